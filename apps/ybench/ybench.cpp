@@ -0,0 +1,417 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_commonio.h>
+#include <yocto/yocto_image.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_shape.h>
+#include <yocto/yocto_trace.h>
+using namespace yocto::math;
+namespace sio = yocto::sceneio;
+namespace img = yocto::image;
+namespace shp = yocto::shape;
+namespace cli = yocto::commonio;
+namespace trc = yocto::trace;
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+using namespace std::string_literals;
+
+#include "ext/filesystem.hpp"
+namespace sfs = ghc::filesystem;
+
+// Timings of a benchmark over its repeats, in seconds. Work is the amount
+// of items processed in each repeat, counted in units, or zero if the
+// benchmark has no natural unit.
+struct bench_result {
+  std::string name    = "";
+  std::string scene   = "";
+  std::string variant = "";
+  int         repeats = 0;
+  double      min     = 0;
+  double      mean    = 0;
+  double      max     = 0;
+  double      work    = 0;
+  std::string unit    = "";
+};
+
+// Run a benchmark repeats times after a warm up run. The function returns
+// the work done in each run, counted in units.
+bench_result run_bench(const std::string& name, const std::string& scene,
+    const std::string& variant, const std::string& unit, int repeats,
+    const std::function<double()>& run) {
+  auto result    = bench_result{name, scene, variant, repeats};
+  result.unit    = unit;
+  result.min     = flt_max;
+  result.work    = run();
+  for (auto repeat = 0; repeat < repeats; repeat++) {
+    auto start   = cli::get_time_();
+    result.work  = run();
+    auto elapsed = (cli::get_time_() - start) / 1e9;
+    result.min   = std::min(result.min, elapsed);
+    result.max   = std::max(result.max, elapsed);
+    result.mean += elapsed / repeats;
+  }
+  cli::print_info(name + " " + scene + " " + variant + ": " +
+                  std::to_string(result.min * 1e3) + " ms");
+  return result;
+}
+
+// Format benchmark results as json
+std::string format_results(const std::vector<bench_result>& results) {
+  auto quote = [](const std::string& str) {
+    auto quoted = "\""s;
+    for (auto c : str) {
+      if (c == '"' || c == '\\') quoted += '\\';
+      quoted += c;
+    }
+    return quoted + "\"";
+  };
+  auto number = [](double value) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.9g", value);
+    return std::string{buffer};
+  };
+  auto json = "{\n  \"benchmarks\": ["s;
+  for (auto& result : results) {
+    json += (&result == results.data() ? "\n" : ",\n");
+    json += "    {\"name\": " + quote(result.name) +
+            ", \"scene\": " + quote(result.scene) +
+            ", \"variant\": " + quote(result.variant) +
+            ", \"repeats\": " + std::to_string(result.repeats) +
+            ", \"min\": " + number(result.min) +
+            ", \"mean\": " + number(result.mean) +
+            ", \"max\": " + number(result.max);
+    if (result.work > 0) {
+      json += ", \"work\": " + number(result.work) +
+              ", \"unit\": " + quote(result.unit) +
+              ", \"rate\": " + number(result.work / result.min);
+    }
+    json += "}";
+  }
+  json += "\n  ]\n}\n";
+  return json;
+}
+
+// construct a scene from io, copying its data so it can be converted again
+void init_scene(trc::scene* scene, const sio::model* ioscene,
+    trc::camera*& camera, const sio::camera* iocamera) {
+  auto camera_map = std::unordered_map<const sio::camera*, trc::camera*>{};
+  camera_map[nullptr] = nullptr;
+  for (auto iocamera : ioscene->cameras) {
+    auto camera = add_camera(scene);
+    set_frame(camera, iocamera->frame);
+    set_lens(camera, iocamera->lens, iocamera->aspect, iocamera->film,
+        iocamera->orthographic);
+    set_focus(camera, iocamera->aperture, iocamera->focus);
+    camera_map[iocamera] = camera;
+  }
+
+  auto texture_map     = std::unordered_map<sio::texture*, trc::texture*>{};
+  texture_map[nullptr] = nullptr;
+  for (auto iotexture : ioscene->textures) {
+    auto texture = add_texture(scene);
+    if (!iotexture->colorf.empty()) {
+      set_texture(texture, iotexture->colorf);
+    } else if (!iotexture->colorb.empty()) {
+      set_texture(texture, iotexture->colorb);
+    } else if (!iotexture->scalarf.empty()) {
+      set_texture(texture, iotexture->scalarf);
+    } else if (!iotexture->scalarb.empty()) {
+      set_texture(texture, iotexture->scalarb);
+    }
+    texture_map[iotexture] = texture;
+  }
+
+  auto material_map     = std::unordered_map<sio::material*, trc::material*>{};
+  material_map[nullptr] = nullptr;
+  for (auto iomaterial : ioscene->materials) {
+    auto material = add_material(scene);
+    set_emission(material, iomaterial->emission,
+        texture_map.at(iomaterial->emission_tex));
+    set_color(
+        material, iomaterial->color, texture_map.at(iomaterial->color_tex));
+    set_specular(material, iomaterial->specular,
+        texture_map.at(iomaterial->specular_tex));
+    set_ior(material, iomaterial->ior);
+    set_metallic(material, iomaterial->metallic,
+        texture_map.at(iomaterial->metallic_tex));
+    set_transmission(material, iomaterial->transmission, iomaterial->thin,
+        iomaterial->trdepth, texture_map.at(iomaterial->transmission_tex));
+    set_translucency(material, iomaterial->translucency, iomaterial->thin,
+        iomaterial->trdepth, texture_map.at(iomaterial->translucency_tex));
+    set_roughness(material, iomaterial->roughness,
+        texture_map.at(iomaterial->roughness_tex));
+    set_opacity(
+        material, iomaterial->opacity, texture_map.at(iomaterial->opacity_tex));
+    set_thin(material, iomaterial->thin);
+    set_normalmap(material, texture_map.at(iomaterial->normal_tex));
+    set_scattering(material, iomaterial->scattering, iomaterial->scanisotropy,
+        texture_map.at(iomaterial->scattering_tex));
+    material_map[iomaterial] = material;
+  }
+
+  auto shape_map     = std::unordered_map<sio::shape*, trc::shape*>{};
+  shape_map[nullptr] = nullptr;
+  for (auto ioshape : ioscene->shapes) {
+    auto shape = add_shape(scene);
+    set_points(shape, ioshape->points);
+    set_lines(shape, ioshape->lines);
+    set_triangles(shape, ioshape->triangles);
+    set_quads(shape, ioshape->quads);
+    set_positions(shape, ioshape->positions);
+    set_normals(shape, ioshape->normals);
+    set_texcoords(shape, ioshape->texcoords);
+    set_colors(shape, ioshape->colors);
+    set_radius(shape, ioshape->radius);
+    set_tangents(shape, ioshape->tangents);
+    shape_map[ioshape] = shape;
+  }
+
+  auto instance_map     = std::unordered_map<sio::instance*, trc::instance*>{};
+  instance_map[nullptr] = nullptr;
+  for (auto ioinstance : ioscene->instances) {
+    auto instance = add_instance(scene);
+    set_frames(instance, ioinstance->frames);
+    instance_map[ioinstance] = instance;
+  }
+
+  for (auto ioobject : ioscene->objects) {
+    auto object = add_object(scene);
+    set_frame(object, ioobject->frame);
+    set_shape(object, shape_map.at(ioobject->shape));
+    set_material(object, material_map.at(ioobject->material));
+    set_instance(object, instance_map.at(ioobject->instance));
+  }
+
+  for (auto ioenvironment : ioscene->environments) {
+    auto environment = add_environment(scene);
+    set_frame(environment, ioenvironment->frame);
+    set_emission(environment, ioenvironment->emission,
+        texture_map.at(ioenvironment->emission_tex));
+  }
+
+  // get camera
+  camera = camera_map.at(iocamera);
+}
+
+// Benchmark loading, saving, bvh building and tracing a test scene
+void bench_scene(std::vector<bench_result>& results,
+    const std::string& filename, const std::string& name,
+    const std::vector<std::string>& formats, const std::string& tmpdir,
+    const trc::trace_params& params, int repeats) {
+  // load scene
+  auto ioerror       = ""s;
+  auto ioscene_guard = std::make_unique<sio::model>();
+  auto ioscene       = ioscene_guard.get();
+  if (!load_scene(filename, ioscene, ioerror)) cli::print_fatal(ioerror);
+
+  // save and reload in each format, skipping unsupported features
+  for (auto& format : formats) {
+    auto outfilename = (sfs::path(tmpdir) / name / (name + "." + format))
+                           .string();
+    for (auto dirname : {"shapes", "subdivs", "textures", "instances"})
+      sfs::create_directories(sfs::path(outfilename).parent_path() / dirname);
+    auto reloaded = std::make_unique<sio::model>();
+    if (!save_scene(outfilename, ioscene, ioerror) ||
+        !load_scene(outfilename, reloaded.get(), ioerror)) {
+      cli::print_info("skipping " + format + ": " + ioerror);
+      continue;
+    }
+    results.push_back(run_bench("save_scene", name, format, "", repeats, [&]() {
+      if (!save_scene(outfilename, ioscene, ioerror))
+        cli::print_fatal(ioerror);
+      return 0.0;
+    }));
+    results.push_back(run_bench("load_scene", name, format, "", repeats, [&]() {
+      auto reloaded = std::make_unique<sio::model>();
+      if (!load_scene(outfilename, reloaded.get(), ioerror))
+        cli::print_fatal(ioerror);
+      return 0.0;
+    }));
+  }
+
+  // convert scene
+  tesselate_subdivs(ioscene);
+  auto scene_guard = std::make_unique<trc::scene>();
+  auto scene       = scene_guard.get();
+  auto camera      = (trc::camera*)nullptr;
+  init_scene(scene, ioscene, camera, get_camera(ioscene));
+  ioscene_guard.reset();
+
+  // build bvhs
+  for (auto type = 0; type < trc::bvh_names.size(); type++) {
+    auto bvh_params = params;
+    bvh_params.bvh  = (trc::bvh_type)type;
+    results.push_back(run_bench(
+        "init_bvh", name, trc::bvh_names[type], "", repeats, [&]() {
+          init_bvh(scene, bvh_params);
+          return 0.0;
+        }));
+  }
+  init_bvh(scene, params);
+  init_lights(scene);
+
+  // trace images, counting rays when statistics are collected
+  for (auto type = 0; type < trc::sampler_names.size(); type++) {
+    auto trace_params    = params;
+    trace_params.sampler = (trc::sampler_type)type;
+    if (scene->lights.empty() && is_sampler_lit(trace_params)) continue;
+    auto rays   = false;
+    auto result = run_bench(
+        "trace_image", name, trc::sampler_names[type], "samples", repeats,
+        [&]() {
+          trc::reset_trace_stats();
+          auto render = trace_image(scene, camera, trace_params);
+          auto stats  = trc::get_trace_stats();
+          rays        = stats.rays > 0;
+          return rays ? (double)stats.rays
+                      : (double)render.count() * trace_params.samples;
+        });
+    if (rays) result.unit = "rays";
+    results.push_back(result);
+  }
+}
+
+// Benchmark image and shape processing on procedural data
+void bench_procedural(std::vector<bench_result>& results, int repeats) {
+  // images
+  auto hdr = img::image<vec4f>{};
+  img::make_sunsky(hdr, {2048, 1024}, pif / 4, 3, true);
+  results.push_back(run_bench(
+      "tonemap_image", "sunsky", "filmic", "pixels", repeats, [&]() {
+        auto ldr = img::tonemap_image(hdr, 0, true);
+        return (double)ldr.count();
+      }));
+  results.push_back(run_bench(
+      "resize_image", "sunsky", "half", "pixels", repeats, [&]() {
+        auto resized = img::resize_image(hdr, hdr.size() / 2);
+        return (double)hdr.count();
+      }));
+
+  // shapes
+  auto quads     = std::vector<vec4i>{};
+  auto positions = std::vector<vec3f>{};
+  auto normals   = std::vector<vec3f>{};
+  auto texcoords = std::vector<vec2f>{};
+  shp::make_sphere(quads, positions, normals, texcoords, 64);
+  for (auto level : {1, 2, 3}) {
+    results.push_back(run_bench("subdivide_catmullclark", "sphere",
+        "level" + std::to_string(level), "quads", repeats, [&]() {
+          auto subdivided = shp::subdivide_catmullclark(
+              quads, positions, level);
+          return (double)subdivided.first.size();
+        }));
+  }
+  auto triangles   = shp::quads_to_triangles(quads);
+  auto adjacencies = shp::face_adjacencies(triangles);
+  results.push_back(run_bench(
+      "make_geodesic_solver", "sphere", "default", "vertices", repeats, [&]() {
+        auto solver = shp::make_geodesic_solver(
+            triangles, adjacencies, positions);
+        return (double)positions.size();
+      }));
+  auto solver = shp::make_geodesic_solver(triangles, adjacencies, positions);
+  results.push_back(run_bench("compute_geodesic_distances", "sphere",
+      "default", "vertices", repeats, [&]() {
+        auto distances = shp::compute_geodesic_distances(solver, {0});
+        return (double)distances.size();
+      }));
+}
+
+int main(int argc, const char* argv[]) {
+  // options
+  auto params        = trc::trace_params{};
+  auto tests         = "tests"s;
+  auto scene_names   = ""s;
+  auto format_names  = "json,obj,pbrt,ybin"s;
+  auto repeats       = 3;
+  auto procedural    = true;
+  auto outfilename   = "bench.json"s;
+  params.resolution  = 256;
+  params.samples     = 4;
+
+  // parse command line
+  auto cli = cli::make_cli("ybench", "Benchmark tracing, bvh, image and io");
+  add_option(cli, "--tests", tests, "Directory of the test scenes.");
+  add_option(cli, "--scenes", scene_names,
+      "Test scenes to run, separated by commas, or all if empty.");
+  add_option(cli, "--formats", format_names,
+      "Scene formats saved and loaded, separated by commas.");
+  add_option(cli, "--repeats,-n", repeats, "Timed runs of each benchmark.");
+  add_option(cli, "--resolution,-r", params.resolution, "Image resolution.");
+  add_option(cli, "--samples,-s", params.samples, "Number of samples.");
+  add_option(cli, "--bounces,-b", params.bounces, "Maximum number of bounces.");
+  add_option(cli, "--procedural/--no-procedural", procedural,
+      "Run image and shape benchmarks on procedural data.");
+  add_option(cli, "--output,-o", outfilename, "Json results filename.");
+  parse_cli(cli, argc, argv);
+
+  // split comma separated lists
+  auto split = [](const std::string& str) {
+    auto values = std::vector<std::string>{};
+    for (auto start = (size_t)0; start < str.size();) {
+      auto end = std::min(str.find(',', start), str.size());
+      if (end > start) values.push_back(str.substr(start, end - start));
+      start = end + 1;
+    }
+    return values;
+  };
+
+  // test scenes are named as their directory, in name order
+  auto scenes = split(scene_names);
+  if (scenes.empty()) {
+    for (auto& entry : sfs::directory_iterator(tests)) {
+      auto name = entry.path().filename().string();
+      if (sfs::exists(entry.path() / (name + ".json")))
+        scenes.push_back(name);
+    }
+    std::sort(scenes.begin(), scenes.end());
+  }
+
+  // run benchmarks
+  auto results = std::vector<bench_result>{};
+  auto tmpdir  = (sfs::temp_directory_path() / "ybench").string();
+  for (auto& name : scenes) {
+    auto filename = (sfs::path(tests) / name / (name + ".json")).string();
+    bench_scene(
+        results, filename, name, split(format_names), tmpdir, params, repeats);
+  }
+  sfs::remove_all(tmpdir);
+  if (procedural) bench_procedural(results, repeats);
+
+  // save results
+  auto ioerror = ""s;
+  if (!cli::save_text(outfilename, format_results(results), ioerror))
+    cli::print_fatal(ioerror);
+
+  // done
+  return 0;
+}
@@ -50,6 +50,9 @@ int main(int argc, const char* argv[]) {
   auto height    = 1.0f;
   auto rotate    = zero3f;
   auto translate = zero3f;
+  auto max_error = 0.0f;
+  auto tile_size = 0;
+  auto skirt     = -1.0f;
   auto info      = false;
   auto output    = "out.ply"s;
   auto filename  = "heightfield.png"s;
@@ -69,16 +72,21 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--scaley,-sy", scale.y, "Scale along y axis");
   add_option(cli, "--scalex,-sx", scale.x, "Scale along x axis");
   add_option(cli, "--scalez,-sz", scale.z, "Scale along z axis");
+  add_option(cli, "--max-error", max_error,
+      "Simplify to triangles within this height error");
+  add_option(cli, "--tile-size", tile_size, "Split in tiles of this size");
+  add_option(cli, "--skirt", skirt, "Tile skirt depth (default 2*max-error)");
   add_option(cli, "--info,-i", info, "print mesh info");
   add_option(cli, "--output,-o", output, "output mesh");
   add_option(cli, "mesh", filename, "input heightfield", true);
   parse_cli(cli, argc, argv);
 
-  // mesh data
-  auto positions = std::vector<vec3f>{};
-  auto normals   = std::vector<vec3f>{};
-  auto texcoords = std::vector<vec2f>{};
-  auto quads     = std::vector<vec4i>{};
+  // mesh data, with one entry per tile
+  auto triangles = std::vector<std::vector<vec3i>>{};
+  auto quads     = std::vector<std::vector<vec4i>>{};
+  auto positions = std::vector<std::vector<vec3f>>{};
+  auto normals   = std::vector<std::vector<vec3f>>{};
+  auto texcoords = std::vector<std::vector<vec2f>>{};
 
   // image data
   auto heightfield = img::image<float>{};
@@ -103,16 +111,37 @@ int main(int argc, const char* argv[]) {
   }
 
   // create heightfield
-  shp::make_heightfield(quads, positions, normals, texcoords,
-      heightfield.size(), heightfield.data_vector());
-  if (!smooth) normals.clear();
+  cli::print_progress("make heightfield", 0, 1);
+  if (tile_size > 0) {
+    if (skirt < 0) skirt = 2 * max_error;
+    shp::make_heightfield_tiles(triangles, positions, normals, texcoords,
+        heightfield.size(), heightfield.data_vector(), max_error, tile_size,
+        skirt);
+    quads.resize(triangles.size());
+  } else if (max_error > 0) {
+    shp::make_heightfield(triangles.emplace_back(), positions.emplace_back(),
+        normals.emplace_back(), texcoords.emplace_back(), heightfield.size(),
+        heightfield.data_vector(), max_error);
+    quads.emplace_back();
+  } else {
+    shp::make_heightfield(quads.emplace_back(), positions.emplace_back(),
+        normals.emplace_back(), texcoords.emplace_back(), heightfield.size(),
+        heightfield.data_vector());
+    triangles.emplace_back();
+  }
+  if (!smooth) {
+    for (auto& tnormals : normals) tnormals.clear();
+  }
+  cli::print_progress("make heightfield", 1, 1);
 
   // print info
   if (info) {
-    cli::print_info("shape stats ------------");
-    auto stats = shp::shape_stats(
-        {}, {}, {}, quads, {}, {}, {}, positions, normals, texcoords, {}, {});
-    for (auto& stat : stats) cli::print_info(stat);
+    for (auto idx = 0; idx < (int)positions.size(); idx++) {
+      cli::print_info("shape stats ------------");
+      auto stats = shp::shape_stats({}, {}, triangles[idx], quads[idx], {},
+          {}, {}, positions[idx], normals[idx], texcoords[idx], {}, {});
+      for (auto& stat : stats) cli::print_info(stat);
+    }
   }
 
   // transform
@@ -123,18 +152,37 @@ int main(int argc, const char* argv[]) {
                  rotation_frame({1, 0, 0}, radians(rotate.x)) *
                  rotation_frame({0, 0, 1}, radians(rotate.z)) *
                  rotation_frame({0, 1, 0}, radians(rotate.y));
-    for (auto& p : positions) p = transform_point(xform, p);
-    for (auto& n : normals)
-      n = transform_normal(xform, n, max(scale) != min(scale));
+    for (auto& tpositions : positions) {
+      for (auto& p : tpositions) p = transform_point(xform, p);
+    }
+    for (auto& tnormals : normals) {
+      for (auto& n : tnormals)
+        n = transform_normal(xform, n, max(scale) != min(scale));
+    }
     cli::print_progress("transform shape", 1, 1);
   }
 
-  // save mesh
-  cli::print_progress("save shape", 0, 1);
-  if (!shp::save_shape(output, {}, {}, {}, quads, positions, normals, texcoords,
-          {}, {}, ioerror))
-    cli::print_fatal(ioerror);
-  cli::print_progress("save shape", 1, 1);
+  // save mesh, numbering tiles as output_<x>_<y>
+  auto num_tiles = (int)positions.size();
+  auto tiles_x   = 1;
+  if (tile_size > 0)
+    tiles_x = max((heightfield.size().x - 1 + tile_size - 1) / tile_size, 1);
+  for (auto idx = 0; idx < num_tiles; idx++) {
+    cli::print_progress("save shape", idx, num_tiles);
+    auto filename = output;
+    if (tile_size > 0) {
+      auto path = sfs::path(output);
+      filename  = (path.parent_path() /
+                  (path.stem().string() + "_" + std::to_string(idx % tiles_x) +
+                      "_" + std::to_string(idx / tiles_x) +
+                      path.extension().string()))
+                     .string();
+    }
+    if (!shp::save_shape(filename, {}, {}, triangles[idx], quads[idx],
+            positions[idx], normals[idx], texcoords[idx], {}, {}, ioerror))
+      cli::print_fatal(ioerror);
+  }
+  cli::print_progress("save shape", num_tiles, num_tiles);
 
   // done
   return 0;
@@ -26,12 +26,18 @@
 // POSSIBILITY OF SUCH DAMAGE.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include <yocto/yocto_common.h>
 #include <yocto/yocto_commonio.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 using namespace yocto::math;
 namespace img = yocto::image;
 namespace cli = yocto::commonio;
+namespace common = yocto::common;
 
 using namespace std::string_literals;
 
@@ -40,85 +46,8 @@ namespace sfs = ghc::filesystem;
 
 namespace yocto::image {
 
-img::image<vec4f> filter_bilateral(const img::image<vec4f>& img,
-    float spatial_sigma, float range_sigma,
-    const std::vector<img::image<vec4f>>& features,
-    const std::vector<float>&             features_sigma) {
-  auto filtered     = img::image{img.size(), zero4f};
-  auto filter_width = (int)ceil(2.57f * spatial_sigma);
-  auto sw           = 1 / (2.0f * spatial_sigma * spatial_sigma);
-  auto rw           = 1 / (2.0f * range_sigma * range_sigma);
-  auto fw           = std::vector<float>();
-  for (auto feature_sigma : features_sigma)
-    fw.push_back(1 / (2.0f * feature_sigma * feature_sigma));
-  for (auto j = 0; j < img.size().y; j++) {
-    for (auto i = 0; i < img.size().x; i++) {
-      auto av = zero4f;
-      auto aw = 0.0f;
-      for (auto fj = -filter_width; fj <= filter_width; fj++) {
-        for (auto fi = -filter_width; fi <= filter_width; fi++) {
-          auto ii = i + fi, jj = j + fj;
-          if (ii < 0 || jj < 0) continue;
-          if (ii >= img.size().x || jj >= img.size().y) continue;
-          auto uv  = vec2f{float(i - ii), float(j - jj)};
-          auto rgb = img[{i, j}] - img[{i, j}];
-          auto w   = (float)math::exp(-dot(uv, uv) * sw) *
-                   (float)math::exp(-dot(rgb, rgb) * rw);
-          for (auto fi = 0; fi < features.size(); fi++) {
-            auto feat = features[fi][{i, j}] - features[fi][{i, j}];
-            w *= math::exp(-dot(feat, feat) * fw[fi]);
-          }
-          av += w * img[{ii, jj}];
-          aw += w;
-        }
-      }
-      filtered[{i, j}] = av / aw;
-    }
-  }
-  return filtered;
-}
-
-img::image<vec4f> filter_bilateral(
-    const img::image<vec4f>& img, float spatial_sigma, float range_sigma) {
-  auto filtered = image{img.size(), zero4f};
-  auto fwidth   = (int)ceil(2.57f * spatial_sigma);
-  auto sw       = 1 / (2.0f * spatial_sigma * spatial_sigma);
-  auto rw       = 1 / (2.0f * range_sigma * range_sigma);
-  for (auto j = 0; j < img.size().y; j++) {
-    for (auto i = 0; i < img.size().x; i++) {
-      auto av = zero4f;
-      auto aw = 0.0f;
-      for (auto fj = -fwidth; fj <= fwidth; fj++) {
-        for (auto fi = -fwidth; fi <= fwidth; fi++) {
-          auto ii = i + fi, jj = j + fj;
-          if (ii < 0 || jj < 0) continue;
-          if (ii >= img.size().x || jj >= img.size().y) continue;
-          auto uv  = vec2f{float(i - ii), float(j - jj)};
-          auto rgb = img[{i, j}] - img[{ii, jj}];
-          auto w   = math::exp(-dot(uv, uv) * sw) *
-                   math::exp(-dot(rgb, rgb) * rw);
-          av += w * img[{ii, jj}];
-          aw += w;
-        }
-      }
-      filtered[{i, j}] = av / aw;
-    }
-  }
-  return filtered;
-}
-
 bool make_image_preset(
     const std::string& type, img::image<vec4f>& img, std::string& error) {
-  auto set_region = [](img::image<vec4f>& img, const img::image<vec4f>& region,
-                        const vec2i& offset) {
-    for (auto j = 0; j < region.size().y; j++) {
-      for (auto i = 0; i < region.size().x; i++) {
-        if (!img.contains({i, j})) continue;
-        img[vec2i{i, j} + offset] = region[{i, j}];
-      }
-    }
-  };
-
   auto size = vec2i{1024, 1024};
   if (type.find("sky") != type.npos) size = {2048, 1024};
   if (type.find("images2") != type.npos) size = {2048, 1024};
@@ -238,125 +167,396 @@ bool make_image_preset(
 
 }  // namespace yocto::image
 
-int main(int argc, const char* argv[]) {
-  // command line parameters
-  auto tonemap_on          = false;
-  auto tonemap_exposure    = 0;
-  auto tonemap_filmic      = false;
-  auto logo                = false;
-  auto resize_width        = 0;
-  auto resize_height       = 0;
-  auto spatial_sigma       = 0.0f;
-  auto range_sigma         = 0.0f;
-  auto alpha_to_color      = false;
-  auto alpha_filename      = ""s;
-  auto coloralpha_filename = ""s;
-  auto diff_filename       = ""s;
-  auto diff_signal         = false;
-  auto diff_threshold      = 0.0f;
-  auto output              = "out.png"s;
-  auto filename            = "img.hdr"s;
-
-  // parse command line
-  auto cli = cli::make_cli("yimgproc", "Transform images");
-  add_option(cli, "--tonemap/--no-tonemap", tonemap_on, "Tonemap image");
-  add_option(cli, "--exposure,-e", tonemap_exposure, "Tonemap exposure");
-  add_option(
-      cli, "--filmic/--no-filmic", tonemap_filmic, "Tonemap uses filmic curve");
-  add_option(cli, "--resize-width", resize_width,
-      "resize size (0 to maintain aspect)");
-  add_option(cli, "--resize-height", resize_height,
-      "resize size (0 to maintain aspect)");
-  add_option(cli, "--spatial-sigma", spatial_sigma, "blur spatial sigma");
-  add_option(cli, "--range-sigma", range_sigma, "bilateral blur range sigma");
-  add_option(
-      cli, "--set-alpha", alpha_filename, "set alpha as this image alpha");
-  add_option(cli, "--set-color-as-alpha", coloralpha_filename,
-      "set alpha as this image color");
-  add_option(cli, "--alpha-to-color/--no-alpha-to-color", alpha_to_color,
-      "Set color as alpha");
-  add_option(cli, "--logo/--no-logo", logo, "Add logo");
-  add_option(cli, "--diff", diff_filename, "compute the diff between images");
-  add_option(cli, "--diff-signal", diff_signal, "signal a diff as error");
-  add_option(cli, "--diff-threshold,", diff_threshold, "diff threshold");
-  add_option(cli, "--output,-o", output, "output image filename");
-  add_option(cli, "filename", filename, "input image filename", true);
-  parse_cli(cli, argc, argv);
-
-  // error std::string buffer
-  auto error = ""s;
+// Image processing options
+struct imageproc_options {
+  bool                tonemap_on          = false;
+  int                 tonemap_exposure    = 0;
+  bool                tonemap_filmic      = false;
+  bool                logo                = false;
+  int                 resize_width        = 0;
+  int                 resize_height       = 0;
+  img::resize_filter  resize_filter       = img::resize_filter::mitchell;
+  float               spatial_sigma       = 0.0f;
+  float               range_sigma         = 0.0f;
+  bool                alpha_to_color      = false;
+  std::string         alpha_filename      = "";
+  std::string         coloralpha_filename = "";
+  std::string         diff_filename       = "";
+  bool                diff_signal         = false;
+  float               diff_threshold      = 0.0f;
+  bool                diff_stats          = false;
+  img::compare_metric diff_metric         = img::compare_metric::max;
+  img::block_format   block_format        = img::block_format::bc1;
+};
 
+// Process an image, loading it from filename and saving it to output.
+// Sets differs if the diff is signalled and above threshold.
+bool process_image(const std::string& filename, const std::string& output,
+    const imageproc_options& options, bool& differs, std::string& error) {
   // load
   auto ext      = sfs::path(filename).extension().string();
   auto basename = sfs::path(filename).stem().string();
-  auto ioerror  = ""s;
   auto img      = img::image<vec4f>{};
   if (ext == ".ypreset") {
-    if (!make_image_preset(basename, img, ioerror)) cli::print_fatal(ioerror);
+    if (!make_image_preset(basename, img, error)) return false;
   } else {
-    if (!load_image(filename, img, ioerror)) cli::print_fatal(ioerror);
+    if (!load_image(filename, img, error)) return false;
+  }
+
+  // compare with the diff image, without building the difference image
+  if (options.diff_filename != "" && options.diff_stats) {
+    auto reference = img::image<vec4f>{};
+    if (!load_image(options.diff_filename, reference, error)) return false;
+    if (img.size() != reference.size()) {
+      error = filename + ": image sizes are different";
+      return false;
+    }
+    auto threshold = options.diff_signal ? options.diff_threshold : flt_max;
+    auto value     = compare_images(
+        img, reference, options.diff_metric, threshold);
+    cli::print_info(filename + ": " +
+                    img::compare_metric_names[(int)options.diff_metric] +
+                    " " + std::to_string(value));
+    differs = options.diff_signal && value > options.diff_threshold;
+    return true;
   }
 
+  // per-pixel operations are fused in a single pass over the image
+  auto pipeline = img::image_pipeline{};
+
   // set alpha
-  if (alpha_filename != "") {
-    auto alpha = img::image<vec4f>{};
-    if (!load_image(alpha_filename, alpha, ioerror)) cli::print_fatal(ioerror);
-    if (img.size() != alpha.size()) cli::print_fatal("bad image size");
-    for (auto j = 0; j < img.size().y; j++)
-      for (auto i = 0; i < img.size().x; i++) img[{i, j}].w = alpha[{i, j}].w;
+  auto alpha = img::image<vec4f>{};
+  if (options.alpha_filename != "") {
+    if (!load_image(options.alpha_filename, alpha, error)) return false;
+    if (img.size() != alpha.size()) {
+      error = filename + ": bad image size";
+      return false;
+    }
+    add_operation(pipeline, [&alpha](vec4f* pixels, int count,
+                                const vec2i& ij) {
+      auto values = &alpha[ij];
+      for (auto i = 0; i < count; i++) pixels[i].w = values[i].w;
+    });
   }
 
   // set alpha
-  if (coloralpha_filename != "") {
-    auto alpha = img::image<vec4f>{};
-    if (!load_image(coloralpha_filename, alpha, ioerror))
-      cli::print_fatal(ioerror);
-    if (img.size() != alpha.size()) cli::print_fatal("bad image size");
-    for (auto j = 0; j < img.size().y; j++)
-      for (auto i = 0; i < img.size().x; i++)
-        img[{i, j}].w = mean(xyz(alpha[{i, j}]));
+  auto coloralpha = img::image<vec4f>{};
+  if (options.coloralpha_filename != "") {
+    if (!load_image(options.coloralpha_filename, coloralpha, error))
+      return false;
+    if (img.size() != coloralpha.size()) {
+      error = filename + ": bad image size";
+      return false;
+    }
+    add_operation(pipeline, [&coloralpha](vec4f* pixels, int count,
+                                const vec2i& ij) {
+      auto values = &coloralpha[ij];
+      for (auto i = 0; i < count; i++) pixels[i].w = mean(xyz(values[i]));
+    });
   }
 
   // set color from alpha
-  if (alpha_to_color) {
-    for (auto& c : img) xyz(c) = vec3f{c.w};
+  if (options.alpha_to_color) {
+    add_operation(pipeline, [](vec4f* pixels, int count, const vec2i&) {
+      for (auto i = 0; i < count; i++) xyz(pixels[i]) = vec3f{pixels[i].w};
+    });
   }
 
   // diff
-  if (diff_filename != "") {
-    auto diff = img::image<vec4f>{};
-    if (!load_image(diff_filename, diff, ioerror)) cli::print_fatal(ioerror);
-    if (img.size() != diff.size())
-      cli::print_fatal("image sizes are different");
-    img = image_difference(img, diff, true);
+  auto diff = img::image<vec4f>{};
+  if (options.diff_filename != "") {
+    if (!load_image(options.diff_filename, diff, error)) return false;
+    if (img.size() != diff.size()) {
+      error = filename + ": image sizes are different";
+      return false;
+    }
+    add_operation(pipeline, [&diff](vec4f* pixels, int count,
+                                const vec2i& ij) {
+      auto values = &diff[ij];
+      for (auto i = 0; i < count; i++) {
+        auto d    = max(abs(pixels[i] - values[i]));
+        pixels[i] = {d, d, d, 1};
+      }
+    });
+  }
+
+  // resize and blur need the whole image, so flush the pending operations
+  auto resize_on = options.resize_width != 0 || options.resize_height != 0;
+  if ((resize_on || options.spatial_sigma) && !pipeline.operations.empty()) {
+    img      = apply_pipeline(img, pipeline);
+    pipeline = {};
   }
 
   // resize
-  if (resize_width != 0 || resize_height != 0) {
-    img = resize_image(img, {resize_width, resize_height});
+  if (resize_on) {
+    img = resize_image(img, {options.resize_width, options.resize_height},
+        options.resize_filter);
   }
 
-  // bilateral
-  if (spatial_sigma && range_sigma) {
-    img = filter_bilateral(img, spatial_sigma, range_sigma, {}, {});
+  // blur
+  if (options.spatial_sigma && options.range_sigma) {
+    img = filter_bilateral(img, options.spatial_sigma, options.range_sigma);
+  } else if (options.spatial_sigma) {
+    img = filter_gaussian(img, options.spatial_sigma);
   }
 
   // hdr correction
-  if (tonemap_on) {
-    img = tonemap_image(img, tonemap_exposure, tonemap_filmic, false);
+  if (options.tonemap_on) {
+    add_tonemap(
+        pipeline, options.tonemap_exposure, options.tonemap_filmic, false);
   }
 
-  // save
-  if (!save_image(output, logo ? add_logo(img) : img, ioerror))
-    cli::print_fatal(ioerror);
-
   // check diff
-  if (diff_filename != "" && diff_signal) {
-    for (auto& c : img) {
-      if (max(xyz(c)) > diff_threshold)
-        cli::print_fatal("image content differs");
+  auto found = std::atomic<bool>{false};
+  if (options.diff_filename != "" && options.diff_signal) {
+    add_operation(pipeline, [&found, threshold = options.diff_threshold](
+                                vec4f* pixels, int count, const vec2i&) {
+      for (auto i = 0; i < count; i++) {
+        if (max(xyz(pixels[i])) > threshold) found = true;
+      }
+    });
+  }
+
+  // save, converting ldr images to bytes in the same pass
+  auto logo = options.logo;
+  if (img::is_hdr_filename(output)) {
+    auto result = apply_pipeline(img, pipeline);
+    if (!save_image(output, logo ? add_logo(result) : result, error))
+      return false;
+  } else if (sfs::path(output).extension() == ".dds") {
+    add_rgb_to_srgb(pipeline);
+    auto result = apply_pipelineb(img, pipeline);
+    if (logo) result = add_logo(result);
+    auto compressed = img::block_image{};
+    if (options.block_format == img::block_format::bc1) {
+      auto colors = img::image<vec3b>{result.size()};
+      for (auto i = (size_t)0; i < colors.count(); i++)
+        colors[i] = xyz(result[i]);
+      compressed = img::compress_image(colors);
+    } else {
+      auto scalars = img::image<byte>{result.size()};
+      for (auto i = (size_t)0; i < scalars.count(); i++)
+        scalars[i] = result[i].x;
+      compressed = img::compress_image(scalars);
+    }
+    if (!save_image(output, compressed, error)) return false;
+  } else {
+    add_rgb_to_srgb(pipeline);
+    auto result = apply_pipelineb(img, pipeline);
+    if (!save_image(output, logo ? add_logo(result) : result, error))
+      return false;
+  }
+
+  // done
+  differs = found;
+  return true;
+}
+
+// Check whether a filename has an extension we can load
+bool is_image_filename(const sfs::path& filename) {
+  auto ext = filename.extension().string();
+  for (auto& c : ext) c = (char)tolower(c);
+  return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".tga" ||
+         ext == ".bmp" || ext == ".hdr" || ext == ".exr" || ext == ".pfm" ||
+         ext == ".ypreset";
+}
+
+// Match a name against a pattern with `*` and `?` wildcards
+bool match_pattern(const std::string& name, const std::string& pattern) {
+  auto n = (size_t)0, p = (size_t)0;
+  auto star = std::string::npos, mark = (size_t)0;
+  while (n < name.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+      n++;
+      p++;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      mark = n;
+    } else if (star != std::string::npos) {
+      p = star + 1;
+      n = ++mark;
+    } else {
+      return false;
     }
   }
+  while (p < pattern.size() && pattern[p] == '*') p++;
+  return p == pattern.size();
+}
+
+// Expand directories and globs in the last path component to image files,
+// sorted by name. Plain filenames are kept as is.
+bool expand_filenames(const std::vector<std::string>& patterns,
+    std::vector<std::string>& filenames, std::string& error) {
+  for (auto& pattern : patterns) {
+    auto path     = sfs::path(pattern);
+    auto dirname  = path;
+    auto wildcard = "*"s;
+    if (!sfs::is_directory(path)) {
+      auto name = path.filename().string();
+      if (name.find_first_of("*?") == name.npos) {
+        filenames.push_back(pattern);
+        continue;
+      }
+      dirname  = path.has_parent_path() ? path.parent_path() : ".";
+      wildcard = name;
+    }
+    auto ec      = std::error_code{};
+    auto entries = std::vector<std::string>{};
+    for (auto& entry : sfs::directory_iterator(dirname, ec)) {
+      auto& filename = entry.path();
+      if (!entry.is_regular_file() || !is_image_filename(filename)) continue;
+      if (!match_pattern(filename.filename().string(), wildcard)) continue;
+      entries.push_back(filename.string());
+    }
+    if (ec) {
+      error = dirname.string() + ": cannot read directory";
+      return false;
+    }
+    std::sort(entries.begin(), entries.end());
+    filenames.insert(filenames.end(), entries.begin(), entries.end());
+  }
+  return true;
+}
+
+// Make the output filename by replacing {name} with the input name
+std::string make_output_filename(
+    const std::string& pattern, const std::string& filename) {
+  auto output = pattern;
+  auto name   = sfs::path(filename).stem().string();
+  for (auto pos = output.find("{name}"); pos != output.npos;
+       pos      = output.find("{name}", pos + name.size())) {
+    output.replace(pos, 6, name);
+  }
+  return output;
+}
+
+// Process many images, with jobs images in flight at once to bound memory.
+// While one image is loaded or saved, others are processed, so i/o and
+// compute overlap. Errors are reported for each image.
+bool process_images(const std::vector<std::string>& filenames,
+    const std::string& output, const imageproc_options& options, int jobs,
+    std::string& error) {
+  // prepare outputs
+  auto outputs = std::vector<std::string>{};
+  for (auto& filename : filenames) {
+    outputs.push_back(make_output_filename(output, filename));
+    auto dirname = sfs::path(outputs.back()).parent_path();
+    auto ec      = std::error_code{};
+    if (!dirname.empty()) sfs::create_directories(dirname, ec);
+  }
+
+  // run jobs pulling images from a shared index
+  auto next   = std::atomic<int>{0};
+  auto failed = std::atomic<int>{0};
+  auto count  = 0;
+  auto mutex  = std::mutex{};
+  auto num    = (int)filenames.size();
+  cli::print_progress("process images", 0, num);
+  common::parallel_for(std::clamp(jobs, 1, num), [&](int) {
+    for (auto idx = next++; idx < num; idx = next++) {
+      auto ioptions          = options;
+      ioptions.diff_filename = make_output_filename(
+          options.diff_filename, filenames[idx]);
+      auto differs = false;
+      auto ierror  = ""s;
+      auto ok      = process_image(
+          filenames[idx], outputs[idx], ioptions, differs, ierror);
+      if (ok && differs) ierror = filenames[idx] + ": image content differs";
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!ok || differs) {
+        failed += 1;
+        cli::print_info("error: " + ierror);
+      }
+      cli::print_progress("process images", ++count, num);
+    }
+  });
+
+  // check errors
+  if (failed) {
+    error = std::to_string(failed.load()) + " of " + std::to_string(num) +
+            " images failed";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, const char* argv[]) {
+  // command line parameters
+  auto options   = imageproc_options{};
+  auto jobs      = 4;
+  auto output    = "out.png"s;
+  auto filenames = std::vector<std::string>{};
+
+  // parse command line
+  auto cli = cli::make_cli("yimgproc", "Transform images");
+  add_option(
+      cli, "--tonemap/--no-tonemap", options.tonemap_on, "Tonemap image");
+  add_option(
+      cli, "--exposure,-e", options.tonemap_exposure, "Tonemap exposure");
+  add_option(cli, "--filmic/--no-filmic", options.tonemap_filmic,
+      "Tonemap uses filmic curve");
+  add_option(cli, "--resize-width", options.resize_width,
+      "resize size (0 to maintain aspect)");
+  add_option(cli, "--resize-height", options.resize_height,
+      "resize size (0 to maintain aspect)");
+  add_option(cli, "--resize-filter", options.resize_filter, "resize filter",
+      img::resize_filter_names);
+  add_option(
+      cli, "--spatial-sigma", options.spatial_sigma, "blur spatial sigma");
+  add_option(
+      cli, "--range-sigma", options.range_sigma, "bilateral blur range sigma");
+  add_option(cli, "--set-alpha", options.alpha_filename,
+      "set alpha as this image alpha");
+  add_option(cli, "--set-color-as-alpha", options.coloralpha_filename,
+      "set alpha as this image color");
+  add_option(cli, "--alpha-to-color/--no-alpha-to-color",
+      options.alpha_to_color, "Set color as alpha");
+  add_option(cli, "--logo/--no-logo", options.logo, "Add logo");
+  add_option(cli, "--diff", options.diff_filename,
+      "compute the diff between images, with {name} replaced in batches");
+  add_option(
+      cli, "--diff-signal", options.diff_signal, "signal a diff as error");
+  add_option(
+      cli, "--diff-threshold,", options.diff_threshold, "diff threshold");
+  add_option(cli, "--diff-stats/--no-diff-stats", options.diff_stats,
+      "only print the diff metric, without saving an image");
+  add_option(cli, "--diff-metric", options.diff_metric,
+      "diff metric for diff stats", img::compare_metric_names);
+  add_option(cli, "--block-format", options.block_format,
+      "block compression format for dds outputs", img::block_format_names);
+  add_option(cli, "--jobs,-j", jobs, "images processed at once in batches");
+  add_option(cli, "--output,-o", output,
+      "output image filename, with {name} replaced by the input name");
+  add_option(cli, "filenames", filenames,
+      "input image filenames, directories or globs", true);
+  parse_cli(cli, argc, argv);
+
+  // error std::string buffer
+  auto error = ""s;
+
+  // batch mode for directories, globs or many images
+  auto batch = filenames.size() > 1 ||
+               output.find("{name}") != output.npos ||
+               sfs::is_directory(filenames.front()) ||
+               filenames.front().find_first_of("*?") != std::string::npos;
+  if (batch) {
+    if (output.find("{name}") == output.npos && !options.diff_stats)
+      cli::print_fatal("batch output needs a {name} pattern");
+    auto expanded = std::vector<std::string>{};
+    if (!expand_filenames(filenames, expanded, error)) cli::print_fatal(error);
+    if (expanded.empty()) cli::print_fatal("no images found");
+    if (!process_images(expanded, output, options, jobs, error))
+      cli::print_fatal(error);
+    return 0;
+  }
+
+  // process a single image
+  auto differs = false;
+  if (!process_image(filenames.front(), output, options, differs, error))
+    cli::print_fatal(error);
+
+  // check diff
+  if (differs) cli::print_fatal("image content differs");
 
   // done
   return 0;
@@ -35,6 +35,7 @@ namespace cli = yocto::commonio;
 namespace gui = yocto::gui;
 
 #include <atomic>
+#include <cstdio>
 #include <deque>
 #include <future>
 
@@ -48,15 +49,29 @@ struct image_stats {
   std::vector<vec3f> histogram = {};
 };
 
+// Mip pyramid of square tiles, stored in a temporary file while the image is
+// streamed from disk, so that large images are viewed loading only the tiles
+// that are drawn. Tiles are stored padded to the full tile size.
+struct image_tiles {
+  std::string           filename  = "";
+  vec2i                 size      = {0, 0};
+  int                   tile_size = 256;
+  std::vector<uint64_t> offsets   = {};  // first tile of each level
+};
+
 struct app_state {
   // original data
   std::string name     = "";
   std::string filename = "";
   std::string outname  = "";
 
-  // image data
-  img::image<vec4f> source  = {};
-  img::image<vec4f> display = {};
+  // image data, tonemapped on the GPU for display
+  img::image<vec4f> source = {};
+
+  // tiled image data, with its coarsest level used for stats
+  bool              tiled   = false;
+  image_tiles       tiles   = {};
+  img::image<vec4f> preview = {};
 
   // image stats
   image_stats source_stats  = {};
@@ -70,6 +85,7 @@ struct app_state {
 
   // viewing properties
   gui::image*       glimage   = new gui::image{};
+  gui::tiled_image* gltiled   = new gui::tiled_image{};
   gui::image_params glparams  = {};
   bool              glupdated = true;
 
@@ -83,6 +99,11 @@ struct app_state {
   // cleanup
   ~app_state() {
     if (glimage) delete glimage;
+    if (gltiled) delete gltiled;
+    if (!tiles.filename.empty()) {
+      auto ec = std::error_code{};
+      sfs::remove(tiles.filename, ec);
+    }
   }
 };
 
@@ -94,6 +115,7 @@ struct app_states {
   std::deque<app_state*>  loading  = {};
 
   // default options
+  bool                   tiled    = false;
   float                  exposure = 0;
   bool                   filmic   = false;
   img::colorgrade_params params   = {};
@@ -125,15 +147,211 @@ void compute_stats(
   stats.average /= num_pixels;
 }
 
+// seek to a tile offset, that can exceed 2GB
+bool seek_tiles(FILE* fs, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(fs, (int64_t)offset, SEEK_SET) == 0;
+#else
+  return fseeko(fs, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// offset of a tile in the tiles file
+uint64_t get_tile_offset(
+    const image_tiles& tiles, int level, const vec2i& tile) {
+  auto ntiles = (gui::get_tiled_size(tiles.size, level) + tiles.tile_size - 1) /
+                tiles.tile_size;
+  auto index  = tiles.offsets[level] + (uint64_t)tile.y * ntiles.x + tile.x;
+  return index * tiles.tile_size * tiles.tile_size * sizeof(vec4f);
+}
+
+// streaming state of a pyramid level, with a band of tile rows and the even
+// row waiting to be averaged with the next one
+struct tiles_level {
+  vec2i              size = {0, 0};
+  img::image<vec4f>  band = {};
+  std::vector<vec4f> even = {};
+};
+
+// write a band of tiles of a level
+bool write_tiles_band(FILE* fs, const image_tiles& tiles, int level,
+    const img::image<vec4f>& band, int row) {
+  auto tsize = tiles.tile_size;
+  if (!seek_tiles(fs, get_tile_offset(tiles, level, {0, row}))) return false;
+  auto tile = img::image<vec4f>{{tsize, tsize}};
+  for (auto i = 0; i < band.size().x / tsize; i++) {
+    for (auto j = 0; j < tsize; j++) {
+      std::copy(&band[{i * tsize, j}], &band[{i * tsize, j}] + tsize,
+          &tile[{0, j}]);
+    }
+    if (fwrite(tile.data(), sizeof(vec4f), tile.count(), fs) != tile.count())
+      return false;
+  }
+  return true;
+}
+
+// add a row to a level, writing its tiles when a band is complete and
+// passing the downsampled rows to the next level
+bool push_tiles_row(FILE* fs, const image_tiles& tiles,
+    std::vector<tiles_level>& levels, int level, int row,
+    const vec4f* pixels) {
+  auto& state = levels[level];
+  auto  tsize = tiles.tile_size;
+  std::copy(pixels, pixels + state.size.x, &state.band[{0, row % tsize}]);
+  if (row % tsize == tsize - 1 || row == state.size.y - 1) {
+    if (!write_tiles_band(fs, tiles, level, state.band, row / tsize))
+      return false;
+  }
+  if (level + 1 == (int)levels.size()) return true;
+  if (row % 2 == 0) {
+    state.even.assign(pixels, pixels + state.size.x);
+    if (row != state.size.y - 1) return true;
+  }
+  // average 2x2 pixels, repeating the last column and row when odd
+  auto& next = levels[level + 1];
+  auto  half = std::vector<vec4f>(next.size.x);
+  for (auto i = 0; i < next.size.x; i++) {
+    auto i0 = 2 * i, i1 = std::min(2 * i + 1, state.size.x - 1);
+    half[i] = (state.even[i0] + state.even[i1] + pixels[i0] + pixels[i1]) / 4;
+  }
+  return push_tiles_row(fs, tiles, levels, level + 1, row / 2, half.data());
+}
+
+// build the tiles of an image, streaming it in bands of tile rows
+bool make_image_tiles(image_tiles& tiles, const std::string& filename,
+    const std::string& tilename, std::string& error) {
+  auto fs = fopen(tilename.c_str(), "wb");
+  if (!fs) {
+    error = tilename + ": file not found";
+    return false;
+  }
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  tiles.filename = tilename;
+
+  auto levels = std::vector<tiles_level>{};
+  auto ok     = true;
+  auto reader = [&](const vec2i& size, int row,
+                    const img::image_view<const vec4f>& block) {
+    if (levels.empty()) {
+      tiles.size = size;
+      tiles.offsets.clear();
+      auto tsize = tiles.tile_size;
+      auto count = (uint64_t)0;
+      for (auto level = 0; level < gui::get_tiled_levels(size, tsize);
+           level++) {
+        auto& state  = levels.emplace_back();
+        state.size   = gui::get_tiled_size(size, level);
+        auto ntiles  = (state.size + tsize - 1) / tsize;
+        state.band   = img::image<vec4f>{{ntiles.x * tsize, tsize}};
+        tiles.offsets.push_back(count);
+        count += (uint64_t)ntiles.x * (uint64_t)ntiles.y;
+      }
+    }
+    for (auto j = 0; j < block.size().y && ok; j++) {
+      ok = push_tiles_row(fs, tiles, levels, 0, row + j, &block[{0, j}]);
+    }
+  };
+  if (!img::load_image(filename, error, tiles.tile_size, reader)) return false;
+  if (!ok) {
+    error = tilename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+// read a tile, cropped to the level size
+bool read_image_tile(const image_tiles& tiles, int level, const vec2i& tile,
+    img::image<vec4f>& pixels) {
+  auto fs = fopen(tiles.filename.c_str(), "rb");
+  if (!fs) return false;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto tsize    = tiles.tile_size;
+  auto padded   = img::image<vec4f>{{tsize, tsize}};
+  if (!seek_tiles(fs, get_tile_offset(tiles, level, tile))) return false;
+  if (fread(padded.data(), sizeof(vec4f), padded.count(), fs) !=
+      padded.count())
+    return false;
+  auto size = min(gui::get_tiled_size(tiles.size, level) - tile * tsize,
+      vec2i{tsize, tsize});
+  pixels.resize(size);
+  for (auto j = 0; j < size.y; j++) {
+    std::copy(&padded[{0, j}], &padded[{0, j}] + size.x, &pixels[{0, j}]);
+  }
+  return true;
+}
+
+// read a single pixel of the full resolution image
+vec4f read_image_pixel(const image_tiles& tiles, const vec2i& ij) {
+  auto fs = fopen(tiles.filename.c_str(), "rb");
+  if (!fs) return zero4f;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto tsize    = tiles.tile_size;
+  auto offset   = get_tile_offset(tiles, 0, ij / tsize) +
+                ((ij.y % tsize) * tsize + ij.x % tsize) * sizeof(vec4f);
+  auto pixel = zero4f;
+  if (!seek_tiles(fs, offset)) return zero4f;
+  if (fread(&pixel, sizeof(vec4f), 1, fs) != 1) return zero4f;
+  return pixel;
+}
+
+// tonemap or colorgrade a pixel, as done on the GPU
+vec4f get_display(app_state* app, const vec4f& pixel) {
+  return app->colorgrade ? colorgrade(pixel, true, app->params)
+                         : tonemap(pixel, app->exposure, app->filmic);
+}
+
+// full resolution display image, computed only when saving
+img::image<vec4f> get_display(app_state* app) {
+  return app->colorgrade ? colorgrade_image(app->source, true, app->params)
+                         : tonemap_image(app->source, app->exposure,
+                               app->filmic);
+}
+
+// save the display image, streaming the tiles of tiled images
+bool save_display(app_state* app, std::string& error) {
+  if (!app->tiled) return save_image(app->outname, get_display(app), error);
+  auto& tiles  = app->tiles;
+  auto  writer = [app, &tiles](int row, const img::image_view<vec4f>& block) {
+    auto pixels = img::image<vec4f>{};
+    for (auto i = 0; i * tiles.tile_size < tiles.size.x; i++) {
+      if (!read_image_tile(tiles, 0, {i, row / tiles.tile_size}, pixels))
+        continue;
+      for (auto j = 0; j < min(pixels.size().y, block.size().y); j++) {
+        for (auto ii = 0; ii < pixels.size().x; ii++) {
+          block[{i * tiles.tile_size + ii, j}] = get_display(
+              app, pixels[{ii, j}]);
+        }
+      }
+    }
+  };
+  return img::save_image(
+      app->outname, tiles.size, error, tiles.tile_size, writer);
+}
+
+// image size, for both full and tiled images
+vec2i get_size(app_state* app) {
+  return app->tiled ? app->tiles.size : app->source.size();
+}
+
 void update_display(app_state* app) {
-  if (app->display.size() != app->source.size()) app->display = app->source;
-  if (app->colorgrade) {
-    colorgrade_image_mt(app->display, app->source, true, app->params);
-  } else {
-    tonemap_image_mt(app->display, app->source, app->exposure, app->filmic);
+  app->glparams.tonemap    = true;
+  app->glparams.exposure   = app->exposure;
+  app->glparams.filmic     = app->filmic;
+  app->glparams.colorgrade = app->colorgrade;
+  app->glparams.grading    = app->params;
+
+  // display stats are estimated on a subset of pixels to keep edits fast
+  auto& source  = app->tiled ? app->preview : app->source;
+  auto  size    = source.size();
+  auto  stride  = max(1, (int)sqrt(source.count() / 262144.0));
+  auto  samples = img::image<vec4f>{
+      {(size.x + stride - 1) / stride, (size.y + stride - 1) / stride}};
+  for (auto j = 0; j < samples.size().y; j++) {
+    for (auto i = 0; i < samples.size().x; i++) {
+      samples[{i, j}] = get_display(app, source[{i * stride, j * stride}]);
+    }
   }
-  compute_stats(app->display_stats, app->display, false);
-  app->glupdated = true;
+  compute_stats(app->display_stats, samples, false);
 }
 
 // add a new image
@@ -145,17 +363,30 @@ void load_image_async(app_states* apps, const std::string& filename) {
   app->exposure = apps->exposure;
   app->filmic   = apps->filmic;
   app->params   = apps->params;
+  app->tiled    = apps->tiled;
   app->status   = "loading";
-  app->loader   = std::async(std::launch::async, [app]() {
+  app->loader   = std::async(std::launch::async, [app,
+                                                index = apps->states.size()]() {
+    if (app->tiled) {
+      // tiles are kept in a temporary file and stats use the coarsest level
+      auto tilename = sfs::temp_directory_path() /
+                      (sfs::path(app->filename).stem().string() + "." +
+                          std::to_string(index) + ".tiles");
+      if (!make_image_tiles(app->tiles, app->filename, tilename.string(),
+              app->loader_error))
+        return;
+      if (!read_image_tile(app->tiles, (int)app->tiles.offsets.size() - 1,
+              {0, 0}, app->preview)) {
+        app->loader_error = tilename.string() + ": read error";
+        return;
+      }
+      compute_stats(app->source_stats, app->preview,
+          img::is_hdr_filename(app->filename));
+      return;
+    }
     if (!load_image(app->filename, app->source, app->loader_error)) return;
     compute_stats(
         app->source_stats, app->source, img::is_hdr_filename(app->filename));
-    if (app->colorgrade) {
-      app->display = colorgrade_image(app->display, true, app->params);
-    } else {
-      app->display = tonemap_image(app->source, app->exposure, app->filmic);
-    }
-    compute_stats(app->display_stats, app->display, false);
   });
   apps->loading.push_back(app);
   if (!apps->selected) apps->selected = apps->states.front();
@@ -175,7 +406,7 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
           "*.png;*.jpg;*.tga;*.bmp;*.hdr;*.exr")) {
     auto app     = apps->selected;
     app->outname = save_path;
-    save_image(app->outname, app->display, app->error);
+    save_display(app, app->error);
     save_path = "";
   }
   continue_line(win);
@@ -236,19 +467,19 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
     draw_label(win, "image", sfs::path(app->filename).filename());
     draw_label(win, "filename", app->filename);
     draw_label(win, "outname", app->outname);
+    auto size = get_size(app);
     draw_label(win, "image",
-        std::to_string(app->source.size().x) + " x " +
-            std::to_string(app->source.size().y));
+        std::to_string(size.x) + " x " + std::to_string(size.y));
     draw_slider(win, "zoom", app->glparams.scale, 0.1, 10);
     draw_checkbox(win, "fit", app->glparams.fit);
     auto ij = get_image_coords(input.mouse_pos, app->glparams.center,
-        app->glparams.scale, app->source.size());
+        app->glparams.scale, size);
     draw_dragger(win, "mouse", ij);
     auto img_pixel = zero4f, display_pixel = zero4f;
-    if (ij.x >= 0 && ij.x < app->source.size().x && ij.y >= 0 &&
-        ij.y < app->source.size().y) {
-      img_pixel     = app->source[{ij.x, ij.y}];
-      display_pixel = app->display[{ij.x, ij.y}];
+    if (ij.x >= 0 && ij.x < size.x && ij.y >= 0 && ij.y < size.y) {
+      img_pixel     = app->tiled ? read_image_pixel(app->tiles, ij)
+                                 : app->source[{ij.x, ij.y}];
+      display_pixel = get_display(app, img_pixel);
     }
     draw_coloredit(win, "image", img_pixel);
     draw_dragger(win, "display", display_pixel);
@@ -269,12 +500,24 @@ void draw(gui::window* win, app_states* apps, const gui::input& input) {
   auto app                  = apps->selected;
   app->glparams.window      = input.window_size;
   app->glparams.framebuffer = input.framebuffer_viewport;
+  if (app->tiled) {
+    if (!is_initialized(app->gltiled)) {
+      init_tiled_image(app->gltiled, app->tiles.size, app->tiles.tile_size,
+          [app](int level, const vec2i& tile, img::image<vec4f>& pixels) {
+            read_image_tile(app->tiles, level, tile, pixels);
+          });
+    }
+    update_imview(app->glparams.center, app->glparams.scale, app->tiles.size,
+        app->glparams.window, app->glparams.fit);
+    draw_tiled_image(app->gltiled, app->glparams);
+    return;
+  }
   if (!is_initialized(app->glimage)) init_image(app->glimage);
   if (app->glupdated) {
-    set_image(app->glimage, app->display, false, false);
+    set_image(app->glimage, app->source, false, false, true);
     app->glupdated = false;
   }
-  update_imview(app->glparams.center, app->glparams.scale, app->display.size(),
+  update_imview(app->glparams.center, app->glparams.scale, app->source.size(),
       app->glparams.window, app->glparams.fit);
   draw_image(app->glimage, app->glparams);
 }
@@ -309,6 +552,7 @@ int main(int argc, const char* argv[]) {
 
   // command line options
   auto cli = cli::make_cli("yimgview", "view images");
+  add_option(cli, "--tiled", apps->tiled, "view images as tiled pyramids");
   add_option(cli, "images", filenames, "image filenames", true);
   parse_cli(cli, argc, argv);
 
@@ -318,7 +562,10 @@ int main(int argc, const char* argv[]) {
   // callbacks
   auto callbacks     = gui::ui_callbacks{};
   callbacks.clear_cb = [apps](gui::window* win, const gui::input& input) {
-    for (auto app : apps->states) clear_image(app->glimage);
+    for (auto app : apps->states) {
+      clear_image(app->glimage);
+      clear_tiled_image(app->gltiled);
+    }
   };
   callbacks.update_cb = [apps](gui::window* win, const gui::input& input) {
     update(win, apps);
@@ -45,8 +45,7 @@ struct app_state {
   // image data
   img::image<vec4f> source = {};
 
-  // diplay data
-  img::image<vec4f>      display    = {};
+  // diplay data, tonemapped on the GPU
   float                  exposure   = 0;
   bool                   filmic     = false;
   img::colorgrade_params params     = {};
@@ -62,12 +61,17 @@ struct app_state {
 };
 
 void update_display(app_state* app) {
-  if (app->display.size() != app->source.size()) app->display = app->source;
-  if (app->colorgrade) {
-    colorgrade_image_mt(app->display, app->source, true, app->params);
-  } else {
-    tonemap_image_mt(app->display, app->source, app->exposure, app->filmic);
-  }
+  app->glparams.tonemap    = true;
+  app->glparams.exposure   = app->exposure;
+  app->glparams.filmic     = app->filmic;
+  app->glparams.colorgrade = app->colorgrade;
+  app->glparams.grading    = app->params;
+}
+
+// tonemap or colorgrade a pixel, as done on the GPU
+vec4f get_display(app_state* app, const vec4f& pixel) {
+  return app->colorgrade ? colorgrade(pixel, true, app->params)
+                         : tonemap(pixel, app->exposure, app->filmic);
 }
 
 int main(int argc, const char* argv[]) {
@@ -102,10 +106,10 @@ int main(int argc, const char* argv[]) {
     app->glparams.framebuffer = input.framebuffer_viewport;
     if (!is_initialized(app->glimage)) {
       init_image(app->glimage);
-      set_image(app->glimage, app->display, false, false);
+      set_image(app->glimage, app->source, false, false, true);
     }
     update_imview(app->glparams.center, app->glparams.scale,
-        app->display.size(), app->glparams.window, app->glparams.fit);
+        app->source.size(), app->glparams.window, app->glparams.fit);
     draw_image(app->glimage, app->glparams);
   };
   callbacks.widgets_cb = [app](gui::window* win, const gui::input& input) {
@@ -147,17 +151,13 @@ int main(int argc, const char* argv[]) {
       if (ij.x >= 0 && ij.x < app->source.size().x && ij.y >= 0 &&
           ij.y < app->source.size().y) {
         img_pixel     = app->source[{ij.x, ij.y}];
-        display_pixel = app->display[{ij.x, ij.y}];
+        display_pixel = get_display(app, img_pixel);
       }
       draw_coloredit(win, "image", img_pixel);
       draw_dragger(win, "display", display_pixel);
       end_header(win);
     }
-    if (edited) {
-      update_display(app);
-      if (!is_initialized(app->glimage)) init_image(app->glimage);
-      set_image(app->glimage, app->display, false, false);
-    }
+    if (edited) update_display(app);
   };
   callbacks.uiupdate_cb = [app](gui::window* win, const gui::input& input) {
     // handle mouse
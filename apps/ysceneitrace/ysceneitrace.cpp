@@ -41,6 +41,7 @@ namespace gui = yocto::gui;
 #include <atomic>
 #include <deque>
 #include <future>
+#include <mutex>
 using namespace std::string_literals;
 
 #include "ext/filesystem.hpp"
@@ -67,15 +68,23 @@ struct app_state {
   // options
   trc::trace_params params = {};
 
-  // rendering state
+  // rendering state, tonemapped on the GPU for display
   img::image<vec4f> render   = {};
-  img::image<vec4f> display  = {};
   float             exposure = 0;
 
   // view scene
   gui::image*       glimage  = new gui::image{};
   gui::image_params glparams = {};
 
+  // scene geometry drawn on the GPU to find the first hits of the preview,
+  // rebuilt when geometry is edited
+  bool        rasterhits = false;
+  gui::scene* glscene    = new gui::scene{};
+  bool        glupdated  = true;
+
+  // weight of the samples reprojected on camera moves, zero to discard them
+  float reproject = 0;
+
   // editing
   sio::camera*      selected_camera      = nullptr;
   sio::object*      selected_object      = nullptr;
@@ -87,9 +96,13 @@ struct app_state {
   sio::texture*     selected_texture     = nullptr;
 
   // computation
-  int         render_sample  = 0;
-  int         render_counter = 0;
-  trc::state* render_state   = new trc::state{};
+  int         render_sample = 0;
+  trc::state* render_state  = new trc::state{};
+
+  // rendered regions to upload, written by render threads
+  std::mutex         render_mutex   = {};
+  std::vector<vec4i> render_regions = {};
+  bool               render_reset   = true;
 
   // loading status
   std::atomic<bool> ok           = false;
@@ -108,6 +121,7 @@ struct app_state {
     if (scene) delete scene;
     if (ioscene) delete ioscene;
     if (glimage) delete glimage;
+    if (glscene) delete glscene;
   }
 };
 
@@ -121,6 +135,8 @@ struct app_states {
   // default options
   trc::trace_params params     = {};
   bool              add_skyenv = false;
+  bool              rasterhits = false;
+  float             reproject  = 0;
 
   // cleanup
   ~app_states() {
@@ -259,6 +275,56 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
   camera = camera_map.at(iocamera);
 }
 
+// Build the scene geometry for drawing first hits. Objects and instances
+// are numbered as in the trace scene, and frames are composed as there.
+void init_glscene(gui::scene* glscene, const trc::scene* scene) {
+  clear_scene(glscene);
+  glscene->shape_arena.clear();
+  glscene->instance_arena.clear();
+  glscene->object_arena.clear();
+  glscene->shapes.clear();
+  glscene->instances.clear();
+  glscene->objects.clear();
+
+  auto shape_map = std::unordered_map<trc::shape*, gui::shape*>{};
+  for (auto shape : scene->shapes) {
+    auto glshape = add_shape(glscene);
+    set_positions(glshape, shape->positions);
+    if (!shape->triangles.empty()) set_triangles(glshape, shape->triangles);
+    if (!shape->quads.empty()) set_quads(glshape, shape->quads);
+    shape_map[shape] = glshape;
+  }
+  for (auto object : scene->objects) {
+    auto glinstance = add_instance(glscene);
+    auto frames     = object->instance->frames;
+    for (auto& frame : frames) frame = frame * object->frame;
+    set_frames(glinstance, frames);
+    auto globject = add_object(glscene);
+    set_shape(globject, shape_map.at(object->shape));
+    set_instance(globject, glinstance);
+  }
+}
+
+// Draw the first hits of the camera rays on the GPU, for pinhole cameras,
+// returning no hits otherwise.
+img::image<vec4i> draw_hits(app_state* app) {
+  auto camera = app->camera;
+  if (!app->rasterhits || camera->orthographic || camera->aperture > 0)
+    return {};
+  if (app->glupdated) {
+    init_glscene(app->glscene, app->scene);
+    app->glupdated = false;
+  }
+  auto glcamera = gui::camera{};
+  set_frame(&glcamera, camera->frame);
+  set_lens(&glcamera, camera->lens, camera->film.x / camera->film.y,
+      camera->film.x);
+  auto hits = img::image<vec4i>{};
+  draw_scene_hits(app->glscene, &glcamera,
+      get_render_size(camera, app->params), {}, hits);
+  return hits;
+}
+
 void stop_display(app_state* app) {
   // stop render
   trc::trace_stop(app->render_state);
@@ -270,22 +336,74 @@ void reset_display(app_state* app) {
 
   // start render
   app->status         = "render";
-  app->render_counter = 0;
+  app->render_reset = true;
   trc::trace_start(
       app->render_state, app->scene, app->camera, app->params,
+      draw_hits(app),
+      [app](const std::string& message, int sample, int nsamples) {
+        app->current = sample;
+        app->total   = nsamples;
+      },
+      [app](const img::image<vec4f>& render, int current, int total) {
+        if (current > 0) return;
+        app->render = render;
+      },
+      {},
+      [app](const img::image<vec4f>& render, int current, int total,
+          const vec4i& tile) {
+        auto lock = std::lock_guard{app->render_mutex};
+        copy_image(get_view(app->render, tile), get_view(render, tile));
+        app->render_regions.push_back(tile);
+      });
+}
+
+// Restart rendering after a scene edit with a still camera, keeping the
+// current render on display until new samples replace it
+void restart_display(app_state* app) {
+  if (app->render.size() != get_render_size(app->camera, app->params))
+    return reset_display(app);
+  trc::trace_stop(app->render_state);
+  app->status = "render";
+  trc::trace_restart(
+      app->render_state, app->scene, app->camera, app->params, true,
+      [app](const std::string& message, int sample, int nsamples) {
+        app->current = sample;
+        app->total   = nsamples;
+      },
+      {}, {},
+      [app](const img::image<vec4f>& render, int current, int total,
+          const vec4i& tile) {
+        auto lock = std::lock_guard{app->render_mutex};
+        copy_image(get_view(app->render, tile), get_view(render, tile));
+        app->render_regions.push_back(tile);
+      });
+}
+
+// Restart rendering after a camera move, reprojecting the accumulated
+// samples if enabled
+void move_display(app_state* app) {
+  if (app->reproject <= 0 ||
+      app->render.size() != get_render_size(app->camera, app->params))
+    return reset_display(app);
+  trc::trace_stop(app->render_state);
+  app->status       = "render";
+  app->render_reset = true;
+  trc::trace_reproject(
+      app->render_state, app->scene, app->camera, app->params, app->reproject,
       [app](const std::string& message, int sample, int nsamples) {
         app->current = sample;
         app->total   = nsamples;
       },
       [app](const img::image<vec4f>& render, int current, int total) {
         if (current > 0) return;
-        app->render  = render;
-        app->display = tonemap_image(app->render, app->exposure);
+        app->render = render;
       },
+      {},
       [app](const img::image<vec4f>& render, int current, int total,
-          const vec2i& ij) {
-        app->render[ij]  = render[ij];
-        app->display[ij] = tonemap(app->render[ij], app->exposure);
+          const vec4i& tile) {
+        auto lock = std::lock_guard{app->render_mutex};
+        copy_image(get_view(app->render, tile), get_view(render, tile));
+        app->render_regions.push_back(tile);
       });
 }
 
@@ -297,6 +415,8 @@ void load_scene_async(app_states* apps, const std::string& filename,
   app->imagename = sfs::path(filename).replace_extension(".png");
   app->outname   = sfs::path(filename).replace_extension(".edited.yaml");
   app->params    = apps->params;
+  app->rasterhits = apps->rasterhits;
+  app->reproject  = apps->reproject;
   app->status    = "load";
   app->loader    = std::async(
       std::launch::async, [app, camera_name, add_skyenv]() {
@@ -310,6 +430,7 @@ void load_scene_async(app_states* apps, const std::string& filename,
           return;
         app->current = 1;
         app->total   = 1;
+        merge_duplicates(app->ioscene);
         if (add_skyenv) add_sky(app->ioscene);
         app->iocamera = get_camera(app->ioscene, camera_name);
         init_scene(
@@ -525,7 +646,9 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
           "*.png;*.jpg;*.tga;*.bmp;*.hdr;*.exr")) {
     auto app     = apps->selected;
     app->outname = save_path;
-    save_image(app->imagename, app->display, app->error);
+    auto lock = std::lock_guard{app->render_mutex};
+    save_image(
+        app->imagename, tonemap_image(app->render, app->exposure), app->error);
     save_path = "";
   }
   continue_line(win);
@@ -568,10 +691,16 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
     edited += draw_checkbox(win, "envhidden", tparams.envhidden);
     continue_line(win);
     edited += draw_checkbox(win, "filter", tparams.tentfilter);
+    continue_line(win);
+    edited += draw_checkbox(win, "mipmap", tparams.mipmap);
     edited += draw_slider(win, "seed", (int&)tparams.seed, 0, 1000000);
+    edited += draw_combobox(
+        win, "sequence", (int&)tparams.sequence, trc::sequence_names);
     edited += draw_slider(win, "pratio", tparams.pratio, 1, 64);
-    edited += draw_slider(win, "exposure", app->exposure, -5, 5);
+    edited += draw_checkbox(win, "raster hits", app->rasterhits);
     if (edited) reset_display(app);
+    draw_slider(win, "reproject", app->reproject, 0, 1);
+    draw_slider(win, "exposure", app->exposure, -5, 5);
     end_header(win);
   }
   if (begin_header(win, "inspect")) {
@@ -641,7 +770,7 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
       set_emission(environment, ioenvironment->emission,
           get_texture(ioenvironment->emission_tex));
       init_lights(app->scene);
-      reset_display(app);
+      restart_display(app);
     }
     end_header(win);
   }
@@ -661,7 +790,8 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
       set_instance(object, get_element(ioobject->instance,
                                app->ioscene->instances, app->scene->instances));
       update_bvh(app->scene, {object}, {}, {}, app->params);
-      reset_display(app);
+      app->glupdated = true;
+      restart_display(app);
     }
     end_header(win);
   }
@@ -684,7 +814,8 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
       set_radius(shape, ioshape->radius);
       set_tangents(shape, ioshape->tangents);
       update_bvh(app->scene, {}, {shape}, {}, app->params);
-      reset_display(app);
+      app->glupdated = true;
+      restart_display(app);
     }
     end_header(win);
   }
@@ -718,7 +849,7 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
       set_scattering(material, iomaterial->scattering, iomaterial->scanisotropy,
           get_texture(iomaterial->scattering_tex));
       init_lights(app->scene);
-      reset_display(app);
+      restart_display(app);
     }
     end_header(win);
   }
@@ -739,7 +870,7 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
       } else if (!iotexture->scalarb.empty()) {
         set_texture(texture, iotexture->scalarb);
       }
-      reset_display(app);
+      restart_display(app);
     }
     end_header(win);
   }
@@ -753,7 +884,8 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
           ioinstance, app->ioscene->instances, app->scene->instances);
       set_frames(instance, ioinstance->frames);
       update_bvh(app->scene, {}, {}, {instance}, app->params);
-      reset_display(app);
+      app->glupdated = true;
+      restart_display(app);
     }
     end_header(win);
   }
@@ -763,7 +895,7 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
     if (draw_widgets(win, app->ioscene, app->selected_subdiv)) {
       stop_display(app);
       // TODO: subdiv not implemented yet
-      reset_display(app);
+      restart_display(app);
     }
     end_header(win);
   }
@@ -774,13 +906,24 @@ void draw(gui::window* win, app_states* apps, const gui::input& input) {
   auto app                  = apps->selected;
   app->glparams.window      = input.window_size;
   app->glparams.framebuffer = input.framebuffer_viewport;
+  app->glparams.tonemap     = true;
+  app->glparams.exposure    = app->exposure;
   if (!is_initialized(app->glimage)) init_image(app->glimage);
-  if (!app->render_counter) set_image(app->glimage, app->display, false, false);
-  update_imview(app->glparams.center, app->glparams.scale, app->display.size(),
+  {
+    auto lock = std::lock_guard{app->render_mutex};
+    if (app->render_reset) {
+      set_image(app->glimage, app->render, false, false, true);
+    } else {
+      set_image_regions(
+          app->glimage, app->render, app->render_regions, false, false, true);
+    }
+    app->render_reset = false;
+    app->render_regions.clear();
+  }
+  update_imview(app->glparams.center, app->glparams.scale, app->render.size(),
       app->glparams.window, app->glparams.fit);
   draw_image(app->glimage, app->glparams);
-  app->render_counter++;
-  if (app->render_counter > 10) app->render_counter = 0;
+  trc::trace_report_frame(app->render_state, app->params);
 }
 
 void update(gui::window* win, app_states* apps) {
@@ -828,10 +971,22 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--clamp", apps->params.clamp, "Final pixel clamping.");
   add_option(
       cli, "--filter/--no-filter", apps->params.tentfilter, "Filter image.");
+  add_option(cli, "--mipmap/--no-mipmap", apps->params.mipmap,
+      "Filter textures with mipmaps.");
   add_option(cli, "--env-hidden/--no-env-hidden", apps->params.envhidden,
       "Environments are hidden in renderer");
   add_option(cli, "--bvh", apps->params.bvh, "Bvh type", trc::bvh_names);
+  add_option(cli, "--reserved-threads", apps->params.reserved,
+      "Threads left to the user interface while rendering");
+  add_option(cli, "--low-priority/--no-low-priority",
+      apps->params.lowpriority, "Render at a lower thread priority");
+  add_option(cli, "--framerate", apps->params.framerate,
+      "Interface frame rate kept by adapting the render threads, 0 for none");
   add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
+  add_option(cli, "--raster-hits/--no-raster-hits", apps->rasterhits,
+      "Draw the first hits of the preview on the GPU.");
+  add_option(cli, "--reproject", apps->reproject,
+      "Weight of the samples reprojected on camera moves, 0 to discard.");
   add_option(cli, "scenes", filenames, "Scene filenames", true);
   parse_cli(cli, argc, argv);
 
@@ -842,7 +997,10 @@ int main(int argc, const char* argv[]) {
   // callbacks
   auto callbacks     = gui::ui_callbacks{};
   callbacks.clear_cb = [apps](gui::window* win, const gui::input& input) {
-    for (auto app : apps->states) clear_image(app->glimage);
+    for (auto app : apps->states) {
+      clear_image(app->glimage);
+      clear_scene(app->glscene);
+    }
   };
   callbacks.draw_cb = [apps](gui::window* win, const gui::input& input) {
     draw(win, apps, input);
@@ -883,7 +1041,7 @@ int main(int argc, const char* argv[]) {
       set_lens(app->camera, app->iocamera->lens, app->iocamera->aspect,
           app->iocamera->film, app->iocamera->orthographic);
       set_focus(app->camera, app->iocamera->aperture, app->iocamera->focus);
-      reset_display(app);
+      move_display(app);
     }
 
     // selection
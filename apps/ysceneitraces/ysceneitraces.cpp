@@ -40,6 +40,7 @@ namespace gui = yocto::gui;
 
 #include <future>
 #include <memory>
+#include <mutex>
 using namespace std::string_literals;
 
 // Application state
@@ -67,9 +68,13 @@ struct app_state {
   gui::image_params glparams = {};
 
   // computation
-  int         render_sample  = 0;
-  int         render_counter = 0;
-  trc::state* render_state   = new trc::state{};
+  int         render_sample = 0;
+  trc::state* render_state  = new trc::state{};
+
+  // rendered regions to upload, written by render threads
+  std::mutex         render_mutex   = {};
+  std::vector<vec4i> render_regions = {};
+  bool               render_reset   = true;
 
   // status
   std::atomic<int> current = 0;
@@ -85,7 +90,7 @@ struct app_state {
   }
 };
 
-// construct a scene from io
+// construct a scene from io, moving its data to avoid copies
 void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
     sio::camera* iocamera, sio::progress_callback print_progress = {}) {
   // handle progress
@@ -115,13 +120,13 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
       print_progress("convert texture", progress.x++, progress.y);
     auto texture = add_texture(scene);
     if (!iotexture->colorf.empty()) {
-      set_texture(texture, iotexture->colorf);
+      set_texture(texture, std::move(iotexture->colorf));
     } else if (!iotexture->colorb.empty()) {
-      set_texture(texture, iotexture->colorb);
+      set_texture(texture, std::move(iotexture->colorb));
     } else if (!iotexture->scalarf.empty()) {
-      set_texture(texture, iotexture->scalarf);
+      set_texture(texture, std::move(iotexture->scalarf));
     } else if (!iotexture->scalarb.empty()) {
-      set_texture(texture, iotexture->scalarb);
+      set_texture(texture, std::move(iotexture->scalarb));
     }
     texture_map[iotexture] = texture;
   }
@@ -168,16 +173,16 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
     if (print_progress)
       print_progress("convert shape", progress.x++, progress.y);
     auto shape = add_shape(scene);
-    set_points(shape, ioshape->points);
-    set_lines(shape, ioshape->lines);
-    set_triangles(shape, ioshape->triangles);
-    set_quads(shape, ioshape->quads);
-    set_positions(shape, ioshape->positions);
-    set_normals(shape, ioshape->normals);
-    set_texcoords(shape, ioshape->texcoords);
-    set_colors(shape, ioshape->colors);
-    set_radius(shape, ioshape->radius);
-    set_tangents(shape, ioshape->tangents);
+    set_points(shape, std::move(ioshape->points));
+    set_lines(shape, std::move(ioshape->lines));
+    set_triangles(shape, std::move(ioshape->triangles));
+    set_quads(shape, std::move(ioshape->quads));
+    set_positions(shape, std::move(ioshape->positions));
+    set_normals(shape, std::move(ioshape->normals));
+    set_texcoords(shape, std::move(ioshape->texcoords));
+    set_colors(shape, std::move(ioshape->colors));
+    set_radius(shape, std::move(ioshape->radius));
+    set_tangents(shape, std::move(ioshape->tangents));
     shape_map[ioshape] = shape;
   }
 
@@ -187,7 +192,7 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
     if (print_progress)
       print_progress("convert instance", progress.x++, progress.y);
     auto instance = add_instance(scene);
-    set_frames(instance, ioinstance->frames);
+    set_frames(instance, std::move(ioinstance->frames));
     instance_map[ioinstance] = instance;
   }
 
@@ -230,7 +235,7 @@ void reset_display(app_state* app) {
   trc::trace_stop(app->render_state);
 
   // start render
-  app->render_counter = 0;
+  app->render_reset = true;
   trc::trace_start(
       app->render_state, app->scene, app->camera, app->params,
       [app](const std::string& message, int sample, int nsamples) {
@@ -242,10 +247,17 @@ void reset_display(app_state* app) {
         app->render  = render;
         app->display = tonemap_image(app->render, app->exposure);
       },
+      {},
       [app](const img::image<vec4f>& render, int current, int total,
-          const vec2i& ij) {
-        app->render[ij]  = render[ij];
-        app->display[ij] = tonemap(app->render[ij], app->exposure);
+          const vec4i& tile) {
+        auto lock = std::lock_guard{app->render_mutex};
+        for (auto j = tile.y; j < tile.w; j++) {
+          for (auto i = tile.x; i < tile.z; i++) {
+            app->render[{i, j}]  = render[{i, j}];
+            app->display[{i, j}] = tonemap(render[{i, j}], app->exposure);
+          }
+        }
+        app->render_regions.push_back(tile);
       });
 }
 
@@ -273,6 +285,8 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--clamp", app->params.clamp, "Final pixel clamping.");
   add_option(
       cli, "--filter/--no-filter", app->params.tentfilter, "Filter image.");
+  add_option(cli, "--mipmap/--no-mipmap", app->params.mipmap,
+      "Filter textures with mipmaps.");
   add_option(cli, "--env-hidden/--no-env-hidden", app->params.envhidden,
       "Environments are hidden in renderer");
   add_option(cli, "--bvh", app->params.bvh, "Bvh type", trc::bvh_names);
@@ -325,15 +339,22 @@ int main(int argc, const char* argv[]) {
   };
   callbacks.draw_cb = [app](gui::window* win, const gui::input& input) {
     if (!is_initialized(app->glimage)) init_image(app->glimage);
-    if (!app->render_counter)
-      set_image(app->glimage, app->display, false, false);
+    {
+      auto lock = std::lock_guard{app->render_mutex};
+      if (app->render_reset) {
+        set_image(app->glimage, app->display, false, false);
+      } else {
+        for (auto& region : app->render_regions)
+          set_image_region(app->glimage, app->display, region, false, false);
+      }
+      app->render_reset = false;
+      app->render_regions.clear();
+    }
     app->glparams.window      = input.window_size;
     app->glparams.framebuffer = input.framebuffer_viewport;
     update_imview(app->glparams.center, app->glparams.scale,
         app->display.size(), app->glparams.window, app->glparams.fit);
     draw_image(app->glimage, app->glparams);
-    app->render_counter++;
-    if (app->render_counter > 10) app->render_counter = 0;
   };
   callbacks.widgets_cb = [app](gui::window* win, const gui::input& input) {
     auto  edited  = 0;
@@ -351,6 +372,8 @@ int main(int argc, const char* argv[]) {
     edited += draw_checkbox(win, "envhidden", tparams.envhidden);
     continue_line(win);
     edited += draw_checkbox(win, "filter", tparams.tentfilter);
+    continue_line(win);
+    edited += draw_checkbox(win, "mipmap", tparams.mipmap);
     edited += draw_slider(win, "seed", (int&)tparams.seed, 0, 1000000);
     edited += draw_slider(win, "pratio", tparams.pratio, 1, 64);
     edited += draw_slider(win, "exposure", app->exposure, -5, 5);
@@ -30,8 +30,10 @@
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 #include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_shape.h>
 using namespace yocto::math;
 namespace sio = yocto::sceneio;
+namespace shp = yocto::shape;
 namespace cli = yocto::commonio;
 
 #include <memory>
@@ -65,11 +67,13 @@ void make_dir(const std::string& dirname) {
 
 int main(int argc, const char* argv[]) {
   // command line parameters
-  auto validate  = false;
-  auto info      = false;
-  auto copyright = ""s;
-  auto output    = "out.json"s;
-  auto filename  = "scene.json"s;
+  auto validate    = false;
+  auto info        = false;
+  auto incremental = false;
+  auto reorder     = false;
+  auto copyright   = ""s;
+  auto output      = "out.json"s;
+  auto filename    = "scene.json"s;
 
   // parse command line
   auto cli = cli::make_cli("yscnproc", "Process scene");
@@ -77,6 +81,10 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--copyright,-c", copyright, "copyright string");
   add_option(cli, "--validate/--no-validate", validate, "Validate scene");
   add_option(cli, "--output,-o", output, "output scene");
+  add_option(cli, "--incremental/--no-incremental", incremental,
+      "Skip saving unchanged assets");
+  add_option(cli, "--reorder/--no-reorder", reorder,
+      "Reorder shapes for memory locality");
   add_option(cli, "scene", filename, "input scene", true);
   parse_cli(cli, argc, argv);
 
@@ -112,26 +120,57 @@ int main(int argc, const char* argv[]) {
     for (auto stat : scene_stats(scene)) cli::print_info(stat);
   }
 
-  // tesselate if needed
-  if (sfs::path(output).extension() != ".json") {
+  // tesselate if needed, binary scenes keep subdivs as json does
+  auto extension = sfs::path(output).extension();
+  if (extension != ".json" && extension != ".ybin") {
     for (auto iosubdiv : scene->subdivs) {
       tesselate_subdiv(scene, iosubdiv);
     }
   }
 
+  // reorder shapes, optimizing triangles for the vertex cache
+  if (reorder) {
+    auto progress = vec2i{0, (int)scene->shapes.size()};
+    for (auto shape : scene->shapes) {
+      cli::print_progress("reorder shapes", progress.x++, progress.y);
+      auto vertex_map = std::vector<int>{};
+      if (!shape->points.empty()) {
+        vertex_map = shp::reorder_points(shape->points, shape->positions);
+      } else if (!shape->lines.empty()) {
+        vertex_map = shp::reorder_lines(shape->lines, shape->positions);
+      } else if (!shape->triangles.empty()) {
+        vertex_map = shp::reorder_triangles(
+            shape->triangles, shape->positions, true);
+      } else if (!shape->quads.empty()) {
+        vertex_map = shp::reorder_quads(shape->quads, shape->positions);
+      }
+      if (vertex_map.empty()) continue;
+      shp::reorder_vertices(shape->positions, vertex_map);
+      shp::reorder_vertices(shape->normals, vertex_map);
+      shp::reorder_vertices(shape->texcoords, vertex_map);
+      shp::reorder_vertices(shape->colors, vertex_map);
+      shp::reorder_vertices(shape->radius, vertex_map);
+      shp::reorder_vertices(shape->tangents, vertex_map);
+    }
+    cli::print_progress("reorder shapes", progress.x, progress.y);
+  }
+
   // make a directory if needed
   make_dir(sfs::path(output).parent_path());
-  if (!scene->shapes.empty())
-    make_dir(sfs::path(output).parent_path() / "shapes");
-  if (!scene->subdivs.empty())
-    make_dir(sfs::path(output).parent_path() / "subdivs");
-  if (!scene->textures.empty())
-    make_dir(sfs::path(output).parent_path() / "textures");
-  if (!scene->instances.empty())
-    make_dir(sfs::path(output).parent_path() / "instances");
+  if (extension != ".ybin") {
+    if (!scene->shapes.empty())
+      make_dir(sfs::path(output).parent_path() / "shapes");
+    if (!scene->subdivs.empty())
+      make_dir(sfs::path(output).parent_path() / "subdivs");
+    if (!scene->textures.empty())
+      make_dir(sfs::path(output).parent_path() / "textures");
+    if (!scene->instances.empty())
+      make_dir(sfs::path(output).parent_path() / "instances");
+  }
 
   // save scene
-  if (!save_scene(output, scene, ioerror, cli::print_progress))
+  if (!save_scene(
+          output, scene, ioerror, cli::print_progress, false, incremental))
     cli::print_fatal(ioerror);
 
   // done
@@ -26,6 +26,7 @@
 // POSSIBILITY OF SUCH DAMAGE.
 //
 
+#include <yocto/yocto_common.h>
 #include <yocto/yocto_commonio.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
@@ -35,24 +36,123 @@ using namespace yocto::math;
 namespace sio = yocto::sceneio;
 namespace img = yocto::image;
 namespace cli = yocto::commonio;
+namespace common = yocto::common;
 namespace trc = yocto::trace;
 
+#include <fstream>
+#include <iostream>
 #include <map>
 #include <memory>
+#include <sstream>
 using namespace std::string_literals;
 
 #include "ext/filesystem.hpp"
 namespace sfs = ghc::filesystem;
 
-// construct a scene from io
+#include <yocto/ext/json.hpp>
+
+// Create a cache directory on first use
+bool make_cache_dir(const std::string& dirname, std::string& error) {
+  if (dirname.empty() || sfs::is_directory(dirname)) return true;
+  auto ec = std::error_code{};
+  if (!sfs::create_directories(dirname, ec) || ec) {
+    error = dirname + ": cannot create cache directory";
+    return false;
+  }
+  return true;
+}
+
+// Set a texture from a tiled texture in the cache directory, converting
+// the texture image the first time. Tiled files are named by the hash of
+// the texture filename, size and modification time.
+bool set_tiled_texture(trc::scene* scene, trc::texture* texture,
+    const sio::texture* iotexture, const std::string& dirname,
+    std::string& error) {
+  auto source = sfs::path(iotexture->filename);
+  if (!sfs::exists(source)) {
+    error = iotexture->filename + ": file not found";
+    return false;
+  }
+  auto stamp = iotexture->filename + ":" +
+               std::to_string(sfs::file_size(source)) + ":" +
+               std::to_string(
+                   sfs::last_write_time(source).time_since_epoch().count()) +
+               (iotexture->scalar ? ":scalar" : ":color");
+  char name[64];
+  snprintf(name, sizeof(name), "tex-%016llx.ytx",
+      (unsigned long long)std::hash<std::string>{}(stamp));
+  auto tiled = (sfs::path(dirname) / name).string();
+  if (!sfs::exists(tiled)) {
+    auto convert = [&](auto&& img) {
+      if (!img::load_image(iotexture->filename, img, error)) return false;
+      return trc::save_tiled_texture(tiled, img, error);
+    };
+    auto hdr = img::is_hdr_filename(iotexture->filename);
+    auto ok  = iotexture->scalar ? (hdr ? convert(img::image<float>{})
+                                       : convert(img::image<byte>{}))
+                                : (hdr ? convert(img::image<vec3f>{})
+                                       : convert(img::image<vec3b>{}));
+    if (!ok) return false;
+  }
+  return trc::set_tiled_texture(scene, texture, tiled, error);
+}
+
+// Set a volume from a sparse volume in the cache directory, converting the
+// volume the first time. Sparse files are named by the hash of the volume
+// filename, size, modification time and voxel encoding.
+bool set_sparse_volume(trc::volume* volume, const std::string& filename,
+    const std::string& dirname, trc::volume_encoding encoding,
+    std::string& error) {
+  auto source = sfs::path(filename);
+  if (!sfs::exists(source)) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto stamp = filename + ":" + std::to_string(sfs::file_size(source)) + ":" +
+               std::to_string(
+                   sfs::last_write_time(source).time_since_epoch().count()) +
+               ":" + trc::volume_encoding_names[(int)encoding];
+  char name[64];
+  snprintf(name, sizeof(name), "vol-%016llx.ysv",
+      (unsigned long long)std::hash<std::string>{}(stamp));
+  auto sparse = (sfs::path(dirname) / name).string();
+  if (!sfs::exists(sparse)) {
+    auto vol = img::volume<float>{};
+    if (!img::load_volume(filename, vol, error)) return false;
+    if (!trc::save_sparse_volume(sparse, vol, encoding, error)) return false;
+  }
+  return trc::set_sparse_volume(
+      volume, sparse, {{-1, -1, -1}, {1, 1, 1}}, error);
+}
+
+// Check if all values of an image fit the range of halfs
+bool fits_half(const img::image<vec3f>& img) {
+  for (auto& value : img) {
+    if (max(abs(value)) > 65504) return false;
+  }
+  return true;
+}
+bool fits_half(const img::image<float>& img) {
+  for (auto value : img) {
+    if (abs(value) > 65504) return false;
+  }
+  return true;
+}
+
+// construct a scene from io, moving its data to avoid copies. Hdr textures
+// are stored as halfs if requested, when they fit their range, and ldr
+// textures are block compressed if requested. Triangle shapes are compressed
+// as they are converted if requested.
 void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
-    sio::camera* iocamera, sio::progress_callback progress_cb = {}) {
+    sio::camera* iocamera, const std::string& texture_cache = "",
+    bool half_textures = false, bool compress_textures = false,
+    bool compress_shapes = false, sio::progress_callback progress_cb = {}) {
   // handle progress
   auto progress = vec2i{
       0, (int)ioscene->cameras.size() + (int)ioscene->environments.size() +
              (int)ioscene->materials.size() + (int)ioscene->textures.size() +
-             (int)ioscene->shapes.size() + (int)ioscene->subdivs.size() +
-             (int)ioscene->instances.size() + (int)ioscene->objects.size()};
+             (int)ioscene->shapes.size() + (int)ioscene->instances.size() +
+             (int)ioscene->objects.size()};
 
   auto camera_map     = std::unordered_map<sio::camera*, trc::camera*>{};
   camera_map[nullptr] = nullptr;
@@ -71,14 +171,32 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
   for (auto iotexture : ioscene->textures) {
     if (progress_cb) progress_cb("convert texture", progress.x++, progress.y);
     auto texture = add_texture(scene);
-    if (!iotexture->colorf.empty()) {
-      set_texture(texture, iotexture->colorf);
+    if (!iotexture->colorf.empty() && half_textures &&
+        fits_half(iotexture->colorf)) {
+      set_texture(texture, img::float_to_half(iotexture->colorf));
+      iotexture->colorf = {};
+    } else if (!iotexture->scalarf.empty() && half_textures &&
+               fits_half(iotexture->scalarf)) {
+      set_texture(texture, img::float_to_half(iotexture->scalarf));
+      iotexture->scalarf = {};
+    } else if (!iotexture->colorb.empty() && compress_textures) {
+      set_texture(texture, img::compress_image(iotexture->colorb));
+      iotexture->colorb = {};
+    } else if (!iotexture->scalarb.empty() && compress_textures) {
+      set_texture(texture, img::compress_image(iotexture->scalarb));
+      iotexture->scalarb = {};
+    } else if (!iotexture->colorf.empty()) {
+      set_texture(texture, std::move(iotexture->colorf));
     } else if (!iotexture->colorb.empty()) {
-      set_texture(texture, iotexture->colorb);
+      set_texture(texture, std::move(iotexture->colorb));
     } else if (!iotexture->scalarf.empty()) {
-      set_texture(texture, iotexture->scalarf);
+      set_texture(texture, std::move(iotexture->scalarf));
     } else if (!iotexture->scalarb.empty()) {
-      set_texture(texture, iotexture->scalarb);
+      set_texture(texture, std::move(iotexture->scalarb));
+    } else if (!iotexture->filename.empty()) {
+      auto error = ""s;
+      if (!set_tiled_texture(scene, texture, iotexture, texture_cache, error))
+        cli::print_fatal(error);
     }
     texture_map[iotexture] = texture;
   }
@@ -112,26 +230,25 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
     material_map[iomaterial] = material;
   }
 
-  for (auto iosubdiv : ioscene->subdivs) {
-    if (progress_cb) progress_cb("convert subdiv", progress.x++, progress.y);
-    tesselate_subdiv(ioscene, iosubdiv);
-  }
-
   auto shape_map     = std::unordered_map<sio::shape*, trc::shape*>{};
   shape_map[nullptr] = nullptr;
   for (auto ioshape : ioscene->shapes) {
     if (progress_cb) progress_cb("convert shape", progress.x++, progress.y);
+    auto error = ""s;
+    if (!load_shape(ioscene, ioshape, error)) cli::print_fatal(error);
     auto shape = add_shape(scene);
-    set_points(shape, ioshape->points);
-    set_lines(shape, ioshape->lines);
-    set_triangles(shape, ioshape->triangles);
-    set_quads(shape, ioshape->quads);
-    set_positions(shape, ioshape->positions);
-    set_normals(shape, ioshape->normals);
-    set_texcoords(shape, ioshape->texcoords);
-    set_colors(shape, ioshape->colors);
-    set_radius(shape, ioshape->radius);
-    set_tangents(shape, ioshape->tangents);
+    set_points(shape, std::move(ioshape->points));
+    set_lines(shape, std::move(ioshape->lines));
+    set_triangles(shape, std::move(ioshape->triangles));
+    set_quads(shape, std::move(ioshape->quads));
+    set_positions(shape, std::move(ioshape->positions));
+    set_normals(shape, std::move(ioshape->normals));
+    set_texcoords(shape, std::move(ioshape->texcoords));
+    set_colors(shape, std::move(ioshape->colors));
+    set_radius(shape, std::move(ioshape->radius));
+    set_tangents(shape, std::move(ioshape->tangents));
+    if (compress_shapes) compress_shape(shape);
+    unload_shape(ioscene, ioshape);
     shape_map[ioshape] = shape;
   }
 
@@ -140,7 +257,7 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb) progress_cb("convert instance", progress.x++, progress.y);
     auto instance = add_instance(scene);
-    set_frames(instance, ioinstance->frames);
+    set_frames(instance, std::move(ioinstance->frames));
     instance_map[ioinstance] = instance;
   }
 
@@ -169,63 +286,369 @@ void init_scene(trc::scene* scene, sio::model* ioscene, trc::camera*& camera,
   camera = camera_map.at(iocamera);
 }
 
-int main(int argc, const char* argv[]) {
-  // options
-  auto params      = trc::trace_params{};
-  auto save_batch  = false;
-  auto add_skyenv  = false;
-  auto camera_name = ""s;
-  auto imfilename  = "out.hdr"s;
-  auto filename    = "scene.json"s;
+// Options of a render job, set from the command line
+struct trace_options {
+  trc::trace_params        params          = {};
+  bool                     save_batch      = false;
+  bool                     add_skyenv      = false;
+  std::string              camera_name     = "";
+  std::string              cameras         = "";
+  std::string              imfilename      = "out.hdr";
+  std::string              ptfilename      = "";
+  std::string              tlfilename      = "";
+  bool                     merge           = false;
+  std::string              volfilename     = "";
+  std::string              vol_cache       = "";
+  trc::volume_encoding     vol_encoding    = trc::volume_encoding::floats;
+  float                    shutter         = 0;
+  std::string              moving_name     = "";
+  float                    motion          = 0;
+  std::string              aov_names       = "";
+  std::string              crop            = "";
+  std::string              crop_into       = "";
+  std::string              animation       = "";
+  int                      frames          = 0;
+  std::string              tex_cache       = "";
+  int                      tex_budget      = 1024;
+  bool                     tex_half        = false;
+  bool                     tex_blocks      = false;
+  bool                     lazy_shapes     = false;
+  bool                     compress_shapes = false;
+  bool                     instancing      = true;
+  bool                     print_stats     = false;
+  float                    subdiv_edge     = 0;
+  int                      subdiv_size     = 0;
+  std::vector<std::string> filenames       = {};
+};
 
-  // parse command line
-  auto cli = cli::make_cli("yscntrace", "Offline path tracing");
-  add_option(cli, "--camera", camera_name, "Camera name.");
+// Add the options of a render job to a command line parser
+void add_options(cli::cli_state& cli, trace_options& options) {
+  auto& params = options.params;
+  add_option(cli, "--camera", options.camera_name, "Camera name.");
+  add_option(cli, "--cameras", options.cameras,
+      "Camera names separated by commas, or all, rendered one at a time.");
   add_option(cli, "--resolution,-r", params.resolution, "Image resolution.");
   add_option(cli, "--samples,-s", params.samples, "Number of samples.");
+  add_option(cli, "--time-budget", params.timebudget,
+      "Render time budget in seconds.");
   add_option(
       cli, "--tracer,-t", params.sampler, "Trace type.", trc::sampler_names);
   add_option(cli, "--falsecolor,-F", params.falsecolor,
       "Tracer false color type.", trc::falsecolor_names);
   add_option(cli, "--bounces,-b", params.bounces, "Maximum number of bounces.");
+  add_option(cli, "--sequence", params.sequence, "Random number sequence.",
+      trc::sequence_names);
   add_option(cli, "--clamp", params.clamp, "Final pixel clamping.");
+  add_option(cli, "--tilesize", params.tilesize, "Render tile size.");
+  add_option(cli, "--batch", params.batch, "Samples per tile pass.");
+  add_option(cli, "--raysort/--no-raysort", params.raysort,
+      "Sort wavefront secondary rays for coherence.");
+  add_option(cli, "--numa/--no-numa", params.numa,
+      "Place scene and pixel memory on NUMA nodes.");
   add_option(cli, "--filter/--no-filter", params.tentfilter, "Filter image.");
+  add_option(cli, "--mipmap/--no-mipmap", params.mipmap,
+      "Filter textures with mipmaps.");
+  add_option(cli, "--adaptive/--no-adaptive", params.adaptive,
+      "Adaptive sampling.");
+  add_option(cli, "--noise", params.noise, "Adaptive sampling noise.");
+  add_option(cli, "--halfbuffer/--no-halfbuffer", params.halfbuffer,
+      "Store pixels in half-floats.");
+  add_option(cli, "--compactrng/--no-compactrng", params.compactrng,
+      "Use counter-based pixel rngs, not stored.");
+  add_option(cli, "--denoise/--no-denoise", params.denoise,
+      "Denoise image with albedo and normal features.");
+  add_option(cli, "--aovs", options.aov_names,
+      "False color aovs saved with the image, separated by commas.");
+  add_option(cli, "--crop", options.crop,
+      "Pixels rendered, as xmin,ymin,xmax,ymax with max excluded.");
+  add_option(cli, "--crop-into", options.crop_into,
+      "Image of the full frame the crop is pasted into when saving.");
   add_option(cli, "--env-hidden/--no-env-hidden", params.envhidden,
       "Environments are hidden in renderer");
-  add_option(cli, "--save-batch", save_batch, "Save images progressively");
+  add_option(
+      cli, "--save-batch", options.save_batch, "Save images progressively");
+  add_option(cli, "--checkpoint", params.checkpoint, "Checkpoint filename");
+  add_option(cli, "--checkpoint-interval", params.checkpoint_interval,
+      "Seconds between checkpoints.");
   add_option(cli, "--bvh", params.bvh, "Bvh type", trc::bvh_names);
-  add_option(cli, "--skyenv/--no-skyenv", add_skyenv, "Add sky envmap");
-  add_option(cli, "--output-image,-o", imfilename, "Image filename");
-  add_option(cli, "scene", filename, "Scene filename", true);
-  parse_cli(cli, argc, argv);
+  add_option(cli, "--bvh-cache", params.bvh_cache, "Bvh cache directory");
+  add_option(cli, "--prune", params.prune,
+      "Prune instances and lights for the camera", trc::prune_names);
+  add_option(cli, "--prune-size", params.prune_size,
+      "Projected size in pixels below which instances are pruned");
+  add_option(cli, "--bvh-triangles/--no-bvh-triangles", params.bvh_triangles,
+      "Store triangles in bvh leaf order");
+  add_option(cli, "--watertight/--no-watertight", params.watertight,
+      "Watertight triangle intersection");
+  add_option(cli, "--shading-cache/--no-shading-cache", params.shading_cache,
+      "Precompute element normals and tangents");
+  add_option(cli, "--texture-cache", options.tex_cache,
+      "Tiled texture directory, loading textures on demand");
+  add_option(cli, "--texture-budget", options.tex_budget,
+      "Texture cache budget in megabytes");
+  add_option(cli, "--half-textures/--no-half-textures", options.tex_half,
+      "Store hdr textures as halfs");
+  add_option(cli, "--compress-textures/--no-compress-textures",
+      options.tex_blocks, "Store ldr textures block compressed");
+  add_option(cli, "--lazy-shapes/--no-lazy-shapes", options.lazy_shapes,
+      "Load shape geometry one at a time when converting");
+  add_option(cli, "--compress-shapes/--no-compress-shapes",
+      options.compress_shapes, "Store triangle shapes compressed");
+  add_option(cli, "--instancing/--no-instancing", options.instancing,
+      "Group objects sharing shape and material as instances");
+  add_option(cli, "--embree-shared/--no-embree-shared", params.embree_shared,
+      "Share geometry buffers with Embree");
+  add_option(cli, "--skyenv/--no-skyenv", options.add_skyenv, "Add sky envmap");
+  add_option(cli, "--subdiv-edge", options.subdiv_edge,
+      "Subdiv edge length in pixels, choosing levels from the camera");
+  add_option(cli, "--subdiv-budget", options.subdiv_size,
+      "Subdiv memory budget in megabytes, or 0 for no limit");
+  add_option(cli, "--stats/--no-stats", options.print_stats,
+      "Print render statistics, collected when built with YOCTO_STATS");
+  add_option(cli, "--volume", options.volfilename,
+      "Density volume for volumetric materials");
+  add_option(cli, "--volume-cache", options.vol_cache,
+      "Sparse volume directory, mapping volumes in memory");
+  add_option(cli, "--volume-encoding", options.vol_encoding,
+      "Sparse volume voxel encoding", trc::volume_encoding_names);
+  add_option(cli, "--shutter", options.shutter, "Camera shutter, in [0, 1].");
+  add_option(
+      cli, "--motion-object", options.moving_name, "Moving object name.");
+  add_option(cli, "--motion", options.motion, "Moving object sideways offset.");
+  add_option(cli, "--animation", options.animation,
+      "Object and camera keyframes, rendered as a frame sequence");
+  add_option(cli, "--frames", options.frames,
+      "Number of frames of the animation, or 0 to end at its last key");
+  add_option(cli, "--partition", params.partition, "Render nodes partition.",
+      trc::partition_names);
+  add_option(cli, "--nodes", params.nodes, "Number of render nodes.");
+  add_option(cli, "--node", params.node, "Render node index.");
+  add_option(
+      cli, "--output-partial", options.ptfilename, "Partial render filename");
+  add_option(cli, "--merge/--no-merge", options.merge, "Merge partial renders");
+  add_option(cli, "--output-image,-o", options.imfilename, "Image filename");
+  add_option(cli, "--trace-timeline", options.tlfilename,
+      "Save a Chrome trace of where time goes");
+  add_option(cli, "scene", options.filenames, "Scene or partial renders");
+}
+
+// A scene converted for rendering, with its bvh and lights. The cameras and
+// object names of the loaded scene are kept to look them up by name.
+struct trace_scene {
+  std::string                 key          = "";
+  std::unique_ptr<trc::scene> scene        = {};
+  std::unique_ptr<sio::model> cameras      = {};
+  std::vector<std::string>    object_names = {};
+  size_t                      memory       = 0;
+};
+
+// Options that change the converted scene, so that jobs with the same key
+// can share it. The camera matters only for subdivs and moving objects.
+std::string get_scene_key(const trace_options& options) {
+  auto& params = options.params;
+  auto  key    = options.filenames.front();
+  for (auto& value : {options.tex_cache, std::to_string(options.tex_budget),
+           std::to_string(options.tex_half), std::to_string(options.tex_blocks),
+           std::to_string(options.lazy_shapes),
+           std::to_string(options.compress_shapes),
+           std::to_string(options.instancing),
+           std::to_string(options.add_skyenv),
+           std::to_string(options.subdiv_edge),
+           std::to_string(options.subdiv_size), options.volfilename,
+           options.vol_cache, std::to_string((int)options.vol_encoding),
+           options.moving_name, std::to_string(options.motion),
+           options.animation,
+           std::to_string((int)params.bvh), params.bvh_cache,
+           std::to_string(params.bvh_triangles),
+           std::to_string(params.watertight),
+           std::to_string(params.shading_cache),
+           std::to_string(params.embree_shared),
+           std::to_string((int)params.prune),
+           std::to_string(params.prune_size)}) {
+    key += "|" + value;
+  }
+  if (options.subdiv_edge > 0 || !options.moving_name.empty() ||
+      params.prune != trc::prune_type::none) {
+    key += "|" + options.camera_name;
+    key += "|" + std::to_string(params.resolution);
+  }
+  return key;
+}
+
+// Load a scene and convert it for rendering, building its bvh and lights
+bool load_trace_scene(trace_scene& tscene, const trace_options& options,
+    std::string& error) {
+  auto& params = options.params;
+
+  // cache directories
+  if (!make_cache_dir(options.tex_cache, error)) return false;
+  if (!make_cache_dir(options.vol_cache, error)) return false;
 
   // scene loading
+  cli::begin_timeline("load scene");
   auto ioscene_guard = std::make_unique<sio::model>();
   auto ioscene       = ioscene_guard.get();
-  auto ioerror       = ""s;
-  if (!load_scene(filename, ioscene, ioerror, cli::print_progress))
-    cli::print_fatal(ioerror);
+  if (!load_scene(options.filenames.front(), ioscene, error,
+          cli::print_progress, false, !options.tex_cache.empty(),
+          options.lazy_shapes))
+    return false;
+
+  // share duplicated shapes and textures
+  merge_duplicates(ioscene);
 
   // add sky
-  if (add_skyenv) add_sky(ioscene);
+  if (options.add_skyenv) add_sky(ioscene);
 
   // get camera
-  auto iocamera = get_camera(ioscene, camera_name);
+  auto iocamera = get_camera(ioscene, options.camera_name);
+
+  // tesselate subdivs
+  if (options.subdiv_edge > 0) {
+    tesselate_subdivs(ioscene, iocamera, params.resolution,
+        options.subdiv_edge, (size_t)options.subdiv_size * 1024 * 1024,
+        cli::print_progress);
+  } else {
+    tesselate_subdivs(ioscene, cli::print_progress);
+  }
+
+  // group objects as instances, unless they are moved by name
+  if (options.instancing && options.moving_name.empty() &&
+      options.animation.empty())
+    group_instances(ioscene);
+
+  // keep cameras and object names
+  tscene.cameras = std::make_unique<sio::model>();
+  for (auto iocamera : ioscene->cameras) {
+    *add_camera(tscene.cameras.get()) = *iocamera;
+  }
+  for (auto ioobject : ioscene->objects) {
+    tscene.object_names.push_back(ioobject->name);
+  }
+
+  cli::end_timeline();
 
   // convert scene
-  auto scene_guard = std::make_unique<trc::scene>();
-  auto scene       = scene_guard.get();
-  auto camera      = (trc::camera*)nullptr;
-  init_scene(scene, ioscene, camera, iocamera, cli::print_progress);
+  cli::begin_timeline("convert scene");
+  tscene.key   = get_scene_key(options);
+  tscene.scene = std::make_unique<trc::scene>();
+  auto scene   = tscene.scene.get();
+  auto camera  = (trc::camera*)nullptr;
+  if (!options.tex_cache.empty())
+    trc::set_texture_cache(scene, (size_t)options.tex_budget * 1024 * 1024);
+  init_scene(scene, ioscene, camera, iocamera, options.tex_cache,
+      options.tex_half, options.tex_blocks, options.compress_shapes,
+      cli::print_progress);
+
+  // add density volume, mapping sparse volumes
+  if (!options.volfilename.empty()) {
+    auto volume = add_volume(scene);
+    if (sfs::path(options.volfilename).extension() == ".ysv") {
+      if (!trc::set_sparse_volume(
+              volume, options.volfilename, {{-1, -1, -1}, {1, 1, 1}}, error))
+        return false;
+    } else if (!options.vol_cache.empty()) {
+      if (!set_sparse_volume(volume, options.volfilename, options.vol_cache,
+              options.vol_encoding, error))
+        return false;
+    } else {
+      auto vol = img::volume<float>{};
+      if (!load_volume(options.volfilename, vol, error)) return false;
+      set_volume(volume, vol);
+    }
+    for (auto material : scene->materials) {
+      if (material->thin) continue;
+      if (!material->transmission && !material->translucency) continue;
+      set_density(material, volume);
+    }
+  }
+
+  // move an object sideways in the camera view over the time interval
+  for (auto idx = 0; idx < ioscene->objects.size(); idx++) {
+    if (options.moving_name.empty() ||
+        ioscene->objects[idx]->name != options.moving_name)
+      continue;
+    auto object   = scene->objects[idx];
+    auto instance = add_instance(scene);
+    auto frames   = object->instance->frames;
+    set_frames(instance, frames);
+    for (auto& frame : frames) frame.o += camera->frame.x * options.motion;
+    set_motion(instance, {frames});
+    set_instance(object, instance);
+  }
 
   // cleanup
   if (ioscene_guard) ioscene_guard.reset();
 
+  cli::end_timeline();
+
+  // prune instances and emitters negligible for the camera
+  if (params.prune != trc::prune_type::none) {
+    cli::begin_timeline("prune scene");
+    prune_scene(scene, camera, params);
+    cli::end_timeline();
+  }
+
   // build bvh
+  trc::reset_trace_stats();
+  cli::begin_timeline("build bvh");
   init_bvh(scene, params, cli::print_progress);
+  cli::end_timeline();
+  cli::print_info("bvh memory: " +
+                  std::to_string(get_bvh_memory(scene) / 1024) + " kb");
+  if (trc::get_embree_memory())
+    cli::print_info("embree memory: " +
+                    std::to_string(trc::get_embree_memory() / 1024) + " kb");
 
   // init renderer
+  cli::begin_timeline("init lights");
   init_lights(scene, cli::print_progress);
+  cli::end_timeline();
+
+  // memory
+  tscene.memory = trc::get_scene_memory(scene).total;
+  return true;
+}
+
+// Render a job on a loaded scene and save its images
+bool render_trace_scene(trace_scene& tscene, const trace_options& options,
+    std::string& error) {
+  auto params = options.params;
+  auto scene  = tscene.scene.get();
+
+  // aovs
+  for (auto start = (size_t)0; start < options.aov_names.size();) {
+    auto end  = std::min(options.aov_names.find(',', start),
+        options.aov_names.size());
+    auto name = options.aov_names.substr(start, end - start);
+    auto it   = std::find(
+        trc::falsecolor_names.begin(), trc::falsecolor_names.end(), name);
+    if (it == trc::falsecolor_names.end()) {
+      error = "unknown aov " + name;
+      return false;
+    }
+    params.aovs.push_back(
+        (trc::falsecolor_type)(it - trc::falsecolor_names.begin()));
+    start = end + 1;
+  }
+
+  // crop
+  if (!options.crop.empty()) {
+    auto& crop = params.crop;
+    if (sscanf(options.crop.c_str(), "%d,%d,%d,%d", &crop.x, &crop.y,
+            &crop.z, &crop.w) != 4 ||
+        crop.z <= crop.x || crop.w <= crop.y) {
+      error = "bad crop " + options.crop;
+      return false;
+    }
+  }
+
+  // get camera, at the same index of the loaded one
+  auto iocamera = get_camera(tscene.cameras.get(), options.camera_name);
+  auto camera =
+      scene->cameras[std::find(tscene.cameras->cameras.begin(),
+                         tscene.cameras->cameras.end(), iocamera) -
+                     tscene.cameras->cameras.begin()];
+  set_shutter(camera, options.shutter);
 
   // fix renderer type if no lights
   if (scene->lights.empty() && is_sampler_lit(params)) {
@@ -233,25 +656,457 @@ int main(int argc, const char* argv[]) {
     params.sampler = trc::sampler_type::eyelight;
   }
 
+  // save batches in the background, one at a time, while rendering continues
+  auto imfilename   = options.imfilename;
+  auto save_batch   = options.save_batch;
+  auto batch_saving = std::future<bool>{};
+  auto batch_error  = ""s;
+  auto wait_batch   = [&batch_saving, &batch_error]() {
+    if (!batch_saving.valid()) return;
+    if (!batch_saving.get()) cli::print_fatal(batch_error);
+  };
+  auto image_cb = [save_batch, imfilename, &batch_saving, &batch_error,
+                      &wait_batch](const img::image<vec4f>& render, int sample,
+                      int samples) {
+    if (!save_batch) return;
+    auto ext = "-s" + std::to_string(sample + samples) +
+               sfs::path(imfilename).extension().string();
+    auto outfilename = sfs::path(imfilename).replace_extension(ext).string();
+    cli::print_progress("save image", sample, samples);
+    wait_batch();
+    batch_saving = save_image_async(outfilename, render, batch_error);
+  };
+
+  // print statistics of the render started at render_start
+  auto render_start = (int64_t)0;
+  auto print_stats  = options.print_stats;
+  auto stats_info   = [print_stats, &render_start, scene, camera, &params]() {
+    if (!print_stats) return;
+    auto elapsed  = cli::get_time_() - render_start;
+    auto stats    = trc::get_trace_stats();
+    auto rays     = (double)std::max(stats.rays, (uint64_t)1);
+    auto mrays    = stats.rays * 1e3 / std::max(elapsed, (int64_t)1);
+    auto nanosecs = [](double time) { return (int64_t)(time * 1e9); };
+    cli::print_info("render time: " + cli::format_duration(elapsed));
+    cli::print_info("rays traced: " + cli::format_num(stats.rays));
+    cli::print_info("mrays/s: " + std::to_string(mrays));
+    cli::print_info("nodes per ray: " + std::to_string(stats.nodes / rays));
+    cli::print_info(
+        "primitives per ray: " + std::to_string(stats.primitives / rays));
+    cli::print_info("light samples: " + cli::format_num(stats.light_samples));
+    cli::print_info("pixel samples: " + cli::format_num(stats.samples));
+    cli::print_info(
+        "bvh time: " + cli::format_duration(nanosecs(stats.bvh_time)));
+    cli::print_info(
+        "lights time: " + cli::format_duration(nanosecs(stats.lights_time)));
+    if (!params.bvh_cache.empty())
+      cli::print_info(
+          "bvh cache write failures: " + cli::format_num(stats.cache_failures));
+    cli::print_info("intersect thread time: " +
+                    cli::format_duration(nanosecs(stats.intersect_time)));
+    cli::print_info("shading thread time: " +
+                    cli::format_duration(nanosecs(std::max(
+                        stats.sample_time - stats.intersect_time, 0.0))));
+    auto memory = trc::get_scene_memory(scene);
+    auto kb     = [](size_t bytes) { return cli::format_num(bytes / 1024); };
+    cli::print_info("shapes memory: " + kb(memory.shapes) + " kb");
+    cli::print_info("bvhs memory: " + kb(memory.bvhs) + " kb");
+    cli::print_info("lights memory: " + kb(memory.lights) + " kb");
+    cli::print_info("textures memory: " + kb(memory.textures) + " kb");
+    cli::print_info("volumes memory: " + kb(memory.volumes) + " kb");
+    cli::print_info("embree memory: " + kb(memory.embree) + " kb");
+    cli::print_info("scene memory: " + kb(memory.total) + " kb");
+    cli::print_info("state memory: " +
+                    kb(trc::get_state_memory(camera, params)) + " kb");
+  };
+
+  // render partial
+  render_start = cli::get_time_();
+  if (!options.ptfilename.empty()) {
+    cli::begin_timeline("render");
+    auto pixels = trc::trace_partial(
+        scene, camera, params, cli::print_progress, image_cb);
+    cli::end_timeline();
+    stats_info();
+    wait_batch();
+    cli::print_progress("save partial", 0, 1);
+    if (!save_partial(options.ptfilename, pixels, error)) return false;
+    cli::print_progress("save partial", 1, 1);
+    return true;
+  }
+
   // render
-  auto render = trc::trace_image(scene, camera, params, cli::print_progress,
-      [save_batch, imfilename](
-          const img::image<vec4f>& render, int sample, int samples) {
-        if (!save_batch) return;
-        auto ext = "-s" + std::to_string(sample + samples) +
-                   sfs::path(imfilename).extension().string();
-        auto outfilename =
-            sfs::path(imfilename).replace_extension(ext).string();
-        auto ioerror = ""s;
-        cli::print_progress("save image", sample, samples);
-        if (!save_image(outfilename, render, ioerror))
-          cli::print_fatal(ioerror);
-      });
+  cli::begin_timeline("render");
+  auto samples = 0;
+  auto aovs    = std::vector<img::image<vec4f>>{};
+  auto render  = params.aovs.empty()
+                    ? trc::trace_image(scene, camera, params, samples,
+                          cli::print_progress, image_cb)
+                    : trc::trace_image(scene, camera, params, aovs,
+                          cli::print_progress, image_cb);
+  cli::end_timeline();
+  if (params.timebudget > 0 && params.aovs.empty())
+    cli::print_info("samples traced: " + std::to_string(samples));
+  stats_info();
+  wait_batch();
+
+  // paste the crop into the full frame
+  if (!options.crop_into.empty()) {
+    auto frame = img::image<vec4f>{};
+    if (!load_image(options.crop_into, frame, error)) return false;
+    if (frame.size() != trc::get_render_size(camera, params)) {
+      error = options.crop_into + ": image does not match render size";
+      return false;
+    }
+    auto crop = trc::get_render_crop(camera, params);
+    img::set_region(frame, render, {crop.x, crop.y});
+    render = std::move(frame);
+  }
 
   // save image
-  cli::print_progress("save image", 0, 1);
-  if (!save_image(imfilename, render, ioerror)) cli::print_fatal(ioerror);
-  cli::print_progress("save image", 1, 1);
+  cli::print_progress("save image", 0, 1 + (int)aovs.size());
+  if (!save_image(imfilename, render, error)) return false;
+  for (auto idx = 0; idx < aovs.size(); idx++) {
+    cli::print_progress("save image", 1 + idx, 1 + (int)aovs.size());
+    auto ext = "." + trc::falsecolor_names[(int)params.aovs[idx]] +
+               sfs::path(imfilename).extension().string();
+    auto aovfilename = sfs::path(imfilename).replace_extension(ext).string();
+    if (!save_image(aovfilename, aovs[idx], error)) return false;
+  }
+  cli::print_progress("save image", 1 + (int)aovs.size(), 1 + (int)aovs.size());
+  return true;
+}
+
+// Render a job once for each camera in its list, or for its camera if the
+// list is empty. Images of each camera have its name before the extension.
+bool render_trace_cameras(trace_scene& tscene, const trace_options& options,
+    std::string& error) {
+  if (options.cameras.empty())
+    return render_trace_scene(tscene, options, error);
+
+  // camera names
+  auto names = std::vector<std::string>{};
+  if (options.cameras == "all") {
+    for (auto iocamera : tscene.cameras->cameras)
+      names.push_back(iocamera->name);
+  } else {
+    for (auto start = (size_t)0; start < options.cameras.size();) {
+      auto end = std::min(
+          options.cameras.find(',', start), options.cameras.size());
+      names.push_back(options.cameras.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  // render each camera, sharing the loaded scene
+  auto get_filename = [](const std::string& filename,
+                          const std::string& name) {
+    if (filename.empty()) return filename;
+    auto ext = "." + name + sfs::path(filename).extension().string();
+    return sfs::path(filename).replace_extension(ext).string();
+  };
+  for (auto& name : names) {
+    auto it = std::find_if(tscene.cameras->cameras.begin(),
+        tscene.cameras->cameras.end(),
+        [&name](auto iocamera) { return iocamera->name == name; });
+    if (it == tscene.cameras->cameras.end()) {
+      error = "unknown camera " + name;
+      return false;
+    }
+    cli::print_info("render camera " + name);
+    auto coptions        = options;
+    coptions.camera_name = name;
+    coptions.imfilename  = get_filename(options.imfilename, name);
+    coptions.ptfilename  = get_filename(options.ptfilename, name);
+    if (!render_trace_scene(tscene, coptions, error)) return false;
+  }
+  return true;
+}
+
+// Keyframed frames of an object or camera, with times in frame numbers
+struct trace_track {
+  std::string          name   = "";
+  std::vector<float>   times  = {};
+  std::vector<frame3f> frames = {};
+};
+
+// Animation of objects and cameras, rendered as a sequence of frames
+struct trace_animation {
+  int                      frames  = 0;
+  std::vector<trace_track> objects = {};
+  std::vector<trace_track> cameras = {};
+};
+
+// Load an animation from a json file with "objects" and "cameras" mapping
+// names to "times" and "frames" arrays, and an optional number of "frames".
+bool load_animation(const std::string& filename, trace_animation& animation,
+    std::string& error) {
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto fs = std::ifstream(filename);
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  try {
+    auto js     = nlohmann::json::parse(fs);
+    auto tracks = [&js](const std::string& group) {
+      auto tracks = std::vector<trace_track>{};
+      if (!js.contains(group)) return tracks;
+      for (auto& [name, ejs] : js.at(group).items()) {
+        auto& track = tracks.emplace_back();
+        track.name  = name;
+        ejs.at("times").get_to(track.times);
+        for (auto& fjs : ejs.at("frames")) {
+          auto values = fjs.get<std::array<float, 12>>();
+          track.frames.push_back((const frame3f&)values);
+        }
+      }
+      return tracks;
+    };
+    animation.frames  = js.value("frames", 0);
+    animation.objects = tracks("objects");
+    animation.cameras = tracks("cameras");
+  } catch (...) {
+    return parse_error();
+  }
+  for (auto& track : animation.objects) {
+    if (track.times.empty() || track.times.size() != track.frames.size())
+      return parse_error();
+    animation.frames = std::max(animation.frames, (int)track.times.back() + 1);
+  }
+  for (auto& track : animation.cameras) {
+    if (track.times.empty() || track.times.size() != track.frames.size())
+      return parse_error();
+    animation.frames = std::max(animation.frames, (int)track.times.back() + 1);
+  }
+  return true;
+}
+
+// Evaluate a track at a time, interpolating frames linearly and making them
+// rigid again
+frame3f eval_track(const trace_track& track, float time) {
+  if (time <= track.times.front()) return track.frames.front();
+  if (time >= track.times.back()) return track.frames.back();
+  auto idx = (int)(std::upper_bound(
+                       track.times.begin(), track.times.end(), time) -
+                   track.times.begin());
+  auto t   = (time - track.times[idx - 1]) /
+           (track.times[idx] - track.times[idx - 1]);
+  auto& a  = track.frames[idx - 1];
+  auto& b  = track.frames[idx];
+  return frame_fromzx(lerp(a.o, b.o, t), lerp(a.z, b.z, t), lerp(a.x, b.x, t));
+}
+
+// Render an animation one frame at a time. Between frames, the moved
+// objects are updated with update_bvh, and the lights are rebuilt only if
+// they include moved objects. Images of each frame have the frame number
+// before the extension.
+bool render_trace_animation(trace_scene& tscene, const trace_options& options,
+    std::string& error) {
+  auto animation = trace_animation{};
+  if (!load_animation(options.animation, animation, error)) return false;
+  if (options.frames > 0) animation.frames = options.frames;
+  auto scene = tscene.scene.get();
+
+  // objects and cameras of the tracks
+  auto objects = std::vector<trc::object*>{};
+  for (auto& track : animation.objects) {
+    auto it = std::find(
+        tscene.object_names.begin(), tscene.object_names.end(), track.name);
+    if (it == tscene.object_names.end()) {
+      error = "unknown object " + track.name;
+      return false;
+    }
+    objects.push_back(scene->objects[it - tscene.object_names.begin()]);
+  }
+  auto cameras = std::vector<trc::camera*>{};
+  for (auto& track : animation.cameras) {
+    auto it = std::find_if(tscene.cameras->cameras.begin(),
+        tscene.cameras->cameras.end(),
+        [&track](auto iocamera) { return iocamera->name == track.name; });
+    if (it == tscene.cameras->cameras.end()) {
+      error = "unknown camera " + track.name;
+      return false;
+    }
+    cameras.push_back(scene->cameras[it - tscene.cameras->cameras.begin()]);
+  }
+  auto emissive = std::any_of(objects.begin(), objects.end(),
+      [](trc::object* object) {
+        return object->material &&
+               (max(object->material->emission) > 0 ||
+                   object->material->emission_tex);
+      });
+
+  // render frames
+  for (auto frame = 0; frame < animation.frames; frame++) {
+    cli::print_info("render frame " + std::to_string(frame));
+    for (auto idx = 0; idx < objects.size(); idx++) {
+      set_frame(objects[idx], eval_track(animation.objects[idx], frame));
+    }
+    if (!objects.empty()) {
+      cli::begin_timeline("update bvh");
+      update_bvh(scene, objects, {}, {}, options.params);
+      cli::end_timeline();
+      if (emissive) {
+        cli::begin_timeline("init lights");
+        init_lights(scene);
+        cli::end_timeline();
+      }
+    }
+    for (auto idx = 0; idx < cameras.size(); idx++) {
+      set_frame(cameras[idx], eval_track(animation.cameras[idx], frame));
+    }
+    auto get_filename = [frame](const std::string& filename) {
+      if (filename.empty()) return filename;
+      char number[16];
+      snprintf(number, sizeof(number), ".%04d", frame);
+      auto ext = number + sfs::path(filename).extension().string();
+      return sfs::path(filename).replace_extension(ext).string();
+    };
+    auto foptions       = options;
+    foptions.imfilename = get_filename(options.imfilename);
+    foptions.ptfilename = get_filename(options.ptfilename);
+    if (!render_trace_cameras(tscene, foptions, error)) return false;
+  }
+  return true;
+}
+
+// Render jobs read from stdin, one per line with the same options of the
+// command line, that are used as defaults. Loaded scenes are kept for later
+// jobs, evicting the least recently used ones over the memory budget.
+void run_server(const trace_options& defaults, size_t budget) {
+  auto tscenes = std::vector<std::unique_ptr<trace_scene>>{};
+  auto line    = ""s;
+  while (std::getline(std::cin, line)) {
+    // parse job
+    auto args = std::vector<std::string>{"yscntrace"};
+    auto sstr = std::istringstream{line};
+    for (auto arg = ""s; sstr >> arg;) args.push_back(arg);
+    if (args.size() == 1 || args[1].front() == '#') continue;
+    auto argv = std::vector<const char*>{};
+    for (auto& arg : args) argv.push_back(arg.c_str());
+    auto options       = defaults;
+    options.filenames  = {};
+    auto cli           = cli::make_cli("yscntrace", "Render job");
+    auto error         = ""s;
+    add_options(cli, options);
+    if (!parse_cli(cli, (int)argv.size(), argv.data(), error)) {
+      cli::print_info("job failed: " + error);
+      continue;
+    }
+    if (options.filenames.size() != 1 || options.merge) {
+      cli::print_info("job failed: one scene is required");
+      continue;
+    }
+
+    // find the scene, or load it evicting the least recently used ones
+    auto key = get_scene_key(options);
+    auto it  = std::find_if(tscenes.begin(), tscenes.end(),
+        [&key](auto& tscene) { return tscene->key == key; });
+    if (it != tscenes.end()) {
+      std::rotate(it, it + 1, tscenes.end());
+      trc::reset_trace_stats();
+    } else {
+      auto tscene = std::make_unique<trace_scene>();
+      if (!load_trace_scene(*tscene, options, error)) {
+        cli::print_info("job failed: " + error);
+        continue;
+      }
+      tscenes.push_back(std::move(tscene));
+      auto memory = (size_t)0;
+      for (auto& tscene : tscenes) memory += tscene->memory;
+      while (memory > budget && tscenes.size() > 1) {
+        memory -= tscenes.front()->memory;
+        tscenes.erase(tscenes.begin());
+      }
+    }
+
+    // render
+    auto rendered = options.animation.empty()
+                        ? render_trace_cameras(*tscenes.back(), options, error)
+                        : render_trace_animation(
+                              *tscenes.back(), options, error);
+    if (!rendered) {
+      cli::print_info("job failed: " + error);
+      continue;
+    }
+    cli::print_info("job done: " + (options.ptfilename.empty()
+                                           ? options.imfilename
+                                           : options.ptfilename));
+    fflush(stdout);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  // options
+  auto options       = trace_options{};
+  auto server        = false;
+  auto server_budget = 4096;
+  auto affinity      = common::thread_affinity::none;
+
+  // parse command line
+  auto cli = cli::make_cli("yscntrace", "Offline path tracing");
+  add_options(cli, options);
+  add_option(cli, "--server/--no-server", server,
+      "Render jobs read from stdin, one per line, keeping scenes loaded");
+  add_option(cli, "--server-budget", server_budget,
+      "Memory budget of the scenes kept loaded, in megabytes");
+  add_option(cli, "--affinity", affinity, "Render thread affinity.",
+      common::thread_affinity_names);
+  parse_cli(cli, argc, argv);
+
+  // thread placement
+  common::set_thread_affinity(affinity);
+
+  // server
+  if (server) {
+    run_server(options, (size_t)server_budget * 1024 * 1024);
+    return 0;
+  }
+
+  // timeline
+  auto& tlfilename = options.tlfilename;
+  if (!tlfilename.empty()) cli::start_timeline();
+  auto save_timeline = [&tlfilename]() {
+    if (tlfilename.empty()) return;
+    auto error = ""s;
+    if (!cli::save_timeline(tlfilename, error)) cli::print_fatal(error);
+  };
+
+  // merge partial renders
+  auto ioerror = ""s;
+  if (options.merge) {
+    auto pixels = img::image<trc::pixel>{};
+    for (auto& filename : options.filenames) {
+      auto partial = img::image<trc::pixel>{};
+      if (!load_partial(filename, partial, ioerror)) cli::print_fatal(ioerror);
+      if (!pixels.empty() && partial.size() != pixels.size())
+        cli::print_fatal(filename + ": different image size");
+      merge_partial(pixels, partial);
+    }
+    cli::print_progress("save image", 0, 1);
+    if (!save_image(options.imfilename, get_partial_render(pixels), ioerror))
+      cli::print_fatal(ioerror);
+    cli::print_progress("save image", 1, 1);
+    save_timeline();
+    return 0;
+  }
+  if (options.filenames.size() != 1) cli::print_fatal("one scene is required");
+
+  // load and render, once for each camera if requested
+  auto tscene = trace_scene{};
+  if (!load_trace_scene(tscene, options, ioerror)) cli::print_fatal(ioerror);
+  if (options.animation.empty()) {
+    if (!render_trace_cameras(tscene, options, ioerror))
+      cli::print_fatal(ioerror);
+  } else {
+    if (!render_trace_animation(tscene, options, ioerror))
+      cli::print_fatal(ioerror);
+  }
+  save_timeline();
 
   // done
   return 0;
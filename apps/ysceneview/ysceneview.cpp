@@ -39,6 +39,7 @@ namespace gui = yocto::gui;
 #include <atomic>
 #include <deque>
 #include <future>
+#include <mutex>
 using namespace std::string_literals;
 
 #include "ext/filesystem.hpp"
@@ -91,9 +92,24 @@ struct app_state {
   std::atomic<int>  total        = 0;
   std::string       loader_error = "";
 
+  // streaming preview, drawn with a placeholder material while loading
+  sio::model*  preview          = new sio::model{};
+  gui::scene*  glpreview        = new gui::scene{};
+  gui::camera* glpreview_camera = nullptr;
+  bbox3f       preview_bbox     = invalidb3f;
+  int          preview_freed    = 0;
+  std::mutex   preview_mutex    = {};
+  std::unordered_map<const sio::shape*, sio::shape*>       preview_shapes = {};
+  std::unordered_map<const sio::instance*, sio::instance*> preview_instances =
+      {};
+  std::unordered_map<sio::shape*, gui::shape*>       glpreview_shapes    = {};
+  std::unordered_map<sio::instance*, gui::instance*> glpreview_instances = {};
+
   ~app_state() {
     if (ioscene) delete ioscene;
     if (glscene) delete glscene;
+    if (preview) delete preview;
+    if (glpreview) delete glpreview;
   }
 };
 
@@ -105,7 +121,9 @@ struct app_states {
   std::deque<app_state*>  loading  = {};
 
   // default options
-  gui::scene_params drawgl_prms = {};
+  gui::scene_params drawgl_prms   = {};
+  size_t            upload_budget = 32 << 20;  // bytes uploaded per frame
+  bool              pack          = false;     // pack shapes once uploaded
 
   // cleanup
   ~app_states() {
@@ -113,6 +131,55 @@ struct app_states {
   }
 };
 
+// Copy the geometry of a streamed object to the preview, with the camera
+// used to view it. Textures are skipped, since the preview draws all objects
+// with a placeholder material.
+void stream_preview(app_state* app, const std::string& camera_name,
+    const sio::camera* iocamera, const sio::object* ioobject) {
+  auto lock    = std::lock_guard<std::mutex>{app->preview_mutex};
+  auto preview = app->preview;
+  if (iocamera) {
+    if (preview->cameras.empty()) {
+      *add_camera(preview) = *iocamera;
+    } else if (!camera_name.empty() && iocamera->name == camera_name) {
+      *preview->cameras.front() = *iocamera;
+    }
+  }
+  if (!ioobject || !ioobject->shape) return;
+  auto& shape = app->preview_shapes[ioobject->shape];
+  if (!shape) {
+    shape            = add_shape(preview);
+    shape->points    = ioobject->shape->points;
+    shape->lines     = ioobject->shape->lines;
+    shape->triangles = ioobject->shape->triangles;
+    shape->quads     = ioobject->shape->quads;
+    shape->positions = ioobject->shape->positions;
+    shape->normals   = ioobject->shape->normals;
+    for (auto p : shape->positions) shape->bounds = merge(shape->bounds, p);
+  }
+  auto instance = (sio::instance*)nullptr;
+  if (ioobject->instance) {
+    auto& preview_instance = app->preview_instances[ioobject->instance];
+    if (!preview_instance) {
+      preview_instance         = add_instance(preview);
+      preview_instance->frames = ioobject->instance->frames;
+    }
+    instance = preview_instance;
+  }
+  auto object      = add_object(preview);
+  object->frame    = ioobject->frame;
+  object->shape    = shape;
+  object->instance = instance;
+  if (instance) {
+    for (auto& frame : instance->frames)
+      app->preview_bbox = merge(app->preview_bbox,
+          transform_bbox(frame * object->frame, shape->bounds));
+  } else {
+    app->preview_bbox = merge(
+        app->preview_bbox, transform_bbox(object->frame, shape->bounds));
+  }
+}
+
 void load_scene_async(app_states* apps, const std::string& filename,
     const std::string& camera_name = "") {
   auto app         = apps->states.emplace_back(new app_state{});
@@ -128,8 +195,13 @@ void load_scene_async(app_states* apps, const std::string& filename,
       app->current = current;
       app->total   = total;
     };
-    if (!load_scene(
-            app->filename, app->ioscene, app->loader_error, progress_cb))
+    auto asset_cb = [app, camera_name](const sio::camera* iocamera,
+                        const sio::object*                ioobject,
+                        const sio::texture*               iotexture) {
+      stream_preview(app, camera_name, iocamera, ioobject);
+    };
+    if (!load_scene(app->filename, app->ioscene, app->loader_error,
+            progress_cb, false, false, false, asset_cb))
       return;
     app->iocamera = get_camera(app->ioscene, camera_name);
   });
@@ -167,6 +239,76 @@ void update_lights(gui::scene* glscene, sio::model* ioscene) {
   }
 }
 
+// Upload the objects streamed to the preview since the last update, and
+// free their geometry once uploaded. The camera is the scene one, if already
+// parsed, or one that frames the objects streamed so far.
+void update_glpreview(app_state* app, size_t budget) {
+  auto lock      = std::lock_guard<std::mutex>{app->preview_mutex};
+  auto preview   = app->preview;
+  auto glpreview = app->glpreview;
+  if (preview->objects.empty()) return;
+
+  // placeholder material and camera
+  if (glpreview->materials.empty()) {
+    init_scene(glpreview);
+    auto glmaterial = add_material(glpreview);
+    set_color(glmaterial, {0.8, 0.8, 0.8});
+    set_roughness(glmaterial, 0.5);
+    app->glpreview_camera = add_camera(glpreview);
+  }
+  auto iocamera = sio::camera{};
+  if (!preview->cameras.empty()) {
+    iocamera = *preview->cameras.front();
+  } else if (app->preview_bbox.min.x <= app->preview_bbox.max.x) {
+    auto center   = (app->preview_bbox.max + app->preview_bbox.min) / 2;
+    auto radius   = length(app->preview_bbox.max - app->preview_bbox.min) / 2;
+    auto distance = 2 * radius * iocamera.lens /
+                    (iocamera.film / iocamera.aspect);
+    iocamera.frame = lookat_frame(
+        center + vec3f{0, 0, distance}, center, {0, 1, 0});
+  }
+  set_frame(app->glpreview_camera, iocamera.frame);
+  set_lens(app->glpreview_camera, iocamera.lens, iocamera.aspect,
+      iocamera.film);
+  set_nearfar(app->glpreview_camera, 0.001, 10000);
+
+  // shapes, instances and objects, in the order they were streamed
+  for (auto idx = glpreview->shapes.size(); idx < preview->shapes.size();
+       idx++) {
+    auto ioshape = preview->shapes[idx];
+    auto glshape = add_shape(glpreview);
+    queue_shape(glpreview, glshape, ioshape->points, ioshape->lines,
+        ioshape->triangles, ioshape->quads, ioshape->positions,
+        ioshape->normals, ioshape->texcoords, ioshape->colors);
+    app->glpreview_shapes[ioshape] = glshape;
+  }
+  for (auto idx = glpreview->instances.size(); idx < preview->instances.size();
+       idx++) {
+    auto ioinstance = preview->instances[idx];
+    auto glinstance = add_instance(glpreview);
+    set_frames(glinstance, ioinstance->frames);
+    app->glpreview_instances[ioinstance] = glinstance;
+  }
+  for (auto idx = glpreview->objects.size(); idx < preview->objects.size();
+       idx++) {
+    auto ioobject = preview->objects[idx];
+    auto globject = add_object(glpreview);
+    set_frame(globject, ioobject->frame);
+    set_shape(globject, app->glpreview_shapes.at(ioobject->shape));
+    set_material(globject, glpreview->materials.front());
+    if (ioobject->instance)
+      set_instance(globject, app->glpreview_instances.at(ioobject->instance));
+  }
+
+  // free the geometry once on the GPU
+  if (process_uploads(glpreview, budget)) return;
+  for (auto idx = app->preview_freed; idx < (int)preview->shapes.size();
+       idx++) {
+    *preview->shapes[idx] = sio::shape{};
+  }
+  app->preview_freed = (int)preview->shapes.size();
+}
+
 void init_glscene(gui::scene* glscene, sio::model* ioscene,
     gui::camera*& glcamera, sio::camera* iocamera,
     sio::progress_callback progress_cb) {
@@ -192,20 +334,20 @@ void init_glscene(gui::scene* glscene, sio::model* ioscene,
     camera_map[iocamera] = camera;
   }
 
-  // textures
+  // textures, uploaded progressively
   auto texture_map     = std::unordered_map<sio::texture*, gui::texture*>{};
   texture_map[nullptr] = nullptr;
   for (auto iotexture : ioscene->textures) {
     if (progress_cb) progress_cb("convert texture", progress.x++, progress.y);
     auto gltexture = add_texture(glscene);
     if (!iotexture->colorf.empty()) {
-      set_texture(gltexture, iotexture->colorf);
+      queue_texture(glscene, gltexture, iotexture->colorf);
     } else if (!iotexture->colorb.empty()) {
-      set_texture(gltexture, iotexture->colorb);
+      queue_texture(glscene, gltexture, iotexture->colorb);
     } else if (!iotexture->scalarf.empty()) {
-      set_texture(gltexture, iotexture->scalarf);
+      queue_texture(glscene, gltexture, iotexture->scalarf);
     } else if (!iotexture->scalarb.empty()) {
-      set_texture(gltexture, iotexture->scalarb);
+      queue_texture(glscene, gltexture, iotexture->scalarb);
     }
     texture_map[iotexture] = gltexture;
   }
@@ -239,21 +381,15 @@ void init_glscene(gui::scene* glscene, sio::model* ioscene,
     tesselate_subdiv(ioscene, iosubdiv);
   }
 
-  // shapes
+  // shapes, uploaded progressively
   auto shape_map     = std::unordered_map<sio::shape*, gui::shape*>{};
   shape_map[nullptr] = nullptr;
   for (auto ioshape : ioscene->shapes) {
     if (progress_cb) progress_cb("convert shape", progress.x++, progress.y);
     auto glshape = add_shape(glscene);
-    set_positions(glshape, ioshape->positions);
-    set_normals(glshape, ioshape->normals);
-    set_texcoords(glshape, ioshape->texcoords);
-    set_colors(glshape, ioshape->colors);
-    set_points(glshape, ioshape->points);
-    set_lines(glshape, ioshape->lines);
-    set_triangles(glshape, ioshape->triangles);
-    set_quads(glshape, ioshape->quads);
-    set_edges(glshape, ioshape->triangles, ioshape->quads);
+    queue_shape(glscene, glshape, ioshape->points, ioshape->lines,
+        ioshape->triangles, ioshape->quads, ioshape->positions,
+        ioshape->normals, ioshape->texcoords, ioshape->colors);
     shape_map[ioshape] = glshape;
   }
 
@@ -516,6 +652,8 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
     draw_checkbox(win, "edges", params.edges);
     continue_line(win);
     draw_checkbox(win, "double sided", params.double_sided);
+    continue_line(win);
+    draw_checkbox(win, "culling", params.culling);
     draw_slider(win, "exposure", params.exposure, -10, 10);
     draw_slider(win, "gamma", params.gamma, 0.1f, 4);
     draw_slider(win, "near", params.near, 0.01f, 1.0f);
@@ -667,8 +805,19 @@ void draw_widgets(gui::window* win, app_states* apps, const gui::input& input) {
 
 // draw with shading
 void draw(gui::window* win, app_states* apps, const gui::input& input) {
-  if (!apps->selected || !apps->selected->ok) return;
+  if (!apps->selected) return;
   auto app = apps->selected;
+  if (!app->ok) {
+    // draw the streamed objects with camera lights, since the scene lights
+    // are not loaded yet
+    if (!app->glpreview || !app->glpreview_camera) return;
+    auto params = app->drawgl_prms;
+    if (params.shading == gui::shading_type::lights)
+      params.shading = gui::shading_type::camlights;
+    draw_scene(app->glpreview, app->glpreview_camera,
+        input.framebuffer_viewport, params);
+    return;
+  }
   if (app->drawgl_prms.shading == gui::shading_type::lights)
     update_lights(app->glscene, app->ioscene);
   draw_scene(app->glscene, app->glcamera, input.framebuffer_viewport,
@@ -682,10 +831,20 @@ void update(gui::window* win, app_states* apps) {
                                  std::future_status::ready;
   };
 
+  // stream the objects of the scenes still loading
+  for (auto app : apps->loading) {
+    if (app->glpreview) update_glpreview(app, apps->upload_budget);
+  }
+
   while (!apps->loading.empty()) {
     auto app = apps->loading.front();
     if (!is_ready(app->loader)) break;
     apps->loading.pop_front();
+    delete app->preview;
+    delete app->glpreview;
+    app->preview          = nullptr;
+    app->glpreview        = nullptr;
+    app->glpreview_camera = nullptr;
     auto progress_cb = [app](
                            const std::string& message, int current, int total) {
       app->current = current;
@@ -697,12 +856,23 @@ void update(gui::window* win, app_states* apps) {
           progress_cb);
       update_lights(app->glscene, app->ioscene);
       app->ok     = true;
-      app->status = "ok";
+      app->status = "upload";
     } else {
       app->status = "error";
       app->error  = app->loader_error;
     }
   }
+
+  // stream loaded scenes to the GPU a bit each frame
+  for (auto app : apps->states) {
+    if (!app->ok || app->status != "upload") continue;
+    if (!process_uploads(app->glscene, apps->upload_budget)) {
+      if (apps->pack) pack_shapes(app->glscene);
+      app->status = "ok";
+    }
+    app->current = (int)(app->glscene->uploaded >> 20);
+    app->total   = (int)(app->glscene->upload_total >> 20);
+  }
 }
 
 int main(int argc, const char* argv[]) {
@@ -717,6 +887,8 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--camera", camera_name, "Camera name.");
   add_option(cli, "--resolution,-r", apps->drawgl_prms.resolution,
       "Image resolution.");
+  add_option(cli, "--pack/--no-pack", apps->pack,
+      "Pack shapes in shared buffers.");
   add_option(cli, "--shading", apps->drawgl_prms.shading, "Shading type.",
       gui::shading_names);
   add_option(cli, "scenes", filenames, "Scene filenames", true);
@@ -728,7 +900,10 @@ int main(int argc, const char* argv[]) {
   // callbacks
   auto callbacks     = gui::ui_callbacks{};
   callbacks.clear_cb = [apps](gui::window* win, const gui::input& input) {
-    for (auto app : apps->states) clear_scene(app->glscene);
+    for (auto app : apps->states) {
+      clear_scene(app->glscene);
+      if (app->glpreview) clear_scene(app->glpreview);
+    }
   };
   callbacks.draw_cb = [apps](gui::window* win, const gui::input& input) {
     draw(win, apps, input);
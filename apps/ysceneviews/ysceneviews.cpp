@@ -62,7 +62,9 @@ struct app_state {
   std::string name      = "";
 
   // options
-  gui::scene_params drawgl_prms = {};
+  gui::scene_params drawgl_prms   = {};
+  size_t            upload_budget = 32 << 20;  // bytes uploaded per frame
+  bool              pack          = false;     // pack shapes once uploaded
 
   // scene
   sio::model*  ioscene  = new sio::model{};
@@ -152,20 +154,20 @@ void init_glscene(gui::scene* glscene, sio::model* ioscene,
     camera_map[iocamera] = camera;
   }
 
-  // textures
+  // textures, uploaded progressively
   auto texture_map     = std::unordered_map<sio::texture*, gui::texture*>{};
   texture_map[nullptr] = nullptr;
   for (auto iotexture : ioscene->textures) {
     if (progress_cb) progress_cb("convert texture", progress.x++, progress.y);
     auto gltexture = add_texture(glscene);
     if (!iotexture->colorf.empty()) {
-      set_texture(gltexture, iotexture->colorf);
+      queue_texture(glscene, gltexture, iotexture->colorf);
     } else if (!iotexture->colorb.empty()) {
-      set_texture(gltexture, iotexture->colorb);
+      queue_texture(glscene, gltexture, iotexture->colorb);
     } else if (!iotexture->scalarf.empty()) {
-      set_texture(gltexture, iotexture->scalarf);
+      queue_texture(glscene, gltexture, iotexture->scalarf);
     } else if (!iotexture->scalarb.empty()) {
-      set_texture(gltexture, iotexture->scalarb);
+      queue_texture(glscene, gltexture, iotexture->scalarb);
     }
     texture_map[iotexture] = gltexture;
   }
@@ -199,21 +201,15 @@ void init_glscene(gui::scene* glscene, sio::model* ioscene,
     tesselate_subdiv(ioscene, iosubdiv);
   }
 
-  // shapes
+  // shapes, uploaded progressively
   auto shape_map     = std::unordered_map<sio::shape*, gui::shape*>{};
   shape_map[nullptr] = nullptr;
   for (auto ioshape : ioscene->shapes) {
     if (progress_cb) progress_cb("convert shape", progress.x++, progress.y);
     auto glshape = add_shape(glscene);
-    set_positions(glshape, ioshape->positions);
-    set_normals(glshape, ioshape->normals);
-    set_texcoords(glshape, ioshape->texcoords);
-    set_colors(glshape, ioshape->colors);
-    set_points(glshape, ioshape->points);
-    set_lines(glshape, ioshape->lines);
-    set_triangles(glshape, ioshape->triangles);
-    set_quads(glshape, ioshape->quads);
-    set_edges(glshape, ioshape->triangles, ioshape->quads);
+    queue_shape(glscene, glshape, ioshape->points, ioshape->lines,
+        ioshape->triangles, ioshape->quads, ioshape->positions,
+        ioshape->normals, ioshape->texcoords, ioshape->colors);
     shape_map[ioshape] = glshape;
   }
 
@@ -255,6 +251,8 @@ int main(int argc, const char* argv[]) {
   add_option(cli, "--camera", camera_name, "Camera name.");
   add_option(
       cli, "--resolution,-r", app->drawgl_prms.resolution, "Image resolution.");
+  add_option(cli, "--pack/--no-pack", app->pack,
+      "Pack shapes in shared buffers.");
   add_option(cli, "--shading", app->drawgl_prms.shading, "Eyelight rendering.",
       gui::shading_names);
   add_option(cli, "scene", app->filename, "Scene filename", true);
@@ -303,13 +301,21 @@ int main(int argc, const char* argv[]) {
     draw_checkbox(win, "edges", params.edges);
     continue_line(win);
     draw_checkbox(win, "double sided", params.double_sided);
+    continue_line(win);
+    draw_checkbox(win, "culling", params.culling);
     draw_slider(win, "exposure", params.exposure, -10, 10);
     draw_slider(win, "gamma", params.gamma, 0.1f, 4);
     draw_slider(win, "near", params.near, 0.01f, 1.0f);
     draw_slider(win, "far", params.far, 1000.0f, 10000.0f);
   };
   callbacks.update_cb = [app](gui::window* win, const gui::input& input) {
-    // update(win, apps);
+    // stream the scene to the GPU a bit each frame
+    if (app->glscene->uploads.empty()) return;
+    auto uploading = process_uploads(app->glscene, app->upload_budget);
+    if (!uploading && app->pack) pack_shapes(app->glscene);
+    app->status    = uploading ? "upload scene" : "ok";
+    app->current   = (int)(app->glscene->uploaded >> 20);
+    app->total     = (int)(app->glscene->upload_total >> 20);
   };
   callbacks.uiupdate_cb = [app](gui::window* win, const gui::input& input) {
     // handle mouse and keyboard for navigation
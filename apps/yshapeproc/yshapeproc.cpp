@@ -27,9 +27,13 @@
 //
 
 #include <yocto/yocto_commonio.h>
+#include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_ply.h>
 #include <yocto/yocto_shape.h>
 using namespace yocto::math;
+namespace img = yocto::image;
+namespace ply = yocto::ply;
 namespace shp = yocto::shape;
 namespace cli = yocto::commonio;
 
@@ -270,6 +274,48 @@ bool make_shape_preset(vector<vec4i>& quadspos, std::vector<vec4i>& quadsnorm,
   return true;
 }
 
+// Transform the vertices of a ply in batches, copying the other elements,
+// so that large files are processed with bounded memory.
+bool stream_ply_shape(const std::string& filename, const std::string& output,
+    const frame3f& xform, bool non_rigid, std::string& error) {
+  auto type_error = false;
+  auto transform  = [&](ply::element* element, const std::string& name,
+                       size_t count, bool normals) {
+    auto props = std::array<ply::property*, 3>{};
+    for (auto prop : element->properties) {
+      for (auto axis = 0; axis < 3; axis++) {
+        if (prop->name == name + "xyz"[axis]) props[axis] = prop;
+      }
+    }
+    if (!props[0] || !props[1] || !props[2]) return;
+    for (auto prop : props) {
+      if (prop->type != ply::property::type_t::f32 || prop->is_list)
+        type_error = true;
+    }
+    if (type_error) return;
+    for (auto idx = (size_t)0; idx < count; idx++) {
+      auto value = vec3f{props[0]->data_f32[idx], props[1]->data_f32[idx],
+          props[2]->data_f32[idx]};
+      value      = normals ? transform_normal(xform, value, non_rigid)
+                           : transform_point(xform, value);
+      for (auto axis = 0; axis < 3; axis++)
+        props[axis]->data_f32[idx] = value[axis];
+    }
+  };
+  if (!ply::stream_ply(filename, output, error, (size_t)1 << 20, false,
+          [&](ply::element* element, size_t start, size_t count) {
+            if (element->name != "vertex") return;
+            transform(element, "", count, false);
+            transform(element, "n", count, true);
+          }))
+    return false;
+  if (type_error) {
+    error = filename + ": vertex properties should be float";
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, const char* argv[]) {
   // command line parameters
   auto facevarying          = false;
@@ -289,6 +335,16 @@ int main(int argc, const char* argv[]) {
   auto num_geodesic_samples = 0;
   auto geodesic_scale       = 30.0f;
   auto slice                = false;
+  auto simplify             = 0;
+  auto simplify_error       = 0.0f;
+  auto num_lods             = 0;
+  auto sdf_filename         = ""s;
+  auto sdf_resolution       = 64;
+  auto sdf_band             = 2;
+  auto sdf_narrow_band      = false;
+  auto reorder              = false;
+  auto vertex_cache         = false;
+  auto stream               = false;
   auto output               = "out.ply"s;
   auto filename             = "mesh.ply"s;
 
@@ -318,10 +374,57 @@ int main(int argc, const char* argv[]) {
       "Number of sampled geodesic sources");
   add_option(cli, "--geodesic-scale", geodesic_scale, "Geodesic scale");
   add_option(cli, "--slice", slice, "Slice mesh along field isolines");
+  add_option(cli, "--simplify", simplify, "Simplify to a number of triangles");
+  add_option(cli, "--simplify-error", simplify_error,
+      "Maximum simplification error (0 for no bound)");
+  add_option(cli, "--lods", num_lods,
+      "Number of levels of detail saved as output_lod<n>, each with half the "
+      "triangles");
+  add_option(cli, "--sdf", sdf_filename, "Signed distance field volume");
+  add_option(cli, "--sdf-resolution", sdf_resolution,
+      "Distance field voxels along the largest axis");
+  add_option(cli, "--sdf-band", sdf_band, "Distance field exact band");
+  add_option(cli, "--sdf-narrow-band", sdf_narrow_band,
+      "Clamp distances to the band");
+  add_option(cli, "--reorder", reorder,
+      "Reorder elements and vertices for memory locality");
+  add_option(cli, "--vertex-cache", vertex_cache,
+      "Reorder triangles for the vertex cache when reordering");
+  add_option(cli, "--stream", stream,
+      "Transform ply files in batches, with bounded memory");
   add_option(cli, "--output,-o", output, "output mesh");
   add_option(cli, "mesh", filename, "input mesh", true);
   parse_cli(cli, argc, argv);
 
+  // transform
+  if (uscale != 1) scale *= uscale;
+  auto transformed = translate != zero3f || rotate != zero3f ||
+                     scale != vec3f{1};
+  auto xform       = translation_frame(translate) * scaling_frame(scale) *
+               rotation_frame({1, 0, 0}, radians(rotate.x)) *
+               rotation_frame({0, 0, 1}, radians(rotate.z)) *
+               rotation_frame({0, 1, 0}, radians(rotate.y));
+
+  // stream ply files, supporting only per-vertex transforms
+  if (stream) {
+    if (facevarying || positiononly || trianglesonly || smooth || faceted ||
+        info || geodesic_source >= 0 || p0 >= 0 || p1 >= 0 || p2 >= 0 ||
+        num_geodesic_samples > 0 || slice || simplify > 0 ||
+        simplify_error > 0 || num_lods > 0 || !sdf_filename.empty() ||
+        reorder)
+      cli::print_fatal("--stream only supports transforms");
+    if (sfs::path(filename).extension() != ".ply" ||
+        sfs::path(output).extension() != ".ply")
+      cli::print_fatal("--stream only supports ply files");
+    auto ioerror = ""s;
+    cli::print_progress("stream shape", 0, 1);
+    if (!stream_ply_shape(filename, output, transformed ? xform : identity3x4f,
+            max(scale) != min(scale), ioerror))
+      cli::print_fatal(ioerror);
+    cli::print_progress("stream shape", 1, 1);
+    return 0;
+  }
+
   // mesh data
   auto positions     = std::vector<vec3f>{};
   auto normals       = std::vector<vec3f>{};
@@ -397,19 +500,30 @@ int main(int argc, const char* argv[]) {
   }
 
   // transform
-  if (uscale != 1) scale *= uscale;
-  if (translate != zero3f || rotate != zero3f || scale != vec3f{1}) {
+  if (transformed) {
     cli::print_progress("transform shape", 0, 1);
-    auto xform = translation_frame(translate) * scaling_frame(scale) *
-                 rotation_frame({1, 0, 0}, radians(rotate.x)) *
-                 rotation_frame({0, 0, 1}, radians(rotate.z)) *
-                 rotation_frame({0, 1, 0}, radians(rotate.y));
     for (auto& p : positions) p = transform_point(xform, p);
     for (auto& n : normals)
       n = transform_normal(xform, n, max(scale) != min(scale));
     cli::print_progress("transform shape", 1, 1);
   }
 
+  // simplify
+  if (simplify > 0 || simplify_error > 0 || num_lods > 0) {
+    if (!quadspos.empty())
+      throw std::runtime_error("cannot simplify facevarying data");
+    if (!quads.empty()) {
+      triangles = shp::quads_to_triangles(quads);
+      quads     = {};
+    }
+  }
+  if (simplify > 0 || simplify_error > 0) {
+    cli::print_progress("simplify shape", 0, 1);
+    shp::simplify_triangles(triangles, positions, normals, texcoords, colors,
+        simplify, simplify_error > 0 ? simplify_error : flt_max);
+    cli::print_progress("simplify shape", 1, 1);
+  }
+
   // compute normals
   if (smooth) {
     cli::print_progress("smooth shape", 0, 1);
@@ -450,12 +564,19 @@ int main(int argc, const char* argv[]) {
     auto field = shp::compute_geodesic_distances(solver, sources);
 
     if (slice) {
-      auto tags = std::vector<int>(triangles.size(), 0);
-      shp::meandering_triangles(
-          field, geodesic_scale, 0, 1, 2, triangles, tags, positions, normals);
-      for (int i = 0; i < triangles.size(); i++) {
-        if (tags[i] == 1) triangles[i] = {-1, -1, -1};
+      auto split_triangles = std::vector<vec3i>{};
+      auto split_tags      = std::vector<int>{};
+      auto split_positions = std::vector<vec3f>{};
+      auto split_normals   = std::vector<vec3f>{};
+      shp::slice_triangles(split_triangles, split_tags, split_positions,
+          split_normals, triangles, positions, normals, field,
+          {geodesic_scale});
+      triangles.clear();
+      for (int i = 0; i < split_triangles.size(); i++) {
+        if (split_tags[i] == 1) triangles.push_back(split_triangles[i]);
       }
+      positions = split_positions;
+      normals   = split_normals;
     } else {
       colors = std::vector<vec3f>(positions.size());
       for (int i = 0; i < colors.size(); ++i) {
@@ -514,6 +635,31 @@ int main(int argc, const char* argv[]) {
     cli::print_progress("cut mesh", 1, 1);
   }
 
+  // reorder for memory locality
+  if (reorder) {
+    if (!quadspos.empty())
+      throw std::runtime_error("cannot reorder facevarying data");
+    cli::print_progress("reorder shape", 0, 1);
+    auto vertex_map = std::vector<int>{};
+    if (!points.empty()) {
+      vertex_map = shp::reorder_points(points, positions);
+    } else if (!lines.empty()) {
+      vertex_map = shp::reorder_lines(lines, positions);
+    } else if (!triangles.empty()) {
+      vertex_map = shp::reorder_triangles(triangles, positions, vertex_cache);
+    } else if (!quads.empty()) {
+      vertex_map = shp::reorder_quads(quads, positions);
+    }
+    if (!vertex_map.empty()) {
+      shp::reorder_vertices(positions, vertex_map);
+      shp::reorder_vertices(normals, vertex_map);
+      shp::reorder_vertices(texcoords, vertex_map);
+      shp::reorder_vertices(colors, vertex_map);
+      shp::reorder_vertices(radius, vertex_map);
+    }
+    cli::print_progress("reorder shape", 1, 1);
+  }
+
   if (info) {
     cli::print_info("shape stats ------------");
     auto stats = shp::shape_stats(points, lines, triangles, quads, quadspos,
@@ -535,6 +681,45 @@ int main(int argc, const char* argv[]) {
   }
   cli::print_progress("save shape", 1, 1);
 
+  // save distance field
+  if (!sdf_filename.empty()) {
+    cli::print_progress("save sdf", 0, 1);
+    if (!quadspos.empty())
+      throw std::runtime_error("cannot compute sdf of facevarying data");
+    auto distances = std::vector<float>{};
+    auto size      = zero3i;
+    auto bbox      = invalidb3f;
+    shp::make_sdf(distances, size, bbox,
+        quads.empty() ? triangles : shp::quads_to_triangles(quads), positions,
+        sdf_resolution, sdf_band, sdf_narrow_band);
+    if (!img::save_volume(
+            sdf_filename, img::volume<float>{size, distances.data()}, ioerror))
+      cli::print_fatal(ioerror);
+    cli::print_progress("save sdf", 1, 1);
+    auto format_vec = [](const vec3f& v) {
+      return std::to_string(v.x) + " " + std::to_string(v.y) + " " +
+             std::to_string(v.z);
+    };
+    cli::print_info(
+        "sdf bbox: " + format_vec(bbox.min) + " " + format_vec(bbox.max));
+  }
+
+  // save levels of detail
+  for (auto lod = 1; lod <= num_lods; lod++) {
+    cli::print_progress("save lods", lod - 1, num_lods);
+    shp::simplify_triangles(triangles, positions, normals, texcoords, colors,
+        (int)triangles.size() / 2,
+        simplify_error > 0 ? simplify_error : flt_max);
+    auto path     = sfs::path(output);
+    auto lodname  = path.stem().string() + "_lod" + std::to_string(lod) +
+                    path.extension().string();
+    if (!shp::save_shape(path.replace_filename(lodname).string(), points,
+            lines, triangles, quads, positions, normals, texcoords, colors,
+            radius, ioerror))
+      cli::print_fatal(ioerror);
+  }
+  if (num_lods > 0) cli::print_progress("save lods", num_lods, num_lods);
+
   // done
   return 0;
 }
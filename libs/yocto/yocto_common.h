@@ -13,6 +13,10 @@
 // Here we also define the vocabulary types used in the rest of Yocto/GL.
 //
 // 1. check whether a value is in a container with `contain()`
+// 2. use `flat_map` for a hash map with open addressing that stores its
+//    elements contiguously, for maps with many small keys
+// 3. use `arena` to allocate many objects of one type in blocks, and free
+//    them all at once
 //
 //
 // ## Python-like iterators and collection helpers
@@ -37,7 +41,13 @@
 // built on top of C++ low-level threading and synchronization.
 //
 // 1. use `concurrent_queue()` for communicationing values between threads
-// 2. use `parallel_for()` for basic parallel for loops
+// 2. use `parallel_for()` for basic parallel for loops, optionally passing
+//    a grain size to hand out indices in chunks
+// 3. parallel loops run on a global `thread_pool` that is created lazily on
+//    first use; set its size with `set_num_threads()` before running
+//    parallel work, or query it with `get_num_threads()`
+// 4. pin the pool threads to NUMA nodes or cores with `set_thread_affinity()`,
+//    and place buffers with `interleave_memory()` and `bind_memory()`
 //
 //
 // LICENSE:
@@ -74,14 +84,29 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // TIMING UTILITIES
 // -----------------------------------------------------------------------------
@@ -121,6 +146,82 @@ inline std::vector<T> operator+(const std::vector<T>& a, const T& b);
 
 }  // namespace yocto::common
 
+// -----------------------------------------------------------------------------
+// FLAT HASH MAP
+// -----------------------------------------------------------------------------
+namespace yocto::common {
+
+// A hash map with open addressing and linear probing. Elements are stored
+// contiguously in insertion order and are never erased, so inserting does
+// not allocate per element and iteration is deterministic. Hashes from
+// `std::hash` are mixed, so that simple integer hashes spread over the table.
+template <typename Key, typename Value>
+struct flat_map {
+  using value_type = std::pair<Key, Value>;
+
+  size_t size() const;
+  bool   empty() const;
+  void   clear();
+  void   reserve(size_t count);
+
+  // Find a value, returning nullptr if missing
+  Value*       find(const Key& key);
+  const Value* find(const Key& key) const;
+  // Insert a value if the key is missing, returning the stored value and
+  // whether it was inserted
+  std::pair<Value*, bool> insert(const Key& key, const Value& value);
+  Value&                  operator[](const Key& key);
+
+  // Iterate over elements in insertion order
+  auto begin() { return elements.begin(); }
+  auto end() { return elements.end(); }
+  auto begin() const { return elements.begin(); }
+  auto end() const { return elements.end(); }
+
+ private:
+  std::vector<value_type> elements = {};
+  std::vector<int>        slots    = {};
+
+  size_t find_slot(const Key& key) const;
+  void   rehash(size_t num_slots);
+};
+
+}  // namespace yocto::common
+
+// -----------------------------------------------------------------------------
+// ARENA
+// -----------------------------------------------------------------------------
+namespace yocto::common {
+
+// An arena of objects of one type, allocated in blocks of about 16Kb so that
+// creating many objects does not allocate each one. Objects have stable
+// addresses. Destroyed objects are reused by later creations, and all
+// objects are destroyed with the arena, freeing its blocks at once.
+template <typename T>
+struct arena {
+  arena() {}
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+  ~arena();
+
+  size_t size() const;
+  void   clear();
+
+  // Create a value-initialized object
+  T* create();
+  // Destroy an object, keeping its memory for later creations
+  void destroy(T* object);
+
+ private:
+  std::vector<T*> blocks = {};
+  std::vector<T*> freed  = {};
+  size_t          used   = 0;
+
+  static size_t block_size();
+};
+
+}  // namespace yocto::common
+
 // -----------------------------------------------------------------------------
 // CONCURRENCY UTILITIES
 // -----------------------------------------------------------------------------
@@ -152,12 +253,86 @@ inline bool is_valid(const std::future<void>& result);
 inline bool is_running(const std::future<void>& result);
 inline bool is_ready(const std::future<void>& result);
 
+// Placement of the pool threads: unpinned, pinned to the cpus of a NUMA
+// node, or pinned to a single cpu. Nodes and cpus are assigned to threads
+// in contiguous blocks.
+enum struct thread_affinity { none, nodes, cores };
+
+const auto thread_affinity_names = std::vector<std::string>{
+    "none", "nodes", "cores"};
+
+// A pool of worker threads that run tasks pushed on a shared queue. With
+// `low_priority`, the threads run at a lower priority than the others of the
+// process, as for background work.
+struct thread_pool {
+  thread_pool(int num_threads, thread_affinity affinity = thread_affinity::none,
+      bool low_priority = false);
+  ~thread_pool();
+  thread_pool(const thread_pool& other) = delete;
+  thread_pool& operator=(const thread_pool& other) = delete;
+
+  int  size() const;
+  void push(std::function<void()>&& task);
+
+ private:
+  std::vector<std::thread>          workers = {};
+  std::deque<std::function<void()>> tasks   = {};
+  std::mutex                        mutex;
+  std::condition_variable           ready;
+  bool                              stop = false;
+};
+
+// Number of threads used by parallel algorithms. Defaults to the hardware
+// concurrency, limited by the cgroup CPU quota when one is set. Setting the
+// number of threads recreates the global pool and should not be done while
+// parallel work is running. Passing 0 restores the default.
+inline int  get_num_threads();
+inline void set_num_threads(int num_threads);
+
+// Global thread pool, created lazily on first use.
+inline thread_pool& get_thread_pool();
+
+// Affinity of the threads of the global pool. Setting it recreates the pool,
+// as set_num_threads() does. Pinning is supported on Linux only.
+inline thread_affinity get_thread_affinity();
+inline void            set_thread_affinity(thread_affinity affinity);
+
+// NUMA nodes of the machine, with the cpus of each, read from sysfs. Returns
+// a single node with no cpus when the topology is not known.
+struct numa_node {
+  int              id   = 0;
+  std::vector<int> cpus = {};
+};
+inline const std::vector<numa_node>& get_numa_nodes();
+
+// Index in get_numa_nodes() of the node that runs the calling thread. This
+// is fixed for pinned pool threads, and is the current node otherwise.
+inline int get_numa_node();
+
+// Hints for the placement of the pages overlapping a buffer: interleaved
+// over all nodes, or moved to a node given as an index in get_numa_nodes().
+// These are no-ops on single-node machines and outside Linux.
+inline void interleave_memory(const void* data, size_t size);
+inline void bind_memory(const void* data, size_t size, int node);
+
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// parallel algorithms. `Func` takes the integer index. Indices are handed out
+// to the pool threads `grain` at a time.
 template <typename Func>
 inline void parallel_for(int begin, int end, Func&& func);
 template <typename Func>
+inline void parallel_for(int begin, int end, int grain, Func&& func);
+template <typename Func>
 inline void parallel_for(int num, Func&& func);
+// Same as above, running the loop on the given pool.
+template <typename Func>
+inline void parallel_for(
+    thread_pool& pool, int begin, int end, int grain, Func&& func);
+
+// Lower the scheduling priority of the calling thread, for threads that
+// should not slow down interactive ones. This cannot be undone, so it is
+// meant for threads that only do background work. Supported on Linux only.
+inline void lower_thread_priority();
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
@@ -268,6 +443,146 @@ inline std::vector<T> operator+(const std::vector<T>& a, const T& b) {
 
 }  // namespace yocto::common
 
+// -----------------------------------------------------------------------------
+// FLAT HASH MAP
+// -----------------------------------------------------------------------------
+namespace yocto::common {
+
+template <typename Key, typename Value>
+inline size_t flat_map<Key, Value>::size() const {
+  return elements.size();
+}
+template <typename Key, typename Value>
+inline bool flat_map<Key, Value>::empty() const {
+  return elements.empty();
+}
+template <typename Key, typename Value>
+inline void flat_map<Key, Value>::clear() {
+  elements.clear();
+  slots.clear();
+}
+template <typename Key, typename Value>
+inline void flat_map<Key, Value>::reserve(size_t count) {
+  elements.reserve(count);
+  if (count * 2 > slots.size()) rehash(count * 2);
+}
+
+// Find the slot of a key, or the empty slot where it would be inserted.
+// Requires a non-empty table.
+template <typename Key, typename Value>
+inline size_t flat_map<Key, Value>::find_slot(const Key& key) const {
+  auto mask = slots.size() - 1;
+  auto hash = (uint64_t)std::hash<Key>{}(key) * 0x9e3779b97f4a7c15ull;
+  auto slot = (size_t)(hash >> 32) & mask;
+  while (slots[slot] >= 0 && !(elements[slots[slot]].first == key))
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+// Resize the table to at least the given number of slots, keeping it a power
+// of two, and reinsert all elements.
+template <typename Key, typename Value>
+inline void flat_map<Key, Value>::rehash(size_t num_slots) {
+  auto size = (size_t)16;
+  while (size < num_slots) size *= 2;
+  slots.assign(size, -1);
+  for (auto idx = 0; idx < (int)elements.size(); idx++) {
+    slots[find_slot(elements[idx].first)] = idx;
+  }
+}
+
+template <typename Key, typename Value>
+inline Value* flat_map<Key, Value>::find(const Key& key) {
+  if (elements.empty()) return nullptr;
+  auto slot = find_slot(key);
+  return slots[slot] >= 0 ? &elements[slots[slot]].second : nullptr;
+}
+template <typename Key, typename Value>
+inline const Value* flat_map<Key, Value>::find(const Key& key) const {
+  if (elements.empty()) return nullptr;
+  auto slot = find_slot(key);
+  return slots[slot] >= 0 ? &elements[slots[slot]].second : nullptr;
+}
+
+template <typename Key, typename Value>
+inline std::pair<Value*, bool> flat_map<Key, Value>::insert(
+    const Key& key, const Value& value) {
+  // keep the load factor at most one half
+  if ((elements.size() + 1) * 2 > slots.size())
+    rehash((elements.size() + 1) * 2);
+  auto slot = find_slot(key);
+  if (slots[slot] >= 0) return {&elements[slots[slot]].second, false};
+  slots[slot] = (int)elements.size();
+  elements.push_back({key, value});
+  return {&elements.back().second, true};
+}
+template <typename Key, typename Value>
+inline Value& flat_map<Key, Value>::operator[](const Key& key) {
+  return *insert(key, Value{}).first;
+}
+
+}  // namespace yocto::common
+
+// -----------------------------------------------------------------------------
+// ARENA
+// -----------------------------------------------------------------------------
+namespace yocto::common {
+
+template <typename T>
+inline size_t arena<T>::block_size() {
+  return std::max((size_t)16384 / sizeof(T), (size_t)16);
+}
+
+template <typename T>
+inline arena<T>::~arena() {
+  clear();
+}
+
+template <typename T>
+inline size_t arena<T>::size() const {
+  return used - freed.size();
+}
+
+// Destroy the live objects, skipping the freed ones, and free all blocks
+template <typename T>
+inline void arena<T>::clear() {
+  std::sort(freed.begin(), freed.end());
+  for (auto idx = (size_t)0; idx < used; idx++) {
+    auto object = blocks[idx / block_size()] + idx % block_size();
+    if (!std::binary_search(freed.begin(), freed.end(), object))
+      object->~T();
+  }
+  auto allocator = std::allocator<T>{};
+  for (auto block : blocks) allocator.deallocate(block, block_size());
+  blocks.clear();
+  freed.clear();
+  used = 0;
+}
+
+template <typename T>
+inline T* arena<T>::create() {
+  if (!freed.empty()) {
+    auto object = freed.back();
+    freed.pop_back();
+    return new (object) T{};
+  }
+  if (used == blocks.size() * block_size()) {
+    blocks.push_back(std::allocator<T>{}.allocate(block_size()));
+  }
+  auto object = blocks[used / block_size()] + used % block_size();
+  used += 1;
+  return new (object) T{};
+}
+
+template <typename T>
+inline void arena<T>::destroy(T* object) {
+  if (!object) return;
+  object->~T();
+  freed.push_back(object);
+}
+
+}  // namespace yocto::common
+
 // -----------------------------------------------------------------------------
 // CONCURRENCY UTILITIES
 // -----------------------------------------------------------------------------
@@ -315,24 +630,307 @@ inline bool is_ready(const std::future<void>& result) {
                                std::future_status::ready;
 }
 
+// Pin the calling pool thread, defined below
+inline void pin_thread(
+    int thread_id, int num_threads, thread_affinity affinity);
+
+// Thread pool
+inline thread_pool::thread_pool(
+    int num_threads, thread_affinity affinity, bool low_priority) {
+  for (auto thread_id = 0; thread_id < num_threads; thread_id++) {
+    workers.emplace_back([this, thread_id, num_threads, affinity,
+                             low_priority]() {
+      pin_thread(thread_id, num_threads, affinity);
+      if (low_priority) lower_thread_priority();
+      while (true) {
+        auto task = std::function<void()>{};
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          ready.wait(lock, [this]() { return stop || !tasks.empty(); });
+          if (stop && tasks.empty()) return;
+          task = std::move(tasks.front());
+          tasks.pop_front();
+        }
+        task();
+      }
+    });
+  }
+}
+inline thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  ready.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+inline int thread_pool::size() const { return (int)workers.size(); }
+inline void thread_pool::push(std::function<void()>&& task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  ready.notify_one();
+}
+
+// Number of CPUs allowed by the cgroup quota, or 0 if there is no quota.
+inline int get_cgroup_cpus() {
+  auto quota = 0.0, period = 0.0;
+  // cgroup v2
+  if (auto fs = std::ifstream{"/sys/fs/cgroup/cpu.max"}; fs) {
+    auto max = std::string{};
+    fs >> max >> period;
+    if (max != "max" && !max.empty() && period > 0) quota = std::stod(max);
+  }
+  // cgroup v1
+  if (quota <= 0) {
+    auto qfs = std::ifstream{"/sys/fs/cgroup/cpu/cpu.cfs_quota_us"};
+    auto pfs = std::ifstream{"/sys/fs/cgroup/cpu/cpu.cfs_period_us"};
+    if (qfs && pfs) qfs >> quota, pfs >> period;
+  }
+  if (quota <= 0 || period <= 0) return 0;
+  return std::max((int)(quota / period + 0.5), 1);
+}
+
+// Number of threads used by parallel algorithms
+inline std::atomic<int>& num_threads_value() {
+  static auto value = std::atomic<int>{0};
+  return value;
+}
+inline int get_num_threads() {
+  if (auto num = num_threads_value().load(); num > 0) return num;
+  auto num = (int)std::thread::hardware_concurrency();
+  if (auto cpus = get_cgroup_cpus(); cpus > 0 && cpus < num) num = cpus;
+  return std::max(num, 1);
+}
+
+// Global thread pool and the mutex that guards its creation
+inline std::mutex& thread_pool_mutex() {
+  static auto mutex = std::mutex{};
+  return mutex;
+}
+inline std::unique_ptr<thread_pool>& thread_pool_value() {
+  static auto pool = std::unique_ptr<thread_pool>{};
+  return pool;
+}
+inline void set_num_threads(int num_threads) {
+  std::lock_guard<std::mutex> lock(thread_pool_mutex());
+  num_threads_value() = std::max(num_threads, 0);
+  thread_pool_value().reset();
+}
+inline std::atomic<thread_affinity>& thread_affinity_value() {
+  static auto value = std::atomic<thread_affinity>{thread_affinity::none};
+  return value;
+}
+inline thread_affinity get_thread_affinity() {
+  return thread_affinity_value().load();
+}
+inline void set_thread_affinity(thread_affinity affinity) {
+  std::lock_guard<std::mutex> lock(thread_pool_mutex());
+  thread_affinity_value() = affinity;
+  thread_pool_value().reset();
+}
+inline thread_pool& get_thread_pool() {
+  std::lock_guard<std::mutex> lock(thread_pool_mutex());
+  auto& pool = thread_pool_value();
+  if (!pool)
+    pool = std::make_unique<thread_pool>(
+        get_num_threads(), get_thread_affinity());
+  return *pool;
+}
+
+// Parse a sysfs cpu list, like "0-7,16-23".
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+  auto cpus  = std::vector<int>{};
+  auto start = (size_t)0;
+  while (start < list.size()) {
+    auto end   = std::min(list.find(',', start), list.size());
+    auto range = list.substr(start, end - start);
+    auto dash  = range.find('-');
+    try {
+      auto first = std::stoi(range.substr(0, dash));
+      auto last  = first;
+      if (dash != std::string::npos) last = std::stoi(range.substr(dash + 1));
+      for (auto cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    } catch (...) {
+    }
+    start = end + 1;
+  }
+  return cpus;
+}
+
+// NUMA nodes
+inline const std::vector<numa_node>& get_numa_nodes() {
+  static auto nodes = []() {
+    auto nodes = std::vector<numa_node>{};
+    auto fs    = std::ifstream{"/sys/devices/system/node/online"};
+    auto list  = std::string{};
+    if (fs && std::getline(fs, list)) {
+      for (auto id : parse_cpu_list(list)) {
+        auto cfs = std::ifstream{"/sys/devices/system/node/node" +
+                                 std::to_string(id) + "/cpulist"};
+        auto cpus = std::string{};
+        if (!cfs || !std::getline(cfs, cpus)) continue;
+        auto node = numa_node{id, parse_cpu_list(cpus)};
+        if (!node.cpus.empty()) nodes.push_back(node);
+      }
+    }
+    if (nodes.empty()) nodes.push_back({});
+    return nodes;
+  }();
+  return nodes;
+}
+
+// Node of pinned pool threads, or -1 for the others
+inline int& thread_numa_node() {
+  static thread_local auto node = -1;
+  return node;
+}
+inline int get_numa_node() {
+  if (thread_numa_node() >= 0) return thread_numa_node();
+  auto& nodes = get_numa_nodes();
+  if (nodes.size() <= 1) return 0;
+#ifdef __linux__
+  auto cpu = sched_getcpu();
+  for (auto idx = 0; idx < (int)nodes.size(); idx++) {
+    auto& cpus = nodes[idx].cpus;
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) return idx;
+  }
+#endif
+  return 0;
+}
+
+// Pin the calling pool thread, out of num_threads, to its node or cpu.
+inline void pin_thread(
+    int thread_id, int num_threads, thread_affinity affinity) {
+  if (affinity == thread_affinity::none) return;
+  auto& nodes = get_numa_nodes();
+  auto  cpus  = std::vector<int>{};
+  if (affinity == thread_affinity::nodes) {
+    auto node          = (int)((size_t)thread_id * nodes.size() / num_threads);
+    cpus               = nodes[node].cpus;
+    thread_numa_node() = node;
+  } else {
+    auto all = std::vector<std::pair<int, int>>{};
+    for (auto node = 0; node < (int)nodes.size(); node++) {
+      for (auto cpu : nodes[node].cpus) all.push_back({cpu, node});
+    }
+    if (all.empty()) return;
+    auto [cpu, node]   = all[(size_t)thread_id * all.size() / num_threads];
+    cpus               = {cpu};
+    thread_numa_node() = node;
+  }
+#ifdef __linux__
+  if (cpus.empty()) return;
+  auto set = cpu_set_t{};
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Set the memory policy of the pages overlapping a buffer with mbind, moving
+// the pages already touched. Errors are ignored since these are hints.
+inline void set_memory_policy(
+    const void* data, size_t size, int mode, const std::vector<int>& ids) {
+#ifdef __linux__
+  if (!data || !size || ids.empty()) return;
+  auto page  = (size_t)sysconf(_SC_PAGESIZE);
+  auto start = (size_t)data / page * page;
+  auto end   = ((size_t)data + size + page - 1) / page * page;
+  auto bits  = sizeof(unsigned long) * 8;
+  auto mask  = std::vector<unsigned long>(
+      *std::max_element(ids.begin(), ids.end()) / bits + 1, 0);
+  for (auto id : ids) mask[id / bits] |= 1ul << (id % bits);
+  const auto mpol_mf_move = 1 << 1;
+  syscall(SYS_mbind, (void*)start, end - start, mode, mask.data(),
+      mask.size() * bits + 1, mpol_mf_move);
+#endif
+}
+inline void interleave_memory(const void* data, size_t size) {
+  auto& nodes = get_numa_nodes();
+  if (nodes.size() <= 1) return;
+  auto ids = std::vector<int>{};
+  for (auto& node : nodes) ids.push_back(node.id);
+  const auto mpol_interleave = 3;
+  set_memory_policy(data, size, mpol_interleave, ids);
+}
+inline void bind_memory(const void* data, size_t size, int node) {
+  auto& nodes = get_numa_nodes();
+  if (nodes.size() <= 1 || node < 0 || node >= (int)nodes.size()) return;
+  const auto mpol_preferred = 1;
+  set_memory_policy(data, size, mpol_preferred, {nodes[node].id});
+}
+
+// Lower the priority of the calling thread, raising its nice value
+inline void lower_thread_priority() {
+#ifdef __linux__
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
+
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// parallel algorithms. `Func` takes the integer index. The calling thread
+// takes part in the loop, so nested calls from pool threads do not deadlock.
 template <typename Func>
-inline void parallel_for(int begin, int end, Func&& func) {
-  auto             futures  = std::vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(begin);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, end]() {
-          while (true) {
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= end) break;
-            func(idx);
-          }
-        }));
+inline void parallel_for(int begin, int end, int grain, Func&& func) {
+  parallel_for(
+      get_thread_pool(), begin, end, grain, std::forward<Func>(func));
+}
+template <typename Func>
+inline void parallel_for(
+    thread_pool& pool, int begin, int end, int grain, Func&& func) {
+  if (begin >= end) return;
+  grain = std::max(grain, 1);
+  // run loops of a single chunk on the calling thread
+  if (end - begin <= grain) {
+    for (auto idx = begin; idx < end; idx++) func(idx);
+    return;
+  }
+  // state shared with pool tasks, that may start after the loop is done
+  struct loop_state {
+    std::atomic<int>        next_idx = 0;
+    std::atomic<int>        active   = 0;
+    std::mutex              mutex;
+    std::condition_variable done;
+    std::exception_ptr      error = nullptr;
+  };
+  auto state      = std::make_shared<loop_state>();
+  state->next_idx = begin;
+  auto run        = [state, begin, end, grain, &func]() {
+    state->active += 1;
+    try {
+      while (true) {
+        auto start = state->next_idx.fetch_add(grain);
+        if (start >= end) break;
+        for (auto idx = start; idx < std::min(start + grain, end); idx++) {
+          func(idx);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->error) state->error = std::current_exception();
+      state->next_idx = end;
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (--state->active == 0) state->done.notify_all();
+  };
+  auto ntasks = std::min(pool.size(), (end - begin + grain - 1) / grain - 1);
+  for (auto task = 0; task < ntasks; task++) {
+    // tasks that start after the loop is done find no work
+    pool.push(std::function<void()>{run});
   }
-  for (auto& f : futures) f.get();
+  run();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done.wait(lock, [&state]() { return state->active == 0; });
+  if (state->error) std::rethrow_exception(state->error);
+}
+
+template <typename Func>
+inline void parallel_for(int begin, int end, Func&& func) {
+  parallel_for(begin, end, 1, std::forward<Func>(func));
 }
 
 template <typename Func>
@@ -16,6 +16,15 @@
 // and Yocto/Math types.
 //
 //
+// ## Timeline tracing
+//
+// Record where time goes with `start_timeline()`, then mark scopes on any
+// thread with `begin_timeline()` and `end_timeline()`, or with the RIIA
+// `scoped_timeline()`. While recording, `print_progress()` also records each
+// progress message as a scope. Save the events with `save_timeline()` as a
+// Chrome trace json, viewable in chrome://tracing or ui.perfetto.dev.
+//
+//
 // ## Command-Line Parsing
 //
 // We provide a simple, immediate-mode, command-line parser. The parser
@@ -87,9 +96,12 @@
 // -----------------------------------------------------------------------------
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
@@ -126,6 +138,36 @@ inline std::string format_num(uint64_t num);
 
 }  // namespace yocto::commonio
 
+// -----------------------------------------------------------------------------
+// TIMELINE TRACING
+// -----------------------------------------------------------------------------
+namespace yocto::commonio {
+
+// Start recording timeline events. The calling thread is named main.
+inline void start_timeline();
+// Save the recorded events as a Chrome trace json. Call it when no other
+// thread is recording.
+inline bool save_timeline(const std::string& filename, std::string& error);
+
+// Begin and end a named scope on the current thread, if recording.
+inline void begin_timeline(const std::string& name);
+inline void end_timeline();
+
+// Scope that ends as its variable goes out of scope. Create with
+// `scoped_timeline`.
+struct timeline_scope {
+  bool active = false;
+  ~timeline_scope();  // end scope
+};
+inline timeline_scope scoped_timeline(const std::string& name);
+
+// Record a progress update as a scope, from the first update of a message
+// to the last one. Called by print_progress().
+inline void progress_timeline(
+    const std::string& message, int current, int total);
+
+}  // namespace yocto::commonio
+
 // -----------------------------------------------------------------------------
 // COMMAND LINE PARSING
 // -----------------------------------------------------------------------------
@@ -284,8 +326,9 @@ inline std::string format_duration(int64_t duration) {
 inline std::string format_num(uint64_t num) {
   auto rem = num % 1000;
   auto div = num / 1000;
-  if (div > 0) return format_num(div) + "," + std::to_string(rem);
-  return std::to_string(rem);
+  if (div <= 0) return std::to_string(rem);
+  auto digits = std::to_string(rem);
+  return format_num(div) + "," + std::string(3 - digits.size(), '0') + digits;
 }
 
 // Print traces for timing and program debugging
@@ -330,6 +373,146 @@ inline void print_progress(const std::string& message, int current, int total) {
   printf("\r%s\r", line.c_str());
   if (current == total) printf("\n");
   fflush(stdout);
+  progress_timeline(message, current, total);
+}
+
+}  // namespace yocto::commonio
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF TIMELINE TRACING
+// -----------------------------------------------------------------------------
+namespace yocto::commonio {
+
+// Timeline events are complete scopes, with times in nanoseconds. Each thread
+// records its scopes in its own buffer, while progress scopes, that may begin
+// and end on different threads, are recorded under the lock.
+struct timeline_event {
+  std::string name     = "";
+  int64_t     start    = 0;
+  int64_t     duration = 0;
+  int         thread   = 0;
+};
+struct timeline_thread {
+  int                         index  = 0;
+  std::vector<timeline_event> events = {};
+  std::vector<timeline_event> stack  = {};
+};
+struct timeline_state {
+  std::atomic<bool>           recording = false;
+  int64_t                     start     = 0;
+  std::mutex                  mutex     = {};
+  std::deque<timeline_thread> threads   = {};
+  std::vector<timeline_event> progress  = {};
+  timeline_event              current   = {};
+};
+
+// Get the timeline state and the buffer of the current thread
+inline timeline_state& get_timeline() {
+  static timeline_state state;
+  return state;
+}
+inline timeline_thread& get_timeline_thread() {
+  thread_local timeline_thread* thread = nullptr;
+  if (!thread) {
+    auto& timeline = get_timeline();
+    auto  lock     = std::lock_guard{timeline.mutex};
+    thread         = &timeline.threads.emplace_back();
+    thread->index  = (int)timeline.threads.size() - 1;
+  }
+  return *thread;
+}
+
+// Start recording timeline events
+inline void start_timeline() {
+  auto& timeline = get_timeline();
+  timeline.start = get_time_();
+  get_timeline_thread();
+  timeline.recording = true;
+}
+
+// Begin and end a scope
+inline void begin_timeline(const std::string& name) {
+  if (!get_timeline().recording) return;
+  auto& thread = get_timeline_thread();
+  thread.stack.push_back({name, get_time_(), 0, thread.index});
+}
+inline void end_timeline() {
+  if (!get_timeline().recording) return;
+  auto& thread = get_timeline_thread();
+  if (thread.stack.empty()) return;
+  auto& event = thread.events.emplace_back(thread.stack.back());
+  thread.stack.pop_back();
+  event.duration = get_time_() - event.start;
+}
+inline timeline_scope scoped_timeline(const std::string& name) {
+  if (!get_timeline().recording) return timeline_scope{false};
+  begin_timeline(name);
+  return timeline_scope{true};
+}
+inline timeline_scope::~timeline_scope() {
+  if (active) end_timeline();
+}
+
+// Record a progress update as a scope
+inline void progress_timeline(
+    const std::string& message, int current, int total) {
+  auto& timeline = get_timeline();
+  if (!timeline.recording) return;
+  auto  thread = get_timeline_thread().index;
+  auto  lock   = std::lock_guard{timeline.mutex};
+  auto& event  = timeline.current;
+  if (current == 0 || event.name != message) {
+    if (!event.name.empty()) {
+      event.duration = get_time_() - event.start;
+      timeline.progress.push_back(event);
+    }
+    event = {message, get_time_(), 0, thread};
+  }
+  if (current >= total) {
+    event.duration = get_time_() - event.start;
+    timeline.progress.push_back(event);
+    event = {};
+  }
+}
+
+// Save timeline events as a Chrome trace
+inline bool save_timeline(const std::string& filename, std::string& error) {
+  auto& timeline = get_timeline();
+  auto  quote    = [](const std::string& str) {
+    auto quoted = std::string{"\""};
+    for (auto c : str) {
+      if (c == '"' || c == '\\') quoted += '\\';
+      quoted += c;
+    }
+    return quoted + "\"";
+  };
+  auto format_event = [&timeline, &quote](const timeline_event& event) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer),
+        ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, "
+        "\"tid\": %d}",
+        (event.start - timeline.start) / 1e3, event.duration / 1e3,
+        event.thread);
+    return "{\"name\": " + quote(event.name) + buffer;
+  };
+  auto lock   = std::lock_guard{timeline.mutex};
+  auto events = std::vector<std::string>{};
+  for (auto& thread : timeline.threads) {
+    auto name = thread.index == 0 ? std::string{"main"}
+                                  : "thread " + std::to_string(thread.index);
+    events.push_back("{\"name\": \"thread_name\", \"ph\": \"M\", "
+                     "\"pid\": 0, \"tid\": " +
+                     std::to_string(thread.index) +
+                     ", \"args\": {\"name\": " + quote(name) + "}}");
+    for (auto& event : thread.events) events.push_back(format_event(event));
+  }
+  for (auto& event : timeline.progress) events.push_back(format_event(event));
+  auto json = std::string{"{\"traceEvents\": [\n"};
+  for (auto idx = (size_t)0; idx < events.size(); idx++) {
+    json += events[idx] + (idx + 1 < events.size() ? ",\n" : "\n");
+  }
+  json += "], \"displayTimeUnit\": \"ms\"}\n";
+  return save_text(filename, json, error);
 }
 
 }  // namespace yocto::commonio
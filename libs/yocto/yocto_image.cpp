@@ -32,13 +32,15 @@
 
 #include "yocto_image.h"
 
+#include <array>
 #include <atomic>
-#include <future>
+#include <cstring>
 #include <memory>
-#include <thread>
+#include <mutex>
+
+#include "yocto_common.h"
 
 #include "ext/stb_image.h"
-#include "ext/stb_image_resize.h"
 #include "ext/stb_image_write.h"
 #include "ext/tinyexr.h"
 
@@ -524,48 +526,6 @@ vec3f eval_image(const image<vec3b>& img, const vec2f& uv, bool as_linear,
 // -----------------------------------------------------------------------------
 namespace yocto::image {
 
-template <typename T>
-inline void set_region(
-    image<T>& img, const image<T>& region, const vec2i& offset) {
-  for (auto j = 0; j < region.size().y; j++) {
-    for (auto i = 0; i < region.size().x; i++) {
-      if (!img.contains({i, j})) continue;
-      img[vec2i{i, j} + offset] = region[{i, j}];
-    }
-  }
-}
-
-template <typename T>
-inline void get_region(image<T>& clipped, const image<T>& img,
-    const vec2i& offset, const vec2i& size) {
-  clipped.resize(size);
-  for (auto j = 0; j < size.y; j++) {
-    for (auto i = 0; i < size.x; i++) {
-      clipped[{i, j}] = img[{i + offset.x, j + offset.y}];
-    }
-  }
-}
-
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
-template <typename Func>
-inline void parallel_for(const vec2i& size, Func&& func) {
-  auto             futures  = std::vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, size]() {
-          while (true) {
-            auto j = next_idx.fetch_add(1);
-            if (j >= size.y) break;
-            for (auto i = 0; i < size.x; i++) func({i, j});
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
-}
-
 // Conversion from/to floats.
 image<vec4f> byte_to_float(const image<vec4b>& bt) {
   auto fl = image<vec4f>{bt.size()};
@@ -614,76 +574,298 @@ image<ushort> float_to_ushort(const image<float>& fl) {
   return bt;
 }
 
+// Conversion from/to halfs.
+image<vec3f> half_to_float(const image<vec3h>& hf) {
+  auto fl = image<vec3f>{hf.size()};
+  for (auto i = 0ull; i < fl.count(); i++) fl[i] = math::half_to_float(hf[i]);
+  return fl;
+}
+image<vec3h> float_to_half(const image<vec3f>& fl) {
+  auto hf = image<vec3h>{fl.size()};
+  for (auto i = 0ull; i < hf.count(); i++) hf[i] = math::float_to_half(fl[i]);
+  return hf;
+}
+image<float> half_to_float(const image<half>& hf) {
+  auto fl = image<float>{hf.size()};
+  for (auto i = 0ull; i < fl.count(); i++) fl[i] = math::half_to_float(hf[i]);
+  return fl;
+}
+image<half> float_to_half(const image<float>& fl) {
+  auto hf = image<half>{fl.size()};
+  for (auto i = 0ull; i < hf.count(); i++) hf[i] = math::float_to_half(fl[i]);
+  return hf;
+}
+
+// Fast log2, exp2 and pow as branchless polynomial fits, accurate to about
+// 1e-6. They work on all four channels at once, written so that the compiler
+// can vectorize them, which it cannot do with calls to the standard library.
+static inline vec4f fast_log2(const vec4f& x) {
+  auto bits = vec4i{};
+  memcpy(&bits, &x, sizeof(bits));
+  auto exponent = vec4f{(float)((bits.x >> 23) & 0xff),
+                      (float)((bits.y >> 23) & 0xff),
+                      (float)((bits.z >> 23) & 0xff),
+                      (float)((bits.w >> 23) & 0xff)} -
+                  127;
+  bits = {(bits.x & 0x007fffff) | 0x3f800000,
+      (bits.y & 0x007fffff) | 0x3f800000, (bits.z & 0x007fffff) | 0x3f800000,
+      (bits.w & 0x007fffff) | 0x3f800000};
+  auto m = vec4f{};
+  memcpy(&m, &bits, sizeof(m));
+  m -= 1;
+  return exponent +
+         m * (1.4426640f +
+                 m * (-0.7205155f +
+                         m * (0.4731131f +
+                                 m * (-0.3246157f +
+                                         m * (0.1923840f +
+                                                 m * (-0.0781574f +
+                                                         m * 0.0151277f))))));
+}
+static inline vec4f fast_exp2(const vec4f& x) {
+  // split in integer and fractional parts by rounding with a magic number
+  auto magic = 12582912.0f;
+  auto r     = x + magic;
+  auto f     = x - (r - magic);
+  auto e     = vec4i{};
+  memcpy(&e, &r, sizeof(e));
+  e          = clamp(e - 0x4b400000, -126, 127);
+  auto bits  = vec4i{(e.x + 127) << 23, (e.y + 127) << 23, (e.z + 127) << 23,
+      (e.w + 127) << 23};
+  auto scale = vec4f{};
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale *
+         (1.00000008f +
+             f * (0.693147207f +
+                     f * (0.240221074f +
+                             f * (0.0555032721f +
+                                     f * (0.00967603709f +
+                                             f * 0.00134004321f)))));
+}
+static inline vec4f fast_pow(const vec4f& x, const vec4f& y) {
+  return fast_exp2(y * fast_log2(x));
+}
+
+// Select channels from a or b, without branches.
+static inline vec4f fast_select(
+    const vec4i& mask, const vec4f& a, const vec4f& b) {
+  auto ab = vec4i{}, bb = vec4i{};
+  memcpy(&ab, &a, sizeof(ab));
+  memcpy(&bb, &b, sizeof(bb));
+  auto rb = vec4i{(ab.x & mask.x) | (bb.x & ~mask.x),
+      (ab.y & mask.y) | (bb.y & ~mask.y), (ab.z & mask.z) | (bb.z & ~mask.z),
+      (ab.w & mask.w) | (bb.w & ~mask.w)};
+  auto r = vec4f{};
+  memcpy(&r, &rb, sizeof(r));
+  return r;
+}
+static inline vec4i fast_less_equal(const vec4f& a, float b) {
+  return {-(int)(a.x <= b), -(int)(a.y <= b), -(int)(a.z <= b),
+      -(int)(a.w <= b)};
+}
+
+// sRGB curves computed with the fast pow on all four channels.
+static inline vec4f fast_rgb_to_srgb(const vec4f& rgb) {
+  return fast_select(fast_less_equal(rgb, 0.0031308f), 12.92f * rgb,
+      1.055f * fast_pow(rgb, vec4f{1 / 2.4f}) - 0.055f);
+}
+static inline vec4f fast_srgb_to_rgb(const vec4f& srgb) {
+  return fast_select(fast_less_equal(srgb, 0.04045f), srgb / 12.92f,
+      fast_pow((srgb + 0.055f) / 1.055f, vec4f{2.4f}));
+}
+
+// Apply a curve to float images four values at a time.
+template <typename Curve>
+static void apply_curve(
+    const float* in, float* out, size_t count, Curve&& curve) {
+  auto i = (size_t)0;
+  for (; i + 4 <= count; i += 4) {
+    auto value = vec4f{in[i + 0], in[i + 1], in[i + 2], in[i + 3]};
+    value      = curve(value);
+    out[i + 0] = value.x;
+    out[i + 1] = value.y;
+    out[i + 2] = value.z;
+    out[i + 3] = value.w;
+  }
+  for (; i < count; i++) out[i] = curve(vec4f{in[i]}).x;
+}
+
+// Lookup table from sRGB bytes to linear floats.
+static const std::array<float, 256>& srgb_byte_table() {
+  static const auto table = [] {
+    auto table = std::array<float, 256>{};
+    for (auto i = 0; i < 256; i++)
+      table[i] = math::srgb_to_rgb(math::byte_to_float((byte)i));
+    return table;
+  }();
+  return table;
+}
+
+// Color kernels over spans of pixels. Input and output may be the same.
+// Colors are kept in all four channels, restoring alpha at the end, so that
+// each operation works on a whole pixel at once.
+static inline vec4f fast_filmic(const vec4f& rgb) {
+  // same fit as tonemap_filmic()
+  auto aces = rgb * 0.6f;
+  return max((aces * aces * 2.51f + aces * 0.03f) /
+                 (aces * aces * 2.43f + aces * 0.59f + 0.14f),
+      0.0f);
+}
+static inline vec4f fast_saturate(const vec4f& rgb, float saturation) {
+  auto grey = (rgb.x + rgb.y + rgb.z) * 0.333333f;
+  return max(grey + (rgb - grey) * (saturation * 2), 0.0f);
+}
+static void tonemap_pixels(const vec4f* hdr, vec4f* ldr, size_t count,
+    float exposure, bool filmic, bool srgb) {
+  auto scale = exp2(exposure);
+  for (auto i = (size_t)0; i < count; i++) {
+    auto rgb = hdr[i] * scale;
+    if (filmic) rgb = fast_filmic(rgb);
+    if (srgb) rgb = fast_rgb_to_srgb(rgb);
+    ldr[i] = {rgb.x, rgb.y, rgb.z, hdr[i].w};
+  }
+}
+static void colorgrade_pixels(const vec4f* img, vec4f* corrected,
+    size_t count, bool linear, const colorgrade_params& params_) {
+  // local copy, since the output could alias the parameters
+  auto params = params_;
+
+  // lift, gamma and gain, computed once for all pixels
+  auto lgg   = params.shadows != 0.5f || params.midtones != 0.5f ||
+             params.highlights != 0.5f ||
+             params.shadows_color != vec3f{1, 1, 1} ||
+             params.midtones_color != vec3f{1, 1, 1} ||
+             params.highlights_color != vec3f{1, 1, 1};
+  auto lift  = params.shadows_color;
+  auto gamma = params.midtones_color;
+  auto gain  = params.highlights_color;
+  if (lgg) {
+    lift      = lift - mean(lift) + params.shadows - (float)0.5;
+    gain      = gain - mean(gain) + params.highlights + (float)0.5;
+    auto grey = gamma - mean(gamma) + params.midtones;
+    gamma     = log(((float)0.5 - lift) / (gain - lift)) / log(grey);
+  }
+  auto lift4      = vec4f{lift.x, lift.y, lift.z, 0};
+  auto gain4      = vec4f{gain.x, gain.y, gain.z, 0};
+  auto inv_gamma4 = vec4f{1 / gamma.x, 1 / gamma.y, 1 / gamma.z, 1};
+
+  auto exposure = exp2(params.exposure);
+  auto scale    = vec4f{exposure * params.tint.x, exposure * params.tint.y,
+      exposure * params.tint.z, 1};
+  auto grey     = linear ? 0.18f : 0.5f;
+  auto log_grey = log2(grey);
+  auto epsilon  = (float)0.0001;
+  for (auto i = (size_t)0; i < count; i++) {
+    auto rgb = img[i] * scale;
+    if (params.lincontrast != 0.5f)
+      rgb = max(grey + (rgb - grey) * (params.lincontrast * 2), 0.0f);
+    if (params.logcontrast != 0.5f) {
+      auto log_ldr  = fast_log2(rgb + epsilon);
+      auto adjusted = log_grey +
+                      (log_ldr - log_grey) * (params.logcontrast * 2);
+      rgb = max(fast_exp2(adjusted) - epsilon, 0.0f);
+    }
+    if (params.linsaturation != 0.5f)
+      rgb = fast_saturate(rgb, params.linsaturation);
+    if (params.filmic) rgb = fast_filmic(rgb);
+    if (linear && params.srgb) rgb = fast_rgb_to_srgb(rgb);
+    if (params.contrast != 0.5f) rgb = math::gain(rgb, 1 - params.contrast);
+    if (params.saturation != 0.5f)
+      rgb = fast_saturate(rgb, params.saturation);
+    if (lgg) {
+      auto lerp_value = clamp(fast_pow(rgb, inv_gamma4), 0.0f, 1.0f);
+      rgb             = gain4 * lerp_value + lift4 * (1 - lerp_value);
+    }
+    corrected[i] = {rgb.x, rgb.y, rgb.z, img[i].w};
+  }
+}
+
 // Conversion between linear and gamma-encoded images.
 image<vec4f> srgb_to_rgb(const image<vec4f>& srgb) {
   auto rgb = image<vec4f>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++) rgb[i] = srgb_to_rgb(srgb[i]);
+  for (auto i = 0ull; i < rgb.count(); i++)
+    rgb[i] = {xyz(fast_srgb_to_rgb(srgb[i])), srgb[i].w};
   return rgb;
 }
 image<vec4f> rgb_to_srgb(const image<vec4f>& rgb) {
   auto srgb = image<vec4f>{rgb.size()};
-  for (auto i = 0ull; i < srgb.count(); i++) srgb[i] = rgb_to_srgb(rgb[i]);
+  for (auto i = 0ull; i < srgb.count(); i++)
+    srgb[i] = {xyz(fast_rgb_to_srgb(rgb[i])), rgb[i].w};
   return srgb;
 }
 image<vec4f> srgb_to_rgb(const image<vec4b>& srgb) {
-  auto rgb = image<vec4f>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++)
-    rgb[i] = srgb_to_rgb(byte_to_float(srgb[i]));
+  auto& table = srgb_byte_table();
+  auto  rgb   = image<vec4f>{srgb.size()};
+  for (auto i = 0ull; i < rgb.count(); i++) {
+    auto c = srgb[i];
+    rgb[i] = {table[c.x], table[c.y], table[c.z], math::byte_to_float(c.w)};
+  }
   return rgb;
 }
 image<vec4b> rgb_to_srgbb(const image<vec4f>& rgb) {
   auto srgb = image<vec4b>{rgb.size()};
   for (auto i = 0ull; i < srgb.count(); i++)
-    srgb[i] = float_to_byte(rgb_to_srgb(rgb[i]));
+    srgb[i] = float_to_byte(vec4f{xyz(fast_rgb_to_srgb(rgb[i])), rgb[i].w});
   return srgb;
 }
 
 // Conversion between linear and gamma-encoded images.
 image<vec3f> srgb_to_rgb(const image<vec3f>& srgb) {
   auto rgb = image<vec3f>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++) rgb[i] = srgb_to_rgb(srgb[i]);
+  for (auto i = 0ull; i < rgb.count(); i++)
+    rgb[i] = xyz(fast_srgb_to_rgb(vec4f{srgb[i], 0}));
   return rgb;
 }
 image<vec3f> rgb_to_srgb(const image<vec3f>& rgb) {
   auto srgb = image<vec3f>{rgb.size()};
-  for (auto i = 0ull; i < srgb.count(); i++) srgb[i] = rgb_to_srgb(rgb[i]);
+  for (auto i = 0ull; i < srgb.count(); i++)
+    srgb[i] = xyz(fast_rgb_to_srgb(vec4f{rgb[i], 0}));
   return srgb;
 }
 image<vec3f> srgb_to_rgb(const image<vec3b>& srgb) {
-  auto rgb = image<vec3f>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++)
-    rgb[i] = srgb_to_rgb(byte_to_float(srgb[i]));
+  auto& table = srgb_byte_table();
+  auto  rgb   = image<vec3f>{srgb.size()};
+  for (auto i = 0ull; i < rgb.count(); i++) {
+    auto c = srgb[i];
+    rgb[i] = {table[c.x], table[c.y], table[c.z]};
+  }
   return rgb;
 }
 image<vec3b> rgb_to_srgbb(const image<vec3f>& rgb) {
   auto srgb = image<vec3b>{rgb.size()};
   for (auto i = 0ull; i < srgb.count(); i++)
-    srgb[i] = float_to_byte(rgb_to_srgb(rgb[i]));
+    srgb[i] = float_to_byte(xyz(fast_rgb_to_srgb(vec4f{rgb[i], 0})));
   return srgb;
 }
 
 // Conversion between linear and gamma-encoded images.
 image<float> srgb_to_rgb(const image<float>& srgb) {
   auto rgb = image<float>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++) rgb[i] = math::srgb_to_rgb(srgb[i]);
+  apply_curve(srgb.data(), rgb.data(), rgb.count(),
+      [](const vec4f& value) { return fast_srgb_to_rgb(value); });
   return rgb;
 }
 image<float> rgb_to_srgb(const image<float>& rgb) {
   auto srgb = image<float>{rgb.size()};
-  for (auto i = 0ull; i < srgb.count(); i++)
-    srgb[i] = math::rgb_to_srgb(rgb[i]);
+  apply_curve(rgb.data(), srgb.data(), srgb.count(),
+      [](const vec4f& value) { return fast_rgb_to_srgb(value); });
   return srgb;
 }
 image<float> srgb_to_rgb(const image<byte>& srgb) {
-  auto rgb = image<float>{srgb.size()};
-  for (auto i = 0ull; i < rgb.count(); i++)
-    rgb[i] = math::srgb_to_rgb(math::byte_to_float(srgb[i]));
+  auto& table = srgb_byte_table();
+  auto  rgb   = image<float>{srgb.size()};
+  for (auto i = 0ull; i < rgb.count(); i++) rgb[i] = table[srgb[i]];
   return rgb;
 }
 image<byte> rgb_to_srgbb(const image<float>& rgb) {
   auto srgb = image<byte>{rgb.size()};
-  for (auto i = 0ull; i < srgb.count(); i++)
-    srgb[i] = math::float_to_byte(math::rgb_to_srgb(rgb[i]));
+  auto row  = std::vector<float>(rgb.size().x);
+  for (auto j = 0; j < rgb.size().y; j++) {
+    apply_curve(&rgb[{0, j}], row.data(), row.size(),
+        [](const vec4f& value) { return fast_rgb_to_srgb(value); });
+    for (auto i = 0; i < rgb.size().x; i++)
+      srgb[{i, j}] = math::float_to_byte(row[i]);
+  }
   return srgb;
 }
 
@@ -691,22 +873,41 @@ image<byte> rgb_to_srgbb(const image<float>& rgb) {
 image<vec4f> tonemap_image(
     const image<vec4f>& hdr, float exposure, bool filmic, bool srgb) {
   auto ldr = image<vec4f>{hdr.size()};
-  for (auto i = 0ull; i < hdr.count(); i++)
-    ldr[i] = tonemap(hdr[i], exposure, filmic, srgb);
+  tonemap_pixels(hdr.data(), ldr.data(), hdr.count(), exposure, filmic, srgb);
   return ldr;
 }
 image<vec4b> tonemap_imageb(
     const image<vec4f>& hdr, float exposure, bool filmic, bool srgb) {
+  // tone map a row at a time to avoid a full float image
   auto ldr = image<vec4b>{hdr.size()};
-  for (auto i = 0ull; i < hdr.count(); i++)
-    ldr[i] = float_to_byte(tonemap(hdr[i], exposure, filmic, srgb));
+  auto row = std::vector<vec4f>(hdr.size().x);
+  for (auto j = 0; j < hdr.size().y; j++) {
+    tonemap_pixels(
+        &hdr[{0, j}], row.data(), row.size(), exposure, filmic, srgb);
+    for (auto i = 0; i < hdr.size().x; i++)
+      ldr[{i, j}] = float_to_byte(row[i]);
+  }
   return ldr;
 }
 
-void tonemap_image_mt(image<vec4f>& ldr, const image<vec4f>& hdr,
-    float exposure, bool filmic, bool srgb) {
-  parallel_for(hdr.size(), [&](const vec2i& ij) {
-    ldr[ij] = tonemap(hdr[ij], exposure, filmic, srgb);
+void tonemap_image(const image_view<vec4f>& ldr,
+    const image_view<const vec4f>& hdr, float exposure, bool filmic,
+    bool srgb) {
+  if (ldr.size() != hdr.size())
+    throw std::invalid_argument("views have different sizes");
+  for (auto j = 0; j < hdr.size().y; j++) {
+    tonemap_pixels(
+        hdr.row(j), ldr.row(j), hdr.size().x, exposure, filmic, srgb);
+  }
+}
+void tonemap_image_mt(const image_view<vec4f>& ldr,
+    const image_view<const vec4f>& hdr, float exposure, bool filmic,
+    bool srgb) {
+  if (ldr.size() != hdr.size())
+    throw std::invalid_argument("views have different sizes");
+  common::parallel_for(hdr.size().y, [&](int j) {
+    tonemap_pixels(
+        hdr.row(j), ldr.row(j), hdr.size().x, exposure, filmic, srgb);
   });
 }
 vec3f colorgrade(
@@ -751,16 +952,97 @@ vec4f colorgrade(
 image<vec4f> colorgrade_image(
     const image<vec4f>& img, bool linear, const colorgrade_params& params) {
   auto corrected = image<vec4f>{img.size()};
-  for (auto i = 0ull; i < img.count(); i++)
-    corrected[i] = colorgrade(img[i], linear, params);
+  colorgrade_pixels(img.data(), corrected.data(), img.count(), linear, params);
   return corrected;
 }
 
 // Apply exposure and filmic tone mapping
-void colorgrade_image_mt(image<vec4f>& corrected, const image<vec4f>& img,
-    bool linear, const colorgrade_params& params) {
-  parallel_for(img.size(), [&](const vec2i& ij) {
-    corrected[ij] = colorgrade(img[ij], linear, params);
+void colorgrade_image_mt(const image_view<vec4f>& corrected,
+    const image_view<const vec4f>& img, bool linear,
+    const colorgrade_params& params) {
+  if (corrected.size() != img.size())
+    throw std::invalid_argument("views have different sizes");
+  common::parallel_for(img.size().y, [&](int j) {
+    colorgrade_pixels(
+        img.row(j), corrected.row(j), img.size().x, linear, params);
+  });
+}
+
+// Add operations to a pipeline
+void add_operation(image_pipeline& pipeline, const pixel_operation& operation) {
+  pipeline.operations.push_back(operation);
+}
+void add_tonemap(
+    image_pipeline& pipeline, float exposure, bool filmic, bool srgb) {
+  add_operation(pipeline, [=](vec4f* pixels, int count, const vec2i&) {
+    tonemap_pixels(pixels, pixels, count, exposure, filmic, srgb);
+  });
+}
+void add_colorgrade(
+    image_pipeline& pipeline, bool linear, const colorgrade_params& params) {
+  add_operation(pipeline, [=](vec4f* pixels, int count, const vec2i&) {
+    colorgrade_pixels(pixels, pixels, count, linear, params);
+  });
+}
+void add_srgb_to_rgb(image_pipeline& pipeline) {
+  add_operation(pipeline, [](vec4f* pixels, int count, const vec2i&) {
+    for (auto i = 0; i < count; i++) {
+      pixels[i] = {xyz(fast_srgb_to_rgb(pixels[i])), pixels[i].w};
+    }
+  });
+}
+void add_rgb_to_srgb(image_pipeline& pipeline) {
+  add_operation(pipeline, [](vec4f* pixels, int count, const vec2i&) {
+    for (auto i = 0; i < count; i++) {
+      pixels[i] = {xyz(fast_rgb_to_srgb(pixels[i])), pixels[i].w};
+    }
+  });
+}
+
+// Number of pixels processed at once by pipelines, 16Kb of floats.
+constexpr auto pipeline_span = 1024;
+
+// Run a pipeline on an image
+image<vec4f> apply_pipeline(
+    const image<vec4f>& img, const image_pipeline& pipeline) {
+  auto result = image<vec4f>{img.size()};
+  apply_pipeline(result, img, pipeline);
+  return result;
+}
+image<vec4b> apply_pipelineb(
+    const image<vec4f>& img, const image_pipeline& pipeline) {
+  auto result = image<vec4b>{img.size()};
+  apply_pipelineb(result, img, pipeline);
+  return result;
+}
+void apply_pipeline(const image_view<vec4f>& result,
+    const image_view<const vec4f>& img, const image_pipeline& pipeline) {
+  if (result.size() != img.size())
+    throw std::invalid_argument("views have different sizes");
+  common::parallel_for(img.size().y, [&](int j) {
+    for (auto i = 0; i < img.size().x; i += pipeline_span) {
+      auto count  = min(pipeline_span, img.size().x - i);
+      auto pixels = &result[{i, j}];
+      std::copy(&img[{i, j}], &img[{i, j}] + count, pixels);
+      for (auto& operation : pipeline.operations)
+        operation(pixels, count, {i, j});
+    }
+  });
+}
+void apply_pipelineb(const image_view<vec4b>& result,
+    const image_view<const vec4f>& img, const image_pipeline& pipeline) {
+  if (result.size() != img.size())
+    throw std::invalid_argument("views have different sizes");
+  common::parallel_for(img.size().y, [&](int j) {
+    auto pixels = std::array<vec4f, pipeline_span>{};
+    for (auto i = 0; i < img.size().x; i += pipeline_span) {
+      auto count = min(pipeline_span, img.size().x - i);
+      std::copy(&img[{i, j}], &img[{i, j}] + count, pixels.data());
+      for (auto& operation : pipeline.operations)
+        operation(pixels.data(), count, {i, j});
+      for (auto k = 0; k < count; k++)
+        result[{i + k, j}] = float_to_byte(pixels[k]);
+    }
   });
 }
 
@@ -785,23 +1067,247 @@ static vec2i resize_size(const vec2i& img_size, const vec2i& size_) {
   return size;
 }
 
-image<vec4f> resize_image(const image<vec4f>& img, const vec2i& size_) {
-  auto size    = resize_size(img.size(), size_);
-  auto res_img = image<vec4f>{size};
-  stbir_resize_float_generic((float*)img.data(), img.size().x, img.size().y,
-      sizeof(vec4f) * img.size().x, (float*)res_img.data(), res_img.size().x,
-      res_img.size().y, sizeof(vec4f) * res_img.size().x, 4, 3, 0,
-      STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, nullptr);
-  return res_img;
+// Resize filter kernels, over distances in source pixels
+static float resize_kernel(resize_filter filter, float x) {
+  x = abs(x);
+  switch (filter) {
+    case resize_filter::mitchell: {
+      // Mitchell-Netravali with B = C = 1/3
+      if (x < 1) return (7 * x * x * x - 12 * x * x + 16 / 3.0f) / 6;
+      if (x < 2)
+        return (-7 / 3.0f * x * x * x + 12 * x * x - 20 * x + 32 / 3.0f) / 6;
+      return 0;
+    }
+    case resize_filter::lanczos: {
+      if (x < 1e-6f) return 1;
+      if (x >= 3) return 0;
+      return 3 * sin(pif * x) * sin(pif * x / 3) / (pif * pif * x * x);
+    }
+    case resize_filter::box: return x < 0.5f ? 1.0f : 0.0f;
+    default: return 0;
+  }
+}
+static float resize_support(resize_filter filter) {
+  switch (filter) {
+    case resize_filter::mitchell: return 2;
+    case resize_filter::lanczos: return 3;
+    case resize_filter::box: return 0.5f;
+    default: return 0;
+  }
+}
+
+// Filter taps for each output pixel along an axis, as source indices and
+// normalized weights. Filters are widened when minifying, and indices are
+// clamped to the image edges.
+struct resize_taps {
+  std::vector<int>   offsets = {};
+  std::vector<int>   indices = {};
+  std::vector<float> weights = {};
+};
+static resize_taps make_resize_taps(
+    int source, int target, resize_filter filter) {
+  auto taps   = resize_taps{};
+  auto scale  = (float)source / (float)target;
+  auto width  = max(scale, 1.0f);
+  auto radius = resize_support(filter) * width;
+  taps.offsets.push_back(0);
+  for (auto i = 0; i < target; i++) {
+    auto center = (i + 0.5f) * scale - 0.5f;
+    auto start  = (int)taps.weights.size();
+    auto sum    = 0.0f;
+    for (auto k = (int)ceil(center - radius); k <= (int)floor(center + radius);
+         k++) {
+      auto weight = resize_kernel(filter, (k - center) / width);
+      if (weight == 0) continue;
+      taps.indices.push_back(clamp(k, 0, source - 1));
+      taps.weights.push_back(weight);
+      sum += weight;
+    }
+    if (sum == 0) {
+      taps.indices.push_back(clamp((int)round(center), 0, source - 1));
+      taps.weights.push_back(1);
+      sum = 1;
+    }
+    for (auto k = start; k < (int)taps.weights.size(); k++)
+      taps.weights[k] /= sum;
+    taps.offsets.push_back((int)taps.weights.size());
+  }
+  return taps;
+}
+
+// Conversion of pixels to and from the four floats used while filtering.
+// Colors with alpha are premultiplied, and bytes and shorts keep their range
+// so that they are rounded back exactly.
+static vec4f resize_load(const vec4f& a) {
+  return {a.x * a.w, a.y * a.w, a.z * a.w, a.w};
+}
+static vec4f resize_load(const vec4b& a) {
+  auto w = a.w / 255.0f;
+  return {a.x * w, a.y * w, a.z * w, (float)a.w};
+}
+static vec4f resize_load(const vec3f& a) { return {a.x, a.y, a.z, 0}; }
+static vec4f resize_load(const vec3b& a) {
+  return {(float)a.x, (float)a.y, (float)a.z, 0};
+}
+static vec4f resize_load(const vec3h& a) {
+  return {math::half_to_float(a.x), math::half_to_float(a.y),
+      math::half_to_float(a.z), 0};
+}
+static vec4f resize_load(float a) { return {a, 0, 0, 0}; }
+static vec4f resize_load(byte a) { return {(float)a, 0, 0, 0}; }
+static vec4f resize_load(half a) { return {math::half_to_float(a), 0, 0, 0}; }
+static vec4f resize_load(ushort a) { return {(float)a, 0, 0, 0}; }
+static byte resize_round(float a) {
+  return (byte)clamp((int)(a + 0.5f), 0, 255);
+}
+static void resize_store(vec4f& a, const vec4f& v) {
+  a = v.w > 0 ? vec4f{v.x / v.w, v.y / v.w, v.z / v.w, v.w} : zero4f;
+}
+static void resize_store(vec4b& a, const vec4f& v) {
+  auto w = v.w / 255;
+  a = w > 0 ? vec4b{resize_round(v.x / w), resize_round(v.y / w),
+                  resize_round(v.z / w), resize_round(v.w)}
+            : vec4b{0, 0, 0, 0};
+}
+static void resize_store(vec3f& a, const vec4f& v) { a = {v.x, v.y, v.z}; }
+static void resize_store(vec3b& a, const vec4f& v) {
+  a = {resize_round(v.x), resize_round(v.y), resize_round(v.z)};
+}
+static void resize_store(vec3h& a, const vec4f& v) {
+  a = math::float_to_half(vec3f{v.x, v.y, v.z});
+}
+static void resize_store(float& a, const vec4f& v) { a = v.x; }
+static void resize_store(byte& a, const vec4f& v) { a = resize_round(v.x); }
+static void resize_store(half& a, const vec4f& v) {
+  a = math::float_to_half(v.x);
+}
+static void resize_store(ushort& a, const vec4f& v) {
+  a = (ushort)clamp((int)(v.x + 0.5f), 0, 65535);
+}
+
+// Resize an image in two separable passes, first along rows and then along
+// columns, both parallel over rows. Halving both sizes with a box filter
+// averages 2x2 blocks directly.
+template <typename T>
+static image<T> resize_image_impl(
+    const image<T>& img, const vec2i& size_, resize_filter filter) {
+  auto size   = resize_size(img.size(), size_);
+  auto result = image<T>{size};
+  if (img.empty()) return result;
+  if (filter == resize_filter::box && size * 2 == img.size()) {
+    common::parallel_for(size.y, [&](int j) {
+      for (auto i = 0; i < size.x; i++) {
+        resize_store(result[{i, j}],
+            (resize_load(img[{2 * i, 2 * j}]) +
+                resize_load(img[{2 * i + 1, 2 * j}]) +
+                resize_load(img[{2 * i, 2 * j + 1}]) +
+                resize_load(img[{2 * i + 1, 2 * j + 1}])) /
+                4);
+      }
+    });
+    return result;
+  }
+  auto xtaps = make_resize_taps(img.size().x, size.x, filter);
+  auto ytaps = make_resize_taps(img.size().y, size.y, filter);
+  auto rows  = image<vec4f>{{size.x, img.size().y}};
+  common::parallel_for(img.size().y, [&](int j) {
+    for (auto i = 0; i < size.x; i++) {
+      auto value = zero4f;
+      for (auto k = xtaps.offsets[i]; k < xtaps.offsets[i + 1]; k++)
+        value += resize_load(img[{xtaps.indices[k], j}]) * xtaps.weights[k];
+      rows[{i, j}] = value;
+    }
+  });
+  common::parallel_for(size.y, [&](int j) {
+    for (auto i = 0; i < size.x; i++) {
+      auto value = zero4f;
+      for (auto k = ytaps.offsets[j]; k < ytaps.offsets[j + 1]; k++)
+        value += rows[{i, ytaps.indices[k]}] * ytaps.weights[k];
+      resize_store(result[{i, j}], value);
+    }
+  });
+  return result;
+}
+
+// Resize an image.
+image<vec4f> resize_image(
+    const image<vec4f>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<vec4b> resize_image(
+    const image<vec4b>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<vec3f> resize_image(
+    const image<vec3f>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<vec3b> resize_image(
+    const image<vec3b>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<vec3h> resize_image(
+    const image<vec3h>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<float> resize_image(
+    const image<float>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<byte> resize_image(
+    const image<byte>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<half> resize_image(
+    const image<half>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+image<ushort> resize_image(
+    const image<ushort>& img, const vec2i& size, resize_filter filter) {
+  return resize_image_impl(img, size, filter);
+}
+
+// Build mip levels by repeated box downsampling.
+template <typename T>
+static std::vector<image<T>> build_mips_impl(const image<T>& img) {
+  auto mips = std::vector<image<T>>{};
+  if (img.empty()) return mips;
+  while (true) {
+    auto& previous = mips.empty() ? img : mips.back();
+    if (previous.size() == vec2i{1, 1}) break;
+    auto size = max(previous.size() / 2, vec2i{1, 1});
+    mips.push_back(resize_image_impl(previous, size, resize_filter::box));
+  }
+  return mips;
+}
+
+// Build mip levels.
+std::vector<image<vec4f>> build_mips(const image<vec4f>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<vec4b>> build_mips(const image<vec4b>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<vec3f>> build_mips(const image<vec3f>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<vec3b>> build_mips(const image<vec3b>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<vec3h>> build_mips(const image<vec3h>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<float>> build_mips(const image<float>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<byte>> build_mips(const image<byte>& img) {
+  return build_mips_impl(img);
+}
+std::vector<image<half>> build_mips(const image<half>& img) {
+  return build_mips_impl(img);
 }
-image<vec4b> resize_image(const image<vec4b>& img, const vec2i& size_) {
-  auto size    = resize_size(img.size(), size_);
-  auto res_img = image<vec4b>{size};
-  stbir_resize_uint8_generic((byte*)img.data(), img.size().x, img.size().y,
-      sizeof(vec4b) * img.size().x, (byte*)res_img.data(), res_img.size().x,
-      res_img.size().y, sizeof(vec4b) * res_img.size().x, 4, 3, 0,
-      STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, nullptr);
-  return res_img;
+std::vector<image<ushort>> build_mips(const image<ushort>& img) {
+  return build_mips_impl(img);
 }
 
 image<vec4f> image_difference(
@@ -819,6 +1325,486 @@ image<vec4f> image_difference(
   return diff;
 }
 
+// Structural dissimilarity of the luminance of a block of pixels
+static float block_dissimilarity(const image<vec4f>& a, const image<vec4f>& b,
+    const vec2i& start, const vec2i& end) {
+  auto luminance = [](const vec4f& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+  };
+  auto sa = 0.0f, sb = 0.0f, saa = 0.0f, sbb = 0.0f, sab = 0.0f;
+  for (auto j = start.y; j < end.y; j++) {
+    auto pa = &a[{start.x, j}], pb = &b[{start.x, j}];
+    for (auto i = 0; i < end.x - start.x; i++) {
+      auto la = luminance(pa[i]), lb = luminance(pb[i]);
+      sa += la;
+      sb += lb;
+      saa += la * la;
+      sbb += lb * lb;
+      sab += la * lb;
+    }
+  }
+  auto n    = (float)((end.x - start.x) * (end.y - start.y));
+  auto ma   = sa / n, mb = sb / n;
+  auto va   = max(saa / n - ma * ma, 0.0f), vb = max(sbb / n - mb * mb, 0.0f);
+  auto cab  = sab / n - ma * mb;
+  auto c1   = 0.01f * 0.01f, c2 = 0.03f * 0.03f;
+  auto ssim = ((2 * ma * mb + c1) * (2 * cab + c2)) /
+              ((ma * ma + mb * mb + c1) * (va + vb + c2));
+  return 1 - ssim;
+}
+
+float compare_images(const image<vec4f>& a, const image<vec4f>& b,
+    compare_metric metric, float threshold) {
+  if (a.size() != b.size())
+    throw std::invalid_argument("images have different sizes");
+  if (a.empty()) return 0;
+
+  // all metrics accumulate non-negative terms, so the partial sum is a lower
+  // bound of the result and bands stop as soon as it exceeds the threshold
+  auto size  = a.size();
+  auto block = 8;
+  auto bands = (size.y + block - 1) / block;
+  auto count = metric == compare_metric::ssim
+                   ? (double)bands * ((size.x + block - 1) / block)
+                   : (double)size.x * size.y;
+  auto bound = metric == compare_metric::rmse ? (double)threshold * threshold
+                                              : (double)threshold;
+  auto total = 0.0;
+  auto done  = std::atomic<bool>{false};
+  auto mutex = std::mutex{};
+  common::parallel_for(bands, [&](int band) {
+    if (done) return;
+    auto start = band * block, end = min(start + block, size.y);
+    auto value = 0.0f;
+    if (metric == compare_metric::ssim) {
+      for (auto i = 0; i < size.x; i += block) {
+        value += block_dissimilarity(
+            a, b, {i, start}, {min(i + block, size.x), end});
+      }
+    } else {
+      for (auto j = start; j < end; j++) {
+        auto pa  = &a[{0, j}], pb = &b[{0, j}];
+        auto row = 0.0f;
+        for (auto i = 0; i < size.x; i++) {
+          auto d = max(abs(pa[i] - pb[i]));
+          if (metric == compare_metric::max) {
+            row = max(row, d);
+          } else if (metric == compare_metric::mean) {
+            row += d;
+          } else {
+            row += d * d;
+          }
+        }
+        value = metric == compare_metric::max ? max(value, row) : value + row;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (metric == compare_metric::max) {
+      total = std::max(total, (double)value);
+      if (total > bound) done = true;
+    } else {
+      total += value;
+      if (total / count > bound) done = true;
+    }
+  });
+
+  switch (metric) {
+    case compare_metric::max: return (float)total;
+    case compare_metric::mean: return (float)(total / count);
+    case compare_metric::rmse: return (float)std::sqrt(total / count);
+    case compare_metric::ssim: return (float)(total / count);
+    default: return 0;
+  }
+}
+
+image<vec4f> filter_gaussian(const image<vec4f>& img, float sigma) {
+  if (sigma <= 0) return img;
+
+  // kernel, renormalized at the borders by summing the weights
+  auto size   = img.size();
+  auto width  = (int)ceil(2.57f * sigma);
+  auto kernel = std::vector<float>(2 * width + 1);
+  for (auto k = -width; k <= width; k++)
+    kernel[k + width] = exp(-(float)(k * k) / (2 * sigma * sigma));
+
+  // filter rows, then columns a row at a time to stay in cache
+  auto rows     = image<vec4f>{size};
+  auto filtered = image<vec4f>{size};
+  common::parallel_for(size.y, [&](int j) {
+    for (auto i = 0; i < size.x; i++) {
+      auto sum  = zero4f;
+      auto wsum = 0.0f;
+      for (auto k = max(-width, -i); k <= min(width, size.x - 1 - i); k++) {
+        sum += kernel[k + width] * img[{i + k, j}];
+        wsum += kernel[k + width];
+      }
+      rows[{i, j}] = sum / wsum;
+    }
+  });
+  common::parallel_for(size.y, [&](int j) {
+    auto wsum = 0.0f;
+    for (auto k = max(-width, -j); k <= min(width, size.y - 1 - j); k++) {
+      auto w = kernel[k + width];
+      for (auto i = 0; i < size.x; i++)
+        filtered[{i, j}] += w * rows[{i, j + k}];
+      wsum += w;
+    }
+    for (auto i = 0; i < size.x; i++) filtered[{i, j}] /= wsum;
+  });
+  return filtered;
+}
+
+image<vec4f> filter_box(const image<vec4f>& img, int radius) {
+  // filter a line with a running sum, kept in double to avoid drift
+  auto size        = img.size();
+  auto filter_line = [radius](const vec4f* source, vec4f* filtered,
+                         int length, int stride) {
+    auto sum   = std::array<double, 4>{0, 0, 0, 0};
+    auto count = 0;
+    auto add   = [&](int pos, double sign) {
+      auto& c = source[(size_t)pos * stride];
+      sum[0] += sign * c.x;
+      sum[1] += sign * c.y;
+      sum[2] += sign * c.z;
+      sum[3] += sign * c.w;
+      count += (int)sign;
+    };
+    for (auto pos = 0; pos < min(radius, length); pos++) add(pos, 1);
+    for (auto pos = 0; pos < length; pos++) {
+      if (pos + radius < length) add(pos + radius, 1);
+      if (pos - radius - 1 >= 0) add(pos - radius - 1, -1);
+      filtered[(size_t)pos * stride] = {(float)(sum[0] / count),
+          (float)(sum[1] / count), (float)(sum[2] / count),
+          (float)(sum[3] / count)};
+    }
+  };
+
+  // filter rows, then columns
+  auto rows     = image<vec4f>{size};
+  auto filtered = image<vec4f>{size};
+  common::parallel_for(size.y, [&](int j) {
+    filter_line(&img[{0, j}], &rows[{0, j}], size.x, 1);
+  });
+  common::parallel_for(size.x, [&](int i) {
+    filter_line(&rows[{i, 0}], &filtered[{i, 0}], size.y, size.x);
+  });
+  return filtered;
+}
+
+// Maximum number of position dimensions in the permutohedral lattice
+constexpr auto lattice_max_dims = 35;
+constexpr auto lattice_max_keys = (lattice_max_dims + 1) * lattice_max_dims;
+
+// Permutohedral lattice [Adams et al. 2010]. Lattice points are stored in an
+// open addressing hash table with keys of d coordinates and values of vd
+// components.
+struct lattice_table {
+  int                d       = 0;
+  int                vd      = 0;
+  std::vector<int>   keys    = {};
+  std::vector<float> values  = {};
+  std::vector<int>   entries = {};
+
+  lattice_table(int d_, int vd_) : d{d_}, vd{vd_}, entries(1 << 10, -1) {}
+
+  int   size() const { return (int)(keys.size() / d); }
+  float* value(int idx) { return values.data() + (size_t)idx * vd; }
+
+  size_t hash(const int* key) const {
+    auto h = (size_t)0;
+    for (auto i = 0; i < d; i++) h = (h + key[i]) * 2531011;
+    return h;
+  }
+
+  // Find a point, or create it if requested, returning -1 if missing.
+  int find(const int* key, bool create) {
+    if (create && (size_t)size() * 2 >= entries.size()) grow();
+    auto mask = entries.size() - 1;
+    for (auto h = hash(key) & mask;; h = (h + 1) & mask) {
+      auto idx = entries[h];
+      if (idx < 0) {
+        if (!create) return -1;
+        idx = entries[h] = size();
+        keys.insert(keys.end(), key, key + d);
+        values.resize(values.size() + vd, 0);
+        return idx;
+      }
+      if (std::equal(key, key + d, keys.data() + (size_t)idx * d)) return idx;
+    }
+  }
+  void grow() {
+    entries.assign(entries.size() * 2, -1);
+    auto mask = entries.size() - 1;
+    for (auto idx = 0; idx < size(); idx++) {
+      auto h = hash(keys.data() + (size_t)idx * d) & mask;
+      while (entries[h] >= 0) h = (h + 1) & mask;
+      entries[h] = idx;
+    }
+  }
+};
+
+// Compute the d+1 lattice points enclosing a position, given in units of
+// standard deviations, and their barycentric weights.
+static void lattice_simplex(
+    const float* position, int d, int* keys, float* weights) {
+  // scaled so that the blur in lattice space has unit variance
+  auto elevated = std::array<float, lattice_max_dims + 1>{};
+  auto greedy   = std::array<int, lattice_max_dims + 1>{};
+  auto rank     = std::array<int, lattice_max_dims + 1>{};
+  auto bary     = std::array<float, lattice_max_dims + 2>{};
+  auto inv_std  = sqrt(2.0f / 3.0f) * (d + 1);
+
+  // elevate to the hyperplane of dimension d in d+1
+  auto sum = 0.0f;
+  for (auto i = d; i > 0; i--) {
+    auto cf     = position[i - 1] * inv_std / sqrt((float)(i * (i + 1)));
+    elevated[i] = sum - i * cf;
+    sum += cf;
+  }
+  elevated[0] = sum;
+
+  // closest remainder-0 point and ranks of the differences
+  auto total = 0;
+  for (auto i = 0; i <= d; i++) {
+    auto v    = elevated[i] / (d + 1);
+    auto up   = (int)ceil(v) * (d + 1);
+    auto down = (int)floor(v) * (d + 1);
+    greedy[i] = (up - elevated[i] < elevated[i] - down) ? up : down;
+    total += greedy[i];
+    rank[i] = 0;
+  }
+  total /= d + 1;
+  for (auto i = 0; i < d; i++) {
+    for (auto j = i + 1; j <= d; j++) {
+      if (elevated[i] - greedy[i] < elevated[j] - greedy[j]) {
+        rank[i]++;
+      } else {
+        rank[j]++;
+      }
+    }
+  }
+  if (total > 0) {
+    for (auto i = 0; i <= d; i++) {
+      if (rank[i] >= d + 1 - total) {
+        greedy[i] -= d + 1;
+        rank[i] += total - (d + 1);
+      } else {
+        rank[i] += total;
+      }
+    }
+  } else if (total < 0) {
+    for (auto i = 0; i <= d; i++) {
+      if (rank[i] < -total) {
+        greedy[i] += d + 1;
+        rank[i] += (d + 1) + total;
+      } else {
+        rank[i] += total;
+      }
+    }
+  }
+
+  // barycentric coordinates
+  for (auto i = 0; i <= d + 1; i++) bary[i] = 0;
+  for (auto i = 0; i <= d; i++) {
+    auto delta = (elevated[i] - greedy[i]) / (d + 1);
+    bary[d - rank[i]] += delta;
+    bary[d + 1 - rank[i]] -= delta;
+  }
+  bary[0] += 1 + bary[d + 1];
+
+  // simplex vertices
+  for (auto r = 0; r <= d; r++) {
+    for (auto i = 0; i < d; i++) {
+      keys[r * d + i] = greedy[i] + (rank[i] <= d - r ? r : r - (d + 1));
+    }
+    weights[r] = bary[r];
+  }
+}
+
+// Filter an image with a gaussian in the space of positions computed for each
+// pixel by `Position`, that writes d values in units of standard deviations.
+template <typename Position>
+static image<vec4f> filter_lattice(
+    const image<vec4f>& img, int d, Position&& get_position) {
+  if (d > lattice_max_dims)
+    throw std::invalid_argument("too many filter dimensions");
+  auto size = img.size();
+
+  // splat pixels in bands of rows, each on its own table
+  auto vd     = 5;
+  auto nbands = min(common::get_num_threads(), size.y);
+  auto bands  = std::vector<lattice_table>(nbands, lattice_table{d, vd});
+  common::parallel_for(nbands, [&](int band) {
+    auto& table    = bands[band];
+    auto  position = std::array<float, lattice_max_dims>{};
+    auto  keys     = std::array<int, lattice_max_keys>{};
+    auto  weights  = std::array<float, lattice_max_dims + 1>{};
+    for (auto j = size.y * band / nbands; j < size.y * (band + 1) / nbands;
+         j++) {
+      for (auto i = 0; i < size.x; i++) {
+        get_position(vec2i{i, j}, position.data());
+        lattice_simplex(position.data(), d, keys.data(), weights.data());
+        auto& c = img[{i, j}];
+        for (auto r = 0; r <= d; r++) {
+          auto value = table.value(table.find(keys.data() + r * d, true));
+          auto w     = weights[r];
+          value[0] += w * c.x;
+          value[1] += w * c.y;
+          value[2] += w * c.z;
+          value[3] += w * c.w;
+          value[4] += w;
+        }
+      }
+    }
+  });
+
+  // merge bands
+  auto table = std::move(bands.front());
+  for (auto band = 1; band < nbands; band++) {
+    auto& other = bands[band];
+    for (auto idx = 0; idx < other.size(); idx++) {
+      auto value = table.value(table.find(other.keys.data() + idx * d, true));
+      auto ovalue = other.value(idx);
+      for (auto k = 0; k < vd; k++) value[k] += ovalue[k];
+    }
+    other = lattice_table{d, vd};
+  }
+
+  // blur along each lattice direction with a [1 2 1] kernel
+  auto blurred = std::vector<float>(table.values.size());
+  for (auto axis = 0; axis <= d; axis++) {
+    common::parallel_for(0, table.size(), 256, [&](int idx) {
+      auto key  = table.keys.data() + (size_t)idx * d;
+      auto key1 = std::array<int, lattice_max_dims>{};
+      auto key2 = std::array<int, lattice_max_dims>{};
+      for (auto i = 0; i < d; i++) {
+        key1[i] = key[i] + (i == axis ? d : -1);
+        key2[i] = key[i] - (i == axis ? d : -1);
+      }
+      auto value  = table.values.data() + (size_t)idx * vd;
+      auto idx1   = table.find(key1.data(), false);
+      auto idx2   = table.find(key2.data(), false);
+      auto result = blurred.data() + (size_t)idx * vd;
+      for (auto k = 0; k < vd; k++) {
+        result[k] = 0.5f * value[k];
+        if (idx1 >= 0) result[k] += 0.25f * table.values[idx1 * vd + k];
+        if (idx2 >= 0) result[k] += 0.25f * table.values[idx2 * vd + k];
+      }
+    });
+    std::swap(table.values, blurred);
+  }
+
+  // slice values back at pixels and normalize
+  auto filtered = image<vec4f>{size};
+  common::parallel_for(size.y, [&](int j) {
+    auto position = std::array<float, lattice_max_dims>{};
+    auto keys     = std::array<int, lattice_max_keys>{};
+    auto weights  = std::array<float, lattice_max_dims + 1>{};
+    for (auto i = 0; i < size.x; i++) {
+      get_position(vec2i{i, j}, position.data());
+      lattice_simplex(position.data(), d, keys.data(), weights.data());
+      auto sum = std::array<float, 5>{0, 0, 0, 0, 0};
+      for (auto r = 0; r <= d; r++) {
+        auto idx = table.find(keys.data() + r * d, false);
+        if (idx < 0) continue;
+        for (auto k = 0; k < vd; k++)
+          sum[k] += weights[r] * table.values[idx * vd + k];
+      }
+      filtered[{i, j}] = sum[4] > 0
+                             ? vec4f{sum[0], sum[1], sum[2], sum[3]} / sum[4]
+                             : img[{i, j}];
+    }
+  });
+  return filtered;
+}
+
+image<vec4f> filter_bilateral(
+    const image<vec4f>& img, float spatial_sigma, float range_sigma) {
+  return filter_bilateral(img, spatial_sigma, range_sigma, {}, {});
+}
+
+image<vec4f> filter_bilateral(const image<vec4f>& img, float spatial_sigma,
+    float range_sigma, const std::vector<image<vec4f>>& features,
+    const std::vector<float>& features_sigma) {
+  if (features.size() != features_sigma.size())
+    throw std::invalid_argument("features and sigmas do not match");
+  for (auto& feature : features) {
+    if (feature.size() != img.size())
+      throw std::invalid_argument("image haev different sizes");
+  }
+  if (spatial_sigma <= 0 || range_sigma <= 0) return img;
+  auto d = 5 + 3 * (int)features.size();
+  return filter_lattice(img, d, [&](const vec2i& ij, float* position) {
+    auto c      = img[ij];
+    position[0] = ij.x / spatial_sigma;
+    position[1] = ij.y / spatial_sigma;
+    position[2] = c.x / range_sigma;
+    position[3] = c.y / range_sigma;
+    position[4] = c.z / range_sigma;
+    for (auto fid = 0; fid < (int)features.size(); fid++) {
+      auto f                = features[fid][ij];
+      position[5 + fid * 3] = f.x / features_sigma[fid];
+      position[6 + fid * 3] = f.y / features_sigma[fid];
+      position[7 + fid * 3] = f.z / features_sigma[fid];
+    }
+  });
+}
+
+image<vec4f> denoise_image(const image<vec4f>& img, const image<vec4f>& albedo,
+    const image<vec4f>& normal, int radius, float sigma_color,
+    float sigma_albedo, float sigma_normal) {
+  if (img.size() != albedo.size() || img.size() != normal.size())
+    throw std::invalid_argument("image haev different sizes");
+  // demodulate albedo where it is not black
+  auto size       = img.size();
+  auto irradiance = image<vec3f>{size};
+  for (auto i = 0llu; i < img.count(); i++) {
+    auto a        = xyz(albedo[i]);
+    auto c        = xyz(img[i]);
+    irradiance[i] = {a.x > 0.01f ? c.x / a.x : c.x,
+        a.y > 0.01f ? c.y / a.y : c.y, a.z > 0.01f ? c.z / a.z : c.z};
+  }
+
+  // filter, weighting neighbors by distance and feature differences
+  auto denoised    = image<vec4f>{size};
+  auto inv_spatial = 1 / (2 * pow(max(radius, 1) / 2.0f, 2.0f));
+  auto inv_color   = 1 / (2 * sigma_color * sigma_color);
+  auto inv_albedo  = 1 / (2 * sigma_albedo * sigma_albedo);
+  auto inv_normal  = 1 / (2 * sigma_normal * sigma_normal);
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      auto c0   = irradiance[{i, j}];
+      auto a0   = xyz(albedo[{i, j}]);
+      auto n0   = xyz(normal[{i, j}]);
+      auto sum  = zero3f;
+      auto wsum = 0.0f;
+      for (auto jj = max(j - radius, 0); jj <= min(j + radius, size.y - 1);
+           jj++) {
+        for (auto ii = max(i - radius, 0); ii <= min(i + radius, size.x - 1);
+             ii++) {
+          auto c = irradiance[{ii, jj}];
+          auto a = xyz(albedo[{ii, jj}]);
+          auto n = xyz(normal[{ii, jj}]);
+          // color differences are relative, so that noise scales with them
+          auto dc = (c - c0) / (0.01f + (max(c) + max(c0)) / 2);
+          auto w  = exp(-(float)((ii - i) * (ii - i) + (jj - j) * (jj - j)) *
+                           inv_spatial -
+                       dot(dc, dc) * inv_color -
+                       distance_squared(a, a0) * inv_albedo -
+                       distance_squared(n, n0) * inv_normal);
+          sum += c * w;
+          wsum += w;
+        }
+      }
+      auto c           = sum / wsum;
+      denoised[{i, j}] = {a0.x > 0.01f ? c.x * a0.x : c.x,
+          a0.y > 0.01f ? c.y * a0.y : c.y, a0.z > 0.01f ? c.z * a0.z : c.z,
+          img[{i, j}].w};
+    }
+  }
+  return denoised;
+}
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -852,16 +1838,17 @@ image<vec4f> bump_to_normal(const image<vec4f>& img, float scale) {
   return norm;
 }
 
+// Make an image from a shader of uv, in parallel over rows
 template <typename Shader>
 void make_image(image<vec4f>& img, const vec2i& size, Shader&& shader) {
   img.resize(size);
   auto scale = 1.0f / max(size);
-  for (auto j = 0; j < img.size().y; j++) {
+  common::parallel_for(img.size().y, [&img, &shader, scale](int j) {
     for (auto i = 0; i < img.size().x; i++) {
       auto uv     = vec2f{i * scale, j * scale};
       img[{i, j}] = shader(uv);
     }
-  }
+  });
 };
 
 // Make an image
@@ -976,43 +1963,61 @@ void make_blackbodyramp(
   });
 }
 
+// Evaluate noise images
+vec4f eval_noisemap(const vec2f& uv_, float scale, const vec4f& color0,
+    const vec4f& color1) {
+  auto uv = uv_ * 8 * scale;
+  auto v  = math::perlin_noise(vec3f{uv.x, uv.y, 0.5f});
+  v       = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
+  return lerp(color0, color1, v);
+}
+vec4f eval_fbmmap(const vec2f& uv_, float scale, const vec4f& noise,
+    const vec4f& color0, const vec4f& color1) {
+  auto uv = uv_ * 8 * scale;
+  auto v  = math::perlin_fbm(
+      {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z);
+  v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
+  return lerp(color0, color1, v);
+}
+vec4f eval_turbulencemap(const vec2f& uv_, float scale, const vec4f& noise,
+    const vec4f& color0, const vec4f& color1) {
+  auto uv = uv_ * 8 * scale;
+  auto v  = math::perlin_turbulence(
+      {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z);
+  v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
+  return lerp(color0, color1, v);
+}
+vec4f eval_ridgemap(const vec2f& uv_, float scale, const vec4f& noise,
+    const vec4f& color0, const vec4f& color1) {
+  auto uv = uv_ * 8 * scale;
+  auto v  = math::perlin_ridge(
+      {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z, noise.w);
+  v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
+  return lerp(color0, color1, v);
+}
+
 void make_noisemap(image<vec4f>& img, const vec2i& size, float scale,
     const vec4f& color0, const vec4f& color1) {
   return make_image(img, size, [=](vec2f uv) {
-    uv *= 8 * scale;
-    auto v = math::perlin_noise(vec3f{uv.x, uv.y, 0.5f});
-    v      = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
-    return lerp(color0, color1, v);
+    return eval_noisemap(uv, scale, color0, color1);
   });
 }
 void make_fbmmap(image<vec4f>& img, const vec2i& size, float scale,
     const vec4f& noise, const vec4f& color0, const vec4f& color1) {
   return make_image(img, size, [=](vec2f uv) {
-    uv *= 8 * scale;
-    auto v = math::perlin_fbm(
-        {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z);
-    v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
-    return lerp(color0, color1, v);
+    return eval_fbmmap(uv, scale, noise, color0, color1);
   });
 }
 void make_turbulencemap(image<vec4f>& img, const vec2i& size, float scale,
     const vec4f& noise, const vec4f& color0, const vec4f& color1) {
   return make_image(img, size, [=](vec2f uv) {
-    uv *= 8 * scale;
-    auto v = math::perlin_turbulence(
-        {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z);
-    v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
-    return lerp(color0, color1, v);
+    return eval_turbulencemap(uv, scale, noise, color0, color1);
   });
 }
 void make_ridgemap(image<vec4f>& img, const vec2i& size, float scale,
     const vec4f& noise, const vec4f& color0, const vec4f& color1) {
   return make_image(img, size, [=](vec2f uv) {
-    uv *= 8 * scale;
-    auto v = math::perlin_ridge(
-        {uv.x, uv.y, 0.5f}, noise.x, noise.y, (int)noise.z, noise.w);
-    v = clamp(0.5f + 0.5f * v, 0.0f, 1.0f);
-    return lerp(color0, color1, v);
+    return eval_ridgemap(uv, scale, noise, color0, color1);
   });
 }
 
@@ -1123,10 +2128,9 @@ void make_sunsky(image<vec4f>& img, const vec2i& size, float theta_sun,
     return (has_sun && gamma < sun_angular_radius) ? sun_le / 10000 : zero3f;
   };
 
-  // Make the sun sky image
-  img               = image<vec4f>{size};
-  auto sky_integral = 0.0f, sun_integral = 0.0f;
-  for (auto j = 0; j < img.size().y / 2; j++) {
+  // Make the sun sky image, in parallel over rows
+  img = image<vec4f>{size};
+  common::parallel_for(img.size().y / 2, [&](int j) {
     auto theta = pif * ((j + 0.5f) / img.size().y);
     theta      = clamp(theta, 0.0f, pif / 2 - math::flt_eps);
     for (int i = 0; i < img.size().x; i++) {
@@ -1135,24 +2139,25 @@ void make_sunsky(image<vec4f>& img, const vec2i& size, float theta_sun,
       auto gamma   = acos(clamp(dot(w, sun_direction), -1.0f, 1.0f));
       auto sky_col = sky(theta, gamma, theta_sun);
       auto sun_col = sun(theta, gamma);
-      sky_integral += mean(sky_col) * sin(theta);
-      sun_integral += mean(sun_col) * sin(theta);
-      auto col    = sky_col + sun_col;
-      img[{i, j}] = {col.x, col.y, col.z, 1};
+      auto col     = sky_col + sun_col;
+      img[{i, j}]  = {col.x, col.y, col.z, 1};
     }
-  }
+  });
 
   if (ground_albedo != zero3f) {
-    auto ground = zero3f;
-    for (auto j = 0; j < img.size().y / 2; j++) {
+    // sum rows in parallel, then add them in order
+    auto rows = std::vector<vec3f>(img.size().y / 2, zero3f);
+    common::parallel_for((int)rows.size(), [&](int j) {
       auto theta = pif * ((j + 0.5f) / img.size().y);
       for (int i = 0; i < img.size().x; i++) {
         auto pxl   = img[{i, j}];
         auto le    = vec3f{pxl.x, pxl.y, pxl.z};
         auto angle = sin(theta) * 4 * pif / (img.size().x * img.size().y);
-        ground += le * (ground_albedo / pif) * cos(theta) * angle;
+        rows[j] += le * (ground_albedo / pif) * cos(theta) * angle;
       }
-    }
+    });
+    auto ground = zero3f;
+    for (auto& row : rows) ground += row;
     for (auto j = img.size().y / 2; j < img.size().y; j++) {
       for (int i = 0; i < img.size().x; i++) {
         img[{i, j}] = {ground.x, ground.y, ground.z, 1};
@@ -1411,38 +2416,50 @@ static inline std::vector<std::string> split_string(const std::string& str) {
   return ret;
 }
 
-// Pfm load
-static inline float* load_pfm(
-    const char* filename, int* w, int* h, int* nc, int req) {
-  auto fs = fopen(filename, "rb");
-  if (!fs) return nullptr;
-  auto fs_guard = std::unique_ptr<FILE, void (*)(FILE*)>{
-      fs, [](FILE* f) { fclose(f); }};
-
+// Pfm header, leaving the file at the start of the pixels
+static inline bool load_pfm_header(
+    FILE* fs, int* w, int* h, int* nc, float* s) {
   // buffer
   char buffer[4096];
   auto toks = std::vector<std::string>();
 
   // read magic
-  if (!fgets(buffer, sizeof(buffer), fs)) return nullptr;
+  if (!fgets(buffer, sizeof(buffer), fs)) return false;
   toks = split_string(buffer);
+  if (toks.empty()) return false;
   if (toks[0] == "Pf")
     *nc = 1;
   else if (toks[0] == "PF")
     *nc = 3;
   else
-    return nullptr;
+    return false;
 
   // read w, h
-  if (!fgets(buffer, sizeof(buffer), fs)) return nullptr;
+  if (!fgets(buffer, sizeof(buffer), fs)) return false;
   toks = split_string(buffer);
-  *w   = atoi(toks[0].c_str());
-  *h   = atoi(toks[1].c_str());
+  if (toks.size() < 2) return false;
+  *w = atoi(toks[0].c_str());
+  *h = atoi(toks[1].c_str());
 
   // read scale
-  if (!fgets(buffer, sizeof(buffer), fs)) return nullptr;
-  toks   = split_string(buffer);
-  auto s = atof(toks[0].c_str());
+  if (!fgets(buffer, sizeof(buffer), fs)) return false;
+  toks = split_string(buffer);
+  if (toks.empty()) return false;
+  *s = (float)atof(toks[0].c_str());
+  return true;
+}
+
+// Pfm load
+static inline float* load_pfm(
+    const char* filename, int* w, int* h, int* nc, int req) {
+  auto fs = fopen(filename, "rb");
+  if (!fs) return nullptr;
+  auto fs_guard = std::unique_ptr<FILE, void (*)(FILE*)>{
+      fs, [](FILE* f) { fclose(f); }};
+
+  // read header
+  auto s = 0.0f;
+  if (!load_pfm_header(fs, w, h, nc, &s)) return nullptr;
 
   // read the data (flip y)
   auto npixels = (size_t)(*w) * (size_t)(*h);
@@ -1554,6 +2571,375 @@ static inline bool save_pfm(
   return true;
 }
 
+// Deflate bit writer, least significant bits first.
+struct deflate_bits {
+  std::vector<byte> data   = {};
+  uint32_t          buffer = 0;
+  int               count  = 0;
+};
+static inline void add_bits(deflate_bits& bits, uint32_t code, int length) {
+  bits.buffer |= code << bits.count;
+  bits.count += length;
+  while (bits.count >= 8) {
+    bits.data.push_back((byte)(bits.buffer & 255));
+    bits.buffer >>= 8;
+    bits.count -= 8;
+  }
+}
+static inline void add_huffman(deflate_bits& bits, int code) {
+  // fixed huffman codes, stored with their bits reversed
+  static const auto table = [] {
+    auto table = std::array<std::pair<uint32_t, int>, 288>{};
+    for (auto code = 0; code < 288; code++) {
+      auto [value, length] = code <= 143   ? std::pair{0x30 + code, 8}
+                             : code <= 255 ? std::pair{0x190 + code - 144, 9}
+                             : code <= 279 ? std::pair{code - 256, 7}
+                                           : std::pair{0xc0 + code - 280, 8};
+      auto reversed = (uint32_t)0;
+      for (auto i = 0; i < length; i++, value >>= 1)
+        reversed = (reversed << 1) | (value & 1);
+      table[code] = {reversed, length};
+    }
+    return table;
+  }();
+  add_bits(bits, table[code].first, table[code].second);
+}
+
+// Deflate a chunk as a non-final block with fixed codes, the same scheme
+// used by stb_image_write, and end it with a sync flush so that chunks
+// compressed independently can be concatenated in one stream.
+static void deflate_chunk(deflate_bits& bits, const byte* data, int size) {
+  static const int length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17,
+      19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+      259};
+  static const int length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2,
+      2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const int dist_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65,
+      97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577, 32768};
+  static const int dist_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5,
+      6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  constexpr auto hash_bits = 14, max_chain = 16, max_dist = 32767;
+
+  // hash chains over the last 32K
+  auto head = std::vector<int>(1 << hash_bits, -1);
+  auto prev = std::vector<int>(size, -1);
+  auto hash = [data](int i) {
+    auto value = (uint32_t)data[i] | ((uint32_t)data[i + 1] << 8) |
+                 ((uint32_t)data[i + 2] << 16);
+    return (value * 2654435761u) >> (32 - hash_bits);
+  };
+  auto find = [&](int i, int& dist) {
+    auto best = 2, limit = min(258, size - i);
+    for (auto p = head[hash(i)], n = 0; p >= 0 && i - p <= max_dist &&
+                                        n < max_chain;
+         p = prev[p], n++) {
+      auto length = 0;
+      while (length < limit && data[p + length] == data[i + length]) length++;
+      if (length > best) {
+        best = length;
+        dist = i - p;
+        if (length == limit) break;
+      }
+    }
+    return best > 2 ? best : 0;
+  };
+  auto insert = [&](int i) {
+    auto h  = hash(i);
+    prev[i] = head[h];
+    head[h] = i;
+  };
+
+  add_bits(bits, 0, 1);  // not final
+  add_bits(bits, 1, 2);  // fixed huffman
+  auto i = 0;
+  while (i < size - 2) {
+    auto dist = 0, next_dist = 0;
+    auto length = find(i, dist);
+    insert(i);
+    // lazy matching: emit a literal if the next match is longer
+    if (length && i + 1 < size - 2 && find(i + 1, next_dist) > length)
+      length = 0;
+    if (length) {
+      auto l = 0, d = 0;
+      while (length > length_base[l + 1] - 1) l++;
+      add_huffman(bits, l + 257);
+      if (length_extra[l])
+        add_bits(bits, length - length_base[l], length_extra[l]);
+      while (dist > dist_base[d + 1] - 1) d++;
+      auto reversed = 0;
+      for (auto b = 0; b < 5; b++) reversed |= ((d >> b) & 1) << (4 - b);
+      add_bits(bits, reversed, 5);
+      if (dist_extra[d]) add_bits(bits, dist - dist_base[d], dist_extra[d]);
+      for (auto k = i + 1; k < i + length && k < size - 2; k++) insert(k);
+      i += length;
+    } else {
+      add_huffman(bits, data[i]);
+      i++;
+    }
+  }
+  for (; i < size; i++) add_huffman(bits, data[i]);
+  add_huffman(bits, 256);
+
+  // sync flush with an empty stored block, which also aligns to bytes
+  add_bits(bits, 0, 3);
+  if (bits.count) add_bits(bits, 0, 8 - bits.count);
+  bits.data.insert(bits.data.end(), {(byte)0, (byte)0, (byte)255, (byte)255});
+}
+
+// Adler-32 checksum of zlib streams
+static inline uint32_t zlib_adler(const byte* data, size_t size) {
+  auto s1 = (uint32_t)1, s2 = (uint32_t)0;
+  for (auto start = (size_t)0; start < size; start += 5552) {
+    auto end = std::min(start + 5552, size);
+    for (auto i = start; i < end; i++) {
+      s1 += data[i];
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  return (s2 << 16) | s1;
+}
+
+// End a zlib stream of deflated chunks with an empty final block and the
+// checksum of the uncompressed data.
+static inline void deflate_end(deflate_bits& bits, uint32_t adler) {
+  add_bits(bits, 1, 1);  // final
+  add_bits(bits, 1, 2);  // fixed huffman
+  add_huffman(bits, 256);
+  if (bits.count) add_bits(bits, 0, 8 - bits.count);
+  bits.data.insert(bits.data.end(), {(byte)(adler >> 24), (byte)(adler >> 16),
+                                        (byte)(adler >> 8), (byte)adler});
+}
+
+// Png crc
+static inline uint32_t png_crc(uint32_t crc, const byte* data, size_t size) {
+  static const auto table = [] {
+    auto table = std::array<uint32_t, 256>{};
+    for (auto n = 0u; n < 256; n++) {
+      auto c = n;
+      for (auto k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (auto i = (size_t)0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Save png. Rows are filtered and compressed in parallel, in chunks of rows.
+static inline bool save_png(
+    const char* filename, int w, int h, int nc, const byte* pixels) {
+  if (nc < 1 || nc > 4) return false;
+  auto fs = fopen(filename, "wb");
+  if (!fs) return false;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // chunk writer
+  auto write_chunk = [fs](const char* type, const byte* data, size_t size) {
+    auto header = std::array<byte, 8>{(byte)(size >> 24), (byte)(size >> 16),
+        (byte)(size >> 8), (byte)size, (byte)type[0], (byte)type[1],
+        (byte)type[2], (byte)type[3]};
+    auto crc    = png_crc(png_crc(0, header.data() + 4, 4), data, size);
+    auto footer = std::array<byte, 4>{
+        (byte)(crc >> 24), (byte)(crc >> 16), (byte)(crc >> 8), (byte)crc};
+    if (fwrite(header.data(), 1, 8, fs) != 8) return false;
+    if (size && fwrite(data, 1, size, fs) != size) return false;
+    if (fwrite(footer.data(), 1, 4, fs) != 4) return false;
+    return true;
+  };
+
+  // header
+  static const byte signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+  static const byte color_types[] = {0, 0, 4, 2, 6};
+  if (fwrite(signature, 1, 8, fs) != 8) return false;
+  auto ihdr = std::array<byte, 13>{(byte)(w >> 24), (byte)(w >> 16),
+      (byte)(w >> 8), (byte)w, (byte)(h >> 24), (byte)(h >> 16), (byte)(h >> 8),
+      (byte)h, 8, color_types[nc], 0, 0, 0};
+  if (!write_chunk("IHDR", ihdr.data(), ihdr.size())) return false;
+
+  // filter each row with the filter that minimizes the sum of absolute
+  // differences, like stb_image_write, using zeros above the first row
+  auto row_size = (size_t)w * nc;
+  auto filtered = std::vector<byte>((row_size + 1) * h);
+  auto zeros    = std::vector<byte>(row_size, 0);
+  auto filter   = [&](int j, std::array<std::vector<byte>, 5>& line) {
+    auto row        = pixels + j * row_size;
+    auto above      = j > 0 ? row - row_size : zeros.data();
+    auto out        = filtered.data() + j * (row_size + 1);
+    auto best_score = std::numeric_limits<size_t>::max();
+    for (auto type = 0; type < 5; type++) {
+      auto& values = line[type];
+      values.resize(row_size);
+      auto score = (size_t)0;
+      for (auto i = (size_t)0; i < row_size; i++) {
+        int a = i >= (size_t)nc ? row[i - nc] : 0, b = above[i],
+            c = i >= (size_t)nc ? above[i - nc] : 0;
+        auto predicted = 0;
+        switch (type) {
+          case 0: predicted = 0; break;
+          case 1: predicted = a; break;
+          case 2: predicted = b; break;
+          case 3: predicted = (a + b) >> 1; break;
+          case 4: {
+            auto p = a + b - c, pa = abs(p - a), pb = abs(p - b),
+                 pc = abs(p - c);
+            predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+          } break;
+        }
+        values[i] = (byte)(row[i] - predicted);
+        score += abs((int)(signed char)values[i]);
+      }
+      if (score < best_score) {
+        best_score = score;
+        out[0]     = (byte)type;
+      }
+    }
+    std::copy(line[out[0]].begin(), line[out[0]].end(), out + 1);
+  };
+
+  // compress chunks of at least 256Kb, with one chunk per thread at least
+  auto chunk_rows = max(1, min((int)((1 << 18) / (row_size + 1) + 1),
+                               (h + common::get_num_threads() - 1) /
+                                   common::get_num_threads()));
+  auto num_chunks = h ? (h + chunk_rows - 1) / chunk_rows : 0;
+  auto chunks     = std::vector<deflate_bits>(num_chunks);
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto start = chunk * chunk_rows, end = min(start + chunk_rows, h);
+    auto line  = std::array<std::vector<byte>, 5>{};
+    for (auto j = start; j < end; j++) filter(j, line);
+    deflate_chunk(chunks[chunk], filtered.data() + start * (row_size + 1),
+        (int)((end - start) * (row_size + 1)));
+  });
+
+  // zlib stream in multiple IDAT chunks
+  static const byte zlib_header[] = {0x78, 0x5e};
+  if (!write_chunk("IDAT", zlib_header, 2)) return false;
+  for (auto& chunk : chunks) {
+    if (!write_chunk("IDAT", chunk.data.data(), chunk.data.size()))
+      return false;
+  }
+  auto last = deflate_bits{};
+  deflate_end(last, zlib_adler(filtered.data(), filtered.size()));
+  if (!write_chunk("IDAT", last.data.data(), last.data.size())) return false;
+  if (!write_chunk("IEND", nullptr, 0)) return false;
+  return true;
+}
+
+// Save exr, ZIP compressed as half floats. The file is written here, rather
+// than by tinyexr, so that blocks of 16 scanlines are compressed in parallel
+// with the png deflate encoder.
+static inline bool save_exr(
+    const char* filename, int w, int h, int nc, const float* pixels) {
+  if ((nc != 3 && nc != 4) || w <= 0 || h <= 0) return false;
+  auto fs = fopen(filename, "wb");
+  if (!fs) return false;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // header, with magic number and version
+  auto header     = std::vector<byte>{0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+  auto add_string = [&header](const char* value) {
+    header.insert(header.end(), value, value + strlen(value) + 1);
+  };
+  auto add_value = [&header](auto value) {
+    auto data = (const byte*)&value;
+    header.insert(header.end(), data, data + sizeof(value));
+  };
+  auto add_attribute = [&](const char* name, const char* type, int size) {
+    add_string(name);
+    add_string(type);
+    add_value((int32_t)size);
+  };
+
+  // channels are listed in alphabetical order, and stored in that order
+  static const char* names[] = {"R", "G", "B", "A"};
+  auto channels = nc == 4 ? std::vector<int>{3, 2, 1, 0}
+                          : std::vector<int>{2, 1, 0};
+  add_attribute("channels", "chlist", nc * 18 + 1);
+  for (auto c : channels) {
+    add_string(names[c]);
+    add_value((int32_t)1);  // half
+    add_value((int32_t)0);  // linear flag and reserved
+    add_value((int32_t)1);  // x sampling
+    add_value((int32_t)1);  // y sampling
+  }
+  header.push_back(0);
+  add_attribute("compression", "compression", 1);
+  header.push_back(3);  // zip, 16 scanlines
+  for (auto window : {"dataWindow", "displayWindow"}) {
+    add_attribute(window, "box2i", 16);
+    for (auto value : {0, 0, w - 1, h - 1}) add_value((int32_t)value);
+  }
+  add_attribute("lineOrder", "lineOrder", 1);
+  header.push_back(0);  // increasing y
+  add_attribute("pixelAspectRatio", "float", 4);
+  add_value(1.0f);
+  add_attribute("screenWindowCenter", "v2f", 8);
+  add_value(0.0f);
+  add_value(0.0f);
+  add_attribute("screenWindowWidth", "float", 4);
+  add_value(1.0f);
+  header.push_back(0);
+
+  // convert blocks to halfs, reorder and delta encode their bytes as the
+  // exr zip predictor does, and compress them, keeping the raw data when
+  // it is smaller
+  constexpr auto block_lines = 16;
+  auto num_blocks = (h + block_lines - 1) / block_lines;
+  auto blocks     = std::vector<std::vector<byte>>(num_blocks);
+  common::parallel_for(num_blocks, [&](int block) {
+    auto start = block * block_lines, end = min(start + block_lines, h);
+    auto raw   = std::vector<byte>((size_t)(end - start) * w * nc * 2);
+    auto data  = raw.data();
+    for (auto j = start; j < end; j++) {
+      for (auto c : channels) {
+        for (auto i = 0; i < w; i++) {
+          auto value = math::float_to_half(
+              pixels[((size_t)j * w + i) * nc + c]);
+          *data++ = (byte)(value.bits & 255);
+          *data++ = (byte)(value.bits >> 8);
+        }
+      }
+    }
+    auto size      = raw.size();
+    auto predicted = std::vector<byte>(size);
+    for (auto i = (size_t)0; i < size; i++)
+      predicted[(i & 1) ? (size + 1) / 2 + i / 2 : i / 2] = raw[i];
+    for (auto i = size - 1; i > 0; i--)
+      predicted[i] = (byte)(predicted[i] - predicted[i - 1] + 128);
+    auto bits = deflate_bits{};
+    bits.data = {0x78, 0x5e};
+    deflate_chunk(bits, predicted.data(), (int)size);
+    deflate_end(bits, zlib_adler(predicted.data(), size));
+    blocks[block] = bits.data.size() < size ? std::move(bits.data)
+                                            : std::move(raw);
+  });
+
+  // header, offset table and blocks, each prefixed by its first scanline
+  // and size
+  if (fwrite(header.data(), 1, header.size(), fs) != header.size())
+    return false;
+  auto offsets = std::vector<uint64_t>(num_blocks);
+  auto offset  = (uint64_t)header.size() + (uint64_t)num_blocks * 8;
+  for (auto block = 0; block < num_blocks; block++) {
+    offsets[block] = offset;
+    offset += 8 + blocks[block].size();
+  }
+  if (fwrite(offsets.data(), 8, num_blocks, fs) != (size_t)num_blocks)
+    return false;
+  for (auto block = 0; block < num_blocks; block++) {
+    auto& data   = blocks[block];
+    auto  prefix = std::array<int32_t, 2>{
+        block * block_lines, (int32_t)data.size()};
+    if (fwrite(prefix.data(), 4, 2, fs) != 2) return false;
+    if (fwrite(data.data(), 1, data.size(), fs) != data.size()) return false;
+  }
+  return true;
+}
+
 // Get extension (not including '.').
 static std::string get_extension(const std::string& filename) {
   auto pos = filename.rfind('.');
@@ -1604,10 +2990,15 @@ bool is_hdr_filename(const std::string& filename) {
     free(pixels);
     return true;
   } else if (!is_hdr_filename(filename)) {
-    auto imgb = image<vec4b>{};
-    if (!load_image(filename, imgb, error)) return false;
-    img = srgb_to_rgb(imgb);
-    return true;
+    // decode directly to linear, with no intermediate byte image
+    img.clear();
+    return load_image(filename, error, 64,
+        [&img](const vec2i& size, int row,
+            const image_view<const vec4f>& block) {
+          img.resize(size);
+          copy_image(
+              get_view(img, {0, row, size.x, row + block.size().y}), block);
+        });
   } else {
     return format_error();
   }
@@ -1637,8 +3028,8 @@ bool is_hdr_filename(const std::string& filename) {
       return write_error();
     return true;
   } else if (ext == ".exr" || ext == ".EXR") {
-    if (SaveEXR((float*)img.data(), img.size().x, img.size().y, 4,
-            filename.c_str()) < 0)
+    if (!save_exr(filename.c_str(), img.size().x, img.size().y, 4,
+            (const float*)img.data()))
       return write_error();
     return true;
   } else if (!is_hdr_filename(filename)) {
@@ -1693,8 +3084,8 @@ bool is_hdr_filename(const std::string& filename) {
 
   auto ext = get_extension(filename);
   if (ext == ".png" || ext == ".PNG") {
-    if (!stbi_write_png(filename.c_str(), img.size().x, img.size().y, 4,
-            img.data(), img.size().x * 4))
+    if (!save_png(filename.c_str(), img.size().x, img.size().y, 4,
+            (const byte*)img.data()))
       return write_error();
     return true;
   } else if (ext == ".jpg" || ext == ".JPG") {
@@ -1719,6 +3110,238 @@ bool is_hdr_filename(const std::string& filename) {
   }
 }
 
+// Radiance rgbe encoding of a linear color
+static inline vec4b float_to_rgbe(const vec4f& rgb) {
+  auto r = max(rgb.x, 0.0f), g = max(rgb.y, 0.0f), b = max(rgb.z, 0.0f);
+  auto m = max(r, max(g, b));
+  if (m < 1e-32f) return {0, 0, 0, 0};
+  auto e = 0;
+  auto n = frexp(m, &e) * 256 / m;
+  return {(byte)(r * n), (byte)(g * n), (byte)(b * n), (byte)(e + 128)};
+}
+
+// Streaming loads an image.
+[[nodiscard]] bool load_image(const std::string& filename, std::string& error,
+    int rows, const image_reader& reader) {
+  auto format_error = [filename, &error]() {
+    error = filename + ": unknown format";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  // send a decoded image in blocks
+  rows             = max(rows, 1);
+  auto send_blocks = [rows, &reader](const image_view<const vec4f>& view) {
+    auto size = view.size();
+    for (auto j = 0; j < size.y; j += rows) {
+      reader(size, j, get_view(view, {0, j, size.x, j + rows}));
+    }
+  };
+
+  auto ext = get_extension(filename);
+  if (ext == ".pfm" || ext == ".PFM") {
+    auto fs = fopen(filename.c_str(), "rb");
+    if (!fs) return read_error();
+    auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+    auto width = 0, height = 0, ncomp = 0;
+    auto scale = 0.0f;
+    if (!load_pfm_header(fs, &width, &height, &ncomp, &scale))
+      return read_error();
+    // rows are stored bottom to top, so each block is read backwards
+    auto start  = (long)ftell(fs);
+    auto nrow   = (size_t)width * (size_t)ncomp;
+    auto values = std::vector<float>(nrow * rows);
+    auto block  = image<vec4f>{{width, rows}};
+    for (auto j = 0; j < height; j += rows) {
+      auto count = min(rows, height - j);
+      auto first = (size_t)(height - j - count);
+      if (fseek(fs, start + (long)(first * nrow * sizeof(float)), SEEK_SET))
+        return read_error();
+      if (fread(values.data(), sizeof(float), nrow * count, fs) !=
+          nrow * count)
+        return read_error();
+      if (scale > 0) {
+        for (auto& value : values) {
+          auto data = (byte*)&value;
+          std::swap(data[0], data[3]);
+          std::swap(data[1], data[2]);
+        }
+      }
+      auto scl = abs(scale);
+      for (auto jj = 0; jj < count; jj++) {
+        auto row = values.data() + (count - 1 - jj) * nrow;
+        for (auto i = 0; i < width; i++) {
+          auto v = row + i * ncomp;
+          block[{i, jj}] = ncomp == 1 ? vec4f{v[0], v[0], v[0], 1}
+                                      : vec4f{v[0], v[1], v[2], 1};
+          if (scl != 1) xyz(block[{i, jj}]) *= scl;
+        }
+      }
+      reader({width, height}, j, get_view(block, {0, 0, width, count}));
+    }
+    return true;
+  } else if (ext == ".exr" || ext == ".EXR") {
+    auto width = 0, height = 0;
+    auto pixels = (float*)nullptr;
+    if (LoadEXR(&pixels, &width, &height, filename.c_str(), nullptr) < 0)
+      return read_error();
+    if (!pixels) return read_error();
+    auto pixels_guard = std::unique_ptr<float, decltype(&free)>{pixels, free};
+    send_blocks({{width, height}, (const vec4f*)pixels});
+    return true;
+  } else if (ext == ".hdr" || ext == ".HDR") {
+    auto width = 0, height = 0, ncomp = 0;
+    auto pixels = stbi_loadf(filename.c_str(), &width, &height, &ncomp, 4);
+    if (!pixels) return read_error();
+    auto pixels_guard = std::unique_ptr<float, decltype(&free)>{pixels, free};
+    send_blocks({{width, height}, (const vec4f*)pixels});
+    return true;
+  } else if (ext == ".png" || ext == ".PNG" || ext == ".jpg" ||
+             ext == ".JPG" || ext == ".tga" || ext == ".TGA" ||
+             ext == ".bmp" || ext == ".BMP") {
+    auto width = 0, height = 0, ncomp = 0;
+    auto pixels = stbi_load(filename.c_str(), &width, &height, &ncomp, 4);
+    if (!pixels) return read_error();
+    auto pixels_guard = std::unique_ptr<byte, decltype(&free)>{pixels, free};
+    // decode to linear one block at a time
+    auto& table = srgb_byte_table();
+    auto  srgb  = (const vec4b*)pixels;
+    auto  block = image<vec4f>{{width, rows}};
+    for (auto j = 0; j < height; j += rows) {
+      auto count = min(rows, height - j);
+      for (auto idx = 0ull; idx < (size_t)width * count; idx++) {
+        auto c     = srgb[(size_t)j * width + idx];
+        block[idx] = {
+            table[c.x], table[c.y], table[c.z], math::byte_to_float(c.w)};
+      }
+      reader({width, height}, j, get_view(block, {0, 0, width, count}));
+    }
+    return true;
+  } else {
+    return format_error();
+  }
+}
+
+// Streaming saves an image.
+[[nodiscard]] bool save_image(const std::string& filename, const vec2i& size,
+    std::string& error, int rows, const image_writer& writer) {
+  auto format_error = [filename, &error]() {
+    error = filename + ": unknown format";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  // fill an image in blocks
+  rows             = max(rows, 1);
+  auto fill_blocks = [rows, &writer](const image_view<vec4f>& view) {
+    for (auto j = 0; j < view.size().y; j += rows) {
+      writer(j, get_view(view, {0, j, view.size().x, j + rows}));
+    }
+  };
+
+  auto ext = get_extension(filename);
+  if (ext == ".pfm" || ext == ".PFM") {
+    auto fs = fopen(filename.c_str(), "wb");
+    if (!fs) return write_error();
+    auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+    if (fprintf(fs, "PF\n%d %d\n-1\n", size.x, size.y) < 0)
+      return write_error();
+    // same row order and channels as save_pfm()
+    auto block  = image<vec4f>{{size.x, rows}};
+    auto values = std::vector<vec3f>((size_t)size.x * rows);
+    for (auto j = 0; j < size.y; j += rows) {
+      auto count = min(rows, size.y - j);
+      auto view  = get_view(block, {0, 0, size.x, count});
+      writer(j, view);
+      for (auto idx = 0ull; idx < view.count(); idx++)
+        values[idx] = xyz(block[idx]);
+      if (fwrite(values.data(), sizeof(vec3f), view.count(), fs) !=
+          view.count())
+        return write_error();
+    }
+    return true;
+  } else if (ext == ".hdr" || ext == ".HDR") {
+    auto fs = fopen(filename.c_str(), "wb");
+    if (!fs) return write_error();
+    auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+    if (fprintf(fs, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+            size.y, size.x) < 0)
+      return write_error();
+    // run-length scanlines with literal runs only, flat for unusual widths
+    auto rle    = size.x >= 8 && size.x < 32768;
+    auto block  = image<vec4f>{{size.x, rows}};
+    auto rgbe   = std::vector<vec4b>(size.x);
+    auto buffer = std::vector<byte>{};
+    for (auto j = 0; j < size.y; j += rows) {
+      auto count = min(rows, size.y - j);
+      writer(j, get_view(block, {0, 0, size.x, count}));
+      for (auto jj = 0; jj < count; jj++) {
+        for (auto i = 0; i < size.x; i++)
+          rgbe[i] = float_to_rgbe(block[{i, jj}]);
+        buffer.clear();
+        if (rle) {
+          buffer.insert(buffer.end(),
+              {(byte)2, (byte)2, (byte)(size.x >> 8), (byte)(size.x & 255)});
+          for (auto c = 0; c < 4; c++) {
+            for (auto i = 0; i < size.x; i += 128) {
+              auto run = min(128, size.x - i);
+              buffer.push_back((byte)run);
+              for (auto k = i; k < i + run; k++) buffer.push_back(rgbe[k][c]);
+            }
+          }
+        } else {
+          buffer.insert(buffer.end(), (byte*)rgbe.data(),
+              (byte*)(rgbe.data() + rgbe.size()));
+        }
+        if (fwrite(buffer.data(), 1, buffer.size(), fs) != buffer.size())
+          return write_error();
+      }
+    }
+    return true;
+  } else if (ext == ".exr" || ext == ".EXR") {
+    auto img = image<vec4f>{size};
+    fill_blocks(img);
+    return save_image(filename, img, error);
+  } else if (!is_hdr_filename(filename)) {
+    // encode to srgb one block at a time
+    auto img   = image<vec4b>{size};
+    auto block = image<vec4f>{{size.x, rows}};
+    for (auto j = 0; j < size.y; j += rows) {
+      auto count = min(rows, size.y - j);
+      auto view  = get_view(block, {0, 0, size.x, count});
+      writer(j, view);
+      auto srgb = &img[{0, j}];
+      for (auto idx = 0ull; idx < view.count(); idx++) {
+        auto c    = block[idx];
+        srgb[idx] = float_to_byte(vec4f{xyz(fast_rgb_to_srgb(c)), c.w});
+      }
+    }
+    return save_image(filename, img, error);
+  } else {
+    return format_error();
+  }
+}
+
+// Saves an image in the background.
+std::future<bool> save_image_async(
+    const std::string& filename, const image<vec4f>& img, std::string& error) {
+  return std::async(std::launch::async, [filename, img, &error]() {
+    return save_image(filename, img, error);
+  });
+}
+std::future<bool> save_image_async(
+    const std::string& filename, const image<vec4b>& img, std::string& error) {
+  return std::async(std::launch::async, [filename, img, &error]() {
+    return save_image(filename, img, error);
+  });
+}
+
 // Loads an hdr image.
 [[nodiscard]] bool load_image(
     const std::string& filename, image<vec3f>& img, std::string& error) {
@@ -1795,8 +3418,8 @@ bool is_hdr_filename(const std::string& filename) {
       return write_error();
     return true;
   } else if (ext == ".exr" || ext == ".EXR") {
-    if (SaveEXR((float*)img.data(), img.size().x, img.size().y, 3,
-            filename.c_str()) < 0)
+    if (!save_exr(filename.c_str(), img.size().x, img.size().y, 3,
+            (const float*)img.data()))
       return write_error();
     return true;
   } else if (!is_hdr_filename(filename)) {
@@ -1851,8 +3474,8 @@ bool is_hdr_filename(const std::string& filename) {
 
   auto ext = get_extension(filename);
   if (ext == ".png" || ext == ".PNG") {
-    if (!stbi_write_png(filename.c_str(), img.size().x, img.size().y, 3,
-            img.data(), img.size().x * 3))
+    if (!save_png(filename.c_str(), img.size().x, img.size().y, 3,
+            (const byte*)img.data()))
       return write_error();
     return true;
   } else if (ext == ".jpg" || ext == ".JPG") {
@@ -2015,8 +3638,8 @@ bool is_hdr_filename(const std::string& filename) {
 
   auto ext = get_extension(filename);
   if (ext == ".png" || ext == ".PNG") {
-    if (!stbi_write_png(filename.c_str(), img.size().x, img.size().y, 1,
-            img.data(), img.size().x * 1))
+    if (!save_png(filename.c_str(), img.size().x, img.size().y, 1,
+            (const byte*)img.data()))
       return write_error();
     return true;
   } else if (ext == ".jpg" || ext == ".JPG") {
@@ -2072,6 +3695,420 @@ bool is_hdr_filename(const std::string& filename) {
   }
 }
 
+// Loads the rgb channels of an exr image as halfs. Half channels are copied
+// as stored, others are converted. Images without rgb use their first
+// channel for all three.
+static bool load_exr_half(const std::string& filename, vec2i& size,
+    std::vector<vec3h>& pixels) {
+  auto version = EXRVersion{};
+  if (ParseEXRVersionFromFile(&version, filename.c_str()) != TINYEXR_SUCCESS)
+    return false;
+  if (version.multipart || version.non_image || version.tiled) return false;
+  auto header = EXRHeader{};
+  InitEXRHeader(&header);
+  if (ParseEXRHeaderFromFile(&header, &version, filename.c_str(), nullptr) !=
+      TINYEXR_SUCCESS)
+    return false;
+  auto header_guard = std::unique_ptr<EXRHeader, int (*)(EXRHeader*)>{
+      &header, FreeEXRHeader};
+  auto exr = EXRImage{};
+  InitEXRImage(&exr);
+  if (LoadEXRImageFromFile(&exr, &header, filename.c_str(), nullptr) !=
+      TINYEXR_SUCCESS)
+    return false;
+  auto image_guard = std::unique_ptr<EXRImage, int (*)(EXRImage*)>{
+      &exr, FreeEXRImage};
+  if (!exr.images || header.num_channels < 1) return false;
+  auto channels = vec3i{-1, -1, -1};
+  for (auto c = 0; c < header.num_channels; c++) {
+    auto name = std::string{header.channels[c].name};
+    if (name == "R") channels.x = c;
+    if (name == "G") channels.y = c;
+    if (name == "B") channels.z = c;
+  }
+  if (channels.x < 0 || channels.y < 0 || channels.z < 0) channels = {0, 0, 0};
+  size = {exr.width, exr.height};
+  pixels.resize((size_t)size.x * (size_t)size.y);
+  for (auto k = 0; k < 3; k++) {
+    auto c    = channels[k];
+    auto data = exr.images[c];
+    auto type = header.pixel_types[c];
+    for (auto i = (size_t)0; i < pixels.size(); i++) {
+      auto& value = (&pixels[i].x)[k];
+      if (type == TINYEXR_PIXELTYPE_HALF) {
+        value = ((const half*)data)[i];
+      } else if (type == TINYEXR_PIXELTYPE_FLOAT) {
+        value = math::float_to_half(((const float*)data)[i]);
+      } else {
+        value = math::float_to_half((float)((const uint*)data)[i]);
+      }
+    }
+  }
+  return true;
+}
+
+// Loads a 16 bit image as halfs, mapping [0,65535] to [0,1].
+static bool load_png16_half(const std::string& filename, vec2i& size,
+    int channels, std::vector<half>& pixels) {
+  auto width = 0, height = 0, ncomp = 0;
+  auto data  = stbi_load_16(
+      filename.c_str(), &width, &height, &ncomp, channels);
+  if (!data) return false;
+  size = {width, height};
+  pixels.resize((size_t)width * (size_t)height * channels);
+  for (auto i = (size_t)0; i < pixels.size(); i++) {
+    pixels[i] = math::float_to_half(math::ushort_to_float(data[i]));
+  }
+  free(data);
+  return true;
+}
+
+// Loads a half image.
+[[nodiscard]] bool load_image(
+    const std::string& filename, image<vec3h>& img, std::string& error) {
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  auto ext = get_extension(filename);
+  if (ext == ".exr" || ext == ".EXR") {
+    auto size   = zero2i;
+    auto pixels = std::vector<vec3h>{};
+    if (!load_exr_half(filename, size, pixels)) return read_error();
+    img = image{size, (const vec3h*)pixels.data()};
+    return true;
+  } else if ((ext == ".png" || ext == ".PNG") &&
+             stbi_is_16_bit(filename.c_str())) {
+    auto size   = zero2i;
+    auto pixels = std::vector<half>{};
+    if (!load_png16_half(filename, size, 3, pixels)) return read_error();
+    img = image{size, (const vec3h*)pixels.data()};
+    return true;
+  } else {
+    auto imgf = image<vec3f>{};
+    if (!load_image(filename, imgf, error)) return false;
+    img = float_to_half(imgf);
+    return true;
+  }
+}
+
+// Loads a half image.
+[[nodiscard]] bool load_image(
+    const std::string& filename, image<half>& img, std::string& error) {
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  auto ext = get_extension(filename);
+  if ((ext == ".png" || ext == ".PNG") && stbi_is_16_bit(filename.c_str())) {
+    auto size   = zero2i;
+    auto pixels = std::vector<half>{};
+    if (!load_png16_half(filename, size, 1, pixels)) return read_error();
+    img = image{size, (const half*)pixels.data()};
+    return true;
+  } else {
+    auto imgf = image<float>{};
+    if (!load_image(filename, imgf, error)) return false;
+    img = float_to_half(imgf);
+    return true;
+  }
+}
+
+}  // namespace yocto::image
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BLOCK COMPRESSED IMAGES
+// -----------------------------------------------------------------------------
+namespace yocto::image {
+
+// Number of blocks along each image axis
+static vec2i block_counts(const vec2i& size) {
+  return {(size.x + 3) / 4, (size.y + 3) / 4};
+}
+
+// Conversion between colors and 5:6:5 bits, expanding bits by replication.
+static int encode_565(const vec3f& color) {
+  auto r = clamp((int)(color.x * 31 / 255 + 0.5f), 0, 31);
+  auto g = clamp((int)(color.y * 63 / 255 + 0.5f), 0, 63);
+  auto b = clamp((int)(color.z * 31 / 255 + 0.5f), 0, 31);
+  return (r << 11) | (g << 5) | b;
+}
+static vec3i decode_565(int color) {
+  auto r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+  return {(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+
+// BC1 palette. Blocks are in four colors mode when the first endpoint is
+// larger, and in three colors and black mode otherwise.
+static std::array<vec3i, 4> bc1_palette(int c0, int c1) {
+  auto e0 = decode_565(c0), e1 = decode_565(c1);
+  if (c0 > c1) {
+    return {e0, e1, (e0 * 2 + e1 + vec3i{1}) / 3, (e0 + e1 * 2 + vec3i{1}) / 3};
+  } else {
+    return {e0, e1, (e0 + e1) / 2, vec3i{0, 0, 0}};
+  }
+}
+
+// Encode a block of 16 colors, in [0,255], as BC1. Endpoints are placed on
+// the principal axis of the colors and then refined by least squares on the
+// chosen indices, keeping the encoding with the smallest error.
+static uint64_t encode_bc1(const std::array<vec3f, 16>& colors) {
+  auto mean = zero3f;
+  for (auto& color : colors) mean += color;
+  mean /= 16;
+  auto xx = 0.0f, xy = 0.0f, xz = 0.0f, yy = 0.0f, yz = 0.0f, zz = 0.0f;
+  for (auto& color : colors) {
+    auto d = color - mean;
+    xx += d.x * d.x, xy += d.x * d.y, xz += d.x * d.z;
+    yy += d.y * d.y, yz += d.y * d.z, zz += d.z * d.z;
+  }
+  auto axis = vec3f{1, 1, 1};
+  for (auto iteration = 0; iteration < 8; iteration++) {
+    axis = {xx * axis.x + xy * axis.y + xz * axis.z,
+        xy * axis.x + yy * axis.y + yz * axis.z,
+        xz * axis.x + yz * axis.y + zz * axis.z};
+    auto len = length(axis);
+    if (len < 1e-6f) {
+      axis = zero3f;
+      break;
+    }
+    axis /= len;
+  }
+  auto tmin = 0.0f, tmax = 0.0f;
+  for (auto& color : colors) {
+    auto t = dot(color - mean, axis);
+    tmin = min(tmin, t);
+    tmax = max(tmax, t);
+  }
+  auto end0 = mean + axis * tmax, end1 = mean + axis * tmin;
+  auto best       = (uint64_t)0;
+  auto best_error = std::numeric_limits<float>::max();
+  for (auto pass = 0; pass < 2; pass++) {
+    auto c0 = encode_565(end0), c1 = encode_565(end1);
+    if (c0 < c1) std::swap(c0, c1);
+    auto palette = bc1_palette(c0, c1);
+    auto indices = std::array<int, 16>{};
+    auto error   = 0.0f;
+    auto bits    = (uint64_t)c0 | ((uint64_t)c1 << 16);
+    for (auto p = 0; p < 16; p++) {
+      auto perror = std::numeric_limits<float>::max();
+      for (auto k = 0; k < 4; k++) {
+        auto d = colors[p] - (vec3f)palette[k];
+        if (dot(d, d) < perror) {
+          perror     = dot(d, d);
+          indices[p] = k;
+        }
+      }
+      error += perror;
+      bits |= (uint64_t)indices[p] << (32 + 2 * p);
+    }
+    if (error < best_error) {
+      best       = bits;
+      best_error = error;
+    }
+    if (c0 == c1) break;
+    // solve for the endpoints that best fit the colors with these indices
+    static const auto weights = std::array<float, 4>{1, 0, 2 / 3.0f, 1 / 3.0f};
+    auto a00 = 0.0f, a01 = 0.0f, a11 = 0.0f;
+    auto b0 = zero3f, b1 = zero3f;
+    for (auto p = 0; p < 16; p++) {
+      auto w0 = weights[indices[p]], w1 = 1 - w0;
+      a00 += w0 * w0, a01 += w0 * w1, a11 += w1 * w1;
+      b0 += colors[p] * w0, b1 += colors[p] * w1;
+    }
+    auto det = a00 * a11 - a01 * a01;
+    if (abs(det) < 1e-6f) break;
+    end0 = (b0 * a11 - b1 * a01) / det;
+    end1 = (b1 * a00 - b0 * a01) / det;
+  }
+  return best;
+}
+
+// Decode a pixel of a BC1 block.
+static vec3b decode_bc1(uint64_t block, int p) {
+  auto palette = bc1_palette(
+      (int)(block & 0xffff), (int)((block >> 16) & 0xffff));
+  auto color = palette[(block >> (32 + 2 * p)) & 3];
+  return {(byte)color.x, (byte)color.y, (byte)color.z};
+}
+
+// Encode a block of 16 values as BC4, in the eight values mode between the
+// block minimum and maximum.
+static uint64_t encode_bc4(const std::array<int, 16>& values) {
+  auto lo = 255, hi = 0;
+  for (auto value : values) lo = min(lo, value), hi = max(hi, value);
+  auto block = (uint64_t)hi | ((uint64_t)lo << 8);
+  if (hi == lo) return block;
+  for (auto p = 0; p < 16; p++) {
+    auto t = ((values[p] - lo) * 14 + (hi - lo)) / (2 * (hi - lo));
+    auto k = t == 7 ? 0 : t == 0 ? 1 : 8 - t;
+    block |= (uint64_t)k << (16 + 3 * p);
+  }
+  return block;
+}
+
+// Decode a pixel of a BC4 block, in both the eight and six values modes.
+static byte decode_bc4(uint64_t block, int p) {
+  auto r0 = (int)(block & 0xff), r1 = (int)((block >> 8) & 0xff);
+  auto k  = (int)((block >> (16 + 3 * p)) & 7);
+  if (k == 0) return (byte)r0;
+  if (k == 1) return (byte)r1;
+  if (r0 > r1) return (byte)(((8 - k) * r0 + (k - 1) * r1 + 3) / 7);
+  if (k == 6) return 0;
+  if (k == 7) return 255;
+  return (byte)(((6 - k) * r0 + (k - 1) * r1 + 2) / 5);
+}
+
+// Compress images in blocks. Blocks past the image edges clamp pixels.
+block_image compress_image(const image<vec3b>& img) {
+  auto counts = block_counts(img.size());
+  auto bimg   = block_image{block_format::bc1, img.size(),
+      std::vector<uint64_t>((size_t)counts.x * (size_t)counts.y)};
+  common::parallel_for(counts.y, [&](int bj) {
+    for (auto bi = 0; bi < counts.x; bi++) {
+      auto colors = std::array<vec3f, 16>{};
+      for (auto p = 0; p < 16; p++) {
+        auto i = min(bi * 4 + p % 4, img.size().x - 1);
+        auto j = min(bj * 4 + p / 4, img.size().y - 1);
+        auto c = img[{i, j}];
+        colors[p] = {(float)c.x, (float)c.y, (float)c.z};
+      }
+      bimg.blocks[(size_t)bj * counts.x + bi] = encode_bc1(colors);
+    }
+  });
+  return bimg;
+}
+block_image compress_image(const image<byte>& img) {
+  auto counts = block_counts(img.size());
+  auto bimg   = block_image{block_format::bc4, img.size(),
+      std::vector<uint64_t>((size_t)counts.x * (size_t)counts.y)};
+  common::parallel_for(counts.y, [&](int bj) {
+    for (auto bi = 0; bi < counts.x; bi++) {
+      auto values = std::array<int, 16>{};
+      for (auto p = 0; p < 16; p++) {
+        auto i    = min(bi * 4 + p % 4, img.size().x - 1);
+        auto j    = min(bj * 4 + p / 4, img.size().y - 1);
+        values[p] = img[{i, j}];
+      }
+      bimg.blocks[(size_t)bj * counts.x + bi] = encode_bc4(values);
+    }
+  });
+  return bimg;
+}
+
+// Decode a pixel or a whole block image.
+vec3b lookup_block(const block_image& img, const vec2i& ij) {
+  auto block =
+      img.blocks[(size_t)(ij.y / 4) * ((img.size.x + 3) / 4) + ij.x / 4];
+  auto p = (ij.y % 4) * 4 + ij.x % 4;
+  if (img.format == block_format::bc1) {
+    return decode_bc1(block, p);
+  } else {
+    return vec3b{decode_bc4(block, p)};
+  }
+}
+image<vec3b> decompress_image(const block_image& img) {
+  auto decoded = image<vec3b>{img.size};
+  for (auto j = 0; j < img.size.y; j++) {
+    for (auto i = 0; i < img.size.x; i++) {
+      decoded[{i, j}] = lookup_block(img, {i, j});
+    }
+  }
+  return decoded;
+}
+
+// Four character codes used in DDS files
+static uint32_t dds_fourcc(const char* code) {
+  auto value = (uint32_t)0;
+  memcpy(&value, code, sizeof(value));
+  return value;
+}
+
+// Loads a block compressed DDS file, reading only its first mip level.
+bool load_image(
+    const std::string& filename, block_image& img, std::string& error) {
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+  auto format_error = [filename, &error]() {
+    error = filename + ": unsupported format";
+    return false;
+  };
+
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // magic and header, with the pixel format four character code
+  auto header = std::array<uint32_t, 32>{};
+  if (fread(header.data(), sizeof(uint32_t), header.size(), fs) !=
+      header.size())
+    return read_error();
+  if (header[0] != dds_fourcc("DDS ") || header[1] != 124)
+    return format_error();
+  if (header[21] == dds_fourcc("DXT1")) {
+    img.format = block_format::bc1;
+  } else if (header[21] == dds_fourcc("ATI1") ||
+             header[21] == dds_fourcc("BC4U")) {
+    img.format = block_format::bc4;
+  } else {
+    return format_error();
+  }
+  img.size    = {(int)header[4], (int)header[3]};
+  auto counts = block_counts(img.size);
+  img.blocks.resize((size_t)counts.x * (size_t)counts.y);
+  if (fread(img.blocks.data(), sizeof(uint64_t), img.blocks.size(), fs) !=
+      img.blocks.size())
+    return read_error();
+  return true;
+}
+
+// Saves a block compressed DDS file.
+bool save_image(
+    const std::string& filename, const block_image& img, std::string& error) {
+  auto format_error = [filename, &error]() {
+    error = filename + ": unknown format";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  auto ext = get_extension(filename);
+  if (ext != ".dds" && ext != ".DDS") return format_error();
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) return write_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // header with caps, height, width, pixel format and linear size flags
+  auto header = std::array<uint32_t, 32>{};
+  header[0]   = dds_fourcc("DDS ");
+  header[1]   = 124;
+  header[2]   = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000;
+  header[3]   = (uint32_t)img.size.y;
+  header[4]   = (uint32_t)img.size.x;
+  header[5]   = (uint32_t)(img.blocks.size() * sizeof(uint64_t));
+  header[19]  = 32;
+  header[20]  = 0x4;
+  header[21]  = dds_fourcc(img.format == block_format::bc1 ? "DXT1" : "ATI1");
+  header[27]  = 0x1000;
+  if (fwrite(header.data(), sizeof(uint32_t), header.size(), fs) !=
+      header.size())
+    return write_error();
+  if (fwrite(img.blocks.data(), sizeof(uint64_t), img.blocks.size(), fs) !=
+      img.blocks.size())
+    return write_error();
+  return true;
+}
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -7,9 +7,9 @@
 // utilities and tone mapping. We provinde loading and saving functionality for
 // images and support PNG, JPG, TGA, BMP, HDR, EXR formats.
 //
-// This library depends on stb_image.h, stb_image_write.h, stb_image_resize.h,
-// tinyexr.h for the IO features. If thoese are not needed, it can be safely
-// used without dependencies.
+// This library depends on stb_image.h, stb_image_write.h and tinyexr.h for
+// the IO features. If thoese are not needed, it can be safely used without
+// dependencies.
 //
 //
 // ## Images
@@ -97,8 +97,12 @@
 // -----------------------------------------------------------------------------
 
 #include <algorithm>
+#include <cstdint>
 #include <functional>
+#include <future>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "yocto_math.h"
@@ -110,6 +114,8 @@ namespace yocto::image {
 
 // Math defitions
 using math::byte;
+using math::flt_max;
+using math::half;
 using math::mat3f;
 using math::pif;
 using math::ushort;
@@ -117,6 +123,7 @@ using math::vec2f;
 using math::vec2i;
 using math::vec3b;
 using math::vec3f;
+using math::vec3h;
 using math::vec3i;
 using math::vec4b;
 using math::vec4f;
@@ -188,6 +195,69 @@ inline bool operator!=(const image<T>& a, const image<T>& b);
 template <typename T>
 inline void swap(image<T>& a, image<T>& b);
 
+// Non-owning view of an image, or of a region of it, with rows `stride`
+// pixels apart. Views are cheap to copy and let functions work on
+// sub-regions, render tiles and external buffers without copies. Views of
+// const pixels can be made from const images and from non-const views.
+template <typename T>
+struct image_view {
+  // constructors
+  image_view();
+  image_view(const vec2i& size, T* data, size_t stride = 0);
+  template <typename U, typename = std::enable_if_t<
+                            std::is_convertible_v<U (*)[], T (*)[]>>>
+  image_view(image<U>& img);
+  template <typename U, typename = std::enable_if_t<
+                            std::is_convertible_v<const U (*)[], T (*)[]>>>
+  image_view(const image<U>& img);
+  template <typename U, typename = std::enable_if_t<
+                            std::is_convertible_v<U (*)[], T (*)[]>>>
+  image_view(const image_view<U>& view);
+
+  // size
+  bool   empty() const;
+  vec2i  size() const;
+  size_t count() const;
+  size_t stride() const;
+  bool   contains(const vec2i& ij) const;
+
+  // element access
+  T& operator[](const vec2i& ij) const;
+
+  // data access
+  T* data() const;
+  T* row(int j) const;
+
+ private:
+  // data
+  T*     pixels = nullptr;
+  vec2i  extent = {0, 0};
+  size_t offset = 0;
+};
+
+// Get a view of a region of an image, given as {min.x, min.y, max.x, max.y}.
+// The region is clipped to the image bounds.
+template <typename T>
+inline image_view<T> get_view(image<T>& img, const vec4i& region);
+template <typename T>
+inline image_view<const T> get_view(const image<T>& img, const vec4i& region);
+template <typename T>
+inline image_view<T> get_view(const image_view<T>& view, const vec4i& region);
+
+// Copy pixels between views of the same size.
+template <typename T>
+inline void copy_image(const image_view<T>& dst,
+    const image_view<const std::remove_const_t<T>>& src);
+
+// Copy a region into an image at an offset, clipping to the image bounds.
+template <typename T>
+inline void set_region(
+    image<T>& img, const image<T>& region, const vec2i& offset);
+// Extract a region of an image, clipped to the image bounds.
+template <typename T>
+inline void get_region(image<T>& region, const image<T>& img,
+    const vec2i& offset, const vec2i& size);
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -221,6 +291,10 @@ image<float>  byte_to_float(const image<byte>& bt);
 image<byte>   float_to_byte(const image<float>& fl);
 image<float>  ushort_to_float(const image<ushort>& bt);
 image<ushort> float_to_ushort(const image<float>& fl);
+image<vec3f>  half_to_float(const image<vec3h>& hf);
+image<vec3h>  float_to_half(const image<vec3f>& fl);
+image<float>  half_to_float(const image<half>& hf);
+image<half>   float_to_half(const image<float>& fl);
 
 // Conversion between linear and gamma-encoded images.
 image<vec4f> srgb_to_rgb(const image<vec4f>& srgb);
@@ -242,9 +316,15 @@ image<vec4f> tonemap_image(const image<vec4f>& hdr, float exposure,
 image<vec4b> tonemap_imageb(const image<vec4f>& hdr, float exposure,
     bool filmic = false, bool srgb = true);
 
+// Apply tone mapping into a view of the same size, e.g. a render tile.
+void tonemap_image(const image_view<vec4f>& ldr,
+    const image_view<const vec4f>& hdr, float exposure, bool filmic = false,
+    bool srgb = true);
+
 // Apply tone mapping using multithreading for speed
-void tonemap_image_mt(image<vec4f>& ldr, const image<vec4f>& hdr,
-    float exposure, bool filmic = false, bool srgb = true);
+void tonemap_image_mt(const image_view<vec4f>& ldr,
+    const image_view<const vec4f>& hdr, float exposure, bool filmic = false,
+    bool srgb = true);
 
 // minimal color grading
 struct colorgrade_params {
@@ -277,20 +357,133 @@ image<vec4f> colorgrade_image(
 
 // Color grade a linear or srgb image to an srgb image.
 // Uses multithreading for speed.
-void colorgrade_image_mt(image<vec4f>& corrected, const image<vec4f>& img,
-    bool linear, const colorgrade_params& params);
+void colorgrade_image_mt(const image_view<vec4f>& corrected,
+    const image_view<const vec4f>& img, bool linear,
+    const colorgrade_params& params);
+
+// Per-pixel operations fused in a single pass over an image. Operations are
+// applied in order to spans of pixels small enough to stay in cache, so that
+// a chain of operations reads and writes the image only once. Each operation
+// gets the pixels of a span within a row and the index of its first pixel.
+using pixel_operation =
+    std::function<void(vec4f* pixels, int count, const vec2i& ij)>;
+struct image_pipeline {
+  std::vector<pixel_operation> operations = {};
+};
+
+// Add operations to a pipeline.
+void add_operation(image_pipeline& pipeline, const pixel_operation& operation);
+void add_tonemap(image_pipeline& pipeline, float exposure, bool filmic = false,
+    bool srgb = true);
+void add_colorgrade(
+    image_pipeline& pipeline, bool linear, const colorgrade_params& params);
+void add_srgb_to_rgb(image_pipeline& pipeline);
+void add_rgb_to_srgb(image_pipeline& pipeline);
+
+// Run a pipeline on an image, in parallel over spans of pixels. The byte
+// version converts the result to bytes in the same pass. The view versions
+// write into views of the same size, and pass view coordinates to the
+// operations.
+image<vec4f> apply_pipeline(
+    const image<vec4f>& img, const image_pipeline& pipeline);
+image<vec4b> apply_pipelineb(
+    const image<vec4f>& img, const image_pipeline& pipeline);
+void apply_pipeline(const image_view<vec4f>& result,
+    const image_view<const vec4f>& img, const image_pipeline& pipeline);
+void apply_pipelineb(const image_view<vec4b>& result,
+    const image_view<const vec4f>& img, const image_pipeline& pipeline);
 
 // determine white balance colors
 vec3f compute_white_balance(const image<vec4f>& img);
 
-// Resize an image.
-image<vec4f> resize_image(const image<vec4f>& img, const vec2i& size);
-image<vec4b> resize_image(const image<vec4b>& img, const vec2i& size);
+// Resize filters. Mitchell is smooth and Lanczos (3 lobes) is sharper.
+// Box averages the covered pixels and is used for mip maps.
+enum struct resize_filter { mitchell, lanczos, box };
+
+// Resize filter names
+const auto resize_filter_names = std::vector<std::string>{
+    "mitchell", "lanczos", "box"};
+
+// Resize an image with a separable filter, computed in parallel. A zero
+// width or height keeps the aspect ratio. Color images with alpha are
+// filtered with premultiplied alpha. Values are filtered as stored, so
+// bytes are filtered in sRGB.
+image<vec4f> resize_image(const image<vec4f>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<vec4b> resize_image(const image<vec4b>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<vec3f> resize_image(const image<vec3f>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<vec3b> resize_image(const image<vec3b>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<vec3h> resize_image(const image<vec3h>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<float> resize_image(const image<float>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<byte> resize_image(const image<byte>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<half> resize_image(const image<half>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+image<ushort> resize_image(const image<ushort>& img, const vec2i& size,
+    resize_filter filter = resize_filter::mitchell);
+
+// Build the mip levels below an image, halving its size down to a single
+// pixel with a box filter.
+std::vector<image<vec4f>>  build_mips(const image<vec4f>& img);
+std::vector<image<vec4b>>  build_mips(const image<vec4b>& img);
+std::vector<image<vec3f>>  build_mips(const image<vec3f>& img);
+std::vector<image<vec3b>>  build_mips(const image<vec3b>& img);
+std::vector<image<vec3h>>  build_mips(const image<vec3h>& img);
+std::vector<image<float>>  build_mips(const image<float>& img);
+std::vector<image<byte>>   build_mips(const image<byte>& img);
+std::vector<image<half>>   build_mips(const image<half>& img);
+std::vector<image<ushort>> build_mips(const image<ushort>& img);
 
 // Compute the difference between two images
 image<vec4f> image_difference(
     const image<vec4f>& a, const image<vec4f>& b, bool disply_diff);
 
+// Image comparison metrics
+enum struct compare_metric { max, mean, rmse, ssim };
+
+// Image comparison metric names
+const auto compare_metric_names = std::vector<std::string>{
+    "max", "mean", "rmse", "ssim"};
+
+// Compare two images of the same size without building a difference image.
+// max, mean and rmse use the largest channel difference of each pixel. ssim
+// returns one minus the mean structural similarity of the luminance on 8x8
+// blocks, so that 0 means equal. Runs in parallel over bands of rows. Once
+// the result is known to exceed threshold, stops early and returns a partial
+// result that is already above it.
+float compare_images(const image<vec4f>& a, const image<vec4f>& b,
+    compare_metric metric, float threshold = flt_max);
+
+// Filter an image with a gaussian of standard deviation sigma in pixels,
+// truncated at 2.57 sigma. The filter is separable and runs in parallel.
+image<vec4f> filter_gaussian(const image<vec4f>& img, float sigma);
+
+// Filter an image with a box of the given radius in pixels. Uses running sums,
+// so the cost per pixel does not depend on the radius.
+image<vec4f> filter_box(const image<vec4f>& img, int radius);
+
+// Bilateral filter with spatial sigma in pixels and range sigma in color
+// units. Optionally, the filter is guided by feature images, each with its
+// own sigma. Runs on a permutohedral lattice, so the cost per pixel does not
+// depend on the sigmas. Supports up to 10 features.
+image<vec4f> filter_bilateral(
+    const image<vec4f>& img, float spatial_sigma, float range_sigma);
+image<vec4f> filter_bilateral(const image<vec4f>& img, float spatial_sigma,
+    float range_sigma, const std::vector<image<vec4f>>& features,
+    const std::vector<float>& features_sigma);
+
+// Denoise a rendered image with a joint bilateral filter guided by albedo
+// and normal images of the same size. The image is divided by the albedo
+// before filtering and multiplied back after, to keep texture details.
+image<vec4f> denoise_image(const image<vec4f>& img, const image<vec4f>& albedo,
+    const image<vec4f>& normal, int radius = 5, float sigma_color = 1,
+    float sigma_albedo = 0.1f, float sigma_normal = 0.2f);
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -311,6 +504,13 @@ bool load_image(
 bool save_image(
     const std::string& filename, const image<vec4b>& img, std::string& error);
 
+// Saves a 4 channels float/byte image in the background, from a copy of the
+// image. The error is written before the future is ready.
+std::future<bool> save_image_async(
+    const std::string& filename, const image<vec4f>& img, std::string& error);
+std::future<bool> save_image_async(
+    const std::string& filename, const image<vec4b>& img, std::string& error);
+
 // Loads/saves a 3 channels float/byte image in linear/srgb color space.
 bool load_image(
     const std::string& filename, image<vec3f>& img, std::string& error);
@@ -335,6 +535,66 @@ bool save_image(
 bool load_image(
     const std::string& filename, image<ushort>& img, std::string& error);
 
+// Loads a 3/1 channels half image in linear color space, using half the
+// memory of floats. Half EXR channels are kept as they are stored and 16 bit
+// PNGs are read directly, other formats are loaded as floats and converted.
+bool load_image(
+    const std::string& filename, image<vec3h>& img, std::string& error);
+bool load_image(
+    const std::string& filename, image<half>& img, std::string& error);
+
+// Streaming image IO, in blocks of at most `rows` rows of linear color.
+// The reader gets the image size, the first row of each block and its
+// pixels, in order from the top. The writer fills each block before it is
+// encoded. PFM and HDR files are streamed from and to disk, so no full float
+// copy of the image is made; other formats keep only their encoded pixels.
+using image_reader = std::function<void(
+    const vec2i& size, int row, const image_view<const vec4f>& block)>;
+using image_writer =
+    std::function<void(int row, const image_view<vec4f>& block)>;
+bool load_image(const std::string& filename, std::string& error, int rows,
+    const image_reader& reader);
+bool save_image(const std::string& filename, const vec2i& size,
+    std::string& error, int rows, const image_writer& writer);
+
+}  // namespace yocto::image
+
+// -----------------------------------------------------------------------------
+// BLOCK COMPRESSED IMAGES
+// -----------------------------------------------------------------------------
+namespace yocto::image {
+
+// Block compression formats, in blocks of 4x4 pixels of 8 bytes as used by
+// GPUs. BC1 stores colors, 6x smaller than bytes, and BC4 single channels,
+// 2x smaller than bytes.
+enum struct block_format { bc1, bc4 };
+
+// Block format names
+const auto block_format_names = std::vector<std::string>{"bc1", "bc4"};
+
+// Block compressed image. Blocks are stored by rows, with the same layout
+// they have in DDS files and GPU memory.
+struct block_image {
+  block_format          format = block_format::bc1;
+  vec2i                 size   = {0, 0};
+  std::vector<uint64_t> blocks = {};
+};
+
+// Compress byte images in blocks, colors as BC1 and scalars as BC4. Values
+// are kept in their color space.
+block_image compress_image(const image<vec3b>& img);
+block_image compress_image(const image<byte>& img);
+
+// Decode a pixel or a whole block image. Scalars are copied to all channels.
+vec3b        lookup_block(const block_image& img, const vec2i& ij);
+image<vec3b> decompress_image(const block_image& img);
+
+// Loads/saves block compressed images as DDS files.
+bool load_image(
+    const std::string& filename, block_image& img, std::string& error);
+bool save_image(
+    const std::string& filename, const block_image& img, std::string& error);
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -383,6 +643,20 @@ void make_ridgemap(image<vec4f>& img, const vec2i& size, float scale = 1,
     const vec4f& noise = {2, 0.5, 8, 1}, const vec4f& color0 = {0, 0, 0, 1},
     const vec4f& color1 = {0, 0, 0, 1});
 
+// Evaluate the noise images at a point uv, without storing pixels. Images
+// map their pixels to uv in [0,1] along their largest side.
+vec4f eval_noisemap(const vec2f& uv, float scale = 1,
+    const vec4f& color0 = {0, 0, 0, 1}, const vec4f& color1 = {0, 0, 0, 1});
+vec4f eval_fbmmap(const vec2f& uv, float scale = 1,
+    const vec4f& noise = {2, 0.5, 8, 1}, const vec4f& color0 = {0, 0, 0, 1},
+    const vec4f& color1 = {0, 0, 0, 1});
+vec4f eval_turbulencemap(const vec2f& uv, float scale = 1,
+    const vec4f& noise = {2, 0.5, 8, 1}, const vec4f& color0 = {0, 0, 0, 1},
+    const vec4f& color1 = {0, 0, 0, 1});
+vec4f eval_ridgemap(const vec2f& uv, float scale = 1,
+    const vec4f& noise = {2, 0.5, 8, 1}, const vec4f& color0 = {0, 0, 0, 1},
+    const vec4f& color1 = {0, 0, 0, 1});
+
 // Make a sunsky HDR model with sun at sun_angle elevation in [0,pif/2],
 // turbidity in [1.7,10] with or without sun. The sun can be enabled or
 // disabled with has_sun. The sun parameters can be slightly modified by
@@ -486,8 +760,10 @@ float eval_volume(const image<float>& img, const vec3f& uvw,
 namespace yocto::image {
 
 // Loads/saves a 1 channel volume.
-void load_volume(const std::string& filename, volume<float>& vol);
-void save_volume(const std::string& filename, const volume<float>& vol);
+bool load_volume(
+    const std::string& filename, volume<float>& vol, std::string& error);
+bool save_volume(
+    const std::string& filename, const volume<float>& vol, std::string& error);
 
 }  // namespace yocto::image
 
@@ -572,7 +848,7 @@ inline size_t image<T>::count() const {
 }
 template <typename T>
 inline bool image<T>::contains(const vec2i& ij) const {
-  return ij.x > 0 && ij.x < extent.x && ij.y > 0 && ij.y < extent.y;
+  return ij.x >= 0 && ij.x < extent.x && ij.y >= 0 && ij.y < extent.y;
 }
 template <typename T>
 inline void image<T>::clear() {
@@ -672,6 +948,114 @@ inline void swap(image<T>& a, image<T>& b) {
   a.swap(b);
 }
 
+// constructors
+template <typename T>
+inline image_view<T>::image_view() : pixels{nullptr}, extent{0, 0}, offset{0} {}
+template <typename T>
+inline image_view<T>::image_view(const vec2i& size, T* data, size_t stride)
+    : pixels{data}, extent{size}, offset{stride ? stride : (size_t)size.x} {}
+template <typename T>
+template <typename U, typename>
+inline image_view<T>::image_view(image<U>& img)
+    : pixels{img.data()}, extent{img.size()}, offset{(size_t)img.size().x} {}
+template <typename T>
+template <typename U, typename>
+inline image_view<T>::image_view(const image<U>& img)
+    : pixels{img.data()}, extent{img.size()}, offset{(size_t)img.size().x} {}
+template <typename T>
+template <typename U, typename>
+inline image_view<T>::image_view(const image_view<U>& view)
+    : pixels{view.data()}, extent{view.size()}, offset{view.stride()} {}
+
+// size
+template <typename T>
+inline bool image_view<T>::empty() const {
+  return extent.x == 0 || extent.y == 0;
+}
+template <typename T>
+inline vec2i image_view<T>::size() const {
+  return extent;
+}
+template <typename T>
+inline size_t image_view<T>::count() const {
+  return (size_t)extent.x * (size_t)extent.y;
+}
+template <typename T>
+inline size_t image_view<T>::stride() const {
+  return offset;
+}
+template <typename T>
+inline bool image_view<T>::contains(const vec2i& ij) const {
+  return ij.x >= 0 && ij.x < extent.x && ij.y >= 0 && ij.y < extent.y;
+}
+
+// element access
+template <typename T>
+inline T& image_view<T>::operator[](const vec2i& ij) const {
+  return pixels[ij.y * offset + ij.x];
+}
+
+// data access
+template <typename T>
+inline T* image_view<T>::data() const {
+  return pixels;
+}
+template <typename T>
+inline T* image_view<T>::row(int j) const {
+  return pixels + j * offset;
+}
+
+// Get a view of a region of an image.
+template <typename T>
+inline image_view<T> get_view(image<T>& img, const vec4i& region) {
+  return get_view(image_view<T>{img}, region);
+}
+template <typename T>
+inline image_view<const T> get_view(const image<T>& img, const vec4i& region) {
+  return get_view(image_view<const T>{img}, region);
+}
+template <typename T>
+inline image_view<T> get_view(const image_view<T>& view, const vec4i& region) {
+  auto min = math::min(vec2i{region.x, region.y}, view.size());
+  auto max = math::min(vec2i{region.z, region.w}, view.size());
+  min      = math::max(min, zero2i);
+  max      = math::max(max, min);
+  if (min.x == max.x || min.y == max.y) return {};
+  return {max - min, &view[min], view.stride()};
+}
+
+// Copy pixels between views of the same size.
+template <typename T>
+inline void copy_image(const image_view<T>& dst,
+    const image_view<const std::remove_const_t<T>>& src) {
+  if (dst.size() != src.size())
+    throw std::invalid_argument("views have different sizes");
+  for (auto j = 0; j < src.size().y; j++) {
+    std::copy(src.row(j), src.row(j) + src.size().x, dst.row(j));
+  }
+}
+
+// Copy a region into an image at an offset.
+template <typename T>
+inline void set_region(
+    image<T>& img, const image<T>& region, const vec2i& offset) {
+  auto dst = get_view(img, {offset.x, offset.y, offset.x + region.size().x,
+                               offset.y + region.size().y});
+  if (dst.empty()) return;
+  auto min = math::max(zero2i - offset, zero2i);
+  copy_image(dst, get_view(region, {min.x, min.y, min.x + dst.size().x,
+                                       min.y + dst.size().y}));
+}
+// Extract a region of an image.
+template <typename T>
+inline void get_region(image<T>& region, const image<T>& img,
+    const vec2i& offset, const vec2i& size) {
+  auto src = get_view(
+      img, {offset.x, offset.y, offset.x + size.x, offset.y + size.y});
+  region.resize(src.size());
+  copy_image(image_view<T>{region}, src);
+}
+
 }  // namespace yocto::image
 
 // -----------------------------------------------------------------------------
@@ -36,6 +36,15 @@
 // quads.
 //
 //
+// ## Vector lanes
+//
+// For kernels that process several rays or points at once, we provide lanes
+// of N values in SoA layout (`lanef<N>`, `vec2fl<N>`, `vec3fl<N>`,
+// `ray3fl<N>`) with masks (`lanemask<N>`). We support per-lane vector math,
+// transforms and ray-triangle and ray-bbox intersection restricted to the
+// active lanes. Lane loops are plain C++ that the compiler vectorizes.
+//
+//
 // ## Transforms
 //
 // For both matrices and frames we support transform operations for points,
@@ -84,6 +93,15 @@
 // 4. generate random floats and double in the [0,1) range with `rand1f()`,
 //    `rand2f()`, `rand3f()`, `rand1d()`
 //
+// We also support counter-based random numbers, that hash a key and a
+// counter instead of advancing a stored state. Numbers can then be drawn
+// independently per element, e.g. per pixel, sample and dimension.
+//
+// 1. make a key from a seed and an element index with `make_rng_key()`
+// 2. generate numbers for a counter with `rand1i()`, `rand1f()`, `rand2f()`,
+//    `rand3f()`, passing the key and counter in place of the rng
+// 3. generate numbers for N consecutive counters in lanes with `rand1fl()`
+//
 //
 // ## Noise Functions
 //
@@ -198,8 +216,11 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstring>
 #include <functional>
 #include <limits>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 // -----------------------------------------------------------------------------
@@ -614,6 +635,17 @@ struct vec4b {
   const byte& operator[](int i) const;
 };
 
+// Half-precision floats, stored as their bits, used to keep hdr data in half
+// the memory. Convert to floats for any arithmetic.
+struct half {
+  ushort bits = 0;
+};
+struct vec3h {
+  half x = {};
+  half y = {};
+  half z = {};
+};
+
 // Zero std::vector constants.
 inline const auto zero2i = vec2i{0, 0};
 inline const auto zero3i = vec3i{0, 0, 0};
@@ -1094,6 +1126,8 @@ inline bbox3f triangle_bounds(
     const vec3f& p0, const vec3f& p1, const vec3f& p2);
 inline bbox3f quad_bounds(
     const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3);
+inline bbox3f bezier_bounds(const vec3f& p0, const vec3f& p1, const vec3f& p2,
+    const vec3f& p3, float r0, float r1, float r2, float r3);
 
 }  // namespace yocto::math
 
@@ -1271,10 +1305,25 @@ inline bool intersect_point(
 inline bool intersect_line(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     float r0, float r1, vec2f& uv, float& dist);
 
+// Intersect a ray with a cubic Bezier curve with varying radius
+inline bool intersect_bezier(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, const vec3f& p3, float r0, float r1,
+    float r2, float r3, vec2f& uv, float& dist);
+
 // Intersect a ray with a triangle
 inline bool intersect_triangle(const ray3f& ray, const vec3f& p0,
     const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist);
 
+// Intersect a ray with a triangle given by a vertex and the edges p1-p0 and
+// p2-p0, for triangles whose edges are precomputed.
+inline bool intersect_triangle_edges(const ray3f& ray, const vec3f& p0,
+    const vec3f& edge1, const vec3f& edge2, vec2f& uv, float& dist);
+
+// Intersect a ray with a triangle with a watertight test, that does not miss
+// rays through the edges and vertices shared by adjacent triangles.
+inline bool intersect_triangle_watertight(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist);
+
 // Intersect a ray with a quad.
 inline bool intersect_quad(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     const vec3f& p2, const vec3f& p3, vec2f& uv, float& dist);
@@ -1288,6 +1337,138 @@ inline bool intersect_bbox(
 
 }  // namespace yocto::math
 
+// -----------------------------------------------------------------------------
+// VECTOR LANES
+// -----------------------------------------------------------------------------
+namespace yocto::math {
+
+// Lanes of N values in SoA layout, for kernels that process N rays or points
+// at once. Lane loops are plain C++ that the compiler vectorizes; N is
+// usually 4, 8 or 16 to match the SIMD width. Masks select active lanes.
+template <int N>
+struct lanef {
+  float v[N] = {};
+
+  float&       operator[](int i);
+  const float& operator[](int i) const;
+};
+template <int N>
+struct lanemask {
+  bool v[N] = {};
+
+  bool&       operator[](int i);
+  const bool& operator[](int i) const;
+};
+template <int N>
+struct vec2fl {
+  lanef<N> x = {};
+  lanef<N> y = {};
+};
+template <int N>
+struct vec3fl {
+  lanef<N> x = {};
+  lanef<N> y = {};
+  lanef<N> z = {};
+};
+template <int N>
+struct ray3fl {
+  vec3fl<N> o    = {};
+  vec3fl<N> d    = {};
+  lanef<N>  tmin = {};
+  lanef<N>  tmax = {};
+};
+
+// Mask with the first count lanes active.
+template <int N>
+inline lanemask<N> make_lanemask(int count);
+// Mask reductions.
+template <int N>
+inline bool any(const lanemask<N>& a);
+template <int N>
+inline bool all(const lanemask<N>& a);
+
+// Lane access.
+template <int N>
+inline vec3f get_lane(const vec3fl<N>& a, int lane);
+template <int N>
+inline ray3f get_lane(const ray3fl<N>& a, int lane);
+template <int N>
+inline void set_lane(vec3fl<N>& a, int lane, const vec3f& b);
+template <int N>
+inline void set_lane(ray3fl<N>& a, int lane, const ray3f& b);
+
+// Lane operations.
+template <int N>
+inline lanef<N> operator+(const lanef<N>& a, const lanef<N>& b);
+template <int N>
+inline lanef<N> operator-(const lanef<N>& a, const lanef<N>& b);
+template <int N>
+inline lanef<N> operator*(const lanef<N>& a, const lanef<N>& b);
+template <int N>
+inline lanef<N> operator*(const lanef<N>& a, float b);
+template <int N>
+inline lanef<N> operator/(float a, const lanef<N>& b);
+template <int N>
+inline vec3fl<N> operator+(const vec3fl<N>& a, const vec3fl<N>& b);
+template <int N>
+inline vec3fl<N> operator-(const vec3fl<N>& a, const vec3fl<N>& b);
+template <int N>
+inline vec3fl<N> operator-(const vec3fl<N>& a, const vec3f& b);
+template <int N>
+inline vec3fl<N> operator*(const vec3fl<N>& a, const lanef<N>& b);
+template <int N>
+inline vec3fl<N> operator/(float a, const vec3fl<N>& b);
+
+// Select lanes from a where the mask is set, and from b otherwise.
+template <int N>
+inline lanef<N> select(
+    const lanemask<N>& mask, const lanef<N>& a, const lanef<N>& b);
+template <int N>
+inline vec3fl<N> select(
+    const lanemask<N>& mask, const vec3fl<N>& a, const vec3fl<N>& b);
+
+// Vector operations per lane.
+template <int N>
+inline lanef<N> dot(const vec3fl<N>& a, const vec3fl<N>& b);
+template <int N>
+inline lanef<N> dot(const vec3fl<N>& a, const vec3f& b);
+template <int N>
+inline vec3fl<N> cross(const vec3fl<N>& a, const vec3fl<N>& b);
+template <int N>
+inline vec3fl<N> cross(const vec3fl<N>& a, const vec3f& b);
+template <int N>
+inline lanef<N> length(const vec3fl<N>& a);
+template <int N>
+inline vec3fl<N> normalize(const vec3fl<N>& a);
+
+// Transforms points, vectors, directions and rays per lane.
+template <int N>
+inline vec3fl<N> transform_point(const frame3f& a, const vec3fl<N>& b);
+template <int N>
+inline vec3fl<N> transform_vector(const frame3f& a, const vec3fl<N>& b);
+template <int N>
+inline vec3fl<N> transform_direction(const frame3f& a, const vec3fl<N>& b);
+template <int N>
+inline ray3fl<N> transform_ray(const frame3f& a, const ray3fl<N>& b);
+
+// Intersect the active lanes of a ray with a triangle, setting uv and dist
+// of the lanes that hit. Lanes match the single ray version exactly.
+template <int N>
+inline lanemask<N> intersect_triangle(const ray3fl<N>& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, const lanemask<N>& active,
+    vec2fl<N>& uv, lanef<N>& dist);
+template <int N>
+inline lanemask<N> intersect_triangle_edges(const ray3fl<N>& ray,
+    const vec3f& p0, const vec3f& edge1, const vec3f& edge2,
+    const lanemask<N>& active, vec2fl<N>& uv, lanef<N>& dist);
+
+// Intersect the active lanes of a ray with a axis-aligned bounding box
+template <int N>
+inline lanemask<N> intersect_bbox(const ray3fl<N>& ray,
+    const vec3fl<N>& ray_dinv, const bbox3f& bbox, const lanemask<N>& active);
+
+}  // namespace yocto::math
+
 // -----------------------------------------------------------------------------
 // POINT-PRIMITIVE DISTANCE FUNCTIONS
 // -----------------------------------------------------------------------------
@@ -1343,6 +1524,13 @@ inline float  byte_to_float(byte a);
 inline ushort float_to_ushort(float a);
 inline float  ushort_to_float(ushort a);
 
+// Conversion between floats and halfs, rounding to nearest even.
+// Values past the half range become infinities.
+inline half  float_to_half(float a);
+inline float half_to_float(half a);
+inline vec3h float_to_half(const vec3f& a);
+inline vec3f half_to_float(const vec3h& a);
+
 // Luminance
 inline float luminance(const vec3f& a);
 
@@ -1458,6 +1646,46 @@ inline void shuffle(std::vector<T>& vals, rng_state& rng) {
   }
 }
 
+// Counter-based random numbers, hashing a key and a counter with the
+// SplitMix64 finalizer. Each call uses one counter, and different counters
+// give independent numbers, so no state is stored or advanced.
+inline uint64_t hash_rng(uint64_t key, uint64_t counter) {
+  auto x = key + (counter + 1) * 0x9e3779b97f4a7c15ull;
+  x      = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x      = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Key of an element, e.g. a pixel or a sample, for a seed.
+inline uint64_t make_rng_key(uint64_t seed, uint64_t index) {
+  return hash_rng(hash_rng(seed, 0), index);
+}
+
+// Random numbers for a key and counter: floats in [0,1), ints in [0,n).
+inline int rand1i(uint64_t key, uint64_t counter, int n) {
+  return (int)(((hash_rng(key, counter) >> 32) * (uint64_t)n) >> 32);
+}
+inline float rand1f(uint64_t key, uint64_t counter) {
+  return (hash_rng(key, counter) >> 40) * 0x1p-24f;
+}
+inline vec2f rand2f(uint64_t key, uint64_t counter) {
+  auto hash = hash_rng(key, counter);
+  return {(hash >> 40) * 0x1p-24f, ((hash >> 8) & 0xffffff) * 0x1p-24f};
+}
+inline vec3f rand3f(uint64_t key, uint64_t counter) {
+  auto hash = hash_rng(key, counter);
+  return {(hash >> 40) * 0x1p-24f, ((hash >> 8) & 0xffffff) * 0x1p-24f,
+      (hash_rng(hash, 0) >> 40) * 0x1p-24f};
+}
+
+// Random floats for the counters from counter to counter + N - 1, in lanes.
+template <int N>
+inline lanef<N> rand1fl(uint64_t key, uint64_t counter) {
+  auto values = lanef<N>{};
+  for (auto i = 0; i < N; i++) values.v[i] = rand1f(key, counter + i);
+  return values;
+}
+
 }  // namespace yocto::math
 
 // -----------------------------------------------------------------------------
@@ -1725,6 +1953,16 @@ inline int sample_discrete_cdf(const std::vector<float>& cdf, float r);
 // Pdf for uniform discrete distribution sampling.
 inline float sample_discrete_cdf_pdf(const std::vector<float>& cdf, int idx);
 
+// Build an alias table for a discrete distribution represented by its cdf.
+// Each entry stores the probability of keeping its index and its alias.
+inline std::vector<std::pair<float, int>> make_discrete_alias(
+    const std::vector<float>& cdf);
+// Sample a discrete distribution represented by its alias table in constant
+// time, using `r` to pick an entry and `ra` to pick its alias. The pdf is the
+// same as the one of the cdf the table was built from.
+inline int sample_discrete_alias(
+    const std::vector<std::pair<float, int>>& alias, float r, float ra);
+
 // Sample a discrete distribution represented by its weights.
 inline int sample_discrete_weights(const std::vector<float>& weights, float r);
 // Pdf for uniform discrete distribution sampling.
@@ -3058,6 +3296,11 @@ inline bbox3f quad_bounds(
     const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3) {
   return {min(p0, min(p1, min(p2, p3))), max(p0, max(p1, max(p2, p3)))};
 }
+inline bbox3f bezier_bounds(const vec3f& p0, const vec3f& p1, const vec3f& p2,
+    const vec3f& p3, float r0, float r1, float r2, float r3) {
+  // the curve and its radius lie in the convex hull of the control spheres
+  return merge(line_bounds(p0, p1, r0, r1), line_bounds(p2, p3, r2, r3));
+}
 
 }  // namespace yocto::math
 
@@ -3480,13 +3723,92 @@ inline bool intersect_line(const ray3f& ray, const vec3f& p0, const vec3f& p1,
   return true;
 }
 
+// Intersect a ray with a cubic Bezier curve with varying radius. The curve
+// is split recursively in ray space, where the ray is the z axis, culling
+// halves whose bounds miss the ray, until the pieces are flat enough to be
+// intersected as lines [Nakamaru and Ohno 2002].
+inline bool intersect_bezier(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, const vec3f& p3, float r0, float r1,
+    float r2, float r3, vec2f& uv, float& dist) {
+  // transform control points to ray space
+  auto len    = length(ray.d);
+  auto basis  = basis_fromz(ray.d / len);
+  auto to_ray = [&](const vec3f& p) {
+    auto q = p - ray.o;
+    return vec3f{dot(q, basis.x), dot(q, basis.y), dot(q, basis.z)};
+  };
+  auto q0 = to_ray(p0), q1 = to_ray(p1), q2 = to_ray(p2), q3 = to_ray(p3);
+  auto rmax = max(max(r0, r1), max(r2, r3));
+
+  // split depth from the curve flatness, as in pbrt
+  auto l0 = max(max(abs(q0 - q1 * 2 + q2)), max(abs(q1 - q2 * 2 + q3)));
+  auto eps   = max(rmax, flt_eps) * 0.05f;
+  auto depth = 0;
+  if (l0 > 0)
+    depth = clamp((int)log2(1.41421356f * 6 * l0 / (8 * eps)) / 2, 0, 10);
+
+  // walk the split tree, nearest ray parameters are in ray space units
+  struct segment {
+    vec3f p0, p1, p2, p3;
+    float u0, u1;
+    int   depth;
+  };
+  segment stack[16];
+  auto    count = 0;
+  auto    tmin = ray.tmin * len, tmax = ray.tmax * len;
+  auto    hit  = false;
+  stack[count++] = {q0, q1, q2, q3, 0, 1, depth};
+  while (count) {
+    auto seg = stack[--count];
+
+    // cull segments whose bounds miss the ray
+    auto bbox = line_bounds(seg.p0, seg.p1, rmax, rmax);
+    bbox      = merge(bbox, line_bounds(seg.p2, seg.p3, rmax, rmax));
+    if (bbox.min.x > 0 || bbox.max.x < 0 || bbox.min.y > 0 || bbox.max.y < 0 ||
+        bbox.max.z < tmin || bbox.min.z > tmax)
+      continue;
+
+    if (seg.depth > 0) {
+      // split in half with de Casteljau
+      auto a = (seg.p0 + seg.p1) / 2, b = (seg.p1 + seg.p2) / 2,
+           c = (seg.p2 + seg.p3) / 2;
+      auto d = (a + b) / 2, e = (b + c) / 2, m = (d + e) / 2;
+      auto um        = (seg.u0 + seg.u1) / 2;
+      stack[count++] = {m, e, c, seg.p3, um, seg.u1, seg.depth - 1};
+      stack[count++] = {seg.p0, a, d, m, seg.u0, um, seg.depth - 1};
+      continue;
+    }
+
+    // closest point to the ray on the segment chord, evaluated on the curve
+    auto dx = seg.p3.x - seg.p0.x, dy = seg.p3.y - seg.p0.y;
+    auto dd = dx * dx + dy * dy;
+    auto w  = dd > 0 ? clamp(-(seg.p0.x * dx + seg.p0.y * dy) / dd, 0.0f, 1.0f)
+                     : 0.0f;
+    auto u  = seg.u0 + (seg.u1 - seg.u0) * w;
+    auto pc = interpolate_bezier(q0, q1, q2, q3, u);
+    auto rc = interpolate_bezier(r0, r1, r2, r3, u);
+    auto d2 = pc.x * pc.x + pc.y * pc.y;
+    if (d2 > rc * rc || pc.z < tmin || pc.z > tmax) continue;
+
+    // intersection occurred: keep the nearest
+    hit  = true;
+    tmax = pc.z;
+    uv   = {u, sqrt(d2) / rc};
+  }
+  if (!hit) return false;
+  dist = tmax / len;
+  return true;
+}
+
 // Intersect a ray with a triangle
 inline bool intersect_triangle(const ray3f& ray, const vec3f& p0,
     const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist) {
-  // compute triangle edges
-  auto edge1 = p1 - p0;
-  auto edge2 = p2 - p0;
+  return intersect_triangle_edges(ray, p0, p1 - p0, p2 - p0, uv, dist);
+}
 
+// Intersect a ray with a triangle with precomputed edges
+inline bool intersect_triangle_edges(const ray3f& ray, const vec3f& p0,
+    const vec3f& edge1, const vec3f& edge2, vec2f& uv, float& dist) {
   // compute determinant to solve a linear system
   auto pvec = cross(ray.d, edge2);
   auto det  = dot(edge1, pvec);
@@ -3516,6 +3838,50 @@ inline bool intersect_triangle(const ray3f& ray, const vec3f& p0,
   return true;
 }
 
+// Intersect a ray with a triangle with a watertight test. Vertices are
+// moved in a space where the ray starts at the origin and goes along +z,
+// where the edge functions are exact in sign [Woop et al. 2013].
+inline bool intersect_triangle_watertight(const ray3f& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, vec2f& uv, float& dist) {
+  // permute axes so that z is the largest direction component
+  auto ad = abs(ray.d);
+  auto kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+  auto kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+  if (ray.d[kz] < 0) swap(kx, ky);
+  auto sx = ray.d[kx] / ray.d[kz], sy = ray.d[ky] / ray.d[kz];
+  auto sz = 1 / ray.d[kz];
+
+  // shear vertices relative to the ray origin
+  auto a = p0 - ray.o, b = p1 - ray.o, c = p2 - ray.o;
+  auto ax = a[kx] - sx * a[kz], ay = a[ky] - sy * a[kz];
+  auto bx = b[kx] - sx * b[kz], by = b[ky] - sy * b[kz];
+  auto cx = c[kx] - sx * c[kz], cy = c[ky] - sy * c[kz];
+
+  // scaled barycentrics, recomputed in double precision on edges
+  auto u = cx * by - cy * bx;
+  auto v = ax * cy - ay * cx;
+  auto w = bx * ay - by * ax;
+  if (u == 0 || v == 0 || w == 0) {
+    u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+    v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+    w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+  }
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+  auto det = u + v + w;
+  if (det == 0) return false;
+
+  // compute and check ray parameter
+  auto az = sz * a[kz], bz = sz * b[kz], cz = sz * c[kz];
+  auto inv_det = 1 / det;
+  auto t       = (u * az + v * bz + w * cz) * inv_det;
+  if (t < ray.tmin || t > ray.tmax) return false;
+
+  // intersection occurred: set params and exit
+  uv   = {v * inv_det, w * inv_det};
+  dist = t;
+  return true;
+}
+
 // Intersect a ray with a quad.
 inline bool intersect_quad(const ray3f& ray, const vec3f& p0, const vec3f& p1,
     const vec3f& p2, const vec3f& p3, vec2f& uv, float& dist) {
@@ -3567,6 +3933,297 @@ inline bool intersect_bbox(
 
 }  // namespace yocto::math
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF VECTOR LANES
+// -----------------------------------------------------------------------------
+namespace yocto::math {
+
+// Lane access
+template <int N>
+inline float& lanef<N>::operator[](int i) {
+  return v[i];
+}
+template <int N>
+inline const float& lanef<N>::operator[](int i) const {
+  return v[i];
+}
+template <int N>
+inline bool& lanemask<N>::operator[](int i) {
+  return v[i];
+}
+template <int N>
+inline const bool& lanemask<N>::operator[](int i) const {
+  return v[i];
+}
+
+// Mask with the first count lanes active.
+template <int N>
+inline lanemask<N> make_lanemask(int count) {
+  auto c = lanemask<N>{};
+  for (auto i = 0; i < N; i++) c[i] = i < count;
+  return c;
+}
+// Mask reductions.
+template <int N>
+inline bool any(const lanemask<N>& a) {
+  auto c = false;
+  for (auto i = 0; i < N; i++) c |= a[i];
+  return c;
+}
+template <int N>
+inline bool all(const lanemask<N>& a) {
+  auto c = true;
+  for (auto i = 0; i < N; i++) c &= a[i];
+  return c;
+}
+
+// Lane access.
+template <int N>
+inline vec3f get_lane(const vec3fl<N>& a, int lane) {
+  return {a.x[lane], a.y[lane], a.z[lane]};
+}
+template <int N>
+inline ray3f get_lane(const ray3fl<N>& a, int lane) {
+  return {get_lane(a.o, lane), get_lane(a.d, lane), a.tmin[lane],
+      a.tmax[lane]};
+}
+template <int N>
+inline void set_lane(vec3fl<N>& a, int lane, const vec3f& b) {
+  a.x[lane] = b.x;
+  a.y[lane] = b.y;
+  a.z[lane] = b.z;
+}
+template <int N>
+inline void set_lane(ray3fl<N>& a, int lane, const ray3f& b) {
+  set_lane(a.o, lane, b.o);
+  set_lane(a.d, lane, b.d);
+  a.tmin[lane] = b.tmin;
+  a.tmax[lane] = b.tmax;
+}
+
+// Lane operations.
+template <int N>
+inline lanef<N> operator+(const lanef<N>& a, const lanef<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = a[i] + b[i];
+  return c;
+}
+template <int N>
+inline lanef<N> operator-(const lanef<N>& a, const lanef<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = a[i] - b[i];
+  return c;
+}
+template <int N>
+inline lanef<N> operator*(const lanef<N>& a, const lanef<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = a[i] * b[i];
+  return c;
+}
+template <int N>
+inline lanef<N> operator*(const lanef<N>& a, float b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = a[i] * b;
+  return c;
+}
+template <int N>
+inline lanef<N> operator/(float a, const lanef<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = a / b[i];
+  return c;
+}
+template <int N>
+inline vec3fl<N> operator+(const vec3fl<N>& a, const vec3fl<N>& b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+template <int N>
+inline vec3fl<N> operator-(const vec3fl<N>& a, const vec3fl<N>& b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+template <int N>
+inline vec3fl<N> operator-(const vec3fl<N>& a, const vec3f& b) {
+  auto c = vec3fl<N>{};
+  for (auto i = 0; i < N; i++) {
+    c.x[i] = a.x[i] - b.x;
+    c.y[i] = a.y[i] - b.y;
+    c.z[i] = a.z[i] - b.z;
+  }
+  return c;
+}
+template <int N>
+inline vec3fl<N> operator*(const vec3fl<N>& a, const lanef<N>& b) {
+  return {a.x * b, a.y * b, a.z * b};
+}
+template <int N>
+inline vec3fl<N> operator/(float a, const vec3fl<N>& b) {
+  return {a / b.x, a / b.y, a / b.z};
+}
+
+// Select lanes from a where the mask is set, and from b otherwise.
+template <int N>
+inline lanef<N> select(
+    const lanemask<N>& mask, const lanef<N>& a, const lanef<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++) c[i] = mask[i] ? a[i] : b[i];
+  return c;
+}
+template <int N>
+inline vec3fl<N> select(
+    const lanemask<N>& mask, const vec3fl<N>& a, const vec3fl<N>& b) {
+  return {select(mask, a.x, b.x), select(mask, a.y, b.y),
+      select(mask, a.z, b.z)};
+}
+
+// Vector operations per lane.
+template <int N>
+inline lanef<N> dot(const vec3fl<N>& a, const vec3fl<N>& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++)
+    c[i] = a.x[i] * b.x[i] + a.y[i] * b.y[i] + a.z[i] * b.z[i];
+  return c;
+}
+template <int N>
+inline lanef<N> dot(const vec3fl<N>& a, const vec3f& b) {
+  auto c = lanef<N>{};
+  for (auto i = 0; i < N; i++)
+    c[i] = a.x[i] * b.x + a.y[i] * b.y + a.z[i] * b.z;
+  return c;
+}
+template <int N>
+inline vec3fl<N> cross(const vec3fl<N>& a, const vec3fl<N>& b) {
+  auto c = vec3fl<N>{};
+  for (auto i = 0; i < N; i++) {
+    c.x[i] = a.y[i] * b.z[i] - a.z[i] * b.y[i];
+    c.y[i] = a.z[i] * b.x[i] - a.x[i] * b.z[i];
+    c.z[i] = a.x[i] * b.y[i] - a.y[i] * b.x[i];
+  }
+  return c;
+}
+template <int N>
+inline vec3fl<N> cross(const vec3fl<N>& a, const vec3f& b) {
+  auto c = vec3fl<N>{};
+  for (auto i = 0; i < N; i++) {
+    c.x[i] = a.y[i] * b.z - a.z[i] * b.y;
+    c.y[i] = a.z[i] * b.x - a.x[i] * b.z;
+    c.z[i] = a.x[i] * b.y - a.y[i] * b.x;
+  }
+  return c;
+}
+template <int N>
+inline lanef<N> length(const vec3fl<N>& a) {
+  auto c = dot(a, a);
+  for (auto i = 0; i < N; i++) c[i] = std::sqrt(c[i]);
+  return c;
+}
+template <int N>
+inline vec3fl<N> normalize(const vec3fl<N>& a) {
+  auto l = length(a);
+  auto c = a;
+  for (auto i = 0; i < N; i++) {
+    if (l[i] == 0) continue;
+    c.x[i] = a.x[i] / l[i];
+    c.y[i] = a.y[i] / l[i];
+    c.z[i] = a.z[i] / l[i];
+  }
+  return c;
+}
+
+// Transforms points, vectors, directions and rays per lane.
+template <int N>
+inline vec3fl<N> transform_point(const frame3f& a, const vec3fl<N>& b) {
+  auto c = vec3fl<N>{};
+  for (auto i = 0; i < N; i++) {
+    c.x[i] = a.x.x * b.x[i] + a.y.x * b.y[i] + a.z.x * b.z[i] + a.o.x;
+    c.y[i] = a.x.y * b.x[i] + a.y.y * b.y[i] + a.z.y * b.z[i] + a.o.y;
+    c.z[i] = a.x.z * b.x[i] + a.y.z * b.y[i] + a.z.z * b.z[i] + a.o.z;
+  }
+  return c;
+}
+template <int N>
+inline vec3fl<N> transform_vector(const frame3f& a, const vec3fl<N>& b) {
+  auto c = vec3fl<N>{};
+  for (auto i = 0; i < N; i++) {
+    c.x[i] = a.x.x * b.x[i] + a.y.x * b.y[i] + a.z.x * b.z[i];
+    c.y[i] = a.x.y * b.x[i] + a.y.y * b.y[i] + a.z.y * b.z[i];
+    c.z[i] = a.x.z * b.x[i] + a.y.z * b.y[i] + a.z.z * b.z[i];
+  }
+  return c;
+}
+template <int N>
+inline vec3fl<N> transform_direction(const frame3f& a, const vec3fl<N>& b) {
+  return normalize(transform_vector(a, b));
+}
+template <int N>
+inline ray3fl<N> transform_ray(const frame3f& a, const ray3fl<N>& b) {
+  return {transform_point(a, b.o), transform_vector(a, b.d), b.tmin, b.tmax};
+}
+
+// Intersect the active lanes of a ray with a triangle
+template <int N>
+inline lanemask<N> intersect_triangle(const ray3fl<N>& ray, const vec3f& p0,
+    const vec3f& p1, const vec3f& p2, const lanemask<N>& active,
+    vec2fl<N>& uv, lanef<N>& dist) {
+  return intersect_triangle_edges(
+      ray, p0, p1 - p0, p2 - p0, active, uv, dist);
+}
+template <int N>
+inline lanemask<N> intersect_triangle_edges(const ray3fl<N>& ray,
+    const vec3f& p0, const vec3f& edge1, const vec3f& edge2,
+    const lanemask<N>& active, vec2fl<N>& uv, lanef<N>& dist) {
+  // solve the linear system in all lanes, then check the results
+  auto pvec = cross(ray.d, edge2);
+  auto det  = dot(pvec, edge1);
+  auto tvec = ray.o - p0;
+  auto qvec = cross(tvec, edge1);
+  auto hits = lanemask<N>{};
+  for (auto i = 0; i < N; i++) {
+    auto inv_det = 1.0f / det[i];
+    auto u = (tvec.x[i] * pvec.x[i] + tvec.y[i] * pvec.y[i] +
+                 tvec.z[i] * pvec.z[i]) *
+             inv_det;
+    auto v = (ray.d.x[i] * qvec.x[i] + ray.d.y[i] * qvec.y[i] +
+                 ray.d.z[i] * qvec.z[i]) *
+             inv_det;
+    auto t = (edge2.x * qvec.x[i] + edge2.y * qvec.y[i] +
+                 edge2.z * qvec.z[i]) *
+             inv_det;
+    // same tests as the single ray version, also for nans
+    hits[i] = active[i] && det[i] != 0 && !(u < 0 || u > 1) &&
+              !(v < 0 || u + v > 1) && !(t < ray.tmin[i] || t > ray.tmax[i]);
+    if (hits[i]) {
+      uv.x[i] = u;
+      uv.y[i] = v;
+      dist[i] = t;
+    }
+  }
+  return hits;
+}
+
+// Intersect the active lanes of a ray with a axis-aligned bounding box
+template <int N>
+inline lanemask<N> intersect_bbox(const ray3fl<N>& ray,
+    const vec3fl<N>& ray_dinv, const bbox3f& bbox, const lanemask<N>& active) {
+  auto hits = lanemask<N>{};
+  for (auto i = 0; i < N; i++) {
+    auto tx0 = (bbox.min.x - ray.o.x[i]) * ray_dinv.x[i];
+    auto tx1 = (bbox.max.x - ray.o.x[i]) * ray_dinv.x[i];
+    auto ty0 = (bbox.min.y - ray.o.y[i]) * ray_dinv.y[i];
+    auto ty1 = (bbox.max.y - ray.o.y[i]) * ray_dinv.y[i];
+    auto tz0 = (bbox.min.z - ray.o.z[i]) * ray_dinv.z[i];
+    auto tz1 = (bbox.max.z - ray.o.z[i]) * ray_dinv.z[i];
+    auto t0  = std::max(std::max(std::min(tx0, tx1),
+                           std::max(std::min(ty0, ty1), std::min(tz0, tz1))),
+        ray.tmin[i]);
+    auto t1  = std::min(std::min(std::max(tx0, tx1),
+                           std::min(std::max(ty0, ty1), std::max(tz0, tz1))),
+        ray.tmax[i]);
+    hits[i]  = active[i] && t0 <= t1 * 1.00000024f;
+  }
+  return hits;
+}
+
+}  // namespace yocto::math
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION OF POINT-PRIMITIVE DISTANCE FUNCTIONS
 // -----------------------------------------------------------------------------
@@ -3745,6 +4402,61 @@ inline ushort float_to_ushort(float a) {
 }
 inline float ushort_to_float(ushort a) { return a / 65535.0f; }
 
+// Conversion between floats and halfs by bit manipulation. Halfs that are
+// subnormal are handled by letting the float unit add or remove the
+// implicit bit with a magic number.
+inline half float_to_half(float a) {
+  auto f = 0u;
+  memcpy(&f, &a, sizeof(f));
+  auto sign = (f >> 16) & 0x8000u;
+  f &= 0x7fffffffu;
+  if (f >= (127u + 16) << 23) {
+    // overflow to infinity and nans to quiet nans
+    return {(ushort)(sign | (f > 0x7f800000u ? 0x7e00u : 0x7c00u))};
+  } else if (f < 113u << 23) {
+    // subnormals and zero
+    auto magic = ((127u - 15) + (23 - 10) + 1) << 23;
+    auto mf = 0.0f, v = 0.0f;
+    memcpy(&mf, &magic, sizeof(mf));
+    memcpy(&v, &f, sizeof(v));
+    v += mf;
+    memcpy(&f, &v, sizeof(f));
+    return {(ushort)(sign | (f - magic))};
+  } else {
+    // rebias the exponent and round the mantissa to nearest even
+    auto odd = (f >> 13) & 1u;
+    f += 0xc8000fffu + odd;  // ((15 - 127) << 23) + 0xfff
+    return {(ushort)(sign | (f >> 13))};
+  }
+}
+inline float half_to_float(half a) {
+  auto f = (uint)(a.bits & 0x7fffu) << 13, exponent = f & (0x7c00u << 13);
+  f += (127u - 15) << 23;
+  if (exponent == 0x7c00u << 13) {
+    // infinities and nans
+    f += (128u - 16) << 23;
+  } else if (exponent == 0) {
+    // subnormals and zero
+    auto magic = 113u << 23;
+    auto mf = 0.0f, v = 0.0f;
+    f += 1u << 23;
+    memcpy(&mf, &magic, sizeof(mf));
+    memcpy(&v, &f, sizeof(v));
+    v -= mf;
+    memcpy(&f, &v, sizeof(f));
+  }
+  f |= (uint)(a.bits & 0x8000u) << 16;
+  auto v = 0.0f;
+  memcpy(&v, &f, sizeof(v));
+  return v;
+}
+inline vec3h float_to_half(const vec3f& a) {
+  return {float_to_half(a.x), float_to_half(a.y), float_to_half(a.z)};
+}
+inline vec3f half_to_float(const vec3h& a) {
+  return {half_to_float(a.x), half_to_float(a.y), half_to_float(a.z)};
+}
+
 // Luminance
 inline float luminance(const vec3f& a) {
   return (0.2126f * a.x + 0.7152f * a.y + 0.0722f * a.z);
@@ -4978,6 +5690,51 @@ inline float sample_discrete_cdf_pdf(const std::vector<float>& cdf, int idx) {
   return cdf.at(idx) - cdf.at(idx - 1);
 }
 
+// Build an alias table for a discrete distribution represented by its cdf.
+inline std::vector<std::pair<float, int>> make_discrete_alias(
+    const std::vector<float>& cdf) {
+  auto size  = (int)cdf.size();
+  auto alias = std::vector<std::pair<float, int>>(size);
+  for (auto idx = 0; idx < size; idx++) alias[idx] = {1, idx};
+  if (cdf.empty() || cdf.back() <= 0) return alias;
+  // scale probabilities so that their average is one
+  auto scaled = std::vector<double>(size);
+  for (auto idx = 0; idx < size; idx++) {
+    auto weight = cdf[idx] - (idx ? cdf[idx - 1] : 0);
+    scaled[idx] = (double)weight * size / cdf.back();
+  }
+  // pair entries below average with entries above average
+  auto small = std::vector<int>{}, large = std::vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    if (scaled[idx] < 1) {
+      small.push_back(idx);
+    } else {
+      large.push_back(idx);
+    }
+  }
+  while (!small.empty() && !large.empty()) {
+    auto sidx = small.back(), lidx = large.back();
+    small.pop_back();
+    alias[sidx] = {(float)scaled[sidx], lidx};
+    scaled[lidx] -= 1 - scaled[sidx];
+    if (scaled[lidx] < 1) {
+      large.pop_back();
+      small.push_back(lidx);
+    }
+  }
+  // remaining entries are kept because of round-off
+  for (auto idx : small) alias[idx] = {1, idx};
+  for (auto idx : large) alias[idx] = {1, idx};
+  return alias;
+}
+
+// Sample a discrete distribution represented by its alias table.
+inline int sample_discrete_alias(
+    const std::vector<std::pair<float, int>>& alias, float r, float ra) {
+  auto idx = clamp((int)(r * alias.size()), 0, (int)alias.size() - 1);
+  return ra < alias[idx].first ? idx : alias[idx].second;
+}
+
 // Sample a discrete distribution represented by its cdf.
 inline int sample_discrete_weights(const std::vector<float>& weights, float r) {
   auto sum = 0.0f;
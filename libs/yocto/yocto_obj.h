@@ -41,6 +41,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "yocto_common.h"
 #include "yocto_math.h"
 
 // -----------------------------------------------------------------------------
@@ -207,7 +208,12 @@ struct model {
   std::vector<obj::material*>    materials    = {};
   std::vector<obj::camera*>      cameras      = {};
   std::vector<obj::environment*> environments = {};
-  ~model();
+
+  // storage of the elements, freed at once with the model
+  common::arena<obj::shape>       shape_arena       = {};
+  common::arena<obj::material>    material_arena    = {};
+  common::arena<obj::camera>      camera_arena      = {};
+  common::arena<obj::environment> environment_arena = {};
 };
 
 // Load and save obj
@@ -328,11 +334,22 @@ struct hash<yocto::obj::vertex> {
 //
 // -----------------------------------------------------------------------------
 
+#include <atomic>
+#include <charconv>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <string_view>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "ext/filesystem.hpp"
+#include "yocto_ply.h"
 namespace sfs = ghc::filesystem;
 
 // -----------------------------------------------------------------------------
@@ -385,9 +402,10 @@ inline void skip_whitespace(std::string_view& str) {
   return true;
 }
 [[nodiscard]] inline bool parse_value(std::string_view& str, int32_t& value) {
-  char* end = nullptr;
-  value     = (int32_t)strtol(str.data(), &end, 10);
-  if (str.data() == end) return false;
+  skip_whitespace(str);
+  if (str.size() > 1 && str.front() == '+') str.remove_prefix(1);
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc{}) return false;
   str.remove_prefix(end - str.data());
   return true;
 }
@@ -397,11 +415,54 @@ inline void skip_whitespace(std::string_view& str) {
   value = (bool)valuei;
   return true;
 }
+// Parse decimals with at most 15 digits and small exponents exactly through
+// a double. Falls back to strtof for other inputs, like inf or hex values.
 [[nodiscard]] inline bool parse_value(std::string_view& str, float& value) {
-  char* end = nullptr;
-  value     = strtof(str.data(), &end);
-  if (str.data() == end) return false;
-  str.remove_prefix(end - str.data());
+  static const double exp10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+      1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+      1e21, 1e22};
+  auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+  skip_whitespace(str);
+  if (str.empty()) return false;
+  auto ptr = str.data(), end = str.data() + str.size();
+  auto negative = *ptr == '-';
+  if (*ptr == '-' || *ptr == '+') ptr++;
+  auto mantissa = (uint64_t)0;
+  auto digits = 0, significant = 0, exponent = 0;
+  for (; ptr != end && is_digit(*ptr); ptr++, digits++) {
+    mantissa = mantissa * 10 + (*ptr - '0');
+    if (mantissa) significant++;
+  }
+  if (ptr != end && *ptr == '.') {
+    for (ptr++; ptr != end && is_digit(*ptr); ptr++, digits++, exponent--) {
+      mantissa = mantissa * 10 + (*ptr - '0');
+      if (mantissa) significant++;
+    }
+  }
+  if (digits && ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    auto eptr = ptr + 1;
+    auto enegative = eptr != end && *eptr == '-';
+    if (eptr != end && (*eptr == '-' || *eptr == '+')) eptr++;
+    auto evalue = 0, edigits = 0;
+    for (; eptr != end && is_digit(*eptr) && edigits < 4; eptr++, edigits++)
+      evalue = evalue * 10 + (*eptr - '0');
+    if (edigits) {
+      exponent += enegative ? -evalue : evalue;
+      ptr = eptr;
+    }
+  }
+  if (digits && significant <= 15 && exponent >= -22 && exponent <= 22 &&
+      (ptr == end || !(isalnum((unsigned char)*ptr) || *ptr == '.'))) {
+    auto result = exponent < 0 ? (double)mantissa / exp10[-exponent]
+                               : (double)mantissa * exp10[exponent];
+    value = (float)(negative ? -result : result);
+    str.remove_prefix(ptr - str.data());
+    return true;
+  }
+  char* fend = nullptr;
+  value      = strtof(str.data(), &fend);
+  if (str.data() == fend) return false;
+  str.remove_prefix(fend - str.data());
   return true;
 }
 
@@ -426,14 +487,15 @@ inline void format_value(std::string& str, const std::string& value) {
   str += value;
 }
 inline void format_value(std::string& str, int value) {
-  char buf[256];
-  sprintf(buf, "%d", (int)value);
-  str += buf;
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  str.append(buf, end);
 }
 inline void format_value(std::string& str, float value) {
-  char buf[256];
-  sprintf(buf, "%g", value);
-  str += buf;
+  // shortest representation that reads back to the same value
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  str.append(buf, end);
 }
 inline void format_value(std::string& str, const vec2f& value) {
   for (auto i = 0; i < 2; i++) {
@@ -580,7 +642,7 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
     if (str.empty()) continue;
 
     // get command
-    auto cmd = ""s;
+    auto cmd = std::string_view{};
     if (!parse_value(str, cmd)) return parse_error();
     if (cmd == "") continue;
 
@@ -732,6 +794,7 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
   }
 
   // remove placeholder material
+  obj->material_arena.destroy(obj->materials.front());
   obj->materials.erase(obj->materials.begin());
 
   // convert between roughness and exponent
@@ -811,7 +874,7 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
     if (str.empty()) continue;
 
     // get command
-    auto cmd = ""s;
+    auto cmd = std::string_view{};
     if (!parse_value(str, cmd)) return parse_error();
     if (cmd == "") continue;
 
@@ -854,28 +917,169 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
   return true;
 }
 
-inline model::~model() {
-  for (auto shape : shapes) delete shape;
-  for (auto material : materials) delete material;
-  for (auto camera : cameras) delete camera;
-  for (auto environment : environments) delete environment;
-}
-
 // Make obj
 inline obj::camera* add_camera(obj::model* obj) {
-  return obj->cameras.emplace_back(new camera{});
+  return obj->cameras.emplace_back(obj->camera_arena.create());
 }
 inline obj::material* add_material(obj::model* obj) {
-  return obj->materials.emplace_back(new material{});
+  return obj->materials.emplace_back(obj->material_arena.create());
 }
 inline obj::environment* add_environment(obj::model* obj) {
-  return obj->environments.emplace_back(new environment{});
+  return obj->environments.emplace_back(obj->environment_arena.create());
 }
 inline obj::shape* add_shape(obj::model* obj) {
-  return obj->shapes.emplace_back(new shape{});
+  return obj->shapes.emplace_back(obj->shape_arena.create());
 }
 
-// Read obj
+// Read-only contents of a file, memory mapped when supported.
+struct file_view {
+  const char*       data   = nullptr;
+  size_t            size   = 0;
+  std::vector<char> buffer = {};  // contents when not mapped
+
+  file_view() {}
+  file_view(const file_view&) = delete;
+  file_view& operator=(const file_view&) = delete;
+  ~file_view() {
+#ifndef _WIN32
+    if (buffer.empty() && data) munmap((void*)data, size);
+#endif
+  }
+};
+
+// Map a file in memory, or read it if mapping is not supported.
+[[nodiscard]] inline bool map_file(const std::string& filename, file_view& view) {
+#ifndef _WIN32
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  auto stats = (struct stat){};
+  if (fstat(fd, &stats) != 0) {
+    close(fd);
+    return false;
+  }
+  view.size = (size_t)stats.st_size;
+  if (view.size) {
+    auto data = mmap(nullptr, view.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(data, view.size, MADV_SEQUENTIAL);
+    view.data = (const char*)data;
+  }
+  close(fd);
+  return true;
+#else
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  fseek(fs, 0, SEEK_END);
+  view.buffer.resize(ftell(fs));
+  fseek(fs, 0, SEEK_SET);
+  if (fread(view.buffer.data(), 1, view.buffer.size(), fs) !=
+      view.buffer.size())
+    return false;
+  view.data = view.buffer.data();
+  view.size = view.buffer.size();
+  return true;
+#endif
+}
+
+// Obj lines parsed in parallel. Vertex data and elements go into chunk
+// buffers, while other commands keep their line and are applied in order
+// after parsing. Runs of elements of the same type store the vertex counts
+// before them, used to resolve negative indices.
+struct obj_command {
+  char             type     = 0;   // 'f', 'l', 'p', or 0 for other commands
+  vertex           size     = {};  // chunk vertex counts before the command
+  int              elements = 0;   // number of elements in a run
+  std::string_view line     = {};  // line of other commands
+};
+struct obj_chunk {
+  std::string_view         data      = {};
+  std::string              tail      = {};  // last line, if not terminated
+  std::vector<vec3f>       positions = {};
+  std::vector<vec3f>       normals   = {};
+  std::vector<vec2f>       texcoords = {};
+  std::vector<vertex>      vertices  = {};
+  std::vector<uint8_t>     sizes     = {};
+  std::vector<obj_command> commands  = {};
+};
+
+// Parse a chunk of obj lines
+[[nodiscard]] inline bool parse_obj_chunk(obj_chunk& chunk, bool last) {
+  auto size = vertex{};
+  auto data = chunk.data;
+  while (!data.empty()) {
+    // get line, copying the last one if not terminated since number
+    // parsing needs a terminator
+    auto end  = (const char*)memchr(data.data(), '\n', data.size());
+    auto line = std::string_view{};
+    if (end) {
+      line = data.substr(0, end - data.data() + 1);
+    } else if (last) {
+      chunk.tail = std::string{data};
+      line       = chunk.tail;
+    } else {
+      line = data;
+    }
+    data.remove_prefix(end ? line.size() : data.size());
+    auto str = line;
+    remove_comment(str);
+    skip_whitespace(str);
+    if (str.empty()) continue;
+
+    // get command
+    auto cmd = std::string_view{};
+    if (!parse_value(str, cmd)) return false;
+    if (cmd == "") continue;
+
+    // parse vertex data and elements, dispatching on the first two
+    // characters of the command
+    auto key = cmd.size() > 2 ? 0
+                              : (cmd[0] << 8) | (cmd.size() > 1 ? cmd[1] : 0);
+    switch (key) {
+      case 'v' << 8: {
+        if (!parse_value(str, chunk.positions.emplace_back())) return false;
+        size.position += 1;
+      } break;
+      case ('v' << 8) | 'n': {
+        if (!parse_value(str, chunk.normals.emplace_back())) return false;
+        size.normal += 1;
+      } break;
+      case ('v' << 8) | 't': {
+        if (!parse_value(str, chunk.texcoords.emplace_back())) return false;
+        size.texcoord += 1;
+      } break;
+      case 'f' << 8:
+      case 'l' << 8:
+      case 'p' << 8: {
+        if (chunk.commands.empty() || chunk.commands.back().type != cmd[0] ||
+            !(chunk.commands.back().size == size))
+          chunk.commands.push_back({cmd[0], size, 0, {}});
+        auto& element_size = chunk.sizes.emplace_back((uint8_t)0);
+        skip_whitespace(str);
+        while (!str.empty()) {
+          auto vert = vertex{};
+          if (!parse_value(str, vert)) return false;
+          if (!vert.position) break;
+          chunk.vertices.push_back(vert);
+          element_size += 1;
+          skip_whitespace(str);
+        }
+        chunk.commands.back().elements += 1;
+      } break;
+      default: {
+        chunk.commands.push_back({0, size, 0, line});
+      } break;
+    }
+  }
+  return true;
+}
+
+// Read obj. The file is memory mapped and split into line aligned chunks
+// that are parsed in parallel. Chunks are then merged in order, offsetting
+// negative indices by the vertex counts of the previous chunks.
 inline bool load_obj(const std::string& filename, obj::model* obj,
     std::string& error, bool geom_only, bool split_elements,
     bool split_materials) {
@@ -897,10 +1101,32 @@ inline bool load_obj(const std::string& filename, obj::model* obj,
     return false;
   };
 
-  // open file
-  auto fs = fopen(filename.c_str(), "rt");
-  if (!fs) return open_error();
-  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  // map file
+  auto file = file_view{};
+  if (!map_file(filename, file)) return open_error();
+
+  // split file in chunks at line boundaries
+  auto nthreads = common::get_num_threads();
+  auto nchunks  = (int)std::clamp(
+      file.size / ((size_t)1 << 20), (size_t)1, (size_t)nthreads * 4);
+  auto chunks   = std::vector<obj_chunk>(nchunks);
+  auto start    = (size_t)0;
+  for (auto idx = 0; idx < nchunks; idx++) {
+    auto end = idx == nchunks - 1
+                   ? file.size
+                   : std::max(start, file.size * (idx + 1) / nchunks);
+    while (end < file.size && file.data[end - 1] != '\n') end++;
+    chunks[idx].data = std::string_view{file.data + start, end - start};
+    start            = end;
+  }
+
+  // parse chunks in parallel, skipping the remaining ones after an error
+  auto failed = std::atomic<bool>{false};
+  common::parallel_for(nchunks, [&](int idx) {
+    if (failed) return;
+    if (!parse_obj_chunk(chunks[idx], idx == nchunks - 1)) failed = true;
+  });
+  if (failed) return parse_error();
 
   // parsing state
   auto opositions   = std::vector<vec3f>{};
@@ -914,138 +1140,160 @@ inline bool load_obj(const std::string& filename, obj::model* obj,
   auto material_map = std::unordered_map<std::string, obj::material*>{};
 
   // initialize obj
-  obj->~model();
   obj->cameras.clear();
   obj->environments.clear();
   obj->shapes.clear();
   obj->materials.clear();
+  obj->camera_arena.clear();
+  obj->environment_arena.clear();
+  obj->shape_arena.clear();
+  obj->material_arena.clear();
 
   // initialize load
-  obj->shapes.emplace_back(new shape{});
+  add_shape(obj);
   auto empty_material = (obj::material*)nullptr;
 
-  // read the file str by str
-  char buffer[4096];
-  while (fgets(buffer, sizeof(buffer), fs)) {
-    // str
-    auto str = std::string_view{buffer};
-    remove_comment(str);
-    skip_whitespace(str);
-    if (str.empty()) continue;
-
-    // get command
-    auto cmd = ""s;
-    if (!parse_value(str, cmd)) return parse_error();
-    if (cmd == "") continue;
-
-    // possible token values
-    if (cmd == "v") {
-      if (!parse_value(str, opositions.emplace_back())) return parse_error();
-      vert_size.position += 1;
-    } else if (cmd == "vn") {
-      if (!parse_value(str, onormals.emplace_back())) return parse_error();
-      vert_size.normal += 1;
-    } else if (cmd == "vt") {
-      if (!parse_value(str, otexcoords.emplace_back())) return parse_error();
-      vert_size.texcoord += 1;
-    } else if (cmd == "f" || cmd == "l" || cmd == "p") {
-      // split if split_elements and different primitives
-      if (auto shape = obj->shapes.back();
-          split_elements && !shape->vertices.empty()) {
-        if ((cmd == "f" && (!shape->lines.empty() || !shape->points.empty())) ||
-            (cmd == "l" && (!shape->faces.empty() || !shape->points.empty())) ||
-            (cmd == "p" && (!shape->faces.empty() || !shape->lines.empty()))) {
-          add_shape(obj);
-          obj->shapes.back()->name = oname + gname;
+  // merge chunks in order
+  auto base = vertex{};
+  for (auto& chunk : chunks) {
+    auto vertex_id = (size_t)0, element_id = (size_t)0;
+    for (auto& command : chunk.commands) {
+      vert_size = {base.position + command.size.position,
+          base.texcoord + command.size.texcoord,
+          base.normal + command.size.normal};
+      if (command.type) {
+        auto type = command.type;
+        // split if split_elements and different primitives
+        if (auto shape = obj->shapes.back();
+            split_elements && !shape->vertices.empty()) {
+          if ((type == 'f' &&
+                  (!shape->lines.empty() || !shape->points.empty())) ||
+              (type == 'l' &&
+                  (!shape->faces.empty() || !shape->points.empty())) ||
+              (type == 'p' &&
+                  (!shape->faces.empty() || !shape->lines.empty()))) {
+            add_shape(obj);
+            obj->shapes.back()->name = oname + gname;
+          }
         }
-      }
-      // split if splt_material and different materials
-      if (auto shape = obj->shapes.back();
-          !geom_only && split_materials && !shape->materials.empty()) {
-        if (shape->materials.size() > 1)
-          throw std::runtime_error("should not have happened");
-        if (shape->materials.back()->name != mname) {
-          add_shape(obj);
-          obj->shapes.back()->name = oname + gname;
+        // split if splt_material and different materials
+        if (auto shape = obj->shapes.back();
+            !geom_only && split_materials && !shape->materials.empty()) {
+          if (shape->materials.size() > 1)
+            throw std::runtime_error("should not have happened");
+          if (shape->materials.back()->name != mname) {
+            add_shape(obj);
+            obj->shapes.back()->name = oname + gname;
+          }
         }
-      }
-      // grab shape and add element
-      auto  shape   = obj->shapes.back();
-      auto& element = (cmd == "f")
-                          ? shape->faces.emplace_back()
-                          : (cmd == "l") ? shape->lines.emplace_back()
-                                         : shape->points.emplace_back();
-      // get element material or add if needed
-      if (!geom_only) {
-        if (mname.empty() && !empty_material) {
-          empty_material   = obj->materials.emplace_back(new material{});
-          material_map[""] = empty_material;
+        // get element material or add if needed
+        auto shape    = obj->shapes.back();
+        auto element_material = (uint8_t)0;
+        if (!geom_only) {
+          if (mname.empty() && !empty_material) {
+            empty_material   = add_material(obj);
+            material_map[""] = empty_material;
+          }
+          auto mat_idx = -1;
+          for (auto midx = 0; midx < shape->materials.size(); midx++)
+            if (shape->materials[midx]->name == mname) mat_idx = midx;
+          if (mat_idx < 0) {
+            shape->materials.push_back(material_map.at(mname));
+            mat_idx = shape->materials.size() - 1;
+          }
+          element_material = (uint8_t)mat_idx;
         }
-        auto mat_idx = -1;
-        for (auto midx = 0; midx < shape->materials.size(); midx++)
-          if (shape->materials[midx]->name == mname) mat_idx = midx;
-        if (mat_idx < 0) {
-          shape->materials.push_back(material_map.at(mname));
-          mat_idx = shape->materials.size() - 1;
+        // add elements, fixing negative indices
+        auto& elements = (type == 'f')
+                             ? shape->faces
+                             : (type == 'l') ? shape->lines : shape->points;
+        for (auto idx = 0; idx < command.elements; idx++) {
+          auto& element    = elements.emplace_back();
+          element.material = element_material;
+          element.size     = chunk.sizes[element_id++];
+          for (auto vid = 0; vid < element.size; vid++) {
+            auto vert = chunk.vertices[vertex_id++];
+            if (vert.position < 0)
+              vert.position = vert_size.position + vert.position + 1;
+            if (vert.texcoord < 0)
+              vert.texcoord = vert_size.texcoord + vert.texcoord + 1;
+            if (vert.normal < 0)
+              vert.normal = vert_size.normal + vert.normal + 1;
+            shape->vertices.push_back(vert);
+          }
         }
-        element.material = (uint8_t)mat_idx;
+        continue;
       }
-      // parse vertices
+
+      // str
+      auto str = command.line;
+      remove_comment(str);
       skip_whitespace(str);
-      while (!str.empty()) {
-        auto vert = vertex{};
-        if (!parse_value(str, vert)) return parse_error();
-        if (!vert.position) break;
-        if (vert.position < 0)
-          vert.position = vert_size.position + vert.position + 1;
-        if (vert.texcoord < 0)
-          vert.texcoord = vert_size.texcoord + vert.texcoord + 1;
-        if (vert.normal < 0) vert.normal = vert_size.normal + vert.normal + 1;
-        shape->vertices.push_back(vert);
-        element.size += 1;
+
+      // get command
+      auto cmd = std::string_view{};
+      if (!parse_value(str, cmd)) return parse_error();
+
+      // possible token values
+      if (cmd == "o" || cmd == "g") {
+        if (geom_only) continue;
         skip_whitespace(str);
-      }
-    } else if (cmd == "o" || cmd == "g") {
-      if (geom_only) continue;
-      skip_whitespace(str);
-      if (cmd == "o") {
-        if (str.empty()) {
-          oname = "";
+        if (cmd == "o") {
+          if (str.empty()) {
+            oname = "";
+          } else {
+            if (!parse_value(str, oname)) return parse_error();
+          }
         } else {
-          if (!parse_value(str, oname)) return parse_error();
+          if (str.empty()) {
+            gname = "";
+          } else {
+            if (!parse_value(str, gname)) return parse_error();
+          }
         }
-      } else {
-        if (str.empty()) {
-          gname = "";
+        if (!obj->shapes.back()->vertices.empty()) {
+          add_shape(obj)->name = oname + gname;
         } else {
-          if (!parse_value(str, gname)) return parse_error();
+          obj->shapes.back()->name = oname + gname;
+        }
+      } else if (cmd == "usemtl") {
+        if (geom_only) continue;
+        if (!parse_value(str, mname)) return parse_error();
+      } else if (cmd == "s") {
+        if (geom_only) continue;
+      } else if (cmd == "mtllib") {
+        if (geom_only) continue;
+        auto mtllib = ""s;
+        if (!parse_value(str, mtllib)) return parse_error();
+        if (std::find(mtllibs.begin(), mtllibs.end(), mtllib) ==
+            mtllibs.end()) {
+          mtllibs.push_back(mtllib);
+          if (!load_mtl(
+                  sfs::path(filename).parent_path() / mtllib, obj, error))
+            return dependent_error();
+          for (auto material : obj->materials)
+            material_map[material->name] = material;
         }
-      }
-      if (!obj->shapes.back()->vertices.empty()) {
-        obj->shapes.emplace_back(new shape{});
-        obj->shapes.back()->name = oname + gname;
       } else {
-        obj->shapes.back()->name = oname + gname;
-      }
-    } else if (cmd == "usemtl") {
-      if (geom_only) continue;
-      if (!parse_value(str, mname)) return parse_error();
-    } else if (cmd == "s") {
-      if (geom_only) continue;
-    } else if (cmd == "mtllib") {
-      if (geom_only) continue;
-      auto mtllib = ""s;
-      if (!parse_value(str, mtllib)) return parse_error();
-      if (std::find(mtllibs.begin(), mtllibs.end(), mtllib) == mtllibs.end()) {
-        mtllibs.push_back(mtllib);
-        if (!load_mtl(sfs::path(filename).parent_path() / mtllib, obj, error))
-          return dependent_error();
-        for (auto material : obj->materials)
-          material_map[material->name] = material;
+        // unused
       }
-    } else {
-      // unused
     }
+    base.position += (int)chunk.positions.size();
+    base.texcoord += (int)chunk.texcoords.size();
+    base.normal += (int)chunk.normals.size();
+  }
+
+  // merge vertex data
+  opositions.reserve(base.position);
+  onormals.reserve(base.normal);
+  otexcoords.reserve(base.texcoord);
+  for (auto& chunk : chunks) {
+    opositions.insert(
+        opositions.end(), chunk.positions.begin(), chunk.positions.end());
+    onormals.insert(onormals.end(), chunk.normals.begin(), chunk.normals.end());
+    otexcoords.insert(
+        otexcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+    chunk = {};
   }
 
   // fix empty material
@@ -1055,15 +1303,15 @@ inline bool load_obj(const std::string& filename, obj::model* obj,
     empty_material->pbr_base = {0.8, 0.8, 0.8};
   }
 
-  // convert vertex data
-  auto ipositions = std::vector<int>{};
-  auto inormals   = std::vector<int>{};
-  auto itexcoords = std::vector<int>{};
+  // convert vertex data, clearing only the indices used by each shape
+  auto ipositions = std::vector<int>(opositions.size() + 1, 0);
+  auto inormals   = std::vector<int>(onormals.size() + 1, 0);
+  auto itexcoords = std::vector<int>(otexcoords.size() + 1, 0);
+  auto used       = std::vector<vertex>{};
   for (auto shape : obj->shapes) {
-    ipositions.assign(opositions.size() + 1, 0);
-    inormals.assign(onormals.size() + 1, 0);
-    itexcoords.assign(otexcoords.size() + 1, 0);
+    used.clear();
     for (auto& vertex : shape->vertices) {
+      used.push_back(vertex);
       if (vertex.position && !ipositions[vertex.position]) {
         shape->positions.push_back(opositions[vertex.position - 1]);
         ipositions[vertex.position] = (int)shape->positions.size();
@@ -1080,6 +1328,11 @@ inline bool load_obj(const std::string& filename, obj::model* obj,
       vertex.normal   = inormals[vertex.normal];
       vertex.texcoord = itexcoords[vertex.texcoord];
     }
+    for (auto& vertex : used) {
+      ipositions[vertex.position] = 0;
+      inormals[vertex.normal]     = 0;
+      itexcoords[vertex.texcoord] = 0;
+    }
   }
 
   // exit if done
@@ -1390,40 +1643,56 @@ inline void format_value(std::string& str, const vertex& value) {
       return write_error();
   }
 
-  // save objects
+  // save objects, formatting vertices and elements in parallel chunks
   auto vert_size = vertex{0, 0, 0};
   for (auto shape : obj->shapes) {
     if (!format_values(fs, "o {}\n", shape->name)) return write_error();
-    for (auto& p : shape->positions)
-      if (!format_values(fs, "v {}\n", p)) return write_error();
-    for (auto& n : shape->normals)
-      if (!format_values(fs, "vn {}\n", n)) return write_error();
-    for (auto& t : shape->texcoords)
-      if (!format_values(fs, "vt {}\n", t)) return write_error();
+    auto format_vertices = [fs](const std::string& label, auto& values) {
+      return ply::format_chunks(fs, values.size(),
+          [&](std::string& str, size_t start, size_t end) {
+            for (auto idx = start; idx < end; idx++) {
+              str += label;
+              format_value(str, values[idx]);
+              str += '\n';
+            }
+          });
+    };
+    if (!format_vertices("v ", shape->positions)) return write_error();
+    if (!format_vertices("vn ", shape->normals)) return write_error();
+    if (!format_vertices("vt ", shape->texcoords)) return write_error();
     auto element_labels = std::vector<std::string>{"f", "l", "p"};
     auto element_groups = std::vector<const std::vector<element>*>{
         &shape->faces, &shape->lines, &shape->points};
     for (auto element_idx = 0; element_idx < 3; element_idx++) {
-      auto& label        = element_labels[element_idx];
-      auto& elements     = *element_groups[element_idx];
-      auto  cur_material = -1, cur_vertex = 0;
-      for (auto& element : elements) {
-        if (!shape->materials.empty() && cur_material != element.material) {
-          if (!format_values(
-                  fs, "usemtl {}\n", shape->materials[element.material]->name))
-            return write_error();
-          cur_material = element.material;
-        }
-        if (!format_values(fs, "{}", label)) return write_error();
-        for (auto c = 0; c < element.size; c++) {
-          auto vert = shape->vertices[cur_vertex++];
-          if (vert.position) vert.position += vert_size.position;
-          if (vert.normal) vert.normal += vert_size.normal;
-          if (vert.texcoord) vert.texcoord += vert_size.texcoord;
-          if (!format_values(fs, " {}", vert)) return write_error();
+      auto& label    = element_labels[element_idx];
+      auto& elements = *element_groups[element_idx];
+      // first vertex of each element, so chunks can start anywhere
+      auto offsets = std::vector<int>(elements.size());
+      for (auto idx = (size_t)1; idx < elements.size(); idx++)
+        offsets[idx] = offsets[idx - 1] + elements[idx - 1].size;
+      auto format_elements = [&](std::string& str, size_t start, size_t end) {
+        auto cur_material = start ? elements[start - 1].material : -1;
+        for (auto idx = start; idx < end; idx++) {
+          auto& element = elements[idx];
+          if (!shape->materials.empty() && cur_material != element.material) {
+            format_values(
+                str, "usemtl {}\n", shape->materials[element.material]->name);
+            cur_material = element.material;
+          }
+          str += label;
+          for (auto c = 0; c < element.size; c++) {
+            auto vert = shape->vertices[offsets[idx] + c];
+            if (vert.position) vert.position += vert_size.position;
+            if (vert.normal) vert.normal += vert_size.normal;
+            if (vert.texcoord) vert.texcoord += vert_size.texcoord;
+            str += ' ';
+            format_value(str, vert);
+          }
+          str += '\n';
         }
-        if (!format_values(fs, "\n")) return write_error();
-      }
+      };
+      if (!ply::format_chunks(fs, elements.size(), format_elements))
+        return write_error();
     }
     if (!format_values(fs, "\n")) return write_error();
     vert_size.position += (int)shape->positions.size();
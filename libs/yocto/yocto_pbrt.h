@@ -38,6 +38,7 @@
 #include <algorithm>
 #include <memory>
 
+#include "yocto_common.h"
 #include "yocto_math.h"
 
 // -----------------------------------------------------------------------------
@@ -159,11 +160,15 @@ struct model {
   ~model();
 };
 
-// Load/save pbrt
+// Load/save pbrt. Plymesh shapes are loaded in parallel, once for each ply
+// file. With ply_meshes, shapes with at least ply_vertices vertices are saved
+// in parallel as binary ply files, once for each filename_, and referenced
+// with plymesh. Shapes with a filename_ but no geometry are referenced as
+// ply files saved by the caller. The other shapes are saved inline.
 inline bool load_pbrt(
     const std::string& filename, pbrt::model* pbrt, std::string& error);
 inline bool save_pbrt(const std::string& filename, pbrt::model* pbrt,
-    std::string& error, bool ply_meshes = false);
+    std::string& error, bool ply_meshes = false, size_t ply_vertices = 0);
 
 // Create pbrt
 inline pbrt::camera*      add_camera(pbrt::model* pbrt);
@@ -182,8 +187,11 @@ inline pbrt::light*       add_light(pbrt::model* pbrt);
 //
 // -----------------------------------------------------------------------------
 
+#include <atomic>
+#include <charconv>
 #include <cstdio>
 #include <memory>
+#include <mutex>
 #include <string_view>
 #include <unordered_set>
 
@@ -248,17 +256,61 @@ inline void skip_whitespace(std::string_view& str) {
   return true;
 }
 [[nodiscard]] inline bool parse_value(std::string_view& str, int& value) {
-  char* end = nullptr;
-  value     = (int32_t)strtol(str.data(), &end, 10);
-  if (str.data() == end) return false;
+  skip_whitespace(str);
+  if (str.size() > 1 && str.front() == '+') str.remove_prefix(1);
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc{}) return false;
   str.remove_prefix(end - str.data());
   return true;
 }
+// Parse decimals with at most 15 digits and small exponents exactly through
+// a double. Falls back to strtof for other inputs, like inf or hex values.
 [[nodiscard]] inline bool parse_value(std::string_view& str, float& value) {
-  char* end = nullptr;
-  value     = strtof(str.data(), &end);
-  if (str.data() == end) return false;
-  str.remove_prefix(end - str.data());
+  static const double exp10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+      1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+      1e21, 1e22};
+  auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+  skip_whitespace(str);
+  if (str.empty()) return false;
+  auto ptr = str.data(), end = str.data() + str.size();
+  auto negative = *ptr == '-';
+  if (*ptr == '-' || *ptr == '+') ptr++;
+  auto mantissa = (uint64_t)0;
+  auto digits = 0, significant = 0, exponent = 0;
+  for (; ptr != end && is_digit(*ptr); ptr++, digits++) {
+    mantissa = mantissa * 10 + (*ptr - '0');
+    if (mantissa) significant++;
+  }
+  if (ptr != end && *ptr == '.') {
+    for (ptr++; ptr != end && is_digit(*ptr); ptr++, digits++, exponent--) {
+      mantissa = mantissa * 10 + (*ptr - '0');
+      if (mantissa) significant++;
+    }
+  }
+  if (digits && ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    auto eptr = ptr + 1;
+    auto enegative = eptr != end && *eptr == '-';
+    if (eptr != end && (*eptr == '-' || *eptr == '+')) eptr++;
+    auto evalue = 0, edigits = 0;
+    for (; eptr != end && is_digit(*eptr) && edigits < 4; eptr++, edigits++)
+      evalue = evalue * 10 + (*eptr - '0');
+    if (edigits) {
+      exponent += enegative ? -evalue : evalue;
+      ptr = eptr;
+    }
+  }
+  if (digits && significant <= 15 && exponent >= -22 && exponent <= 22 &&
+      (ptr == end || !(isalnum((unsigned char)*ptr) || *ptr == '.'))) {
+    auto result = exponent < 0 ? (double)mantissa / exp10[-exponent]
+                               : (double)mantissa * exp10[exponent];
+    value = (float)(negative ? -result : result);
+    str.remove_prefix(ptr - str.data());
+    return true;
+  }
+  char* fend = nullptr;
+  value      = strtof(str.data(), &fend);
+  if (str.data() == fend) return false;
+  str.remove_prefix(fend - str.data());
   return true;
 }
 
@@ -289,14 +341,14 @@ inline void format_value(std::string& str, const std::string& value) {
 }
 inline void format_value(std::string& str, const char* value) { str += value; }
 inline void format_value(std::string& str, int value) {
-  char buf[256];
-  sprintf(buf, "%d", (int)value);
-  str += buf;
+  char buf[64];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  str.append(buf, end);
 }
 inline void format_value(std::string& str, float value) {
-  char buf[256];
-  sprintf(buf, "%g", value);
-  str += buf;
+  char buf[64];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  str.append(buf, end);
 }
 
 inline void format_value(std::string& str, const vec2f& value) {
@@ -562,6 +614,30 @@ template <typename T>
   return true;
 }
 
+// get pbrt arrays, moving them out of the values if their type matches
+template <typename T>
+[[nodiscard]] inline bool take_value(
+    std::vector<value>& pbrt, const std::string& name, std::vector<T>& val) {
+  for (auto& p : pbrt) {
+    if (p.name != name) continue;
+    if constexpr (std::is_same_v<T, vec3f>) {
+      if (p.type != value::type_t::real && !p.vector3f.empty()) {
+        val        = std::move(p.vector3f);
+        p.vector3f = {};
+        return true;
+      }
+    } else if constexpr (std::is_same_v<T, vec2f>) {
+      if (p.type != value::type_t::real && !p.vector2f.empty()) {
+        val        = std::move(p.vector2f);
+        p.vector2f = {};
+        return true;
+      }
+    }
+    return get_value(p, val);
+  }
+  return true;
+}
+
 // pbrt value construction
 inline value make_value(const std::string& name, const std::string& val,
     value::type_t type = value::type_t::string) {
@@ -648,15 +724,16 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
   str.remove_suffix(cpy.size());
 }
 
-// Read a pbrt command from file
-[[nodiscard]] inline bool read_cmdline(FILE* fs, std::string& cmd) {
-  char buffer[4096];
-  cmd.clear();
-  auto found = false;
-  auto pos   = ftell(fs);
-  while (fgets(buffer, sizeof(buffer), fs)) {
+// Split pbrt file contents in commands. Commands start on lines beginning
+// with an uppercase letter, and continue on the following lines.
+[[nodiscard]] inline bool split_cmdlines(
+    std::string_view data, std::vector<std::string>& cmdlines) {
+  cmdlines.clear();
+  while (!data.empty()) {
     // line
-    auto line = std::string_view{buffer};
+    auto pos  = data.find('\n');
+    auto line = data.substr(0, pos);
+    data.remove_prefix(pos == std::string_view::npos ? data.size() : pos + 1);
     remove_comment(line);
     skip_whitespace(line);
     if (line.empty()) continue;
@@ -664,35 +741,28 @@ inline void remove_comment(std::string_view& str, char comment_char = '#') {
     // check if command
     auto is_cmd = line[0] >= 'A' && line[0] <= 'Z';
     if (is_cmd) {
-      if (found) {
-        fseek(fs, pos, SEEK_SET);
-        // line_num -= 1;
-        return true;
-      } else {
-        found = true;
-      }
-    } else if (!found) {
+      cmdlines.emplace_back();
+    } else if (cmdlines.empty()) {
       return false;
     }
-    cmd += line;
-    cmd += " ";
-    pos = ftell(fs);
+    cmdlines.back() += line;
+    cmdlines.back() += " ";
   }
-  return found;
+  return true;
 }
 
 // parse a quoted std::string
 [[nodiscard]] inline bool parse_command(
-    std::string_view& str, std::string& value) {
+    std::string_view& str, std::string_view& value) {
   skip_whitespace(str);
   if (!isalpha((int)str.front())) return false;
   auto pos = str.find_first_not_of(
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
   if (pos == std::string_view::npos) {
-    value.assign(str);
+    value = str;
     str.remove_prefix(str.size());
   } else {
-    value.assign(str.substr(0, pos));
+    value = str.substr(0, pos);
     str.remove_prefix(pos + 1);
   }
   return true;
@@ -1280,6 +1350,10 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     error = filename + ": missing bsdf " + name;
     return false;
   };
+  auto texture_error = [filename, &error](const std::string& name) {
+    error = filename + ": missing texture " + name;
+    return false;
+  };
 
   // helpers
   auto get_texture = [&](const std::vector<value>& values,
@@ -1291,7 +1365,9 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
       color    = textured.first;
       filename = "";
     } else {
-      auto& texture = named_textures.at(textured.second);
+      auto it = named_textures.find(textured.second);
+      if (it == named_textures.end()) return texture_error(textured.second);
+      auto& texture = it->second;
       if (texture.filename.empty()) {
         color    = texture.constant;
         filename = "";
@@ -1310,7 +1386,9 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     if (textured.second == "") {
       scalar = mean(textured.first);
     } else {
-      auto& texture = named_textures.at(textured.second);
+      auto it = named_textures.find(textured.second);
+      if (it == named_textures.end()) return texture_error(textured.second);
+      auto& texture = it->second;
       if (texture.filename.empty()) {
         scalar = mean(texture.constant);
       } else {
@@ -1327,7 +1405,9 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     if (textured.second == "") {
       color = textured.first;
     } else {
-      auto& texture = named_textures.at(textured.second);
+      auto it = named_textures.find(textured.second);
+      if (it == named_textures.end()) return texture_error(textured.second);
+      auto& texture = it->second;
       if (texture.filename.empty()) {
         color = texture.constant;
       } else {
@@ -1373,12 +1453,12 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     auto diffuse = zero3f, specular = zero3f, transmission = zero3f;
     auto diffuse_map = ""s, specular_map = ""s, transmission_map = ""s;
     if (!get_texture(command.values, "Kd", diffuse, diffuse_map, vec3f{0.25}))
-      return parse_error();
+      return false;
     if (!get_texture(command.values, "Ks", specular, specular_map, vec3f{0.25}))
-      return parse_error();
+      return false;
     if (!get_texture(
             command.values, "Kt", transmission, transmission_map, vec3f{0}))
-      return parse_error();
+      return false;
     if (max(transmission) > 0.1) {
       pmaterial->color        = transmission;
       pmaterial->color_tex    = transmission_map;
@@ -1390,44 +1470,39 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
       pmaterial->specular  = 1;
     }
     if (!get_scalar(command.values, "opacity", pmaterial->opacity, 1))
-      return parse_error();
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+      return false;
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     if (!get_roughness(command.values, pmaterial->roughness, 0.1f))
-      return parse_error();
+      return false;
     return true;
   } else if (command.type == "plastic") {
     if (!get_texture(command.values, "Kd", pmaterial->color,
             pmaterial->color_tex, vec3f{0.25}))
-      return parse_error();
+      return false;
     if (!get_scalar(command.values, "Ks", pmaterial->specular, 0.25))
-      return parse_error();
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+      return false;
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     pmaterial->roughness = 0.1f;
-    if (!get_roughness(command.values, pmaterial->roughness, 0.1))
-      return parse_error();
+    if (!get_roughness(command.values, pmaterial->roughness, 0.1)) return false;
     return true;
   } else if (command.type == "translucent") {
     if (!get_texture(command.values, "Kd", pmaterial->color,
             pmaterial->color_tex, vec3f{0.25}))
-      return parse_error();
+      return false;
     if (!get_scalar(command.values, "Ks", pmaterial->specular, 0.25))
-      return parse_error();
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
-    if (!get_roughness(command.values, pmaterial->roughness, 0.1))
-      return parse_error();
+      return false;
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
+    if (!get_roughness(command.values, pmaterial->roughness, 0.1)) return false;
     return true;
   } else if (command.type == "matte") {
     if (!get_texture(command.values, "Kd", pmaterial->color,
             pmaterial->color_tex, vec3f{0.5}))
-      return parse_error();
+      return false;
     return true;
   } else if (command.type == "mirror") {
     if (!get_texture(command.values, "Kr", pmaterial->color,
             pmaterial->color_tex, vec3f{0.9}))
-      return parse_error();
+      return false;
     pmaterial->metallic  = 1;
     pmaterial->roughness = 0;
     return true;
@@ -1438,26 +1513,24 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     auto eta = zero3f, etak = zero3f;
     if (!get_color(command.values, "eta", eta,
             vec3f{0.2004376970f, 0.9240334304f, 1.1022119527f}))
-      return parse_error();
+      return false;
     if (!get_color(command.values, "k", etak,
             vec3f{3.9129485033f, 2.4528477015f, 2.1421879552f}))
-      return parse_error();
+      return false;
     pmaterial->color     = eta_to_reflectivity(eta, etak);
     pmaterial->roughness = 0.01f;
     if (!get_roughness(command.values, pmaterial->roughness, 0.01))
-      return parse_error();
+      return false;
     return true;
   } else if (command.type == "substrate") {
     if (!get_texture(command.values, "Kd", pmaterial->color,
             pmaterial->color_tex, vec3f{0.5}))
-      return parse_error();
+      return false;
     if (!get_scalar(command.values, "Ks", pmaterial->specular, 0.5))
-      return parse_error();
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+      return false;
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     pmaterial->roughness = 0.1f;
-    if (!get_roughness(command.values, pmaterial->roughness, 0.1))
-      return parse_error();
+    if (!get_roughness(command.values, pmaterial->roughness, 0.1)) return false;
     return true;
   } else if (command.type == "glass") {
     // get_texture(
@@ -1469,50 +1542,42 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     pmaterial->specular     = 1;
     pmaterial->transmission = 1;
     pmaterial->thin         = false;
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     pmaterial->roughness = 0;
-    if (!get_roughness(command.values, pmaterial->roughness, 0))
-      return parse_error();
+    if (!get_roughness(command.values, pmaterial->roughness, 0)) return false;
     return true;
   } else if (command.type == "hair") {
     if (!get_texture(command.values, "color", pmaterial->color,
             pmaterial->color_tex, vec3f{0}))
-      return parse_error();
+      return false;
     pmaterial->roughness = 1;
     if (verbose) printf("hair material not properly supported\n");
     return true;
   } else if (command.type == "disney") {
     if (!get_texture(command.values, "color", pmaterial->color,
             pmaterial->color_tex, vec3f{0.5}))
-      return parse_error();
+      return false;
     pmaterial->roughness = 1;
     if (verbose) printf("disney material not properly supported\n");
     return true;
   } else if (command.type == "kdsubsurface") {
     if (!get_texture(command.values, "Kd", pmaterial->color,
             pmaterial->color_tex, vec3f{0.5}))
-      return parse_error();
-    if (!get_scalar(command.values, "Kr", pmaterial->specular, 1))
-      return parse_error();
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+      return false;
+    if (!get_scalar(command.values, "Kr", pmaterial->specular, 1)) return false;
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     pmaterial->roughness = 0;
-    if (!get_roughness(command.values, pmaterial->roughness, 0))
-      return parse_error();
+    if (!get_roughness(command.values, pmaterial->roughness, 0)) return false;
     if (verbose) printf("kdsubsurface material not properly supported\n");
     return true;
   } else if (command.type == "subsurface") {
-    if (!get_scalar(command.values, "Kr", pmaterial->specular, 1))
-      return parse_error();
+    if (!get_scalar(command.values, "Kr", pmaterial->specular, 1)) return false;
     if (!get_scalar(command.values, "Kt", pmaterial->transmission, 1))
-      return parse_error();
+      return false;
     pmaterial->color = {1, 1, 1};
-    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5))
-      return parse_error();
+    if (!get_scalar(command.values, "eta", pmaterial->ior, 1.5)) return false;
     pmaterial->roughness = 0;
-    if (!get_roughness(command.values, pmaterial->roughness, 0))
-      return parse_error();
+    if (!get_roughness(command.values, pmaterial->roughness, 0)) return false;
     auto scale = 1.0f;
     if (!get_value(command.values, "scale", scale)) return parse_error();
     pmaterial->volscale = 1 / scale;
@@ -1520,10 +1585,10 @@ inline bool convert_material(pbrt::material* pmaterial, const command& command,
     auto sigma_a_tex = ""s, sigma_s_tex = ""s;
     if (!get_texture(command.values, "sigma_a", sigma_a, sigma_a_tex,
             vec3f{0011, .0024, .014}))
-      return parse_error();
+      return false;
     if (!get_texture(command.values, "sigma_prime_s", sigma_s, sigma_s_tex,
             vec3f{2.55, 3.12, 3.77}))
-      return parse_error();
+      return false;
     pmaterial->volmeanfreepath = 1 / (sigma_a + sigma_s);
     pmaterial->volscatter      = sigma_s / (sigma_a + sigma_s);
     if (verbose) printf("subsurface material not properly supported\n");
@@ -1661,11 +1726,12 @@ inline void make_quad(std::vector<vec3i>& triangles,
 }
 
 // Convert pbrt shapes
-inline bool convert_shape(pbrt::shape* shape, const command& command,
+// Array values are moved out of the command. Ply meshes only store their
+// filename, and are loaded later.
+inline bool convert_shape(pbrt::shape* shape, command& command,
     std::string&                                    alphamap,
     const std::unordered_map<std::string, texture>& named_textures,
-    const std::string& ply_dirname, const std::string& filename,
-    std::string& error, bool verbose = false) {
+    const std::string& filename, std::string& error, bool verbose = false) {
   auto parse_error = [filename, &error]() {
     error = filename + ": parse error";
     return false;
@@ -1674,8 +1740,8 @@ inline bool convert_shape(pbrt::shape* shape, const command& command,
     error = filename + ": unknown type " + command.type;
     return false;
   };
-  auto dependent_error = [filename, &error]() {
-    error = filename + ": error in " + error;
+  auto texture_error = [filename, &error](const std::string& name) {
+    error = filename + ": missing texture " + name;
     return false;
   };
 
@@ -1688,7 +1754,9 @@ inline bool convert_shape(pbrt::shape* shape, const command& command,
     if (textured.second == "") {
       filename = "";
     } else {
-      filename = named_textures.at(textured.second).filename;
+      auto it = named_textures.find(textured.second);
+      if (it == named_textures.end()) return texture_error(textured.second);
+      filename = it->second.filename;
     }
     return true;
   };
@@ -1700,9 +1768,10 @@ inline bool convert_shape(pbrt::shape* shape, const command& command,
     shape->normals   = {};
     shape->texcoords = {};
     shape->triangles = {};
-    if (!get_value(command.values, "P", shape->positions)) return parse_error();
-    if (!get_value(command.values, "N", shape->normals)) return parse_error();
-    if (!get_value(command.values, "uv", shape->texcoords))
+    if (!take_value(command.values, "P", shape->positions))
+      return parse_error();
+    if (!take_value(command.values, "N", shape->normals)) return parse_error();
+    if (!take_value(command.values, "uv", shape->texcoords))
       return parse_error();
     for (auto& uv : shape->texcoords) uv.y = (1 - uv.y);
     if (!get_value(command.values, "indices", shape->triangles))
@@ -1711,7 +1780,8 @@ inline bool convert_shape(pbrt::shape* shape, const command& command,
   } else if (command.type == "loopsubdiv") {
     shape->positions = {};
     shape->triangles = {};
-    if (!get_value(command.values, "P", shape->positions)) return parse_error();
+    if (!take_value(command.values, "P", shape->positions))
+      return parse_error();
     if (!get_value(command.values, "indices", shape->triangles))
       return parse_error();
     shape->normals.resize(shape->positions.size());
@@ -1721,14 +1791,7 @@ inline bool convert_shape(pbrt::shape* shape, const command& command,
     shape->filename_ = ""s;
     if (!get_value(command.values, "filename", shape->filename_))
       return parse_error();
-    if (!get_alpha(command.values, "alpha", alphamap)) return parse_error();
-    auto ply = std::make_unique<ply::model>();
-    if (!load_ply(ply_dirname + shape->filename_, ply.get(), error))
-      return dependent_error();
-    get_positions(ply.get(), shape->positions);
-    get_normals(ply.get(), shape->normals);
-    get_texcoords(ply.get(), shape->texcoords);
-    get_triangles(ply.get(), shape->triangles);
+    if (!get_alpha(command.values, "alpha", alphamap)) return false;
     return true;
   } else if (command.type == "sphere") {
     auto radius = 1.0f;
@@ -1886,14 +1949,41 @@ struct context {
   vec2i film_resolution = {512, 512};
 };
 
-// load pbrt
-[[nodiscard]] inline bool load_pbrt(const std::string& filename,
-    pbrt::model* pbrt, std::string& error, context& ctx,
-    std::unordered_map<std::string, pbrt::material*>& material_map,
-    std::unordered_map<std::string, material>&        named_materials,
-    std::unordered_map<std::string, texture>&         named_textures,
-    std::unordered_map<std::string, medium>&          named_mediums,
-    const std::string&                                ply_dirname) {
+// pbrt file split in commands, with shapes parsed ahead of time and
+// included files read concurrently
+struct cmdfile {
+  // included files are read by a pool task, or by the thread that needs
+  // them if the task has not started yet; they are shared with the task,
+  // that may run after loading is done
+  struct include {
+    std::unique_ptr<cmdfile> file   = std::make_unique<cmdfile>();
+    std::string              path   = "";
+    std::string              error  = "";
+    bool                     loaded = false;
+    std::once_flag           once   = {};
+  };
+  std::vector<std::string>                                  cmdlines = {};
+  std::vector<int>                                          shapeids = {};
+  std::vector<command>                                      shapes   = {};
+  std::unordered_map<std::string, std::shared_ptr<include>> includes = {};
+};
+
+// read pbrt commands, defined below
+[[nodiscard]] inline bool read_cmdfile(
+    const std::string& filename, cmdfile& file, std::string& error);
+
+// read an included file once, returning whether it was read
+inline bool read_include(cmdfile::include& include) {
+  std::call_once(include.once, [&include]() {
+    include.loaded = read_cmdfile(include.path, *include.file, include.error);
+  });
+  return include.loaded;
+}
+
+// read pbrt commands, parsing shapes in parallel and starting to read
+// included files, relative to the including file
+[[nodiscard]] inline bool read_cmdfile(
+    const std::string& filename, cmdfile& file, std::string& error) {
   // error helpers
   auto open_error = [filename, &error]() {
     error = filename + ": file not found";
@@ -1907,20 +1997,84 @@ struct context {
     error = filename + ": read error";
     return false;
   };
+
+  // read file in one go
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  if (fseek(fs, 0, SEEK_END) != 0) return read_error();
+  auto length = ftell(fs);
+  if (length < 0 || fseek(fs, 0, SEEK_SET) != 0) return read_error();
+  auto data = std::string(length, '\0');
+  if (fread(data.data(), 1, length, fs) != (size_t)length) return read_error();
+
+  // split commands
+  if (!split_cmdlines(data, file.cmdlines)) return parse_error();
+  data = {};
+
+  // parse shapes in parallel, since their arrays dominate parsing time;
+  // shapes that fail are parsed again later to report the error
+  auto shapes = std::vector<size_t>{};
+  for (auto idx = (size_t)0; idx < file.cmdlines.size(); idx++) {
+    if (file.cmdlines[idx].compare(0, 6, "Shape ") == 0) shapes.push_back(idx);
+  }
+  file.shapeids.assign(file.cmdlines.size(), -1);
+  file.shapes.resize(shapes.size());
+  auto parse_shape = [&file, &shapes](size_t sidx) {
+    auto  idx     = shapes[sidx];
+    auto  str     = std::string_view{file.cmdlines[idx]};
+    auto  cmd     = std::string_view{};
+    auto& command = file.shapes[sidx];
+    if (parse_command(str, cmd) && parse_param(str, command.type) &&
+        parse_params(str, command.values))
+      file.shapeids[idx] = (int)sidx;
+  };
+  if (shapes.size() < 64) {
+    for (auto sidx = (size_t)0; sidx < shapes.size(); sidx++)
+      parse_shape(sidx);
+  } else {
+    common::parallel_for((int)shapes.size(), parse_shape);
+  }
+
+  // read includes concurrently on the global pool
+  for (auto& cmdline : file.cmdlines) {
+    if (cmdline.compare(0, 8, "Include ") != 0) continue;
+    auto str         = std::string_view{cmdline};
+    auto cmd         = std::string_view{};
+    auto includename = ""s;
+    if (!parse_command(str, cmd)) return parse_error();
+    if (!parse_param(str, includename)) return parse_error();
+    if (file.includes.find(includename) != file.includes.end()) continue;
+    auto include  = std::make_shared<cmdfile::include>();
+    include->path = (sfs::path(filename).parent_path() / includename).string();
+    file.includes[includename] = include;
+    common::get_thread_pool().push([include]() { read_include(*include); });
+  }
+
+  return true;
+}
+
+// load pbrt
+[[nodiscard]] inline bool load_pbrt(const std::string& filename,
+    pbrt::model* pbrt, std::string& error, context& ctx, cmdfile& file,
+    std::unordered_map<std::string, pbrt::material*>& material_map,
+    std::unordered_map<std::string, material>&        named_materials,
+    std::unordered_map<std::string, texture>&         named_textures,
+    std::unordered_map<std::string, medium>&          named_mediums) {
+  // error helpers
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
   auto dependent_error = [filename, &error]() {
     error = filename + ": error in " + error;
     return false;
   };
-  auto command_error = [filename, &error](const std::string& cmd) {
-    error = filename + ": unknown command " + cmd;
+  auto command_error = [filename, &error](std::string_view cmd) {
+    error = filename + ": unknown command " + std::string{cmd};
     return false;
   };
 
-  // open file
-  auto fs = fopen(filename.c_str(), "rt");
-  if (!fs) return open_error();
-  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
-
   // helpers
   auto set_transform = [](stack_element& ctx, const frame3f& xform) {
     if (ctx.active_transform_start) ctx.transform_start = xform;
@@ -1935,11 +2089,10 @@ struct context {
   if (ctx.stack.empty()) ctx.stack.emplace_back();
 
   // parse command by command
-  auto line = ""s;
-  while (read_cmdline(fs, line)) {
-    auto str = std::string_view{line};
+  for (auto idx = (size_t)0; idx < file.cmdlines.size(); idx++) {
+    auto str = std::string_view{file.cmdlines[idx]};
     // get command
-    auto cmd = ""s;
+    auto cmd = std::string_view{};
     if (!parse_command(str, cmd)) return parse_error();
     if (cmd == "WorldBegin") {
       ctx.stack.push_back({});
@@ -1978,7 +2131,7 @@ struct context {
         shape->instaends.push_back(ctx.stack.back().transform_end);
       }
     } else if (cmd == "ActiveTransform") {
-      auto name = ""s;
+      auto name = std::string_view{};
       if (!parse_command(str, name)) return parse_error();
       if (name == "StartTime") {
         ctx.stack.back().active_transform_start = true;
@@ -2105,17 +2258,29 @@ struct context {
     } else if (cmd == "NamedMaterial") {
       auto name = ""s;
       if (!parse_param(str, name)) return parse_error();
-      ctx.stack.back().material = named_materials.at(name);
+      auto it = named_materials.find(name);
+      if (it == named_materials.end()) {
+        error = filename + ": missing material " + name;
+        return false;
+      }
+      ctx.stack.back().material = it->second;
     } else if (cmd == "Shape") {
       auto command = pbrt::command{};
-      if (!parse_param(str, command.type)) return parse_error();
-      if (!parse_params(str, command.values)) return parse_error();
+      if (file.shapeids[idx] >= 0) {
+        // shapes parsed ahead are used once, in case the file is included
+        // again
+        command            = std::move(file.shapes[file.shapeids[idx]]);
+        file.shapeids[idx] = -1;
+      } else {
+        if (!parse_param(str, command.type)) return parse_error();
+        if (!parse_params(str, command.values)) return parse_error();
+      }
       command.frame = ctx.stack.back().transform_start;
       command.frend = ctx.stack.back().transform_end;
       auto shape    = add_shape(pbrt);
       auto alphamap = ""s;
-      if (!convert_shape(shape, command, alphamap, named_textures, ply_dirname,
-              filename, error))
+      if (!convert_shape(
+              shape, command, alphamap, named_textures, filename, error))
         return false;
       auto matkey = "?!!!?" + ctx.stack.back().material.name + "?!!!?" +
                     ctx.stack.back().arealight.name + "?!!!?" + alphamap;
@@ -2169,14 +2334,26 @@ struct context {
       auto interior = ""s, exterior = ""s;
       if (!parse_param(str, interior)) return parse_error();
       if (!parse_param(str, exterior)) return parse_error();
-      ctx.stack.back().interior = named_mediums.at(interior);
-      ctx.stack.back().exterior = named_mediums.at(exterior);
+      auto iit = named_mediums.find(interior);
+      auto eit = named_mediums.find(exterior);
+      if (iit == named_mediums.end() || eit == named_mediums.end()) {
+        error = filename + ": missing medium " +
+                (iit == named_mediums.end() ? interior : exterior);
+        return false;
+      }
+      ctx.stack.back().interior = iit->second;
+      ctx.stack.back().exterior = eit->second;
     } else if (cmd == "Include") {
       auto includename = ""s;
       if (!parse_param(str, includename)) return parse_error();
+      auto& include = *file.includes.at(includename);
+      if (!read_include(include)) {
+        error = include.error;
+        return dependent_error();
+      }
       if (!load_pbrt(sfs::path(filename).parent_path() / includename, pbrt,
-              error, ctx, material_map, named_materials, named_textures,
-              named_mediums, ply_dirname))
+              error, ctx, *include.file, material_map, named_materials,
+              named_textures, named_mediums))
         return dependent_error();
     } else {
       return command_error(cmd);
@@ -2220,9 +2397,50 @@ inline pbrt::light* add_light(pbrt::model* pbrt) {
   auto named_textures  = std::unordered_map<std::string, texture>{{"", {}}};
   auto dirname         = sfs::path(filename).parent_path().string();
   if (dirname != "") dirname += "/";
-  if (!load_pbrt(filename, pbrt, error, ctx, material_map, named_materials,
-          named_textures, named_mediums, dirname))
+  auto file = cmdfile{};
+  if (!read_cmdfile(filename, file, error)) return false;
+  if (!load_pbrt(filename, pbrt, error, ctx, file, material_map,
+          named_materials, named_textures, named_mediums))
+    return false;
+
+  // load ply meshes in parallel, once for each file
+  auto ply_shapes = std::vector<pbrt::shape*>{};
+  auto ply_copies = std::vector<std::pair<pbrt::shape*, pbrt::shape*>>{};
+  auto ply_map    = std::unordered_map<std::string, pbrt::shape*>{};
+  for (auto shape : pbrt->shapes) {
+    if (shape->filename_.empty()) continue;
+    auto [it, inserted] = ply_map.insert({shape->filename_, shape});
+    if (inserted) {
+      ply_shapes.push_back(shape);
+    } else {
+      ply_copies.push_back({shape, it->second});
+    }
+  }
+  auto ply_errors = std::vector<std::string>(ply_shapes.size());
+  auto ply_failed = std::vector<int>(ply_shapes.size(), 0);
+  common::parallel_for((int)ply_shapes.size(), [&](int idx) {
+    auto shape = ply_shapes[idx];
+    auto ply   = std::make_unique<ply::model>();
+    if (!load_ply(dirname + shape->filename_, ply.get(), ply_errors[idx])) {
+      ply_failed[idx] = 1;
+      return;
+    }
+    get_positions(ply.get(), shape->positions);
+    get_normals(ply.get(), shape->normals);
+    get_texcoords(ply.get(), shape->texcoords);
+    get_triangles(ply.get(), shape->triangles);
+  });
+  for (auto idx = (size_t)0; idx < ply_shapes.size(); idx++) {
+    if (!ply_failed[idx]) continue;
+    error = filename + ": error in " + ply_errors[idx];
     return false;
+  }
+  for (auto [shape, loaded] : ply_copies) {
+    shape->positions = loaded->positions;
+    shape->normals   = loaded->normals;
+    shape->texcoords = loaded->texcoords;
+    shape->triangles = loaded->triangles;
+  }
 
   // remove unused materials
   auto used_materials = std::unordered_set<pbrt::material*>{};
@@ -2239,22 +2457,25 @@ inline pbrt::light* add_light(pbrt::model* pbrt) {
   return true;
 }
 
-inline void format_value(std::string& str, const value& value) {
+inline const std::string& get_type_label(value::type_t type) {
   static auto type_labels = std::unordered_map<value::type_t, std::string>{
       {value::type_t::real, "float"},
       {value::type_t::integer, "integer"},
       {value::type_t::boolean, "bool"},
-      {value::type_t::string, "std::string"},
+      {value::type_t::string, "string"},
       {value::type_t::point, "point"},
       {value::type_t::normal, "normal"},
-      {value::type_t::vector, "std::vector"},
+      {value::type_t::vector, "vector"},
       {value::type_t::texture, "texture"},
       {value::type_t::color, "rgb"},
       {value::type_t::point2, "point2"},
       {value::type_t::vector2, "vector2"},
       {value::type_t::spectrum, "spectrum"},
   };
+  return type_labels.at(type);
+}
 
+inline void format_value(std::string& str, const value& value) {
   auto format_vector = [](std::string& str, auto& values) {
     str += "[ ";
     for (auto& value : values) {
@@ -2264,7 +2485,7 @@ inline void format_value(std::string& str, const value& value) {
     str += " ]";
   };
 
-  format_values(str, "\"{} {}\" ", type_labels.at(value.type), value.name);
+  format_values(str, "\"{} {}\" ", get_type_label(value.type), value.name);
   switch (value.type) {
     case value::type_t::real:
       if (!value.vector1f.empty()) {
@@ -2274,7 +2495,7 @@ inline void format_value(std::string& str, const value& value) {
       }
       break;
     case value::type_t::integer:
-      if (!value.vector1f.empty()) {
+      if (!value.vector1i.empty()) {
         format_vector(str, value.vector1i);
       } else {
         format_value(str, value.value1i);
@@ -2316,8 +2537,44 @@ inline void format_value(std::string& str, const std::vector<value>& values) {
   }
 }
 
+// Write values to file, formatting large arrays in parallel chunks
+[[nodiscard]] inline bool format_value(
+    FILE* fs, const std::vector<value>& values) {
+  auto format_vector = [fs](const value& value, auto& vector) {
+    if (!format_values(fs, " \"{} {}\" [ ", get_type_label(value.type),
+            value.name))
+      return false;
+    if (!ply::format_chunks(fs, vector.size(),
+            [&vector](std::string& str, size_t start, size_t end) {
+              for (auto idx = start; idx < end; idx++) {
+                str += " ";
+                format_value(str, vector[idx]);
+              }
+            }))
+      return false;
+    return format_values(fs, " ]");
+  };
+  for (auto& value : values) {
+    if (!value.vector1f.empty()) {
+      if (!format_vector(value, value.vector1f)) return false;
+    } else if (!value.vector1i.empty()) {
+      if (!format_vector(value, value.vector1i)) return false;
+    } else if (!value.vector2f.empty()) {
+      if (!format_vector(value, value.vector2f)) return false;
+    } else if (!value.vector3f.empty()) {
+      if (!format_vector(value, value.vector3f)) return false;
+    } else {
+      auto str = " "s;
+      format_value(str, value);
+      if (fputs(str.c_str(), fs) < 0) return false;
+    }
+  }
+  return true;
+}
+
 [[nodiscard]] inline bool save_pbrt(const std::string& filename,
-    pbrt::model* pbrt, std::string& error, bool ply_meshes) {
+    pbrt::model* pbrt, std::string& error, bool ply_meshes,
+    size_t ply_vertices) {
   // error helpers
   auto open_error = [filename, &error]() {
     error = filename + ": file not found";
@@ -2411,6 +2668,20 @@ inline void format_value(std::string& str, const std::vector<value>& values) {
     return (1 + sqrt(reflectivity)) / (1 - sqrt(reflectivity));
   };
 
+  // declare image textures, named after the files materials refer to
+  auto texture_names = std::unordered_set<std::string>{};
+  auto save_texture  = [&](const std::string& path, const std::string& type) {
+    if (path.empty() || !texture_names.insert(type + " " + path).second)
+      return true;
+    return format_values(fs,
+        "Texture \"{}\" \"{}\" \"imagemap\" \"string filename\" \"{}\"\n",
+        path, type, path);
+  };
+  for (auto material : pbrt->materials) {
+    if (!save_texture(material->color_tex, "spectrum")) return write_error();
+    if (!save_texture(material->opacity_tex, "float")) return write_error();
+  }
+
   for (auto material : pbrt->materials) {
     auto command = pbrt::command{};
     if (material->specular != 0 && material->transmission != 0 &&
@@ -2457,16 +2728,49 @@ inline void format_value(std::string& str, const std::vector<value>& values) {
       }
     }
     if (!format_values(fs,
-            "MakeNamedMaterial \"{}\" \"std::string type\" \"{}\" {}\n",
+            "MakeNamedMaterial \"{}\" \"string type\" \"{}\" {}\n",
             material->name, command.type, command.values))
       return write_error();
   }
 
+  // shapes referenced as ply files
+  auto is_plymesh = [ply_meshes, ply_vertices](const pbrt::shape* shape) {
+    if (shape->filename_.empty()) return false;
+    return shape->positions.empty() ||
+           (ply_meshes && shape->positions.size() >= ply_vertices);
+  };
+
+  // save ply meshes in parallel, once for each file
+  auto ply_shapes = std::vector<pbrt::shape*>{};
+  auto ply_names  = std::unordered_set<std::string>{};
+  for (auto shape : pbrt->shapes) {
+    if (!is_plymesh(shape) || shape->positions.empty()) continue;
+    if (ply_names.insert(shape->filename_).second) ply_shapes.push_back(shape);
+  }
+  auto dirname    = sfs::path(filename).parent_path();
+  auto ply_errors = std::vector<std::string>(ply_shapes.size());
+  auto ply_failed = std::vector<int>(ply_shapes.size(), 0);
+  common::parallel_for((int)ply_shapes.size(), [&](int idx) {
+    auto shape = ply_shapes[idx];
+    auto ply   = std::make_unique<ply::model>();
+    add_positions(ply.get(), shape->positions);
+    add_normals(ply.get(), shape->normals);
+    add_texcoords(ply.get(), shape->texcoords);
+    add_triangles(ply.get(), shape->triangles);
+    if (!save_ply(dirname / shape->filename_, ply.get(), ply_errors[idx]))
+      ply_failed[idx] = 1;
+  });
+  for (auto idx = (size_t)0; idx < ply_shapes.size(); idx++) {
+    if (!ply_failed[idx]) continue;
+    error = ply_errors[idx];
+    return dependent_error();
+  }
+
   auto object_id = 0;
   for (auto shape : pbrt->shapes) {
     auto command  = pbrt::command{};
     command.frame = shape->frame;
-    if (ply_meshes) {
+    if (is_plymesh(shape)) {
       command.type = "plymesh";
       command.values.push_back(make_value("filename", shape->filename_));
     } else {
@@ -2476,21 +2780,10 @@ inline void format_value(std::string& str, const std::vector<value>& values) {
           make_value("P", shape->positions, value::type_t::point));
       if (!shape->normals.empty())
         command.values.push_back(
-            make_value("N", shape->triangles, value::type_t::normal));
+            make_value("N", shape->normals, value::type_t::normal));
       if (!shape->texcoords.empty())
         command.values.push_back(make_value("uv", shape->texcoords));
     }
-    if (ply_meshes) {
-      auto ply_guard = std::make_unique<ply::model>();
-      auto ply       = ply_guard.get();
-      add_positions(ply, shape->positions);
-      add_normals(ply, shape->normals);
-      add_texcoords(ply, shape->texcoords);
-      add_triangles(ply, shape->triangles);
-      if (!save_ply(
-              sfs::path(filename).parent_path() / shape->filename_, ply, error))
-        return dependent_error();
-    }
     auto object = "object" + std::to_string(object_id++);
     if (!shape->instances.empty())
       if (!format_values(fs, "ObjectBegin \"{}\"\n", object))
@@ -2508,8 +2801,9 @@ inline void format_value(std::string& str, const std::vector<value>& values) {
     }
     if (!format_values(fs, "NamedMaterial \"{}\"\n", shape->material->name))
       return write_error();
-    if (!format_values(fs, "Shape \"{}\" {}\n", command.type, command.values))
-      return write_error();
+    if (!format_values(fs, "Shape \"{}\" ", command.type)) return write_error();
+    if (!format_value(fs, command.values)) return write_error();
+    if (!format_values(fs, "\n")) return write_error();
     if (!format_values(fs, "AttributeEnd\n")) return write_error();
     if (!shape->instances.empty())
       if (!format_values(fs, "ObjectEnd\n")) return write_error();
@@ -36,8 +36,10 @@
 // -----------------------------------------------------------------------------
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 
+#include "yocto_common.h"
 #include "yocto_math.h"
 
 // -----------------------------------------------------------------------------
@@ -119,6 +121,31 @@ inline bool load_ply(
 inline bool save_ply(
     const std::string& filename, ply::model* ply, std::string& error);
 
+// Load and save ply in batches of at most batch_size rows per element, to
+// bound memory for large point clouds. On load, the callback is called with
+// each batch stored in the element properties, that are cleared after use.
+// On save, elements counts and properties are taken from the model, and the
+// callback fills the properties with the batch values before they are
+// written.
+inline bool load_ply(const std::string& filename, ply::model* ply,
+    std::string& error, size_t batch_size,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback);
+inline bool save_ply(const std::string& filename, ply::model* ply,
+    std::string& error, size_t batch_size,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback);
+
+// Copy a ply to another file in batches of at most batch_size rows per
+// element, to process large files with bounded memory. The callback is
+// called with each batch loaded in the element properties, and may change
+// their values before they are saved. Elements and properties are kept,
+// while the output is saved as ascii or binary as requested.
+inline bool stream_ply(const std::string& filename, const std::string& outname,
+    std::string& error, size_t batch_size, bool ascii,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback);
+
 // Get ply properties
 inline bool has_property(
     ply::model* ply, const std::string& element, const std::string& property);
@@ -214,7 +241,10 @@ inline bool add_points(ply::model* ply, const std::vector<int>& values);
 //
 // -----------------------------------------------------------------------------
 
+#include <charconv>
+#include <climits>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <string_view>
 
@@ -351,55 +381,43 @@ inline void skip_whitespace(std::string_view& str) {
 inline void format_value(std::string& str, const std::string& value) {
   str += value;
 }
+// Numbers are written with the shortest representation that reads back to
+// the same value
+template <typename T>
+inline void format_number(std::string& str, T value) {
+  char buf[64];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  str.append(buf, end);
+}
 inline void format_value(std::string& str, int8_t value) {
-  char buf[256];
-  sprintf(buf, "%d", (int)value);
-  str += buf;
+  format_number(str, (int)value);
 }
 inline void format_value(std::string& str, int16_t value) {
-  char buf[256];
-  sprintf(buf, "%d", (int)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, int32_t value) {
-  char buf[256];
-  sprintf(buf, "%d", (int)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, int64_t value) {
-  char buf[256];
-  sprintf(buf, "%lld", (long long)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, uint8_t value) {
-  char buf[256];
-  sprintf(buf, "%u", (unsigned)value);
-  str += buf;
+  format_number(str, (unsigned)value);
 }
 inline void format_value(std::string& str, uint16_t value) {
-  char buf[256];
-  sprintf(buf, "%u", (unsigned)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, uint32_t value) {
-  char buf[256];
-  sprintf(buf, "%u", (unsigned)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, uint64_t value) {
-  char buf[256];
-  sprintf(buf, "%llu", (unsigned long long)value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, float value) {
-  char buf[256];
-  sprintf(buf, "%g", value);
-  str += buf;
+  format_number(str, value);
 }
 inline void format_value(std::string& str, double value) {
-  char buf[256];
-  sprintf(buf, "%g", value);
-  str += buf;
+  format_number(str, value);
 }
 
 // Foramt to file
@@ -436,6 +454,35 @@ template <typename T>
   return true;
 }
 
+// Size of the chunks of rows formatted in parallel
+const auto format_chunk_size = (size_t)65536;
+
+// Format count items in chunks on the global thread pool, and write them in
+// order with one large write per chunk. `func(str, start, end)` appends the
+// items in [start, end) to str. Shared by the obj and pbrt writers.
+template <typename Func>
+[[nodiscard]] inline bool format_chunks(FILE* fs, size_t count, Func&& func) {
+  auto nthreads = (size_t)common::get_num_threads();
+  auto chunks   = std::vector<std::string>(nthreads);
+  for (auto start = (size_t)0; start < count;
+       start += format_chunk_size * nthreads) {
+    auto num    = std::min(
+        nthreads, (count - start + format_chunk_size - 1) / format_chunk_size);
+    auto format = [&](int idx) {
+      auto begin = start + idx * format_chunk_size;
+      chunks[idx].clear();
+      func(chunks[idx], begin, std::min(begin + format_chunk_size, count));
+    };
+    common::parallel_for((int)num, format);
+    for (auto idx = (size_t)0; idx < num; idx++) {
+      auto& chunk = chunks[idx];
+      if (fwrite(chunk.data(), 1, chunk.size(), fs) != chunk.size())
+        return false;
+    }
+  }
+  return true;
+}
+
 template <typename T>
 inline T swap_endian(T value) {
   // https://stackoverflow.com/questions/105252/how-do-i-convert-between-big-endian-and-little-endian-values-in-c
@@ -465,6 +512,121 @@ template <typename T>
   return true;
 }
 
+// Size in bytes of a property value
+inline size_t get_value_size(property::type_t type) {
+  switch (type) {
+    case property::type_t::i8: return 1;
+    case property::type_t::i16: return 2;
+    case property::type_t::i32: return 4;
+    case property::type_t::i64: return 8;
+    case property::type_t::u8: return 1;
+    case property::type_t::u16: return 2;
+    case property::type_t::u32: return 4;
+    case property::type_t::u64: return 8;
+    case property::type_t::f32: return 4;
+    case property::type_t::f64: return 8;
+  }
+  return 0;
+}
+
+// Append count values to the property data and return their bytes
+inline byte* append_data(ply::property* prop, size_t count) {
+  switch (prop->type) {
+    case property::type_t::i8:
+      prop->data_i8.resize(prop->data_i8.size() + count);
+      return (byte*)(prop->data_i8.data() + prop->data_i8.size() - count);
+    case property::type_t::i16:
+      prop->data_i16.resize(prop->data_i16.size() + count);
+      return (byte*)(prop->data_i16.data() + prop->data_i16.size() - count);
+    case property::type_t::i32:
+      prop->data_i32.resize(prop->data_i32.size() + count);
+      return (byte*)(prop->data_i32.data() + prop->data_i32.size() - count);
+    case property::type_t::i64:
+      prop->data_i64.resize(prop->data_i64.size() + count);
+      return (byte*)(prop->data_i64.data() + prop->data_i64.size() - count);
+    case property::type_t::u8:
+      prop->data_u8.resize(prop->data_u8.size() + count);
+      return (byte*)(prop->data_u8.data() + prop->data_u8.size() - count);
+    case property::type_t::u16:
+      prop->data_u16.resize(prop->data_u16.size() + count);
+      return (byte*)(prop->data_u16.data() + prop->data_u16.size() - count);
+    case property::type_t::u32:
+      prop->data_u32.resize(prop->data_u32.size() + count);
+      return (byte*)(prop->data_u32.data() + prop->data_u32.size() - count);
+    case property::type_t::u64:
+      prop->data_u64.resize(prop->data_u64.size() + count);
+      return (byte*)(prop->data_u64.data() + prop->data_u64.size() - count);
+    case property::type_t::f32:
+      prop->data_f32.resize(prop->data_f32.size() + count);
+      return (byte*)(prop->data_f32.data() + prop->data_f32.size() - count);
+    case property::type_t::f64:
+      prop->data_f64.resize(prop->data_f64.size() + count);
+      return (byte*)(prop->data_f64.data() + prop->data_f64.size() - count);
+  }
+  return nullptr;
+}
+
+// Copy count values of N bytes from rows of the given stride
+template <size_t N>
+inline void copy_strided(byte* dst, const byte* src, size_t stride,
+    size_t count, bool big_endian) {
+  for (auto idx = (size_t)0; idx < count; idx++, dst += N, src += stride) {
+    memcpy(dst, src, N);
+    if (big_endian) std::reverse(dst, dst + N);
+  }
+}
+
+// Clear the values of all element properties
+inline void clear_values(ply::element* elem) {
+  for (auto prop : elem->properties) {
+    prop->data_i8.clear();
+    prop->data_i16.clear();
+    prop->data_i32.clear();
+    prop->data_i64.clear();
+    prop->data_u8.clear();
+    prop->data_u16.clear();
+    prop->data_u32.clear();
+    prop->data_u64.clear();
+    prop->data_f32.clear();
+    prop->data_f64.clear();
+    prop->ldata_u8.clear();
+  }
+}
+
+// Read count rows of an element made only of fixed size properties. Rows
+// are read in blocks and each property is decoded with a strided copy.
+[[nodiscard]] inline bool read_fixed_element(
+    FILE* fs, ply::element* elem, size_t count, bool big_endian) {
+  if (elem->properties.empty() || !count) return true;
+  auto stride  = (size_t)0;
+  auto offsets = std::vector<size_t>{};
+  auto datas   = std::vector<byte*>{};
+  for (auto prop : elem->properties) {
+    offsets.push_back(stride);
+    datas.push_back(append_data(prop, count));
+    stride += get_value_size(prop->type);
+  }
+  auto block_rows = std::max((size_t)1, ((size_t)1 << 24) / stride);
+  auto block      = std::vector<byte>{};
+  for (auto start = (size_t)0; start < count; start += block_rows) {
+    auto rows = std::min(block_rows, count - start);
+    block.resize(rows * stride);
+    if (fread(block.data(), stride, rows, fs) != rows) return false;
+    for (auto pidx = (size_t)0; pidx < elem->properties.size(); pidx++) {
+      auto size = get_value_size(elem->properties[pidx]->type);
+      auto dst  = datas[pidx] + start * size;
+      auto src  = block.data() + offsets[pidx];
+      switch (size) {
+        case 1: copy_strided<1>(dst, src, stride, rows, false); break;
+        case 2: copy_strided<2>(dst, src, stride, rows, big_endian); break;
+        case 4: copy_strided<4>(dst, src, stride, rows, big_endian); break;
+        case 8: copy_strided<8>(dst, src, stride, rows, big_endian); break;
+      }
+    }
+  }
+  return true;
+}
+
 inline void remove_comment(std::string_view& str, char comment_char = '#') {
   while (!str.empty() && is_newline(str.back())) str.remove_suffix(1);
   auto cpy = str;
@@ -487,8 +649,8 @@ inline ply::property* add_property(ply::element* element) {
   return element->properties.emplace_back(new property{});
 }
 
-// Load ply
-inline bool load_ply(
+// Load the ply header, leaving the file at the start of the element data
+[[nodiscard]] inline bool load_ply_header(FILE* fs,
     const std::string& filename, ply::model* ply, std::string& error) {
   // ply type names
   static auto type_map = std::unordered_map<std::string, property::type_t>{
@@ -508,23 +670,10 @@ inline bool load_ply(
   ply->elements.clear();
 
   // error helpers
-  auto open_error = [filename, &error]() {
-    error = filename + ": file not found";
-    return false;
-  };
   auto parse_error = [filename, &error]() {
     error = filename + ": parse error";
     return false;
   };
-  auto read_error = [filename, &error]() {
-    error = filename + ": read error";
-    return false;
-  };
-
-  // open file
-  auto fs = fopen(filename.c_str(), "rb");
-  if (!fs) return open_error();
-  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
 
   // parsing checks
   auto first_line = true;
@@ -606,90 +755,89 @@ inline bool load_ply(
   // check exit
   if (!end_header) return parse_error();
 
-  // allocate data ---------------------------------
-  for (auto element : ply->elements) {
-    for (auto property : element->properties) {
-      auto count = property->is_list ? element->count * 3 : element->count;
-      switch (property->type) {
-        case property::type_t::i8: property->data_i8.reserve(count); break;
-        case property::type_t::i16: property->data_i16.reserve(count); break;
-        case property::type_t::i32: property->data_i32.reserve(count); break;
-        case property::type_t::i64: property->data_i64.reserve(count); break;
-        case property::type_t::u8: property->data_u8.reserve(count); break;
-        case property::type_t::u16: property->data_u16.reserve(count); break;
-        case property::type_t::u32: property->data_u32.reserve(count); break;
-        case property::type_t::u64: property->data_u64.reserve(count); break;
-        case property::type_t::f32: property->data_f32.reserve(count); break;
-        case property::type_t::f64: property->data_f64.reserve(count); break;
-      }
-      if (property->is_list) property->ldata_u8.reserve(element->count);
-    }
-  }
+  return true;
+}
+
+// Load count rows of an element, appending them to its properties
+[[nodiscard]] inline bool load_ply_values(FILE* fs,
+    const std::string& filename, ply::model* ply, ply::element* elem,
+    size_t count, std::string& error) {
+  // error helpers
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
 
-  // read data -------------------------------------
   if (ply->format == model::format_t::ascii) {
     char buffer[4096];
-    for (auto elem : ply->elements) {
-      for (auto idx = 0; idx < elem->count; idx++) {
-        if (!fgets(buffer, sizeof(buffer), fs)) return read_error();
-        auto str = std::string_view{buffer};
-        for (auto prop : elem->properties) {
-          if (prop->is_list) {
-            if (!parse_value(str, prop->ldata_u8.emplace_back()))
-              return parse_error();
-          }
-          auto vcount = prop->is_list ? prop->ldata_u8.back() : 1;
-          for (auto i = 0; i < vcount; i++) {
-            switch (prop->type) {
-              case property::type_t::i8:
-                if (!parse_value(str, prop->data_i8.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::i16:
-                if (!parse_value(str, prop->data_i16.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::i32:
-                if (!parse_value(str, prop->data_i32.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::i64:
-                if (!parse_value(str, prop->data_i64.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::u8:
-                if (!parse_value(str, prop->data_u8.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::u16:
-                if (!parse_value(str, prop->data_u16.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::u32:
-                if (!parse_value(str, prop->data_u32.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::u64:
-                if (!parse_value(str, prop->data_u64.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::f32:
-                if (!parse_value(str, prop->data_f32.emplace_back()))
-                  return parse_error();
-                break;
-              case property::type_t::f64:
-                if (!parse_value(str, prop->data_f64.emplace_back()))
-                  return parse_error();
-                break;
-            }
+    for (auto idx = (size_t)0; idx < count; idx++) {
+      if (!fgets(buffer, sizeof(buffer), fs)) return read_error();
+      auto str = std::string_view{buffer};
+      for (auto prop : elem->properties) {
+        if (prop->is_list) {
+          if (!parse_value(str, prop->ldata_u8.emplace_back()))
+            return parse_error();
+        }
+        auto vcount = prop->is_list ? prop->ldata_u8.back() : 1;
+        for (auto i = 0; i < vcount; i++) {
+          switch (prop->type) {
+            case property::type_t::i8:
+              if (!parse_value(str, prop->data_i8.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::i16:
+              if (!parse_value(str, prop->data_i16.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::i32:
+              if (!parse_value(str, prop->data_i32.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::i64:
+              if (!parse_value(str, prop->data_i64.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::u8:
+              if (!parse_value(str, prop->data_u8.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::u16:
+              if (!parse_value(str, prop->data_u16.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::u32:
+              if (!parse_value(str, prop->data_u32.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::u64:
+              if (!parse_value(str, prop->data_u64.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::f32:
+              if (!parse_value(str, prop->data_f32.emplace_back()))
+                return parse_error();
+              break;
+            case property::type_t::f64:
+              if (!parse_value(str, prop->data_f64.emplace_back()))
+                return parse_error();
+              break;
           }
         }
       }
     }
   } else {
     auto big_endian = ply->format == model::format_t::binary_big_endian;
-    for (auto elem : ply->elements) {
-      for (auto idx = 0; idx < elem->count; idx++) {
+    // read elements without lists in bulk
+    if (std::none_of(elem->properties.begin(), elem->properties.end(),
+            [](ply::property* prop) { return prop->is_list; })) {
+      if (!read_fixed_element(fs, elem, count, big_endian))
+        return read_error();
+    } else {
+      for (auto idx = (size_t)0; idx < count; idx++) {
         for (auto prop : elem->properties) {
           if (prop->is_list) {
             if (!read_value(fs, prop->ldata_u8.emplace_back(), big_endian))
@@ -747,8 +895,87 @@ inline bool load_ply(
   return true;
 }
 
-// Save ply
-inline bool save_ply(
+// Load ply
+inline bool load_ply(
+    const std::string& filename, ply::model* ply, std::string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+
+  // open file
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // read header
+  if (!load_ply_header(fs, filename, ply, error)) return false;
+
+  // allocate data
+  for (auto element : ply->elements) {
+    for (auto property : element->properties) {
+      auto count = property->is_list ? element->count * 3 : element->count;
+      switch (property->type) {
+        case property::type_t::i8: property->data_i8.reserve(count); break;
+        case property::type_t::i16: property->data_i16.reserve(count); break;
+        case property::type_t::i32: property->data_i32.reserve(count); break;
+        case property::type_t::i64: property->data_i64.reserve(count); break;
+        case property::type_t::u8: property->data_u8.reserve(count); break;
+        case property::type_t::u16: property->data_u16.reserve(count); break;
+        case property::type_t::u32: property->data_u32.reserve(count); break;
+        case property::type_t::u64: property->data_u64.reserve(count); break;
+        case property::type_t::f32: property->data_f32.reserve(count); break;
+        case property::type_t::f64: property->data_f64.reserve(count); break;
+      }
+      if (property->is_list) property->ldata_u8.reserve(element->count);
+    }
+  }
+
+  // read data
+  for (auto elem : ply->elements) {
+    if (!load_ply_values(fs, filename, ply, elem, elem->count, error))
+      return false;
+  }
+  return true;
+}
+
+// Load ply in batches
+inline bool load_ply(const std::string& filename, ply::model* ply,
+    std::string& error, size_t batch_size,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+
+  // open file
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // read header
+  if (!load_ply_header(fs, filename, ply, error)) return false;
+
+  // read data in batches, replacing the previous one
+  batch_size = std::max(batch_size, (size_t)1);
+  for (auto elem : ply->elements) {
+    for (auto start = (size_t)0; start < elem->count; start += batch_size) {
+      auto count = std::min(batch_size, elem->count - start);
+      clear_values(elem);
+      if (!load_ply_values(fs, filename, ply, elem, count, error))
+        return false;
+      callback(elem, start, count);
+    }
+    clear_values(elem);
+  }
+  return true;
+}
+
+// Save the ply header, with element counts and property types
+[[nodiscard]] inline bool save_ply_header(FILE* fs,
     const std::string& filename, ply::model* ply, std::string& error) {
   // ply type names
   static auto type_map = std::unordered_map<property::type_t, std::string>{
@@ -763,20 +990,11 @@ inline bool save_ply(
       {model::format_t::binary_big_endian, "binary_big_endian"}};
 
   // error helpers
-  auto open_error = [filename, &error]() {
-    error = filename + ": file not found";
-    return false;
-  };
   auto write_error = [filename, &error]() {
     error = filename + ": write error";
     return false;
   };
 
-  // open file
-  auto fs = fopen(filename.c_str(), "wb");
-  if (!fs) return open_error();
-  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
-
   // header
   if (!format_values(fs, "ply\n")) return write_error();
   if (!format_values(fs, "format {} 1.0\n", format_map.at(ply->format)))
@@ -804,120 +1022,135 @@ inline bool save_ply(
   }
 
   if (!format_values(fs, "end_header\n")) return write_error();
+  return true;
+}
+
+// Save count rows of an element from its properties
+[[nodiscard]] inline bool save_ply_values(FILE* fs,
+    const std::string& filename, ply::model* ply, ply::element* elem,
+    size_t count, std::string& error) {
+  // error helpers
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
 
-  // properties
   if (ply->format == model::format_t::ascii) {
-    for (auto elem : ply->elements) {
-      auto cur = std::vector<size_t>(elem->properties.size(), 0);
-      for (auto idx = 0; idx < elem->count; idx++) {
+    // value offsets of the properties at the start of each chunk
+    auto num_chunks = (count + format_chunk_size - 1) / format_chunk_size;
+    auto offsets    = std::vector<std::vector<size_t>>(num_chunks);
+    auto cur        = std::vector<size_t>(elem->properties.size(), 0);
+    for (auto idx = (size_t)0; idx < count; idx++) {
+      if (idx % format_chunk_size == 0)
+        offsets[idx / format_chunk_size] = cur;
+      for (auto pidx = 0; pidx < elem->properties.size(); pidx++) {
+        auto prop = elem->properties[pidx];
+        cur[pidx] += prop->is_list ? prop->ldata_u8[idx] : 1;
+      }
+    }
+    auto format_rows = [&](std::string& str, size_t start, size_t end) {
+      auto cur = offsets[start / format_chunk_size];
+      for (auto idx = start; idx < end; idx++) {
         for (auto pidx = 0; pidx < elem->properties.size(); pidx++) {
           auto prop = elem->properties[pidx];
-          if (prop->is_list)
-            if (!format_values(fs, "{} ", (int)prop->ldata_u8[idx]))
-              return write_error();
+          if (prop->is_list) {
+            format_value(str, (int)prop->ldata_u8[idx]);
+            str += ' ';
+          }
           auto vcount = prop->is_list ? prop->ldata_u8[idx] : 1;
           for (auto i = 0; i < vcount; i++) {
+            auto vidx = cur[pidx]++;
             switch (prop->type) {
               case property::type_t::i8:
-                if (!format_values(fs, "{} ", prop->data_i8[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_i8[vidx]);
                 break;
               case property::type_t::i16:
-                if (!format_values(fs, "{} ", prop->data_i16[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_i16[vidx]);
                 break;
               case property::type_t::i32:
-                if (!format_values(fs, "{} ", prop->data_i32[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_i32[vidx]);
                 break;
               case property::type_t::i64:
-                if (!format_values(fs, "{} ", prop->data_i64[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_i64[vidx]);
                 break;
               case property::type_t::u8:
-                if (!format_values(fs, "{} ", prop->data_u8[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_u8[vidx]);
                 break;
               case property::type_t::u16:
-                if (!format_values(fs, "{} ", prop->data_u16[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_u16[vidx]);
                 break;
               case property::type_t::u32:
-                if (!format_values(fs, "{} ", prop->data_u32[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_u32[vidx]);
                 break;
               case property::type_t::u64:
-                if (!format_values(fs, "{} ", prop->data_u64[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_u64[vidx]);
                 break;
               case property::type_t::f32:
-                if (!format_values(fs, "{} ", prop->data_f32[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_f32[vidx]);
                 break;
               case property::type_t::f64:
-                if (!format_values(fs, "{} ", prop->data_f64[cur[idx]++]))
-                  return write_error();
+                format_value(str, prop->data_f64[vidx]);
                 break;
             }
+            str += ' ';
           }
-          if (!format_values(fs, "\n")) return write_error();
         }
+        str += '\n';
       }
-    }
+    };
+    if (!format_chunks(fs, count, format_rows)) return write_error();
   } else {
     auto big_endian = ply->format == model::format_t::binary_big_endian;
-    for (auto elem : ply->elements) {
-      auto cur = std::vector<size_t>(elem->properties.size(), 0);
-      for (auto idx = 0; idx < elem->count; idx++) {
-        for (auto pidx = 0; pidx < elem->properties.size(); pidx++) {
-          auto prop = elem->properties[pidx];
-          if (prop->is_list)
-            if (!write_value(fs, prop->ldata_u8[idx], big_endian))
-              return write_error();
-          auto vcount = prop->is_list ? prop->ldata_u8[idx] : 1;
-          for (auto i = 0; i < vcount; i++) {
-            switch (prop->type) {
-              case property::type_t::i8:
-                if (!write_value(fs, prop->data_i8[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::i16:
-                if (!write_value(fs, prop->data_i16[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::i32:
-                if (!write_value(fs, prop->data_i32[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::i64:
-                if (!write_value(fs, prop->data_i64[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::u8:
-                if (!write_value(fs, prop->data_u8[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::u16:
-                if (!write_value(fs, prop->data_u16[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::u32:
-                if (!write_value(fs, prop->data_u32[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::u64:
-                if (!write_value(fs, prop->data_u64[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::f32:
-                if (!write_value(fs, prop->data_f32[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-              case property::type_t::f64:
-                if (!write_value(fs, prop->data_f64[cur[pidx]++], big_endian))
-                  return write_error();
-                break;
-            }
+    auto cur = std::vector<size_t>(elem->properties.size(), 0);
+    for (auto idx = (size_t)0; idx < count; idx++) {
+      for (auto pidx = 0; pidx < elem->properties.size(); pidx++) {
+        auto prop = elem->properties[pidx];
+        if (prop->is_list)
+          if (!write_value(fs, prop->ldata_u8[idx], big_endian))
+            return write_error();
+        auto vcount = prop->is_list ? prop->ldata_u8[idx] : 1;
+        for (auto i = 0; i < vcount; i++) {
+          switch (prop->type) {
+            case property::type_t::i8:
+              if (!write_value(fs, prop->data_i8[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::i16:
+              if (!write_value(fs, prop->data_i16[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::i32:
+              if (!write_value(fs, prop->data_i32[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::i64:
+              if (!write_value(fs, prop->data_i64[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::u8:
+              if (!write_value(fs, prop->data_u8[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::u16:
+              if (!write_value(fs, prop->data_u16[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::u32:
+              if (!write_value(fs, prop->data_u32[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::u64:
+              if (!write_value(fs, prop->data_u64[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::f32:
+              if (!write_value(fs, prop->data_f32[cur[pidx]++], big_endian))
+                return write_error();
+              break;
+            case property::type_t::f64:
+              if (!write_value(fs, prop->data_f64[cur[pidx]++], big_endian))
+                return write_error();
+              break;
           }
         }
       }
@@ -927,6 +1160,113 @@ inline bool save_ply(
   return true;
 }
 
+// Save ply
+inline bool save_ply(
+    const std::string& filename, ply::model* ply, std::string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+
+  // open file
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // header
+  if (!save_ply_header(fs, filename, ply, error)) return false;
+
+  // properties
+  for (auto elem : ply->elements) {
+    if (!save_ply_values(fs, filename, ply, elem, elem->count, error))
+      return false;
+  }
+  return true;
+}
+
+// Save ply in batches
+inline bool save_ply(const std::string& filename, ply::model* ply,
+    std::string& error, size_t batch_size,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+
+  // open file
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+
+  // header
+  if (!save_ply_header(fs, filename, ply, error)) return false;
+
+  // properties in batches, filled by the callback
+  batch_size = std::max(batch_size, (size_t)1);
+  for (auto elem : ply->elements) {
+    for (auto start = (size_t)0; start < elem->count; start += batch_size) {
+      auto count = std::min(batch_size, elem->count - start);
+      clear_values(elem);
+      callback(elem, start, count);
+      if (!save_ply_values(fs, filename, ply, elem, count, error))
+        return false;
+    }
+    clear_values(elem);
+  }
+  return true;
+}
+
+// Copy ply in batches
+inline bool stream_ply(const std::string& filename, const std::string& outname,
+    std::string& error, size_t batch_size, bool ascii,
+    const std::function<void(ply::element* element, size_t start,
+        size_t count)>& callback) {
+  // error helpers
+  auto open_error = [&error](const std::string& filename) {
+    error = filename + ": file not found";
+    return false;
+  };
+
+  // open files
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error(filename);
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto ofs      = fopen(outname.c_str(), "wb");
+  if (!ofs) return open_error(outname);
+  auto ofs_guard = std::unique_ptr<FILE, decltype(&fclose)>{ofs, fclose};
+
+  // headers, switching the model format when reading or writing values
+  auto ply_guard = std::make_unique<ply::model>();
+  auto ply       = ply_guard.get();
+  if (!load_ply_header(fs, filename, ply, error)) return false;
+  auto input_format  = ply->format;
+  auto output_format = ascii ? model::format_t::ascii
+                             : model::format_t::binary_little_endian;
+  ply->format        = output_format;
+  if (!save_ply_header(ofs, outname, ply, error)) return false;
+
+  // properties in batches
+  batch_size = std::max(batch_size, (size_t)1);
+  for (auto elem : ply->elements) {
+    for (auto start = (size_t)0; start < elem->count; start += batch_size) {
+      auto count = std::min(batch_size, elem->count - start);
+      clear_values(elem);
+      ply->format = input_format;
+      if (!load_ply_values(fs, filename, ply, elem, count, error))
+        return false;
+      callback(elem, start, count);
+      ply->format = output_format;
+      if (!save_ply_values(ofs, outname, ply, elem, count, error))
+        return false;
+    }
+    clear_values(elem);
+  }
+  return true;
+}
+
 // Get ply properties
 inline bool has_property(
     ply::model* ply, const std::string& element, const std::string& property) {
@@ -973,6 +1313,73 @@ inline bool convert_property(ply::property* prop, std::vector<T>& values) {
   std::runtime_error("should not have gotten here");
   return false;
 }
+// Convert property values into every stride-th value of the output,
+// reading the typed data directly
+template <typename T, typename T1>
+inline void convert_strided(
+    const std::vector<T1>& prop, T* values, size_t stride) {
+  for (auto i = (size_t)0; i < prop.size(); i++) values[i * stride] = (T)prop[i];
+}
+template <typename T>
+inline void convert_strided(ply::property* prop, T* values, size_t stride) {
+  switch (prop->type) {
+    case property::type_t::i8:
+      return convert_strided(prop->data_i8, values, stride);
+    case property::type_t::i16:
+      return convert_strided(prop->data_i16, values, stride);
+    case property::type_t::i32:
+      return convert_strided(prop->data_i32, values, stride);
+    case property::type_t::i64:
+      return convert_strided(prop->data_i64, values, stride);
+    case property::type_t::u8:
+      return convert_strided(prop->data_u8, values, stride);
+    case property::type_t::u16:
+      return convert_strided(prop->data_u16, values, stride);
+    case property::type_t::u32:
+      return convert_strided(prop->data_u32, values, stride);
+    case property::type_t::u64:
+      return convert_strided(prop->data_u64, values, stride);
+    case property::type_t::f32:
+      return convert_strided(prop->data_f32, values, stride);
+    case property::type_t::f64:
+      return convert_strided(prop->data_f64, values, stride);
+  }
+}
+inline size_t get_size(ply::property* prop) {
+  switch (prop->type) {
+    case property::type_t::i8: return prop->data_i8.size();
+    case property::type_t::i16: return prop->data_i16.size();
+    case property::type_t::i32: return prop->data_i32.size();
+    case property::type_t::i64: return prop->data_i64.size();
+    case property::type_t::u8: return prop->data_u8.size();
+    case property::type_t::u16: return prop->data_u16.size();
+    case property::type_t::u32: return prop->data_u32.size();
+    case property::type_t::u64: return prop->data_u64.size();
+    case property::type_t::f32: return prop->data_f32.size();
+    case property::type_t::f64: return prop->data_f64.size();
+  }
+  return 0;
+}
+// Gets N scalar properties interleaved into float tuples, converting the
+// typed data directly into the output
+template <typename T, size_t N>
+inline bool get_interleaved(ply::model* ply, const std::string& element,
+    const std::array<std::string, N>& properties, std::vector<T>& values) {
+  static_assert(sizeof(T) == sizeof(float) * N, "bad tuple size");
+  values.clear();
+  auto props = std::array<ply::property*, N>{};
+  for (auto idx = (size_t)0; idx < N; idx++) {
+    if (!has_property(ply, element, properties[idx])) return false;
+    props[idx] = get_property(ply, element, properties[idx]);
+    if (props[idx]->is_list) return false;
+    if (get_size(props[idx]) != get_size(props[0])) return false;
+  }
+  values.resize(get_size(props[0]));
+  for (auto idx = (size_t)0; idx < N; idx++)
+    convert_strided(props[idx], (float*)values.data() + idx, N);
+  return true;
+}
+
 inline bool get_value(ply::model* ply, const std::string& element,
     const std::string& property, std::vector<float>& values) {
   values.clear();
@@ -984,53 +1391,20 @@ inline bool get_value(ply::model* ply, const std::string& element,
 }
 inline bool get_values(ply::model* ply, const std::string& element,
     const std::array<std::string, 2>& properties, std::vector<vec2f>& values) {
-  values.clear();
-  auto x = std::vector<float>{}, y = std::vector<float>{};
-  if (!get_value(ply, element, properties[0], x)) return false;
-  if (!get_value(ply, element, properties[1], y)) return false;
-  values = std::vector<vec2f>(x.size());
-  for (auto i = (size_t)0; i < values.size(); i++) values[i] = {x[i], y[i]};
-  return true;
+  return get_interleaved(ply, element, properties, values);
 }
 inline bool get_values(ply::model* ply, const std::string& element,
     const std::array<std::string, 3>& properties, std::vector<vec3f>& values) {
-  values.clear();
-  auto x = std::vector<float>{}, y = std::vector<float>{},
-       z = std::vector<float>{};
-  if (!get_value(ply, element, properties[0], x)) return false;
-  if (!get_value(ply, element, properties[1], y)) return false;
-  if (!get_value(ply, element, properties[2], z)) return false;
-  values = std::vector<vec3f>(x.size());
-  for (auto i = (size_t)0; i < values.size(); i++)
-    values[i] = {x[i], y[i], z[i]};
-  return true;
+  return get_interleaved(ply, element, properties, values);
 }
 inline bool get_values(ply::model* ply, const std::string& element,
     const std::array<std::string, 4>& properties, std::vector<vec4f>& values) {
-  values.clear();
-  auto x = std::vector<float>{}, y = std::vector<float>{},
-       z = std::vector<float>{}, w = std::vector<float>{};
-  if (!get_value(ply, element, properties[0], x)) return false;
-  if (!get_value(ply, element, properties[1], y)) return false;
-  if (!get_value(ply, element, properties[2], z)) return false;
-  if (!get_value(ply, element, properties[3], w)) return false;
-  values = std::vector<vec4f>(x.size());
-  for (auto i = (size_t)0; i < values.size(); i++)
-    values[i] = {x[i], y[i], z[i], w[i]};
-  return true;
+  return get_interleaved(ply, element, properties, values);
 }
 inline bool get_values(ply::model* ply, const std::string& element,
     const std::array<std::string, 12>& properties,
     std::vector<frame3f>&              values) {
-  values.clear();
-  auto coords = std::array<std::vector<float>, 12>{};
-  for (auto idx = 0; idx < 12; idx++)
-    if (!get_value(ply, element, properties[idx], coords[idx])) return false;
-  values = std::vector<frame3f>(coords[0].size());
-  for (auto i = (size_t)0; i < values.size(); i++) {
-    for (auto c = 0; c < 12; c++) (&values[i].x.x)[c] = coords[c][i];
-  }
-  return true;
+  return get_interleaved(ply, element, properties, values);
 }
 inline bool get_lists(ply::model* ply, const std::string& element,
     const std::string& property, std::vector<std::vector<int>>& lists) {
@@ -1103,6 +1477,17 @@ inline bool get_faces(ply::model* ply, std::vector<std::vector<int>>& faces) {
 }
 inline bool get_triangles(ply::model* ply, std::vector<vec3i>& triangles) {
   triangles.clear();
+  // convert indices directly when all faces are triangles
+  if (!has_property(ply, "face", "vertex_indices")) return false;
+  auto prop = get_property(ply, "face", "vertex_indices");
+  if (!prop->is_list) return false;
+  if (get_size(prop) == prop->ldata_u8.size() * 3 &&
+      std::all_of(prop->ldata_u8.begin(), prop->ldata_u8.end(),
+          [](uint8_t size) { return size == 3; })) {
+    triangles.resize(prop->ldata_u8.size());
+    convert_strided(prop, (int*)triangles.data(), 1);
+    return true;
+  }
   auto indices = std::vector<int>{};
   auto sizes   = std::vector<uint8_t>{};
   if (!get_list_values(ply, "face", "vertex_indices", indices)) return false;
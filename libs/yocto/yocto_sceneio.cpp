@@ -39,6 +39,7 @@
 
 #include "yocto_sceneio.h"
 
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cctype>
@@ -47,9 +48,13 @@
 #include <deque>
 #include <future>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "ext/filesystem.hpp"
 #include "ext/json.hpp"
+#include "yocto_common.h"
 #include "yocto_image.h"
 #include "yocto_obj.h"
 #include "yocto_pbrt.h"
@@ -83,6 +88,7 @@ using math::fmod;
 using math::invalidb3f;
 using math::log;
 using math::max;
+using math::mat3f;
 using math::min;
 using math::pow;
 using math::sin;
@@ -223,9 +229,72 @@ std::vector<std::string> scene_stats(const scn::model* scene, bool verbose) {
   stats.push_back("center:       " + format3(center(bbox)));
   stats.push_back("size:         " + format3(size(bbox)));
 
+  auto memory = get_scene_memory(scene);
+  stats.push_back("shapes kb:    " + format(memory.shapes / 1024));
+  stats.push_back("subdivs kb:   " + format(memory.subdivs / 1024));
+  stats.push_back("textures kb:  " + format(memory.textures / 1024));
+  stats.push_back("instances kb: " + format(memory.instances / 1024));
+  stats.push_back("memory kb:    " + format(memory.total / 1024));
+
   return stats;
 }
 
+// Memory used by a scene
+scene_memory get_scene_memory(const scn::model* scene) {
+  auto size = [](const auto& values) {
+    return values.capacity() * sizeof(values[0]);
+  };
+  auto isize = [](const auto& image) {
+    return image.count() * sizeof(*image.data());
+  };
+  auto memory = scene_memory{};
+  for (auto shape : scene->shapes) {
+    memory.shapes += sizeof(scn::shape) + size(shape->points) +
+                     size(shape->lines) + size(shape->triangles) +
+                     size(shape->quads) + size(shape->positions) +
+                     size(shape->normals) + size(shape->texcoords) +
+                     size(shape->colors) + size(shape->radius) +
+                     size(shape->tangents) + shape->name.capacity() +
+                     shape->filename.capacity();
+  }
+  for (auto subdiv : scene->subdivs) {
+    memory.subdivs += sizeof(scn::subdiv) + size(subdiv->quadspos) +
+                      size(subdiv->quadsnorm) + size(subdiv->quadstexcoord) +
+                      size(subdiv->positions) + size(subdiv->normals) +
+                      size(subdiv->texcoords) + subdiv->name.capacity();
+  }
+  for (auto texture : scene->textures) {
+    memory.textures += sizeof(scn::texture) + isize(texture->colorf) +
+                       isize(texture->colorb) + isize(texture->scalarf) +
+                       isize(texture->scalarb) + texture->name.capacity() +
+                       texture->filename.capacity();
+  }
+  for (auto instance : scene->instances) {
+    memory.instances += sizeof(scn::instance) + size(instance->frames) +
+                        instance->name.capacity();
+  }
+  auto names = [](const auto& elements) {
+    auto memory = (size_t)0;
+    for (auto element : elements) memory += element->name.capacity();
+    return memory;
+  };
+  memory.other = sizeof(scn::model) +
+                 scene->cameras.size() * sizeof(scn::camera) +
+                 scene->objects.size() * sizeof(scn::object) +
+                 scene->environments.size() * sizeof(scn::environment) +
+                 scene->materials.size() * sizeof(scn::material) +
+                 names(scene->cameras) + names(scene->objects) +
+                 names(scene->environments) + names(scene->materials) +
+                 size(scene->cameras) + size(scene->objects) +
+                 size(scene->environments) + size(scene->shapes) +
+                 size(scene->subdivs) + size(scene->textures) +
+                 size(scene->materials) + size(scene->instances) +
+                 size(scene->loaded_shapes);
+  memory.total = memory.shapes + memory.subdivs + memory.textures +
+                 memory.instances + memory.other;
+  return memory;
+}
+
 // Checks for validity of the scene->
 std::vector<std::string> scene_validation(
     const scn::model* scene, bool notextures) {
@@ -270,50 +339,42 @@ std::vector<std::string> scene_validation(
 // -----------------------------------------------------------------------------
 namespace yocto::sceneio {
 
-model::~model() {
-  for (auto camera : cameras) delete camera;
-  for (auto shape : shapes) delete shape;
-  for (auto subdiv : subdivs) delete subdiv;
-  for (auto material : materials) delete material;
-  for (auto instance : instances) delete instance;
-  for (auto object : objects) delete object;
-  for (auto texture : textures) delete texture;
-  for (auto environment : environments) delete environment;
-}
-
 // add an element
 template <typename T>
-static T* add_element(std::vector<T*>& elements, const std::string& name,
-    const std::string& base) {
-  auto element  = elements.emplace_back(new T{});
+static T* add_element(std::vector<T*>& elements, common::arena<T>& arena,
+    const std::string& name, const std::string& base) {
+  auto element  = elements.emplace_back(arena.create());
   element->name = name != "" ? name : (base + std::to_string(elements.size()));
   return element;
 }
 
 // add element
 scn::camera* add_camera(scn::model* scene, const std::string& name) {
-  return add_element(scene->cameras, name, "camera");
+  return add_element(scene->cameras, scene->camera_arena, name, "camera");
 }
 scn::environment* add_environment(scn::model* scene, const std::string& name) {
-  return add_element(scene->environments, name, "environment");
+  return add_element(
+      scene->environments, scene->environment_arena, name, "environment");
 }
 scn::shape* add_shape(scn::model* scene, const std::string& name) {
-  return add_element(scene->shapes, name, "shape");
+  return add_element(scene->shapes, scene->shape_arena, name, "shape");
 }
 scn::subdiv* add_subdiv(scn::model* scene, const std::string& name) {
-  return add_element(scene->subdivs, name, "subdiv");
+  return add_element(scene->subdivs, scene->subdiv_arena, name, "subdiv");
 }
 scn::texture* add_texture(scn::model* scene, const std::string& name) {
-  return add_element(scene->textures, name, "texture");
+  return add_element(scene->textures, scene->texture_arena, name, "texture");
 }
 scn::object* add_object(scn::model* scene, const std::string& name) {
-  return add_element(scene->objects, name, "object");
+  return add_element(scene->objects, scene->object_arena, name, "object");
 }
 scn::instance* add_instance(scn::model* scene, const std::string& name) {
-  return add_element(scene->instances, name, "instance");
+  return add_element(
+      scene->instances, scene->instance_arena, name, "instance");
 }
 scn::material* add_material(scn::model* scene, const std::string& name) {
-  return add_element(scene->materials, name, "material");
+  return add_element(
+      scene->materials, scene->material_arena, name, "material");
 }
 scn::object* add_complete_object(scn::model* scene, const std::string& name) {
   auto object      = add_object(scene, name);
@@ -347,6 +408,8 @@ bbox3f compute_bounds(const scn::model* scene) {
   for (auto shape : scene->shapes) {
     auto sbvh = invalidb3f;
     for (auto p : shape->positions) sbvh = merge(sbvh, p);
+    if (shape->positions.empty() && !shape->filename.empty())
+      sbvh = shape->bounds;
     shape_bbox[shape] = sbvh;
   }
   for (auto object : scene->objects) {
@@ -545,65 +608,6 @@ static std::vector<vec3f> compute_normals(
   return normals;
 }
 
-// Convert face varying data to single primitives. Returns the quads indices
-// and filled vectors for pos, norm and texcoord.
-std::tuple<std::vector<vec4i>, std::vector<vec3f>, std::vector<vec3f>,
-    std::vector<vec2f>> static split_facevarying(const std::vector<vec4i>&
-                                                     quadspos,
-    const std::vector<vec4i>&                        quadsnorm,
-    const std::vector<vec4i>&                        quadstexcoord,
-    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
-    const std::vector<vec2f>& texcoords) {
-  auto split = std::tuple<std::vector<vec4i>, std::vector<vec3f>,
-      std::vector<vec3f>, std::vector<vec2f>>{};
-  auto& [split_quads, split_positions, split_normals, split_texcoords] = split;
-  // make faces unique
-  std::unordered_map<vec3i, int> vert_map;
-  split_quads.resize(quadspos.size());
-  for (auto fid = 0; fid < quadspos.size(); fid++) {
-    for (auto c = 0; c < 4; c++) {
-      auto v = vec3i{
-          (&quadspos[fid].x)[c],
-          (!quadsnorm.empty()) ? (&quadsnorm[fid].x)[c] : -1,
-          (!quadstexcoord.empty()) ? (&quadstexcoord[fid].x)[c] : -1,
-      };
-      auto it = vert_map.find(v);
-      if (it == vert_map.end()) {
-        auto s = (int)vert_map.size();
-        vert_map.insert(it, {v, s});
-        (&split_quads[fid].x)[c] = s;
-      } else {
-        (&split_quads[fid].x)[c] = it->second;
-      }
-    }
-  }
-
-  // fill vert data
-  split_positions.clear();
-  if (!positions.empty()) {
-    split_positions.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_positions[index] = positions[vert.x];
-    }
-  }
-  split_normals.clear();
-  if (!normals.empty()) {
-    split_normals.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_normals[index] = normals[vert.y];
-    }
-  }
-  split_texcoords.clear();
-  if (!texcoords.empty()) {
-    split_texcoords.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_texcoords[index] = texcoords[vert.z];
-    }
-  }
-
-  return split;
-}
-
 // Apply subdivision and displacement rules.
 std::unique_ptr<subdiv> subdivide_subdiv(
     scn::subdiv* shape, int subdivisions, bool smooth) {
@@ -666,7 +670,176 @@ std::unique_ptr<subdiv> displace_subdiv(scn::subdiv* subdiv, float displacement,
   return displaced;
 }
 
+// Adaptive subdivision. Subdivided quads are grouped in patches, one for
+// each quad after the first level, whose vertices form regular grids. Each
+// patch keeps the coarsest grid whose cells deviate from the
+// subdivided and displaced surface less than error times the shape size.
+// This accounts for curvature, edge length and displacement together.
+// Patch sides take the finest level of the patches that share them, and
+// coarser cells along them are fanned from their centers, so that
+// neighbors share the same vertices and no cracks appear.
+std::unique_ptr<subdiv> adapt_subdiv(const scn::subdiv* cage,
+    const scn::subdiv* tesselated, int subdivisions, float error) {
+  auto adapted = std::make_unique<scn::subdiv>(*tesselated);
+  if (subdivisions < 2 || error <= 0) return adapted;
+
+  // patches are split consistently only if all topologies agree on
+  // degenerate quads
+  auto num_patches = 0;
+  for (auto fid = 0; fid < cage->quadspos.size(); fid++) {
+    auto degenerate = [fid](const std::vector<vec4i>& quads) {
+      return quads[fid].z == quads[fid].w;
+    };
+    auto qpos = cage->quadspos[fid];
+    if (!cage->quadstexcoord.empty() &&
+        degenerate(cage->quadstexcoord) != degenerate(cage->quadspos))
+      return adapted;
+    if (!cage->quadsnorm.empty() && !tesselated->quadsnorm.empty() &&
+        degenerate(cage->quadsnorm) != degenerate(cage->quadspos))
+      return adapted;
+    num_patches += qpos.z != qpos.w ? 4 : 3;
+  }
+
+  // patch grids of size (resolution+1)^2, filled by following the child
+  // quads of each patch down to the last level
+  auto resolution = 1 << (subdivisions - 1);
+  auto stride     = resolution + 1;
+  auto has_norm   = !tesselated->quadsnorm.empty();
+  auto has_txt    = !tesselated->quadstexcoord.empty();
+  auto grids      = std::vector<vec3i>((size_t)num_patches * stride * stride);
+  auto grid       = [&](int patch, vec2i ij) -> vec3i& {
+    return grids[((size_t)patch * stride + ij.y) * stride + ij.x];
+  };
+  auto fill_grid  = [&](auto&& fill_grid, int patch, int idx, int depth,
+                       const std::array<vec2i, 4>& corners) -> void {
+    if (depth == subdivisions - 1) {
+      for (auto k = 0; k < 4; k++) {
+        grid(patch, corners[k]) = {tesselated->quadspos[idx][k],
+            has_norm ? tesselated->quadsnorm[idx][k] : -1,
+            has_txt ? tesselated->quadstexcoord[idx][k] : -1};
+      }
+      return;
+    }
+    auto center = (corners[0] + corners[2]) / 2;
+    for (auto k = 0; k < 4; k++) {
+      auto prev = corners[(k + 3) % 4], next = corners[(k + 1) % 4];
+      fill_grid(fill_grid, patch, idx * 4 + k, depth + 1,
+          {corners[k], (corners[k] + next) / 2, center,
+              (prev + corners[k]) / 2});
+    }
+  };
+  common::parallel_for(num_patches, [&](int patch) {
+    fill_grid(fill_grid, patch, patch, 0,
+        {vec2i{0, 0}, vec2i{resolution, 0}, vec2i{resolution, resolution},
+            vec2i{0, resolution}});
+  });
+
+  // pick the coarsest level of each patch within the error
+  auto bbox = invalidb3f;
+  for (auto& position : tesselated->positions) bbox = merge(bbox, position);
+  auto max_error = error * length(bbox.max - bbox.min);
+  auto levels    = std::vector<int>(num_patches, 0);
+  common::parallel_for(num_patches, [&](int patch) {
+    auto position = [&](int i, int j) {
+      return tesselated->positions[grid(patch, {i, j}).x];
+    };
+    auto level = 0;
+    for (; level < subdivisions - 1; level++) {
+      auto step      = resolution >> level;
+      auto deviation = 0.0f;
+      for (auto j = 0; j <= resolution && deviation <= max_error; j++) {
+        for (auto i = 0; i <= resolution; i++) {
+          auto i0 = min(i / step, (resolution / step) - 1) * step;
+          auto j0 = min(j / step, (resolution / step) - 1) * step;
+          auto u = (i - i0) / (float)step, v = (j - j0) / (float)step;
+          auto approx = interpolate_quad(position(i0, j0),
+              position(i0 + step, j0), position(i0 + step, j0 + step),
+              position(i0, j0 + step), {u, v});
+          deviation = max(deviation, distance(approx, position(i, j)));
+        }
+      }
+      if (deviation <= max_error) break;
+    }
+    levels[patch] = level;
+  });
+
+  // sides take the finest level of their patches
+  auto side_corners = std::array<vec2i, 5>{vec2i{0, 0}, vec2i{resolution, 0},
+      vec2i{resolution, resolution}, vec2i{0, resolution}, vec2i{0, 0}};
+  auto side_key     = [&](int patch, int side) {
+    auto a = grid(patch, side_corners[side]).x;
+    auto b = grid(patch, side_corners[side + 1]).x;
+    return vec2i{min(a, b), max(a, b)};
+  };
+  auto side_levels = common::flat_map<vec2i, int>{};
+  side_levels.reserve(num_patches * 2);
+  for (auto patch = 0; patch < num_patches; patch++) {
+    for (auto side = 0; side < 4; side++) {
+      auto [level, inserted] = side_levels.insert(
+          side_key(patch, side), levels[patch]);
+      if (!inserted) *level = max(*level, levels[patch]);
+    }
+  }
+
+  // emit quads for regular cells and fans of degenerate quads elsewhere
+  adapted->quadspos.clear();
+  adapted->quadsnorm.clear();
+  adapted->quadstexcoord.clear();
+  auto add_quad = [&](int patch, vec2i a, vec2i b, vec2i c, vec2i d) {
+    auto va = grid(patch, a), vb = grid(patch, b), vc = grid(patch, c),
+         vd = grid(patch, d);
+    adapted->quadspos.push_back({va.x, vb.x, vc.x, vd.x});
+    if (has_norm) adapted->quadsnorm.push_back({va.y, vb.y, vc.y, vd.y});
+    if (has_txt) adapted->quadstexcoord.push_back({va.z, vb.z, vc.z, vd.z});
+  };
+  for (auto patch = 0; patch < num_patches; patch++) {
+    auto step       = resolution >> levels[patch];
+    auto side_steps = std::array<int, 4>{};
+    for (auto side = 0; side < 4; side++) {
+      side_steps[side] = resolution >> *side_levels.find(side_key(patch, side));
+    }
+    for (auto j = 0; j < resolution; j += step) {
+      for (auto i = 0; i < resolution; i += step) {
+        // steps along the cell sides, finer on refined patch sides
+        auto steps = std::array<int, 4>{
+            j == 0 ? side_steps[0] : step,
+            i + step == resolution ? side_steps[1] : step,
+            j + step == resolution ? side_steps[2] : step,
+            i == 0 ? side_steps[3] : step};
+        if (steps == std::array<int, 4>{step, step, step, step}) {
+          add_quad(patch, {i, j}, {i + step, j}, {i + step, j + step},
+              {i, j + step});
+          continue;
+        }
+        auto corners = std::array<vec2i, 5>{vec2i{i, j}, vec2i{i + step, j},
+            vec2i{i + step, j + step}, vec2i{i, j + step}, vec2i{i, j}};
+        auto center  = vec2i{i + step / 2, j + step / 2};
+        for (auto side = 0; side < 4; side++) {
+          auto direction = (corners[side + 1] - corners[side]) / step;
+          for (auto k = 0; k < step; k += steps[side]) {
+            auto a = corners[side] + direction * k;
+            auto b = a + direction * steps[side];
+            add_quad(patch, center, a, b, b);
+          }
+        }
+      }
+    }
+  }
+
+  return adapted;
+}
+
 void tesselate_subdiv(scn::model* scene, scn::subdiv* subdiv) {
+  for (auto object : scene->objects) {
+    if (object->subdiv == subdiv) {
+      return tesselate_subdiv(
+          scene, subdiv, object->material->subdivisions);
+    }
+  }
+}
+
+void tesselate_subdiv(
+    scn::model* scene, scn::subdiv* subdiv, int subdivisions) {
   auto material = (scn::material*)nullptr;
   auto shape    = (scn::shape*)nullptr;
   for (auto object : scene->objects) {
@@ -677,14 +850,16 @@ void tesselate_subdiv(scn::model* scene, scn::subdiv* subdiv) {
     }
   }
 
-  auto tesselated = subdivide_subdiv(
-      subdiv, material->subdivisions, material->smooth);
+  auto tesselated = subdivide_subdiv(subdiv, subdivisions, material->smooth);
   auto displaced = displace_subdiv(tesselated.get(), material->displacement,
       material->displacement_tex, material->smooth);
-  std::tie(shape->quads, shape->positions, shape->normals, shape->texcoords) =
-      split_facevarying(displaced->quadspos, displaced->quadsnorm,
-          displaced->quadstexcoord, displaced->positions, displaced->normals,
-          displaced->texcoords);
+  if (material->subdivision_error > 0)
+    displaced = adapt_subdiv(subdiv, displaced.get(), subdivisions,
+        material->subdivision_error);
+  yshp::split_facevarying(shape->quads, shape->positions, shape->normals,
+      shape->texcoords, displaced->quadspos, displaced->quadsnorm,
+      displaced->quadstexcoord, displaced->positions, displaced->normals,
+      displaced->texcoords);
   shape->points    = {};
   shape->lines     = {};
   shape->triangles = {};
@@ -698,12 +873,114 @@ void tesselate_subdivs(scn::model* scene, progress_callback progress_cb) {
   // handle progress
   auto progress = vec2i{0, (int)scene->subdivs.size()};
 
-  // tesselate subdivs
-  for (auto subdiv : scene->subdivs) {
-    if (progress_cb) progress_cb("tesseleate subdiv", progress.x++, progress.y);
-    tesselate_subdiv(scene, subdiv);
+  // tesselate subdivs concurrently, since each writes only its own shape
+  auto progress_mutex = std::mutex{};
+  common::parallel_for((int)scene->subdivs.size(), [&](int sid) {
+    if (progress_cb) {
+      auto lock = std::lock_guard<std::mutex>{progress_mutex};
+      progress_cb("tesseleate subdiv", progress.x++, progress.y);
+    }
+    tesselate_subdiv(scene, scene->subdivs[sid]);
+  });
+
+  // done
+  if (progress_cb) progress_cb("tesseleate subdiv", progress.x++, progress.y);
+}
+
+// Estimated memory of a tesselated quad, including vertex data and the
+// acceleration structures built by renderers.
+const auto subdiv_quad_bytes = (size_t)64;
+
+void tesselate_subdivs(scn::model* scene, const scn::camera* camera,
+    int resolution, float edge_pixels, size_t budget,
+    progress_callback progress_cb) {
+  if (scene->subdivs.empty()) return;
+
+  // handle progress
+  auto progress = vec2i{0, (int)scene->subdivs.size() + 1};
+  if (progress_cb) progress_cb("tesseleate subdiv", progress.x++, progress.y);
+
+  // world size of a pixel at unit distance, or at all distances for
+  // orthographic cameras
+  auto pixel_size = camera->orthographic
+                        ? camera->film / resolution
+                        : camera->film / (camera->lens * resolution);
+  auto origin     = camera->frame.o;
+
+  // project cage edges of each subdiv, using its closest object or instance
+  auto levels    = std::vector<int>(scene->subdivs.size(), 0);
+  auto projected = std::vector<float>(scene->subdivs.size(), 0);
+  auto quads     = std::vector<size_t>(scene->subdivs.size(), 0);
+  for (auto sid = 0; sid < scene->subdivs.size(); sid++) {
+    auto subdiv = scene->subdivs[sid];
+    auto bbox   = invalidb3f;
+    for (auto& position : subdiv->positions) bbox = merge(bbox, position);
+    auto edge = 0.0f;
+    for (auto& quad : subdiv->quadspos) {
+      edge += distance(subdiv->positions[quad.x], subdiv->positions[quad.y]) +
+              distance(subdiv->positions[quad.y], subdiv->positions[quad.z]);
+    }
+    if (!subdiv->quadspos.empty()) edge /= 2 * subdiv->quadspos.size();
+    quads[sid] = subdiv->quadspos.size();
+    for (auto object : scene->objects) {
+      if (object->subdiv != subdiv) continue;
+      levels[sid]  = object->material->subdivisions;
+      auto frames  = object->instance ? object->instance->frames
+                                      : std::vector<frame3f>{identity3x4f};
+      for (auto& frame : frames) {
+        auto world = object->frame * frame;
+        auto wbbox = transform_bbox(world, bbox);
+        auto scale = (length(world.x) + length(world.y) + length(world.z)) / 3;
+        auto dist  = camera->orthographic
+                         ? 1.0f
+                         : max(distance(origin,
+                                   min(max(origin, wbbox.min), wbbox.max)),
+                               camera->lens);
+        projected[sid] = max(
+            projected[sid], edge * scale / (dist * pixel_size));
+      }
+    }
+  }
+
+  // pick the smallest levels that reach the edge size
+  for (auto sid = 0; sid < scene->subdivs.size(); sid++) {
+    auto level = 0;
+    while (level < levels[sid] && projected[sid] / (1 << level) > edge_pixels)
+      level++;
+    levels[sid] = level;
   }
 
+  // lower levels of the finest subdivs on screen until within budget
+  auto memory = [&quads](int sid, int level) {
+    return quads[sid] * ((size_t)1 << (2 * level)) * subdiv_quad_bytes;
+  };
+  auto total = (size_t)0;
+  for (auto sid = 0; sid < scene->subdivs.size(); sid++)
+    total += memory(sid, levels[sid]);
+  while (budget && total > budget) {
+    auto finest = -1;
+    for (auto sid = 0; sid < scene->subdivs.size(); sid++) {
+      if (levels[sid] == 0) continue;
+      if (finest < 0 || projected[sid] / (1 << levels[sid]) <
+                            projected[finest] / (1 << levels[finest]))
+        finest = sid;
+    }
+    if (finest < 0) break;
+    total -= memory(finest, levels[finest]) -
+             memory(finest, levels[finest] - 1);
+    levels[finest] -= 1;
+  }
+
+  // tesselate subdivs concurrently, since each writes only its own shape
+  auto progress_mutex = std::mutex{};
+  common::parallel_for((int)scene->subdivs.size(), [&](int sid) {
+    if (progress_cb) {
+      auto lock = std::lock_guard<std::mutex>{progress_mutex};
+      progress_cb("tesseleate subdiv", progress.x++, progress.y);
+    }
+    tesselate_subdiv(scene, scene->subdivs[sid], levels[sid]);
+  });
+
   // done
   if (progress_cb) progress_cb("tesseleate subdiv", progress.x++, progress.y);
 }
@@ -717,16 +994,18 @@ namespace yocto::sceneio {
 
 // Load/save a scene in the builtin JSON format.
 static bool load_json_scene(const std::string& filename, scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel);
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool notextures, bool noshapes, asset_callback asset_cb);
 static bool save_json_scene(const std::string& filename,
     const scn::model* scene, std::string& error, progress_callback progress_cb,
-    bool noparallel);
+    bool noparallel, bool incremental);
 
 // Load/save a scene from/to OBJ.
 static bool load_obj_scene(const std::string& filename, scn::model* scene,
     std::string& error, progress_callback progress_cb, bool noparallel);
 static bool save_obj_scene(const std::string& filename, const scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel);
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool incremental);
 
 // Load/save a scene from/to PLY. Loads/saves only one mesh with no other data.
 static bool load_ply_scene(const std::string& filename, scn::model* scene,
@@ -747,42 +1026,368 @@ static bool save_pbrt_scene(const std::string& filename,
     const scn::model* scene, std::string& error, progress_callback progress_cb,
     bool noparallel);
 
+// Load/save a scene in the builtin binary format, that stores all data in
+// a single file for fast loading.
+static bool load_binary_scene(const std::string& filename, scn::model* scene,
+    std::string& error, progress_callback progress_cb, bool noparallel);
+static bool save_binary_scene(const std::string& filename,
+    const scn::model* scene, std::string& error, progress_callback progress_cb,
+    bool noparallel);
+
+// Stream all the assets of a loaded scene
+static void stream_scene(const scn::model* scene, asset_callback asset_cb) {
+  for (auto camera : scene->cameras) asset_cb(camera, nullptr, nullptr);
+  for (auto texture : scene->textures) asset_cb(nullptr, nullptr, texture);
+  for (auto object : scene->objects) asset_cb(nullptr, object, nullptr);
+}
+
 // Load a scene
 bool load_scene(const std::string& filename, scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel) {
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool notextures, bool noshapes, asset_callback asset_cb) {
   auto ext = sfs::path(filename).extension();
+  auto ok  = false;
   if (ext == ".json" || ext == ".JSON") {
-    return load_json_scene(filename, scene, error, progress_cb, noparallel);
+    return load_json_scene(filename, scene, error, progress_cb, noparallel,
+        notextures, noshapes, asset_cb);
   } else if (ext == ".obj" || ext == ".OBJ") {
-    return load_obj_scene(filename, scene, error, progress_cb, noparallel);
+    ok = load_obj_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".gltf" || ext == ".GLTF") {
-    return load_gltf_scene(filename, scene, error, progress_cb, noparallel);
+    ok = load_gltf_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".pbrt" || ext == ".PBRT") {
-    return load_pbrt_scene(filename, scene, error, progress_cb, noparallel);
+    ok = load_pbrt_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
-    return load_ply_scene(filename, scene, error, progress_cb, noparallel);
+    ok = load_ply_scene(filename, scene, error, progress_cb, noparallel);
+  } else if (ext == ".ybin" || ext == ".YBIN") {
+    ok = load_binary_scene(filename, scene, error, progress_cb, noparallel);
   } else {
     throw std::runtime_error{filename + ": unknown format"};
   }
+  if (ok && asset_cb) stream_scene(scene, asset_cb);
+  return ok;
 }
 
 // Save a scene
 bool save_scene(const std::string& filename, const scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel) {
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool incremental) {
   auto ext = sfs::path(filename).extension();
   if (ext == ".json" || ext == ".JSON") {
-    return save_json_scene(filename, scene, error, progress_cb, noparallel);
+    return save_json_scene(
+        filename, scene, error, progress_cb, noparallel, incremental);
   } else if (ext == ".obj" || ext == ".OBJ") {
-    return save_obj_scene(filename, scene, error, progress_cb, noparallel);
+    return save_obj_scene(
+        filename, scene, error, progress_cb, noparallel, incremental);
   } else if (ext == ".pbrt" || ext == ".PBRT") {
     return save_pbrt_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
     return save_ply_scene(filename, scene, error, progress_cb, noparallel);
+  } else if (ext == ".ybin" || ext == ".YBIN") {
+    return save_binary_scene(filename, scene, error, progress_cb, noparallel);
   } else {
     throw std::runtime_error{filename + ": unknown format"};
   }
 }
 
+// Dependent asset of a scene, saved after the scene file.
+struct asset_save {
+  std::string                       message = "";
+  std::string                       path    = "";
+  uint64_t                          hash    = 0;
+  std::function<bool(std::string&)> save    = {};
+};
+
+// Hash of the data of an asset, used to detect unchanged assets.
+static uint64_t hash_asset(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  hash       = (hash ^ size) * 0x100000001b3ull;
+  auto idx   = (size_t)0;
+  for (; idx + 8 <= size; idx += 8) {
+    auto word = uint64_t{0};
+    memcpy(&word, bytes + idx, 8);
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 29;
+  }
+  for (; idx < size; idx++) hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+  return hash;
+}
+template <typename T>
+static uint64_t hash_asset(uint64_t hash, const std::vector<T>& values) {
+  return hash_asset(hash, values.data(), values.size() * sizeof(T));
+}
+template <typename T>
+static uint64_t hash_asset(uint64_t hash, const img::image<T>& img) {
+  auto size = img.size();
+  hash      = hash_asset(hash, &size, sizeof(size));
+  return hash_asset(hash, img.data(), img.count() * sizeof(T));
+}
+template <typename... Ts>
+static uint64_t hash_assets(const Ts&... values) {
+  auto hash = (uint64_t)0;
+  for (auto value_hash : {hash_asset(0, values)...})
+    hash = hash_asset(hash, &value_hash, sizeof(value_hash));
+  return hash;
+}
+
+// Load and save the asset hashes recorded for a scene, as lines of hash
+// and path relative to the scene. A missing file has no hashes.
+static std::unordered_map<std::string, uint64_t> load_asset_hashes(
+    const std::string& filename) {
+  auto hashes = std::unordered_map<std::string, uint64_t>{};
+  auto fs     = fopen(filename.c_str(), "rt");
+  if (!fs) return hashes;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), fs)) {
+    auto line = std::string{buffer};
+    if (!line.empty() && line.back() == '\n') line.pop_back();
+    if (line.size() < 18 || line[16] != ' ') continue;
+    hashes[line.substr(17)] = std::strtoull(
+        line.substr(0, 16).c_str(), nullptr, 16);
+  }
+  return hashes;
+}
+static bool save_asset_hashes(const std::string& filename,
+    const std::unordered_map<std::string, uint64_t>& hashes,
+    std::string& error) {
+  auto fs = fopen(filename.c_str(), "wt");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  for (auto& [path, hash] : hashes) {
+    if (fprintf(fs, "%016llx %s\n", (unsigned long long)hash,
+            path.c_str()) < 0) {
+      error = filename + ": write error";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Save the dependent assets of a scene concurrently on the thread pool,
+// unless noparallel. Each worker encodes one asset at a time, so the memory
+// in flight is bounded by the number of threads. With incremental, assets
+// whose hash matches the recorded one and whose file exists are skipped.
+// Reports the errors of all failed assets.
+static bool save_assets(const std::string& filename,
+    const std::vector<asset_save>& assets, std::string& error,
+    progress_callback progress_cb, vec2i& progress, bool noparallel,
+    bool incremental) {
+  auto hashes_filename = filename + ".hashes";
+  auto hashes          = std::unordered_map<std::string, uint64_t>{};
+  if (incremental) hashes = load_asset_hashes(hashes_filename);
+  auto get_key = [dirname = sfs::path(filename).parent_path()](
+                     const std::string& path) {
+    return sfs::path(path).lexically_relative(dirname).generic_string();
+  };
+  auto asset_errors   = std::vector<std::string>(assets.size());
+  auto asset_failed   = std::vector<int>(assets.size(), 0);
+  auto progress_mutex = std::mutex{};
+  auto save_asset     = [&](int idx) {
+    auto& asset = assets[idx];
+    if (progress_cb) {
+      auto lock = std::lock_guard<std::mutex>{progress_mutex};
+      progress_cb(asset.message, progress.x++, progress.y);
+    }
+    if (incremental) {
+      auto it = hashes.find(get_key(asset.path));
+      if (it != hashes.end() && it->second == asset.hash &&
+          sfs::exists(asset.path))
+        return;
+    }
+    asset_failed[idx] = !asset.save(asset_errors[idx]);
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)assets.size(); idx++) save_asset(idx);
+  } else {
+    common::parallel_for((int)assets.size(), save_asset);
+  }
+
+  // report the errors of all failed assets
+  auto asset_error = ""s;
+  for (auto idx = 0; idx < (int)assets.size(); idx++) {
+    if (!asset_failed[idx]) continue;
+    if (!asset_error.empty()) asset_error += "; ";
+    asset_error += asset_errors[idx];
+  }
+  if (!asset_error.empty()) {
+    error = asset_error;
+    return false;
+  }
+
+  // record hashes
+  if (!incremental) return true;
+  for (auto& asset : assets) hashes[get_key(asset.path)] = asset.hash;
+  return save_asset_hashes(hashes_filename, hashes, error);
+}
+
+// Check whether two asset buffers have the same data.
+template <typename T>
+static bool same_asset(const std::vector<T>& a, const std::vector<T>& b) {
+  return a.size() == b.size() &&
+         (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+template <typename T>
+static bool same_asset(const img::image<T>& a, const img::image<T>& b) {
+  return a.size() == b.size() &&
+         (a.empty() || memcmp(a.data(), b.data(), a.count() * sizeof(T)) == 0);
+}
+
+// Merge shapes and textures with the same contents
+void merge_duplicates(scn::model* scene) {
+  // shapes with the same geometry, found by hash and then compared
+  auto subdiv_shapes = std::unordered_set<scn::shape*>{};
+  for (auto object : scene->objects) {
+    if (object->subdiv) subdiv_shapes.insert(object->shape);
+  }
+  auto same_shape = [](const scn::shape* a, const scn::shape* b) {
+    return same_asset(a->points, b->points) &&
+           same_asset(a->lines, b->lines) &&
+           same_asset(a->triangles, b->triangles) &&
+           same_asset(a->quads, b->quads) &&
+           same_asset(a->positions, b->positions) &&
+           same_asset(a->normals, b->normals) &&
+           same_asset(a->texcoords, b->texcoords) &&
+           same_asset(a->colors, b->colors) &&
+           same_asset(a->radius, b->radius) &&
+           same_asset(a->tangents, b->tangents);
+  };
+  auto shape_hashes = std::unordered_multimap<uint64_t, scn::shape*>{};
+  auto shape_map    = std::unordered_map<scn::shape*, scn::shape*>{};
+  for (auto shape : scene->shapes) {
+    if (!shape->filename.empty() || shape->positions.empty()) continue;
+    if (subdiv_shapes.count(shape)) continue;
+    auto hash = hash_assets(shape->points, shape->lines, shape->triangles,
+        shape->quads, shape->positions, shape->normals, shape->texcoords,
+        shape->colors, shape->radius, shape->tangents);
+    auto [first, last] = shape_hashes.equal_range(hash);
+    auto it = std::find_if(first, last,
+        [&](auto& item) { return same_shape(item.second, shape); });
+    if (it != last) {
+      shape_map[shape] = it->second;
+    } else {
+      shape_hashes.insert({hash, shape});
+    }
+  }
+
+  // textures with the same images
+  auto same_texture = [](const scn::texture* a, const scn::texture* b) {
+    return same_asset(a->colorf, b->colorf) &&
+           same_asset(a->colorb, b->colorb) &&
+           same_asset(a->scalarf, b->scalarf) &&
+           same_asset(a->scalarb, b->scalarb);
+  };
+  auto texture_hashes = std::unordered_multimap<uint64_t, scn::texture*>{};
+  auto texture_map    = std::unordered_map<scn::texture*, scn::texture*>{};
+  for (auto texture : scene->textures) {
+    if (!texture->filename.empty()) continue;
+    if (texture->colorf.empty() && texture->colorb.empty() &&
+        texture->scalarf.empty() && texture->scalarb.empty())
+      continue;
+    auto hash = hash_assets(
+        texture->colorf, texture->colorb, texture->scalarf, texture->scalarb);
+    auto [first, last] = texture_hashes.equal_range(hash);
+    auto it = std::find_if(first, last,
+        [&](auto& item) { return same_texture(item.second, texture); });
+    if (it != last) {
+      texture_map[texture] = it->second;
+    } else {
+      texture_hashes.insert({hash, texture});
+    }
+  }
+
+  // remap references
+  auto remap = [](auto& element, const auto& map) {
+    auto it = map.find(element);
+    if (it != map.end()) element = it->second;
+  };
+  for (auto object : scene->objects) remap(object->shape, shape_map);
+  for (auto environment : scene->environments) {
+    remap(environment->emission_tex, texture_map);
+  }
+  for (auto material : scene->materials) {
+    for (auto texture :
+        {&material->emission_tex, &material->color_tex,
+            &material->specular_tex, &material->metallic_tex,
+            &material->roughness_tex, &material->transmission_tex,
+            &material->translucency_tex, &material->spectint_tex,
+            &material->scattering_tex, &material->coat_tex,
+            &material->opacity_tex, &material->normal_tex,
+            &material->displacement_tex})
+      remap(*texture, texture_map);
+  }
+
+  // remove merged elements
+  for (auto& shape : scene->shapes) {
+    if (!shape_map.count(shape)) continue;
+    scene->shape_arena.destroy(shape);
+    shape = nullptr;
+  }
+  scene->shapes.erase(
+      std::remove(scene->shapes.begin(), scene->shapes.end(), nullptr),
+      scene->shapes.end());
+  for (auto& texture : scene->textures) {
+    if (!texture_map.count(texture)) continue;
+    scene->texture_arena.destroy(texture);
+    texture = nullptr;
+  }
+  scene->textures.erase(
+      std::remove(scene->textures.begin(), scene->textures.end(), nullptr),
+      scene->textures.end());
+}
+
+// Group objects with the same shape and material into instanced objects
+void group_instances(scn::model* scene) {
+  // objects grouped by shape and material, in the order they appear
+  auto groups    = std::vector<std::vector<scn::object*>>{};
+  auto group_map = std::unordered_map<scn::shape*,
+      std::unordered_map<scn::material*, int>>{};
+  for (auto object : scene->objects) {
+    if (!object->shape || object->subdiv) continue;
+    auto& materials = group_map[object->shape];
+    auto  it        = materials.find(object->material);
+    if (it == materials.end()) {
+      materials[object->material] = (int)groups.size();
+      groups.emplace_back().push_back(object);
+    } else {
+      groups[it->second].push_back(object);
+    }
+  }
+
+  // make the first object of each group instance the others
+  auto removed = std::unordered_set<scn::object*>{};
+  for (auto& group : groups) {
+    if (group.size() < 2) continue;
+    auto frames = std::vector<frame3f>{};
+    for (auto object : group) {
+      if (object->instance) {
+        for (auto& frame : object->instance->frames)
+          frames.push_back(frame * object->frame);
+      } else {
+        frames.push_back(object->frame);
+      }
+    }
+    auto instance    = add_instance(scene);
+    instance->frames = std::move(frames);
+    auto object      = group.front();
+    object->frame    = identity3x4f;
+    object->instance = instance;
+    removed.insert(group.begin() + 1, group.end());
+  }
+
+  // remove grouped objects
+  for (auto& object : scene->objects) {
+    if (!removed.count(object)) continue;
+    scene->object_arena.destroy(object);
+    object = nullptr;
+  }
+  scene->objects.erase(
+      std::remove(scene->objects.begin(), scene->objects.end(), nullptr),
+      scene->objects.end());
+}
+
 }  // namespace yocto::sceneio
 
 // -----------------------------------------------------------------------------
@@ -845,6 +1450,105 @@ static bool save_image(const std::string& filename,
   }
 }
 
+// Load shape bounds without keeping its geometry. Ply vertices are read in
+// batches, so that bounds are computed in bounded memory.
+static bool load_shape_bounds(
+    const std::string& filename, bbox3f& bounds, std::string& error) {
+  bounds   = invalidb3f;
+  auto ext = get_extension(filename);
+  if (ext == ".ply" || ext == ".PLY") {
+    auto ply       = ply::model{};
+    auto positions = std::vector<vec3f>{};
+    return load_ply(filename, &ply, error, (size_t)1 << 16,
+        [&](ply::element* element, size_t start, size_t count) {
+          if (element->name != "vertex") return;
+          if (!get_positions(&ply, positions)) return;
+          for (auto& position : positions) bounds = merge(bounds, position);
+        });
+  } else {
+    auto shape = scn::shape{};
+    if (!yshp::load_shape(filename, shape.points, shape.lines,
+            shape.triangles, shape.quads, shape.positions, shape.normals,
+            shape.texcoords, shape.colors, shape.radius, error))
+      return false;
+    for (auto& position : shape.positions) bounds = merge(bounds, position);
+    return true;
+  }
+}
+
+// Memory used by the geometry of a shape
+static size_t get_shape_memory(const scn::shape* shape) {
+  auto size = [](auto& values) { return values.size() * sizeof(values[0]); };
+  return size(shape->points) + size(shape->lines) + size(shape->triangles) +
+         size(shape->quads) + size(shape->positions) + size(shape->normals) +
+         size(shape->texcoords) + size(shape->colors) + size(shape->radius) +
+         size(shape->tangents);
+}
+
+// Load the geometry of a shape on demand, evicting shapes over budget
+bool load_shape(scn::model* scene, scn::shape* shape, std::string& error) {
+  if (shape->filename.empty()) return true;
+  auto& loaded = scene->loaded_shapes;
+  auto  it     = std::find(loaded.begin(), loaded.end(), shape);
+  if (it != loaded.end()) {
+    loaded.erase(it);
+    loaded.push_back(shape);
+    return true;
+  }
+  if (!yshp::load_shape(shape->filename, shape->points, shape->lines,
+          shape->triangles, shape->quads, shape->positions, shape->normals,
+          shape->texcoords, shape->colors, shape->radius, error))
+    return false;
+  loaded.push_back(shape);
+  if (!scene->shape_budget) return true;
+  auto memory = (size_t)0;
+  for (auto loaded_shape : loaded) memory += get_shape_memory(loaded_shape);
+  while (memory > scene->shape_budget && loaded.front() != shape) {
+    memory -= get_shape_memory(loaded.front());
+    unload_shape(scene, loaded.front());
+  }
+  return true;
+}
+
+// Release the geometry of a shape loaded on demand
+void unload_shape(scn::model* scene, scn::shape* shape) {
+  if (shape->filename.empty()) return;
+  auto& loaded = scene->loaded_shapes;
+  auto  it     = std::find(loaded.begin(), loaded.end(), shape);
+  if (it != loaded.end()) loaded.erase(it);
+  shape->points    = {};
+  shape->lines     = {};
+  shape->triangles = {};
+  shape->quads     = {};
+  shape->positions = {};
+  shape->normals   = {};
+  shape->texcoords = {};
+  shape->colors    = {};
+  shape->radius    = {};
+  shape->tangents  = {};
+}
+
+// Instance frames are stored in ply as an instance element with twelve float
+// properties, in the same order as the values in frame3f.
+static const auto instance_properties = std::array<std::string, 12>{"xx",
+    "xy", "xz", "yx", "yy", "yz", "zx", "zy", "zz", "ox", "oy", "oz"};
+
+// Check whether a ply header stores frames as packed binary rows
+static bool is_instance_layout(const ply::model* ply) {
+  if (ply->format != ply::model::format_t::binary_little_endian) return false;
+  if (ply->elements.size() != 1) return false;
+  auto element = ply->elements.front();
+  if (element->name != "instance") return false;
+  if (element->properties.size() != instance_properties.size()) return false;
+  for (auto idx = (size_t)0; idx < instance_properties.size(); idx++) {
+    auto property = element->properties[idx];
+    if (property->is_list || property->type != ply::property::type_t::f32 ||
+        property->name != instance_properties[idx])
+      return false;
+  }
+  return true;
+}
+
 // load instances
 static bool load_instance(const std::string& filename,
     std::vector<frame3f>& frames, std::string& error) {
@@ -852,14 +1556,34 @@ static bool load_instance(const std::string& filename,
     error = filename + ": unknown format";
     return false;
   };
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
   auto ext = get_extension(filename);
   if (ext == ".ply" || ext == ".PLY") {
-    auto ply = ply::model{};
-    if (!load_ply(filename, &ply, error)) return false;
-    get_values(&ply, "instance",
-        {"xx", "xy", "xz", "yx", "yy", "yz", "zx", "zy", "zz", "ox", "oy",
-            "oz"},
-        frames);
+    // frames saved as packed binary rows are read directly, without
+    // copying them through ply properties
+    auto fs = fopen(filename.c_str(), "rb");
+    if (!fs) return open_error();
+    auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+    auto ply      = ply::model{};
+    if (!load_ply_header(fs, filename, &ply, error)) return false;
+    if (is_instance_layout(&ply)) {
+      frames.resize(ply.elements.front()->count);
+      if (fread(frames.data(), sizeof(frame3f), frames.size(), fs) !=
+          frames.size())
+        return read_error();
+      return true;
+    }
+    fs_guard.reset();
+    auto values = ply::model{};
+    if (!load_ply(filename, &values, error)) return false;
+    get_values(&values, "instance", instance_properties, frames);
     return true;
   } else {
     return format_error();
@@ -874,15 +1598,40 @@ static bool save_instance(const std::string& filename,
     error = filename + ": unknown format";
     return false;
   };
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
   auto ext = get_extension(filename);
-  if (ext == ".ply" || ext == ".PLY") {
-    auto ply = ply::model{};
-    add_values(&ply, "instance",
-        {"xx", "xy", "xz", "yx", "yy", "yz", "zx", "zy", "zz", "ox", "oy",
-            "oz"},
-        frames);
+  if ((ext == ".ply" || ext == ".PLY") && ascii) {
+    auto ply   = ply::model{};
+    ply.format = ply::model::format_t::ascii;
+    add_values(&ply, "instance", instance_properties, frames);
     if (!save_ply(filename, &ply, error)) return false;
     return true;
+  } else if (ext == ".ply" || ext == ".PLY") {
+    // write the header and then the frames as packed binary rows
+    auto ply     = ply::model{};
+    auto element = add_property(&ply);
+    element->name  = "instance";
+    element->count = frames.size();
+    for (auto& name : instance_properties) {
+      auto property  = add_property(element);
+      property->name = name;
+      property->type = ply::property::type_t::f32;
+    }
+    auto fs = fopen(filename.c_str(), "wb");
+    if (!fs) return open_error();
+    auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+    if (!save_ply_header(fs, filename, &ply, error)) return false;
+    if (fwrite(frames.data(), sizeof(frame3f), frames.size(), fs) !=
+        frames.size())
+      return write_error();
+    return true;
   } else {
     return format_error();
   }
@@ -1060,9 +1809,259 @@ inline json load_json(const std::string& filename, std::string& error) {
   return js;
 }
 
-// Save a scene in the builtin JSON format.
+// Streaming reader for json scenes. Elements are created while parsing,
+// without building a json document first, which keeps memory bounded for
+// scenes with many objects. References are kept by name and resolved after
+// parsing, since they may appear before the elements they refer to.
+struct json_scene_reader : json::json_sax_t {
+  // parsed property value
+  struct value_t {
+    enum struct type_t { invalid, boolean, number, string, array };
+    type_t             type    = type_t::invalid;
+    bool               flag    = false;
+    double             number  = 0;
+    std::string        text    = "";
+    std::vector<float> numbers = {};
+  };
+  using type_t = value_t::type_t;
+
+  // scene and references, as property and element names for each element
+  scn::model* scene = nullptr;
+  std::unordered_map<const void*, std::unordered_map<std::string, std::string>>
+      refs = {};
+
+  // parsing state
+  int               depth         = 0;
+  std::string       group_name    = "";
+  std::string       element_name  = "";
+  std::string       property_name = "";
+  value_t           value         = {};
+  scn::camera*      camera        = nullptr;
+  scn::environment* environment   = nullptr;
+  scn::material*    material      = nullptr;
+  scn::object*      object        = nullptr;
+  bool              has_lookat    = false;
+  mat3f             lookat        = identity3x3f;
+
+  explicit json_scene_reader(scn::model* scene) : scene{scene} {}
+
+  // sax interface
+  bool null() override { return scalar({}); }
+  bool boolean(bool val) override { return scalar({type_t::boolean, val}); }
+  bool number_integer(number_integer_t val) override {
+    return number((double)val);
+  }
+  bool number_unsigned(number_unsigned_t val) override {
+    return number((double)val);
+  }
+  bool number_float(number_float_t val, const string_t&) override {
+    return number(val);
+  }
+  bool string(string_t& val) override {
+    return scalar({type_t::string, false, 0, val});
+  }
+  bool start_object(std::size_t) override {
+    depth += 1;
+    if (depth == 3 && group_name != "asset") return begin_element();
+    if (depth > property_depth()) value = {};
+    return true;
+  }
+  bool key(string_t& val) override {
+    if (depth == 1) {
+      group_name = val;
+    } else if (depth == property_depth()) {
+      property_name = val;
+    } else if (depth == 2) {
+      element_name = val;
+    }
+    return true;
+  }
+  bool end_object() override {
+    if (depth == property_depth() + 1 && !property(value)) return false;
+    if (depth == 3 && group_name != "asset" && !end_element()) return false;
+    depth -= 1;
+    return true;
+  }
+  bool start_array(std::size_t) override {
+    depth += 1;
+    if (depth == property_depth() + 1) {
+      value = {type_t::array};
+    } else if (depth > property_depth() + 1) {
+      value.type = type_t::invalid;
+    }
+    return true;
+  }
+  bool end_array() override {
+    if (depth == property_depth() + 1 && !property(value)) return false;
+    depth -= 1;
+    return true;
+  }
+  bool parse_error(std::size_t, const std::string&,
+      const nlohmann::detail::exception&) override {
+    return false;
+  }
+
+  // properties are inside elements, except for the asset group
+  int property_depth() const { return group_name == "asset" ? 2 : 3; }
+
+  // values
+  bool number(double val) {
+    if (depth == property_depth() + 1 && value.type == type_t::array) {
+      value.numbers.push_back((float)val);
+      return true;
+    }
+    return scalar({type_t::number, false, val});
+  }
+  bool scalar(const value_t& val) {
+    if (depth == property_depth()) return property(val);
+    if (depth > property_depth()) value.type = type_t::invalid;
+    return true;
+  }
+
+  // elements
+  bool begin_element() {
+    has_lookat = false;
+    if (group_name == "cameras") {
+      camera       = add_camera(scene);
+      camera->name = element_name;
+    } else if (group_name == "environments") {
+      environment       = add_environment(scene);
+      environment->name = element_name;
+    } else if (group_name == "materials") {
+      material       = add_material(scene);
+      material->name = element_name;
+    } else if (group_name == "objects") {
+      object       = add_object(scene);
+      object->name = element_name;
+    }
+    return true;
+  }
+  bool end_element() {
+    if (camera && has_lookat) {
+      camera->frame = lookat_frame(lookat.x, lookat.y, lookat.z);
+      camera->focus = length(lookat.x - lookat.y);
+    }
+    if (environment && has_lookat) {
+      environment->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
+    }
+    if (object && has_lookat) {
+      object->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
+    }
+    camera      = nullptr;
+    environment = nullptr;
+    material    = nullptr;
+    object      = nullptr;
+    return true;
+  }
+
+  // element properties; unknown properties are ignored
+  bool property(const value_t& value) {
+    auto& name = property_name;
+    if (name == "lookat" && (camera || environment || object)) {
+      has_lookat = true;
+      return get_value(value, lookat);
+    }
+    if (group_name == "asset") {
+      if (name == "copyright") return get_value(value, scene->copyright);
+    } else if (camera) {
+      if (name == "frame") return get_value(value, camera->frame);
+      if (name == "orthographic") return get_value(value, camera->orthographic);
+      if (name == "lens") return get_value(value, camera->lens);
+      if (name == "aspect") return get_value(value, camera->aspect);
+      if (name == "film") return get_value(value, camera->film);
+      if (name == "focus") return get_value(value, camera->focus);
+      if (name == "aperture") return get_value(value, camera->aperture);
+    } else if (environment) {
+      if (name == "frame") return get_value(value, environment->frame);
+      if (name == "emission") return get_value(value, environment->emission);
+      if (name == "emission_tex") return get_ref(value, environment);
+    } else if (material) {
+      if (name == "emission") return get_value(value, material->emission);
+      if (name == "color") return get_value(value, material->color);
+      if (name == "metallic") return get_value(value, material->metallic);
+      if (name == "specular") return get_value(value, material->specular);
+      if (name == "roughness") return get_value(value, material->roughness);
+      if (name == "coat") return get_value(value, material->coat);
+      if (name == "transmission")
+        return get_value(value, material->transmission);
+      if (name == "translucency")
+        return get_value(value, material->translucency);
+      if (name == "thin") return get_value(value, material->thin);
+      if (name == "ior") return get_value(value, material->ior);
+      if (name == "trdepth") return get_value(value, material->trdepth);
+      if (name == "scattering") return get_value(value, material->scattering);
+      if (name == "scanisotropy")
+        return get_value(value, material->scanisotropy);
+      if (name == "opacity") return get_value(value, material->opacity);
+      if (name == "displacement")
+        return get_value(value, material->displacement);
+      if (name == "subdivisions")
+        return get_value(value, material->subdivisions);
+      if (name == "smooth") return get_value(value, material->smooth);
+      if (name == "subdivision_error")
+        return get_value(value, material->subdivision_error);
+      for (auto texture : {"emission_tex", "color_tex", "metallic_tex",
+               "specular_tex", "transmission_tex", "translucency_tex",
+               "roughness_tex", "scattering_tex", "opacity_tex", "normal_tex",
+               "displacement_tex"}) {
+        if (name == texture) return get_ref(value, material);
+      }
+    } else if (object) {
+      if (name == "frame") return get_value(value, object->frame);
+      if (name == "material" || name == "shape" || name == "subdiv" ||
+          name == "instance")
+        return get_ref(value, object);
+    }
+    return true;
+  }
+
+  // conversions
+  bool get_ref(const value_t& value, const void* element) {
+    if (value.type != type_t::string) return false;
+    refs[element][property_name] = value.text;
+    return true;
+  }
+  static bool get_value(const value_t& value, std::string& result) {
+    if (value.type != type_t::string) return false;
+    result = value.text;
+    return true;
+  }
+  static bool get_value(const value_t& value, bool& result) {
+    if (value.type != type_t::boolean) return false;
+    result = value.flag;
+    return true;
+  }
+  static bool get_value(const value_t& value, int& result) {
+    if (value.type != type_t::number) return false;
+    result = (int)value.number;
+    return true;
+  }
+  static bool get_value(const value_t& value, float& result) {
+    if (value.type != type_t::number) return false;
+    result = (float)value.number;
+    return true;
+  }
+  static bool get_values(const value_t& value, float* result, size_t size) {
+    if (value.type != type_t::array || value.numbers.size() < size)
+      return false;
+    std::copy(value.numbers.begin(), value.numbers.begin() + size, result);
+    return true;
+  }
+  static bool get_value(const value_t& value, vec3f& result) {
+    return get_values(value, &result.x, 3);
+  }
+  static bool get_value(const value_t& value, mat3f& result) {
+    return get_values(value, &result.x.x, 9);
+  }
+  static bool get_value(const value_t& value, frame3f& result) {
+    return get_values(value, &result.x.x, 12);
+  }
+};
+
+// Load a scene in the builtin JSON format.
 static bool load_json_scene(const std::string& filename, scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel) {
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool notextures, bool noshapes, asset_callback asset_cb) {
   auto parse_error = [filename, &error]() {
     error = filename + ": parse error";
     return false;
@@ -1080,255 +2079,178 @@ static bool load_json_scene(const std::string& filename, scn::model* scene,
   auto progress = vec2i{0, 2};
   if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
 
-  // open file
-  auto js = json{};
-  if (!load_json(filename, js, error)) return false;
-
-  // gets a json value
-  auto get_value = [](const json& ejs, const std::string& name,
-                       auto& value) -> bool {
-    if (!ejs.contains(name)) return true;
-    try {
-      ejs.at(name).get_to(value);
-      return true;
-    } catch (...) {
-      return false;
-    }
+  // parse the file, creating elements as they are read
+  auto text = ""s;
+  if (!load_text(filename, text, error)) return false;
+  auto reader = json_scene_reader{scene};
+  if (!json::sax_parse(text, &reader)) return parse_error();
+  text = {};
+
+  // sort elements by name, as in the order of json objects
+  auto sort_elements = [](auto& elements) {
+    std::stable_sort(elements.begin(), elements.end(),
+        [](auto a, auto b) { return a->name < b->name; });
   };
-
-  // parse yaml reference
-  auto get_ref = [&material_error, &get_value](const json& ejs,
-                     const std::string& name, auto& value,
-                     const auto& refs) -> bool {
-    if (!ejs.contains(name)) return true;
-    auto ref = ""s;
-    if (!get_value(ejs, name, ref)) return false;
-    if (ref == "") {
-      value = nullptr;
-    } else {
-      if (refs.find(ref) == refs.end()) return material_error(ref);
-      value = refs.at(ref);
-    }
-    return true;
+  sort_elements(scene->cameras);
+  sort_elements(scene->environments);
+  sort_elements(scene->materials);
+  sort_elements(scene->objects);
+
+  // get a reference by name
+  auto get_ref = [&reader](const void* element,
+                     const std::string& name) -> const std::string* {
+    auto it = reader.refs.find(element);
+    if (it == reader.refs.end()) return nullptr;
+    auto rit = it->second.find(name);
+    if (rit == it->second.end()) return nullptr;
+    return &rit->second;
   };
 
   // parse json reference
   auto ctexture_map = std::unordered_map<std::string, scn::texture*>{
       {"", nullptr}};
-  auto get_ctexture = [scene, &ctexture_map, &get_value](const json& ejs,
-                          const std::string& name, scn::texture*& value,
-                          const std::string& dirname = "textures/") -> bool {
-    if (!ejs.contains(name)) return true;
-    auto path = ""s;
-    if (!get_value(ejs, name, path)) return false;
-    if (path == "") return true;
-    auto it = ctexture_map.find(path);
+  auto get_ctexture = [scene, &ctexture_map, &get_ref](const void* element,
+                          const std::string& name, scn::texture*& value) {
+    auto path = get_ref(element, name);
+    if (!path || *path == "") return;
+    auto it = ctexture_map.find(*path);
     if (it != ctexture_map.end()) {
       value = it->second;
-      return true;
+      return;
     }
-    auto texture       = add_texture(scene, path);
-    ctexture_map[path] = texture;
-    value              = texture;
-    return true;
+    auto texture        = add_texture(scene, *path);
+    ctexture_map[*path] = texture;
+    value               = texture;
   };
 
   // parse json reference
   auto stexture_map = std::unordered_map<std::string, scn::texture*>{
       {"", nullptr}};
-  auto get_stexture = [scene, &stexture_map, &get_value](const json& ejs,
-                          const std::string& name, scn::texture*& value,
-                          const std::string& dirname = "textures/") -> bool {
-    if (!ejs.contains(name)) return true;
-    auto path = ""s;
-    if (!get_value(ejs, name, path)) return false;
-    if (path == "") return true;
-    auto it = stexture_map.find(path);
+  auto get_stexture = [scene, &stexture_map, &get_ref](const void* element,
+                          const std::string& name, scn::texture*& value) {
+    auto path = get_ref(element, name);
+    if (!path || *path == "") return;
+    auto it = stexture_map.find(*path);
     if (it != stexture_map.end()) {
       value = it->second;
-      return true;
+      return;
     }
-    auto texture       = add_texture(scene, path);
-    stexture_map[path] = texture;
-    value              = texture;
-    return true;
+    auto texture        = add_texture(scene, *path);
+    stexture_map[*path] = texture;
+    value               = texture;
   };
 
   // parse json reference
   auto shape_map = std::unordered_map<std::string, scn::shape*>{{"", nullptr}};
-  auto get_shape = [scene, &shape_map, &get_value](const json& ejs,
-                       const std::string& name, scn::shape*& value,
-                       const std::string& dirname = "shapes/") -> bool {
-    if (!ejs.contains(name)) return true;
-    auto path = ""s;
-    if (!get_value(ejs, name, path)) return false;
-    if (path == "") return true;
-    auto it = shape_map.find(path);
+  auto get_shape = [scene, &shape_map, &get_ref](const void* element,
+                       const std::string& name, scn::shape*& value) {
+    auto path = get_ref(element, name);
+    if (!path || *path == "") return;
+    auto it = shape_map.find(*path);
     if (it != shape_map.end()) {
       value = it->second;
-      return it->second;
+      return;
     }
-    auto shape      = add_shape(scene, path);
-    shape_map[path] = shape;
-    value           = shape;
-    return true;
+    auto shape       = add_shape(scene, *path);
+    shape_map[*path] = shape;
+    value            = shape;
   };
 
   // parse json reference
   auto subdiv_map = std::unordered_map<std::string, scn::subdiv*>{
       {"", nullptr}};
-  auto get_subdiv = [scene, &subdiv_map, &get_value](const json& ejs,
-                        const std::string& name, scn::subdiv*& value,
-                        const std::string& dirname = "subdivs/") -> bool {
-    if (!ejs.contains(name)) return true;
-    auto path = ""s;
-    if (!get_value(ejs, name, path)) return false;
-    if (path == "") return true;
-    auto it = subdiv_map.find(path);
+  auto get_subdiv = [scene, &subdiv_map, &get_ref](const void* element,
+                        const std::string& name, scn::subdiv*& value) {
+    auto path = get_ref(element, name);
+    if (!path || *path == "") return;
+    auto it = subdiv_map.find(*path);
     if (it != subdiv_map.end()) {
       value = it->second;
-      return true;
+      return;
     }
-    auto subdiv      = add_subdiv(scene, path);
-    subdiv_map[path] = subdiv;
-    value            = subdiv;
-    return true;
+    auto subdiv       = add_subdiv(scene, *path);
+    subdiv_map[*path] = subdiv;
+    value             = subdiv;
   };
 
   // load json instance
   auto instance_map = std::unordered_map<std::string, scn::instance*>{
       {"", nullptr}};
-  auto get_instance = [scene, &instance_map, &get_value](const json& ejs,
-                          const std::string& name, scn::instance*& value,
-                          const std::string& dirname = "instances/") -> bool {
-    if (!ejs.contains(name)) return true;
-    auto path = ""s;
-    if (!get_value(ejs, name, path)) return false;
-    if (path == "") return true;
-    auto it = instance_map.find(path);
+  auto get_instance = [scene, &instance_map, &get_ref](const void* element,
+                          const std::string& name, scn::instance*& value) {
+    auto path = get_ref(element, name);
+    if (!path || *path == "") return;
+    auto it = instance_map.find(*path);
     if (it != instance_map.end()) {
       value = it->second;
-      return true;
+      return;
     }
-    auto instance      = add_instance(scene, path);
-    instance_map[path] = instance;
-    value              = instance;
-    return true;
+    auto instance       = add_instance(scene, *path);
+    instance_map[*path] = instance;
+    value               = instance;
   };
 
-  // material map
-  auto material_map = std::unordered_map<std::string, scn::material*>{
-      {"", nullptr}};
-
   // handle progress
   if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
 
-  // asset
-  if (js.contains("asset")) {
-    auto& ejs = js.at("asset");
-    if (!get_value(ejs, "copyright", scene->copyright)) return false;
-  }
-
-  // cameras
-  if (js.contains("cameras")) {
-    for (auto& [name, ejs] : js.at("cameras").items()) {
-      auto camera  = add_camera(scene);
-      camera->name = name;
-      if (!get_value(ejs, "frame", camera->frame)) return false;
-      if (!get_value(ejs, "orthographic", camera->orthographic)) return false;
-      if (!get_value(ejs, "lens", camera->lens)) return false;
-      if (!get_value(ejs, "aspect", camera->aspect)) return false;
-      if (!get_value(ejs, "film", camera->film)) return false;
-      if (!get_value(ejs, "focus", camera->focus)) return false;
-      if (!get_value(ejs, "aperture", camera->aperture)) return false;
-      if (ejs.contains("lookat")) {
-        auto lookat = identity3x3f;
-        if (!get_value(ejs, "lookat", lookat)) return false;
-        camera->frame = lookat_frame(lookat.x, lookat.y, lookat.z);
-        camera->focus = length(lookat.x - lookat.y);
-      }
-    }
+  // resolve references, in the order elements are listed in the format
+  for (auto environment : scene->environments) {
+    get_ctexture(environment, "emission_tex", environment->emission_tex);
   }
-  if (js.contains("environments")) {
-    for (auto& [name, ejs] : js.at("environments").items()) {
-      auto environment  = add_environment(scene);
-      environment->name = name;
-      if (!get_value(ejs, "frame", environment->frame)) return false;
-      if (!get_value(ejs, "emission", environment->emission)) return false;
-      if (!get_ctexture(
-              ejs, "emission_tex", environment->emission_tex, "environments/"))
-        return false;
-      if (ejs.contains("lookat")) {
-        auto lookat = identity3x3f;
-        if (!get_value(ejs, "lookat", lookat)) return false;
-        environment->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
-      }
+  auto material_map = std::unordered_map<std::string, scn::material*>{
+      {"", nullptr}};
+  for (auto material : scene->materials) {
+    get_ctexture(material, "emission_tex", material->emission_tex);
+    get_ctexture(material, "color_tex", material->color_tex);
+    get_stexture(material, "metallic_tex", material->metallic_tex);
+    get_stexture(material, "specular_tex", material->specular_tex);
+    get_stexture(material, "transmission_tex", material->transmission_tex);
+    get_stexture(material, "translucency_tex", material->translucency_tex);
+    get_stexture(material, "roughness_tex", material->roughness_tex);
+    get_ctexture(material, "scattering_tex", material->scattering_tex);
+    get_stexture(material, "opacity_tex", material->opacity_tex);
+    get_ctexture(material, "normal_tex", material->normal_tex);
+    get_stexture(material, "displacement_tex", material->displacement_tex);
+    material_map[material->name] = material;
+  }
+  for (auto object : scene->objects) {
+    if (auto name = get_ref(object, "material"); name) {
+      auto it = material_map.find(*name);
+      if (it == material_map.end()) return material_error(*name);
+      object->material = it->second;
     }
+    get_shape(object, "shape", object->shape);
+    get_subdiv(object, "subdiv", object->subdiv);
+    get_instance(object, "instance", object->instance);
   }
-  if (js.contains("materials")) {
-    for (auto& [name, ejs] : js.at("materials").items()) {
-      auto material  = add_material(scene);
-      material->name = name;
-      if (!get_value(ejs, "emission", material->emission)) return false;
-      if (!get_value(ejs, "color", material->color)) return false;
-      if (!get_value(ejs, "metallic", material->metallic)) return false;
-      if (!get_value(ejs, "specular", material->specular)) return false;
-      if (!get_value(ejs, "roughness", material->roughness)) return false;
-      if (!get_value(ejs, "coat", material->coat)) return false;
-      if (!get_value(ejs, "transmission", material->transmission)) return false;
-      if (!get_value(ejs, "translucency", material->translucency)) return false;
-      if (!get_value(ejs, "thin", material->thin)) return false;
-      if (!get_value(ejs, "ior", material->ior)) return false;
-      if (!get_value(ejs, "trdepth", material->trdepth)) return false;
-      if (!get_value(ejs, "scattering", material->scattering)) return false;
-      if (!get_value(ejs, "scanisotropy", material->scanisotropy)) return false;
-      if (!get_value(ejs, "opacity", material->opacity)) return false;
-      if (!get_value(ejs, "coat", material->coat)) return false;
-      if (!get_value(ejs, "displacement", material->displacement)) return false;
-      if (!get_ctexture(ejs, "emission_tex", material->emission_tex))
-        return false;
-      if (!get_ctexture(ejs, "color_tex", material->color_tex)) return false;
-      if (!get_stexture(ejs, "metallic_tex", material->metallic_tex))
-        return false;
-      if (!get_stexture(ejs, "specular_tex", material->specular_tex))
-        return false;
-      if (!get_stexture(ejs, "transmission_tex", material->transmission_tex))
-        return false;
-      if (!get_stexture(ejs, "translucency_tex", material->translucency_tex))
-        return false;
-      if (!get_stexture(ejs, "roughness_tex", material->roughness_tex))
-        return false;
-      if (!get_ctexture(ejs, "scattering_tex", material->scattering_tex))
-        return false;
-      if (!get_stexture(ejs, "opacity_tex", material->opacity_tex))
-        return false;
-      if (!get_ctexture(ejs, "normal_tex", material->normal_tex)) return false;
-      if (!get_stexture(ejs, "displacement_tex", material->displacement_tex))
-        return false;
-      if (!get_value(ejs, "subdivisions", material->subdivisions))
-        return false;  // hack fir subd
-      if (!get_value(ejs, "smooth", material->smooth))
-        return false;  // hack for subd
-      material_map[material->name] = material;
-    }
-  }
-  if (js.contains("objects")) {
-    for (auto& [name, ejs] : js.at("objects").items()) {
-      auto object  = add_object(scene);
-      object->name = name;
-      if (!get_value(ejs, "frame", object->frame)) return false;
-      if (ejs.contains("lookat")) {
-        auto lookat = identity3x3f;
-        if (!get_value(ejs, "lookat", lookat)) return false;
-        object->frame = lookat_frame(lookat.x, lookat.y, lookat.z, true);
+  reader.refs = {};
+
+  // stream the cameras, and the objects that do not wait for loaded data
+  auto asset_objects =
+      std::unordered_map<const void*, std::vector<scn::object*>>{};
+  auto object_pending = std::unordered_map<const scn::object*, int>{};
+  if (asset_cb) {
+    for (auto camera : scene->cameras) asset_cb(camera, nullptr, nullptr);
+    for (auto object : scene->objects) {
+      for (auto asset : {(const void*)object->shape,
+               (const void*)object->instance}) {
+        if (!asset) continue;
+        asset_objects[asset].push_back(object);
+        object_pending[object] += 1;
       }
-      if (!get_ref(ejs, "material", object->material, material_map))
-        return false;
-      if (!get_shape(ejs, "shape", object->shape)) return false;
-      if (!get_subdiv(ejs, "subdiv", object->subdiv)) return false;
-      if (!get_instance(ejs, "instance", object->instance)) return false;
+      if (!object_pending[object]) asset_cb(nullptr, object, nullptr);
     }
   }
+  auto stream_objects = [&](const void* asset) {
+    auto it = asset_objects.find(asset);
+    if (it == asset_objects.end()) return;
+    for (auto object : it->second) {
+      if (--object_pending[object] == 0) asset_cb(nullptr, object, nullptr);
+    }
+  };
+  auto stream_texture = [&](const scn::texture* texture) {
+    asset_cb(nullptr, nullptr, texture);
+  };
 
   // handle progress
   progress.y += scene->shapes.size();
@@ -1349,50 +2271,120 @@ static bool load_json_scene(const std::string& filename, scn::model* scene,
            (name + extensions.front());
   };
 
+  // collect asset loads, with their progress messages and the streaming
+  // of the loaded asset
+  auto asset_messages = std::vector<std::string>{};
+  auto asset_loads    = std::vector<std::function<bool(std::string&)>>{};
+  auto asset_streams  = std::vector<std::function<void()>>{};
+  auto add_asset      = [&](const std::string&               message,
+                           std::function<bool(std::string&)> load,
+                           std::function<void()>             stream) {
+    asset_messages.push_back(message);
+    asset_loads.push_back(std::move(load));
+    asset_streams.push_back(std::move(stream));
+  };
   // load shapes
   shape_map.erase("");
   for (auto [name, shape] : shape_map) {
-    if (progress_cb) progress_cb("load shape", progress.x++, progress.y);
-    auto path = get_filename(name, "shapes", {".ply", ".obj"});
-    if (!yshp::load_shape(path, shape->points, shape->lines, shape->triangles,
-            shape->quads, shape->positions, shape->normals, shape->texcoords,
-            shape->colors, shape->radius, error))
-      return dependent_error();
+    auto path = get_filename(name, "shapes", {".ply", ".obj"}).string();
+    add_asset("load shape",
+        [path, shape = shape, noshapes](std::string& error) {
+          if (noshapes) {
+            shape->filename = path;
+            return load_shape_bounds(path, shape->bounds, error);
+          }
+          return yshp::load_shape(path, shape->points, shape->lines,
+              shape->triangles, shape->quads, shape->positions,
+              shape->normals, shape->texcoords, shape->colors, shape->radius,
+              error);
+        },
+        [&, shape = shape]() { stream_objects(shape); });
   }
   // load subdivs
   subdiv_map.erase("");
   for (auto [name, subdiv] : subdiv_map) {
-    if (progress_cb) progress_cb("load subdiv", progress.x++, progress.y);
-    auto path = get_filename(name, "subdivs", {".obj"});
-    if (!yshp::load_fvshape(path, subdiv->quadspos, subdiv->quadsnorm,
-            subdiv->quadstexcoord, subdiv->positions, subdiv->normals,
-            subdiv->texcoords, error))
-      return dependent_error();
+    auto path = get_filename(name, "subdivs", {".obj"}).string();
+    add_asset("load subdiv",
+        [path, subdiv = subdiv](std::string& error) {
+          return yshp::load_fvshape(path, subdiv->quadspos, subdiv->quadsnorm,
+              subdiv->quadstexcoord, subdiv->positions, subdiv->normals,
+              subdiv->texcoords, error);
+        },
+        [] {});
   }
   // load textures
   ctexture_map.erase("");
   for (auto [name, texture] : ctexture_map) {
-    if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     auto path = get_filename(
-        name, "textures", {".hdr", ".exr", ".png", ".jpg"});
-    if (!load_image(path, texture->colorf, texture->colorb, error))
-      return dependent_error();
+        name, "textures", {".hdr", ".exr", ".png", ".jpg"}).string();
+    add_asset("load texture",
+        [path, texture = texture, notextures](std::string& error) {
+          if (notextures) {
+            texture->filename = path;
+            return true;
+          }
+          return load_image(path, texture->colorf, texture->colorb, error);
+        },
+        [&, texture = texture]() { stream_texture(texture); });
   }
   // load textures
   stexture_map.erase("");
   for (auto [name, texture] : stexture_map) {
-    if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     auto path = get_filename(
-        name, "textures", {".hdr", ".exr", ".png", ".jpg"});
-    if (!load_image(path, texture->scalarf, texture->scalarb, error))
-      return dependent_error();
+        name, "textures", {".hdr", ".exr", ".png", ".jpg"}).string();
+    add_asset("load texture",
+        [path, texture = texture, notextures](std::string& error) {
+          if (notextures) {
+            texture->filename = path;
+            texture->scalar   = true;
+            return true;
+          }
+          return load_image(path, texture->scalarf, texture->scalarb, error);
+        },
+        [&, texture = texture]() { stream_texture(texture); });
   }
   // load instances
   instance_map.erase("");
   for (auto [name, instance] : instance_map) {
-    if (progress_cb) progress_cb("load instance", progress.x++, progress.y);
-    auto path = get_filename(name, "instances", {".ply"});
-    if (!load_instance(path, instance->frames, error)) return dependent_error();
+    auto path = get_filename(name, "instances", {".ply"}).string();
+    add_asset("load instance",
+        [path, instance = instance](std::string& error) {
+          return load_instance(path, instance->frames, error);
+        },
+        [&, instance = instance]() { stream_objects(instance); });
+  }
+
+  // load assets concurrently, since their latency dominates on slow storage
+  auto asset_errors   = std::vector<std::string>(asset_loads.size());
+  auto asset_failed   = std::vector<int>(asset_loads.size(), 0);
+  auto progress_mutex = std::mutex{};
+  auto load_asset     = [&](int idx) {
+    if (progress_cb) {
+      auto lock = std::lock_guard<std::mutex>{progress_mutex};
+      progress_cb(asset_messages[idx], progress.x++, progress.y);
+    }
+    asset_failed[idx] = !asset_loads[idx](asset_errors[idx]);
+    if (asset_cb && !asset_failed[idx]) {
+      auto lock = std::lock_guard<std::mutex>{progress_mutex};
+      asset_streams[idx]();
+    }
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)asset_loads.size(); idx++) load_asset(idx);
+  } else {
+    common::parallel_for((int)asset_loads.size(), load_asset);
+  }
+
+  // report the errors of all failed assets
+  auto asset_error = ""s;
+  for (auto idx = 0; idx < (int)asset_loads.size(); idx++) {
+    if (!asset_failed[idx]) continue;
+    if (!asset_error.empty()) asset_error += "; ";
+    asset_error += asset_errors[idx];
+  }
+  if (!asset_error.empty()) {
+    error = asset_error;
+    return dependent_error();
   }
 
   // fix scene
@@ -1410,7 +2402,7 @@ static bool load_json_scene(const std::string& filename, scn::model* scene,
 // Save a scene in the builtin JSON format.
 static bool save_json_scene(const std::string& filename,
     const scn::model* scene, std::string& error, progress_callback progress_cb,
-    bool noparallel) {
+    bool noparallel, bool incremental) {
   auto dependent_error = [filename, &error]() {
     error = filename + ": error in " + error;
     return false;
@@ -1452,7 +2444,7 @@ static bool save_json_scene(const std::string& filename,
   for (auto& camera : scene->cameras) {
     auto& ejs = js["cameras"][camera->name];
     add_opt(ejs, "frame", camera->frame, def_cam.frame);
-    add_opt(ejs, "ortho", camera->orthographic, def_cam.orthographic);
+    add_opt(ejs, "orthographic", camera->orthographic, def_cam.orthographic);
     add_opt(ejs, "lens", camera->lens, def_cam.lens);
     add_opt(ejs, "aspect", camera->aspect, def_cam.aspect);
     add_opt(ejs, "film", camera->film, def_cam.film);
@@ -1507,6 +2499,8 @@ static bool save_json_scene(const std::string& filename,
         def_material.subdivisions);  // hack for subd
     add_opt(
         ejs, "smooth", material->smooth, def_material.smooth);  // hack for subd
+    add_opt(ejs, "subdivision_error", material->subdivision_error,
+        def_material.subdivision_error);  // hack for subd
   }
 
   auto def_object = object{};
@@ -1535,46 +2529,68 @@ static bool save_json_scene(const std::string& filename,
   };
 
   // save shapes
+  auto assets = std::vector<asset_save>{};
   for (auto shape : scene->shapes) {
-    if (progress_cb) progress_cb("save shape", progress.x++, progress.y);
-    auto path = get_filename(shape->name, "shapes", ".ply");
-    if (!yshp::save_shape(path, shape->points, shape->lines, shape->triangles,
-            shape->quads, shape->positions, shape->normals, shape->texcoords,
-            shape->colors, shape->radius, error))
-      return dependent_error();
+    auto& asset   = assets.emplace_back();
+    asset.message = "save shape";
+    asset.path    = get_filename(shape->name, "shapes", ".ply").string();
+    asset.hash    = hash_assets(shape->points, shape->lines, shape->triangles,
+        shape->quads, shape->positions, shape->normals, shape->texcoords,
+        shape->colors, shape->radius);
+    asset.save    = [path = asset.path, shape](std::string& error) {
+      return yshp::save_shape(path, shape->points, shape->lines,
+          shape->triangles, shape->quads, shape->positions, shape->normals,
+          shape->texcoords, shape->colors, shape->radius, error);
+    };
   }
 
   // save subdivs
   for (auto subdiv : scene->subdivs) {
-    if (progress_cb) progress_cb("save subdiv", progress.x++, progress.y);
-    auto path = get_filename(subdiv->name, "subdivs", ".obj");
-    if (!yshp::save_fvshape(path, subdiv->quadspos, subdiv->quadsnorm,
-            subdiv->quadstexcoord, subdiv->positions, subdiv->normals,
-            subdiv->texcoords, error))
-      return dependent_error();
+    auto& asset   = assets.emplace_back();
+    asset.message = "save subdiv";
+    asset.path    = get_filename(subdiv->name, "subdivs", ".obj").string();
+    asset.hash    = hash_assets(subdiv->quadspos, subdiv->quadsnorm,
+        subdiv->quadstexcoord, subdiv->positions, subdiv->normals,
+        subdiv->texcoords);
+    asset.save    = [path = asset.path, subdiv](std::string& error) {
+      return yshp::save_fvshape(path, subdiv->quadspos, subdiv->quadsnorm,
+          subdiv->quadstexcoord, subdiv->positions, subdiv->normals,
+          subdiv->texcoords, error);
+    };
   }
 
   // save instances
   for (auto instance : scene->instances) {
-    if (progress_cb) progress_cb("save instance", progress.x++, progress.y);
-    auto path = get_filename(instance->name, "instances", ".ply");
-    if (!save_instance(path, instance->frames, error)) return dependent_error();
+    auto& asset   = assets.emplace_back();
+    asset.message = "save instance";
+    asset.path = get_filename(instance->name, "instances", ".ply").string();
+    asset.hash = hash_assets(instance->frames);
+    asset.save = [path = asset.path, instance](std::string& error) {
+      return save_instance(path, instance->frames, error);
+    };
   }
 
   // save textures
   for (auto texture : scene->textures) {
-    if (progress_cb) progress_cb("save texture", progress.x++, progress.y);
-    auto path = get_filename(texture->name, "textures",
+    auto& asset   = assets.emplace_back();
+    asset.message = "save texture";
+    asset.path    = get_filename(texture->name, "textures",
         (!texture->colorf.empty() || !texture->scalarf.empty()) ? ".hdr"
-                                                                : ".png");
-    if (!texture->colorf.empty() || !texture->colorb.empty()) {
-      if (!save_image(path, texture->colorf, texture->colorb, error))
-        return dependent_error();
-    } else {
-      if (!save_image(path, texture->scalarf, texture->scalarb, error))
-        return dependent_error();
-    }
+                                                                : ".png")
+                     .string();
+    asset.hash = hash_assets(texture->colorf, texture->colorb,
+        texture->scalarf, texture->scalarb);
+    asset.save = [path = asset.path, texture](std::string& error) {
+      if (!texture->colorf.empty() || !texture->colorb.empty()) {
+        return save_image(path, texture->colorf, texture->colorb, error);
+      } else {
+        return save_image(path, texture->scalarf, texture->scalarb, error);
+      }
+    };
   }
+  if (!save_assets(filename, assets, error, progress_cb, progress, noparallel,
+          incremental))
+    return dependent_error();
 
   // done
   if (progress_cb) progress_cb("save done", progress.x++, progress.y);
@@ -1769,7 +2785,8 @@ static bool load_obj_scene(const std::string& filename, scn::model* scene,
 }
 
 static bool save_obj_scene(const std::string& filename, const scn::model* scene,
-    std::string& error, progress_callback progress_cb, bool noparallel) {
+    std::string& error, progress_callback progress_cb, bool noparallel,
+    bool incremental) {
   auto shape_error = [filename, &error]() {
     error = filename + ": empty shape";
     return false;
@@ -1886,20 +2903,28 @@ static bool save_obj_scene(const std::string& filename, const scn::model* scene,
     return sfs::path(filename).parent_path() / group / (name + extension);
   };
 
+  auto assets = std::vector<asset_save>{};
   // save textures
   for (auto texture : scene->textures) {
-    if (progress_cb) progress_cb("save texture", progress.x++, progress.y);
-    auto path = get_filename(texture->name, "textures",
+    auto& asset   = assets.emplace_back();
+    asset.message = "save texture";
+    asset.path    = get_filename(texture->name, "textures",
         (!texture->colorf.empty() || !texture->scalarf.empty()) ? ".hdr"
-                                                                : ".png");
-    if (!texture->colorf.empty() || !texture->colorb.empty()) {
-      if (!save_image(path, texture->colorf, texture->colorb, error))
-        return dependent_error();
-    } else {
-      if (!save_image(path, texture->scalarf, texture->scalarb, error))
-        return dependent_error();
-    }
+                                                                : ".png")
+                     .string();
+    asset.hash = hash_assets(texture->colorf, texture->colorb,
+        texture->scalarf, texture->scalarb);
+    asset.save = [path = asset.path, texture](std::string& error) {
+      if (!texture->colorf.empty() || !texture->colorb.empty()) {
+        return save_image(path, texture->colorf, texture->colorb, error);
+      } else {
+        return save_image(path, texture->scalarf, texture->scalarb, error);
+      }
+    };
   }
+  if (!save_assets(filename, assets, error, progress_cb, progress, noparallel,
+          incremental))
+    return dependent_error();
 
   // done
   if (progress_cb) progress_cb("save scene", progress.x++, progress.y);
@@ -1978,6 +3003,135 @@ static bool save_ply_scene(const std::string& filename, const scn::model* scene,
 // -----------------------------------------------------------------------------
 namespace yocto::sceneio {
 
+// Read count elements of num floats from an accessor. Float accessors are
+// copied directly from the buffer, while others are converted by cgltf.
+static void read_gltf_floats(const cgltf_accessor* gacc, float* values,
+    int num, size_t count) {
+  auto gview = gacc->buffer_view;
+  if (!gacc->is_sparse && gview && gview->buffer->data &&
+      gacc->component_type == cgltf_component_type_r_32f &&
+      cgltf_num_components(gacc->type) == num) {
+    auto data = (const byte*)gview->buffer->data + gview->offset +
+                gacc->offset;
+    auto size = sizeof(float) * num;
+    if (gacc->stride == size) {
+      memcpy(values, data, size * count);
+    } else {
+      for (auto i = (size_t)0; i < count; i++)
+        memcpy(values + i * num, data + i * gacc->stride, size);
+    }
+  } else {
+    for (auto i = (size_t)0; i < count; i++)
+      cgltf_accessor_read_float(gacc, i, values + i * num, num);
+  }
+}
+
+// Read all indices from an accessor, converting integer types directly.
+static void read_gltf_indices(
+    const cgltf_accessor* gacc, std::vector<int>& indices) {
+  indices.resize(gacc->count);
+  auto gview = gacc->buffer_view;
+  if (gacc->is_sparse || !gview || !gview->buffer->data) {
+    for (auto i = (size_t)0; i < gacc->count; i++)
+      cgltf_accessor_read_uint(gacc, i, (uint*)&indices[i], 1);
+    return;
+  }
+  auto data = (const byte*)gview->buffer->data + gview->offset + gacc->offset;
+  auto read = [&](auto type) {
+    for (auto i = (size_t)0; i < gacc->count; i++) {
+      auto index = type;
+      memcpy(&index, data + i * gacc->stride, sizeof(index));
+      indices[i] = (int)index;
+    }
+  };
+  switch (gacc->component_type) {
+    case cgltf_component_type_r_8u: read((uint8_t)0); break;
+    case cgltf_component_type_r_16u: read((uint16_t)0); break;
+    case cgltf_component_type_r_32u: read((uint32_t)0); break;
+    default:
+      for (auto i = (size_t)0; i < gacc->count; i++)
+        cgltf_accessor_read_uint(gacc, i, (uint*)&indices[i], 1);
+      break;
+  }
+}
+
+// Convert a gltf primitive to a shape
+static bool load_gltf_primitive(
+    const cgltf_primitive* gprim, scn::shape* shape) {
+  for (auto aid = 0; aid < gprim->attributes_count; aid++) {
+    auto gattr    = &gprim->attributes[aid];
+    auto semantic = std::string(gattr->name ? gattr->name : "");
+    auto gacc     = gattr->data;
+    if (semantic == "POSITION") {
+      shape->positions.resize(gacc->count);
+      read_gltf_floats(gacc, (float*)shape->positions.data(), 3, gacc->count);
+    } else if (semantic == "NORMAL") {
+      shape->normals.resize(gacc->count);
+      read_gltf_floats(gacc, (float*)shape->normals.data(), 3, gacc->count);
+    } else if (semantic == "TEXCOORD" || semantic == "TEXCOORD_0") {
+      shape->texcoords.resize(gacc->count);
+      read_gltf_floats(gacc, (float*)shape->texcoords.data(), 2, gacc->count);
+    } else if (semantic == "COLOR" || semantic == "COLOR_0") {
+      shape->colors.resize(gacc->count);
+      if (cgltf_num_components(gacc->type) == 3) {
+        read_gltf_floats(gacc, (float*)shape->colors.data(), 3, gacc->count);
+      } else {
+        auto colors4 = std::vector<vec4f>(gacc->count);
+        read_gltf_floats(gacc, (float*)colors4.data(), 4, gacc->count);
+        for (auto i = (size_t)0; i < gacc->count; i++)
+          shape->colors[i] = xyz(colors4[i]);
+      }
+    } else if (semantic == "TANGENT") {
+      shape->tangents.resize(gacc->count);
+      read_gltf_floats(gacc, (float*)shape->tangents.data(), 4, gacc->count);
+      for (auto& t : shape->tangents) t.w = -t.w;
+    } else if (semantic == "RADIUS") {
+      shape->radius.resize(gacc->count);
+      read_gltf_floats(gacc, shape->radius.data(), 1, gacc->count);
+    } else {
+      // ignore
+    }
+  }
+
+  // indices, generated if missing
+  auto indices = std::vector<int>{};
+  if (gprim->indices) {
+    read_gltf_indices(gprim->indices, indices);
+  } else {
+    indices.resize(shape->positions.size());
+    for (auto i = 0; i < (int)indices.size(); i++) indices[i] = i;
+  }
+  auto count = (int)indices.size();
+  if (gprim->type == cgltf_primitive_type_triangles) {
+    shape->triangles.resize(count / 3);
+    memcpy(shape->triangles.data(), indices.data(),
+        shape->triangles.size() * sizeof(vec3i));
+  } else if (gprim->type == cgltf_primitive_type_triangle_fan) {
+    shape->triangles.resize(count - 2);
+    for (auto i = 2; i < count; i++)
+      shape->triangles[i - 2] = {indices[0], indices[i - 1], indices[i]};
+  } else if (gprim->type == cgltf_primitive_type_triangle_strip) {
+    shape->triangles.resize(count - 2);
+    for (auto i = 2; i < count; i++)
+      shape->triangles[i - 2] = {indices[i - 2], indices[i - 1], indices[i]};
+  } else if (gprim->type == cgltf_primitive_type_lines) {
+    shape->lines.resize(count / 2);
+    memcpy(shape->lines.data(), indices.data(),
+        shape->lines.size() * sizeof(vec2i));
+  } else if (gprim->type == cgltf_primitive_type_line_loop) {
+    shape->lines.resize(count);
+    for (auto i = 0; i < count; i++)
+      shape->lines[i] = {indices[i], indices[(i + 1) % count]};
+  } else if (gprim->type == cgltf_primitive_type_line_strip) {
+    shape->lines.resize(count - 1);
+    for (auto i = 0; i < count - 1; i++)
+      shape->lines[i] = {indices[i], indices[i + 1]};
+  } else {
+    return false;
+  }
+  return true;
+}
+
 // Load a scene
 static bool load_gltf_scene(const std::string& filename, scn::model* scene,
     std::string& error, progress_callback progress_cb, bool noparallel) {
@@ -1993,6 +3147,10 @@ static bool load_gltf_scene(const std::string& filename, scn::model* scene,
     error = filename + ": error in " + error;
     return false;
   };
+  auto extension_error = [filename, &error](const std::string& extension) {
+    error = filename + ": unsupported extension " + extension;
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{0, 3};
@@ -2007,6 +3165,14 @@ static bool load_gltf_scene(const std::string& filename, scn::model* scene,
   auto gltf = std::unique_ptr<cgltf_data, void (*)(cgltf_data*)>{
       data, cgltf_free};
 
+  // check for compressed geometry, which we cannot decode
+  for (auto eid = 0; eid < gltf->extensions_required_count; eid++) {
+    auto extension = std::string{gltf->extensions_required[eid]};
+    if (extension == "KHR_draco_mesh_compression" ||
+        extension == "EXT_meshopt_compression")
+      return extension_error(extension);
+  }
+
   // handle progress
   if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
 
@@ -2155,6 +3321,7 @@ static bool load_gltf_scene(const std::string& filename, scn::model* scene,
   // convert meshes
   auto mesh_map = std::unordered_map<cgltf_mesh*, std::vector<scn::object*>>{
       {nullptr, {}}};
+  auto primitives = std::vector<std::pair<cgltf_primitive*, scn::shape*>>{};
   for (auto mid = 0; mid < gltf->meshes_count; mid++) {
     auto gmesh = &gltf->meshes[mid];
     for (auto sid = 0; sid < gmesh->primitives_count; sid++) {
@@ -2165,146 +3332,24 @@ static bool load_gltf_scene(const std::string& filename, scn::model* scene,
       auto shape       = add_shape(scene);
       object->shape    = shape;
       object->material = material_map.at(gprim->material);
-      for (auto aid = 0; aid < gprim->attributes_count; aid++) {
-        auto gattr    = &gprim->attributes[aid];
-        auto semantic = std::string(gattr->name ? gattr->name : "");
-        auto gacc     = gattr->data;
-        if (semantic == "POSITION") {
-          shape->positions.resize(gacc->count);
-          for (auto i = 0; i < gacc->count; i++)
-            cgltf_accessor_read_float(gacc, i, &shape->positions[i].x, 3);
-        } else if (semantic == "NORMAL") {
-          shape->normals.resize(gacc->count);
-          for (auto i = 0; i < gacc->count; i++)
-            cgltf_accessor_read_float(gacc, i, &shape->normals[i].x, 3);
-        } else if (semantic == "TEXCOORD" || semantic == "TEXCOORD_0") {
-          shape->texcoords.resize(gacc->count);
-          for (auto i = 0; i < gacc->count; i++)
-            cgltf_accessor_read_float(gacc, i, &shape->texcoords[i].x, 2);
-        } else if (semantic == "COLOR" || semantic == "COLOR_0") {
-          shape->colors.resize(gacc->count);
-          if (cgltf_num_components(gacc->type) == 3) {
-            for (auto i = 0; i < gacc->count; i++)
-              cgltf_accessor_read_float(gacc, i, &shape->colors[i].x, 3);
-          } else {
-            for (auto i = 0; i < gacc->count; i++) {
-              auto color4 = vec4f{0};
-              cgltf_accessor_read_float(gacc, i, &color4.x, 4);
-              shape->colors[i] = xyz(color4);
-            }
-          }
-        } else if (semantic == "TANGENT") {
-          shape->tangents.resize(gacc->count);
-          for (auto i = 0; i < gacc->count; i++)
-            cgltf_accessor_read_float(gacc, i, &shape->tangents[i].x, 4);
-          for (auto& t : shape->tangents) t.w = -t.w;
-        } else if (semantic == "RADIUS") {
-          shape->radius.resize(gacc->count);
-          for (auto i = 0; i < gacc->count; i++)
-            cgltf_accessor_read_float(gacc, i, &shape->radius[i], 1);
-        } else {
-          // ignore
-        }
-      }
-      // indices
-      if (!gprim->indices) {
-        if (gprim->type == cgltf_primitive_type_triangles) {
-          shape->triangles.resize(shape->positions.size() / 3);
-          for (auto i = 0; i < shape->positions.size() / 3; i++)
-            shape->triangles[i] = {i * 3 + 0, i * 3 + 1, i * 3 + 2};
-        } else if (gprim->type == cgltf_primitive_type_triangle_fan) {
-          shape->triangles.resize(shape->positions.size() - 2);
-          for (auto i = 2; i < shape->positions.size(); i++)
-            shape->triangles[i - 2] = {0, i - 1, i};
-        } else if (gprim->type == cgltf_primitive_type_triangle_strip) {
-          shape->triangles.resize(shape->positions.size() - 2);
-          for (auto i = 2; i < shape->positions.size(); i++)
-            shape->triangles[i - 2] = {i - 2, i - 1, i};
-        } else if (gprim->type == cgltf_primitive_type_lines) {
-          shape->lines.resize(shape->positions.size() / 2);
-          for (auto i = 0; i < shape->positions.size() / 2; i++)
-            shape->lines[i] = {i * 2 + 0, i * 2 + 1};
-        } else if (gprim->type == cgltf_primitive_type_line_loop) {
-          shape->lines.resize(shape->positions.size());
-          for (auto i = 1; i < shape->positions.size(); i++)
-            shape->lines[i - 1] = {i - 1, i};
-          shape->lines.back() = {(int)shape->positions.size() - 1, 0};
-        } else if (gprim->type == cgltf_primitive_type_line_strip) {
-          shape->lines.resize(shape->positions.size() - 1);
-          for (auto i = 1; i < shape->positions.size(); i++)
-            shape->lines[i - 1] = {i - 1, i};
-        } else if (gprim->type == cgltf_primitive_type_points) {
-          // points
-          return primitive_error();
-        } else {
-          return primitive_error();
-        }
-      } else {
-        auto giacc = gprim->indices;
-        if (gprim->type == cgltf_primitive_type_triangles) {
-          shape->triangles.resize(giacc->count / 3);
-          for (auto i = 0; i < giacc->count / 3; i++) {
-            cgltf_accessor_read_uint(
-                giacc, i * 3 + 0, (uint*)&shape->triangles[i].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, i * 3 + 1, (uint*)&shape->triangles[i].y, 1);
-            cgltf_accessor_read_uint(
-                giacc, i * 3 + 2, (uint*)&shape->triangles[i].z, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_triangle_fan) {
-          shape->triangles.resize(giacc->count - 2);
-          for (auto i = 2; i < giacc->count; i++) {
-            cgltf_accessor_read_uint(
-                giacc, 0 + 0, (uint*)&shape->triangles[i - 2].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, i - 1, (uint*)&shape->triangles[i - 2].y, 1);
-            cgltf_accessor_read_uint(
-                giacc, i + 0, (uint*)&shape->triangles[i - 2].z, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_triangle_strip) {
-          shape->triangles.resize(giacc->count - 2);
-          for (auto i = 2; i < giacc->count; i++) {
-            cgltf_accessor_read_uint(
-                giacc, i - 2, (uint*)&shape->triangles[i - 2].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, i - 1, (uint*)&shape->triangles[i - 2].y, 1);
-            cgltf_accessor_read_uint(
-                giacc, i + 0, (uint*)&shape->triangles[i - 2].z, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_lines) {
-          shape->lines.resize(giacc->count / 2);
-          for (auto i = 0; i < giacc->count / 2; i++) {
-            cgltf_accessor_read_uint(
-                giacc, i * 2 + 0, (uint*)&shape->lines[i].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, i * 2 + 1, (uint*)&shape->lines[i].y, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_line_loop) {
-          shape->lines.resize(giacc->count);
-          for (auto i = 0; i < giacc->count; i++) {
-            cgltf_accessor_read_uint(
-                giacc, (i + 0) % giacc->count, (uint*)&shape->lines[i].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, (i + 1) % giacc->count, (uint*)&shape->lines[i].y, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_line_strip) {
-          shape->lines.resize(giacc->count - 1);
-          for (auto i = 0; i < giacc->count - 1; i++) {
-            cgltf_accessor_read_uint(
-                giacc, (i + 0) % giacc->count, (uint*)&shape->lines[i].x, 1);
-            cgltf_accessor_read_uint(
-                giacc, (i + 1) % giacc->count, (uint*)&shape->lines[i].y, 1);
-          }
-        } else if (gprim->type == cgltf_primitive_type_points) {
-          // points
-          return primitive_error();
-        } else {
-          return primitive_error();
-        }
-      }
+      primitives.push_back({gprim, shape});
     }
   }
 
+  // convert primitives in parallel, since they are independent
+  auto failed         = std::atomic<bool>{false};
+  auto load_primitive = [&](int idx) {
+    auto [gprim, shape] = primitives[idx];
+    if (!load_gltf_primitive(gprim, shape)) failed = true;
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)primitives.size(); idx++)
+      load_primitive(idx);
+  } else {
+    common::parallel_for((int)primitives.size(), load_primitive);
+  }
+  if (failed) return primitive_error();
+
   // convert nodes
   auto instance_map = std::unordered_map<cgltf_mesh*, std::vector<frame3f>>{};
   for (auto nid = 0; nid < gltf->nodes_count; nid++) {
@@ -2421,7 +3466,7 @@ static bool load_gltf_scene(const std::string& filename, scn::model* scene,
   for (auto& texture : scene->textures) {
     if (texture->scalarb.empty() && texture->scalarf.empty() &&
         texture->colorb.empty() && texture->colorf.empty()) {
-      delete texture;
+      scene->texture_arena.destroy(texture);
       texture = nullptr;
     }
   }
@@ -2543,21 +3588,31 @@ static bool load_pbrt_scene(const std::string& filename, scn::model* scene,
   // hack for pbrt empty material
   material_map[nullptr] = add_material(scene);
 
-  // convert shapes
+  // convert shapes, sharing the ones loaded from the same ply file and
+  // moving their data, since the pbrt model is discarded
+  auto ply_map = std::unordered_map<std::string, scn::shape*>{};
   for (auto pshape : pbrt->shapes) {
     auto object   = add_object(scene);
-    object->shape = add_shape(scene);
     object->frame = pshape->frame;
     if (!pshape->instances.empty()) {
       object->instance         = add_instance(scene);
-      object->instance->frames = pshape->instances;
+      object->instance->frames = std::move(pshape->instances);
     }
-    object->shape->positions = pshape->positions;
-    object->shape->normals   = pshape->normals;
-    object->shape->texcoords = pshape->texcoords;
-    object->shape->triangles = pshape->triangles;
-    for (auto& uv : object->shape->texcoords) uv.y = 1 - uv.y;
     object->material = material_map.at(pshape->material);
+    if (!pshape->filename_.empty()) {
+      auto it = ply_map.find(pshape->filename_);
+      if (it != ply_map.end()) {
+        object->shape = it->second;
+        continue;
+      }
+    }
+    object->shape            = add_shape(scene);
+    object->shape->positions = std::move(pshape->positions);
+    object->shape->normals   = std::move(pshape->normals);
+    object->shape->texcoords = std::move(pshape->texcoords);
+    object->shape->triangles = std::move(pshape->triangles);
+    for (auto& uv : object->shape->texcoords) uv.y = 1 - uv.y;
+    if (!pshape->filename_.empty()) ply_map[pshape->filename_] = object->shape;
   }
 
   // convert environments
@@ -2653,9 +3708,11 @@ static bool save_pbrt_scene(const std::string& filename,
   pcamera->aspect     = camera->aspect;
   pcamera->resolution = {1280, (int)(1280 / pcamera->aspect)};
 
-  // get texture name
-  auto get_texture = [](const scn::texture* texture) {
-    return texture ? texture->name : "";
+  // get texture path, relative to the scene, as saved below
+  auto get_texture = [](const scn::texture* texture) -> std::string {
+    if (!texture) return "";
+    auto hdr = !texture->colorf.empty() || !texture->scalarf.empty();
+    return "textures/" + texture->name + (hdr ? ".hdr" : ".png");
   };
 
   // convert materials
@@ -2676,17 +3733,33 @@ static bool save_pbrt_scene(const std::string& filename,
     material_map[material]  = pmaterial;
   }
 
-  // convert instances
+  // convert instances, referencing large shapes as ply files, that are
+  // saved below, and converting the others inline
+  auto ply_vertices = (size_t)4096;
+  auto ply_shapes   = std::vector<scn::shape*>{};
+  auto ply_names    = std::unordered_map<scn::shape*, std::string>{};
   for (auto object : scene->objects) {
-    auto pshape = add_shape(pbrt);
-    pshape->filename_ =
-        sfs::path(object->shape->name).replace_extension(".ply");
+    auto shape       = object->shape;
+    auto pshape      = add_shape(pbrt);
     pshape->frame    = object->frame;
     pshape->frend    = object->frame;
     pshape->material = material_map.at(object->material);
-    if (object->instance) {
-      pshape->instances = object->instance->frames;
-      pshape->instances = object->instance->frames;
+    if (object->instance) pshape->instances = object->instance->frames;
+    if (shape->positions.size() >= ply_vertices) {
+      auto it = ply_names.find(shape);
+      if (it == ply_names.end()) {
+        it = ply_names.insert({shape, "shapes/" + shape->name + ".ply"}).first;
+        ply_shapes.push_back(shape);
+      }
+      pshape->filename_ = it->second;
+    } else {
+      pshape->positions = shape->positions;
+      pshape->normals   = shape->normals;
+      pshape->texcoords = shape->texcoords;
+      pshape->triangles = !shape->quads.empty()
+                              ? yshp::quads_to_triangles(shape->quads)
+                              : shape->triangles;
+      for (auto& uv : pshape->texcoords) uv.y = 1 - uv.y;
     }
   }
 
@@ -2704,7 +3777,7 @@ static bool save_pbrt_scene(const std::string& filename,
   if (!save_pbrt(filename, pbrt, error)) return false;
 
   // handle progress
-  progress.y += (int)scene->shapes.size() + (int)scene->textures.size();
+  progress.y += (int)ply_shapes.size() + (int)scene->textures.size();
 
   // get filename from name
   auto get_filename = [filename](const std::string& name,
@@ -2713,19 +3786,335 @@ static bool save_pbrt_scene(const std::string& filename,
     return sfs::path(filename).parent_path() / group / (name + extension);
   };
 
+  // save large shapes as binary ply
+  auto assets = std::vector<asset_save>{};
+  for (auto shape : ply_shapes) {
+    auto& asset   = assets.emplace_back();
+    asset.message = "save shape";
+    asset.path    = get_filename(shape->name, "shapes", ".ply").string();
+    asset.save    = [path = asset.path, shape](std::string& error) {
+      return yshp::save_shape(path, {}, {}, shape->triangles, shape->quads,
+          shape->positions, shape->normals, shape->texcoords, {}, {}, error);
+    };
+  }
+
   // save textures
   for (auto texture : scene->textures) {
-    if (progress_cb) progress_cb("save texture", progress.x++, progress.y);
-    auto path = get_filename(texture->name, "textures",
-        (!texture->colorf.empty() || !texture->scalarf.empty()) ? ".hdr"
-                                                                : ".png");
-    if (!texture->colorf.empty() || !texture->colorb.empty()) {
-      if (!save_image(path, texture->colorf, texture->colorb, error))
-        return dependent_error();
-    } else {
-      if (!save_image(path, texture->scalarf, texture->scalarb, error))
-        return dependent_error();
+    auto& asset   = assets.emplace_back();
+    asset.message = "save texture";
+    asset.path    = (sfs::path(filename).parent_path() / get_texture(texture))
+                     .string();
+    asset.save = [path = asset.path, texture](std::string& error) {
+      if (!texture->colorf.empty() || !texture->colorb.empty()) {
+        return save_image(path, texture->colorf, texture->colorb, error);
+      } else {
+        return save_image(path, texture->scalarf, texture->scalarb, error);
+      }
+    };
+  }
+  if (!save_assets(filename, assets, error, progress_cb, progress, noparallel,
+          false))
+    return dependent_error();
+
+  // done
+  if (progress_cb) progress_cb("save scene", progress.x++, progress.y);
+  return true;
+}
+
+}  // namespace yocto::sceneio
+
+// -----------------------------------------------------------------------------
+// BINARY SCENE
+// -----------------------------------------------------------------------------
+namespace yocto::sceneio {
+
+// Binary scenes store all elements in a single file, in the order of the
+// model arrays, with references stored as indices, or -1 if null. Arrays are
+// prefixed by their size and aligned to 16 bytes in the file, so that they
+// can be read directly into the model or memory mapped.
+static const auto binary_magic   = std::array<char, 8>{
+    'Y', 'S', 'C', 'E', 'N', 'E', 'B', 'N'};
+static const auto binary_version = (uint32_t)2;
+static const auto binary_align   = (size_t)16;
+
+// Binary file with the current offset, used to align arrays
+struct binary_file {
+  FILE*  fs     = nullptr;
+  size_t offset = 0;
+};
+
+template <typename T>
+[[nodiscard]] static bool write_binary(binary_file& file, const T& value) {
+  static_assert(std::is_trivially_copyable_v<T>, "not a pod type");
+  if (fwrite(&value, sizeof(T), 1, file.fs) != 1) return false;
+  file.offset += sizeof(T);
+  return true;
+}
+[[nodiscard]] static bool write_binary(
+    binary_file& file, const std::string& value) {
+  if (!write_binary(file, (uint64_t)value.size())) return false;
+  if (fwrite(value.data(), 1, value.size(), file.fs) != value.size())
+    return false;
+  file.offset += value.size();
+  return true;
+}
+template <typename T>
+[[nodiscard]] static bool write_binary(
+    binary_file& file, const T* values, size_t count) {
+  static_assert(std::is_trivially_copyable_v<T>, "not a pod type");
+  if (!write_binary(file, (uint64_t)count)) return false;
+  if (!count) return true;
+  auto padding = (binary_align - file.offset % binary_align) % binary_align;
+  auto zeros   = std::array<byte, binary_align>{};
+  if (fwrite(zeros.data(), 1, padding, file.fs) != padding) return false;
+  if (fwrite(values, sizeof(T), count, file.fs) != count) return false;
+  file.offset += padding + sizeof(T) * count;
+  return true;
+}
+template <typename T>
+[[nodiscard]] static bool write_binary(
+    binary_file& file, const std::vector<T>& values) {
+  return write_binary(file, values.data(), values.size());
+}
+template <typename T>
+[[nodiscard]] static bool write_binary(
+    binary_file& file, const img::image<T>& image) {
+  if (!write_binary(file, image.size())) return false;
+  return write_binary(file, image.data(), image.count());
+}
+
+template <typename T>
+[[nodiscard]] static bool read_binary(binary_file& file, T& value) {
+  static_assert(std::is_trivially_copyable_v<T>, "not a pod type");
+  if (fread(&value, sizeof(T), 1, file.fs) != 1) return false;
+  file.offset += sizeof(T);
+  return true;
+}
+[[nodiscard]] static bool read_binary(binary_file& file, std::string& value) {
+  auto size = (uint64_t)0;
+  if (!read_binary(file, size)) return false;
+  value.resize(size);
+  if (fread(value.data(), 1, size, file.fs) != size) return false;
+  file.offset += size;
+  return true;
+}
+template <typename T>
+[[nodiscard]] static bool read_binary(
+    binary_file& file, T* values, size_t count) {
+  static_assert(std::is_trivially_copyable_v<T>, "not a pod type");
+  if (!count) return true;
+  auto padding = (binary_align - file.offset % binary_align) % binary_align;
+  auto zeros   = std::array<byte, binary_align>{};
+  if (fread(zeros.data(), 1, padding, file.fs) != padding) return false;
+  if (fread(values, sizeof(T), count, file.fs) != count) return false;
+  file.offset += padding + sizeof(T) * count;
+  return true;
+}
+template <typename T>
+[[nodiscard]] static bool read_binary(
+    binary_file& file, std::vector<T>& values) {
+  auto count = (uint64_t)0;
+  if (!read_binary(file, count)) return false;
+  values.resize(count);
+  return read_binary(file, values.data(), values.size());
+}
+template <typename T>
+[[nodiscard]] static bool read_binary(binary_file& file, img::image<T>& image) {
+  auto size  = zero2i;
+  auto count = (uint64_t)0;
+  if (!read_binary(file, size)) return false;
+  if (!read_binary(file, count)) return false;
+  if (count != (uint64_t)size.x * (uint64_t)size.y) return false;
+  image.resize(size);
+  return read_binary(file, image.data(), image.count());
+}
+
+// Write and read element references as indices
+template <typename T>
+[[nodiscard]] static bool write_binary_ref(binary_file& file, T* element,
+    const std::unordered_map<const T*, int>& indices) {
+  return write_binary(file, element ? indices.at(element) : -1);
+}
+template <typename T>
+[[nodiscard]] static bool read_binary_ref(
+    binary_file& file, T*& element, const std::vector<T*>& elements) {
+  auto index = -1;
+  if (!read_binary(file, index)) return false;
+  if (index < -1 || index >= (int)elements.size()) return false;
+  element = index < 0 ? nullptr : elements[index];
+  return true;
+}
+
+// Save a scene in the binary format
+static bool save_binary_scene(const std::string& filename,
+    const scn::model* scene, std::string& error, progress_callback progress_cb,
+    bool noparallel) {
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  // handle progress
+  auto progress = vec2i{0, 2};
+  if (progress_cb) progress_cb("save scene", progress.x++, progress.y);
+
+  // open file
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto file     = binary_file{fs, 0};
+
+  // element indices
+  auto texture_indices  = std::unordered_map<const scn::texture*, int>{};
+  auto material_indices = std::unordered_map<const scn::material*, int>{};
+  auto shape_indices    = std::unordered_map<const scn::shape*, int>{};
+  auto subdiv_indices   = std::unordered_map<const scn::subdiv*, int>{};
+  auto instance_indices = std::unordered_map<const scn::instance*, int>{};
+  for (auto idx = 0; idx < (int)scene->textures.size(); idx++)
+    texture_indices[scene->textures[idx]] = idx;
+  for (auto idx = 0; idx < (int)scene->materials.size(); idx++)
+    material_indices[scene->materials[idx]] = idx;
+  for (auto idx = 0; idx < (int)scene->shapes.size(); idx++)
+    shape_indices[scene->shapes[idx]] = idx;
+  for (auto idx = 0; idx < (int)scene->subdivs.size(); idx++)
+    subdiv_indices[scene->subdivs[idx]] = idx;
+  for (auto idx = 0; idx < (int)scene->instances.size(); idx++)
+    instance_indices[scene->instances[idx]] = idx;
+
+  // header
+  if (!write_binary(file, binary_magic)) return write_error();
+  if (!write_binary(file, binary_version)) return write_error();
+  if (!write_binary(file, scene->name)) return write_error();
+  if (!write_binary(file, scene->copyright)) return write_error();
+
+  // cameras
+  if (!write_binary(file, (uint64_t)scene->cameras.size()))
+    return write_error();
+  for (auto camera : scene->cameras) {
+    if (!write_binary(file, camera->name)) return write_error();
+    if (!write_binary(file, camera->frame)) return write_error();
+    if (!write_binary(file, camera->orthographic)) return write_error();
+    if (!write_binary(file, camera->lens)) return write_error();
+    if (!write_binary(file, camera->film)) return write_error();
+    if (!write_binary(file, camera->aspect)) return write_error();
+    if (!write_binary(file, camera->focus)) return write_error();
+    if (!write_binary(file, camera->aperture)) return write_error();
+  }
+
+  // textures
+  if (!write_binary(file, (uint64_t)scene->textures.size()))
+    return write_error();
+  for (auto texture : scene->textures) {
+    if (!write_binary(file, texture->name)) return write_error();
+    if (!write_binary(file, texture->colorf)) return write_error();
+    if (!write_binary(file, texture->colorb)) return write_error();
+    if (!write_binary(file, texture->scalarf)) return write_error();
+    if (!write_binary(file, texture->scalarb)) return write_error();
+    if (!write_binary(file, texture->filename)) return write_error();
+    if (!write_binary(file, texture->scalar)) return write_error();
+  }
+
+  // materials
+  if (!write_binary(file, (uint64_t)scene->materials.size()))
+    return write_error();
+  for (auto material : scene->materials) {
+    if (!write_binary(file, material->name)) return write_error();
+    for (auto value :
+        {material->emission, material->color, material->spectint,
+            material->scattering}) {
+      if (!write_binary(file, value)) return write_error();
+    }
+    for (auto value :
+        {material->specular, material->roughness, material->metallic,
+            material->ior, material->coat, material->transmission,
+            material->translucency, material->scanisotropy, material->trdepth,
+            material->opacity, material->displacement}) {
+      if (!write_binary(file, value)) return write_error();
     }
+    if (!write_binary(file, material->thin)) return write_error();
+    for (auto texture :
+        {material->emission_tex, material->color_tex, material->specular_tex,
+            material->metallic_tex, material->roughness_tex,
+            material->transmission_tex, material->translucency_tex,
+            material->spectint_tex, material->scattering_tex,
+            material->coat_tex, material->opacity_tex, material->normal_tex,
+            material->displacement_tex}) {
+      if (!write_binary_ref(file, texture, texture_indices))
+        return write_error();
+    }
+    if (!write_binary(file, material->subdivisions)) return write_error();
+    if (!write_binary(file, material->smooth)) return write_error();
+    if (!write_binary(file, material->subdivision_error))
+      return write_error();
+  }
+
+  // shapes
+  if (!write_binary(file, (uint64_t)scene->shapes.size()))
+    return write_error();
+  for (auto shape : scene->shapes) {
+    if (!write_binary(file, shape->name)) return write_error();
+    if (!write_binary(file, shape->points)) return write_error();
+    if (!write_binary(file, shape->lines)) return write_error();
+    if (!write_binary(file, shape->triangles)) return write_error();
+    if (!write_binary(file, shape->quads)) return write_error();
+    if (!write_binary(file, shape->positions)) return write_error();
+    if (!write_binary(file, shape->normals)) return write_error();
+    if (!write_binary(file, shape->texcoords)) return write_error();
+    if (!write_binary(file, shape->colors)) return write_error();
+    if (!write_binary(file, shape->radius)) return write_error();
+    if (!write_binary(file, shape->tangents)) return write_error();
+  }
+
+  // subdivs
+  if (!write_binary(file, (uint64_t)scene->subdivs.size()))
+    return write_error();
+  for (auto subdiv : scene->subdivs) {
+    if (!write_binary(file, subdiv->name)) return write_error();
+    if (!write_binary(file, subdiv->quadspos)) return write_error();
+    if (!write_binary(file, subdiv->quadsnorm)) return write_error();
+    if (!write_binary(file, subdiv->quadstexcoord)) return write_error();
+    if (!write_binary(file, subdiv->positions)) return write_error();
+    if (!write_binary(file, subdiv->normals)) return write_error();
+    if (!write_binary(file, subdiv->texcoords)) return write_error();
+  }
+
+  // instances
+  if (!write_binary(file, (uint64_t)scene->instances.size()))
+    return write_error();
+  for (auto instance : scene->instances) {
+    if (!write_binary(file, instance->name)) return write_error();
+    if (!write_binary(file, instance->frames)) return write_error();
+  }
+
+  // objects
+  if (!write_binary(file, (uint64_t)scene->objects.size()))
+    return write_error();
+  for (auto object : scene->objects) {
+    if (!write_binary(file, object->name)) return write_error();
+    if (!write_binary(file, object->frame)) return write_error();
+    if (!write_binary_ref(file, object->shape, shape_indices))
+      return write_error();
+    if (!write_binary_ref(file, object->material, material_indices))
+      return write_error();
+    if (!write_binary_ref(file, object->instance, instance_indices))
+      return write_error();
+    if (!write_binary_ref(file, object->subdiv, subdiv_indices))
+      return write_error();
+  }
+
+  // environments
+  if (!write_binary(file, (uint64_t)scene->environments.size()))
+    return write_error();
+  for (auto environment : scene->environments) {
+    if (!write_binary(file, environment->name)) return write_error();
+    if (!write_binary(file, environment->frame)) return write_error();
+    if (!write_binary(file, environment->emission)) return write_error();
+    if (!write_binary_ref(file, environment->emission_tex, texture_indices))
+      return write_error();
   }
 
   // done
@@ -2733,6 +4122,173 @@ static bool save_pbrt_scene(const std::string& filename,
   return true;
 }
 
+// Load a scene in the binary format
+static bool load_binary_scene(const std::string& filename, scn::model* scene,
+    std::string& error, progress_callback progress_cb, bool noparallel) {
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+  auto version_error = [filename, &error]() {
+    error = filename + ": unsupported binary scene";
+    return false;
+  };
+
+  // handle progress
+  auto progress = vec2i{0, 2};
+  if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
+
+  // open file
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return open_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto file     = binary_file{fs, 0};
+
+  // header
+  auto magic   = std::array<char, 8>{};
+  auto version = (uint32_t)0;
+  if (!read_binary(file, magic)) return read_error();
+  if (!read_binary(file, version)) return read_error();
+  if (magic != binary_magic || version != binary_version)
+    return version_error();
+  if (!read_binary(file, scene->name)) return read_error();
+  if (!read_binary(file, scene->copyright)) return read_error();
+
+  // cameras
+  auto count = (uint64_t)0;
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto camera = add_camera(scene);
+    if (!read_binary(file, camera->name)) return read_error();
+    if (!read_binary(file, camera->frame)) return read_error();
+    if (!read_binary(file, camera->orthographic)) return read_error();
+    if (!read_binary(file, camera->lens)) return read_error();
+    if (!read_binary(file, camera->film)) return read_error();
+    if (!read_binary(file, camera->aspect)) return read_error();
+    if (!read_binary(file, camera->focus)) return read_error();
+    if (!read_binary(file, camera->aperture)) return read_error();
+  }
+
+  // textures
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto texture = add_texture(scene);
+    if (!read_binary(file, texture->name)) return read_error();
+    if (!read_binary(file, texture->colorf)) return read_error();
+    if (!read_binary(file, texture->colorb)) return read_error();
+    if (!read_binary(file, texture->scalarf)) return read_error();
+    if (!read_binary(file, texture->scalarb)) return read_error();
+    if (!read_binary(file, texture->filename)) return read_error();
+    if (!read_binary(file, texture->scalar)) return read_error();
+  }
+
+  // materials
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto material = add_material(scene);
+    if (!read_binary(file, material->name)) return read_error();
+    for (auto value : {&material->emission, &material->color,
+             &material->spectint, &material->scattering}) {
+      if (!read_binary(file, *value)) return read_error();
+    }
+    for (auto value : {&material->specular, &material->roughness,
+             &material->metallic, &material->ior, &material->coat,
+             &material->transmission, &material->translucency,
+             &material->scanisotropy, &material->trdepth, &material->opacity,
+             &material->displacement}) {
+      if (!read_binary(file, *value)) return read_error();
+    }
+    if (!read_binary(file, material->thin)) return read_error();
+    for (auto texture : {&material->emission_tex, &material->color_tex,
+             &material->specular_tex, &material->metallic_tex,
+             &material->roughness_tex, &material->transmission_tex,
+             &material->translucency_tex, &material->spectint_tex,
+             &material->scattering_tex, &material->coat_tex,
+             &material->opacity_tex, &material->normal_tex,
+             &material->displacement_tex}) {
+      if (!read_binary_ref(file, *texture, scene->textures))
+        return read_error();
+    }
+    if (!read_binary(file, material->subdivisions)) return read_error();
+    if (!read_binary(file, material->smooth)) return read_error();
+    if (!read_binary(file, material->subdivision_error))
+      return read_error();
+  }
+
+  // shapes
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto shape = add_shape(scene);
+    if (!read_binary(file, shape->name)) return read_error();
+    if (!read_binary(file, shape->points)) return read_error();
+    if (!read_binary(file, shape->lines)) return read_error();
+    if (!read_binary(file, shape->triangles)) return read_error();
+    if (!read_binary(file, shape->quads)) return read_error();
+    if (!read_binary(file, shape->positions)) return read_error();
+    if (!read_binary(file, shape->normals)) return read_error();
+    if (!read_binary(file, shape->texcoords)) return read_error();
+    if (!read_binary(file, shape->colors)) return read_error();
+    if (!read_binary(file, shape->radius)) return read_error();
+    if (!read_binary(file, shape->tangents)) return read_error();
+  }
+
+  // subdivs
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto subdiv = add_subdiv(scene);
+    if (!read_binary(file, subdiv->name)) return read_error();
+    if (!read_binary(file, subdiv->quadspos)) return read_error();
+    if (!read_binary(file, subdiv->quadsnorm)) return read_error();
+    if (!read_binary(file, subdiv->quadstexcoord)) return read_error();
+    if (!read_binary(file, subdiv->positions)) return read_error();
+    if (!read_binary(file, subdiv->normals)) return read_error();
+    if (!read_binary(file, subdiv->texcoords)) return read_error();
+  }
+
+  // instances
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto instance = add_instance(scene);
+    if (!read_binary(file, instance->name)) return read_error();
+    if (!read_binary(file, instance->frames)) return read_error();
+  }
+
+  // objects
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto object = add_object(scene);
+    if (!read_binary(file, object->name)) return read_error();
+    if (!read_binary(file, object->frame)) return read_error();
+    if (!read_binary_ref(file, object->shape, scene->shapes))
+      return read_error();
+    if (!read_binary_ref(file, object->material, scene->materials))
+      return read_error();
+    if (!read_binary_ref(file, object->instance, scene->instances))
+      return read_error();
+    if (!read_binary_ref(file, object->subdiv, scene->subdivs))
+      return read_error();
+  }
+
+  // environments
+  if (!read_binary(file, count)) return read_error();
+  for (auto idx = (uint64_t)0; idx < count; idx++) {
+    auto environment = add_environment(scene);
+    if (!read_binary(file, environment->name)) return read_error();
+    if (!read_binary(file, environment->frame)) return read_error();
+    if (!read_binary(file, environment->emission)) return read_error();
+    if (!read_binary_ref(file, environment->emission_tex, scene->textures))
+      return read_error();
+  }
+
+  // done
+  if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
+  return true;
+}
+
 }  // namespace yocto::sceneio
 
 // -----------------------------------------------------------------------------
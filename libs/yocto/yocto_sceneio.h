@@ -48,6 +48,7 @@
 #include <functional>
 #include <memory>
 
+#include "yocto_common.h"
 #include "yocto_image.h"
 #include "yocto_math.h"
 
@@ -66,6 +67,7 @@ using math::byte;
 using math::frame3f;
 using math::identity3x3f;
 using math::identity3x4f;
+using math::invalidb3f;
 using math::mat4f;
 using math::vec2f;
 using math::vec2i;
@@ -119,6 +121,10 @@ struct texture {
   img::image<vec3b> colorb  = {};
   img::image<float> scalarf = {};
   img::image<byte>  scalarb = {};
+
+  // textures not loaded keep their filename, and if they are scalar
+  std::string filename = "";
+  bool        scalar   = false;
 };
 
 // Material for surfaces, lines and triangles.
@@ -163,8 +169,9 @@ struct material {
   scn::texture* displacement_tex = nullptr;
 
   // [experimental] properties to drive subdiv and displacement
-  int  subdivisions = 2;
-  bool smooth       = true;
+  int   subdivisions      = 2;
+  bool  smooth            = true;
+  float subdivision_error = 0;  // adaptive if > 0, relative to shape size
 };
 
 // Shape data represented as indexed meshes of elements.
@@ -188,6 +195,10 @@ struct shape {
   std::vector<vec3f> colors    = {};
   std::vector<float> radius    = {};
   std::vector<vec4f> tangents  = {};
+
+  // shapes not loaded keep their filename and bounds, see load_shape()
+  std::string filename = "";
+  bbox3f      bounds   = invalidb3f;
 };
 
 // Subdiv data represented as indexed meshes of elements.
@@ -256,8 +267,20 @@ struct model {
   std::string name      = "";
   std::string copyright = "";
 
-  // cleanup
-  ~model();
+  // shapes loaded on demand, least recently used first, and the memory
+  // budget for their geometry in bytes, or 0 for no limit
+  std::vector<scn::shape*> loaded_shapes = {};
+  size_t                   shape_budget  = 0;
+
+  // storage of the elements, freed at once with the model
+  common::arena<scn::camera>      camera_arena      = {};
+  common::arena<scn::object>      object_arena      = {};
+  common::arena<scn::environment> environment_arena = {};
+  common::arena<scn::shape>       shape_arena       = {};
+  common::arena<scn::subdiv>      subdiv_arena      = {};
+  common::arena<scn::texture>     texture_arena     = {};
+  common::arena<scn::material>    material_arena    = {};
+  common::arena<scn::instance>    instance_arena    = {};
 };
 
 // add element to a scene
@@ -285,14 +308,38 @@ namespace yocto::sceneio {
 using progress_callback =
     std::function<void(const std::string& message, int current, int total)>;
 
+// Asset callback called when streaming a scene. It is called with each
+// camera once parsed, and then with each texture and object, one per call,
+// as soon as their data is loaded. Calls come from the loading threads, but
+// are never concurrent. Assets may still be merged or trimmed before loading
+// completes, so the callback has to copy the data it keeps.
+using asset_callback = std::function<void(const scn::camera* camera,
+    const scn::object* object, const scn::texture* texture)>;
+
 // Load/save a scene in the supported formats. Throws on error.
 // Calls the progress callback, if defined, as we process more data.
+// With notextures, JSON scenes store texture filenames without loading them.
+// With noshapes, JSON scenes store shape filenames and bounds without
+// keeping their geometry, that is loaded on demand with load_shape().
+// JSON and OBJ scenes save their shapes, textures and instances in parallel,
+// unless noparallel. With incremental, they also record the hashes of these
+// assets in `<filename>.hashes` and skip writing the unchanged ones.
+// Calls the asset callback, if defined, to stream the scene while loading.
+// JSON scenes stream each asset when loaded, other formats once parsed.
 bool load_scene(const std::string& filename, scn::model* scene,
     std::string& error, progress_callback progress_cb = {},
-    bool noparallel = false);
+    bool noparallel = false, bool notextures = false, bool noshapes = false,
+    asset_callback asset_cb = {});
 bool save_scene(const std::string& filename, const scn::model* scene,
     std::string& error, progress_callback progress_cb = {},
-    bool noparallel = false);
+    bool noparallel = false, bool incremental = false);
+
+// Load the geometry of a shape that was not loaded with the scene. Then,
+// evict the least recently used shapes loaded this way until their memory
+// fits the scene shape budget. Unload releases the geometry of a shape
+// loaded on demand. These functions are not thread-safe.
+bool load_shape(scn::model* scene, scn::shape* shape, std::string& error);
+void unload_shape(scn::model* scene, scn::shape* shape);
 
 // get named camera or default if name is empty
 scn::camera* get_camera(const scn::model* scene, const std::string& name = "");
@@ -327,6 +374,18 @@ std::vector<std::string> scene_validation(
 // Return an approximate scene bounding box.
 bbox3f compute_bounds(const scn::model* scene);
 
+// Memory used by a scene, in bytes, by kind of data, counting the capacity
+// of its buffers. Stats also report it.
+struct scene_memory {
+  size_t shapes    = 0;  // shape geometry
+  size_t subdivs   = 0;  // subdiv geometry
+  size_t textures  = 0;  // texture images
+  size_t instances = 0;  // instance frames
+  size_t other     = 0;  // elements and names
+  size_t total     = 0;
+};
+scene_memory get_scene_memory(const scn::model* scene);
+
 }  // namespace yocto::sceneio
 
 // -----------------------------------------------------------------------------
@@ -337,6 +396,37 @@ namespace yocto::sceneio {
 // Apply subdivision and displacement rules.
 void tesselate_subdivs(scn::model* scene, progress_callback progress_cb = {});
 void tesselate_subdiv(scn::model* scene, scn::subdiv* subdiv);
+void tesselate_subdiv(
+    scn::model* scene, scn::subdiv* subdiv, int subdivisions);
+// Subdivision is adaptive for materials with a positive subdivision_error.
+// Then subdivisions is the finest level, and each region is kept at the
+// coarsest level that deviates from the finest surface, including
+// displacement, less than subdivision_error times the shape size.
+// Neighboring regions are stitched without cracks.
+
+// Apply subdivision and displacement rules, choosing the subdivision level
+// of each subdiv from its projected size under the camera, at the given
+// image resolution. Levels are the smallest that make cage edges project
+// to at most edge_pixels, up to the material subdivisions. Then, while the
+// estimated memory exceeds budget bytes, the level of the subdiv with the
+// smallest projected edges is lowered.
+void tesselate_subdivs(scn::model* scene, const scn::camera* camera,
+    int resolution, float edge_pixels, size_t budget,
+    progress_callback progress_cb = {});
+
+// Merge shapes and textures with the same contents, remapping objects,
+// materials and environments to the remaining copy. This way, objects with
+// the same geometry are instanced by the tracer. Elements not loaded and
+// shapes tesselated from subdivs are left as is. Since merged elements are
+// shared, this is meant for scenes that are loaded for rendering only.
+void merge_duplicates(scn::model* scene);
+
+// Group objects with the same shape and material into one object, whose
+// instance holds the frames of the grouped objects. This reduces the number
+// of objects the tracer handles at the top level of its bvh. Objects with
+// subdivs are left as is. Objects are not kept in one-to-one correspondence,
+// so this is meant for scenes that are converted for rendering only.
+void group_instances(scn::model* scene);
 
 }  // namespace yocto::sceneio
 
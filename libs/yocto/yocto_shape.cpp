@@ -8,6 +8,8 @@
 
 #include "yocto_shape.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <deque>
 #include <memory>
@@ -33,6 +35,7 @@ using math::atan2;
 using math::clamp;
 using math::cos;
 using math::exp;
+using math::flt_eps;
 using math::flt_max;
 using math::fmod;
 using math::invalidb3f;
@@ -62,54 +65,120 @@ using math::zero4f;
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
+// Accumulate values of elements into vertices in parallel. Elements are
+// split in contiguous chunks, one per thread, each adding into its own
+// per-vertex sums, that are then reduced in chunk order. This is atomic-free
+// and deterministic for a given number of threads.
+template <typename T, typename Func>
+static std::vector<T> accumulate_vertices(
+    int num_vertices, int num_elements, const Func& accumulate) {
+  auto num_chunks = clamp(
+      num_elements / 16384, 1, common::get_num_threads());
+  auto sums     = std::vector<T>(num_vertices, T{});
+  auto partials = std::vector<std::vector<T>>(num_chunks - 1);
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto& chunk_sums = chunk == 0 ? sums : partials[chunk - 1];
+    if (chunk != 0) chunk_sums.assign(num_vertices, T{});
+    auto begin = (int)((int64_t)num_elements * chunk / num_chunks);
+    auto end   = (int)((int64_t)num_elements * (chunk + 1) / num_chunks);
+    for (auto element = begin; element < end; element++) {
+      accumulate(element, chunk_sums);
+    }
+  });
+  if (!partials.empty()) {
+    common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+      for (auto& partial : partials) sums[vertex] += partial[vertex];
+    });
+  }
+  return sums;
+}
+
+// Sort values in parallel, by sorting chunks and merging them pairwise.
+template <typename T, typename Compare>
+static void parallel_sort(std::vector<T>& values, const Compare& compare) {
+  auto size       = (int64_t)values.size();
+  auto num_chunks = clamp((int)(size / 65536), 1, common::get_num_threads());
+  auto bound      = [&](int chunk) {
+    return values.begin() + (size * min(chunk, num_chunks) / num_chunks);
+  };
+  common::parallel_for(num_chunks,
+      [&](int chunk) { std::sort(bound(chunk), bound(chunk + 1), compare); });
+  for (auto width = 1; width < num_chunks; width *= 2) {
+    common::parallel_for((num_chunks + width * 2 - 1) / (width * 2),
+        [&](int pair) {
+          auto chunk = pair * width * 2;
+          std::inplace_merge(bound(chunk), bound(chunk + width),
+              bound(chunk + width * 2), compare);
+        });
+  }
+}
+
+// Normalize vectors in parallel.
+static void normalize_vertices(std::vector<vec3f>& vectors) {
+  common::parallel_for(0, (int)vectors.size(), 4096,
+      [&](int vertex) { vectors[vertex] = normalize(vectors[vertex]); });
+}
+
+// Area-weighted normals of elements. For triangles, half the cross product
+// of the edges is the normal times the area, without square roots.
+static vec3f weighted_normal(
+    const std::vector<vec3f>& positions, const vec3i& t) {
+  return cross(positions[t.y] - positions[t.x],
+             positions[t.z] - positions[t.x]) /
+         2;
+}
+static vec3f weighted_normal(
+    const std::vector<vec3f>& positions, const vec4i& q) {
+  auto normal = quad_normal(
+      positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+  auto area = quad_area(
+      positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+  return normal * area;
+}
+
 // Compute per-vertex tangents for lines.
 std::vector<vec3f> compute_tangents(
     const std::vector<vec2i>& lines, const std::vector<vec3f>& positions) {
-  auto tangents = std::vector<vec3f>{positions.size()};
-  for (auto& tangent : tangents) tangent = zero3f;
-  for (auto& l : lines) {
-    auto tangent = line_tangent(positions[l.x], positions[l.y]);
-    auto length  = line_length(positions[l.x], positions[l.y]);
-    tangents[l.x] += tangent * length;
-    tangents[l.y] += tangent * length;
-  }
-  for (auto& tangent : tangents) tangent = normalize(tangent);
+  auto tangents = accumulate_vertices<vec3f>((int)positions.size(),
+      (int)lines.size(), [&](int idx, std::vector<vec3f>& tangents) {
+        auto& l       = lines[idx];
+        auto  tangent = line_tangent(positions[l.x], positions[l.y]);
+        auto  length  = line_length(positions[l.x], positions[l.y]);
+        tangents[l.x] += tangent * length;
+        tangents[l.y] += tangent * length;
+      });
+  normalize_vertices(tangents);
   return tangents;
 }
 
 // Compute per-vertex normals for triangles.
 std::vector<vec3f> compute_normals(
     const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions) {
-  auto normals = std::vector<vec3f>{positions.size()};
-  for (auto& normal : normals) normal = zero3f;
-  for (auto& t : triangles) {
-    auto normal = triangle_normal(
-        positions[t.x], positions[t.y], positions[t.z]);
-    auto area = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
-    normals[t.x] += normal * area;
-    normals[t.y] += normal * area;
-    normals[t.z] += normal * area;
-  }
-  for (auto& normal : normals) normal = normalize(normal);
+  auto normals = accumulate_vertices<vec3f>((int)positions.size(),
+      (int)triangles.size(), [&](int idx, std::vector<vec3f>& normals) {
+        auto& t      = triangles[idx];
+        auto  normal = weighted_normal(positions, t);
+        normals[t.x] += normal;
+        normals[t.y] += normal;
+        normals[t.z] += normal;
+      });
+  normalize_vertices(normals);
   return normals;
 }
 
 // Compute per-vertex normals for quads.
 std::vector<vec3f> compute_normals(
     const std::vector<vec4i>& quads, const std::vector<vec3f>& positions) {
-  auto normals = std::vector<vec3f>{positions.size()};
-  for (auto& normal : normals) normal = zero3f;
-  for (auto& q : quads) {
-    auto normal = quad_normal(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    auto area = quad_area(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    normals[q.x] += normal * area;
-    normals[q.y] += normal * area;
-    normals[q.z] += normal * area;
-    if (q.z != q.w) normals[q.w] += normal * area;
-  }
-  for (auto& normal : normals) normal = normalize(normal);
+  auto normals = accumulate_vertices<vec3f>((int)positions.size(),
+      (int)quads.size(), [&](int idx, std::vector<vec3f>& normals) {
+        auto& q      = quads[idx];
+        auto  normal = weighted_normal(positions, q);
+        normals[q.x] += normal;
+        normals[q.y] += normal;
+        normals[q.z] += normal;
+        if (q.z != q.w) normals[q.w] += normal;
+      });
+  normalize_vertices(normals);
   return normals;
 }
 
@@ -119,14 +188,7 @@ void update_tangents(std::vector<vec3f>& tangents,
   if (tangents.size() != positions.size()) {
     throw std::out_of_range("array should be the same length");
   }
-  for (auto& tangent : tangents) tangent = zero3f;
-  for (auto& l : lines) {
-    auto tangent = line_tangent(positions[l.x], positions[l.y]);
-    auto length  = line_length(positions[l.x], positions[l.y]);
-    tangents[l.x] += tangent * length;
-    tangents[l.y] += tangent * length;
-  }
-  for (auto& tangent : tangents) tangent = normalize(tangent);
+  tangents = compute_tangents(lines, positions);
 }
 
 // Compute per-vertex normals for triangles.
@@ -135,16 +197,7 @@ void update_normals(std::vector<vec3f>& normals,
   if (normals.size() != positions.size()) {
     throw std::out_of_range("array should be the same length");
   }
-  for (auto& normal : normals) normal = zero3f;
-  for (auto& t : triangles) {
-    auto normal = triangle_normal(
-        positions[t.x], positions[t.y], positions[t.z]);
-    auto area = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
-    normals[t.x] += normal * area;
-    normals[t.y] += normal * area;
-    normals[t.z] += normal * area;
-  }
-  for (auto& normal : normals) normal = normalize(normal);
+  normals = compute_normals(triangles, positions);
 }
 
 // Compute per-vertex normals for quads.
@@ -153,18 +206,7 @@ void update_normals(std::vector<vec3f>& normals,
   if (normals.size() != positions.size()) {
     throw std::out_of_range("array should be the same length");
   }
-  for (auto& normal : normals) normal = zero3f;
-  for (auto& q : quads) {
-    auto normal = quad_normal(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    auto area = quad_area(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    normals[q.x] += normal * area;
-    normals[q.y] += normal * area;
-    normals[q.z] += normal * area;
-    if (q.z != q.w) normals[q.w] += normal * area;
-  }
-  for (auto& normal : normals) normal = normalize(normal);
+  normals = compute_normals(quads, positions);
 }
 
 // Compute per-vertex tangent frame for triangle meshes.
@@ -175,27 +217,44 @@ void update_normals(std::vector<vec3f>& normals,
 std::vector<vec4f> compute_tangent_spaces(const std::vector<vec3i>& triangles,
     const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
     const std::vector<vec2f>& texcoords) {
-  auto tangu = std::vector<vec3f>(positions.size(), zero3f);
-  auto tangv = std::vector<vec3f>(positions.size(), zero3f);
-  for (auto t : triangles) {
-    auto tutv = triangle_tangents_fromuv(positions[t.x], positions[t.y],
-        positions[t.z], texcoords[t.x], texcoords[t.y], texcoords[t.z]);
-    for (auto vid : {t.x, t.y, t.z}) tangu[vid] += normalize(tutv.first);
-    for (auto vid : {t.x, t.y, t.z}) tangv[vid] += normalize(tutv.second);
-  }
-  for (auto& t : tangu) t = normalize(t);
-  for (auto& t : tangv) t = normalize(t);
+  // u and v tangents are interleaved
+  auto tangents = accumulate_vertices<vec3f>((int)positions.size() * 2,
+      (int)triangles.size(), [&](int idx, std::vector<vec3f>& tangents) {
+        auto& t    = triangles[idx];
+        auto  tutv = triangle_tangents_fromuv(positions[t.x], positions[t.y],
+            positions[t.z], texcoords[t.x], texcoords[t.y], texcoords[t.z]);
+        auto  tu   = normalize(tutv.first), tv = normalize(tutv.second);
+        for (auto vid : {t.x, t.y, t.z}) tangents[vid * 2 + 0] += tu;
+        for (auto vid : {t.x, t.y, t.z}) tangents[vid * 2 + 1] += tv;
+      });
 
   auto tangent_spaces = std::vector<vec4f>(positions.size());
-  for (auto& tangent : tangent_spaces) tangent = zero4f;
-  for (auto i = 0; i < positions.size(); i++) {
-    tangu[i] = orthonormalize(tangu[i], normals[i]);
-    auto s   = (dot(cross(normals[i], tangu[i]), tangv[i]) < 0) ? -1.0f : 1.0f;
-    tangent_spaces[i] = {tangu[i].x, tangu[i].y, tangu[i].z, s};
-  }
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
+    auto tangu = normalize(tangents[i * 2 + 0]);
+    auto tangv = normalize(tangents[i * 2 + 1]);
+    tangu      = orthonormalize(tangu, normals[i]);
+    auto s     = (dot(cross(normals[i], tangu), tangv) < 0) ? -1.0f : 1.0f;
+    tangent_spaces[i] = {tangu.x, tangu.y, tangu.z, s};
+  });
   return tangent_spaces;
 }
 
+// Skin a vertex position and normal by blending joint frames.
+static vec3f skin_position(const std::vector<frame3f>& xforms,
+    const vec3f& position, const vec4f& weights, const vec4i& joints) {
+  return transform_point(xforms[joints.x], position) * weights.x +
+         transform_point(xforms[joints.y], position) * weights.y +
+         transform_point(xforms[joints.z], position) * weights.z +
+         transform_point(xforms[joints.w], position) * weights.w;
+}
+static vec3f skin_normal(const std::vector<frame3f>& xforms,
+    const vec3f& normal, const vec4f& weights, const vec4i& joints) {
+  return normalize(transform_direction(xforms[joints.x], normal) * weights.x +
+                   transform_direction(xforms[joints.y], normal) * weights.y +
+                   transform_direction(xforms[joints.z], normal) * weights.z +
+                   transform_direction(xforms[joints.w], normal) * weights.w);
+}
+
 // Apply skinning
 std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_skinning(
     const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
@@ -203,20 +262,13 @@ std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_skinning(
     const std::vector<frame3f>& xforms) {
   auto skinned_positions = std::vector<vec3f>{positions.size()};
   auto skinned_normals   = std::vector<vec3f>{positions.size()};
-  for (auto i = 0; i < positions.size(); i++) {
-    skinned_positions[i] =
-        transform_point(xforms[joints[i].x], positions[i]) * weights[i].x +
-        transform_point(xforms[joints[i].y], positions[i]) * weights[i].y +
-        transform_point(xforms[joints[i].z], positions[i]) * weights[i].z +
-        transform_point(xforms[joints[i].w], positions[i]) * weights[i].w;
-  }
-  for (auto i = 0; i < normals.size(); i++) {
-    skinned_normals[i] = normalize(
-        transform_direction(xforms[joints[i].x], normals[i]) * weights[i].x +
-        transform_direction(xforms[joints[i].y], normals[i]) * weights[i].y +
-        transform_direction(xforms[joints[i].z], normals[i]) * weights[i].z +
-        transform_direction(xforms[joints[i].w], normals[i]) * weights[i].w);
-  }
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
+    skinned_positions[i] = skin_position(
+        xforms, positions[i], weights[i], joints[i]);
+    if (i < normals.size())
+      skinned_normals[i] = skin_normal(
+          xforms, normals[i], weights[i], joints[i]);
+  });
   return {skinned_positions, skinned_normals};
 }
 
@@ -227,14 +279,14 @@ std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_matrix_skinning(
     const std::vector<mat4f>& xforms) {
   auto skinned_positions = std::vector<vec3f>{positions.size()};
   auto skinned_normals   = std::vector<vec3f>{positions.size()};
-  for (auto i = 0; i < positions.size(); i++) {
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
     auto xform = xforms[joints[i].x] * weights[i].x +
                  xforms[joints[i].y] * weights[i].y +
                  xforms[joints[i].z] * weights[i].z +
                  xforms[joints[i].w] * weights[i].w;
     skinned_positions[i] = transform_point(xform, positions[i]);
     skinned_normals[i]   = normalize(transform_direction(xform, normals[i]));
-  }
+  });
   return {skinned_positions, skinned_normals};
 }
 
@@ -247,20 +299,13 @@ void update_skinning(std::vector<vec3f>& skinned_positions,
       skinned_normals.size() != normals.size()) {
     throw std::out_of_range("arrays should be the same size");
   }
-  for (auto i = 0; i < positions.size(); i++) {
-    skinned_positions[i] =
-        transform_point(xforms[joints[i].x], positions[i]) * weights[i].x +
-        transform_point(xforms[joints[i].y], positions[i]) * weights[i].y +
-        transform_point(xforms[joints[i].z], positions[i]) * weights[i].z +
-        transform_point(xforms[joints[i].w], positions[i]) * weights[i].w;
-  }
-  for (auto i = 0; i < normals.size(); i++) {
-    skinned_normals[i] = normalize(
-        transform_direction(xforms[joints[i].x], normals[i]) * weights[i].x +
-        transform_direction(xforms[joints[i].y], normals[i]) * weights[i].y +
-        transform_direction(xforms[joints[i].z], normals[i]) * weights[i].z +
-        transform_direction(xforms[joints[i].w], normals[i]) * weights[i].w);
-  }
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
+    skinned_positions[i] = skin_position(
+        xforms, positions[i], weights[i], joints[i]);
+    if (i < normals.size())
+      skinned_normals[i] = skin_normal(
+          xforms, normals[i], weights[i], joints[i]);
+  });
 }
 
 // Apply skinning as specified in Khronos glTF
@@ -272,14 +317,103 @@ void update_matrix_skinning(std::vector<vec3f>& skinned_positions,
       skinned_normals.size() != normals.size()) {
     throw std::out_of_range("arrays should be the same size");
   }
-  for (auto i = 0; i < positions.size(); i++) {
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
     auto xform = xforms[joints[i].x] * weights[i].x +
                  xforms[joints[i].y] * weights[i].y +
                  xforms[joints[i].z] * weights[i].z +
                  xforms[joints[i].w] * weights[i].w;
     skinned_positions[i] = transform_point(xform, positions[i]);
     skinned_normals[i]   = normalize(transform_direction(xform, normals[i]));
+  });
+}
+
+// Dual quaternion of a rigid frame, with real and dual parts stored as
+// vec4f with the scalar in w.
+struct dual_quaternion {
+  vec4f real = {0, 0, 0, 1};
+  vec4f dual = {0, 0, 0, 0};
+};
+static dual_quaternion make_dual_quaternion(const frame3f& frame) {
+  // rotation quaternion, choosing the largest diagonal term for stability
+  auto& r     = frame;
+  auto  trace = r.x.x + r.y.y + r.z.z;
+  auto  q     = vec4f{};
+  if (trace > 0) {
+    auto s = sqrt(trace + 1) * 2;
+    q = {(r.y.z - r.z.y) / s, (r.z.x - r.x.z) / s, (r.x.y - r.y.x) / s, s / 4};
+  } else if (r.x.x > r.y.y && r.x.x > r.z.z) {
+    auto s = sqrt(1 + r.x.x - r.y.y - r.z.z) * 2;
+    q = {s / 4, (r.y.x + r.x.y) / s, (r.z.x + r.x.z) / s, (r.y.z - r.z.y) / s};
+  } else if (r.y.y > r.z.z) {
+    auto s = sqrt(1 + r.y.y - r.x.x - r.z.z) * 2;
+    q = {(r.y.x + r.x.y) / s, s / 4, (r.z.y + r.y.z) / s, (r.z.x - r.x.z) / s};
+  } else {
+    auto s = sqrt(1 + r.z.z - r.x.x - r.y.y) * 2;
+    q = {(r.z.x + r.x.z) / s, (r.z.y + r.y.z) / s, s / 4, (r.x.y - r.y.x) / s};
+  }
+  q = normalize(q);
+  // dual part is half the translation times the rotation
+  auto t  = frame.o;
+  auto qv = vec3f{q.x, q.y, q.z};
+  auto dv = (t * q.w + cross(t, qv)) / 2;
+  return {q, {dv.x, dv.y, dv.z, -dot(t, qv) / 2}};
+}
+
+// Blend joint dual quaternions and apply them to a vertex.
+static std::pair<vec3f, vec3f> skin_dual_quaternion(
+    const std::vector<dual_quaternion>& dquats, const vec3f& position,
+    const vec3f& normal, const vec4f& weights, const vec4i& joints) {
+  // blend in the hemisphere of the first joint
+  auto real = vec4f{0, 0, 0, 0}, dual = vec4f{0, 0, 0, 0};
+  auto& first = dquats[joints.x].real;
+  for (auto k = 0; k < 4; k++) {
+    auto& dquat  = dquats[joints[k]];
+    auto  weight = dot(dquat.real, first) < 0 ? -weights[k] : weights[k];
+    real += dquat.real * weight;
+    dual += dquat.dual * weight;
+  }
+  auto norm = length(real);
+  real /= norm;
+  dual /= norm;
+  // rotate and translate
+  auto rv     = vec3f{real.x, real.y, real.z};
+  auto dv     = vec3f{dual.x, dual.y, dual.z};
+  auto rotate = [&](const vec3f& v) {
+    return v + cross(rv, cross(rv, v) + v * real.w) * 2;
+  };
+  auto translation = (dv * real.w - rv * dual.w + cross(rv, dv)) * 2;
+  return {rotate(position) + translation, normalize(rotate(normal))};
+}
+
+// Apply dual quaternion skinning
+std::pair<std::vector<vec3f>, std::vector<vec3f>>
+compute_dual_quaternion_skinning(const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms) {
+  auto skinned_positions = std::vector<vec3f>{positions.size()};
+  auto skinned_normals   = std::vector<vec3f>{normals.size()};
+  update_dual_quaternion_skinning(skinned_positions, skinned_normals,
+      positions, normals, weights, joints, xforms);
+  return {skinned_positions, skinned_normals};
+}
+void update_dual_quaternion_skinning(std::vector<vec3f>& skinned_positions,
+    std::vector<vec3f>& skinned_normals, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms) {
+  if (skinned_positions.size() != positions.size() ||
+      skinned_normals.size() != normals.size()) {
+    throw std::out_of_range("arrays should be the same size");
   }
+  auto dquats = std::vector<dual_quaternion>(xforms.size());
+  for (auto idx = 0; idx < xforms.size(); idx++)
+    dquats[idx] = make_dual_quaternion(xforms[idx]);
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int i) {
+    auto normal = i < normals.size() ? normals[i] : vec3f{0, 0, 1};
+    auto [position, skinned_normal] = skin_dual_quaternion(
+        dquats, positions[i], normal, weights[i], joints[i]);
+    skinned_positions[i] = position;
+    if (i < normals.size()) skinned_normals[i] = skinned_normal;
+  });
 }
 
 }  // namespace yocto::shape
@@ -350,6 +484,7 @@ namespace yocto::shape {
 // Initialize an edge map with elements.
 edge_map make_edge_map(const std::vector<vec3i>& triangles) {
   auto emap = edge_map{};
+  emap.index.reserve(triangles.size() * 3 / 2);
   for (auto& t : triangles) {
     insert_edge(emap, {t.x, t.y});
     insert_edge(emap, {t.y, t.z});
@@ -359,6 +494,7 @@ edge_map make_edge_map(const std::vector<vec3i>& triangles) {
 }
 edge_map make_edge_map(const std::vector<vec4i>& quads) {
   auto emap = edge_map{};
+  emap.index.reserve(quads.size() * 2);
   for (auto& q : quads) {
     insert_edge(emap, {q.x, q.y});
     insert_edge(emap, {q.y, q.z});
@@ -384,28 +520,23 @@ void insert_edges(edge_map& emap, const std::vector<vec4i>& quads) {
 }
 // Insert an edge and return its index
 int insert_edge(edge_map& emap, const vec2i& edge) {
-  auto es = edge.x < edge.y ? edge : vec2i{edge.y, edge.x};
-  auto it = emap.index.find(es);
-  if (it == emap.index.end()) {
-    auto idx = (int)emap.edges.size();
-    emap.index.insert(it, {es, idx});
+  auto es                = edge.x < edge.y ? edge : vec2i{edge.y, edge.x};
+  auto [index, inserted] = emap.index.insert(es, (int)emap.edges.size());
+  if (inserted) {
     emap.edges.push_back(es);
     emap.nfaces.push_back(1);
-    return idx;
   } else {
-    auto idx = it->second;
-    emap.nfaces[idx] += 1;
-    return idx;
+    emap.nfaces[*index] += 1;
   }
+  return *index;
 }
 // Get number of edges
 int num_edges(const edge_map& emap) { return emap.edges.size(); }
 // Get the edge index
 int edge_index(const edge_map& emap, const vec2i& edge) {
-  auto es       = edge.x < edge.y ? edge : vec2i{edge.y, edge.x};
-  auto iterator = emap.index.find(es);
-  if (iterator == emap.index.end()) return -1;
-  return iterator->second;
+  auto es    = edge.x < edge.y ? edge : vec2i{edge.y, edge.x};
+  auto index = emap.index.find(es);
+  return index ? *index : -1;
 }
 // Get a list of edges, boundary edges, boundary vertices
 std::vector<vec2i> get_edges(const edge_map& emap) { return emap.edges; }
@@ -423,37 +554,72 @@ std::vector<vec2i> get_edges(const std::vector<vec4i>& quads) {
   return get_edges(make_edge_map(quads));
 }
 
-// Build adjacencies between faces (sorted counter-clockwise)
-std::vector<vec3i> face_adjacencies(const std::vector<vec3i>& triangles) {
-  auto get_edge = [](const vec3i& triangle, int i) -> vec2i {
-    auto x = triangle[i], y = triangle[i < 2 ? i + 1 : 0];
+// Convert per-bucket counts to offsets, with the total as last element
+static std::vector<int> make_bucket_offsets(
+    const std::vector<std::atomic<int>>& counts) {
+  auto offsets = std::vector<int>(counts.size() + 1, 0);
+  for (auto idx = 0; idx < (int)counts.size(); idx++) {
+    offsets[idx + 1] = offsets[idx] + counts[idx];
+  }
+  return offsets;
+}
+
+// Build face adjacencies by bucketing edges by their smallest vertex and
+// sorting each bucket. Edges shared by more than two faces are linked as in
+// face_adjacencies(): the first face to the last one, the others to the first.
+static std::vector<vec3i> make_face_adjacencies(
+    const std::vector<vec3i>& triangles, int num_vertices) {
+  auto num_faces = (int)triangles.size();
+  auto get_edge  = [&triangles](int corner) -> vec2i {
+    auto& triangle = triangles[corner / 3];
+    auto  x = triangle[corner % 3], y = triangle[(corner + 1) % 3];
     return x < y ? vec2i{x, y} : vec2i{y, x};
   };
-  auto adjacencies = std::vector<vec3i>{triangles.size(), vec3i{-1, -1, -1}};
-  auto edge_map    = std::unordered_map<vec2i, int>();
-  edge_map.reserve((size_t)(triangles.size() * 1.5));
-  for (int i = 0; i < triangles.size(); ++i) {
-    for (int k = 0; k < 3; ++k) {
-      auto edge = get_edge(triangles[i], k);
-      auto it   = edge_map.find(edge);
-      if (it == edge_map.end()) {
-        edge_map.insert(it, {edge, i});
-      } else {
-        auto neighbor     = it->second;
-        adjacencies[i][k] = neighbor;
-        for (int kk = 0; kk < 3; ++kk) {
-          auto edge2 = get_edge(triangles[neighbor], kk);
-          if (edge2 == edge) {
-            adjacencies[neighbor][kk] = i;
-            break;
-          }
-        }
+
+  // bucket corners by the smallest vertex of their edge
+  auto counts = std::vector<std::atomic<int>>(num_vertices);
+  common::parallel_for(0, num_faces * 3, 4096,
+      [&](int corner) { counts[get_edge(corner).x] += 1; });
+  auto offsets = make_bucket_offsets(counts);
+  for (auto& count : counts) count = 0;
+  auto corners = std::vector<int>(num_faces * 3);
+  common::parallel_for(0, num_faces * 3, 4096, [&](int corner) {
+    auto vertex = get_edge(corner).x;
+    corners[offsets[vertex] + counts[vertex]++] = corner;
+  });
+
+  // sort buckets by edge and corner, and link the faces of equal edges
+  auto adjacencies = std::vector<vec3i>(num_faces, vec3i{-1, -1, -1});
+  common::parallel_for(0, num_vertices, 1024, [&](int vertex) {
+    auto begin = corners.begin() + offsets[vertex];
+    auto end   = corners.begin() + offsets[vertex + 1];
+    std::sort(begin, end, [&get_edge](int a, int b) {
+      auto ea = get_edge(a).y, eb = get_edge(b).y;
+      return ea < eb || (ea == eb && a < b);
+    });
+    for (auto first = begin; first != end;) {
+      auto last = first + 1;
+      while (last != end && get_edge(*last).y == get_edge(*first).y) last++;
+      for (auto it = first + 1; it != last; it++) {
+        adjacencies[*it / 3][*it % 3] = *first / 3;
       }
+      if (last - first > 1)
+        adjacencies[*first / 3][*first % 3] = *(last - 1) / 3;
+      first = last;
     }
-  }
+  });
   return adjacencies;
 }
 
+// Build adjacencies between faces (sorted counter-clockwise)
+std::vector<vec3i> face_adjacencies(const std::vector<vec3i>& triangles) {
+  auto num_vertices = 0;
+  for (auto& triangle : triangles) {
+    num_vertices = max(num_vertices, max(triangle) + 1);
+  }
+  return make_face_adjacencies(triangles, num_vertices);
+}
+
 // Build adjacencies between vertices (sorted counter-clockwise)
 std::vector<std::vector<int>> vertex_adjacencies(
     const std::vector<vec3i>& triangles,
@@ -589,6 +755,120 @@ std::vector<std::vector<int>> ordered_boundaries(
   return boundaries;
 }
 
+// Build mesh connectivity in parallel, by bucketing edges and corners.
+mesh_adjacency make_mesh_adjacency(
+    const std::vector<vec3i>& triangles, int num_vertices) {
+  auto  adjacency   = mesh_adjacency{};
+  auto  num_faces   = (int)triangles.size();
+  auto& adjacencies = adjacency.adjacencies;
+  adjacencies       = make_face_adjacencies(triangles, num_vertices);
+
+  // bucket faces by their vertices, sorted by face index
+  auto counts = std::vector<std::atomic<int>>(num_vertices);
+  common::parallel_for(0, num_faces * 3, 4096,
+      [&](int corner) { counts[triangles[corner / 3][corner % 3]] += 1; });
+  auto& face_offsets = adjacency.face_offsets;
+  face_offsets       = make_bucket_offsets(counts);
+  for (auto& count : counts) count = 0;
+  auto faces = std::vector<int>(num_faces * 3);
+  common::parallel_for(0, num_faces * 3, 4096, [&](int corner) {
+    auto vertex = triangles[corner / 3][corner % 3];
+    faces[face_offsets[vertex] + counts[vertex]++] = corner / 3;
+  });
+
+  // walk faces counter-clockwise around each vertex, starting from a face
+  // with a boundary edge if any; faces not reached by the walk, around
+  // non-manifold vertices, are added at the end
+  auto& vertex_faces = adjacency.vertex_faces;
+  vertex_faces.assign(num_faces * 3, -1);
+  auto visited    = std::vector<byte>(num_faces * 3, 0);
+  auto boundaries = std::vector<byte>(num_vertices, 0);
+  common::parallel_for(0, num_vertices, 1024, [&](int vertex) {
+    auto offset = face_offsets[vertex];
+    auto num    = face_offsets[vertex + 1] - offset;
+    if (num == 0) return;
+    auto begin = faces.begin() + offset, end = begin + num;
+    std::sort(begin, end);
+    auto corner = [&](int face) {
+      auto& triangle = triangles[face];
+      if (triangle.x == vertex) return 0;
+      if (triangle.y == vertex) return 1;
+      if (triangle.z == vertex) return 2;
+      return -1;
+    };
+    auto start = *begin;
+    for (auto it = begin; it != end; it++) {
+      if (adjacencies[*it][corner(*it)] == -1) {
+        start              = *it;
+        boundaries[vertex] = 1;
+        break;
+      }
+    }
+    auto count = 0, face = start;
+    while (count < num) {
+      auto k = corner(face);
+      if (k < 0) break;
+      auto pos = (int)(std::lower_bound(begin, end, face) - faces.begin());
+      if (visited[pos]) break;
+      visited[pos]                   = 1;
+      vertex_faces[offset + count++] = face;
+      face = adjacencies[face][(k + 2) % 3];
+      if (face == -1) break;
+    }
+    for (auto pos = offset; pos < offset + num && count < num; pos++) {
+      if (!visited[pos]) vertex_faces[offset + count++] = faces[pos];
+    }
+  });
+
+  // neighbors are the previous vertex in each face, plus the next vertex of
+  // the first face for boundary vertices
+  auto& neighbor_offsets = adjacency.neighbor_offsets;
+  neighbor_offsets.assign(num_vertices + 1, 0);
+  for (auto vertex = 0; vertex < num_vertices; vertex++) {
+    neighbor_offsets[vertex + 1] = neighbor_offsets[vertex] +
+                                   face_offsets[vertex + 1] -
+                                   face_offsets[vertex] +
+                                   (boundaries[vertex] ? 1 : 0);
+  }
+  auto& vertex_neighbors = adjacency.vertex_neighbors;
+  vertex_neighbors.assign(neighbor_offsets.back(), -1);
+  common::parallel_for(0, num_vertices, 1024, [&](int vertex) {
+    auto next = neighbor_offsets[vertex];
+    for (auto pos = face_offsets[vertex]; pos < face_offsets[vertex + 1];
+         pos++) {
+      auto& triangle = triangles[vertex_faces[pos]];
+      auto  k        = triangle.x == vertex ? 0 : triangle.y == vertex ? 1 : 2;
+      if (boundaries[vertex] && pos == face_offsets[vertex])
+        vertex_neighbors[next++] = triangle[(k + 1) % 3];
+      vertex_neighbors[next++] = triangle[(k + 2) % 3];
+    }
+  });
+
+  return adjacency;
+}
+
+// Update normals with precomputed adjacency
+void update_normals(std::vector<vec3f>& normals,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    const mesh_adjacency& adjacency) {
+  if (normals.size() != positions.size() ||
+      adjacency.face_offsets.size() != positions.size() + 1) {
+    throw std::out_of_range("array should be the same length");
+  }
+  auto face_normals = std::vector<vec3f>(triangles.size());
+  common::parallel_for(0, (int)triangles.size(), 4096, [&](int face) {
+    face_normals[face] = weighted_normal(positions, triangles[face]);
+  });
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int vertex) {
+    auto normal = zero3f;
+    for (auto pos = adjacency.face_offsets[vertex];
+         pos < adjacency.face_offsets[vertex + 1]; pos++) {
+      normal += face_normals[adjacency.vertex_faces[pos]];
+    }
+    normals[vertex] = normalize(normal);
+  });
+}
+
 }  // namespace yocto::shape
 
 #ifdef YOCTO_EMBREE
@@ -642,20 +922,36 @@ static RTCDevice     bvh_embree_device() {
 void init_shape_embree_bvh(bvh_shape& shape) {
   auto edevice = bvh_embree_device();
   auto escene  = rtcNewScene(edevice);
-  if (!shape.points.empty()) {
-    throw std::runtime_error("embree does not support points");
-  } else if (!shape.lines.empty()) {
-    auto elines     = std::vector<int>{};
-    auto epositions = std::vector<vec4f>{};
-    auto last_index = -1;
-    for (auto& l : shape.lines) {
+  if (shape.points && !shape.points->empty()) {
+    // points are ray-facing discs, indexed by point
+    auto& points     = *shape.points;
+    auto& positions  = *shape.positions;
+    auto& radius     = *shape.radius;
+    auto  epositions = std::vector<vec4f>{};
+    epositions.reserve(points.size());
+    for (auto& p : points) epositions.push_back({positions[p], radius[p]});
+    auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_DISC_POINT);
+    rtcSetGeometryVertexAttributeCount(egeometry, 1);
+    auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, 4 * 4, epositions.size());
+    memcpy(embree_positions, epositions.data(), epositions.size() * 16);
+    rtcCommitGeometry(egeometry);
+    rtcAttachGeometryByID(escene, egeometry, 0);
+  } else if (shape.lines && !shape.lines->empty()) {
+    auto& lines      = *shape.lines;
+    auto& positions  = *shape.positions;
+    auto& radius     = *shape.radius;
+    auto  elines     = std::vector<int>{};
+    auto  epositions = std::vector<vec4f>{};
+    auto  last_index = -1;
+    for (auto& l : lines) {
       if (last_index == l.x) {
         elines.push_back((int)epositions.size() - 1);
-        epositions.push_back({shape.positions[l.y], shape.radius[l.y]});
+        epositions.push_back({positions[l.y], radius[l.y]});
       } else {
         elines.push_back((int)epositions.size());
-        epositions.push_back({shape.positions[l.x], shape.radius[l.x]});
-        epositions.push_back({shape.positions[l.y], shape.radius[l.y]});
+        epositions.push_back({positions[l.x], radius[l.x]});
+        epositions.push_back({positions[l.y], radius[l.y]});
       }
       last_index = l.y;
     }
@@ -670,32 +966,30 @@ void init_shape_embree_bvh(bvh_shape& shape) {
     memcpy(embree_lines, elines.data(), elines.size() * 4);
     rtcCommitGeometry(egeometry);
     rtcAttachGeometryByID(escene, egeometry, 0);
-  } else if (!shape.triangles.empty()) {
-    auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_TRIANGLE);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    auto& triangles = *shape.triangles;
+    auto& positions = *shape.positions;
+    auto  egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_TRIANGLE);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
     auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
-        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4,
-        shape.positions.size());
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4, positions.size());
     auto embree_triangles = rtcSetNewGeometryBuffer(egeometry,
-        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * 4,
-        shape.triangles.size());
-    memcpy(
-        embree_positions, shape.positions.data(), shape.positions.size() * 12);
-    memcpy(
-        embree_triangles, shape.triangles.data(), shape.triangles.size() * 12);
+        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * 4, triangles.size());
+    memcpy(embree_positions, positions.data(), positions.size() * 12);
+    memcpy(embree_triangles, triangles.data(), triangles.size() * 12);
     rtcCommitGeometry(egeometry);
     rtcAttachGeometryByID(escene, egeometry, 0);
-  } else if (!shape.quads.empty()) {
-    auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_QUAD);
+  } else if (shape.quads && !shape.quads->empty()) {
+    auto& quads     = *shape.quads;
+    auto& positions = *shape.positions;
+    auto  egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_QUAD);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
     auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
-        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4,
-        shape.positions.size());
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4, positions.size());
     auto embree_quads     = rtcSetNewGeometryBuffer(egeometry,
-        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT4, 4 * 4, shape.quads.size());
-    memcpy(
-        embree_positions, shape.positions.data(), shape.positions.size() * 12);
-    memcpy(embree_quads, shape.quads.data(), shape.quads.size() * 16);
+        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT4, 4 * 4, quads.size());
+    memcpy(embree_positions, positions.data(), positions.size() * 12);
+    memcpy(embree_quads, quads.data(), quads.size() * 16);
     rtcCommitGeometry(egeometry);
     rtcAttachGeometryByID(escene, egeometry, 0);
   } else {
@@ -797,67 +1091,213 @@ bool intersect_scene_embree_bvh(const bvh_scene& scene, const ray3f& ray,
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
-#if !defined(_WIN32) && !defined(_WIN64)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-function"
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#ifndef __clang__
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-#endif
-#endif
+// Number of primitives processed by each parallel task in bvh builds. Ranges
+// smaller than twice this are processed serially. The chunk size does not
+// depend on the number of threads, so that built trees are deterministic.
+const int bvh_parallel_chunk = 1 << 15;
+
+// Number of chunks a primitive range is split into for parallel processing.
+static int get_bvh_chunks(int start, int end) {
+  if (end - start < 2 * bvh_parallel_chunk) return 1;
+  return (end - start + bvh_parallel_chunk - 1) / bvh_parallel_chunk;
+}
+
+// Range of a chunk of a primitive range.
+static std::pair<int, int> get_bvh_chunk(int start, int end, int chunk) {
+  return {start + chunk * bvh_parallel_chunk,
+      min(start + (chunk + 1) * bvh_parallel_chunk, end)};
+}
+
+// Compute the centroid bounds of a primitive range, in parallel for large
+// ranges.
+static bbox3f compute_centroid_bounds(
+    const std::vector<bvh_primitive>& primitives, int start, int end) {
+  auto nchunks = get_bvh_chunks(start, end);
+  if (nchunks == 1) {
+    auto cbbox = invalidb3f;
+    for (auto i = start; i < end; i++)
+      cbbox = merge(cbbox, primitives[i].center);
+    return cbbox;
+  }
+  auto cbboxes = std::vector<bbox3f>(nchunks, invalidb3f);
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    for (auto i = cstart; i < cend; i++)
+      cbboxes[chunk] = merge(cbboxes[chunk], primitives[i].center);
+  });
+  auto cbbox = invalidb3f;
+  for (auto& chunk_cbbox : cbboxes) cbbox = merge(cbbox, chunk_cbbox);
+  return cbbox;
+}
+
+// Compute the bounds of a primitive range, in parallel for large ranges.
+static bbox3f compute_bounds(
+    const std::vector<bvh_primitive>& primitives, int start, int end) {
+  auto nchunks = get_bvh_chunks(start, end);
+  if (nchunks == 1) {
+    auto bbox = invalidb3f;
+    for (auto i = start; i < end; i++) bbox = merge(bbox, primitives[i].bbox);
+    return bbox;
+  }
+  auto bboxes = std::vector<bbox3f>(nchunks, invalidb3f);
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    for (auto i = cstart; i < cend; i++)
+      bboxes[chunk] = merge(bboxes[chunk], primitives[i].bbox);
+  });
+  auto bbox = invalidb3f;
+  for (auto& chunk_bbox : bboxes) bbox = merge(bbox, chunk_bbox);
+  return bbox;
+}
+
+// Partition a primitive range so that primitives satisfying `pred` come
+// first. Returns the partition position. Large ranges are partitioned in
+// parallel in chunks, that are then gathered with a temporary buffer. This
+// changes the order, but not the set, of primitives in each partition.
+template <typename Pred>
+static int partition_primitives(
+    std::vector<bvh_primitive>& primitives, int start, int end, Pred&& pred) {
+  auto nchunks = get_bvh_chunks(start, end);
+  if (nchunks == 1 || common::get_num_threads() == 1) {
+    return (int)(std::partition(primitives.data() + start,
+                     primitives.data() + end, pred) -
+                 primitives.data());
+  }
+
+  // partition chunks
+  auto counts = std::vector<int>(nchunks, 0);
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    counts[chunk]       = (int)(std::partition(primitives.data() + cstart,
+                              primitives.data() + cend, pred) -
+                          (primitives.data() + cstart));
+  });
+
+  // compute chunk offsets
+  auto left_offsets = std::vector<int>(nchunks, 0);
+  auto right_offsets = std::vector<int>(nchunks, 0);
+  auto left = start, right = start;
+  for (auto count : counts) right += count;
+  auto mid = right;
+  for (auto chunk = 0; chunk < nchunks; chunk++) {
+    auto [cstart, cend]  = get_bvh_chunk(start, end, chunk);
+    left_offsets[chunk]  = left;
+    right_offsets[chunk] = right;
+    left += counts[chunk];
+    right += cend - cstart - counts[chunk];
+  }
+
+  // gather chunks and copy back
+  auto partitioned = std::vector<bvh_primitive>(end - start);
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    auto cmid           = cstart + counts[chunk];
+    std::copy(primitives.data() + cstart, primitives.data() + cmid,
+        partitioned.data() + left_offsets[chunk] - start);
+    std::copy(primitives.data() + cmid, primitives.data() + cend,
+        partitioned.data() + right_offsets[chunk] - start);
+  });
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    std::copy(partitioned.data() + cstart - start,
+        partitioned.data() + cend - start, primitives.data() + cstart);
+  });
+
+  return mid;
+}
+
+// Bin used by the SAH heuristic.
+struct bvh_bin {
+  bbox3f bbox  = invalidb3f;
+  int    count = 0;
+};
 
 // Splits a BVH node using the SAH heuristic. Returns split position and axis.
-static std::pair<int, int> split_sah(std::vector<int>& primitives,
-    const std::vector<bbox3f>& bboxes, const std::vector<vec3f>& centers,
-    int start, int end) {
+// Primitives are binned by centroid along each axis in a single pass, that
+// runs in parallel for large ranges, and the split costs are computed by
+// sweeping the bins.
+static std::pair<int, int> split_sah(
+    std::vector<bvh_primitive>& primitives, int start, int end) {
   // initialize split axis and position
   auto split_axis = 0;
   auto mid        = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centroid_bounds(primitives, start, end);
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, split_axis};
 
-  // consider N bins, compute their cost and keep the minimum
-  const int nbins    = 16;
-  auto      middle   = 0.0f;
-  auto      min_cost = flt_max;
-  auto      area     = [](auto& b) {
+  // bin primitives along each axis
+  const int nbins   = 16;
+  auto      get_bin = [&cbbox, &csize](const vec3f& center, int axis) {
+    if (csize[axis] == 0) return 0;
+    auto bin = (int)(nbins * (center[axis] - cbbox.min[axis]) / csize[axis]);
+    return clamp(bin, 0, nbins - 1);
+  };
+  auto nchunks = get_bvh_chunks(start, end);
+  auto bins    = std::vector<bvh_bin>(nchunks * 3 * nbins);
+  common::parallel_for(nchunks, [&](int chunk) {
+    auto [cstart, cend] = get_bvh_chunk(start, end, chunk);
+    auto chunk_bins     = bins.data() + chunk * 3 * nbins;
+    for (auto i = cstart; i < cend; i++) {
+      auto& primitive = primitives[i];
+      for (auto axis = 0; axis < 3; axis++) {
+        auto& bin = chunk_bins[axis * nbins + get_bin(primitive.center, axis)];
+        bin.bbox  = merge(bin.bbox, primitive.bbox);
+        bin.count += 1;
+      }
+    }
+  });
+  for (auto chunk = 1; chunk < nchunks; chunk++) {
+    for (auto idx = 0; idx < 3 * nbins; idx++) {
+      auto& bin = bins[idx];
+      auto& chunk_bin = bins[chunk * 3 * nbins + idx];
+      bin.bbox        = merge(bin.bbox, chunk_bin.bbox);
+      bin.count += chunk_bin.count;
+    }
+  }
+
+  // consider splits between bins, compute their cost and keep the minimum
+  auto split    = 0;
+  auto min_cost = flt_max;
+  auto area     = [](auto& b) {
     auto size = b.max - b.min;
     return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
            2 * size.y * size.z;
   };
   for (auto saxis = 0; saxis < 3; saxis++) {
+    if (csize[saxis] == 0) continue;
+    auto axis_bins = bins.data() + saxis * nbins;
+    // sweep from the right to get the cost of the right sides
+    auto right_costs = std::array<float, nbins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto b = nbins - 1; b > 0; b--) {
+      right_bbox = merge(right_bbox, axis_bins[b].bbox);
+      right_count += axis_bins[b].count;
+      right_costs[b] = right_count ? right_count * area(right_bbox) : 0;
+    }
+    // sweep from the left and combine
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
     for (auto b = 1; b < nbins; b++) {
-      auto split     = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < split) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * area(left_bbox) / area(cbbox) +
-                  right_nprims * area(right_bbox) / area(cbbox);
+      left_bbox = merge(left_bbox, axis_bins[b - 1].bbox);
+      left_count += axis_bins[b - 1].count;
+      auto cost = (left_count ? left_count * area(left_bbox) : 0) +
+                  right_costs[b];
       if (cost < min_cost) {
         min_cost   = cost;
-        middle     = split;
+        split      = b;
         split_axis = saxis;
       }
     }
   }
+
   // split
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [split_axis, middle, &centers](
-                      auto a) { return centers[a][split_axis] < middle; }) -
-              primitives.data());
+  mid = partition_primitives(primitives, start, end,
+      [split_axis, split, &get_bin](auto& primitive) {
+        return get_bin(primitive.center, split_axis) < split;
+      });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
@@ -871,17 +1311,14 @@ static std::pair<int, int> split_sah(std::vector<int>& primitives,
 
 // Splits a BVH node using the balance heuristic. Returns split position and
 // axis.
-static std::pair<int, int> split_balanced(std::vector<int>& primitives,
-    const std::vector<bbox3f>& bboxes, const std::vector<vec3f>& centers,
-    int start, int end) {
+static std::pair<int, int> split_balanced(
+    std::vector<bvh_primitive>& primitives, int start, int end) {
   // initialize split axis and position
   auto axis = 0;
   auto mid  = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centroid_bounds(primitives, start, end);
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, axis};
 
@@ -894,15 +1331,14 @@ static std::pair<int, int> split_balanced(std::vector<int>& primitives,
   // bounding box and split along this one right in the middle
   mid = (start + end) / 2;
   std::nth_element(primitives.data() + start, primitives.data() + mid,
-      primitives.data() + end, [axis, &centers](auto a, auto b) {
-        return centers[a][axis] < centers[b][axis];
+      primitives.data() + end, [axis](auto& primitive_a, auto& primitive_b) {
+        return primitive_a.center[axis] < primitive_b.center[axis];
       });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    axis = 0;
-    mid  = (start + end) / 2;
+    // throw std::runtime_error("bad bvh split");
+    mid = (start + end) / 2;
   }
 
   return {mid, axis};
@@ -910,17 +1346,14 @@ static std::pair<int, int> split_balanced(std::vector<int>& primitives,
 
 // Splits a BVH node using the middle heutirtic. Returns split position and
 // axis.
-static std::pair<int, int> split_middle(std::vector<int>& primitives,
-    const std::vector<bbox3f>& bboxes, const std::vector<vec3f>& centers,
-    int start, int end) {
+static std::pair<int, int> split_middle(
+    std::vector<bvh_primitive>& primitives, int start, int end) {
   // initialize split axis and position
   auto axis = 0;
   auto mid  = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
+  auto cbbox = compute_centroid_bounds(primitives, start, end);
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, axis};
 
@@ -930,48 +1363,29 @@ static std::pair<int, int> split_middle(std::vector<int>& primitives,
   if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
 
   // split the space in the middle along the largest axis
-  auto cmiddle = (cbbox.max + cbbox.min) / 2;
-  auto middle  = cmiddle[axis];
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [axis, middle, &centers](
-                      auto a) { return centers[a][axis] < middle; }) -
-              primitives.data());
+  mid = partition_primitives(primitives, start, end,
+      [axis, middle = center(cbbox)[axis]](auto& primitive) {
+        return primitive.center[axis] < middle;
+      });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    axis = 0;
-    mid  = (start + end) / 2;
+    // throw std::runtime_error("bad bvh split");
+    mid = (start + end) / 2;
   }
 
   return {mid, axis};
 }
 
-#if !defined(_WIN32) && !defined(_WIN64)
-#pragma GCC diagnostic pop
-#endif
-
 // Build BVH nodes
-static void build_bvh(bvh_tree& bvh, std::vector<bbox3f>& bboxes) {
-  // get values
-  auto& nodes      = bvh.nodes;
-  auto& primitives = bvh.primitives;
-
+void build_bvh_nodes(std::vector<bvh_node>& nodes,
+    std::vector<bvh_primitive>& primitives, bvh_split split, int max_prims) {
   // prepare to build nodes
   nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
-
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
-
-  // prepare centers
-  auto centers = std::vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+  nodes.reserve(primitives.size() * 2);
 
   // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)bboxes.size()}};
+  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
   nodes.emplace_back();
 
   // create nodes until the queue is empty
@@ -985,14 +1399,17 @@ static void build_bvh(bvh_tree& bvh, std::vector<bbox3f>& bboxes) {
     auto& node = nodes[nodeid];
 
     // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    node.bbox = compute_bounds(primitives, start, end);
 
     // split into two children
-    if (end - start > bvh_max_prims) {
+    if (end - start > max_prims) {
       // get split
-      auto [mid, axis] = split_middle(primitives, bboxes, centers, start, end);
+      auto [mid, axis] =
+          split == bvh_split::sah
+              ? split_sah(primitives, start, end)
+              : split == bvh_split::balanced
+                    ? split_balanced(primitives, start, end)
+                    : split_middle(primitives, start, end);
 
       // make an internal node
       node.internal = true;
@@ -1015,23 +1432,44 @@ static void build_bvh(bvh_tree& bvh, std::vector<bbox3f>& bboxes) {
   nodes.shrink_to_fit();
 }
 
-// Update bvh
-static void update_bvh(bvh_tree& bvh, const std::vector<bbox3f>& bboxes) {
-  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh.nodes[nodeid];
+// Refit BVH nodes
+void refit_bvh_nodes(
+    std::vector<bvh_node>& nodes, const std::vector<bbox3f>& bboxes) {
+  for (auto nodeid = (int)nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = nodes[nodeid];
     node.bbox  = invalidb3f;
     if (node.internal) {
       for (auto idx = 0; idx < 2; idx++) {
-        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
+        node.bbox = merge(node.bbox, nodes[node.start + idx].bbox);
       }
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        node.bbox = merge(node.bbox, bboxes[bvh.primitives[node.start + idx]]);
+        node.bbox = merge(node.bbox, bboxes[node.start + idx]);
       }
     }
   }
 }
 
+// Build shape and scene bvhs from element bounds
+static void build_bvh(bvh_tree& bvh, const std::vector<bbox3f>& bboxes) {
+  auto primitives = std::vector<bvh_primitive>(bboxes.size());
+  common::parallel_for(0, (int)bboxes.size(), 4096, [&](int idx) {
+    primitives[idx] = {bboxes[idx], center(bboxes[idx]), {idx, 0}};
+  });
+  build_bvh_nodes(bvh.nodes, primitives, bvh_split::middle);
+  bvh.primitives.resize(primitives.size());
+  for (auto idx = 0; idx < primitives.size(); idx++)
+    bvh.primitives[idx] = primitives[idx].primitive.x;
+}
+
+// Update bvh from element bounds
+static void update_bvh(bvh_tree& bvh, const std::vector<bbox3f>& bboxes) {
+  auto sorted = std::vector<bbox3f>(bvh.primitives.size());
+  for (auto idx = 0; idx < sorted.size(); idx++)
+    sorted[idx] = bboxes[bvh.primitives[idx]];
+  refit_bvh_nodes(bvh.nodes, sorted);
+}
+
 // Build shape bvh
 void make_points_bvh(bvh_tree& bvh, const std::vector<int>& points,
     const std::vector<vec3f>& positions, const std::vector<float>& radius) {
@@ -1395,6 +1833,13 @@ bvh_intersection overlap_quads_bvh(const bvh_tree& bvh,
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
+// Shape data referenced by a bvh, or an empty array if not set.
+template <typename T>
+static const std::vector<T>& get_bvh_data(const std::vector<T>* data) {
+  static const auto empty = std::vector<T>{};
+  return data ? *data : empty;
+}
+
 void init_shape_bvh(bvh_shape& shape, bool embree) {
 #ifdef YOCTO_EMBREE
   // call Embree if needed
@@ -1403,39 +1848,20 @@ void init_shape_bvh(bvh_shape& shape, bool embree) {
   }
 #endif
 
-  // build primitives
-  auto bboxes = std::vector<bbox3f>{};
-  if (!shape.points.empty()) {
-    bboxes = std::vector<bbox3f>(shape.points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
-    }
-  } else if (!shape.lines.empty()) {
-    bboxes = std::vector<bbox3f>(shape.lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
-          shape.radius[l.x], shape.radius[l.y]);
-    }
-  } else if (!shape.triangles.empty()) {
-    bboxes = std::vector<bbox3f>(shape.triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape.triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
-    }
-  } else if (!shape.quads.empty()) {
-    bboxes = std::vector<bbox3f>(shape.quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
-          shape.positions[q.z], shape.positions[q.w]);
-    }
+  // build nodes from the referenced data
+  auto& positions = get_bvh_data(shape.positions);
+  auto& radius    = get_bvh_data(shape.radius);
+  if (shape.points && !shape.points->empty()) {
+    make_points_bvh(shape.bvh, *shape.points, positions, radius);
+  } else if (shape.lines && !shape.lines->empty()) {
+    make_lines_bvh(shape.bvh, *shape.lines, positions, radius);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    make_triangles_bvh(shape.bvh, *shape.triangles, positions, radius);
+  } else if (shape.quads && !shape.quads->empty()) {
+    make_quads_bvh(shape.bvh, *shape.quads, positions, radius);
+  } else {
+    shape.bvh = {};
   }
-
-  // build nodes
-  build_bvh(shape.bvh, bboxes);
 }
 
 void init_scene_bvh(bvh_scene& scene, bool embree) {
@@ -1472,39 +1898,18 @@ void update_shape_bvh(bvh_shape& shape) {
   }
 #endif
 
-  // build primitives
-  auto bboxes = std::vector<bbox3f>{};
-  if (!shape.points.empty()) {
-    bboxes = std::vector<bbox3f>(shape.points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
-    }
-  } else if (!shape.lines.empty()) {
-    bboxes = std::vector<bbox3f>(shape.lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
-          shape.radius[l.x], shape.radius[l.y]);
-    }
-  } else if (!shape.triangles.empty()) {
-    bboxes = std::vector<bbox3f>(shape.triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape.triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
-    }
-  } else if (!shape.quads.empty()) {
-    bboxes = std::vector<bbox3f>(shape.quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
-          shape.positions[q.z], shape.positions[q.w]);
-    }
+  // update nodes from the referenced data
+  auto& positions = get_bvh_data(shape.positions);
+  auto& radius    = get_bvh_data(shape.radius);
+  if (shape.points && !shape.points->empty()) {
+    update_points_bvh(shape.bvh, *shape.points, positions, radius);
+  } else if (shape.lines && !shape.lines->empty()) {
+    update_lines_bvh(shape.bvh, *shape.lines, positions, radius);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    update_triangles_bvh(shape.bvh, *shape.triangles, positions);
+  } else if (shape.quads && !shape.quads->empty()) {
+    update_quads_bvh(shape.bvh, *shape.quads, positions);
   }
-
-  // update nodes
-  update_bvh(shape.bvh, bboxes);
 }
 
 void update_scene_bvh(bvh_scene& scene,
@@ -1532,103 +1937,38 @@ void update_scene_bvh(bvh_scene& scene,
 }
 
 // Intersect ray with a bvh.
-static bool intersect_shape_bvh(const bvh_shape& shape, const ray3f& ray_,
+static bool intersect_shape_bvh(const bvh_shape& shape, const ray3f& ray,
     int& element, vec2f& uv, float& distance, bool find_any) {
 #ifdef YOCTO_EMBREE
   // call Embree if needed
   if (shape.embree_bvh) {
     return intersect_shape_embree_bvh(
-        shape, ray_, element, uv, distance, find_any);
+        shape, ray, element, uv, distance, find_any);
   }
 #endif
 
-  // check empty
-  if (shape.bvh.nodes.empty()) return false;
-
-  // node stack
-  int  node_stack[128];
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
-
-  // shared variables
-  auto hit = false;
-
-  // copy ray to modify it
-  auto ray = ray_;
-
-  // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
-
-  // walking stack
-  while (node_cur) {
-    // grab node
-    auto& node = shape.bvh.nodes[node_stack[--node_cur]];
-
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
-
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
-    } else if (!shape.points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape.points[shape.bvh.primitives[idx]];
-        if (intersect_point(
-                ray, shape.positions[p], shape.radius[p], uv, distance)) {
-          hit      = true;
-          element  = shape.bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape.lines[shape.bvh.primitives[idx]];
-        if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
-                shape.radius[l.x], shape.radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = shape.bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape.triangles[shape.bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
-                shape.positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = shape.bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.quads.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape.quads[shape.bvh.primitives[idx]];
-        if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
-                shape.positions[q.z], shape.positions[q.w], uv, distance)) {
-          hit      = true;
-          element  = shape.bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    }
-
-    // check for early exit
-    if (find_any && hit) return hit;
-  }
-
-  return hit;
+  // intersect the referenced elements
+  auto& positions    = get_bvh_data(shape.positions);
+  auto& radius       = get_bvh_data(shape.radius);
+  auto  intersection = bvh_intersection{};
+  if (shape.points && !shape.points->empty()) {
+    intersection = intersect_points_bvh(
+        shape.bvh, *shape.points, positions, radius, ray, find_any);
+  } else if (shape.lines && !shape.lines->empty()) {
+    intersection = intersect_lines_bvh(
+        shape.bvh, *shape.lines, positions, radius, ray, find_any);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    intersection = intersect_triangles_bvh(
+        shape.bvh, *shape.triangles, positions, ray, find_any);
+  } else if (shape.quads && !shape.quads->empty()) {
+    intersection = intersect_quads_bvh(
+        shape.bvh, *shape.quads, positions, ray, find_any);
+  }
+  if (!intersection.hit) return false;
+  element  = intersection.element;
+  uv       = intersection.uv;
+  distance = intersection.distance;
+  return true;
 }
 
 // Intersect ray with a bvh.
@@ -1718,8 +2058,36 @@ static bool intersect_instance_bvh(const bvh_scene& scene, int instance,
 static bool overlap_shape_bvh(const bvh_shape& shape, const vec3f& pos,
     float max_distance, int& element, vec2f& uv, float& distance,
     bool find_any) {
+  // overlap the referenced elements
+  auto& positions    = get_bvh_data(shape.positions);
+  auto& radius       = get_bvh_data(shape.radius);
+  auto  intersection = bvh_intersection{};
+  if (shape.points && !shape.points->empty()) {
+    intersection = overlap_points_bvh(shape.bvh, *shape.points, positions,
+        radius, pos, max_distance, find_any);
+  } else if (shape.lines && !shape.lines->empty()) {
+    intersection = overlap_lines_bvh(shape.bvh, *shape.lines, positions,
+        radius, pos, max_distance, find_any);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    intersection = overlap_triangles_bvh(shape.bvh, *shape.triangles,
+        positions, radius, pos, max_distance, find_any);
+  } else if (shape.quads && !shape.quads->empty()) {
+    intersection = overlap_quads_bvh(shape.bvh, *shape.quads, positions,
+        radius, pos, max_distance, find_any);
+  }
+  if (!intersection.hit) return false;
+  element  = intersection.element;
+  uv       = intersection.uv;
+  distance = intersection.distance;
+  return true;
+}
+
+// Intersect ray with a bvh.
+static bool overlap_scene_bvh(const bvh_scene& scene, const vec3f& pos,
+    float max_distance, int& instance, int& element, vec2f& uv, float& distance,
+    bool find_any, bool non_rigid_frames) {
   // check if empty
-  if (shape.bvh.nodes.empty()) return false;
+  if (scene.bvh.nodes.empty()) return false;
 
   // node stack
   int  node_stack[64];
@@ -1732,7 +2100,7 @@ static bool overlap_shape_bvh(const bvh_shape& shape, const vec3f& pos,
   // walking stack
   while (node_cur) {
     // grab node
-    auto& node = shape.bvh.nodes[node_stack[--node_cur]];
+    auto& node = scene.bvh.nodes[node_stack[--node_cur]];
 
     // intersect bbox
     if (!distance_check_bbox(pos, max_distance, node.bbox)) continue;
@@ -1743,51 +2111,16 @@ static bool overlap_shape_bvh(const bvh_shape& shape, const vec3f& pos,
       // internal node
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
-    } else if (!shape.points.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape.bvh.primitives[node.start + idx];
-        auto& p         = shape.points[primitive];
-        if (overlap_point(pos, max_distance, shape.positions[p],
-                shape.radius[p], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape.bvh.primitives[node.start + idx];
-        auto& l         = shape.lines[primitive];
-        if (overlap_line(pos, max_distance, shape.positions[l.x],
-                shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
-                distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape.bvh.primitives[node.start + idx];
-        auto& t         = shape.triangles[primitive];
-        if (overlap_triangle(pos, max_distance, shape.positions[t.x],
-                shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
-                shape.radius[t.y], shape.radius[t.z], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.quads.empty()) {
+    } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape.bvh.primitives[node.start + idx];
-        auto& q         = shape.quads[primitive];
-        if (overlap_quad(pos, max_distance, shape.positions[q.x],
-                shape.positions[q.y], shape.positions[q.z],
-                shape.positions[q.w], shape.radius[q.x], shape.radius[q.y],
-                shape.radius[q.z], shape.radius[q.w], uv, distance)) {
+        auto primitive = scene.bvh.primitives[node.start + idx];
+        auto instance_ = scene.instances[primitive];
+        auto inv_pos   = transform_point(
+            inverse(instance_.frame, non_rigid_frames), pos);
+        if (overlap_shape_bvh(scene.shapes[instance_.shape], inv_pos,
+                max_distance, element, uv, distance, find_any)) {
           hit          = true;
-          element      = primitive;
+          instance     = primitive;
           max_distance = distance;
         }
       }
@@ -1800,55 +2133,182 @@ static bool overlap_shape_bvh(const bvh_shape& shape, const vec3f& pos,
   return hit;
 }
 
-// Intersect ray with a bvh.
-static bool overlap_scene_bvh(const bvh_scene& scene, const vec3f& pos,
-    float max_distance, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
+// Find the k closest elements that overlap a point, adding them to a max heap
+// on distance shared across calls. Once k elements are found, the search
+// radius shrinks to the distance of the farthest one. Children are visited
+// from the side of the split the point is in, to shrink the radius early.
+template <typename Overlap>
+static void nearest_elements_bvh(const bvh_tree& bvh, Overlap&& overlap_element,
+    const vec3f& pos, float max_distance, int k, int instance,
+    std::vector<bvh_intersection>& nearest) {
   // check if empty
-  if (scene.bvh.nodes.empty()) return false;
+  if (bvh.nodes.empty() || k <= 0) return;
+
+  // heap helpers
+  auto compare = [](const bvh_intersection& a, const bvh_intersection& b) {
+    return a.distance < b.distance;
+  };
+  auto radius = [&]() {
+    return (int)nearest.size() < k ? max_distance : nearest.front().distance;
+  };
 
   // node stack
   int  node_stack[64];
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // hit
-  auto hit = false;
-
   // walking stack
   while (node_cur) {
     // grab node
-    auto& node = scene.bvh.nodes[node_stack[--node_cur]];
+    auto& node = bvh.nodes[node_stack[--node_cur]];
 
     // intersect bbox
-    if (!distance_check_bbox(pos, max_distance, node.bbox)) continue;
+    if (!distance_check_bbox(pos, radius(), node.bbox)) continue;
 
     // intersect node, switching based on node type
     // for each type, iterate over the the primitive list
     if (node.internal) {
-      // internal node
-      node_stack[node_cur++] = node.start + 0;
-      node_stack[node_cur++] = node.start + 1;
+      // internal node, pushing the closest child last
+      auto axis = (int)node.axis;
+      if (pos[axis] * 2 < node.bbox.min[axis] + node.bbox.max[axis]) {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      } else {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      }
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        auto primitive = scene.bvh.primitives[node.start + idx];
-        auto instance_ = scene.instances[primitive];
-        auto inv_pos   = transform_point(
-            inverse(instance_.frame, non_rigid_frames), pos);
-        if (overlap_shape_bvh(scene.shapes[instance_.shape], inv_pos,
-                max_distance, element, uv, distance, find_any)) {
-          hit          = true;
-          instance     = primitive;
-          max_distance = distance;
+        auto primitive    = bvh.primitives[node.start + idx];
+        auto intersection = bvh_intersection{instance, primitive};
+        if (!overlap_element(primitive, pos, radius(), intersection.uv,
+                intersection.distance))
+          continue;
+        intersection.hit = true;
+        if ((int)nearest.size() == k) {
+          std::pop_heap(nearest.begin(), nearest.end(), compare);
+          nearest.pop_back();
         }
+        nearest.push_back(intersection);
+        std::push_heap(nearest.begin(), nearest.end(), compare);
       }
     }
+  }
+}
 
-    // check for early exit
-    if (find_any && hit) return hit;
+// Find the k closest shape elements that overlap a point.
+static void nearest_shape_bvh(const bvh_shape& shape, const vec3f& pos,
+    float max_distance, int k, int instance,
+    std::vector<bvh_intersection>& nearest) {
+  auto& positions = get_bvh_data(shape.positions);
+  auto& radius    = get_bvh_data(shape.radius);
+  if (shape.points && !shape.points->empty()) {
+    auto& points = *shape.points;
+    nearest_elements_bvh(
+        shape.bvh,
+        [&points, &positions, &radius](int idx, const vec3f& pos,
+            float max_distance, vec2f& uv, float& distance) {
+          auto& p = points[idx];
+          return overlap_point(
+              pos, max_distance, positions[p], radius[p], uv, distance);
+        },
+        pos, max_distance, k, instance, nearest);
+  } else if (shape.lines && !shape.lines->empty()) {
+    auto& lines = *shape.lines;
+    nearest_elements_bvh(
+        shape.bvh,
+        [&lines, &positions, &radius](int idx, const vec3f& pos,
+            float max_distance, vec2f& uv, float& distance) {
+          auto& l = lines[idx];
+          return overlap_line(pos, max_distance, positions[l.x],
+              positions[l.y], radius[l.x], radius[l.y], uv, distance);
+        },
+        pos, max_distance, k, instance, nearest);
+  } else if (shape.triangles && !shape.triangles->empty()) {
+    auto& triangles = *shape.triangles;
+    nearest_elements_bvh(
+        shape.bvh,
+        [&triangles, &positions, &radius](int idx, const vec3f& pos,
+            float max_distance, vec2f& uv, float& distance) {
+          auto& t = triangles[idx];
+          return overlap_triangle(pos, max_distance, positions[t.x],
+              positions[t.y], positions[t.z], radius[t.x], radius[t.y],
+              radius[t.z], uv, distance);
+        },
+        pos, max_distance, k, instance, nearest);
+  } else if (shape.quads && !shape.quads->empty()) {
+    auto& quads = *shape.quads;
+    nearest_elements_bvh(
+        shape.bvh,
+        [&quads, &positions, &radius](int idx, const vec3f& pos,
+            float max_distance, vec2f& uv, float& distance) {
+          auto& q = quads[idx];
+          return overlap_quad(pos, max_distance, positions[q.x],
+              positions[q.y], positions[q.z], positions[q.w], radius[q.x],
+              radius[q.y], radius[q.z], radius[q.w], uv, distance);
+        },
+        pos, max_distance, k, instance, nearest);
   }
+}
 
-  return hit;
+// Find the k closest instance elements that overlap a point.
+static void nearest_scene_bvh(const bvh_scene& scene, const vec3f& pos,
+    float max_distance, int k, bool non_rigid_frames,
+    std::vector<bvh_intersection>& nearest) {
+  nearest_elements_bvh(
+      scene.bvh,
+      [&](int idx, const vec3f& pos, float max_distance, vec2f& uv,
+          float& distance) {
+        auto& instance_ = scene.instances[idx];
+        auto  inv_pos   = transform_point(
+            inverse(instance_.frame, non_rigid_frames), pos);
+        nearest_shape_bvh(scene.shapes[instance_.shape], inv_pos,
+            max_distance, k, idx, nearest);
+        return false;
+      },
+      pos, max_distance, k, -1, nearest);
+}
+
+// Sort points along a Morton curve over their bounds, so that consecutive
+// queries visit mostly the same bvh nodes.
+static std::vector<int> sort_morton(const std::vector<vec3f>& positions) {
+  auto bbox = invalidb3f;
+  for (auto& position : positions) bbox = merge(bbox, position);
+  auto size = max(bbox.max - bbox.min, 1e-20f);
+  auto expand_bits = [](uint32_t value) {
+    value = (value * 0x00010001u) & 0xFF0000FFu;
+    value = (value * 0x00000101u) & 0x0F00F00Fu;
+    value = (value * 0x00000011u) & 0xC30C30C3u;
+    value = (value * 0x00000005u) & 0x49249249u;
+    return value;
+  };
+  auto codes = std::vector<uint32_t>(positions.size());
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int idx) {
+    auto cell  = clamp((positions[idx] - bbox.min) / size, 0.0f, 1.0f) * 1023;
+    codes[idx] = (expand_bits((uint32_t)cell.x) << 2) |
+                 (expand_bits((uint32_t)cell.y) << 1) |
+                 expand_bits((uint32_t)cell.z);
+  });
+  auto order = std::vector<int>(positions.size());
+  for (auto idx = 0; idx < (int)order.size(); idx++) order[idx] = idx;
+  parallel_sort(order, [&codes](int a, int b) {
+    return codes[a] < codes[b] || (codes[a] == codes[b] && a < b);
+  });
+  return order;
+}
+
+// Run point queries in parallel in Morton order, storing results in the
+// order of the points.
+template <typename Query>
+static auto query_points_morton(
+    const std::vector<vec3f>& positions, Query&& query) {
+  using result_type = decltype(query(positions.front()));
+  auto order        = sort_morton(positions);
+  auto results      = std::vector<result_type>(positions.size());
+  common::parallel_for(0, (int)order.size(), 256, [&](int idx) {
+    results[order[idx]] = query(positions[order[idx]]);
+  });
+  return results;
 }
 
 #if 0
@@ -1953,6 +2413,42 @@ bvh_intersection overlap_scene_bvh(const bvh_scene& scene, const vec3f& pos,
   return intersection;
 }
 
+std::vector<bvh_intersection> overlap_shape_bvh(const bvh_shape& shape,
+    const std::vector<vec3f>& positions, float max_distance, bool find_any) {
+  return query_points_morton(positions, [&](const vec3f& pos) {
+    return overlap_shape_bvh(shape, pos, max_distance, find_any);
+  });
+}
+std::vector<bvh_intersection> overlap_scene_bvh(const bvh_scene& scene,
+    const std::vector<vec3f>& positions, float max_distance, bool find_any,
+    bool non_rigid_frames) {
+  return query_points_morton(positions, [&](const vec3f& pos) {
+    return overlap_scene_bvh(
+        scene, pos, max_distance, find_any, non_rigid_frames);
+  });
+}
+
+std::vector<bvh_intersection> nearest_shape_bvh(
+    const bvh_shape& shape, const vec3f& pos, float max_distance, int k) {
+  auto nearest = std::vector<bvh_intersection>{};
+  nearest_shape_bvh(shape, pos, max_distance, k, -1, nearest);
+  std::sort_heap(nearest.begin(), nearest.end(),
+      [](const bvh_intersection& a, const bvh_intersection& b) {
+        return a.distance < b.distance;
+      });
+  return nearest;
+}
+std::vector<bvh_intersection> nearest_scene_bvh(const bvh_scene& scene,
+    const vec3f& pos, float max_distance, int k, bool non_rigid_frames) {
+  auto nearest = std::vector<bvh_intersection>{};
+  nearest_scene_bvh(scene, pos, max_distance, k, non_rigid_frames, nearest);
+  std::sort_heap(nearest.begin(), nearest.end(),
+      [](const bvh_intersection& a, const bvh_intersection& b) {
+        return a.distance < b.distance;
+      });
+  return nearest;
+}
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -2000,10 +2496,9 @@ void find_neighbors(const hash_grid& grid, std::vector<int>& neighbors,
     for (auto j = -cell_radius; j <= cell_radius; j++) {
       for (auto i = -cell_radius; i <= cell_radius; i++) {
         auto ncell         = cell + vec3i{i, j, k};
-        auto cell_iterator = grid.cells.find(ncell);
-        if (cell_iterator == grid.cells.end()) continue;
-        auto& ncell_vertices = cell_iterator->second;
-        for (auto vertex_id : ncell_vertices) {
+        auto ncell_vertices = grid.cells.find(ncell);
+        if (!ncell_vertices) continue;
+        for (auto vertex_id : *ncell_vertices) {
           if (distance_squared(grid.positions[vertex_id], position) >
               max_radius_squared)
             continue;
@@ -2023,6 +2518,198 @@ void find_neighbors(const hash_grid& grid, std::vector<int>& neighbors,
   find_neighbors(grid, neighbors, grid.positions[vertex], max_radius, vertex);
 }
 
+// Cell coordinates and keys of a point_grid. Keys sort cells along x first,
+// so that cells of a row are contiguous.
+static vec3i get_cell_index(const point_grid& grid, const vec3f& position) {
+  auto scaled = position * grid.cell_inv_size;
+  return vec3i{(int)std::floor(scaled.x), (int)std::floor(scaled.y),
+      (int)std::floor(scaled.z)};
+}
+static uint64_t get_cell_key(const vec3i& cell) {
+  auto bias = 1 << 20;
+  return ((uint64_t)(clamp(cell.z, -bias, bias - 1) + bias) << 42) |
+         ((uint64_t)(clamp(cell.y, -bias, bias - 1) + bias) << 21) |
+         (uint64_t)(clamp(cell.x, -bias, bias - 1) + bias);
+}
+
+// Create a point_grid
+point_grid make_point_grid(
+    const std::vector<vec3f>& positions, float cell_size) {
+  auto grid          = point_grid{};
+  grid.cell_size     = cell_size;
+  grid.cell_inv_size = 1 / cell_size;
+  grid.positions     = positions;
+  if (positions.empty()) return grid;
+
+  // sort points by cell key
+  auto num_vertices = (int)positions.size();
+  auto keys         = std::vector<uint64_t>(num_vertices);
+  common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+    keys[vertex] = get_cell_key(get_cell_index(grid, positions[vertex]));
+  });
+  grid.cell_vertices.resize(num_vertices);
+  for (auto vertex = 0; vertex < num_vertices; vertex++)
+    grid.cell_vertices[vertex] = vertex;
+  parallel_sort(grid.cell_vertices, [&keys](int a, int b) {
+    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+  });
+  grid.cell_positions.resize(num_vertices);
+  common::parallel_for(0, num_vertices, 4096, [&](int idx) {
+    grid.cell_positions[idx] = positions[grid.cell_vertices[idx]];
+  });
+
+  // cell ranges and bounds
+  grid.cell_min = get_cell_index(grid, positions.front());
+  grid.cell_max = grid.cell_min;
+  for (auto idx = 0; idx < num_vertices; idx++) {
+    auto key = keys[grid.cell_vertices[idx]];
+    if (!grid.cell_keys.empty() && grid.cell_keys.back() == key) continue;
+    auto cell     = get_cell_index(grid, grid.cell_positions[idx]);
+    grid.cell_min = min(grid.cell_min, cell);
+    grid.cell_max = max(grid.cell_max, cell);
+    grid.cell_keys.push_back(key);
+    grid.cell_offsets.push_back(idx);
+  }
+  grid.cell_offsets.push_back(num_vertices);
+  return grid;
+}
+
+// Visit the points of the cells from `cell_start` to `cell_end` along x.
+template <typename Func>
+static void visit_cell_row(const point_grid& grid, const vec3i& cell_start,
+    int cell_end, Func&& func) {
+  auto start = get_cell_key(cell_start);
+  auto end   = get_cell_key({cell_end, cell_start.y, cell_start.z});
+  auto cell  = std::lower_bound(
+      grid.cell_keys.begin(), grid.cell_keys.end(), start);
+  for (; cell != grid.cell_keys.end() && *cell <= end; cell++) {
+    auto cell_id = (int)(cell - grid.cell_keys.begin());
+    for (auto idx = grid.cell_offsets[cell_id];
+         idx < grid.cell_offsets[cell_id + 1]; idx++) {
+      func(grid.cell_vertices[idx], grid.cell_positions[idx]);
+    }
+  }
+}
+
+// Finds the neighbors within a given radius
+static void find_neighbors(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, float max_radius, int skip_id) {
+  neighbors.clear();
+  if (grid.cell_keys.empty()) return;
+  auto cell_start = max(
+      get_cell_index(grid, position - max_radius), grid.cell_min);
+  auto cell_end = min(
+      get_cell_index(grid, position + max_radius), grid.cell_max);
+  auto max_radius_squared = max_radius * max_radius;
+  for (auto k = cell_start.z; k <= cell_end.z; k++) {
+    for (auto j = cell_start.y; j <= cell_end.y; j++) {
+      visit_cell_row(grid, {cell_start.x, j, k}, cell_end.x,
+          [&](int vertex, const vec3f& vertex_position) {
+            if (distance_squared(vertex_position, position) >
+                max_radius_squared)
+              return;
+            if (vertex == skip_id) return;
+            neighbors.push_back(vertex);
+          });
+    }
+  }
+}
+
+// Finds the k nearest neighbors by visiting shells of cells of increasing
+// size, stopping when the k-th neighbor is closer than any unvisited cell.
+static void find_nearest(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, int k, float max_distance, int skip_id) {
+  neighbors.clear();
+  if (grid.cell_keys.empty() || k <= 0) return;
+  auto nearest = std::vector<std::pair<float, int>>{};
+  auto max_distance_squared = max_distance == flt_max
+                                  ? flt_max
+                                  : max_distance * max_distance;
+  auto visit = [&](int vertex, const vec3f& vertex_position) {
+    auto distance_squared_ = distance_squared(vertex_position, position);
+    if (distance_squared_ > max_distance_squared || vertex == skip_id) return;
+    auto candidate = std::pair{distance_squared_, vertex};
+    if ((int)nearest.size() == k) {
+      if (!(candidate < nearest.front())) return;
+      std::pop_heap(nearest.begin(), nearest.end());
+      nearest.pop_back();
+    }
+    nearest.push_back(candidate);
+    std::push_heap(nearest.begin(), nearest.end());
+  };
+  auto cell       = get_cell_index(grid, position);
+  auto max_radius = max(max(cell - grid.cell_min), max(grid.cell_max - cell));
+  for (auto radius = 0; radius <= max_radius; radius++) {
+    // distance from the point to the cells not visited yet
+    if (radius > 0) {
+      auto gap = flt_max;
+      for (auto axis = 0; axis < 3; axis++) {
+        gap = min(gap, position[axis] - (cell[axis] - radius + 1) *
+                                            grid.cell_size);
+        gap = min(gap, (cell[axis] + radius) * grid.cell_size -
+                           position[axis]);
+      }
+      gap = max(gap, 0.0f);
+      if (gap * gap > max_distance_squared) break;
+      if ((int)nearest.size() == k && nearest.front().first <= gap * gap)
+        break;
+    }
+    // visit the shell of cells at this radius
+    auto cell_start = max(cell - radius, grid.cell_min);
+    auto cell_end   = min(cell + radius, grid.cell_max);
+    for (auto z = cell_start.z; z <= cell_end.z; z++) {
+      for (auto y = cell_start.y; y <= cell_end.y; y++) {
+        if (abs(z - cell.z) == radius || abs(y - cell.y) == radius) {
+          visit_cell_row(grid, {cell_start.x, y, z}, cell_end.x, visit);
+        } else {
+          if (cell.x - radius >= grid.cell_min.x)
+            visit_cell_row(
+                grid, {cell.x - radius, y, z}, cell.x - radius, visit);
+          if (cell.x + radius <= grid.cell_max.x)
+            visit_cell_row(
+                grid, {cell.x + radius, y, z}, cell.x + radius, visit);
+        }
+      }
+    }
+  }
+  std::sort_heap(nearest.begin(), nearest.end());
+  for (auto& [distance_squared_, vertex] : nearest) neighbors.push_back(vertex);
+}
+
+void find_neighbors(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, float max_radius) {
+  find_neighbors(grid, neighbors, position, max_radius, -1);
+}
+void find_neighbors(const point_grid& grid, std::vector<int>& neighbors,
+    int vertex, float max_radius) {
+  find_neighbors(grid, neighbors, grid.positions[vertex], max_radius, vertex);
+}
+void find_nearest(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, int k, float max_distance) {
+  find_nearest(grid, neighbors, position, k, max_distance, -1);
+}
+void find_nearest(const point_grid& grid, std::vector<int>& neighbors,
+    int vertex, int k, float max_distance) {
+  find_nearest(
+      grid, neighbors, grid.positions[vertex], k, max_distance, vertex);
+}
+std::vector<std::vector<int>> find_neighbors(const point_grid& grid,
+    const std::vector<vec3f>& positions, float max_radius) {
+  return query_points_morton(positions, [&](const vec3f& position) {
+    auto neighbors = std::vector<int>{};
+    find_neighbors(grid, neighbors, position, max_radius, -1);
+    return neighbors;
+  });
+}
+std::vector<std::vector<int>> find_nearest(const point_grid& grid,
+    const std::vector<vec3f>& positions, int k, float max_distance) {
+  return query_points_morton(positions, [&](const vec3f& position) {
+    auto neighbors = std::vector<int>{};
+    find_nearest(grid, neighbors, position, k, max_distance, -1);
+    return neighbors;
+  });
+}
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -2039,7 +2726,7 @@ void meandering_triangles(const std::vector<float>& field, float isoline,
 
   // Edgemap to keep track of the added vertex on each splitted edge.
   // key: edge (ordered std::pair), value: vertex index
-  auto emap = std::unordered_map<vec2i, int>();
+  auto emap = common::flat_map<vec2i, int>();
 
   // Helper procedures.
   auto make_edge = [](int a, int b) -> vec2i {
@@ -2090,14 +2777,14 @@ void meandering_triangles(const std::vector<float>& field, float isoline,
       auto  edge = make_edge(tr.z, vert);
       auto  it   = emap.find(edge);
 
-      if (it != emap.end()) {
+      if (it) {
         // Edge already processed.
-        new_verts[k] = it->second;
+        new_verts[k] = *it;
       } else {
         // Compute new vertex via interpolation.
         float alpha  = fabs(a / (b - a));
         new_verts[k] = add_vertex(tr.z, vert, alpha);
-        emap.insert(it, {edge, new_verts[k]});
+        emap.insert(edge, new_verts[k]);
       }
     }
 
@@ -2131,6 +2818,140 @@ void meandering_triangles(const std::vector<float>& field, float isoline,
   }
 }
 
+// Slice a mesh along multiple isolines of a scalar field. Each triangle is
+// clipped against the bands between isolines by walking its boundary, with
+// cut vertices deduplicated by sorting the crossed edges.
+void slice_triangles(std::vector<vec3i>& split_triangles,
+    std::vector<int>& split_tags, std::vector<vec3f>& split_positions,
+    std::vector<vec3f>& split_normals, const std::vector<vec3i>& triangles,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<float>& field, const std::vector<float>& isolines) {
+  // band of each vertex, as the number of isolines below its value
+  auto bands = std::vector<int>(positions.size());
+  common::parallel_for(0, (int)positions.size(), 4096, [&](int vertex) {
+    bands[vertex] = (int)(std::lower_bound(isolines.begin(), isolines.end(),
+                              field[vertex]) -
+                          isolines.begin());
+  });
+
+  // collect crossed edges, as sorted vertex pairs packed in 64 bits
+  auto make_edge = [](int a, int b) {
+    if (a > b) std::swap(a, b);
+    return ((uint64_t)a << 32) | (uint64_t)b;
+  };
+  auto triangle_edges = std::vector<int>(triangles.size() + 1, 0);
+  common::parallel_for(0, (int)triangles.size(), 4096, [&](int idx) {
+    auto& t = triangles[idx];
+    for (auto k = 0; k < 3; k++) {
+      if (bands[t[k]] != bands[t[(k + 1) % 3]]) triangle_edges[idx + 1] += 1;
+    }
+  });
+  for (auto idx = 0; idx < (int)triangles.size(); idx++) {
+    triangle_edges[idx + 1] += triangle_edges[idx];
+  }
+  auto edges = std::vector<uint64_t>(triangle_edges.back());
+  common::parallel_for(0, (int)triangles.size(), 4096, [&](int idx) {
+    auto& t      = triangles[idx];
+    auto  offset = triangle_edges[idx];
+    for (auto k = 0; k < 3; k++) {
+      if (bands[t[k]] != bands[t[(k + 1) % 3]])
+        edges[offset++] = make_edge(t[k], t[(k + 1) % 3]);
+    }
+  });
+  parallel_sort(edges, std::less<uint64_t>{});
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+  // allocate one cut vertex per crossed isoline on each edge
+  auto edge_vertices = std::vector<int>(edges.size() + 1, 0);
+  edge_vertices[0]   = (int)positions.size();
+  for (auto idx = 0; idx < (int)edges.size(); idx++) {
+    auto a = (int)(edges[idx] >> 32), b = (int)(edges[idx] & 0xffffffff);
+    edge_vertices[idx + 1] = edge_vertices[idx] + abs(bands[a] - bands[b]);
+  }
+  split_positions = positions;
+  split_positions.resize(edge_vertices.back());
+  split_normals = normals;
+  if (!normals.empty()) split_normals.resize(edge_vertices.back());
+  common::parallel_for(0, (int)edges.size(), 1024, [&](int idx) {
+    auto a = (int)(edges[idx] >> 32), b = (int)(edges[idx] & 0xffffffff);
+    for (auto band = min(bands[a], bands[b]); band < max(bands[a], bands[b]);
+         band++) {
+      auto vertex = edge_vertices[idx] + band - min(bands[a], bands[b]);
+      auto t      = (isolines[band] - field[a]) / (field[b] - field[a]);
+      split_positions[vertex] = lerp(positions[a], positions[b], t);
+      if (!normals.empty())
+        split_normals[vertex] = normalize(lerp(normals[a], normals[b], t));
+    }
+  });
+
+  // polygon of the part of a triangle in a band, walking its boundary with
+  // the cut vertices of the isolines around the band on each edge
+  auto get_polygon = [&](const vec3i& t, int band,
+                         std::array<int, 5>& polygon) {
+    auto count   = 0;
+    auto add_cut = [&](int a, int b, int isoline) {
+      if (isoline < min(bands[a], bands[b]) ||
+          isoline >= max(bands[a], bands[b]) || count >= 5)
+        return;
+      auto edge = std::lower_bound(edges.begin(), edges.end(),
+                      make_edge(a, b)) -
+                  edges.begin();
+      polygon[count++] = edge_vertices[edge] + isoline -
+                         min(bands[a], bands[b]);
+    };
+    for (auto k = 0; k < 3; k++) {
+      auto a = t[k], b = t[(k + 1) % 3];
+      if (bands[a] == band && count < 5) polygon[count++] = a;
+      if (bands[a] < bands[b]) {
+        add_cut(a, b, band - 1);
+        add_cut(a, b, band);
+      } else if (bands[a] > bands[b]) {
+        add_cut(a, b, band);
+        add_cut(a, b, band - 1);
+      }
+    }
+    return count;
+  };
+
+  // count and emit the fan triangulation of each band polygon
+  auto triangle_splits = std::vector<int>(triangles.size() + 1, 0);
+  common::parallel_for(0, (int)triangles.size(), 1024, [&](int idx) {
+    auto& t        = triangles[idx];
+    auto  band_min = min(bands[t.x], min(bands[t.y], bands[t.z]));
+    auto  band_max = max(bands[t.x], max(bands[t.y], bands[t.z]));
+    auto  polygon  = std::array<int, 5>{};
+    for (auto band = band_min; band <= band_max; band++) {
+      auto count = band_min == band_max ? 3 : get_polygon(t, band, polygon);
+      triangle_splits[idx + 1] += max(count - 2, 0);
+    }
+  });
+  for (auto idx = 0; idx < (int)triangles.size(); idx++) {
+    triangle_splits[idx + 1] += triangle_splits[idx];
+  }
+  split_triangles.resize(triangle_splits.back());
+  split_tags.resize(triangle_splits.back());
+  common::parallel_for(0, (int)triangles.size(), 1024, [&](int idx) {
+    auto& t        = triangles[idx];
+    auto  offset   = triangle_splits[idx];
+    auto  band_min = min(bands[t.x], min(bands[t.y], bands[t.z]));
+    auto  band_max = max(bands[t.x], max(bands[t.y], bands[t.z]));
+    if (band_min == band_max) {
+      split_triangles[offset] = t;
+      split_tags[offset]      = band_min;
+      return;
+    }
+    auto polygon = std::array<int, 5>{};
+    for (auto band = band_min; band <= band_max; band++) {
+      auto count = get_polygon(t, band, polygon);
+      for (auto k = 2; k < count; k++) {
+        split_triangles[offset] = {polygon[0], polygon[k - 1], polygon[k]};
+        split_tags[offset]      = band;
+        offset++;
+      }
+    }
+  });
+}
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -2138,24 +2959,62 @@ void meandering_triangles(const std::vector<float>& field, float isoline,
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
+// Convert quads to triangles, writing them after offset. Degenerate quads
+// give one triangle and the others two, so offsets are a prefix sum.
+static void quads_to_triangles(std::vector<vec3i>& triangles,
+    const std::vector<vec4i>& quads, size_t offset) {
+  auto num_chunks = (int)((quads.size() + 65535) / 65536);
+  auto starts     = std::vector<size_t>(num_chunks + 1, 0);
+  starts[0]       = offset;
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto end = min((chunk + 1) * 65536, (int)quads.size());
+    for (auto idx = chunk * 65536; idx < end; idx++) {
+      starts[chunk + 1] += quads[idx].z != quads[idx].w ? 2 : 1;
+    }
+  });
+  for (auto chunk = 0; chunk < num_chunks; chunk++)
+    starts[chunk + 1] += starts[chunk];
+  triangles.resize(starts.back());
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto end  = min((chunk + 1) * 65536, (int)quads.size());
+    auto next = starts[chunk];
+    for (auto idx = chunk * 65536; idx < end; idx++) {
+      auto& q           = quads[idx];
+      triangles[next++] = {q.x, q.y, q.w};
+      if (q.z != q.w) triangles[next++] = {q.z, q.w, q.y};
+    }
+  });
+}
+
 // Convert quads to triangles
 std::vector<vec3i> quads_to_triangles(const std::vector<vec4i>& quads) {
   auto triangles = std::vector<vec3i>{};
-  triangles.reserve(quads.size() * 2);
-  for (auto& q : quads) {
-    triangles.push_back({q.x, q.y, q.w});
-    if (q.z != q.w) triangles.push_back({q.z, q.w, q.y});
-  }
+  quads_to_triangles(triangles, quads);
   return triangles;
 }
+void quads_to_triangles(
+    std::vector<vec3i>& triangles, const std::vector<vec4i>& quads) {
+  quads_to_triangles(triangles, quads, 0);
+}
 
 // Convert triangles to quads by creating degenerate quads
+static void triangles_to_quads(std::vector<vec4i>& quads,
+    const std::vector<vec3i>& triangles, size_t offset) {
+  quads.resize(offset + triangles.size());
+  common::parallel_for(0, (int)triangles.size(), 4096, [&](int idx) {
+    auto& t             = triangles[idx];
+    quads[offset + idx] = {t.x, t.y, t.z, t.z};
+  });
+}
 std::vector<vec4i> triangles_to_quads(const std::vector<vec3i>& triangles) {
   auto quads = std::vector<vec4i>{};
-  quads.reserve(triangles.size());
-  for (auto& t : triangles) quads.push_back({t.x, t.y, t.z, t.z});
+  triangles_to_quads(quads, triangles);
   return quads;
 }
+void triangles_to_quads(
+    std::vector<vec4i>& quads, const std::vector<vec3i>& triangles) {
+  triangles_to_quads(quads, triangles, 0);
+}
 
 // Convert beziers to lines using 3 lines for each bezier.
 std::vector<vec2i> bezier_to_lines(const std::vector<vec4i>& beziers) {
@@ -2181,94 +3040,275 @@ split_facevarying(const std::vector<vec4i>& quadspos,
   auto split = std::tuple<std::vector<vec4i>, std::vector<vec3f>,
       std::vector<vec3f>, std::vector<vec2f>>{};
   auto& [split_quads, split_positions, split_normals, split_texcoords] = split;
-  // make faces unique
-  std::unordered_map<vec3i, int> vert_map;
-  split_quads.resize(quadspos.size());
-  for (auto fid = 0; fid < quadspos.size(); fid++) {
-    for (auto c = 0; c < 4; c++) {
-      auto v = vec3i{
-          (&quadspos[fid].x)[c],
-          (!quadsnorm.empty()) ? (&quadsnorm[fid].x)[c] : -1,
-          (!quadstexcoord.empty()) ? (&quadstexcoord[fid].x)[c] : -1,
-      };
-      auto it = vert_map.find(v);
-      if (it == vert_map.end()) {
-        auto s = (int)vert_map.size();
-        vert_map.insert(it, {v, s});
-        (&split_quads[fid].x)[c] = s;
-      } else {
-        (&split_quads[fid].x)[c] = it->second;
+  split_facevarying(split_quads, split_positions, split_normals,
+      split_texcoords, quadspos, quadsnorm, quadstexcoord, positions, normals,
+      texcoords);
+  return split;
+}
+
+// Convert face varying data to single primitives. Quad corners are bucket
+// sorted by position, and corners with equal normal and texcoord indices are
+// found within each bucket in parallel. Vertices are numbered in the order
+// of their first corner, as a hash map would.
+void split_facevarying(std::vector<vec4i>& split_quads,
+    std::vector<vec3f>& split_positions, std::vector<vec3f>& split_normals,
+    std::vector<vec2f>& split_texcoords, const std::vector<vec4i>& quadspos,
+    const std::vector<vec4i>& quadsnorm,
+    const std::vector<vec4i>& quadstexcoord,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<vec2f>& texcoords) {
+  // corner index triplets
+  auto num_corners = (int)quadspos.size() * 4;
+  auto get_corner  = [&](int corner) {
+    auto fid = corner / 4, c = corner % 4;
+    return vec3i{quadspos[fid][c],
+        (!quadsnorm.empty()) ? quadsnorm[fid][c] : -1,
+        (!quadstexcoord.empty()) ? quadstexcoord[fid][c] : -1};
+  };
+
+  // bucket corners by position, keeping them in order
+  auto num_buckets = 0;
+  for (auto& q : quadspos) num_buckets = max(num_buckets, max(q) + 1);
+  auto buckets = std::vector<int>(num_buckets + 1, 0);
+  for (auto& q : quadspos) {
+    for (auto c = 0; c < 4; c++) buckets[q[c] + 1] += 1;
+  }
+  for (auto bucket = 0; bucket < num_buckets; bucket++)
+    buckets[bucket + 1] += buckets[bucket];
+  auto sorted = std::vector<int>(num_corners);
+  auto next   = std::vector<int>(buckets.begin(), buckets.end() - 1);
+  for (auto corner = 0; corner < num_corners; corner++)
+    sorted[next[quadspos[corner / 4][corner % 4]]++] = corner;
+  next = {};
+
+  // first equal corner in each bucket, sorting large buckets
+  auto first = std::vector<int>(num_corners);
+  auto keep  = std::vector<int>(num_corners + 1, 0);
+  common::parallel_for(0, num_buckets, 1024, [&](int bucket) {
+    auto begin = buckets[bucket], end = buckets[bucket + 1];
+    if (end - begin > 64) {
+      std::sort(sorted.begin() + begin, sorted.begin() + end,
+          [&](int a, int b) {
+            auto ca = get_corner(a), cb = get_corner(b);
+            if (ca.y != cb.y) return ca.y < cb.y;
+            if (ca.z != cb.z) return ca.z < cb.z;
+            return a < b;
+          });
+      for (auto idx = begin; idx < end; idx++) {
+        auto start = idx == begin || get_corner(sorted[idx - 1]) !=
+                                         get_corner(sorted[idx]);
+        first[sorted[idx]] = start ? sorted[idx] : first[sorted[idx - 1]];
+      }
+    } else {
+      for (auto idx = begin; idx < end; idx++) {
+        auto corner        = get_corner(sorted[idx]);
+        first[sorted[idx]] = sorted[idx];
+        for (auto prev = begin; prev < idx; prev++) {
+          if (get_corner(sorted[prev]) != corner) continue;
+          first[sorted[idx]] = sorted[prev];
+          break;
+        }
       }
     }
-  }
+    for (auto idx = begin; idx < end; idx++) {
+      if (first[sorted[idx]] == sorted[idx]) keep[sorted[idx] + 1] = 1;
+    }
+  });
 
-  // fill vert data
+  // number vertices in corner order
+  for (auto corner = 0; corner < num_corners; corner++)
+    keep[corner + 1] += keep[corner];
+  split_quads.resize(quadspos.size());
+  common::parallel_for(0, num_corners, 4096, [&](int corner) {
+    split_quads[corner / 4][corner % 4] = keep[first[corner]];
+  });
+
+  // fill vert data from the first corners
+  auto num_vertices = keep.back();
+  auto firsts       = std::vector<int>(num_vertices);
+  common::parallel_for(0, num_corners, 4096, [&](int corner) {
+    if (keep[corner + 1] != keep[corner]) firsts[keep[corner]] = corner;
+  });
   split_positions.clear();
   if (!positions.empty()) {
-    split_positions.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_positions[index] = positions[vert.x];
-    }
+    split_positions.resize(num_vertices);
+    common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+      split_positions[vertex] = positions[get_corner(firsts[vertex]).x];
+    });
   }
   split_normals.clear();
   if (!normals.empty()) {
-    split_normals.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_normals[index] = normals[vert.y];
-    }
+    split_normals.resize(num_vertices);
+    common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+      split_normals[vertex] = normals[get_corner(firsts[vertex]).y];
+    });
   }
   split_texcoords.clear();
   if (!texcoords.empty()) {
-    split_texcoords.resize(vert_map.size());
-    for (auto& [vert, index] : vert_map) {
-      split_texcoords[index] = texcoords[vert.z];
-    }
+    split_texcoords.resize(num_vertices);
+    common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+      split_texcoords[vertex] = texcoords[get_corner(firsts[vertex]).z];
+    });
   }
-
-  return split;
 }
 
-// Split primitives per id
+// Split primitives per id. Elements are counted per id in chunks, and each
+// chunk then copies its elements at its own offsets, keeping their order.
 template <typename T>
-std::vector<std::vector<T>> ungroup_elems_impl(
+static void ungroup_elems_impl(std::vector<std::vector<T>>& split_elems,
     const std::vector<T>& elems, const std::vector<int>& ids) {
-  auto max_id      = *max_element(ids.begin(), ids.end());
-  auto split_elems = std::vector<std::vector<T>>(max_id + 1);
-  for (auto elem_id = 0; elem_id < elems.size(); elem_id++) {
-    split_elems[ids[elem_id]].push_back(elems[elem_id]);
+  split_elems.clear();
+  if (ids.empty()) return;
+  auto num_ids    = *max_element(ids.begin(), ids.end()) + 1;
+  auto num_chunks = (int)((elems.size() + 65535) / 65536);
+  auto counts     = std::vector<int>((size_t)num_chunks * num_ids, 0);
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto end = min((chunk + 1) * 65536, (int)elems.size());
+    for (auto idx = chunk * 65536; idx < end; idx++)
+      counts[(size_t)chunk * num_ids + ids[idx]] += 1;
+  });
+  split_elems.resize(num_ids);
+  for (auto id = 0; id < num_ids; id++) {
+    auto size = 0;
+    for (auto chunk = 0; chunk < num_chunks; chunk++) {
+      auto& count = counts[(size_t)chunk * num_ids + id];
+      std::swap(count, size);
+      size += count;
+    }
+    split_elems[id].resize(size);
   }
-  return split_elems;
+  common::parallel_for(num_chunks, [&](int chunk) {
+    auto end     = min((chunk + 1) * 65536, (int)elems.size());
+    auto offsets = counts.data() + (size_t)chunk * num_ids;
+    for (auto idx = chunk * 65536; idx < end; idx++)
+      split_elems[ids[idx]][offsets[ids[idx]]++] = elems[idx];
+  });
 }
 std::vector<std::vector<vec2i>> ungroup_lines(
     const std::vector<vec2i>& lines, const std::vector<int>& ids) {
-  return ungroup_elems_impl(lines, ids);
+  auto split_lines = std::vector<std::vector<vec2i>>{};
+  ungroup_elems_impl(split_lines, lines, ids);
+  return split_lines;
 }
 std::vector<std::vector<vec3i>> ungroup_triangles(
     const std::vector<vec3i>& triangles, const std::vector<int>& ids) {
-  return ungroup_elems_impl(triangles, ids);
+  auto split_triangles = std::vector<std::vector<vec3i>>{};
+  ungroup_elems_impl(split_triangles, triangles, ids);
+  return split_triangles;
 }
 std::vector<std::vector<vec4i>> ungroup_quads(
     const std::vector<vec4i>& quads, const std::vector<int>& ids) {
-  return ungroup_elems_impl(quads, ids);
+  auto split_quads = std::vector<std::vector<vec4i>>{};
+  ungroup_elems_impl(split_quads, quads, ids);
+  return split_quads;
+}
+void ungroup_lines(std::vector<std::vector<vec2i>>& split_lines,
+    const std::vector<vec2i>& lines, const std::vector<int>& ids) {
+  ungroup_elems_impl(split_lines, lines, ids);
+}
+void ungroup_triangles(std::vector<std::vector<vec3i>>& split_triangles,
+    const std::vector<vec3i>& triangles, const std::vector<int>& ids) {
+  ungroup_elems_impl(split_triangles, triangles, ids);
+}
+void ungroup_quads(std::vector<std::vector<vec4i>>& split_quads,
+    const std::vector<vec4i>& quads, const std::vector<int>& ids) {
+  ungroup_elems_impl(split_quads, quads, ids);
 }
 
-// Weld vertices within a threshold.
+// Weld vertices within a threshold. Vertices are sorted by grid cell, and
+// the earlier vertices within the threshold of each vertex are found in
+// parallel from its neighbor cells. A sequential sweep then keeps the
+// vertices without earlier kept ones nearby, mapping the others to the
+// first kept one in the same order of a hash_grid search.
 std::pair<std::vector<vec3f>, std::vector<int>> weld_vertices(
     const std::vector<vec3f>& positions, float threshold) {
-  auto indices   = std::vector<int>(positions.size());
-  auto welded    = std::vector<vec3f>{};
-  auto grid      = make_hash_grid(threshold);
-  auto neighbors = std::vector<int>{};
-  for (auto vertex = 0; vertex < positions.size(); vertex++) {
+  auto num_vertices = (int)positions.size();
+  auto grid         = make_hash_grid(threshold);
+  auto cells        = std::vector<vec3i>(num_vertices);
+  common::parallel_for(0, num_vertices, 4096, [&](int vertex) {
+    cells[vertex] = get_cell_index(grid, positions[vertex]);
+  });
+
+  // sort vertices by cell, and by index within cells
+  auto cell_less = [](const vec3i& a, const vec3i& b) {
+    if (a.z != b.z) return a.z < b.z;
+    if (a.y != b.y) return a.y < b.y;
+    return a.x < b.x;
+  };
+  auto sorted = std::vector<int>(num_vertices);
+  for (auto vertex = 0; vertex < num_vertices; vertex++)
+    sorted[vertex] = vertex;
+  parallel_sort(sorted, [&](int a, int b) {
+    if (cells[a] != cells[b]) return cell_less(cells[a], cells[b]);
+    return a < b;
+  });
+  auto cell_keys   = std::vector<vec3i>{};
+  auto cell_starts = std::vector<int>{};
+  for (auto idx = 0; idx < num_vertices; idx++) {
+    if (idx == 0 || cells[sorted[idx]] != cell_keys.back()) {
+      cell_keys.push_back(cells[sorted[idx]]);
+      cell_starts.push_back(idx);
+    }
+  }
+  cell_starts.push_back(num_vertices);
+
+  // earlier vertices within the threshold, visiting neighbor cells in the
+  // order of hash_grid, by sweeping the sorted cells along x for each row
+  auto max_distance_squared = threshold * threshold;
+  auto visit_earlier        = [&](int vertex, auto&& visit) {
     auto& position = positions[vertex];
-    find_neighbors(grid, neighbors, position, threshold);
-    if (neighbors.empty()) {
-      welded.push_back(position);
-      indices[vertex] = (int)welded.size() - 1;
-      insert_vertex(grid, position);
-    } else {
-      indices[vertex] = neighbors.front();
+    auto& cell     = cells[vertex];
+    for (auto k = -1; k <= 1; k++) {
+      for (auto j = -1; j <= 1; j++) {
+        auto row = cell + vec3i{-1, j, k};
+        auto it  = std::lower_bound(
+            cell_keys.begin(), cell_keys.end(), row, cell_less);
+        for (; it != cell_keys.end(); it++) {
+          if (it->z != row.z || it->y != row.y || it->x > cell.x + 1) break;
+          auto ncell = (int)(it - cell_keys.begin());
+          for (auto idx = cell_starts[ncell]; idx < cell_starts[ncell + 1];
+               idx++) {
+            auto other = sorted[idx];
+            if (other >= vertex) break;
+            if (distance_squared(positions[other], position) >
+                max_distance_squared)
+              continue;
+            visit(other);
+          }
+        }
+      }
+    }
+  };
+  // vertices are visited in sorted order for locality
+  auto offsets = std::vector<int>(num_vertices + 1, 0);
+  common::parallel_for(0, num_vertices, 1024, [&](int idx) {
+    auto vertex = sorted[idx];
+    visit_earlier(vertex, [&](int other) { offsets[vertex + 1] += 1; });
+  });
+  for (auto vertex = 0; vertex < num_vertices; vertex++)
+    offsets[vertex + 1] += offsets[vertex];
+  auto earlier = std::vector<int>(offsets.back());
+  common::parallel_for(0, num_vertices, 1024, [&](int idx) {
+    auto vertex = sorted[idx];
+    auto next   = offsets[vertex];
+    if (next == offsets[vertex + 1]) return;
+    visit_earlier(vertex, [&](int other) { earlier[next++] = other; });
+  });
+
+  // keep vertices in order
+  auto indices = std::vector<int>(num_vertices, -1);
+  auto kept    = std::vector<byte>(num_vertices, 0);
+  auto welded  = std::vector<vec3f>{};
+  for (auto vertex = 0; vertex < num_vertices; vertex++) {
+    for (auto idx = offsets[vertex]; idx < offsets[vertex + 1]; idx++) {
+      if (!kept[earlier[idx]]) continue;
+      indices[vertex] = indices[earlier[idx]];
+      break;
     }
+    if (indices[vertex] >= 0) continue;
+    kept[vertex] = 1;
+    welded.push_back(positions[vertex]);
+    indices[vertex] = (int)welded.size() - 1;
   }
   return {welded, indices};
 }
@@ -2276,41 +3316,46 @@ std::pair<std::vector<vec3i>, std::vector<vec3f>> weld_triangles(
     const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
     float threshold) {
   auto [wpositions, indices] = weld_vertices(positions, threshold);
-  auto wtriangles            = triangles;
-  for (auto& t : wtriangles) t = {indices[t.x], indices[t.y], indices[t.z]};
+  auto wtriangles            = std::vector<vec3i>(triangles.size());
+  common::parallel_for(0, (int)triangles.size(), 4096, [&](int idx) {
+    auto& t         = triangles[idx];
+    wtriangles[idx] = {indices[t.x], indices[t.y], indices[t.z]};
+  });
   return {wtriangles, wpositions};
 }
 std::pair<std::vector<vec4i>, std::vector<vec3f>> weld_quads(
     const std::vector<vec4i>& quads, const std::vector<vec3f>& positions,
     float threshold) {
   auto [wpositions, indices] = weld_vertices(positions, threshold);
-  auto wquads                = quads;
-  for (auto& q : wquads)
-    q = {
-        indices[q.x],
-        indices[q.y],
-        indices[q.z],
-        indices[q.w],
-    };
+  auto wquads                = std::vector<vec4i>(quads.size());
+  common::parallel_for(0, (int)quads.size(), 4096, [&](int idx) {
+    auto& q     = quads[idx];
+    wquads[idx] = {indices[q.x], indices[q.y], indices[q.z], indices[q.w]};
+  });
   return {wquads, wpositions};
 }
 
 // Merge shape elements
+// Append elements offsetting their vertex indices in parallel
+template <typename T>
+static void merge_elements(
+    std::vector<T>& elements, const std::vector<T>& merge, int num_verts) {
+  auto size = (int)elements.size();
+  elements.resize(size + merge.size());
+  common::parallel_for(0, (int)merge.size(), 4096,
+      [&](int idx) { elements[size + idx] = merge[idx] + num_verts; });
+}
 void merge_lines(std::vector<vec2i>& lines,
     const std::vector<vec2i>& merge_lines, int num_verts) {
-  for (auto& l : merge_lines)
-    lines.push_back({l.x + num_verts, l.y + num_verts});
+  merge_elements(lines, merge_lines, num_verts);
 }
 void merge_triangles(std::vector<vec3i>& triangles,
     const std::vector<vec3i>& merge_triangles, int num_verts) {
-  for (auto& t : merge_triangles)
-    triangles.push_back({t.x + num_verts, t.y + num_verts, t.z + num_verts});
+  merge_elements(triangles, merge_triangles, num_verts);
 }
 void merge_quads(std::vector<vec4i>& quads,
     const std::vector<vec4i>& merge_quads, int num_verts) {
-  for (auto& q : merge_quads)
-    quads.push_back(
-        {q.x + num_verts, q.y + num_verts, q.z + num_verts, q.w + num_verts});
+  merge_elements(quads, merge_quads, num_verts);
 }
 void merge_lines(std::vector<vec2i>& lines, std::vector<vec3f>& positions,
     std::vector<vec3f>& tangents, std::vector<vec2f>& texcoords,
@@ -2319,9 +3364,7 @@ void merge_lines(std::vector<vec2i>& lines, std::vector<vec3f>& positions,
     const std::vector<vec3f>& merge_tangents,
     const std::vector<vec2f>& merge_texturecoords,
     const std::vector<float>& merge_radius) {
-  auto merge_verts = (int)positions.size();
-  for (auto& l : merge_lines)
-    lines.push_back({l.x + merge_verts, l.y + merge_verts});
+  merge_elements(lines, merge_lines, (int)positions.size());
   positions.insert(
       positions.end(), merge_positions.begin(), merge_positions.end());
   tangents.insert(tangents.end(), merge_tangents.begin(), merge_tangents.end());
@@ -2335,10 +3378,7 @@ void merge_triangles(std::vector<vec3i>& triangles,
     const std::vector<vec3f>& merge_positions,
     const std::vector<vec3f>& merge_normals,
     const std::vector<vec2f>& merge_texturecoords) {
-  auto merge_verts = (int)positions.size();
-  for (auto& t : merge_triangles)
-    triangles.push_back(
-        {t.x + merge_verts, t.y + merge_verts, t.z + merge_verts});
+  merge_elements(triangles, merge_triangles, (int)positions.size());
   positions.insert(
       positions.end(), merge_positions.begin(), merge_positions.end());
   normals.insert(normals.end(), merge_normals.begin(), merge_normals.end());
@@ -2351,10 +3391,7 @@ void merge_quads(std::vector<vec4i>& quads, std::vector<vec3f>& positions,
     const std::vector<vec3f>& merge_positions,
     const std::vector<vec3f>& merge_normals,
     const std::vector<vec2f>& merge_texturecoords) {
-  auto merge_verts = (int)positions.size();
-  for (auto& q : merge_quads)
-    quads.push_back({q.x + merge_verts, q.y + merge_verts, q.z + merge_verts,
-        q.w + merge_verts});
+  merge_elements(quads, merge_quads, (int)positions.size());
   positions.insert(
       positions.end(), merge_positions.begin(), merge_positions.end());
   normals.insert(normals.end(), merge_normals.begin(), merge_normals.end());
@@ -2366,12 +3403,10 @@ void merge_triangles_and_quads(std::vector<vec3i>& triangles,
     std::vector<vec4i>& quads, bool force_triangles) {
   if (quads.empty()) return;
   if (force_triangles) {
-    auto qtriangles = quads_to_triangles(quads);
-    triangles.insert(triangles.end(), qtriangles.begin(), qtriangles.end());
+    quads_to_triangles(triangles, quads, triangles.size());
     quads = {};
   } else {
-    auto tquads = triangles_to_quads(triangles);
-    quads.insert(quads.end(), tquads.begin(), tquads.end());
+    triangles_to_quads(quads, triangles, quads.size());
     triangles = {};
   }
 }
@@ -2423,6 +3458,380 @@ std::pair<std::vector<vec2i>, std::vector<T>> subdivide_lines_impl(
   return tess;
 }
 
+// Split triangles in four, with new vertices numbered after the old ones,
+// one for each edge.
+static std::vector<vec3i> split_triangles(const std::vector<vec3i>& triangles,
+    const edge_map& emap, int nverts) {
+  auto ttriangles = std::vector<vec3i>(triangles.size() * 4);
+  common::parallel_for(0, (int)triangles.size(), 1024, [&](int i) {
+    auto t                = triangles[i];
+    auto ex               = nverts + edge_index(emap, {t.x, t.y});
+    auto ey               = nverts + edge_index(emap, {t.y, t.z});
+    auto ez               = nverts + edge_index(emap, {t.z, t.x});
+    ttriangles[i * 4 + 0] = {t.x, ex, ez};
+    ttriangles[i * 4 + 1] = {t.y, ey, ex};
+    ttriangles[i * 4 + 2] = {t.z, ez, ey};
+    ttriangles[i * 4 + 3] = {ex, ey, ez};
+  });
+  return ttriangles;
+}
+
+// Split quads in four, and degenerate quads in three, with new vertices
+// numbered after the old ones, first for each edge and then for each face.
+static std::vector<vec4i> split_quads(
+    const std::vector<vec4i>& quads, const edge_map& emap, int nverts) {
+  auto nedges  = num_edges(emap);
+  auto offsets = std::vector<int>(quads.size() + 1, 0);
+  for (auto i = 0; i < (int)quads.size(); i++) {
+    offsets[i + 1] = offsets[i] + (quads[i].z != quads[i].w ? 4 : 3);
+  }
+  auto tquads = std::vector<vec4i>(offsets.back());
+  common::parallel_for(0, (int)quads.size(), 1024, [&](int i) {
+    auto q  = quads[i];
+    auto f  = nverts + nedges + i;
+    auto qi = offsets[i];
+    if (q.z != q.w) {
+      tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}), f,
+          nverts + edge_index(emap, {q.w, q.x})};
+      tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}), f,
+          nverts + edge_index(emap, {q.x, q.y})};
+      tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.w}), f,
+          nverts + edge_index(emap, {q.y, q.z})};
+      tquads[qi++] = {q.w, nverts + edge_index(emap, {q.w, q.x}), f,
+          nverts + edge_index(emap, {q.z, q.w})};
+    } else {
+      tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}), f,
+          nverts + edge_index(emap, {q.z, q.x})};
+      tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}), f,
+          nverts + edge_index(emap, {q.x, q.y})};
+      tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.x}), f,
+          nverts + edge_index(emap, {q.y, q.z})};
+    }
+  });
+  return tquads;
+}
+
+// Split boundary edges in two at their edge vertices.
+static std::vector<vec2i> split_boundary(
+    const std::vector<vec2i>& boundary, const edge_map& emap, int nverts) {
+  auto tboundary = std::vector<vec2i>(boundary.size() * 2);
+  for (auto i = 0; i < (int)boundary.size(); i++) {
+    auto e               = boundary[i];
+    tboundary[i * 2 + 0] = {e.x, nverts + edge_index(emap, e)};
+    tboundary[i * 2 + 1] = {nverts + edge_index(emap, e), e.y};
+  }
+  return tboundary;
+}
+
+// Elements averaged by Catmull-Clark around each split vertex. Valence is
+// 2 for inner vertices, averaged over their quads, 1 for crease vertices,
+// averaged over their boundary edges, and 0 for locked boundary vertices,
+// that are kept. Elements of vertex `v` are from `offsets[v]` to
+// `offsets[v+1]`, and index boundary edges first and then quads.
+struct catmullclark_rings {
+  std::vector<int> valence  = {};
+  std::vector<int> offsets  = {};
+  std::vector<int> elements = {};
+};
+static catmullclark_rings make_catmullclark_rings(int ntverts,
+    const std::vector<vec4i>& tquads, const std::vector<vec2i>& tboundary,
+    bool lock_boundary) {
+  auto  rings     = catmullclark_rings{};
+  auto& valence   = rings.valence;
+  auto& offsets   = rings.offsets;
+  auto  nboundary = (int)tboundary.size();
+  valence.assign(ntverts, 2);
+  for (auto& e : tboundary) {
+    valence[e.x] = lock_boundary ? 0 : 1;
+    valence[e.y] = lock_boundary ? 0 : 1;
+  }
+  offsets.assign(ntverts + 1, 0);
+  for (auto& e : tboundary) {
+    for (auto v : {e.x, e.y}) {
+      if (valence[v] == 1) offsets[v + 1] += 1;
+    }
+  }
+  for (auto& q : tquads) {
+    for (auto v : {q.x, q.y, q.z, q.w}) {
+      if (valence[v] == 2) offsets[v + 1] += 1;
+    }
+  }
+  for (auto v = 0; v < ntverts; v++) offsets[v + 1] += offsets[v];
+  auto next = std::vector<int>(offsets.begin(), offsets.end() - 1);
+  rings.elements.resize(offsets.back());
+  for (auto i = 0; i < nboundary; i++) {
+    for (auto v : {tboundary[i].x, tboundary[i].y}) {
+      if (valence[v] == 1) rings.elements[next[v]++] = i;
+    }
+  }
+  for (auto i = 0; i < (int)tquads.size(); i++) {
+    auto& q = tquads[i];
+    for (auto v : {q.x, q.y, q.z, q.w}) {
+      if (valence[v] == 2) rings.elements[next[v]++] = nboundary + i;
+    }
+  }
+  return rings;
+}
+
+// Compute split vertices, as old vertices, edge midpoints and face centers.
+template <typename T>
+static std::vector<T> split_vertices(const std::vector<T>& vert,
+    const std::vector<vec2i>& edges, const std::vector<vec4i>& quads) {
+  auto nverts = (int)vert.size();
+  auto nedges = (int)edges.size();
+  auto tvert  = std::vector<T>(nverts + nedges + quads.size());
+  common::parallel_for(0, (int)tvert.size(), 4096, [&](int i) {
+    if (i < nverts) {
+      tvert[i] = vert[i];
+    } else if (i < nverts + nedges) {
+      auto e   = edges[i - nverts];
+      tvert[i] = (vert[e.x] + vert[e.y]) / 2;
+    } else {
+      auto q = quads[i - nverts - nedges];
+      if (q.z != q.w) {
+        tvert[i] = (vert[q.x] + vert[q.y] + vert[q.z] + vert[q.w]) / 4;
+      } else {
+        tvert[i] = (vert[q.x] + vert[q.y] + vert[q.z]) / 3;
+      }
+    }
+  });
+  return tvert;
+}
+
+// Smooth split vertices with the Catmull-Clark averaging and correction
+// passes. Averages are accumulated over elements, since this is cheaper than
+// building the vertex rings for one-shot subdivision.
+template <typename T>
+static std::vector<T> smooth_catmullclark(const std::vector<T>& tvert,
+    const std::vector<vec4i>& tquads, const std::vector<vec2i>& tboundary,
+    bool lock_boundary) {
+  // define vertex valence
+  auto tvert_val = std::vector<int>(tvert.size(), 2);
+  for (auto& e : tboundary) {
+    tvert_val[e.x] = (lock_boundary) ? 0 : 1;
+    tvert_val[e.y] = (lock_boundary) ? 0 : 1;
+  }
+  // averaging pass
+  auto avert  = std::vector<T>(tvert.size(), T());
+  auto acount = std::vector<int>(tvert.size(), 0);
+  if (!lock_boundary) {
+    for (auto& e : tboundary) {
+      auto c = (tvert[e.x] + tvert[e.y]) / 2;
+      for (auto vid : {e.x, e.y}) {
+        if (tvert_val[vid] != 1) continue;
+        avert[vid] += c;
+        acount[vid] += 1;
+      }
+    }
+  }
+  for (auto& q : tquads) {
+    auto c = (tvert[q.x] + tvert[q.y] + tvert[q.z] + tvert[q.w]) / 4;
+    for (auto vid : {q.x, q.y, q.z, q.w}) {
+      if (tvert_val[vid] != 2) continue;
+      avert[vid] += c;
+      acount[vid] += 1;
+    }
+  }
+  // correction pass
+  common::parallel_for(0, (int)tvert.size(), 4096, [&](int i) {
+    if (tvert_val[i] == 0 || acount[i] == 0) {
+      avert[i] = tvert[i];
+      return;
+    }
+    avert[i] /= (float)acount[i];
+    // p = p + (avg_p - p) * (4/avg_count)
+    if (tvert_val[i] == 2) {
+      avert[i] = tvert[i] + (avert[i] - tvert[i]) * (4 / (float)acount[i]);
+    }
+  });
+  return avert;
+}
+
+// Build a subdivision step in parallel, given the number of weights of each
+// row and a function that fills them.
+template <typename Size, typename Fill>
+static subdivision_level make_subdivision_level(
+    int num_rows, Size&& row_size, Fill&& fill_row) {
+  auto level = subdivision_level{};
+  level.offsets.assign(num_rows + 1, 0);
+  for (auto idx = 0; idx < num_rows; idx++) {
+    level.offsets[idx + 1] = level.offsets[idx] + row_size(idx);
+  }
+  level.indices.resize(level.offsets.back());
+  level.weights.resize(level.offsets.back());
+  common::parallel_for(0, num_rows, 4096, [&](int idx) {
+    fill_row(idx, level.indices.data() + level.offsets[idx],
+        level.weights.data() + level.offsets[idx]);
+  });
+  return level;
+}
+
+// Weights of split vertices, as in split_vertices().
+static subdivision_level make_split_level(int nverts,
+    const std::vector<vec2i>& edges, const std::vector<vec4i>& quads) {
+  auto nedges = (int)edges.size();
+  return make_subdivision_level(
+      nverts + nedges + (int)quads.size(),
+      [&](int idx) {
+        if (idx < nverts) return 1;
+        if (idx < nverts + nedges) return 2;
+        auto& q = quads[idx - nverts - nedges];
+        return q.z != q.w ? 4 : 3;
+      },
+      [&](int idx, int* indices, float* weights) {
+        if (idx < nverts) {
+          indices[0] = idx;
+          weights[0] = 1;
+        } else if (idx < nverts + nedges) {
+          auto e     = edges[idx - nverts];
+          indices[0] = e.x;
+          indices[1] = e.y;
+          weights[0] = weights[1] = 0.5f;
+        } else {
+          auto q = quads[idx - nverts - nedges];
+          auto n = q.z != q.w ? 4 : 3;
+          for (auto k = 0; k < n; k++) {
+            indices[k] = q[k];
+            weights[k] = 1 / (float)n;
+          }
+        }
+      });
+}
+
+// Weights of smoothed vertices, as in smooth_catmullclark().
+static subdivision_level make_catmullclark_level(
+    const std::vector<vec4i>& tquads, const std::vector<vec2i>& tboundary,
+    const catmullclark_rings& rings) {
+  auto nboundary = (int)tboundary.size();
+  return make_subdivision_level(
+      (int)rings.valence.size(),
+      [&](int idx) {
+        auto count = rings.offsets[idx + 1] - rings.offsets[idx];
+        if (rings.valence[idx] == 0 || count == 0) return 1;
+        if (rings.valence[idx] == 1) return count * 2;
+        return 1 + count * 4;
+      },
+      [&](int idx, int* indices, float* weights) {
+        auto begin = rings.offsets[idx], end = rings.offsets[idx + 1];
+        auto count = end - begin;
+        if (rings.valence[idx] == 0 || count == 0) {
+          indices[0] = idx;
+          weights[0] = 1;
+        } else if (rings.valence[idx] == 1) {
+          for (auto i = begin; i < end; i++) {
+            auto& e    = tboundary[rings.elements[i]];
+            *indices++ = e.x;
+            *indices++ = e.y;
+            *weights++ = 0.5f / count;
+            *weights++ = 0.5f / count;
+          }
+        } else {
+          auto scale = 4 / (float)count;
+          *indices++ = idx;
+          *weights++ = 1 - scale;
+          for (auto i = begin; i < end; i++) {
+            auto& q = tquads[rings.elements[i] - nboundary];
+            for (auto k = 0; k < 4; k++) {
+              *indices++ = q[k];
+              *weights++ = scale / (4 * count);
+            }
+          }
+        }
+      });
+}
+
+// Make subdivision stencils
+subdivision_stencils make_triangles_stencils(
+    const std::vector<vec3i>& triangles, int num_vertices, int level) {
+  auto stencils         = subdivision_stencils{};
+  stencils.triangles    = triangles;
+  stencils.num_vertices = num_vertices;
+  auto nverts           = num_vertices;
+  for (auto l = 0; l < level; l++) {
+    auto emap  = make_edge_map(stencils.triangles);
+    auto edges = get_edges(emap);
+    stencils.steps.push_back(make_split_level(nverts, edges, {}));
+    stencils.triangles = split_triangles(stencils.triangles, emap, nverts);
+    nverts += (int)edges.size();
+  }
+  return stencils;
+}
+subdivision_stencils make_quads_stencils(
+    const std::vector<vec4i>& quads, int num_vertices, int level) {
+  auto stencils         = subdivision_stencils{};
+  stencils.quads        = quads;
+  stencils.num_vertices = num_vertices;
+  auto nverts           = num_vertices;
+  for (auto l = 0; l < level; l++) {
+    auto emap  = make_edge_map(stencils.quads);
+    auto edges = get_edges(emap);
+    stencils.steps.push_back(make_split_level(nverts, edges, stencils.quads));
+    auto tquads = split_quads(stencils.quads, emap, nverts);
+    nverts += (int)edges.size() + (int)stencils.quads.size();
+    stencils.quads = std::move(tquads);
+  }
+  return stencils;
+}
+subdivision_stencils make_catmullclark_stencils(const std::vector<vec4i>& quads,
+    int num_vertices, int level, bool lock_boundary) {
+  auto stencils         = subdivision_stencils{};
+  stencils.quads        = quads;
+  stencils.num_vertices = num_vertices;
+  auto nverts           = num_vertices;
+  for (auto l = 0; l < level; l++) {
+    auto emap      = make_edge_map(stencils.quads);
+    auto edges     = get_edges(emap);
+    auto tquads    = split_quads(stencils.quads, emap, nverts);
+    auto tboundary = split_boundary(get_boundary(emap), emap, nverts);
+    auto ntverts   = nverts + (int)edges.size() + (int)stencils.quads.size();
+    auto rings     = make_catmullclark_rings(
+        ntverts, tquads, tboundary, lock_boundary);
+    stencils.steps.push_back(make_split_level(nverts, edges, stencils.quads));
+    stencils.steps.push_back(
+        make_catmullclark_level(tquads, tboundary, rings));
+    stencils.quads = std::move(tquads);
+    nverts         = ntverts;
+  }
+  return stencils;
+}
+
+// Subdivide vertex data with precomputed stencils
+template <typename T>
+static std::vector<T> apply_subdivision_impl(
+    const subdivision_stencils& stencils, const std::vector<T>& vert) {
+  if ((int)vert.size() != stencils.num_vertices)
+    throw std::out_of_range("array should be the same length");
+  auto current = vert;
+  for (auto& step : stencils.steps) {
+    auto next = std::vector<T>(step.offsets.size() - 1);
+    common::parallel_for(0, (int)next.size(), 4096, [&](int idx) {
+      auto value = T{};
+      for (auto i = step.offsets[idx]; i < step.offsets[idx + 1]; i++) {
+        value += current[step.indices[i]] * step.weights[i];
+      }
+      next[idx] = value;
+    });
+    current = std::move(next);
+  }
+  return current;
+}
+std::vector<float> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<float>& vert) {
+  return apply_subdivision_impl(stencils, vert);
+}
+std::vector<vec2f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec2f>& vert) {
+  return apply_subdivision_impl(stencils, vert);
+}
+std::vector<vec3f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec3f>& vert) {
+  return apply_subdivision_impl(stencils, vert);
+}
+std::vector<vec4f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec4f>& vert) {
+  return apply_subdivision_impl(stencils, vert);
+}
+
 // Subdivide triangle.
 template <typename T>
 void subdivide_triangles_impl(std::vector<vec3i>& triangles,
@@ -2435,36 +3844,10 @@ void subdivide_triangles_impl(std::vector<vec3i>& triangles,
   if (triangles.empty() || vert.empty()) return;
   // loop over levels
   for (auto l = 0; l < level; l++) {
-    // get edges
     auto emap  = make_edge_map(triangles);
-    auto edges = get_edges(emap);
-    // number of elements
-    auto nverts = (int)vert.size();
-    auto nedges = (int)edges.size();
-    auto nfaces = (int)triangles.size();
-    // create vertices
-    auto tvert = std::vector<T>(nverts + nedges);
-    for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
-    for (auto i = 0; i < nedges; i++) {
-      auto e            = edges[i];
-      tvert[nverts + i] = (vert[e.x] + vert[e.y]) / 2;
-    }
-    // create triangles
-    auto ttriangles = std::vector<vec3i>(nfaces * 4);
-    for (auto i = 0; i < nfaces; i++) {
-      auto t                = triangles[i];
-      ttriangles[i * 4 + 0] = {t.x, nverts + edge_index(emap, {t.x, t.y}),
-          nverts + edge_index(emap, {t.z, t.x})};
-      ttriangles[i * 4 + 1] = {t.y, nverts + edge_index(emap, {t.y, t.z}),
-          nverts + edge_index(emap, {t.x, t.y})};
-      ttriangles[i * 4 + 2] = {t.z, nverts + edge_index(emap, {t.z, t.x}),
-          nverts + edge_index(emap, {t.y, t.z})};
-      ttriangles[i * 4 + 3] = {nverts + edge_index(emap, {t.x, t.y}),
-          nverts + edge_index(emap, {t.y, t.z}),
-          nverts + edge_index(emap, {t.z, t.x})};
-    }
-    swap(ttriangles, triangles);
-    swap(tvert, vert);
+    auto tvert = split_vertices(vert, get_edges(emap), {});
+    triangles  = split_triangles(triangles, emap, (int)vert.size());
+    vert       = std::move(tvert);
   }
 }
 template <typename T>
@@ -2487,56 +3870,10 @@ void subdivide_quads_impl(std::vector<vec4i>& quads, std::vector<T>& vert,
   if (quads.empty() || vert.empty()) return;
   // loop over levels
   for (auto l = 0; l < level; l++) {
-    // get edges
     auto emap  = make_edge_map(quads);
-    auto edges = get_edges(emap);
-    // number of elements
-    auto nverts = (int)vert.size();
-    auto nedges = (int)edges.size();
-    auto nfaces = (int)quads.size();
-    // create vertices
-    auto tvert = std::vector<T>(nverts + nedges + nfaces);
-    for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
-    for (auto i = 0; i < nedges; i++) {
-      auto e            = edges[i];
-      tvert[nverts + i] = (vert[e.x] + vert[e.y]) / 2;
-    }
-    for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
-      if (q.z != q.w) {
-        tvert[nverts + nedges + i] =
-            (vert[q.x] + vert[q.y] + vert[q.z] + vert[q.w]) / 4;
-      } else {
-        tvert[nverts + nedges + i] = (vert[q.x] + vert[q.y] + vert[q.z]) / 3;
-      }
-    }
-    // create quads
-    auto tquads = std::vector<vec4i>(nfaces * 4);  // conservative allocation
-    auto qi     = 0;
-    for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
-      if (q.z != q.w) {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.w, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.w}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-        tquads[qi++] = {q.w, nverts + edge_index(emap, {q.w, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.w})};
-      } else {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-      }
-    }
-    tquads.resize(qi);
-    // done
-    swap(tquads, quads);
-    swap(tvert, vert);
+    auto tvert = split_vertices(vert, get_edges(emap), quads);
+    quads      = split_quads(quads, emap, (int)vert.size());
+    vert       = std::move(tvert);
   }
 }
 template <typename T>
@@ -2560,21 +3897,17 @@ void subdivide_beziers_impl(std::vector<vec4i>& beziers, std::vector<T>& vert,
   // loop over levels
   for (auto l = 0; l < level; l++) {
     // get edges
-    auto vmap     = std::unordered_map<int, int>();
+    auto vmap     = common::flat_map<int, int>();
     auto tvert    = std::vector<T>();
     auto tbeziers = std::vector<vec4i>();
     for (auto b : beziers) {
-      if (vmap.find(b.x) == vmap.end()) {
-        vmap[b.x] = (int)tvert.size();
+      if (vmap.insert(b.x, (int)tvert.size()).second)
         tvert.push_back(vert[b.x]);
-      }
-      if (vmap.find(b.w) == vmap.end()) {
-        vmap[b.w] = (int)tvert.size();
+      if (vmap.insert(b.w, (int)tvert.size()).second)
         tvert.push_back(vert[b.w]);
-      }
       auto bo = (int)tvert.size();
-      tbeziers.push_back({vmap.at(b.x), bo + 0, bo + 1, bo + 2});
-      tbeziers.push_back({bo + 2, bo + 3, bo + 4, vmap.at(b.w)});
+      tbeziers.push_back({*vmap.find(b.x), bo + 0, bo + 1, bo + 2});
+      tbeziers.push_back({bo + 2, bo + 3, bo + 4, *vmap.find(b.w)});
       tvert.push_back(vert[b.x] / 2 + vert[b.y] / 2);
       tvert.push_back(vert[b.x] / 4 + vert[b.y] / 2 + vert[b.z] / 4);
       tvert.push_back(vert[b.x] / 8 + vert[b.y] * ((float)3 / (float)8) +
@@ -2608,122 +3941,15 @@ void subdivide_catmullclark_impl(std::vector<vec4i>& quads,
   if (quads.empty() || vert.empty()) return;
   // loop over levels
   for (auto l = 0; l < level; l++) {
-    // get edges
-    auto emap     = make_edge_map(quads);
-    auto edges    = get_edges(emap);
-    auto boundary = get_boundary(emap);
-    // number of elements
+    // split elements
+    auto emap      = make_edge_map(quads);
     auto nverts    = (int)vert.size();
-    auto nedges    = (int)edges.size();
-    auto nboundary = (int)boundary.size();
-    auto nfaces    = (int)quads.size();
-
-    // split elements ------------------------------------
-    // create vertices
-    auto tvert = std::vector<T>(nverts + nedges + nfaces);
-    for (auto i = 0; i < nverts; i++) tvert[i] = vert[i];
-    for (auto i = 0; i < nedges; i++) {
-      auto e            = edges[i];
-      tvert[nverts + i] = (vert[e.x] + vert[e.y]) / 2;
-    }
-    for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
-      if (q.z != q.w) {
-        tvert[nverts + nedges + i] =
-            (vert[q.x] + vert[q.y] + vert[q.z] + vert[q.w]) / 4;
-      } else {
-        tvert[nverts + nedges + i] = (vert[q.x] + vert[q.y] + vert[q.z]) / 3;
-      }
-    }
-    // create quads
-    auto tquads = std::vector<vec4i>(nfaces * 4);  // conservative allocation
-    auto qi     = 0;
-    for (auto i = 0; i < nfaces; i++) {
-      auto q = quads[i];
-      if (q.z != q.w) {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.w, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.w}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-        tquads[qi++] = {q.w, nverts + edge_index(emap, {q.w, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.w})};
-      } else {
-        tquads[qi++] = {q.x, nverts + edge_index(emap, {q.x, q.y}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.z, q.x})};
-        tquads[qi++] = {q.y, nverts + edge_index(emap, {q.y, q.z}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.x, q.y})};
-        tquads[qi++] = {q.z, nverts + edge_index(emap, {q.z, q.x}),
-            nverts + nedges + i, nverts + edge_index(emap, {q.y, q.z})};
-      }
-    }
-    tquads.resize(qi);
-
-    // split boundary
-    auto tboundary = std::vector<vec2i>(nboundary * 2);
-    for (auto i = 0; i < nboundary; i++) {
-      auto e               = boundary[i];
-      tboundary[i * 2 + 0] = {e.x, nverts + edge_index(emap, e)};
-      tboundary[i * 2 + 1] = {nverts + edge_index(emap, e), e.y};
-    }
-
-    // setup creases -----------------------------------
-    auto tcrease_edges = std::vector<vec2i>();
-    auto tcrease_verts = std::vector<int>();
-    if (lock_boundary) {
-      for (auto& b : tboundary) {
-        tcrease_verts.push_back(b.x);
-        tcrease_verts.push_back(b.y);
-      }
-    } else {
-      for (auto& b : tboundary) tcrease_edges.push_back(b);
-    }
-
-    // define vertex valence ---------------------------
-    auto tvert_val = std::vector<int>(tvert.size(), 2);
-    for (auto& e : tboundary) {
-      tvert_val[e.x] = (lock_boundary) ? 0 : 1;
-      tvert_val[e.y] = (lock_boundary) ? 0 : 1;
-    }
-
-    // averaging pass ----------------------------------
-    auto avert  = std::vector<T>(tvert.size(), T());
-    auto acount = std::vector<int>(tvert.size(), 0);
-    for (auto p : tcrease_verts) {
-      if (tvert_val[p] != 0) continue;
-      avert[p] += tvert[p];
-      acount[p] += 1;
-    }
-    for (auto& e : tcrease_edges) {
-      auto c = (tvert[e.x] + tvert[e.y]) / 2;
-      for (auto vid : {e.x, e.y}) {
-        if (tvert_val[vid] != 1) continue;
-        avert[vid] += c;
-        acount[vid] += 1;
-      }
-    }
-    for (auto& q : tquads) {
-      auto c = (tvert[q.x] + tvert[q.y] + tvert[q.z] + tvert[q.w]) / 4;
-      for (auto vid : {q.x, q.y, q.z, q.w}) {
-        if (tvert_val[vid] != 2) continue;
-        avert[vid] += c;
-        acount[vid] += 1;
-      }
-    }
-    for (auto i = 0; i < tvert.size(); i++) avert[i] /= (float)acount[i];
-
-    // correction pass ----------------------------------
-    // p = p + (avg_p - p) * (4/avg_count)
-    for (auto i = 0; i < tvert.size(); i++) {
-      if (tvert_val[i] != 2) continue;
-      avert[i] = tvert[i] + (avert[i] - tvert[i]) * (4 / (float)acount[i]);
-    }
-    tvert = avert;
-
-    // done
-    swap(tquads, quads);
-    swap(tvert, vert);
+    auto tvert     = split_vertices(vert, get_edges(emap), quads);
+    auto tquads    = split_quads(quads, emap, nverts);
+    auto tboundary = split_boundary(get_boundary(emap), emap, nverts);
+    // smooth vertices
+    vert  = smooth_catmullclark(tvert, tquads, tboundary, lock_boundary);
+    quads = std::move(tquads);
   }
 }
 template <typename T>
@@ -2843,6 +4069,725 @@ std::pair<std::vector<vec4i>, std::vector<vec4f>> subdivide_catmullclark(
 
 }  // namespace yocto::shape
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF SHAPE SIMPLIFICATION
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Quadric error x^T A x + 2 b^T x + c of the squared distances from a set of
+// planes, with the symmetric matrix A stored by its upper triangle. Sums are
+// kept in double precision since they span many planes.
+struct simplify_quadric {
+  double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+  double b0 = 0, b1 = 0, b2 = 0, c = 0;
+
+  simplify_quadric& operator+=(const simplify_quadric& q) {
+    a00 += q.a00, a01 += q.a01, a02 += q.a02, a11 += q.a11, a12 += q.a12;
+    a22 += q.a22, b0 += q.b0, b1 += q.b1, b2 += q.b2, c += q.c;
+    return *this;
+  }
+};
+
+// Weighted quadric of the plane with unit normal `n` through `p`.
+static simplify_quadric make_plane_quadric(
+    const vec3f& n, const vec3f& p, double weight) {
+  auto nx = (double)n.x, ny = (double)n.y, nz = (double)n.z;
+  auto d  = -(nx * p.x + ny * p.y + nz * p.z);
+  auto q  = simplify_quadric{};
+  q.a00 = weight * nx * nx, q.a01 = weight * nx * ny, q.a02 = weight * nx * nz;
+  q.a11 = weight * ny * ny, q.a12 = weight * ny * nz, q.a22 = weight * nz * nz;
+  q.b0 = weight * nx * d, q.b1 = weight * ny * d, q.b2 = weight * nz * d;
+  q.c  = weight * d * d;
+  return q;
+}
+
+// Collapse of an edge, with the interpolation `t` from its first vertex to
+// the second that minimizes the quadric error `cost`. The collapse is valid
+// while the vertex stamps match the ones of the vertices.
+struct simplify_collapse {
+  double cost   = 0;
+  float  length = 0;
+  float  t      = 0;
+  int    v0     = -1;
+  int    v1     = -1;
+  int    stamp0 = 0;
+  int    stamp1 = 0;
+};
+
+// Orders the heap of collapses by increasing cost. Ties, as on flat regions,
+// are broken by edge length to avoid fans of collapses around one vertex.
+static bool operator<(const simplify_collapse& a, const simplify_collapse& b) {
+  if (a.cost != b.cost) return a.cost > b.cost;
+  if (a.length != b.length) return a.length > b.length;
+  if (a.v0 != b.v0) return a.v0 > b.v0;
+  return a.v1 > b.v1;
+}
+
+// Best placement along the edge from `p0` to `p1`. The error is a quadratic
+// in t, minimized in closed form and clamped to the edge.
+static simplify_collapse make_simplify_collapse(const simplify_quadric& q,
+    const vec3f& p0, const vec3f& p1, int v0, int v1) {
+  auto x = (double)p0.x, y = (double)p0.y, z = (double)p0.z;
+  auto ex = (double)p1.x - x, ey = (double)p1.y - y, ez = (double)p1.z - z;
+  // A p0 + b and A e
+  auto ax  = q.a00 * x + q.a01 * y + q.a02 * z + q.b0;
+  auto ay  = q.a01 * x + q.a11 * y + q.a12 * z + q.b1;
+  auto az  = q.a02 * x + q.a12 * y + q.a22 * z + q.b2;
+  auto aex = q.a00 * ex + q.a01 * ey + q.a02 * ez;
+  auto aey = q.a01 * ex + q.a11 * ey + q.a12 * ez;
+  auto aez = q.a02 * ex + q.a12 * ey + q.a22 * ez;
+  // error(t) = e0 + 2 t e1 + t^2 e2
+  auto e0 = x * (ax + q.b0) + y * (ay + q.b1) + z * (az + q.b2) + q.c;
+  auto e1 = ex * ax + ey * ay + ez * az;
+  auto e2 = ex * aex + ey * aey + ez * aez;
+  auto t  = 0.5;
+  if (e2 > 0) {
+    t = std::clamp(-e1 / e2, 0.0, 1.0);
+  } else if (e1 != 0) {
+    t = e1 < 0 ? 1.0 : 0.0;
+  }
+  auto collapse = simplify_collapse{};
+  collapse.cost   = std::max(e0 + 2 * t * e1 + t * t * e2, 0.0);
+  collapse.length = (float)(ex * ex + ey * ey + ez * ez);
+  collapse.t      = (float)t;
+  collapse.v0     = v0;
+  collapse.v1     = v1;
+  return collapse;
+}
+
+// Simplify triangles and vertex data in place.
+static void simplify_triangles_impl(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, std::vector<vec3f>& colors,
+    int num_triangles, float max_error) {
+  if ((!normals.empty() && normals.size() != positions.size()) ||
+      (!texcoords.empty() && texcoords.size() != positions.size()) ||
+      (!colors.empty() && colors.size() != positions.size()))
+    throw std::out_of_range("array should be the same length");
+
+  // boundaries are kept by planes orthogonal to their faces
+  const auto boundary_weight = 1000.0;
+
+  // skip degenerate faces
+  auto num_vertices = (int)positions.size();
+  auto removed      = std::vector<bool>(triangles.size(), false);
+  auto num_faces    = (int)triangles.size();
+  for (auto face = 0; face < (int)triangles.size(); face++) {
+    auto& t = triangles[face];
+    if (t.x == t.y || t.y == t.z || t.z == t.x) {
+      removed[face] = true;
+      num_faces--;
+    }
+  }
+  if (num_faces <= num_triangles) return;
+
+  // vertex quadrics from faces and boundaries, in parallel
+  auto emap      = make_edge_map(triangles);
+  auto quadrics  = accumulate_vertices<simplify_quadric>(num_vertices,
+      (int)triangles.size(), [&](int face, std::vector<simplify_quadric>& q) {
+        if (removed[face]) return;
+        auto& t      = triangles[face];
+        auto  normal = cross(positions[t.y] - positions[t.x],
+            positions[t.z] - positions[t.x]);
+        if (normal == zero3f) return;
+        normal     = normalize(normal);
+        auto plane = make_plane_quadric(normal, positions[t.x], 1);
+        q[t.x] += plane, q[t.y] += plane, q[t.z] += plane;
+        for (auto k = 0; k < 3; k++) {
+          auto a = t[k], b = t[(k + 1) % 3];
+          if (emap.nfaces[edge_index(emap, {a, b})] != 1) continue;
+          auto edge = positions[b] - positions[a];
+          if (edge == zero3f) continue;
+          auto side = make_plane_quadric(normalize(cross(edge, normal)),
+              positions[a], boundary_weight);
+          q[a] += side, q[b] += side;
+        }
+      });
+
+  // vertices on boundaries and on non-manifold edges, which are kept
+  auto boundary = std::vector<bool>(num_vertices, false);
+  auto locked   = std::vector<bool>(num_vertices, false);
+  for (auto edge = 0; edge < (int)emap.edges.size(); edge++) {
+    auto& e = emap.edges[edge];
+    if (emap.nfaces[edge] == 1) boundary[e.x] = boundary[e.y] = true;
+    if (emap.nfaces[edge] > 2) locked[e.x] = locked[e.y] = true;
+  }
+
+  // faces around vertices, updated by collapses
+  auto vertex_faces = std::vector<std::vector<int>>(num_vertices);
+  for (auto face = 0; face < (int)triangles.size(); face++) {
+    if (removed[face]) continue;
+    auto& t = triangles[face];
+    for (auto k = 0; k < 3; k++) vertex_faces[t[k]].push_back(face);
+  }
+
+  // initial collapses, in parallel
+  auto heap = std::vector<simplify_collapse>(emap.edges.size());
+  common::parallel_for(0, (int)emap.edges.size(), 1024, [&](int edge) {
+    auto  e = emap.edges[edge];
+    auto  q = quadrics[e.x];
+    q += quadrics[e.y];
+    heap[edge] = make_simplify_collapse(
+        q, positions[e.x], positions[e.y], e.x, e.y);
+  });
+  heap.erase(std::remove_if(heap.begin(), heap.end(),
+                 [&](const simplify_collapse& collapse) {
+                   return locked[collapse.v0] || locked[collapse.v1];
+                 }),
+      heap.end());
+  std::make_heap(heap.begin(), heap.end());
+
+  // check whether a collapse keeps the mesh manifold and does not flip faces
+  auto stamps    = std::vector<int>(num_vertices, 0);
+  auto marks     = std::vector<int>(num_vertices, -1);
+  auto epoch     = 0;
+  auto neighbors = std::vector<int>{};
+  auto can_collapse = [&](int v0, int v1, const vec3f& position) {
+    // faces shared by the edge and link condition
+    auto shared = 0;
+    for (auto face : vertex_faces[v0]) {
+      auto& t = triangles[face];
+      if (t.x == v1 || t.y == v1 || t.z == v1) shared++;
+    }
+    if (shared == 0 || shared > 2) return false;
+    if (boundary[v0] && boundary[v1] && shared != 1) return false;
+    epoch += 1;
+    for (auto face : vertex_faces[v0]) {
+      auto& t = triangles[face];
+      for (auto k = 0; k < 3; k++) marks[t[k]] = epoch;
+    }
+    neighbors.clear();
+    for (auto face : vertex_faces[v1]) {
+      auto& t = triangles[face];
+      for (auto k = 0; k < 3; k++) {
+        if (t[k] != v0 && t[k] != v1 && marks[t[k]] == epoch)
+          neighbors.push_back(t[k]);
+      }
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    auto common = std::unique(neighbors.begin(), neighbors.end()) -
+                  neighbors.begin();
+    if (common != shared) return false;
+    // orientation of the faces that are moved
+    for (auto vertex : {v0, v1}) {
+      for (auto face : vertex_faces[vertex]) {
+        auto& t = triangles[face];
+        if ((t.x == v0 || t.y == v0 || t.z == v0) &&
+            (t.x == v1 || t.y == v1 || t.z == v1))
+          continue;
+        auto moved = [&](int v) {
+          return v == vertex ? position : positions[v];
+        };
+        auto n0 = cross(positions[t.y] - positions[t.x],
+            positions[t.z] - positions[t.x]);
+        auto n1 = cross(moved(t.y) - moved(t.x), moved(t.z) - moved(t.x));
+        if (n0 != zero3f && dot(n0, n1) <= 0) return false;
+      }
+    }
+    return true;
+  };
+
+  // collapse edges greedily
+  while (num_faces > num_triangles && !heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end());
+    auto collapse = heap.back();
+    heap.pop_back();
+    if (collapse.cost > max_error) break;
+    auto v0 = collapse.v0, v1 = collapse.v1;
+    if (stamps[v0] != collapse.stamp0 || stamps[v1] != collapse.stamp1)
+      continue;
+    auto position = lerp(positions[v0], positions[v1], collapse.t);
+    if (!can_collapse(v0, v1, position)) continue;
+
+    // update vertex data of the kept vertex
+    positions[v0] = position;
+    if (!normals.empty())
+      normals[v0] = normalize(lerp(normals[v0], normals[v1], collapse.t));
+    if (!texcoords.empty())
+      texcoords[v0] = lerp(texcoords[v0], texcoords[v1], collapse.t);
+    if (!colors.empty())
+      colors[v0] = lerp(colors[v0], colors[v1], collapse.t);
+    quadrics[v0] += quadrics[v1];
+    boundary[v0] = boundary[v0] || boundary[v1];
+
+    // remove the shared faces and move the others to the kept vertex
+    for (auto face : vertex_faces[v1]) {
+      auto& t = triangles[face];
+      if (t.x == v0 || t.y == v0 || t.z == v0) {
+        removed[face] = true;
+        num_faces--;
+        for (auto k = 0; k < 3; k++) {
+          if (t[k] == v0 || t[k] == v1) continue;
+          auto& around = vertex_faces[t[k]];
+          around.erase(std::find(around.begin(), around.end(), face));
+        }
+      } else {
+        for (auto k = 0; k < 3; k++) {
+          if (t[k] == v1) t[k] = v0;
+        }
+      }
+    }
+    auto& faces = vertex_faces[v0];
+    faces.erase(std::remove_if(faces.begin(), faces.end(),
+                    [&](int face) { return removed[face]; }),
+        faces.end());
+    for (auto face : vertex_faces[v1]) {
+      if (!removed[face]) faces.push_back(face);
+    }
+    vertex_faces[v1] = {};
+    stamps[v0] += 1;
+    stamps[v1] = -1;
+
+    // new collapses around the kept vertex
+    epoch += 1;
+    for (auto face : faces) {
+      auto& t = triangles[face];
+      for (auto k = 0; k < 3; k++) {
+        auto vertex = t[k];
+        if (vertex == v0 || locked[vertex] || marks[vertex] == epoch)
+          continue;
+        marks[vertex] = epoch;
+        auto q        = quadrics[v0];
+        q += quadrics[vertex];
+        auto& next = heap.emplace_back(make_simplify_collapse(
+            q, positions[v0], positions[vertex], v0, vertex));
+        next.stamp0 = stamps[v0];
+        next.stamp1 = stamps[vertex];
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+  }
+
+  // compact faces and vertices
+  auto vertex_map = std::vector<int>(num_vertices, -1);
+  auto kept       = std::vector<int>{};
+  auto faces      = std::vector<vec3i>{};
+  faces.reserve(num_faces);
+  for (auto face = 0; face < (int)triangles.size(); face++) {
+    if (removed[face]) continue;
+    auto t = triangles[face];
+    for (auto k = 0; k < 3; k++) {
+      if (vertex_map[t[k]] < 0) {
+        vertex_map[t[k]] = (int)kept.size();
+        kept.push_back(t[k]);
+      }
+      t[k] = vertex_map[t[k]];
+    }
+    faces.push_back(t);
+  }
+  triangles = std::move(faces);
+  auto compact = [&kept](auto& vert) {
+    if (vert.empty()) return;
+    auto compacted = std::vector<std::decay_t<decltype(vert[0])>>(
+        kept.size());
+    common::parallel_for(0, (int)kept.size(), 4096,
+        [&](int vertex) { compacted[vertex] = vert[kept[vertex]]; });
+    vert = std::move(compacted);
+  };
+  compact(positions);
+  compact(normals);
+  compact(texcoords);
+  compact(colors);
+}
+
+// Simplify triangles.
+void simplify_triangles(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, std::vector<vec3f>& colors,
+    int num_triangles, float max_error) {
+  simplify_triangles_impl(triangles, positions, normals, texcoords, colors,
+      num_triangles, max_error);
+}
+std::pair<std::vector<vec3i>, std::vector<vec3f>> simplify_triangles(
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    int num_triangles, float max_error) {
+  auto striangles = triangles;
+  auto spositions = positions;
+  auto normals    = std::vector<vec3f>{};
+  auto texcoords  = std::vector<vec2f>{};
+  auto colors     = std::vector<vec3f>{};
+  simplify_triangles_impl(striangles, spositions, normals, texcoords, colors,
+      num_triangles, max_error);
+  return {striangles, spositions};
+}
+
+}  // namespace yocto::shape
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF SHAPE REORDERING
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Access the vertices of points and of other elements alike.
+static int& element_vertex(int& element, int) { return element; }
+template <typename T>
+static int& element_vertex(T& element, int k) {
+  return element[k];
+}
+
+// Sort elements along a Morton curve of their centers.
+template <typename T>
+static void sort_elements_morton(std::vector<T>& elements,
+    const std::vector<vec3f>& positions, int element_size) {
+  auto centers = std::vector<vec3f>(elements.size());
+  for (auto idx = 0; idx < (int)elements.size(); idx++) {
+    auto center = zero3f;
+    for (auto k = 0; k < element_size; k++)
+      center += positions[element_vertex(elements[idx], k)];
+    centers[idx] = center / (float)element_size;
+  }
+  auto order  = sort_morton(centers);
+  auto sorted = std::vector<T>(elements.size());
+  for (auto idx = 0; idx < (int)order.size(); idx++)
+    sorted[idx] = elements[order[idx]];
+  elements = std::move(sorted);
+}
+
+// Renumber vertices in order of first use, with unused ones at the end.
+// Returns the old index of each new vertex.
+template <typename T>
+static std::vector<int> renumber_vertices(
+    std::vector<T>& elements, int num_vertices, int element_size) {
+  auto remap = std::vector<int>(num_vertices, -1);
+  auto map   = std::vector<int>{};
+  map.reserve(num_vertices);
+  for (auto& element : elements) {
+    for (auto k = 0; k < element_size; k++) {
+      auto& vid = element_vertex(element, k);
+      if (remap[vid] < 0) {
+        remap[vid] = (int)map.size();
+        map.push_back(vid);
+      }
+      vid = remap[vid];
+    }
+  }
+  for (auto vid = 0; vid < num_vertices; vid++) {
+    if (remap[vid] < 0) map.push_back(vid);
+  }
+  return map;
+}
+
+// Order triangles for a post-transform vertex cache with the greedy
+// algorithm of [Forsyth 2006]. The next triangle is the one with the highest
+// score among the ones around the cached vertices, or the next one in input
+// order if none is left.
+static std::vector<int> vertex_cache_order(
+    const std::vector<vec3i>& triangles, int num_vertices, int cache_size) {
+  // vertex scores favor the last triangle, then recently used vertices, and
+  // vertices with few triangles left
+  cache_size        = max(cache_size, 4);
+  auto vertex_score = [cache_size](int position, int valence) {
+    if (valence == 0) return -1.0f;
+    auto score = 0.0f;
+    if (position >= 0 && position < 3) {
+      score = 0.75f;
+    } else if (position >= 0) {
+      score = pow(1 - (float)(position - 3) / (cache_size - 3), 1.5f);
+    }
+    return score + 2 / sqrt((float)valence);
+  };
+
+  // triangles around each vertex, with the remaining ones first
+  auto offsets = std::vector<int>(num_vertices + 1, 0);
+  for (auto& triangle : triangles)
+    for (auto k = 0; k < 3; k++) offsets[triangle[k] + 1]++;
+  for (auto vid = 0; vid < num_vertices; vid++)
+    offsets[vid + 1] += offsets[vid];
+  auto adjacency = std::vector<int>(offsets.back());
+  auto valence   = std::vector<int>(num_vertices, 0);
+  for (auto tid = 0; tid < (int)triangles.size(); tid++) {
+    for (auto k = 0; k < 3; k++) {
+      auto vid = triangles[tid][k];
+      adjacency[offsets[vid] + valence[vid]++] = tid;
+    }
+  }
+
+  // initial scores
+  auto position = std::vector<int>(num_vertices, -1);
+  auto vscores  = std::vector<float>(num_vertices);
+  for (auto vid = 0; vid < num_vertices; vid++)
+    vscores[vid] = vertex_score(-1, valence[vid]);
+  auto tscores = std::vector<float>(triangles.size());
+  for (auto tid = 0; tid < (int)triangles.size(); tid++) {
+    auto& triangle = triangles[tid];
+    tscores[tid]   = vscores[triangle.x] + vscores[triangle.y] +
+                   vscores[triangle.z];
+  }
+
+  // add triangles greedily
+  auto added = std::vector<bool>(triangles.size(), false);
+  auto cache = std::vector<int>{}, new_cache = std::vector<int>{};
+  auto order = std::vector<int>{};
+  order.reserve(triangles.size());
+  auto next = 0, best = -1;
+  while (order.size() < triangles.size()) {
+    if (best < 0) {
+      while (added[next]) next++;
+      best = next;
+    }
+    auto& triangle = triangles[best];
+    added[best]    = true;
+    order.push_back(best);
+
+    // remove the triangle from its vertices
+    for (auto k = 0; k < 3; k++) {
+      auto vid   = triangle[k];
+      auto begin = adjacency.begin() + offsets[vid];
+      auto end   = begin + valence[vid];
+      std::iter_swap(std::find(begin, end, best), end - 1);
+      valence[vid]--;
+    }
+
+    // move its vertices to the front of the cache
+    new_cache.clear();
+    for (auto k = 0; k < 3; k++) {
+      if (std::find(new_cache.begin(), new_cache.end(), triangle[k]) ==
+          new_cache.end())
+        new_cache.push_back(triangle[k]);
+    }
+    for (auto vid : cache) {
+      if (vid != triangle.x && vid != triangle.y && vid != triangle.z)
+        new_cache.push_back(vid);
+    }
+    std::swap(cache, new_cache);
+
+    // update the scores of the vertices in the cache and of the ones
+    // dropped from it, then of their triangles
+    for (auto idx = 0; idx < (int)cache.size(); idx++) {
+      auto vid      = cache[idx];
+      position[vid] = idx < cache_size ? idx : -1;
+      vscores[vid]  = vertex_score(position[vid], valence[vid]);
+    }
+    auto best_score = -flt_max;
+    best            = -1;
+    for (auto vid : cache) {
+      for (auto idx = 0; idx < valence[vid]; idx++) {
+        auto  tid      = adjacency[offsets[vid] + idx];
+        auto& triangle = triangles[tid];
+        tscores[tid]   = vscores[triangle.x] + vscores[triangle.y] +
+                       vscores[triangle.z];
+        if (tscores[tid] > best_score) {
+          best_score = tscores[tid];
+          best       = tid;
+        }
+      }
+    }
+    if (cache.size() > cache_size) cache.resize(cache_size);
+  }
+  return order;
+}
+
+// Reorder elements in place for memory locality
+std::vector<int> reorder_points(
+    std::vector<int>& points, const std::vector<vec3f>& positions) {
+  sort_elements_morton(points, positions, 1);
+  return renumber_vertices(points, (int)positions.size(), 1);
+}
+std::vector<int> reorder_lines(
+    std::vector<vec2i>& lines, const std::vector<vec3f>& positions) {
+  sort_elements_morton(lines, positions, 2);
+  return renumber_vertices(lines, (int)positions.size(), 2);
+}
+std::vector<int> reorder_triangles(std::vector<vec3i>& triangles,
+    const std::vector<vec3f>& positions, bool vertex_cache, int cache_size) {
+  sort_elements_morton(triangles, positions, 3);
+  if (vertex_cache) {
+    auto order = vertex_cache_order(
+        triangles, (int)positions.size(), cache_size);
+    auto sorted = std::vector<vec3i>(triangles.size());
+    for (auto idx = 0; idx < (int)order.size(); idx++)
+      sorted[idx] = triangles[order[idx]];
+    triangles = std::move(sorted);
+  }
+  return renumber_vertices(triangles, (int)positions.size(), 3);
+}
+std::vector<int> reorder_quads(
+    std::vector<vec4i>& quads, const std::vector<vec3f>& positions) {
+  sort_elements_morton(quads, positions, 4);
+  return renumber_vertices(quads, (int)positions.size(), 4);
+}
+
+// Reorder vertex data with a vertex map
+template <typename T>
+static void reorder_vertices_impl(
+    std::vector<T>& vert, const std::vector<int>& map) {
+  if (vert.empty()) return;
+  if (vert.size() != map.size())
+    throw std::out_of_range("array should be the same length");
+  auto reordered = std::vector<T>(map.size());
+  for (auto idx = 0; idx < (int)map.size(); idx++)
+    reordered[idx] = vert[map[idx]];
+  vert = std::move(reordered);
+}
+void reorder_vertices(std::vector<float>& vert, const std::vector<int>& map) {
+  reorder_vertices_impl(vert, map);
+}
+void reorder_vertices(std::vector<vec2f>& vert, const std::vector<int>& map) {
+  reorder_vertices_impl(vert, map);
+}
+void reorder_vertices(std::vector<vec3f>& vert, const std::vector<int>& map) {
+  reorder_vertices_impl(vert, map);
+}
+void reorder_vertices(std::vector<vec4f>& vert, const std::vector<int>& map) {
+  reorder_vertices_impl(vert, map);
+}
+
+}  // namespace yocto::shape
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF SHAPE DISTANCE FIELDS
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Update a voxel distance from its neighbors, solving the eikonal equation
+// with the upwind scheme of fast sweeping [Zhao 2005].
+static float solve_eikonal(float a, float b, float c, float voxel) {
+  if (a > b) swap(a, b);
+  if (b > c) swap(b, c);
+  if (a > b) swap(a, b);
+  auto distance = a + voxel;
+  if (distance <= b) return distance;
+  distance = (a + b + sqrt(max(2 * voxel * voxel - (a - b) * (a - b), 0.0f))) /
+             2;
+  if (distance <= c) return distance;
+  auto sum = a + b + c;
+  return (sum + sqrt(max(sum * sum - 3 * (a * a + b * b + c * c -
+                                             voxel * voxel),
+                    0.0f))) /
+         3;
+}
+
+// Compute the signed distance field of a closed triangle mesh.
+void make_sdf(std::vector<float>& distances, vec3i& size, bbox3f& bbox,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    int resolution, int band, bool narrow_band) {
+  // grid of cubic voxels centered on the mesh
+  auto bounds = invalidb3f;
+  for (auto& triangle : triangles) {
+    for (auto vid = 0; vid < 3; vid++)
+      bounds = merge(bounds, positions[triangle[vid]]);
+  }
+  if (triangles.empty()) {
+    distances = {};
+    size      = {0, 0, 0};
+    bbox      = invalidb3f;
+    return;
+  }
+  resolution  = max(resolution, 1);
+  band        = max(band, 1);
+  auto extent = bounds.max - bounds.min;
+  auto voxel  = max(max(extent), flt_eps) / resolution;
+  for (auto axis = 0; axis < 3; axis++) {
+    size[axis] = max((int)std::ceil(extent[axis] / voxel), 1) + 2 * band;
+  }
+  bbox.min     = (bounds.min + bounds.max) / 2 - vec3f{size} * voxel / 2;
+  bbox.max     = bbox.min + vec3f{size} * voxel;
+  auto index   = [&size](int i, int j, int k) {
+    return ((size_t)k * size.y + j) * size.x + i;
+  };
+  auto center = [&bbox, voxel](int i, int j, int k) {
+    return bbox.min + (vec3f{(float)i, (float)j, (float)k} + 0.5f) * voxel;
+  };
+
+  // exact distances in the narrow band
+  auto radius = std::vector<float>(positions.size(), 0);
+  auto bvh    = bvh_tree{};
+  make_triangles_bvh(bvh, triangles, positions, radius);
+  auto max_distance = band * voxel;
+  distances.assign((size_t)size.x * size.y * size.z, flt_max);
+  common::parallel_for(size.y * size.z, [&](int row) {
+    auto j = row % size.y, k = row / size.y;
+    for (auto i = 0; i < size.x; i++) {
+      auto intersection = overlap_triangles_bvh(
+          bvh, triangles, positions, radius, center(i, j, k), max_distance);
+      if (intersection.hit) distances[index(i, j, k)] = intersection.distance;
+    }
+  });
+
+  // extend distances by sweeping the grid along the 8 diagonal directions,
+  // keeping band distances fixed; voxels on a plane orthogonal to the
+  // direction only depend on the previous plane, so they are updated
+  // in parallel
+  if (narrow_band) {
+    for (auto& distance : distances) distance = min(distance, max_distance);
+  } else {
+    auto fixed = std::vector<bool>(distances.size());
+    for (auto idx = (size_t)0; idx < distances.size(); idx++) {
+      fixed[idx] = distances[idx] != flt_max;
+    }
+    auto neighbor = [&](int i, int j, int k, int axis) {
+      auto ijk    = vec3i{i, j, k};
+      auto result = flt_max;
+      for (auto offset : {-1, 1}) {
+        ijk[axis] += offset;
+        if (ijk[axis] >= 0 && ijk[axis] < size[axis])
+          result = min(result, distances[index(ijk.x, ijk.y, ijk.z)]);
+        ijk[axis] -= offset;
+      }
+      return result;
+    };
+    auto num_planes = size.x + size.y + size.z - 2;
+    for (auto direction = 0; direction < 8; direction++) {
+      for (auto plane = 0; plane < num_planes; plane++) {
+        auto min_i = max(plane - (size.y - 1) - (size.z - 1), 0);
+        auto max_i = min(plane, size.x - 1);
+        common::parallel_for(min_i, max_i + 1, 4, [&](int di) {
+          auto min_j = max(plane - di - (size.z - 1), 0);
+          auto max_j = min(plane - di, size.y - 1);
+          for (auto dj = min_j; dj <= max_j; dj++) {
+            auto dk  = plane - di - dj;
+            auto i   = (direction & 1) ? size.x - 1 - di : di;
+            auto j   = (direction & 2) ? size.y - 1 - dj : dj;
+            auto k   = (direction & 4) ? size.z - 1 - dk : dk;
+            auto idx = index(i, j, k);
+            if (fixed[idx]) continue;
+            distances[idx] = min(distances[idx],
+                solve_eikonal(neighbor(i, j, k, 0), neighbor(i, j, k, 1),
+                    neighbor(i, j, k, 2), voxel));
+          }
+        });
+      }
+    }
+  }
+
+  // count the parity of the surface crossings along rays on each axis,
+  // walking each column of voxels with a single ray
+  auto votes = std::vector<byte>(distances.size(), 0);
+  for (auto axis = 0; axis < 3; axis++) {
+    auto axis_u = (axis + 1) % 3, axis_v = (axis + 2) % 3;
+    common::parallel_for(size[axis_u] * size[axis_v], [&](int column) {
+      auto ijk    = vec3i{0, 0, 0};
+      ijk[axis_u] = column % size[axis_u];
+      ijk[axis_v] = column / size[axis_u];
+      auto origin = center(ijk.x, ijk.y, ijk.z);
+      origin[axis] = bbox.min[axis];
+      // offset rays off the grid, where symmetric meshes have edges
+      origin[axis_u] += voxel * 0.00123f;
+      origin[axis_v] += voxel * 0.00271f;
+      auto direction  = vec3f{0, 0, 0};
+      direction[axis] = 1;
+      auto ray = ray3f{
+          origin, direction, 0.0f, bbox.max[axis] - bbox.min[axis]};
+      auto crossings = 0;
+      auto crossing  = intersect_triangles_bvh(bvh, triangles, positions, ray);
+      for (ijk[axis] = 0; ijk[axis] < size[axis]; ijk[axis]++) {
+        auto distance = (ijk[axis] + 0.5f) * voxel;
+        while (crossing.hit && crossing.distance < distance) {
+          crossings += 1;
+          ray.tmin = crossing.distance + voxel * 1e-4f;
+          crossing = intersect_triangles_bvh(bvh, triangles, positions, ray);
+        }
+        if (crossings % 2) votes[index(ijk.x, ijk.y, ijk.z)] += 1;
+      }
+    });
+  }
+  common::parallel_for(0, (int)distances.size(), 4096, [&](int idx) {
+    if (votes[idx] >= 2) distances[idx] = -distances[idx];
+  });
+}
+
+}  // namespace yocto::shape
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION OF SHAPE SAMPLING
 // -----------------------------------------------------------------------------
@@ -2917,74 +4862,218 @@ std::vector<float> sample_quads_cdf(
   return cdf;
 }
 
-// Samples a set of points over a triangle mesh uniformly. The rng function
-// takes the point index and returns vec3f numbers uniform directibuted in
-// [0,1]^3. unorm and texcoord are optional.
-void sample_triangles(std::vector<vec3f>& sampled_positions,
+// Sample mesh elements in parallel, with a random stream per chunk of points
+// apart from the ones of callers, so that samples are the same for any
+// number of threads.
+template <typename Sample>
+static std::vector<std::pair<int, vec2f>> sample_elements(
+    int npoints, int seed, const Sample& sample) {
+  auto samples    = std::vector<std::pair<int, vec2f>>(npoints);
+  auto chunk_size = 4096;
+  common::parallel_for((npoints + chunk_size - 1) / chunk_size, [&](int chunk) {
+    auto rng = make_rng(seed, ((uint64_t)1 << 32) + chunk);
+    auto end = min((chunk + 1) * chunk_size, npoints);
+    for (auto idx = chunk * chunk_size; idx < end; idx++) {
+      auto re      = rand1f(rng);
+      auto ruv     = rand2f(rng);
+      samples[idx] = sample(re, ruv);
+    }
+  });
+  return samples;
+}
+
+// Keep the samples with no kept sample closer than radius, by dart throwing
+// over a grid of cells as large as the radius. Cells are processed in 27
+// phases, so that cells in the same phase are two cells apart and can be
+// processed in parallel, making the result independent of threads.
+static std::vector<int> eliminate_samples(
+    const std::vector<vec3f>& positions, float radius) {
+  auto grid   = make_point_grid(positions, radius);
+  auto phases = std::vector<std::vector<int>>(27);
+  for (auto cell_id = 0; cell_id < (int)grid.cell_keys.size(); cell_id++) {
+    auto cell = get_cell_index(
+        grid, grid.cell_positions[grid.cell_offsets[cell_id]]);
+    auto phase = vec3i{(cell.x % 3 + 3) % 3, (cell.y % 3 + 3) % 3,
+        (cell.z % 3 + 3) % 3};
+    phases[phase.x + phase.y * 3 + phase.z * 9].push_back(cell_id);
+  }
+  auto kept           = std::vector<byte>(positions.size(), 0);
+  auto radius_squared = radius * radius;
+  for (auto& phase : phases) {
+    common::parallel_for((int)phase.size(), [&](int phase_idx) {
+      auto cell_id = phase[phase_idx];
+      for (auto idx = grid.cell_offsets[cell_id];
+           idx < grid.cell_offsets[cell_id + 1]; idx++) {
+        auto& position = grid.cell_positions[idx];
+        auto  cell     = get_cell_index(grid, position);
+        auto  covered  = false;
+        for (auto k = -1; k <= 1; k++) {
+          for (auto j = -1; j <= 1; j++) {
+            visit_cell_row(grid, cell + vec3i{-1, j, k}, cell.x + 1,
+                [&](int vertex, const vec3f& vertex_position) {
+                  if (kept[vertex] && distance_squared(vertex_position,
+                                          position) < radius_squared)
+                    covered = true;
+                });
+          }
+        }
+        if (!covered) kept[grid.cell_vertices[idx]] = 1;
+      }
+    });
+  }
+  auto kept_samples = std::vector<int>{};
+  for (auto idx = 0; idx < (int)kept.size(); idx++) {
+    if (kept[idx]) kept_samples.push_back(idx);
+  }
+  return kept_samples;
+}
+
+// Number of candidates for Poisson-disk sampling of a given area.
+static int get_poisson_candidates(float area, float radius) {
+  if (radius <= 0) return 0;
+  return (int)std::min(8.0 * area / ((double)radius * radius), 1e9);
+}
+
+// Evaluate sampled points of a triangle mesh in parallel.
+static void eval_triangles_samples(std::vector<vec3f>& sampled_positions,
     std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<std::pair<int, vec2f>>& samples,
     const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
-    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
-    int npoints, int seed) {
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords) {
+  auto npoints = (int)samples.size();
   sampled_positions.resize(npoints);
   sampled_normals.resize(npoints);
   sampled_texcoords.resize(npoints);
-  auto cdf = sample_triangles_cdf(triangles, positions);
-  auto rng = make_rng(seed);
-  for (auto i = 0; i < npoints; i++) {
-    auto  sample         = sample_triangles(cdf, rand1f(rng), rand2f(rng));
-    auto& t              = triangles[sample.first];
-    auto  uv             = sample.second;
+  common::parallel_for(0, npoints, 4096, [&](int i) {
+    auto& [element, uv]  = samples[i];
+    auto& t              = triangles[element];
     sampled_positions[i] = interpolate_triangle(
         positions[t.x], positions[t.y], positions[t.z], uv);
-    if (!sampled_normals.empty()) {
+    if (!normals.empty()) {
       sampled_normals[i] = normalize(
           interpolate_triangle(normals[t.x], normals[t.y], normals[t.z], uv));
     } else {
       sampled_normals[i] = triangle_normal(
           positions[t.x], positions[t.y], positions[t.z]);
     }
-    if (!sampled_texcoords.empty()) {
+    if (!texcoords.empty()) {
       sampled_texcoords[i] = interpolate_triangle(
           texcoords[t.x], texcoords[t.y], texcoords[t.z], uv);
     } else {
       sampled_texcoords[i] = zero2f;
     }
-  }
+  });
 }
 
-// Samples a set of points over a triangle mesh uniformly. The rng function
-// takes the point index and returns vec3f numbers uniform directibuted in
-// [0,1]^3. unorm and texcoord are optional.
-void sample_quads(std::vector<vec3f>& sampled_positions,
+// Evaluate sampled points of a quad mesh in parallel.
+static void eval_quads_samples(std::vector<vec3f>& sampled_positions,
     std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<std::pair<int, vec2f>>& samples,
     const std::vector<vec4i>& quads, const std::vector<vec3f>& positions,
-    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
-    int npoints, int seed) {
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords) {
+  auto npoints = (int)samples.size();
   sampled_positions.resize(npoints);
   sampled_normals.resize(npoints);
   sampled_texcoords.resize(npoints);
-  auto cdf = sample_quads_cdf(quads, positions);
-  auto rng = make_rng(seed);
-  for (auto i = 0; i < npoints; i++) {
-    auto  sample         = sample_quads(cdf, rand1f(rng), rand2f(rng));
-    auto& q              = quads[sample.first];
-    auto  uv             = sample.second;
+  common::parallel_for(0, npoints, 4096, [&](int i) {
+    auto& [element, uv]  = samples[i];
+    auto& q              = quads[element];
     sampled_positions[i] = interpolate_quad(
         positions[q.x], positions[q.y], positions[q.z], positions[q.w], uv);
-    if (!sampled_normals.empty()) {
+    if (!normals.empty()) {
       sampled_normals[i] = normalize(interpolate_quad(
           normals[q.x], normals[q.y], normals[q.z], normals[q.w], uv));
     } else {
       sampled_normals[i] = quad_normal(
           positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
     }
-    if (!sampled_texcoords.empty()) {
+    if (!texcoords.empty()) {
       sampled_texcoords[i] = interpolate_quad(
           texcoords[q.x], texcoords[q.y], texcoords[q.z], texcoords[q.w], uv);
     } else {
       sampled_texcoords[i] = zero2f;
     }
-  }
+  });
+}
+
+// Samples a set of points over a triangle mesh uniformly. unorm and texcoord
+// are optional.
+void sample_triangles(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    int npoints, int seed) {
+  auto cdf     = sample_triangles_cdf(triangles, positions);
+  auto samples = sample_elements(npoints, seed, [&](float re, vec2f ruv) {
+    return sample_triangles(cdf, re, ruv);
+  });
+  eval_triangles_samples(sampled_positions, sampled_normals, sampled_texcoords,
+      samples, triangles, positions, normals, texcoords);
+}
+
+// Samples a set of points over a quad mesh uniformly. unorm and texcoord
+// are optional.
+void sample_quads(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec4i>& quads, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    int npoints, int seed) {
+  auto cdf     = sample_quads_cdf(quads, positions);
+  auto samples = sample_elements(npoints, seed, [&](float re, vec2f ruv) {
+    return sample_quads(cdf, re, ruv);
+  });
+  eval_quads_samples(sampled_positions, sampled_normals, sampled_texcoords,
+      samples, quads, positions, normals, texcoords);
+}
+
+// Samples a set of points over a triangle mesh with a Poisson-disk
+// distribution, eliminating uniform candidates closer than radius.
+void sample_triangles_poisson(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    float radius, int seed) {
+  auto cdf        = sample_triangles_cdf(triangles, positions);
+  auto candidates = sample_elements(
+      get_poisson_candidates(cdf.empty() ? 0 : cdf.back(), radius), seed,
+      [&](float re, vec2f ruv) { return sample_triangles(cdf, re, ruv); });
+  auto candidate_positions = std::vector<vec3f>(candidates.size());
+  common::parallel_for(0, (int)candidates.size(), 4096, [&](int i) {
+    auto& [element, uv]    = candidates[i];
+    auto& t                = triangles[element];
+    candidate_positions[i] = interpolate_triangle(
+        positions[t.x], positions[t.y], positions[t.z], uv);
+  });
+  auto samples = std::vector<std::pair<int, vec2f>>{};
+  for (auto idx : eliminate_samples(candidate_positions, radius))
+    samples.push_back(candidates[idx]);
+  eval_triangles_samples(sampled_positions, sampled_normals, sampled_texcoords,
+      samples, triangles, positions, normals, texcoords);
+}
+
+// Samples a set of points over a quad mesh with a Poisson-disk
+// distribution, eliminating uniform candidates closer than radius.
+void sample_quads_poisson(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec4i>& quads, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    float radius, int seed) {
+  auto cdf        = sample_quads_cdf(quads, positions);
+  auto candidates = sample_elements(
+      get_poisson_candidates(cdf.empty() ? 0 : cdf.back(), radius), seed,
+      [&](float re, vec2f ruv) { return sample_quads(quads, cdf, re, ruv); });
+  auto candidate_positions = std::vector<vec3f>(candidates.size());
+  common::parallel_for(0, (int)candidates.size(), 4096, [&](int i) {
+    auto& [element, uv]    = candidates[i];
+    auto& q                = quads[element];
+    candidate_positions[i] = interpolate_quad(
+        positions[q.x], positions[q.y], positions[q.z], positions[q.w], uv);
+  });
+  auto samples = std::vector<std::pair<int, vec2f>>{};
+  for (auto idx : eliminate_samples(candidate_positions, radius))
+    samples.push_back(candidates[idx]);
+  eval_quads_samples(sampled_positions, sampled_normals, sampled_texcoords,
+      samples, quads, positions, normals, texcoords);
 }
 
 }  // namespace yocto::shape
@@ -2994,13 +5083,15 @@ void sample_quads(std::vector<vec3f>& sampled_positions,
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
+// Graph arcs, stored once for both directions before building the solver
+using geodesic_arcs = std::vector<std::pair<vec2i, float>>;
+
 static inline void connect_nodes(
-    geodesic_solver& solver, int a, int b, float length) {
-  solver.graph[a].push_back({b, length});
-  solver.graph[b].push_back({a, length});
+    geodesic_arcs& arcs, int a, int b, float length) {
+  arcs.push_back({{a, b}, length});
 }
 
-static inline float opposite_nodes_arc_length(geodesic_solver& solver,
+static inline float opposite_nodes_arc_length(
     const std::vector<vec3f>& positions, int a, int c, const vec2i& edge) {
   // Triangles (a, b, d) and (b, d, c) are connected by (b, d) edge
   // Nodes a and c must be connected.
@@ -3030,7 +5121,7 @@ static inline float opposite_nodes_arc_length(geodesic_solver& solver,
     return sqrtf(len);
 }
 
-static inline void connect_opposite_nodes(geodesic_solver& solver,
+static inline void connect_opposite_nodes(geodesic_arcs& arcs,
     const std::vector<vec3f>& positions, const vec3i& tr0, const vec3i& tr1,
     const vec2i& edge) {
   auto opposite_vertex = [](const vec3i& tr, const vec2i& edge) -> int {
@@ -3043,15 +5134,15 @@ static inline void connect_opposite_nodes(geodesic_solver& solver,
   int v0 = opposite_vertex(tr0, edge);
   int v1 = opposite_vertex(tr1, edge);
   if (v0 == -1 || v1 == -1) return;
-  auto length = opposite_nodes_arc_length(solver, positions, v0, v1, edge);
-  connect_nodes(solver, v0, v1, length);
+  auto length = opposite_nodes_arc_length(positions, v0, v1, edge);
+  connect_nodes(arcs, v0, v1, length);
 }
 
 geodesic_solver make_geodesic_solver(const std::vector<vec3i>& triangles,
     const std::vector<vec3i>&                                  adjacencies,
     const std::vector<vec3f>&                                  positions) {
-  auto solver = geodesic_solver{};
-  solver.graph.resize(positions.size());
+  auto arcs = geodesic_arcs{};
+  arcs.reserve(triangles.size() * 3);
   for (int face = 0; face < triangles.size(); face++) {
     for (int k = 0; k < 3; k++) {
       auto a = triangles[face][k];
@@ -3059,19 +5150,42 @@ geodesic_solver make_geodesic_solver(const std::vector<vec3i>& triangles,
 
       // connect mesh edges
       auto len = length(positions[a] - positions[b]);
-      if (a < b) connect_nodes(solver, a, b, len);
+      if (a < b) connect_nodes(arcs, a, b, len);
 
       // connect opposite nodes
       auto neighbor = adjacencies[face][k];
       if (face < neighbor) {
         connect_opposite_nodes(
-            solver, positions, triangles[face], triangles[neighbor], {a, b});
+            arcs, positions, triangles[face], triangles[neighbor], {a, b});
       }
     }
   }
+
+  // store arcs in both directions, grouped by node
+  auto solver = geodesic_solver{};
+  solver.offsets.assign(positions.size() + 1, 0);
+  for (auto& [nodes, length] : arcs) {
+    solver.offsets[nodes.x + 1] += 1;
+    solver.offsets[nodes.y + 1] += 1;
+  }
+  for (auto node = 0; node < positions.size(); node++) {
+    solver.offsets[node + 1] += solver.offsets[node];
+  }
+  auto next = std::vector<int>(
+      solver.offsets.begin(), solver.offsets.end() - 1);
+  solver.graph.resize(solver.offsets.back());
+  for (auto& [nodes, length] : arcs) {
+    solver.graph[next[nodes.x]++] = {nodes.y, length};
+    solver.graph[next[nodes.y]++] = {nodes.x, length};
+  }
   return solver;
 }
 
+// Number of nodes in the geodesic graph
+static inline int geodesic_nodes(const geodesic_solver& solver) {
+  return solver.offsets.empty() ? 0 : (int)solver.offsets.size() - 1;
+}
+
 // `update` is a function that is executed during expansion, every time a node
 // is put into queue. `exit` is a function that tells whether to expand the
 // current node or perform early exit.
@@ -3095,7 +5209,7 @@ void visit_geodesic_graph(std::vector<float>& field,
      the end of the queue.
   */
 
-  auto in_queue = std::vector<bool>(solver.graph.size(), false);
+  auto in_queue = std::vector<bool>(geodesic_nodes(solver), false);
 
   // setup queue
   auto queue = std::deque<int>();
@@ -3128,10 +5242,11 @@ void visit_geodesic_graph(std::vector<float>& field,
     // Check early exit condition.
     if (exit(node)) continue;
 
-    for (int i = 0; i < solver.graph[node].size(); i++) {
+    for (auto arc = solver.offsets[node]; arc < solver.offsets[node + 1];
+         arc++) {
       // Distance of neighbor through this node
-      auto new_distance = field[node] + solver.graph[node][i].length;
-      auto neighbor     = solver.graph[node][i].node;
+      auto new_distance = field[node] + solver.graph[arc].length;
+      auto neighbor     = solver.graph[arc].node;
 
       auto old_distance = field[neighbor];
       if (new_distance >= old_distance) continue;
@@ -3171,7 +5286,7 @@ void update_geodesic_distances(std::vector<float>& distances,
 
 std::vector<float> compute_geodesic_distances(const geodesic_solver& solver,
     const std::vector<int>& sources, float max_distance) {
-  auto distances = std::vector<float>(solver.graph.size(), flt_max);
+  auto distances = std::vector<float>(geodesic_nodes(solver), flt_max);
   for (auto source : sources) distances[source] = 0.0f;
   update_geodesic_distances(distances, solver, sources, max_distance);
   return distances;
@@ -3182,8 +5297,8 @@ std::vector<float> compute_geodesic_distances(const geodesic_solver& solver,
 // the path. Graph search early exits when reching end_vertex.
 std::vector<int> compute_geodesic_paths(const geodesic_solver& solver,
     const std::vector<int>& sources, int end_vertex) {
-  auto parents   = std::vector<int>(solver.graph.size(), -1);
-  auto distances = std::vector<float>(solver.graph.size(), flt_max);
+  auto parents   = std::vector<int>(geodesic_nodes(solver), -1);
+  auto distances = std::vector<float>(geodesic_nodes(solver), flt_max);
   auto update    = [&parents](int node, int neighbor, float new_distance) {
     parents[neighbor] = node;
   };
@@ -3200,15 +5315,38 @@ std::vector<int> sample_vertices_poisson(
     const geodesic_solver& solver, int num_samples) {
   auto verts = std::vector<int>{};
   verts.reserve(num_samples);
-  auto distances = std::vector<float>(solver.graph.size(), flt_max);
+  auto distances = std::vector<float>(geodesic_nodes(solver), flt_max);
+  if (distances.empty()) return verts;
+  // Farthest vertices are found from the farthest vertex of each block of
+  // vertices, updated in parallel only for blocks whose distances changed.
+  // Ties pick the smaller index, as a linear scan would.
+  auto num_nodes  = (int)distances.size();
+  auto block_size = 1024;
+  auto num_blocks = (num_nodes + block_size - 1) / block_size;
+  auto block_max  = std::vector<int>(num_blocks, 0);
+  auto dirty      = std::vector<byte>(num_blocks, 1);
+  auto update     = [&](int node, int neighbor, float new_distance) {
+    dirty[neighbor / block_size] = 1;
+  };
+  auto exit = [](int node) { return false; };
   while (true) {
-    auto max_index =
-        (int)(std::max_element(distances.begin(), distances.end()) -
-              distances.begin());
+    common::parallel_for(num_blocks, [&](int block) {
+      if (!dirty[block]) return;
+      auto begin = distances.begin() + block * block_size;
+      auto end   = distances.begin() + min((block + 1) * block_size, num_nodes);
+      block_max[block] = (int)(std::max_element(begin, end) -
+                               distances.begin());
+      dirty[block]     = 0;
+    });
+    auto max_index = block_max[0];
+    for (auto index : block_max) {
+      if (distances[index] > distances[max_index]) max_index = index;
+    }
     verts.push_back(max_index);
     if (verts.size() >= num_samples) break;
-    distances[max_index] = 0.0f;
-    update_geodesic_distances(distances, solver, {max_index}, flt_max);
+    distances[max_index]          = 0.0f;
+    dirty[max_index / block_size] = 1;
+    visit_geodesic_graph(distances, solver, {max_index}, update, exit);
   }
   return verts;
 }
@@ -3223,15 +5361,31 @@ std::vector<std::vector<float>> compute_voronoi_fields(
   // time weakly dependant on the number of generators.
   auto total = compute_geodesic_distances(solver, generators);
   auto max   = *std::max_element(total.begin(), total.end());
-  // @Speed: use parallel_for
-  for (int i = 0; i < generators.size(); ++i) {
-    fields[i]                = std::vector<float>(solver.graph.size(), flt_max);
-    fields[i][generators[i]] = 0;
+  common::parallel_for((int)generators.size(), [&](int i) {
     fields[i] = compute_geodesic_distances(solver, {generators[i]}, max);
-  };
+  });
   return fields;
 }
 
+// Compute the closest generator of each vertex in a single search
+std::pair<std::vector<int>, std::vector<float>> compute_voronoi_labels(
+    const geodesic_solver& solver, const std::vector<int>& generators) {
+  auto labels    = std::vector<int>(geodesic_nodes(solver), -1);
+  auto distances = std::vector<float>(geodesic_nodes(solver), flt_max);
+  for (auto idx = 0; idx < (int)generators.size(); idx++) {
+    labels[generators[idx]]    = idx;
+    distances[generators[idx]] = 0.0f;
+  }
+  // labels follow the shortest paths, so each vertex takes the label of the
+  // node it was last reached from
+  auto update = [&labels](int node, int neighbor, float new_distance) {
+    labels[neighbor] = labels[node];
+  };
+  auto exit = [](int node) { return false; };
+  visit_geodesic_graph(distances, solver, generators, update, exit);
+  return {labels, distances};
+}
+
 std::vector<vec3f> colors_from_field(const std::vector<float>& field,
     float scale, const vec3f& c0, const vec3f& c1) {
   auto colors = std::vector<vec3f>{field.size()};
@@ -4811,6 +6965,260 @@ void make_heightfield(std::vector<vec4i>& quads, std::vector<vec3f>& positions,
   normals = compute_normals(quads, positions);
 }
 
+// Emits the triangles of a right-triangulated irregular network, splitting
+// triangles whose hypotenuse midpoint error exceeds max_error. Vertices are
+// packed as grid indices. Only triangles inside [0,extent] are kept.
+static void extract_heightfield_triangles(std::vector<vec3i>& triangles,
+    const std::vector<float>& errors, int grid_size, const vec2i& extent,
+    float max_error, const vec2i& a, const vec2i& b, const vec2i& c) {
+  // skip triangles outside the region
+  if (min(a.x, min(b.x, c.x)) >= extent.x ||
+      min(a.y, min(b.y, c.y)) >= extent.y)
+    return;
+  auto m = (a + b) / 2;
+  if (abs(a.x - c.x) + abs(a.y - c.y) > 1 &&
+      errors[m.y * grid_size + m.x] > max_error) {
+    extract_heightfield_triangles(
+        triangles, errors, grid_size, extent, max_error, c, a, m);
+    extract_heightfield_triangles(
+        triangles, errors, grid_size, extent, max_error, b, c, m);
+  } else {
+    if (max(a.x, max(b.x, c.x)) > extent.x ||
+        max(a.y, max(b.y, c.y)) > extent.y)
+      return;
+    triangles.push_back({a.y * grid_size + a.x, c.y * grid_size + c.x,
+        b.y * grid_size + b.x});
+  }
+}
+
+// Make an adaptive heightfield mesh for the pixels in [start, end] with a
+// right-triangulated irregular network. Errors bound the height deviation
+// of all the pixels under a triangle, by adding the midpoint error to the
+// children ones. Errors are shared with neighbors across the hypotenuse, so
+// the mesh has no cracks.
+// Regions that are not a power of two are embedded in the enclosing grid,
+// where straddling triangles are always split.
+static void make_heightfield_rtin(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, const vec2i& size,
+    const std::vector<float>& height, float max_error, const vec2i& start,
+    const vec2i& end) {
+  triangles.clear();
+  positions.clear();
+  normals.clear();
+  texcoords.clear();
+  auto extent = end - start;
+  if (extent.x <= 0 || extent.y <= 0) return;
+
+  // grid of 2^k+1 vertices enclosing the region
+  auto tile_size = 1, num_levels = 0;
+  while (tile_size < max(extent)) {
+    tile_size *= 2;
+    num_levels += 2;
+  }
+  auto grid_size  = tile_size + 1;
+  auto get_height = [&](const vec2i& ij) {
+    auto i = start.x + min(ij.x, extent.x), j = start.y + min(ij.y, extent.y);
+    return height[j * size.x + i];
+  };
+
+  // midpoint error of a triangle, refining triangles that straddle the region
+  auto get_error = [&](const vec2i& a, const vec2i& b, const vec2i& c) {
+    if (min(a.x, min(b.x, c.x)) >= extent.x ||
+        min(a.y, min(b.y, c.y)) >= extent.y)
+      return 0.0f;
+    if (max(a.x, max(b.x, c.x)) > extent.x ||
+        max(a.y, max(b.y, c.y)) > extent.y)
+      return flt_max;
+    return abs((get_height(a) + get_height(b)) / 2 - get_height((a + b) / 2));
+  };
+
+  // compute errors bottom-up, one level at a time; triangles in a level have
+  // distinct midpoints, except for hypotenuse neighbors that are merged
+  auto errors = std::vector<float>((size_t)grid_size * grid_size, 0);
+  for (auto level = num_levels - 1; level >= 0; level--) {
+    auto first = (int64_t)1 << (level + 1);
+    common::parallel_for(0, (int)first, 4096, [&](int idx) {
+      auto id = first + idx;
+      auto a = vec2i{0, 0}, b = vec2i{0, 0}, c = vec2i{0, 0};
+      if (id & 1) {
+        b = {tile_size, tile_size};
+        c = {tile_size, 0};
+      } else {
+        a = {tile_size, tile_size};
+        c = {0, tile_size};
+      }
+      while ((id >>= 1) > 1) {
+        auto m = (a + b) / 2;
+        if (id & 1) {
+          b = a;
+          a = c;
+        } else {
+          a = b;
+          b = c;
+        }
+        c = m;
+      }
+      auto n      = a + b - c;
+      auto inside = n.x >= 0 && n.y >= 0 && n.x <= tile_size &&
+                    n.y <= tile_size;
+      if (inside && c.y * grid_size + c.x > n.y * grid_size + n.x) return;
+      auto error = get_error(a, b, c);
+      if (inside) error = max(error, get_error(a, b, n));
+      if (level < num_levels - 1) {
+        auto child_error = [&](const vec2i& p, const vec2i& q) {
+          auto m = (p + q) / 2;
+          return errors[m.y * grid_size + m.x];
+        };
+        auto children = max(child_error(a, c), child_error(b, c));
+        if (inside)
+          children = max(children, max(child_error(a, n), child_error(b, n)));
+        error = min(error + children, flt_max);
+      }
+      auto m                         = (a + b) / 2;
+      errors[m.y * grid_size + m.x] = error;
+    });
+  }
+
+  // extract triangles, splitting the top levels into independent subtrees
+  auto subtrees = std::vector<std::array<vec2i, 3>>{};
+  auto split    = [&](const std::array<vec2i, 3>& t) {
+    auto& [a, b, c] = t;
+    auto m          = (a + b) / 2;
+    subtrees.push_back({c, a, m});
+    subtrees.push_back({b, c, m});
+  };
+  subtrees.push_back({vec2i{0, 0}, {tile_size, tile_size}, {tile_size, 0}});
+  subtrees.push_back({vec2i{tile_size, tile_size}, {0, 0}, {0, tile_size}});
+  for (auto level = 0; level < min(num_levels - 1, 10); level++) {
+    auto parents = std::move(subtrees);
+    subtrees.clear();
+    for (auto& parent : parents) {
+      auto& [a, b, c] = parent;
+      auto m          = (a + b) / 2;
+      if (errors[m.y * grid_size + m.x] > max_error) {
+        split(parent);
+      } else {
+        subtrees.push_back(parent);
+      }
+    }
+  }
+  auto subtree_triangles = std::vector<std::vector<vec3i>>(subtrees.size());
+  common::parallel_for((int)subtrees.size(), [&](int idx) {
+    auto& [a, b, c] = subtrees[idx];
+    extract_heightfield_triangles(subtree_triangles[idx], errors, grid_size,
+        extent, max_error, a, b, c);
+  });
+  errors.clear();
+  errors.shrink_to_fit();
+
+  // compact vertices in order of use
+  auto vertex_map = std::vector<int>((size_t)grid_size * grid_size, -1);
+  auto vertices   = std::vector<int>{};
+  for (auto& stree : subtree_triangles) {
+    for (auto& triangle : stree) {
+      auto& t = triangles.emplace_back();
+      for (auto k = 0; k < 3; k++) {
+        auto& vid = vertex_map[triangle[k]];
+        if (vid < 0) {
+          vid = (int)vertices.size();
+          vertices.push_back(triangle[k]);
+        }
+        t[k] = vid;
+      }
+    }
+    stree = {};
+  }
+
+  // vertex data matching the full resolution heightfield
+  auto scale = vec2f{(float)size.x, (float)size.y} / max(size);
+  positions.resize(vertices.size());
+  texcoords.resize(vertices.size());
+  common::parallel_for(0, (int)vertices.size(), 4096, [&](int idx) {
+    auto ij = vec2i{vertices[idx] % grid_size, vertices[idx] / grid_size};
+    auto uv = vec2f{(float)(start.x + ij.x) / (size.x - 1),
+        (float)(start.y + ij.y) / (size.y - 1)};
+    positions[idx] = {(2 * uv.x - 1) * scale.x, get_height(ij),
+        -(2 * uv.y - 1) * scale.y};
+    texcoords[idx] = {uv.x, 1 - uv.y};
+  });
+  normals = compute_normals(triangles, positions);
+}
+
+// Make an adaptive heightfield mesh.
+void make_heightfield(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, const vec2i& size,
+    const std::vector<float>& height, float max_error) {
+  make_heightfield_rtin(triangles, positions, normals, texcoords, size, height,
+      max_error, {0, 0}, size - 1);
+}
+
+// Make adaptive heightfield tiles with skirts.
+void make_heightfield_tiles(std::vector<std::vector<vec3i>>& triangles,
+    std::vector<std::vector<vec3f>>&                          positions,
+    std::vector<std::vector<vec3f>>&                          normals,
+    std::vector<std::vector<vec2f>>& texcoords, const vec2i& size,
+    const std::vector<float>& height, float max_error, int tile_size,
+    float skirt) {
+  tile_size      = max(tile_size, 1);
+  auto num_tiles = max((size - 1 + tile_size - 1) / tile_size, vec2i{1, 1});
+  auto num       = num_tiles.x * num_tiles.y;
+  triangles.assign(num, {});
+  positions.assign(num, {});
+  normals.assign(num, {});
+  texcoords.assign(num, {});
+  common::parallel_for(num, [&](int idx) {
+    auto tile  = vec2i{idx % num_tiles.x, idx / num_tiles.x};
+    auto start = tile * tile_size;
+    auto end   = min(start + tile_size, size - 1);
+    make_heightfield_rtin(triangles[idx], positions[idx], normals[idx],
+        texcoords[idx], size, height, max_error, start, end);
+    if (skirt <= 0) return;
+
+    // hang skirts from the tile border, copying the border vertex data
+    auto& ttriangles = triangles[idx];
+    auto& tpositions = positions[idx];
+    auto& tnormals   = normals[idx];
+    auto& ttexcoords = texcoords[idx];
+    auto  xy         = [&](int vid) {
+      auto& p = tpositions[vid];
+      return vec2f{p.x, p.z};
+    };
+    auto corner_min = xy(0), corner_max = xy(0);
+    for (auto vid = 0; vid < (int)tpositions.size(); vid++) {
+      corner_min = min(corner_min, xy(vid));
+      corner_max = max(corner_max, xy(vid));
+    }
+    auto on_border = [&](int v0, int v1) {
+      auto p0 = xy(v0), p1 = xy(v1);
+      return (p0.x == p1.x && (p0.x == corner_min.x || p0.x == corner_max.x)) ||
+             (p0.y == p1.y && (p0.y == corner_min.y || p0.y == corner_max.y));
+    };
+    auto skirt_map = std::unordered_map<int, int>{};
+    auto skirt_vertex = [&](int vid) {
+      auto it = skirt_map.find(vid);
+      if (it != skirt_map.end()) return it->second;
+      auto sid       = (int)tpositions.size();
+      skirt_map[vid] = sid;
+      tpositions.push_back(tpositions[vid] - vec3f{0, skirt, 0});
+      tnormals.push_back(tnormals[vid]);
+      ttexcoords.push_back(ttexcoords[vid]);
+      return sid;
+    };
+    auto num_triangles = (int)ttriangles.size();
+    for (auto tid = 0; tid < num_triangles; tid++) {
+      for (auto k = 0; k < 3; k++) {
+        auto v0 = ttriangles[tid][k], v1 = ttriangles[tid][(k + 1) % 3];
+        if (!on_border(v0, v1)) continue;
+        auto s0 = skirt_vertex(v0), s1 = skirt_vertex(v1);
+        ttriangles.push_back({v1, v0, s0});
+        ttriangles.push_back({v1, s0, s1});
+      }
+    }
+  });
+}
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -19,8 +19,8 @@
 //   `compute_tangents()`
 // 2. compute tangent frames from texture coordinates with
 //    `compute_tangent_spaces()`
-// 3. compute skinning with `compute_skinning()` and
-//    `compute_matrix_skinning()`
+// 3. compute skinning with `compute_skinning()`,
+//    `compute_matrix_skinning()` and `compute_dual_quaternion_skinning()`
 // 4. create shapes with `make_proc_image()`, `make_hair()`,
 //    `make_points()`, `make_point()`
 // 5. merge element with `marge_lines()`, `marge_triangles()`, `marge_quads()`
@@ -29,13 +29,23 @@
 //    `sample_points_cdf()`, `sample_lines_cdf()`,
 //    `sample_triangles_cdf()`
 // 7.  sample a could of point over a surface with `sample_triangles()`
-// 8. get edges and boundaries with `get_edges()`
+// 8. get edges and boundaries with `get_edges()`, and compact mesh
+//    connectivity with `make_mesh_adjacency()`
 // 9. convert quads to triangles with `quads_to_triangles()`
 // 10. convert face varying to vertex shared representations with
 //     `convert_face_varying()`
 // 11. subdivide elements by edge splits with `subdivide_lines()`,
 //     `subdivide_triangles()`, `subdivide_quads()`, `subdivide_beziers()`
 // 12. Catmull-Clark subdivision surface with `subdivide_catmullclark()`
+// 13. precompute subdivisions of a topology with `make_quads_stencils()`,
+//     `make_triangles_stencils()` or `make_catmullclark_stencils()`, and
+//     subdivide vertex data with `apply_subdivision()`
+// 14. simplify triangle meshes, e.g. for levels of detail, with
+//     `simplify_triangles()`
+// 15. compute signed distance fields of closed meshes with `make_sdf()`
+// 16. reorder elements and vertices for memory locality with
+//     `reorder_triangles()` and similar, and remap vertex data with
+//     `reorder_vertices()`
 //
 //
 // ## Shape IO
@@ -77,15 +87,18 @@
 // improve memory footprint at the price of convenience. Shape data is
 // explixitly passed on evey call, while instance data uses callbacks,
 // since each application has its own conventions for storing those.
-// To make usage more convenite, we provide `bvh_XXX_data` to hold application
-// data and convenience wrappers for all functions.
+// To make usage more convenite, we provide `bvh_shape` and `bvh_scene` that
+// reference application data and convenience wrappers for all functions.
+// The bvh builder is shared with Yocto/Trace, that uses `build_bvh_nodes()`
+// and `refit_bvh_nodes()` for its own bvh layouts.
 //
 // We support working either on the whole scene or on a single shape. In the
 // description below yoi will see this dual API defined.
 //
 // 1. build the shape/scene BVH with `make_XXX_bvh()`;
 // 2. perform ray-shape intersection with `intersect_XXX_bvh()`
-// 3. perform point overlap queries with `overlap_XXX_bvh()`
+// 3. perform point overlap queries with `overlap_XXX_bvh()`, or find the
+//    k closest elements with `nearest_XXX_bvh()`
 // 4. refit BVH for dynamic applications with `update_XXX_bvh`
 //
 //
@@ -124,8 +137,8 @@
 
 #include <memory>
 #include <tuple>
-#include <unordered_map>
 
+#include "yocto_common.h"
 #include "yocto_math.h"
 
 // -----------------------------------------------------------------------------
@@ -192,7 +205,7 @@ std::pair<std::vector<vec3f>, std::vector<vec3f>> compute_matrix_skinning(
     const std::vector<vec4f>& weights, const std::vector<vec4i>& joints,
     const std::vector<mat4f>& xforms);
 // Update skinning
-void udpate_skinning(std::vector<vec3f>& skinned_positions,
+void update_skinning(std::vector<vec3f>& skinned_positions,
     std::vector<vec3f>& skinned_normals, const std::vector<vec3f>& positions,
     const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
     const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms);
@@ -200,6 +213,17 @@ void update_matrix_skinning(std::vector<vec3f>& skinned_positions,
     std::vector<vec3f>& skinned_normals, const std::vector<vec3f>& positions,
     const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
     const std::vector<vec4i>& joints, const std::vector<mat4f>& xforms);
+// Apply dual quaternion skinning, that blends joint frames as rigid
+// transforms and avoids the volume loss of linear blending at twisting
+// joints. Joint frames should not contain scaling.
+std::pair<std::vector<vec3f>, std::vector<vec3f>>
+compute_dual_quaternion_skinning(const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms);
+void update_dual_quaternion_skinning(std::vector<vec3f>& skinned_positions,
+    std::vector<vec3f>& skinned_normals, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms);
 
 }  // namespace yocto::shape
 
@@ -229,9 +253,9 @@ namespace yocto::shape {
 // We store only bidirectional edges to keep the dictionary small. Use the
 // functions below to access this data.
 struct edge_map {
-  std::unordered_map<vec2i, int> index  = {};
-  std::vector<vec2i>             edges  = {};
-  std::vector<int>               nfaces = {};
+  common::flat_map<vec2i, int> index  = {};
+  std::vector<vec2i>           edges  = {};
+  std::vector<int>             nfaces = {};
 };
 
 // Initialize an edge map with elements.
@@ -268,6 +292,32 @@ std::vector<std::vector<int>> ordered_boundaries(
 std::vector<std::vector<int>> vertex_to_faces_adjacencies(
     const std::vector<vec3i>& triangles, const std::vector<vec3i>& adjacencies);
 
+// Compact connectivity of a triangle mesh, stored in flat arrays.
+// `adjacencies` are the faces adjacent to each face, as in face_adjacencies().
+// The faces around vertex `v` are `vertex_faces` from `face_offsets[v]` to
+// `face_offsets[v+1]`, and its neighbor vertices are `vertex_neighbors` from
+// `neighbor_offsets[v]` to `neighbor_offsets[v+1]`, both sorted
+// counter-clockwise. Boundary vertices start at the boundary and have one
+// more neighbor than faces.
+struct mesh_adjacency {
+  std::vector<vec3i> adjacencies      = {};
+  std::vector<int>   face_offsets     = {};
+  std::vector<int>   vertex_faces     = {};
+  std::vector<int>   neighbor_offsets = {};
+  std::vector<int>   vertex_neighbors = {};
+};
+
+// Build mesh connectivity in parallel, by bucketing edges and corners.
+mesh_adjacency make_mesh_adjacency(
+    const std::vector<vec3i>& triangles, int num_vertices);
+
+// Update normals of a triangle mesh whose connectivity does not change, as
+// when deforming it, by gathering face normals around each vertex in
+// parallel with the precomputed adjacency.
+void update_normals(std::vector<vec3f>& normals,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    const mesh_adjacency& adjacency);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -299,6 +349,32 @@ struct bvh_tree {
   std::vector<int>      primitives = {};
 };
 
+// Heuristics used to split bvh nodes, by the middle of the centroid bounds,
+// by the median centroid, or by the surface area heuristic.
+enum struct bvh_split { middle, balanced, sah };
+
+// Primitive used to build bvh nodes, with its bounds and centroid. The
+// primitive id is defined by the application, e.g. an element index or an
+// object and instance pair, and is reordered with the primitives.
+struct bvh_primitive {
+  bbox3f bbox      = {};
+  vec3f  center    = {0, 0, 0};
+  vec2i  primitive = {0, 0};
+};
+
+// Build the nodes of a binary bvh, reordering primitives so that leaf nodes
+// refer to ranges of them. Large ranges are binned and partitioned in
+// parallel, in chunks that do not depend on the number of threads, so that
+// trees are deterministic.
+void build_bvh_nodes(std::vector<bvh_node>& nodes,
+    std::vector<bvh_primitive>& primitives, bvh_split split = bvh_split::middle,
+    int max_prims = bvh_max_prims);
+
+// Refit the bounds of bvh nodes given the bounds of the primitives, that are
+// in the order of the primitives after the build.
+void refit_bvh_nodes(
+    std::vector<bvh_node>& nodes, const std::vector<bbox3f>& bboxes);
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
@@ -370,17 +446,19 @@ bvh_intersection overlap_quads_bvh(const bvh_tree& bvh,
     const std::vector<float>& radius, const vec3f& pos, float max_distance,
     bool find_any = false);
 
-// BVH data for whole shapes. This interface makes copies of all the data.
+// BVH data for whole shapes. Elements and vertices are referenced, not
+// copied, so they should outlive the bvh. Set only the elements of the shape
+// type, and radius for points, lines and overlap queries.
 struct bvh_shape {
   // elements
-  std::vector<int>   points    = {};
-  std::vector<vec2i> lines     = {};
-  std::vector<vec3i> triangles = {};
-  std::vector<vec4i> quads     = {};
+  const std::vector<int>*   points    = nullptr;
+  const std::vector<vec2i>* lines     = nullptr;
+  const std::vector<vec3i>* triangles = nullptr;
+  const std::vector<vec4i>* quads     = nullptr;
 
   // vertices
-  std::vector<vec3f> positions = {};
-  std::vector<float> radius    = {};
+  const std::vector<vec3f>* positions = nullptr;
+  const std::vector<float>* radius    = nullptr;
 
   // nodes
   bvh_tree bvh = {};
@@ -395,7 +473,7 @@ struct bvh_instance {
   int     shape = -1;
 };
 
-// BVH data for whole shapes. This interface makes copies of all the data.
+// BVH data for whole scenes, that owns the shape bvhs.
 struct bvh_scene {
   // instances and shapes
   std::vector<bvh_instance> instances = {};
@@ -436,6 +514,23 @@ bvh_intersection overlap_shape_bvh(const bvh_shape& bvh, const vec3f& pos,
 bvh_intersection overlap_scene_bvh(const bvh_scene& bvh, const vec3f& pos,
     float max_distance, bool find_any = false, bool non_rigid_frames = true);
 
+// Find the overlaps of many points at once, as above. Points are queried in
+// parallel, sorted along a Morton curve for coherence, while results are
+// returned in the order of the points.
+std::vector<bvh_intersection> overlap_shape_bvh(const bvh_shape& bvh,
+    const std::vector<vec3f>& positions, float max_distance,
+    bool find_any = false);
+std::vector<bvh_intersection> overlap_scene_bvh(const bvh_scene& bvh,
+    const std::vector<vec3f>& positions, float max_distance,
+    bool find_any = false, bool non_rigid_frames = true);
+
+// Find the k closest shape elements, or instance elements, that overlap a
+// point within a given distance, sorted by increasing distance.
+std::vector<bvh_intersection> nearest_shape_bvh(
+    const bvh_shape& bvh, const vec3f& pos, float max_distance, int k);
+std::vector<bvh_intersection> nearest_scene_bvh(const bvh_scene& bvh,
+    const vec3f& pos, float max_distance, int k, bool non_rigid_frames = true);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -446,10 +541,10 @@ namespace yocto::shape {
 // A sparse grid of cells, containing list of points. Cells are stored in
 // a dictionary to get sparsity. Helpful for nearest neighboor lookups.
 struct hash_grid {
-  float                                       cell_size     = 0;
-  float                                       cell_inv_size = 0;
-  std::vector<vec3f>                          positions     = {};
-  std::unordered_map<vec3i, std::vector<int>> cells         = {};
+  float                                     cell_size     = 0;
+  float                                     cell_inv_size = 0;
+  std::vector<vec3f>                        positions     = {};
+  common::flat_map<vec3i, std::vector<int>> cells         = {};
 };
 
 // Create a hash_grid
@@ -463,6 +558,42 @@ void find_neighbors(const hash_grid& grid, std::vector<int>& neighbors,
 void find_neighbors(const hash_grid& grid, std::vector<int>& neighbors,
     int vertex, float max_radius);
 
+// A static grid of points, built in parallel, for fast neighbor queries.
+// Points are sorted by cell and cells are stored as sorted keys with the
+// range of their points, so that queries scan compact arrays. Use hash_grid
+// to insert points incrementally.
+struct point_grid {
+  float                 cell_size      = 0;
+  float                 cell_inv_size  = 0;
+  std::vector<vec3f>    positions      = {};
+  std::vector<int>      cell_vertices  = {};
+  std::vector<vec3f>    cell_positions = {};
+  std::vector<uint64_t> cell_keys      = {};
+  std::vector<int>      cell_offsets   = {};
+  vec3i                 cell_min       = {0, 0, 0};
+  vec3i                 cell_max       = {0, 0, 0};
+};
+
+// Create a point_grid
+point_grid make_point_grid(
+    const std::vector<vec3f>& positions, float cell_size);
+// Finds the neighbors within a given radius, excluding `vertex` if given
+void find_neighbors(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, float max_radius);
+void find_neighbors(const point_grid& grid, std::vector<int>& neighbors,
+    int vertex, float max_radius);
+// Finds the k nearest neighbors within a given distance, sorted by distance,
+// excluding `vertex` if given
+void find_nearest(const point_grid& grid, std::vector<int>& neighbors,
+    const vec3f& position, int k, float max_distance = flt_max);
+void find_nearest(const point_grid& grid, std::vector<int>& neighbors,
+    int vertex, int k, float max_distance = flt_max);
+// Finds the neighbors of many points in parallel, in Morton order
+std::vector<std::vector<int>> find_neighbors(const point_grid& grid,
+    const std::vector<vec3f>& positions, float max_radius);
+std::vector<std::vector<int>> find_nearest(const point_grid& grid,
+    const std::vector<vec3f>& positions, int k, float max_distance = flt_max);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -472,8 +603,12 @@ namespace yocto::shape {
 
 // Convert quads to triangles
 std::vector<vec3i> quads_to_triangles(const std::vector<vec4i>& quads);
+void quads_to_triangles(
+    std::vector<vec3i>& triangles, const std::vector<vec4i>& quads);
 // Convert triangles to quads by creating degenerate quads
 std::vector<vec4i> triangles_to_quads(const std::vector<vec3i>& triangles);
+void triangles_to_quads(
+    std::vector<vec4i>& quads, const std::vector<vec3i>& triangles);
 // Convert beziers to lines using 3 lines for each bezier.
 std::vector<vec4i> bezier_to_lines(std::vector<vec2i>& lines);
 
@@ -486,6 +621,13 @@ split_facevarying(const std::vector<vec4i>& quadspos,
     const std::vector<vec4i>&               quadstexcoord,
     const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
     const std::vector<vec2f>& texcoords);
+void split_facevarying(std::vector<vec4i>& split_quads,
+    std::vector<vec3f>& split_positions, std::vector<vec3f>& split_normals,
+    std::vector<vec2f>& split_texcoords, const std::vector<vec4i>& quadspos,
+    const std::vector<vec4i>& quadsnorm,
+    const std::vector<vec4i>& quadstexcoord,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<vec2f>& texcoords);
 
 // Split primitives per id
 std::vector<std::vector<vec2i>> ungroup_lines(
@@ -494,6 +636,12 @@ std::vector<std::vector<vec3i>> ungroup_triangles(
     const std::vector<vec3i>& triangles, const std::vector<int>& ids);
 std::vector<std::vector<vec4i>> ungroup_quads(
     const std::vector<vec4i>& quads, const std::vector<int>& ids);
+void ungroup_lines(std::vector<std::vector<vec2i>>& split_lines,
+    const std::vector<vec2i>& lines, const std::vector<int>& ids);
+void ungroup_triangles(std::vector<std::vector<vec3i>>& split_triangles,
+    const std::vector<vec3i>& triangles, const std::vector<int>& ids);
+void ungroup_quads(std::vector<std::vector<vec4i>>& split_quads,
+    const std::vector<vec4i>& quads, const std::vector<int>& ids);
 
 // Weld vertices within a threshold.
 std::pair<std::vector<vec3f>, std::vector<int>> weld_vertices(
@@ -509,7 +657,7 @@ std::pair<std::vector<vec4i>, std::vector<vec3f>> weld_quads(
 void merge_lines(std::vector<vec2i>& lines,
     const std::vector<vec2i>& merge_lines, int num_verts);
 void merge_triangles(std::vector<vec3i>& triangles,
-    const std::vector<vec2i>& merge_triangles, int num_verts);
+    const std::vector<vec3i>& merge_triangles, int num_verts);
 void merge_quads(std::vector<vec4i>& quads,
     const std::vector<vec4i>& merge_quads, int num_verts);
 void merge_lines(std::vector<vec2i>& lines, std::vector<vec3f>& positions,
@@ -521,7 +669,7 @@ void merge_lines(std::vector<vec2i>& lines, std::vector<vec3f>& positions,
     const std::vector<float>& merge_radius);
 void merge_triangles(std::vector<vec3i>& triangles,
     std::vector<vec3f>& positions, std::vector<vec3f>& normals,
-    std::vector<vec2f>& texcoords, const std::vector<vec2i>& merge_triangles,
+    std::vector<vec2f>& texcoords, const std::vector<vec3i>& merge_triangles,
     const std::vector<vec3f>& merge_positions,
     const std::vector<vec3f>& merge_normals,
     const std::vector<vec2f>& merge_texturecoords);
@@ -603,6 +751,123 @@ std::pair<std::vector<vec4i>, std::vector<vec4f>> subdivide_catmullclark(
     const std::vector<vec4i>& quads, const std::vector<vec4f>& vert, int level,
     bool lock_boundary = false);
 
+// Sparse weights from the vertices of a subdivision step to the next.
+// Vertex `i` of the next step is the sum of the vertices in `indices`
+// times `weights`, from `offsets[i]` to `offsets[i+1]`.
+struct subdivision_level {
+  std::vector<int>   offsets = {};
+  std::vector<int>   indices = {};
+  std::vector<float> weights = {};
+};
+
+// Subdivision precomputed from the topology of a mesh, as the subdivided
+// elements and the weights of each step. Catmull-Clark uses two steps per
+// level, that split faces and then smooth vertices. Vertex data are
+// subdivided with apply_subdivision(), so that they can be updated, e.g.
+// when animated, without recomputing the topology.
+struct subdivision_stencils {
+  std::vector<vec3i>             triangles    = {};
+  std::vector<vec4i>             quads        = {};
+  int                            num_vertices = 0;
+  std::vector<subdivision_level> steps        = {};
+};
+
+// Make the stencils of subdivide_triangles(), subdivide_quads() and
+// subdivide_catmullclark(). Stencils are built in parallel.
+subdivision_stencils make_triangles_stencils(
+    const std::vector<vec3i>& triangles, int num_vertices, int level);
+subdivision_stencils make_quads_stencils(
+    const std::vector<vec4i>& quads, int num_vertices, int level);
+subdivision_stencils make_catmullclark_stencils(const std::vector<vec4i>& quads,
+    int num_vertices, int level, bool lock_boundary = false);
+
+// Subdivide vertex data with precomputed stencils. Throws std::out_of_range
+// if the number of vertices does not match the stencils.
+std::vector<float> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<float>& vert);
+std::vector<vec2f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec2f>& vert);
+std::vector<vec3f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec3f>& vert);
+std::vector<vec4f> apply_subdivision(
+    const subdivision_stencils& stencils, const std::vector<vec4f>& vert);
+
+}  // namespace yocto::shape
+
+// -----------------------------------------------------------------------------
+// SHAPE SIMPLIFICATION
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Simplify triangles by collapsing edges in order of quadric error
+// [Garland and Heckbert 1997], until at most `num_triangles` remain or the
+// next collapse has an error larger than `max_error`, measured as the sum of
+// squared distances from the planes of the collapsed faces. Vertices are
+// placed along the collapsed edges, so that normals, texcoords and colors
+// are interpolated with positions. Boundaries, and so texture seams, are
+// preserved, collapses that would flip faces or make the mesh non-manifold
+// are skipped, and vertices on non-manifold edges are kept. Vertex arrays
+// that are empty are ignored. Throws std::out_of_range if their sizes
+// differ from positions.
+void simplify_triangles(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, std::vector<vec3f>& colors,
+    int num_triangles, float max_error = flt_max);
+std::pair<std::vector<vec3i>, std::vector<vec3f>> simplify_triangles(
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    int num_triangles, float max_error = flt_max);
+
+}  // namespace yocto::shape
+
+// -----------------------------------------------------------------------------
+// SHAPE REORDERING
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Reorder elements in place for memory locality. Elements are sorted along a
+// Morton curve of their centers, and vertices are renumbered in order of
+// first use, with unused ones kept at the end. With `vertex_cache`,
+// triangles are then reordered for a post-transform cache of `cache_size`
+// vertices [Forsyth 2006], continuing along the Morton curve when the cache
+// has no candidates. Returns, for each new vertex, its old index, that is
+// used to reorder vertex data with `reorder_vertices()`.
+std::vector<int> reorder_points(
+    std::vector<int>& points, const std::vector<vec3f>& positions);
+std::vector<int> reorder_lines(
+    std::vector<vec2i>& lines, const std::vector<vec3f>& positions);
+std::vector<int> reorder_triangles(std::vector<vec3i>& triangles,
+    const std::vector<vec3f>& positions, bool vertex_cache = false,
+    int cache_size = 32);
+std::vector<int> reorder_quads(
+    std::vector<vec4i>& quads, const std::vector<vec3f>& positions);
+
+// Reorder vertex data with the vertex map returned by the functions above.
+// Empty arrays are left empty. Throws std::out_of_range if their size differs
+// from the map.
+void reorder_vertices(std::vector<float>& vert, const std::vector<int>& map);
+void reorder_vertices(std::vector<vec2f>& vert, const std::vector<int>& map);
+void reorder_vertices(std::vector<vec3f>& vert, const std::vector<int>& map);
+void reorder_vertices(std::vector<vec4f>& vert, const std::vector<int>& map);
+
+}  // namespace yocto::shape
+
+// -----------------------------------------------------------------------------
+// SHAPE DISTANCE FIELDS
+// -----------------------------------------------------------------------------
+namespace yocto::shape {
+
+// Compute the signed distance field of a closed triangle mesh at the centers
+// of cubic voxels. The grid covers the mesh bounds, padded by `band` voxels,
+// with `resolution` voxels along the largest axis, and its size and bounds
+// are returned in `size` and `bbox`. Distances are stored in x-major order,
+// as in image::volume, and are negative inside the mesh, as found by the
+// majority of ray parities along the three axes. Distances within `band`
+// voxels of the surface are exact, and are approximated in the rest of the
+// grid by fast sweeping, or clamped to the band if `narrow_band` is set.
+void make_sdf(std::vector<float>& distances, vec3i& size, bbox3f& bbox,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    int resolution, int band = 2, bool narrow_band = false);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -636,7 +901,9 @@ std::vector<float>    sample_quads_cdf(
        const std::vector<vec4i>& quads, const std::vector<vec3f>& positions);
 
 // Samples a set of points over a triangle/quad mesh uniformly. Returns pos,
-// norm and texcoord of the sampled points.
+// norm and texcoord of the sampled points. Points are sampled in parallel,
+// with a random stream per chunk of points, so that they do not depend on
+// the number of threads.
 void sample_triangles(std::vector<vec3f>& sampled_positions,
     std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
     const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
@@ -648,6 +915,22 @@ void sample_quads(std::vector<vec3f>& sampled_positions,
     const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
     int npoints, int seed = 7);
 
+// Samples a set of points over a triangle/quad mesh with a Poisson-disk
+// distribution, so that no two points are closer than `radius`. Uniform
+// candidates are thinned by dart throwing over a grid, in parallel and
+// deterministically for a given seed. Returns as many points as fit, about
+// `0.6 * area / radius^2`, with pos, norm and texcoord as above.
+void sample_triangles_poisson(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec3i>& triangles, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    float radius, int seed = 7);
+void sample_quads_poisson(std::vector<vec3f>& sampled_positions,
+    std::vector<vec3f>& sampled_normals, std::vector<vec2f>& sampled_texcoords,
+    const std::vector<vec4i>& quads, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec2f>& texcoords,
+    float radius, int seed = 7);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -655,18 +938,15 @@ void sample_quads(std::vector<vec3f>& sampled_positions,
 // -----------------------------------------------------------------------------
 namespace yocto::shape {
 
-// Data structure used for geodesic computation
+// Data structure used for geodesic computation. The arcs leaving node `n`
+// are `graph` from `offsets[n]` to `offsets[n+1]`.
 struct geodesic_solver {
-  static const int min_arcs = 12;
   struct graph_edge {
     int   node   = -1;
     float length = flt_max;
   };
-#ifdef YOCTO_ABSEIL
-  std::vector<short_vector<adjancency_list, min_arcs>> graph = {};
-#else
-  std::vector<std::vector<graph_edge>> graph = {};
-#endif
+  std::vector<int>        offsets = {};
+  std::vector<graph_edge> graph   = {};
 };
 
 // Construct a a graph to compute geodesic distances
@@ -693,10 +973,17 @@ std::vector<int> compute_geodesic_paths(const geodesic_solver& solver,
 std::vector<int> sample_vertices_poisson(
     const geodesic_solver& solver, int num_samples);
 
-// Compute the distance field needed to compute a voronoi diagram
+// Compute the distance field needed to compute a voronoi diagram. This
+// stores one field per generator; prefer compute_voronoi_labels() when only
+// the diagram is needed.
 std::vector<std::vector<float>> compute_voronoi_fields(
     const geodesic_solver& solver, const std::vector<int>& generators);
 
+// Compute a voronoi diagram in a single search from all generators, as the
+// index of the closest generator of each vertex and its distance.
+std::pair<std::vector<int>, std::vector<float>> compute_voronoi_labels(
+    const geodesic_solver& solver, const std::vector<int>& generators);
+
 // Convert distances to colors
 std::vector<vec3f> colors_from_field(const std::vector<float>& field,
     float scale = 1, const vec3f& c0 = {1, 1, 1},
@@ -956,6 +1243,23 @@ void make_heightfield(std::vector<vec4i>& quads, std::vector<vec3f>& positions,
     std::vector<vec3f>& normals, std::vector<vec2f>& texcoords,
     const vec2i& size, const std::vector<float>& height);
 
+// Make an adaptive heightfield mesh, that deviates at most max_error in height
+// from the full resolution one, using a right-triangulated irregular network.
+void make_heightfield(std::vector<vec3i>& triangles,
+    std::vector<vec3f>& positions, std::vector<vec3f>& normals,
+    std::vector<vec2f>& texcoords, const vec2i& size,
+    const std::vector<float>& height, float max_error);
+
+// Make an adaptive heightfield split into tiles of tile_size pixels, returned
+// in row-major order. Tiles are simplified independently, so each one hangs
+// skirts of the given depth from its border to hide cracks between tiles.
+void make_heightfield_tiles(std::vector<std::vector<vec3i>>& triangles,
+    std::vector<std::vector<vec3f>>&                          positions,
+    std::vector<std::vector<vec3f>>&                          normals,
+    std::vector<std::vector<vec2f>>& texcoords, const vec2i& size,
+    const std::vector<float>& height, float max_error, int tile_size,
+    float skirt);
+
 }  // namespace yocto::shape
 
 // -----------------------------------------------------------------------------
@@ -969,6 +1273,16 @@ void meandering_triangles(const std::vector<float>& field, float isoline,
     std::vector<int>& tags, std::vector<vec3f>& positions,
     std::vector<vec3f>& normals);
 
+// Slice a mesh along the isolines of a scalar field in a single pass.
+// Isolines are sorted in increasing order. Triangles are tagged with the band
+// they lie in, from 0 below the first isoline to isolines.size() above the
+// last. Cut vertices are appended to positions and, if present, normals.
+void slice_triangles(std::vector<vec3i>& split_triangles,
+    std::vector<int>& split_tags, std::vector<vec3f>& split_positions,
+    std::vector<vec3f>& split_normals, const std::vector<vec3i>& triangles,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<float>& field, const std::vector<float>& isolines);
+
 }  // namespace yocto::shape
 
 #endif
@@ -28,23 +28,49 @@
 
 #include "yocto_trace.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cstdio>
 #include <cstring>
 #include <deque>
 #include <future>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "ext/filesystem.hpp"
+#include "yocto_common.h"
+#include "yocto_shape.h"
+namespace sfs = ghc::filesystem;
 using namespace std::string_literals;
 
 #ifdef YOCTO_EMBREE
 #include <embree3/rtcore.h>
 #endif
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // ALIASES
 // -----------------------------------------------------------------------------
 namespace yocto::trace {
 
+// Namespace aliases
+namespace yshp = yocto::shape;
+
+// Bvh builder shared with Yocto/Shape
+using yshp::bvh_max_prims;
+using yshp::bvh_primitive;
+
 // import math symbols for use
 using math::abs;
 using math::acos;
@@ -52,26 +78,46 @@ using math::atan2;
 using math::clamp;
 using math::cos;
 using math::exp;
+using math::float_to_half;
+using math::flt_eps;
 using math::flt_max;
 using math::fmod;
 using math::fresnel_conductor;
 using math::fresnel_dielectric;
+using math::half_to_float;
+using math::hash_rng;
 using math::identity3x3f;
 using math::invalidb3f;
+using math::lanemask;
+using math::lerp;
 using math::log;
+using math::log2;
+using math::make_discrete_alias;
+using math::make_lanemask;
 using math::make_rng;
+using math::make_rng_key;
+using math::mat3f;
 using math::max;
 using math::min;
 using math::pif;
 using math::pow;
+using math::ray3fl;
+using math::rand1f;
+using math::rand2f;
+using math::ray_eps;
 using math::rng_state;
+using math::rotation_frame;
+using math::sample_discrete_alias;
 using math::sample_discrete_cdf;
 using math::sample_discrete_cdf_pdf;
 using math::sample_uniform;
 using math::sample_uniform_pdf;
+using math::scaling_frame;
 using math::sign;
 using math::sin;
 using math::sqrt;
+using math::vec2fl;
+using math::vec3fl;
 using math::zero2f;
 using math::zero2i;
 using math::zero3f;
@@ -81,10 +127,250 @@ using math::zero4i;
 
 }  // namespace yocto::trace
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR STATISTICS
+// -----------------------------------------------------------------------------
+namespace yocto::trace {
+
+// Statistics counters, with times in nanoseconds
+enum struct trace_counter {
+  // clang-format off
+  rays, nodes, primitives, light_samples, samples, bvh_time, lights_time,
+  sample_time, intersect_time
+  // clang-format on
+};
+const auto trace_counters = 9;
+
+// Failed bvh cache writes, counted in all builds since they are rare and
+// otherwise leave the cache empty without notice
+static auto cache_failures = std::atomic<uint64_t>{0};
+
+#ifdef YOCTO_STATS
+
+// Counters of a thread, registered globally to be summed. Only their thread
+// writes them, so relaxed loads and stores avoid locked increments.
+struct thread_counters {
+  std::array<std::atomic<uint64_t>, trace_counters> values = {};
+};
+static auto counters_mutex = std::mutex{};
+static auto counters_list  = std::deque<thread_counters>{};
+
+// Get the counters of the current thread
+static thread_counters& get_thread_counters() {
+  thread_local thread_counters* counters = nullptr;
+  if (!counters) {
+    auto lock = std::lock_guard{counters_mutex};
+    counters  = &counters_list.emplace_back();
+  }
+  return *counters;
+}
+
+// Add to a counter
+static void add_counter(trace_counter counter, uint64_t value = 1) {
+  auto& count = get_thread_counters().values[(int)counter];
+  count.store(count.load(std::memory_order_relaxed) + value,
+      std::memory_order_relaxed);
+}
+
+// Time for timers
+static int64_t get_counter_time() { return common::get_time(); }
+
+trace_stats get_trace_stats() {
+  auto values = std::array<uint64_t, trace_counters>{};
+  {
+    auto lock = std::lock_guard{counters_mutex};
+    for (auto& counters : counters_list) {
+      for (auto idx = 0; idx < trace_counters; idx++)
+        values[idx] += counters.values[idx].load(std::memory_order_relaxed);
+    }
+  }
+  auto get = [&values](trace_counter counter) {
+    return values[(int)counter];
+  };
+  auto stats           = trace_stats{};
+  stats.rays           = get(trace_counter::rays);
+  stats.nodes          = get(trace_counter::nodes);
+  stats.primitives     = get(trace_counter::primitives);
+  stats.light_samples  = get(trace_counter::light_samples);
+  stats.samples        = get(trace_counter::samples);
+  stats.bvh_time       = get(trace_counter::bvh_time) / 1e9;
+  stats.lights_time    = get(trace_counter::lights_time) / 1e9;
+  stats.sample_time    = get(trace_counter::sample_time) / 1e9;
+  stats.intersect_time = get(trace_counter::intersect_time) / 1e9;
+  stats.cache_failures = cache_failures;
+  return stats;
+}
+
+void reset_trace_stats() {
+  auto lock = std::lock_guard{counters_mutex};
+  for (auto& counters : counters_list) {
+    for (auto& value : counters.values)
+      value.store(0, std::memory_order_relaxed);
+  }
+  cache_failures = 0;
+}
+
+#else
+
+// Counters are compiled out
+static void    add_counter(trace_counter counter, uint64_t value = 1) {}
+static int64_t get_counter_time() { return 0; }
+
+trace_stats get_trace_stats() {
+  auto stats           = trace_stats{};
+  stats.cache_failures = cache_failures;
+  return stats;
+}
+void reset_trace_stats() { cache_failures = 0; }
+
+#endif
+
+// Add the duration of a scope to a time counter
+struct counter_timer {
+  trace_counter counter = trace_counter::sample_time;
+  int64_t       start   = get_counter_time();
+  ~counter_timer() { add_counter(counter, get_counter_time() - start); }
+};
+
+}  // namespace yocto::trace
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR PATH TRACING SUPPORT FUNCTIONS
 // -----------------------------------------------------------------------------
-namespace yocto::trace {}  // namespace yocto::trace
+namespace yocto::trace {
+
+// Number of Sobol dimensions. Later dimensions are padded with shuffled
+// two dimensional samples.
+static const auto sobol_dimensions = 16;
+
+// Sobol generator matrices, from the direction numbers of Joe and Kuo in
+// https://web.maths.unsw.edu.au/~fkuo/sobol/
+using sobol_matrices = std::array<std::array<uint32_t, 32>, sobol_dimensions>;
+static const sobol_matrices& get_sobol_matrices() {
+  static const auto matrices = [] {
+    struct direction_numbers {
+      int                     s = 0, a = 0;
+      std::array<uint32_t, 6> m = {};
+    };
+    // clang-format off
+    static const auto directions = std::array<direction_numbers, 15>{{
+        {1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}, {3, 2, {1, 1, 1}},
+        {4, 1, {1, 1, 3, 3}}, {4, 4, {1, 3, 5, 13}}, {5, 2, {1, 1, 5, 5, 17}},
+        {5, 4, {1, 1, 5, 5, 5}}, {5, 7, {1, 1, 7, 11, 19}},
+        {5, 11, {1, 1, 5, 1, 1}}, {5, 13, {1, 1, 1, 3, 11}},
+        {5, 14, {1, 3, 5, 5, 31}}, {6, 1, {1, 3, 3, 9, 7, 49}},
+        {6, 13, {1, 1, 1, 15, 21, 21}}, {6, 16, {1, 3, 1, 13, 27, 49}}}};
+    // clang-format on
+    auto matrices = sobol_matrices{};
+    for (auto bit = 0; bit < 32; bit++) matrices[0][bit] = 1u << (31 - bit);
+    for (auto dim = 1; dim < sobol_dimensions; dim++) {
+      auto& [s, a, m] = directions[dim - 1];
+      auto& v         = matrices[dim];
+      for (auto bit = 0; bit < s; bit++) v[bit] = m[bit] << (31 - bit);
+      for (auto bit = s; bit < 32; bit++) {
+        v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+        for (auto k = 1; k < s; k++)
+          if ((a >> (s - 1 - k)) & 1) v[bit] ^= v[bit - k];
+      }
+    }
+    return matrices;
+  }();
+  return matrices;
+}
+
+// Sobol sample of an index along a dimension, as fixed point.
+static uint32_t sample_sobol(uint32_t index, int dim) {
+  auto& matrix = get_sobol_matrices()[dim];
+  auto  result = 0u;
+  for (auto bit = 0; index != 0; index >>= 1, bit++)
+    if (index & 1) result ^= matrix[bit];
+  return result;
+}
+
+// Owen scrambling of a fixed point number, implemented with the hash of
+// Burley, "Practical Hash-based Owen Scrambling", JCGT 2020. Applied to
+// sample indices, it shuffles sequences.
+static uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+// Mix the bits of a 64 bit hash.
+static uint64_t mix_bits(uint64_t hash) {
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
+}
+static uint32_t hash_dimension(uint32_t seed, int dim) {
+  return (uint32_t)mix_bits(((uint64_t)seed << 32) | (uint32_t)dim);
+}
+
+// Fixed point to float in [0,1).
+static float fixed_to_float(uint32_t x) { return (x >> 8) * 0x1p-24f; }
+
+// Random numbers of a sample. Random sequences draw from the pcg stream,
+// or, when `compact`, hash the sample key with the dimension, while
+// low-discrepancy sequences evaluate the scrambled sample at `index`
+// along the next dimensions. Sobol uses its dimensions in order, with a
+// shuffle shared by all of them. Pmj02 pairs the first two dimensions,
+// that form a progressive multi-jittered (0,2) sequence when scrambled,
+// and shuffles them for each pair.
+struct sampler_state {
+  rng_state     rng       = {};
+  uint64_t      key       = 0;
+  bool          compact   = false;
+  sequence_type sequence  = sequence_type::random;
+  uint32_t      index     = 0;
+  uint32_t      seed      = 0;
+  int           dimension = 0;
+};
+
+// Scrambled (0,2) sample for a dimension pair.
+static vec2f sample_pmj02(const sampler_state& rng, int dim) {
+  auto seed  = hash_dimension(rng.seed, dim);
+  auto index = owen_scramble(rng.index, seed);
+  return {fixed_to_float(owen_scramble(sample_sobol(index, 0), seed ^ 1)),
+      fixed_to_float(owen_scramble(sample_sobol(index, 1), seed ^ 2))};
+}
+// Scrambled Sobol sample for a dimension.
+static float sample_sobol(const sampler_state& rng, int dim) {
+  auto index = owen_scramble(rng.index, rng.seed);
+  return fixed_to_float(
+      owen_scramble(sample_sobol(index, dim), hash_dimension(rng.seed, dim)));
+}
+
+// Next random numbers of a sample.
+static float rand1f(sampler_state& rng) {
+  if (rng.sequence == sequence_type::random)
+    return rng.compact ? rand1f(rng.key, rng.dimension++) : rand1f(rng.rng);
+  auto dim = rng.dimension++;
+  if (rng.sequence == sequence_type::sobol && dim < sobol_dimensions)
+    return sample_sobol(rng, dim);
+  return sample_pmj02(rng, dim).x;
+}
+static vec2f rand2f(sampler_state& rng) {
+  if (rng.sequence == sequence_type::random)
+    return rng.compact ? rand2f(rng.key, rng.dimension++) : rand2f(rng.rng);
+  auto dim = rng.dimension;
+  rng.dimension += 2;
+  if (rng.sequence == sequence_type::sobol && dim + 1 < sobol_dimensions)
+    return {sample_sobol(rng, dim), sample_sobol(rng, dim + 1)};
+  return sample_pmj02(rng, dim);
+}
+
+}  // namespace yocto::trace
 
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR SCENE EVALUATION
@@ -95,13 +381,148 @@ namespace yocto::trace {
 static const auto coat_ior       = 1.5f;
 static const auto coat_roughness = 0.03f * 0.03f;
 
+// Instance frame at a given time, interpolating linearly between the
+// keyframes. Still instances, and time zero, return the first key.
+static frame3f eval_instance_frame(
+    const trc::object* object, int instance, float time) {
+  auto& frames = object->instance->frames;
+  auto& motion = object->instance->motion;
+  if (motion.empty() || time <= 0) return frames[instance] * object->frame;
+  auto  keyt   = min(time, 1.0f) * motion.size();
+  auto  key    = min((int)keyt, (int)motion.size() - 1);
+  auto  u      = keyt - key;
+  auto& a      = key == 0 ? frames[instance] : motion[key - 1][instance];
+  auto& b      = motion[key][instance];
+  auto  frame  = frame3f{lerp(a.x, b.x, u), lerp(a.y, b.y, u),
+      lerp(a.z, b.z, u), lerp(a.o, b.o, u)};
+  return frame * object->frame;
+}
+
+// Instance bounds over the whole time interval. Since frames are linearly
+// interpolated, the bounds at the keyframes enclose the motion.
+static bbox3f eval_instance_bounds(
+    const trc::object* object, int instance, const bbox3f& bbox) {
+  auto& motion = object->instance->motion;
+  auto  bounds = transform_bbox(eval_instance_frame(object, instance, 0), bbox);
+  for (auto& frames : motion) {
+    bounds = merge(
+        bounds, transform_bbox(frames[instance] * object->frame, bbox));
+  }
+  return bounds;
+}
+
+// Whether an object instance was marked by prune_scene().
+static bool is_pruned(
+    const std::vector<std::vector<bool>>& pruned, int object, int instance) {
+  return object < pruned.size() && instance < pruned[object].size() &&
+         pruned[object][instance];
+}
+
+// Index of an object instance in the scene layout.
+static int get_layout_index(const trc::scene* scene, int object, int instance) {
+  return scene->layout.offsets[object] + instance;
+}
+
+// Instance frame from the scene layout. Only moving instances are evaluated.
+static frame3f eval_layout_frame(
+    const trc::scene* scene, int index, float time) {
+  auto& layout = scene->layout;
+  if (!layout.moving[index] || time <= 0) return layout.frames[index];
+  auto [object_id, instance_id] = layout.instances[index];
+  return eval_instance_frame(scene->objects[object_id], instance_id, time);
+}
+
+// Inverse instance frame from the scene layout.
+static frame3f eval_layout_inverse(
+    const trc::scene* scene, int index, float time, bool non_rigid_frames) {
+  auto& layout = scene->layout;
+  if (!layout.moving[index] || time <= 0) return layout.inv_frames[index];
+  return inverse(eval_layout_frame(scene, index, time), non_rigid_frames);
+}
+
+// Heightfield grid vertices of a cell, ordered as the quads of
+// make_heightfield. Cells are indexed in row-major order.
+static vec4i get_heightfield_quad(const trc::shape* shape, int element) {
+  auto width = shape->heightfield.size().x;
+  auto vid   = (element / (width - 1)) * width + element % (width - 1);
+  return {vid, vid + 1, vid + width + 1, vid + width};
+}
+
+// Heightfield vertex position and texcoord, computed as make_heightfield
+// does, so that the grid matches its mesh exactly.
+static vec3f get_heightfield_position(const trc::shape* shape, int vid) {
+  auto size  = shape->heightfield.size();
+  auto scale = vec2f{(float)size.x, (float)size.y} / max(size);
+  auto uv    = vec2f{(vid % size.x) / (float)(size.x - 1),
+      (vid / size.x) / (float)(size.y - 1)};
+  return {(2 * uv.x - 1) * scale.x, shape->heightfield[vid],
+      -((2 * uv.y - 1) * scale.y)};
+}
+static vec2f get_heightfield_texcoord(const trc::shape* shape, int vid) {
+  auto size = shape->heightfield.size();
+  return {(vid % size.x) / (float)(size.x - 1),
+      1 - (vid / size.x) / (float)(size.y - 1)};
+}
+
+// Triangles and vertex data of triangle shapes, decoded for compressed
+// shapes as stored by compress_shape(). Vertex data of other shapes is
+// returned as is.
+static bool has_triangles(const trc::shape* shape) {
+  return !shape->triangles.empty() || !shape->ctriangles.empty();
+}
+static bool has_normals(const trc::shape* shape) {
+  return !shape->normals.empty() || !shape->cnormals.empty();
+}
+static bool has_texcoords(const trc::shape* shape) {
+  return !shape->texcoords.empty() || !shape->ctexcoords.empty();
+}
+static int get_num_triangles(const trc::shape* shape) {
+  return !shape->ctriangles.empty() ? (int)shape->ctriangles.size() / 3
+                                    : (int)shape->triangles.size();
+}
+static vec3i get_triangle(const trc::shape* shape, int element) {
+  if (shape->ctriangles.empty()) return shape->triangles[element];
+  auto t = &shape->ctriangles[element * 3];
+  return {(int)t[0], (int)t[1], (int)t[2]};
+}
+static vec3f get_position(const trc::shape* shape, int vid) {
+  if (shape->cpositions.empty()) return shape->positions[vid];
+  auto  p      = &shape->cpositions[vid * 3];
+  auto& bounds = shape->cbounds;
+  return bounds.min + vec3f{(float)p[0], (float)p[1], (float)p[2]} *
+                          ((bounds.max - bounds.min) * (1 / 65535.0f));
+}
+static vec3f get_normal(const trc::shape* shape, int vid) {
+  if (shape->cnormals.empty()) return shape->normals[vid];
+  auto e = &shape->cnormals[vid * 2];
+  auto o = vec2f{(float)e[0], (float)e[1]} * (2 / 65535.0f) - 1;
+  auto n = vec3f{o.x, o.y, 1 - abs(o.x) - abs(o.y)};
+  auto t = max(-n.z, 0.0f);
+  n.x += n.x >= 0 ? -t : t;
+  n.y += n.y >= 0 ? -t : t;
+  return normalize(n);
+}
+static vec2f get_texcoord(const trc::shape* shape, int vid) {
+  if (shape->ctexcoords.empty()) return shape->texcoords[vid];
+  return {half_to_float(shape->ctexcoords[vid * 2 + 0]),
+      half_to_float(shape->ctexcoords[vid * 2 + 1])};
+}
+
 // Shape element normal.
-static vec3f eval_normal(const trc::shape* shape, int element) {
+static vec3f eval_normal(
+    const trc::shape* shape, int element, const vec2f& uv = zero2f) {
+  if (!shape->element_normals.empty()) return shape->element_normals[element];
   auto norm = zero3f;
-  if (!shape->triangles.empty()) {
-    auto t = shape->triangles[element];
-    norm   = triangle_normal(
-        shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+  if (!shape->heightfield.empty()) {
+    auto q = get_heightfield_quad(shape, element);
+    norm   = quad_normal(get_heightfield_position(shape, q.x),
+        get_heightfield_position(shape, q.y),
+        get_heightfield_position(shape, q.z),
+        get_heightfield_position(shape, q.w));
+  } else if (has_triangles(shape)) {
+    auto t = get_triangle(shape, element);
+    norm   = triangle_normal(get_position(shape, t.x),
+        get_position(shape, t.y), get_position(shape, t.z));
   } else if (!shape->quads.empty()) {
     auto q = shape->quads[element];
     norm   = quad_normal(shape->positions[q.x], shape->positions[q.y],
@@ -109,6 +530,11 @@ static vec3f eval_normal(const trc::shape* shape, int element) {
   } else if (!shape->lines.empty()) {
     auto l = shape->lines[element];
     norm   = line_tangent(shape->positions[l.x], shape->positions[l.y]);
+  } else if (!shape->beziers.empty()) {
+    auto b = shape->beziers[element];
+    norm   = normalize(interpolate_bezier_derivative(shape->positions[b.x],
+        shape->positions[b.y], shape->positions[b.z], shape->positions[b.w],
+        uv.x));
   } else if (!shape->points.empty()) {
     norm = {0, 0, 1};
   } else {
@@ -121,16 +547,32 @@ static vec3f eval_normal(const trc::shape* shape, int element) {
 // Shape element normal.
 static std::pair<vec3f, vec3f> eval_tangents(
     const trc::shape* shape, int element, const vec2f& uv) {
-  if (!shape->triangles.empty()) {
-    auto t = shape->triangles[element];
-    if (shape->texcoords.empty()) {
-      return triangle_tangents_fromuv(shape->positions[t.x],
-          shape->positions[t.y], shape->positions[t.z], {0, 0}, {1, 0}, {0, 1});
+  if (!shape->element_tangents.empty()) {
+    if (shape->quads.empty()) return shape->element_tangents[element];
+    return shape->element_tangents[element * 2 + (uv.x + uv.y > 1 ? 1 : 0)];
+  }
+  if (has_triangles(shape)) {
+    auto t = get_triangle(shape, element);
+    if (!has_texcoords(shape)) {
+      return triangle_tangents_fromuv(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z), {0, 0}, {1, 0},
+          {0, 1});
     } else {
-      return triangle_tangents_fromuv(shape->positions[t.x],
-          shape->positions[t.y], shape->positions[t.z], shape->texcoords[t.x],
-          shape->texcoords[t.y], shape->texcoords[t.z]);
+      return triangle_tangents_fromuv(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z),
+          get_texcoord(shape, t.x), get_texcoord(shape, t.y),
+          get_texcoord(shape, t.z));
     }
+  } else if (!shape->heightfield.empty()) {
+    auto q = get_heightfield_quad(shape, element);
+    return quad_tangents_fromuv(get_heightfield_position(shape, q.x),
+        get_heightfield_position(shape, q.y),
+        get_heightfield_position(shape, q.z),
+        get_heightfield_position(shape, q.w),
+        get_heightfield_texcoord(shape, q.x),
+        get_heightfield_texcoord(shape, q.y),
+        get_heightfield_texcoord(shape, q.z),
+        get_heightfield_texcoord(shape, q.w), uv);
   } else if (!shape->quads.empty()) {
     auto q = shape->quads[element];
     if (shape->texcoords.empty()) {
@@ -153,8 +595,11 @@ template <typename T>
 static T eval_shape(const trc::shape* shape, const std::vector<T>& vals,
     int element, const vec2f& uv, const T& def) {
   if (vals.empty()) return def;
-  if (!shape->triangles.empty()) {
-    auto t = shape->triangles[element];
+  if (!shape->heightfield.empty()) {
+    auto q = get_heightfield_quad(shape, element);
+    return interpolate_quad(vals[q.x], vals[q.y], vals[q.z], vals[q.w], uv);
+  } else if (has_triangles(shape)) {
+    auto t = get_triangle(shape, element);
     return interpolate_triangle(vals[t.x], vals[t.y], vals[t.z], uv);
   } else if (!shape->quads.empty()) {
     auto q = shape->quads[element];
@@ -164,6 +609,9 @@ static T eval_shape(const trc::shape* shape, const std::vector<T>& vals,
   } else if (!shape->lines.empty()) {
     auto l = shape->lines[element];
     return interpolate_line(vals[l.x], vals[l.y], uv.x);
+  } else if (!shape->beziers.empty()) {
+    auto b = shape->beziers[element];
+    return interpolate_bezier(vals[b.x], vals[b.y], vals[b.z], vals[b.w], uv.x);
   } else if (!shape->points.empty()) {
     return vals[shape->points[element]];
   } else {
@@ -171,35 +619,257 @@ static T eval_shape(const trc::shape* shape, const std::vector<T>& vals,
   }
 }
 
+// Shape element position, shading normal and texcoord, computed for
+// heightfields and decoded for compressed shapes.
+static vec3f eval_position(
+    const trc::shape* shape, int element, const vec2f& uv) {
+  if (!shape->cpositions.empty()) {
+    auto t = get_triangle(shape, element);
+    return interpolate_triangle(get_position(shape, t.x),
+        get_position(shape, t.y), get_position(shape, t.z), uv);
+  }
+  if (shape->heightfield.empty())
+    return eval_shape(shape, shape->positions, element, uv, zero3f);
+  auto q = get_heightfield_quad(shape, element);
+  return interpolate_quad(get_heightfield_position(shape, q.x),
+      get_heightfield_position(shape, q.y),
+      get_heightfield_position(shape, q.z),
+      get_heightfield_position(shape, q.w), uv);
+}
+static vec3f eval_shading_normal(const trc::shape* shape, int element,
+    const vec2f& uv, const vec3f& gnormal) {
+  if (shape->cnormals.empty())
+    return eval_shape(shape, shape->normals, element, uv, gnormal);
+  auto t = get_triangle(shape, element);
+  return interpolate_triangle(get_normal(shape, t.x), get_normal(shape, t.y),
+      get_normal(shape, t.z), uv);
+}
+static vec2f eval_texcoord(
+    const trc::shape* shape, int element, const vec2f& uv) {
+  if (!shape->ctexcoords.empty()) {
+    auto t = get_triangle(shape, element);
+    return interpolate_triangle(get_texcoord(shape, t.x),
+        get_texcoord(shape, t.y), get_texcoord(shape, t.z), uv);
+  }
+  if (shape->heightfield.empty() || !shape->texcoords.empty())
+    return eval_shape(shape, shape->texcoords, element, uv, uv);
+  auto q = get_heightfield_quad(shape, element);
+  return interpolate_quad(get_heightfield_texcoord(shape, q.x),
+      get_heightfield_texcoord(shape, q.y),
+      get_heightfield_texcoord(shape, q.z),
+      get_heightfield_texcoord(shape, q.w), uv);
+}
+
+// Tiled textures are split into square tiles of texture_tile texels, padded
+// at the image edges. Each thread keeps the last tiles it used in a small
+// direct mapped cache, to avoid locking the shared cache at every lookup.
+static const auto texture_tile       = 64;
+static const auto texture_microcache = 16;
+
+// Texture tiles cached in memory, indexed by texture id, level and tile.
+// Tiles are shared, so that evicted tiles stay valid for the threads that
+// still hold them.
+using texture_tile_data = std::shared_ptr<const std::vector<byte>>;
+struct texture_cache {
+  size_t              budget = (size_t)1 << 30;
+  size_t              used   = 0;
+  std::mutex          mutex  = {};
+  std::list<uint64_t> lru    = {};  // most recently used first
+  std::unordered_map<uint64_t,
+      std::pair<texture_tile_data, std::list<uint64_t>::iterator>>
+      tiles = {};
+};
+
+// Size in bytes of a texture tile
+static size_t get_tile_bytes(const trc::texture* texture) {
+  return (size_t)texture_tile * (size_t)texture_tile *
+         (size_t)texture->tiled_channels * (texture->tiled_ldr ? 1 : 4);
+}
+
+// Read a texture tile from disk. Tiles that cannot be read are left black,
+// and are cached as such to avoid reading them again.
+static texture_tile_data read_texture_tile(
+    const trc::texture* texture, int level, int tile) {
+  auto tile_bytes = get_tile_bytes(texture);
+  auto data       = std::make_shared<std::vector<byte>>(tile_bytes, (byte)0);
+  auto fs         = fopen(texture->tiled.c_str(), "rb");
+  if (!fs) return data;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto offset   = texture->tiled_offsets[level] + (uint64_t)tile * tile_bytes;
+#ifdef _WIN32
+  if (_fseeki64(fs, (int64_t)offset, SEEK_SET) != 0) return data;
+#else
+  if (fseeko(fs, (off_t)offset, SEEK_SET) != 0) return data;
+#endif
+  if (fread(data->data(), tile_bytes, 1, fs) != 1)
+    std::fill(data->begin(), data->end(), (byte)0);
+  return data;
+}
+
+// Get a texture tile, loading it in the cache if needed.
+static const byte* get_texture_tile(
+    const trc::texture* texture, int level, const vec2i& tile_ij) {
+  auto tiles = (texture->tiled_sizes[level].x + texture_tile - 1) /
+               texture_tile;
+  auto tile = tile_ij.y * tiles + tile_ij.x;
+  auto key  = (texture->tiled_id << 40) | ((uint64_t)level << 32) |
+             (uint64_t)tile;
+
+  // lookup the thread cache
+  struct micro_entry {
+    uint64_t          key  = 0;
+    texture_tile_data data = {};
+  };
+  thread_local auto micro = std::array<micro_entry, texture_microcache>{};
+  auto&             entry = micro[mix_bits(key) % texture_microcache];
+  if (entry.key == key) return entry.data->data();
+
+  // lookup the shared cache, loading the tile without holding the lock
+  auto cache = texture->tiled_cache;
+  auto data  = texture_tile_data{};
+  auto find  = [cache, key, &data]() {
+    auto it = cache->tiles.find(key);
+    if (it == cache->tiles.end()) return false;
+    cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+    data = it->second.first;
+    return true;
+  };
+  {
+    auto lock = std::lock_guard{cache->mutex};
+    find();
+  }
+  if (!data) {
+    auto loaded = read_texture_tile(texture, level, tile);
+    auto lock   = std::lock_guard{cache->mutex};
+    if (!find()) {
+      data = loaded;
+      cache->lru.push_front(key);
+      cache->tiles[key] = {data, cache->lru.begin()};
+      cache->used += data->size();
+      while (cache->used > cache->budget && cache->lru.size() > 1) {
+        auto evicted = cache->tiles.find(cache->lru.back());
+        cache->used -= evicted->second.first->size();
+        cache->tiles.erase(evicted);
+        cache->lru.pop_back();
+      }
+    }
+  }
+  entry = {key, data};
+  return entry.data->data();
+}
+
+// Lookup a texel of a tiled texture
+static vec3f lookup_tiled_texture(const trc::texture* texture,
+    const vec2i& ij, bool ldr_as_linear, int level) {
+  auto tile   = get_texture_tile(texture, level, ij / texture_tile);
+  auto texel  = (ij.y % texture_tile) * texture_tile + ij.x % texture_tile;
+  auto offset = texel * texture->tiled_channels;
+  if (texture->tiled_ldr) {
+    auto value = texture->tiled_channels == 3
+                     ? vec3b{tile[offset], tile[offset + 1], tile[offset + 2]}
+                     : vec3b{tile[offset]};
+    return ldr_as_linear ? byte_to_float(value)
+                         : srgb_to_rgb(byte_to_float(value));
+  } else {
+    auto value = vec3f{};
+    memcpy(&value, tile + offset * sizeof(float),
+        texture->tiled_channels * sizeof(float));
+    return texture->tiled_channels == 3 ? value : vec3f{value.x};
+  }
+}
+
 // Check texture size
-static vec2i texture_size(const trc::texture* texture) {
+static vec2i texture_size(const trc::texture* texture, int level = 0) {
   if (!texture->colorf.empty()) {
-    return texture->colorf.size();
+    return level ? texture->colorf_mips[level - 1].size()
+                 : texture->colorf.size();
+  } else if (!texture->colorh.empty()) {
+    return level ? texture->colorh_mips[level - 1].size()
+                 : texture->colorh.size();
   } else if (!texture->colorb.empty()) {
-    return texture->colorb.size();
+    return level ? texture->colorb_mips[level - 1].size()
+                 : texture->colorb.size();
   } else if (!texture->scalarf.empty()) {
-    return texture->scalarf.size();
+    return level ? texture->scalarf_mips[level - 1].size()
+                 : texture->scalarf.size();
+  } else if (!texture->scalarh.empty()) {
+    return level ? texture->scalarh_mips[level - 1].size()
+                 : texture->scalarh.size();
   } else if (!texture->scalarb.empty()) {
-    return texture->scalarb.size();
+    return level ? texture->scalarb_mips[level - 1].size()
+                 : texture->scalarb.size();
+  } else if (!texture->blocks.blocks.empty()) {
+    return level ? texture->blocks_mips[level - 1].size
+                 : texture->blocks.size;
+  } else if (texture->procedural) {
+    return texture->procedural_size;
+  } else if (!texture->tiled.empty()) {
+    return texture->tiled_sizes[level];
   } else {
     return zero2i;
   }
 }
 
+// Number of texture levels, including the base image
+static int texture_levels(const trc::texture* texture) {
+  if (!texture->colorf.empty()) {
+    return 1 + (int)texture->colorf_mips.size();
+  } else if (!texture->colorh.empty()) {
+    return 1 + (int)texture->colorh_mips.size();
+  } else if (!texture->colorb.empty()) {
+    return 1 + (int)texture->colorb_mips.size();
+  } else if (!texture->scalarf.empty()) {
+    return 1 + (int)texture->scalarf_mips.size();
+  } else if (!texture->scalarh.empty()) {
+    return 1 + (int)texture->scalarh_mips.size();
+  } else if (!texture->scalarb.empty()) {
+    return 1 + (int)texture->scalarb_mips.size();
+  } else if (!texture->blocks.blocks.empty()) {
+    return 1 + (int)texture->blocks_mips.size();
+  } else if (texture->procedural) {
+    return 1;
+  } else if (!texture->tiled.empty()) {
+    return (int)texture->tiled_sizes.size();
+  } else {
+    return 0;
+  }
+}
+
 // Evaluate a texture
-static vec3f lookup_texture(
-    const trc::texture* texture, const vec2i& ij, bool ldr_as_linear = false) {
+static vec3f lookup_texture(const trc::texture* texture, const vec2i& ij,
+    bool ldr_as_linear = false, int level = 0) {
   if (!texture->colorf.empty()) {
-    return texture->colorf[ij];
+    return level ? texture->colorf_mips[level - 1][ij] : texture->colorf[ij];
+  } else if (!texture->colorh.empty()) {
+    return half_to_float(
+        level ? texture->colorh_mips[level - 1][ij] : texture->colorh[ij]);
   } else if (!texture->colorb.empty()) {
-    return ldr_as_linear ? byte_to_float(texture->colorb[ij])
-                         : srgb_to_rgb(byte_to_float(texture->colorb[ij]));
+    auto value = level ? texture->colorb_mips[level - 1][ij]
+                       : texture->colorb[ij];
+    return ldr_as_linear ? byte_to_float(value)
+                         : srgb_to_rgb(byte_to_float(value));
   } else if (!texture->scalarf.empty()) {
-    return vec3f{texture->scalarf[ij]};
+    return vec3f{
+        level ? texture->scalarf_mips[level - 1][ij] : texture->scalarf[ij]};
+  } else if (!texture->scalarh.empty()) {
+    return vec3f{half_to_float(
+        level ? texture->scalarh_mips[level - 1][ij] : texture->scalarh[ij])};
   } else if (!texture->scalarb.empty()) {
-    return ldr_as_linear
-               ? byte_to_float(vec3b{texture->scalarb[ij]})
-               : srgb_to_rgb(byte_to_float(vec3b{texture->scalarb[ij]}));
+    auto value = level ? texture->scalarb_mips[level - 1][ij]
+                       : texture->scalarb[ij];
+    return ldr_as_linear ? byte_to_float(vec3b{value})
+                         : srgb_to_rgb(byte_to_float(vec3b{value}));
+  } else if (!texture->blocks.blocks.empty()) {
+    auto value = lookup_block(
+        level ? texture->blocks_mips[level - 1] : texture->blocks, ij);
+    return ldr_as_linear ? byte_to_float(value)
+                         : srgb_to_rgb(byte_to_float(value));
+  } else if (texture->procedural) {
+    auto size = texture->procedural_size;
+    return texture->procedural(
+        {(ij.x + 0.5f) / size.x, (ij.y + 0.5f) / size.y});
+  } else if (!texture->tiled.empty()) {
+    return lookup_tiled_texture(texture, ij, ldr_as_linear, level);
   } else {
     return {1, 1, 1};
   }
@@ -208,12 +878,20 @@ static vec3f lookup_texture(
 // Evaluate a texture
 static vec3f eval_texture(const trc::texture* texture, const vec2f& uv,
     bool ldr_as_linear = false, bool no_interpolation = false,
-    bool clamp_to_edge = false) {
+    bool clamp_to_edge = false, int level = 0) {
   // get texture
   if (!texture) return {1, 1, 1};
 
+  // procedural textures are evaluated directly, wrapping or clamping uv
+  if (texture->procedural) {
+    auto st = clamp_to_edge
+                  ? vec2f{clamp(uv.x, 0.0f, 1.0f), clamp(uv.y, 0.0f, 1.0f)}
+                  : vec2f{uv.x - std::floor(uv.x), uv.y - std::floor(uv.y)};
+    return texture->procedural(st);
+  }
+
   // get img::image width/height
-  auto size = texture_size(texture);
+  auto size = texture_size(texture, level);
 
   // get coordinates normalized for tiling
   auto s = 0.0f, t = 0.0f;
@@ -232,13 +910,37 @@ static vec3f eval_texture(const trc::texture* texture, const vec2f& uv,
   auto ii = (i + 1) % size.x, jj = (j + 1) % size.y;
   auto u = s - i, v = t - j;
 
-  if (no_interpolation) return lookup_texture(texture, {i, j}, ldr_as_linear);
+  if (no_interpolation)
+    return lookup_texture(texture, {i, j}, ldr_as_linear, level);
 
   // handle interpolation
-  return lookup_texture(texture, {i, j}, ldr_as_linear) * (1 - u) * (1 - v) +
-         lookup_texture(texture, {i, jj}, ldr_as_linear) * (1 - u) * v +
-         lookup_texture(texture, {ii, j}, ldr_as_linear) * u * (1 - v) +
-         lookup_texture(texture, {ii, jj}, ldr_as_linear) * u * v;
+  return lookup_texture(texture, {i, j}, ldr_as_linear, level) * (1 - u) *
+             (1 - v) +
+         lookup_texture(texture, {i, jj}, ldr_as_linear, level) * (1 - u) *
+             v +
+         lookup_texture(texture, {ii, j}, ldr_as_linear, level) * u *
+             (1 - v) +
+         lookup_texture(texture, {ii, jj}, ldr_as_linear, level) * u * v;
+}
+
+// Evaluate a texture over a footprint of the given width in texture space,
+// blending the two closest mip levels. Zero footprints use the base image.
+static vec3f eval_texture(const trc::texture* texture, const vec2f& uv,
+    float footprint, bool ldr_as_linear) {
+  if (!texture) return {1, 1, 1};
+  if (footprint <= 0) return eval_texture(texture, uv, ldr_as_linear);
+  auto size = texture_size(texture);
+  auto lod  = log2(footprint * sqrt((float)size.x * (float)size.y));
+  auto last = texture_levels(texture) - 1;
+  if (lod <= 0 || last <= 0) return eval_texture(texture, uv, ldr_as_linear);
+  if (lod >= last)
+    return eval_texture(texture, uv, ldr_as_linear, false, false, last);
+  auto level = (int)lod;
+  auto alpha = lod - level;
+  return eval_texture(texture, uv, ldr_as_linear, false, false, level) *
+             (1 - alpha) +
+         eval_texture(texture, uv, ldr_as_linear, false, false, level + 1) *
+             alpha;
 }
 
 // Generates a ray from a camera for img::image plane coordinate uv and
@@ -333,6 +1035,62 @@ static ray3f sample_camera(const trc::camera* camera, const vec2i& ij,
   }
 }
 
+// Ray cone used to select texture levels. The width is the cone diameter
+// at the ray origin and the spread is its angle.
+struct ray_cone {
+  float width  = 0;
+  float spread = 0;
+};
+
+// Cone of the camera rays through a pixel
+static ray_cone get_camera_cone(
+    const trc::camera* camera, const vec2i& image_size) {
+  if (camera->orthographic) return {camera->film.x / image_size.x, 0};
+  return {0, camera->film.x / (camera->lens * image_size.x)};
+}
+
+// Advance a ray cone to a hit at the given distance, and widen its spread
+// by the roughness of the surface it scatters from
+static ray_cone scatter_cone(
+    const ray_cone& cone, float distance, float roughness) {
+  return {cone.width + cone.spread * distance, cone.spread + roughness};
+}
+
+// Ratio of texture space to world space lengths over a shape element
+static float eval_texcoord_scale(
+    const trc::shape* shape, int element, const frame3f& frame) {
+  if (!shape->heightfield.empty()) {
+    auto p0 = transform_point(frame, eval_position(shape, element, {0, 0}));
+    auto p1 = transform_point(frame, eval_position(shape, element, {1, 0}));
+    auto p2 = transform_point(frame, eval_position(shape, element, {1, 1}));
+    auto t0 = eval_texcoord(shape, element, {0, 0});
+    auto t1 = eval_texcoord(shape, element, {1, 0});
+    auto t2 = eval_texcoord(shape, element, {1, 1});
+    auto world_area = triangle_area(p0, p1, p2);
+    auto uv_area    = abs(cross(t1 - t0, t2 - t0)) / 2;
+    return world_area ? sqrt(uv_area / world_area) : 0;
+  }
+  if (!has_texcoords(shape)) return 0;
+  auto t = vec3i{};
+  if (has_triangles(shape)) {
+    t = get_triangle(shape, element);
+  } else if (!shape->quads.empty()) {
+    auto& q = shape->quads[element];
+    t       = {q.x, q.y, q.z};
+  } else {
+    return 0;
+  }
+  auto p0         = transform_point(frame, get_position(shape, t.x));
+  auto p1         = transform_point(frame, get_position(shape, t.y));
+  auto p2         = transform_point(frame, get_position(shape, t.z));
+  auto t0         = get_texcoord(shape, t.x);
+  auto t1         = get_texcoord(shape, t.y);
+  auto t2         = get_texcoord(shape, t.z);
+  auto world_area = triangle_area(p0, p1, p2);
+  auto uv_area    = abs(cross(t1 - t0, t2 - t0)) / 2;
+  return world_area ? sqrt(uv_area / world_area) : 0;
+}
+
 // Point used for tracing
 struct trace_point {
   // shape
@@ -369,14 +1127,41 @@ struct trace_point {
   float refraction_pdf   = 0;
 };
 
-// Evaluate point
+// Material lobes, used to specialize point evaluation for simple materials.
+// Diffuse is always evaluated since it takes the remaining weight.
+enum material_lobe : int {
+  lobe_coat         = 1 << 0,
+  lobe_metal        = 1 << 1,
+  lobe_specular     = 1 << 2,
+  lobe_transmission = 1 << 3,
+  lobe_translucency = 1 << 4,
+  lobe_all          = (1 << 5) - 1,
+};
+
+// Lobes that have a non-zero weight for a material. Textures only scale
+// the material factors, so they do not need to be checked.
+static int get_material_lobes(const trc::material* material) {
+  auto lobes = 0;
+  if (material->coat) lobes |= lobe_coat;
+  if (material->metallic) lobes |= lobe_metal;
+  if (material->specular) lobes |= lobe_specular;
+  if (material->transmission) lobes |= lobe_transmission;
+  if (material->translucency) lobes |= lobe_translucency;
+  return lobes;
+}
+
+// Evaluate point. Lobes not in the mask are skipped at compile time.
+template <int lobes>
 static trace_point eval_point(const trc::scene* scene,
-    const intersection3f& intersection, const ray3f& ray) {
+    const intersection3f& intersection, const ray3f& ray, float width,
+    float time) {
   // get data
-  auto object   = scene->objects[intersection.object];
-  auto shape    = object->shape;
-  auto material = object->material;
-  auto frame = object->instance->frames[intersection.instance] * object->frame;
+  auto& layout = scene->layout;
+  auto  index  = get_layout_index(
+      scene, intersection.object, intersection.instance);
+  auto shape    = scene->shapes[layout.shapes[index]];
+  auto material = scene->materials[layout.materials[index]];
+  auto frame    = eval_layout_frame(scene, index, time);
   auto element          = intersection.element;
   auto uv               = intersection.uv;
   auto non_rigid_frames = true;
@@ -388,18 +1173,28 @@ static trace_point eval_point(const trc::scene* scene,
   point.incoming = -ray.d;
 
   // geometric properties
-  point.position = eval_shape(shape, shape->positions, element, uv, zero3f);
-  point.gnormal  = eval_normal(shape, element);
+  point.position = eval_position(shape, element, uv);
+  point.gnormal  = eval_normal(shape, element, uv);
   point.normal   = normalize(
-      eval_shape(shape, shape->normals, element, uv, point.gnormal));
-  point.texcoord = eval_shape(shape, shape->texcoords, element, uv, uv);
+      eval_shading_normal(shape, element, uv, point.gnormal));
+  point.texcoord = eval_texcoord(shape, element, uv);
   point.color    = eval_shape(shape, shape->colors, element, uv, vec3f{1});
 
+  // texture footprint, from the ray cone width projected on the surface
+  auto footprint = 0.0f;
+  if (width > 0) {
+    auto cosine = abs(dot(point.outgoing,
+        transform_normal(frame, point.gnormal, non_rigid_frames)));
+    footprint = width * eval_texcoord_scale(shape, element, frame) /
+                max(cosine, 0.1f);
+  }
+
   // apply normal mapping
   if (material->normal_tex &&
-      (!shape->triangles.empty() || !shape->quads.empty())) {
-    auto normalmap = -1 + 2 * eval_texture(
-                                  material->normal_tex, point.texcoord, true);
+      (has_triangles(shape) || !shape->quads.empty() ||
+          !shape->heightfield.empty())) {
+    auto normalmap = -1 + 2 * eval_texture(material->normal_tex,
+                                  point.texcoord, footprint, true);
     auto z      = point.normal;
     auto basis  = identity3x3f;
     auto flip_v = false;
@@ -429,9 +1224,9 @@ static trace_point eval_point(const trc::scene* scene,
   // correct normals
   if (!shape->points.empty()) {
     point.normal = point.outgoing;
-  } else if (!shape->lines.empty()) {
+  } else if (!shape->lines.empty() || !shape->beziers.empty()) {
     point.normal = orthonormalize(point.outgoing, point.normal);
-  } else if (!shape->triangles.empty()) {
+  } else if (has_triangles(shape)) {
     if (material->thin && dot(point.outgoing, point.normal) < 0)
       point.normal = -point.normal;
   } else if (!shape->quads.empty()) {
@@ -442,47 +1237,82 @@ static trace_point eval_point(const trc::scene* scene,
   // material -------
   // initialize factors
   auto texcoord = point.texcoord;
-  auto emission = material->emission *
-                  eval_texture(material->emission_tex, texcoord, false);
-  auto base = material->color * point.color *
-              eval_texture(material->color_tex, texcoord, false);
-  auto specular = material->specular *
-                  eval_texture(material->specular_tex, texcoord, true).x;
-  auto metallic = material->metallic *
-                  eval_texture(material->metallic_tex, texcoord, true).x;
-  auto roughness = material->roughness *
-                   eval_texture(material->roughness_tex, texcoord, true).x;
-
-  auto ior  = material->ior;
-  auto coat = material->coat *
-              eval_texture(material->coat_tex, texcoord, true).x;
-  auto transmission = material->transmission *
-                      eval_texture(material->emission_tex, texcoord, true).x;
-  auto translucency =
-      material->translucency *
-      eval_texture(material->translucency_tex, texcoord, true).x;
+  auto emission = material->emission * eval_texture(material->emission_tex,
+                                           texcoord, footprint, false);
+  auto base     = material->color * point.color *
+              eval_texture(material->color_tex, texcoord, footprint, false);
+  auto specular = 0.0f, metallic = 0.0f, roughness = 1.0f;
+  auto coat = 0.0f, transmission = 0.0f, translucency = 0.0f;
+  if constexpr ((lobes & lobe_specular) != 0) {
+    specular = material->specular * eval_texture(material->specular_tex,
+                                        texcoord, footprint, true)
+                                        .x;
+  }
+  if constexpr ((lobes & lobe_metal) != 0) {
+    metallic = material->metallic * eval_texture(material->metallic_tex,
+                                        texcoord, footprint, true)
+                                        .x;
+  }
+  // roughness is reset to 1 below when there are no glossy lobes
+  if constexpr ((lobes & (lobe_specular | lobe_metal | lobe_transmission)) !=
+                0) {
+    roughness = material->roughness * eval_texture(material->roughness_tex,
+                                          texcoord, footprint, true)
+                                          .x;
+  }
+
+  auto ior = material->ior;
+  if constexpr ((lobes & lobe_coat) != 0) {
+    coat = material->coat *
+           eval_texture(material->coat_tex, texcoord, footprint, true).x;
+  }
+  if constexpr ((lobes & lobe_transmission) != 0) {
+    transmission = material->transmission *
+                   eval_texture(material->emission_tex, texcoord, footprint,
+                       true)
+                       .x;
+  }
+  if constexpr ((lobes & lobe_translucency) != 0) {
+    translucency = material->translucency *
+                   eval_texture(material->translucency_tex, texcoord,
+                       footprint, true)
+                       .x;
+  }
   auto opacity = material->opacity *
-                 mean(eval_texture(material->opacity_tex, texcoord, true));
+                 mean(eval_texture(
+                     material->opacity_tex, texcoord, footprint, true));
   auto thin = material->thin || !material->transmission;
 
   // factors
   auto weight    = vec3f{1, 1, 1};
   point.emission = weight * emission;
-  point.coat     = weight * coat;
-  weight *= 1 - point.coat *
-                    fresnel_dielectric(coat_ior, point.outgoing, point.normal);
-  point.metal = weight * metallic;
-  weight *= 1 - metallic;
-  point.refraction = thin ? zero3f : (weight * transmission);
-  weight *= 1 - (thin ? 0 : transmission);
-  point.specular = weight * specular;
-  weight *= 1 -
-            specular * fresnel_dielectric(ior, point.outgoing, point.normal);
-  point.transmission = thin ? (weight * transmission * base) : zero3f;
-  weight *= 1 - (thin ? transmission : 0);
-  point.translucency = thin ? (weight * translucency * base)
-                            : (weight * translucency);
-  weight *= 1 - translucency;
+  if constexpr ((lobes & lobe_coat) != 0) {
+    point.coat = weight * coat;
+    weight *= 1 - point.coat * fresnel_dielectric(
+                                   coat_ior, point.outgoing, point.normal);
+  }
+  if constexpr ((lobes & lobe_metal) != 0) {
+    point.metal = weight * metallic;
+    weight *= 1 - metallic;
+  }
+  if constexpr ((lobes & lobe_transmission) != 0) {
+    point.refraction = thin ? zero3f : (weight * transmission);
+    weight *= 1 - (thin ? 0 : transmission);
+  }
+  if constexpr ((lobes & lobe_specular) != 0) {
+    point.specular = weight * specular;
+    weight *= 1 -
+              specular * fresnel_dielectric(ior, point.outgoing, point.normal);
+  }
+  if constexpr ((lobes & lobe_transmission) != 0) {
+    point.transmission = thin ? (weight * transmission * base) : zero3f;
+    weight *= 1 - (thin ? transmission : 0);
+  }
+  if constexpr ((lobes & lobe_translucency) != 0) {
+    point.translucency = thin ? (weight * translucency * base)
+                              : (weight * translucency);
+    weight *= 1 - translucency;
+  }
   point.diffuse   = weight * base;
   point.meta      = reflectivity_to_eta(base);
   point.metak     = zero3f;
@@ -502,16 +1332,28 @@ static trace_point eval_point(const trc::scene* scene,
   if (point.opacity > 0.999f) point.opacity = 1;
 
   // weights
-  point.diffuse_pdf  = max(point.diffuse);
-  point.specular_pdf = max(point.specular * fresnel_dielectric(point.ior,
-                                                point.normal, point.outgoing));
-  point.metal_pdf = max(point.metal * fresnel_conductor(point.meta, point.metak,
-                                          point.normal, point.outgoing));
-  point.coat_pdf  = max(
-      point.coat * fresnel_dielectric(coat_ior, point.normal, point.outgoing));
-  point.transmission_pdf = max(point.transmission);
-  point.translucency_pdf = max(point.translucency);
-  point.refraction_pdf   = max(point.refraction);
+  point.diffuse_pdf = max(point.diffuse);
+  if constexpr ((lobes & lobe_specular) != 0) {
+    point.specular_pdf = max(point.specular *
+                             fresnel_dielectric(
+                                 point.ior, point.normal, point.outgoing));
+  }
+  if constexpr ((lobes & lobe_metal) != 0) {
+    point.metal_pdf = max(point.metal * fresnel_conductor(point.meta,
+                                            point.metak, point.normal,
+                                            point.outgoing));
+  }
+  if constexpr ((lobes & lobe_coat) != 0) {
+    point.coat_pdf = max(point.coat * fresnel_dielectric(coat_ior, point.normal,
+                                          point.outgoing));
+  }
+  if constexpr ((lobes & lobe_transmission) != 0) {
+    point.transmission_pdf = max(point.transmission);
+    point.refraction_pdf   = max(point.refraction);
+  }
+  if constexpr ((lobes & lobe_translucency) != 0) {
+    point.translucency_pdf = max(point.translucency);
+  }
   auto pdf_sum = point.diffuse_pdf + point.specular_pdf + point.metal_pdf +
                  point.coat_pdf + point.transmission_pdf +
                  point.translucency_pdf + point.refraction_pdf;
@@ -527,6 +1369,27 @@ static trace_point eval_point(const trc::scene* scene,
   return point;
 }
 
+// Evaluate point, dispatching on the material lobes computed in init_lights.
+// Common simple materials get their own specialization. Textures are
+// filtered over the ray cone width at the hit, if given. Moving instances
+// are evaluated at `time`.
+static trace_point eval_point(const trc::scene* scene,
+    const intersection3f& intersection, const ray3f& ray, float width = 0,
+    float time = 0) {
+  switch (scene->objects[intersection.object]->material->lobes) {
+    case 0: return eval_point<0>(scene, intersection, ray, width, time);
+    case lobe_specular:
+      return eval_point<lobe_specular>(scene, intersection, ray, width, time);
+    case lobe_metal:
+      return eval_point<lobe_metal>(scene, intersection, ray, width, time);
+    case lobe_specular | lobe_metal:
+      return eval_point<lobe_specular | lobe_metal>(
+          scene, intersection, ray, width, time);
+    default:
+      return eval_point<lobe_all>(scene, intersection, ray, width, time);
+  }
+}
+
 // Point used for tracing
 struct volume_point {
   // shape
@@ -540,16 +1403,21 @@ struct volume_point {
   vec3f volemission   = {0, 0, 0};
   vec3f volscatter    = {0, 0, 0};
   float volanisotropy = 0;
+  // heterogeneous density, with the world to object frame
+  const trc::volume* density = nullptr;
+  frame3f            frame   = identity3x4f;
 };
 
 // Evaluate point
 static volume_point eval_volume(const trc::scene* scene,
-    const intersection3f& intersection, const ray3f& ray) {
+    const intersection3f& intersection, const ray3f& ray, float time = 0) {
   // get data
-  auto& object   = scene->objects[intersection.object];
-  auto& shape    = object->shape;
-  auto& material = object->material;
-  auto  frame = object->instance->frames[intersection.instance] * object->frame;
+  auto& layout   = scene->layout;
+  auto  index    = get_layout_index(
+      scene, intersection.object, intersection.instance);
+  auto  shape    = scene->shapes[layout.shapes[index]];
+  auto  material = scene->materials[layout.materials[index]];
+  auto  frame    = eval_layout_frame(scene, index, time);
   auto  element = intersection.element;
   auto  uv      = intersection.uv;
 
@@ -560,12 +1428,12 @@ static volume_point eval_volume(const trc::scene* scene,
   point.incoming = -ray.d;
 
   // geometric properties
-  point.position = eval_shape(shape, shape->positions, element, uv, zero3f);
+  point.position = eval_position(shape, element, uv);
   point.position = transform_point(frame, point.position);
 
   // material -------
   // initialize factors
-  auto texcoord = eval_shape(shape, shape->texcoords, element, uv, uv);
+  auto texcoord = eval_texcoord(shape, element, uv);
   auto color    = eval_shape(shape, shape->colors, element, uv, vec3f{1});
   auto base     = material->color * color *
               eval_texture(material->color_tex, texcoord, false);
@@ -588,28 +1456,191 @@ static volume_point eval_volume(const trc::scene* scene,
                          : zero3f;
   point.volscatter    = scattering;
   point.volanisotropy = scanisotropy;
+  point.density       = material->density_vol;
+  if (point.density) point.frame = inverse(frame, true);
 
   return point;
 }
 
+// Lookup a density grid voxel, returning zero outside the grid and in
+// empty bricks
+static float lookup_density(const trc::volume* volume, const vec3i& ijk) {
+  if (ijk.x < 0 || ijk.y < 0 || ijk.z < 0 || ijk.x >= volume->size.x ||
+      ijk.y >= volume->size.y || ijk.z >= volume->size.z)
+    return 0;
+  auto brick  = ijk / volume_brick;
+  auto offset = volume->offsets[(brick.z * volume->bricks.y + brick.y) *
+                                    volume->bricks.x +
+                                brick.x];
+  if (offset < 0) return 0;
+  auto local = ijk - brick * volume_brick;
+  auto index = offset + (local.z * volume_brick + local.y) * volume_brick +
+               local.x;
+  if (!volume->encoded) return volume->voxels[index];
+  switch (volume->encoding) {
+    case volume_encoding::floats:
+      return ((const float*)volume->encoded)[index];
+    case volume_encoding::halfs:
+      return half_to_float(((const half*)volume->encoded)[index]);
+    case volume_encoding::bytes:
+      return volume->encoded[index] *
+             (volume->majorants[(brick.z * volume->bricks.y + brick.y) *
+                                    volume->bricks.x +
+                                brick.x] /
+                 255);
+    default: return 0;
+  }
+}
+
+// Evaluate a density grid at a point in voxel coordinates, interpolating
+// between voxel centers
+static float eval_density(const trc::volume* volume, const vec3f& uvw) {
+  auto p   = uvw - 0.5f;
+  auto ijk = vec3i{(int)floor(p.x), (int)floor(p.y), (int)floor(p.z)};
+  auto w   = p - vec3f{(float)ijk.x, (float)ijk.y, (float)ijk.z};
+  auto density = 0.0f;
+  for (auto k = 0; k < 2; k++) {
+    for (auto j = 0; j < 2; j++) {
+      for (auto i = 0; i < 2; i++) {
+        density += lookup_density(volume, ijk + vec3i{i, j, k}) *
+                   (i ? w.x : 1 - w.x) * (j ? w.y : 1 - w.y) *
+                   (k ? w.z : 1 - w.z);
+      }
+    }
+  }
+  return density;
+}
+
+// Voxel coordinates of a world position in a heterogeneous volume
+static vec3f eval_density_coords(
+    const volume_point& point, const vec3f& position) {
+  auto volume = point.density;
+  auto scale  = vec3f{(float)volume->size.x, (float)volume->size.y,
+                   (float)volume->size.z} /
+               (volume->bounds.max - volume->bounds.min);
+  return (transform_point(point.frame, position) - volume->bounds.min) *
+         scale;
+}
+
+// Evaluate the volume density at a world position
+static vec3f eval_voldensity(
+    const volume_point& point, const vec3f& position) {
+  if (!point.density) return point.voldensity;
+  return point.voldensity *
+         eval_density(point.density, eval_density_coords(point, position));
+}
+
+// Sample a collision distance in a heterogeneous volume with delta
+// tracking, stepping through the grid bricks with a dda and using their
+// majorants. Colored densities use spectral tracking, picking real and null
+// collisions proportionally to their weighted maximum to keep weights
+// bounded. Returns the distance, or max_distance if no collision happens
+// before it, and the path weight. At collisions, the weight excludes the
+// density, that is accounted for in eval_scattering.
+static std::pair<float, vec3f> sample_density_distance(
+    const volume_point& point, const ray3f& ray, float max_distance,
+    sampler_state& rng) {
+  auto volume = point.density;
+  auto weight = vec3f{1, 1, 1};
+  auto scale  = max(point.voldensity);
+  if (scale == 0) return {max_distance, weight};
+
+  // ray in voxel coordinates, keeping the distance parametrization
+  auto origin    = eval_density_coords(point, ray.o);
+  auto direction = eval_density_coords(point, ray.o + ray.d) - origin;
+
+  // clip to the grid
+  auto tmin = 0.0f, tmax = max_distance;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto size = (float)volume->size[axis];
+    if (direction[axis] == 0) {
+      if (origin[axis] < 0 || origin[axis] > size)
+        return {max_distance, weight};
+      continue;
+    }
+    auto t0 = (0 - origin[axis]) / direction[axis];
+    auto t1 = (size - origin[axis]) / direction[axis];
+    if (t0 > t1) std::swap(t0, t1);
+    tmin = max(tmin, t0);
+    tmax = min(tmax, t1);
+  }
+  if (tmin >= tmax) return {max_distance, weight};
+
+  // setup dda over bricks
+  auto start = (origin + direction * tmin) / (float)volume_brick;
+  auto brick = vec3i{clamp((int)start.x, 0, volume->bricks.x - 1),
+      clamp((int)start.y, 0, volume->bricks.y - 1),
+      clamp((int)start.z, 0, volume->bricks.z - 1)};
+  auto step  = zero3i;
+  auto tnext = vec3f{flt_max, flt_max, flt_max};
+  auto tstep = vec3f{flt_max, flt_max, flt_max};
+  for (auto axis = 0; axis < 3; axis++) {
+    if (direction[axis] == 0) continue;
+    step[axis]  = direction[axis] > 0 ? 1 : -1;
+    tnext[axis] = ((brick[axis] + (step[axis] > 0 ? 1 : 0)) * volume_brick -
+                      origin[axis]) /
+                  direction[axis];
+    tstep[axis] = volume_brick / abs(direction[axis]);
+  }
+
+  // track through bricks
+  auto t = tmin;
+  while (true) {
+    auto texit    = min(min(tnext.x, tnext.y), min(tnext.z, tmax));
+    auto majorant = scale *
+                    volume->majorants[(brick.z * volume->bricks.y + brick.y) *
+                                          volume->bricks.x +
+                                      brick.x];
+    if (majorant > 0) {
+      while (true) {
+        t -= log(1 - rand1f(rng)) / majorant;
+        if (t >= texit) break;
+        auto density = point.voldensity *
+                       eval_density(volume, origin + direction * t);
+        auto real = max(density * weight);
+        auto null = max((majorant - density) * weight);
+        if (real + null == 0) return {max_distance, zero3f};
+        auto collision = real / (real + null);
+        if (rand1f(rng) < collision)
+          return {t, weight / (majorant * collision)};
+        weight *= (majorant - density) / (majorant * (1 - collision));
+      }
+    }
+    if (texit >= tmax) return {max_distance, weight};
+    t         = texit;
+    auto axis = tnext.x < tnext.y ? (tnext.x < tnext.z ? 0 : 2)
+                                  : (tnext.y < tnext.z ? 1 : 2);
+    brick[axis] += step[axis];
+    if (brick[axis] < 0 || brick[axis] >= volume->bricks[axis])
+      return {max_distance, weight};
+    tnext[axis] += tstep[axis];
+  }
+}
+
 // Check if an instance as volume scattering
 static bool has_volume(
     const trc::scene* scene, const intersection3f& intersection) {
-  auto object = scene->objects[intersection.object];
-  return !object->material->thin &&
-         (object->material->transmission || object->material->translucency);
+  auto index    = get_layout_index(
+      scene, intersection.object, intersection.instance);
+  auto material = scene->materials[scene->layout.materials[index]];
+  return !material->thin &&
+         (material->transmission || material->translucency);
 }
 
 // Evaluate all environment color.
+static vec3f eval_environment(
+    const trc::environment* environment, const vec3f& direction) {
+  auto wl       = transform_direction(inverse(environment->frame), direction);
+  auto texcoord = vec2f{
+      atan2(wl.z, wl.x) / (2 * pif), acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+  if (texcoord.x < 0) texcoord.x += 1;
+  return environment->emission *
+         eval_texture(environment->emission_tex, texcoord);
+}
 static vec3f eval_environment(const trc::scene* scene, const ray3f& ray) {
   auto emission = zero3f;
   for (auto environment : scene->environments) {
-    auto wl       = transform_direction(inverse(environment->frame), ray.d);
-    auto texcoord = vec2f{
-        atan2(wl.z, wl.x) / (2 * pif), acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-    if (texcoord.x < 0) texcoord.x += 1;
-    emission += environment->emission *
-                eval_texture(environment->emission_tex, texcoord);
+    emission += eval_environment(environment, ray.d);
   }
   return emission;
 }
@@ -661,6 +1692,10 @@ static RTCDevice     embree_device() {
 
 // Initialize Embree BVH
 static void init_embree_bvh(trc::shape* shape, const trace_params& params) {
+  if (!shape->heightfield.empty())
+    throw std::runtime_error("embree does not support heightfields");
+  if (!shape->cpositions.empty())
+    throw std::runtime_error("embree does not support compressed shapes");
   auto edevice = embree_device();
   if (shape->embree_bvh) rtcReleaseScene(shape->embree_bvh);
   shape->embree_bvh = rtcNewScene(edevice);
@@ -669,8 +1704,27 @@ static void init_embree_bvh(trc::shape* shape, const trace_params& params) {
     rtcSetSceneFlags(escene, RTC_SCENE_FLAG_COMPACT);
   if (params.bvh == bvh_type::embree_highquality)
     rtcSetSceneBuildQuality(escene, RTC_BUILD_QUALITY_HIGH);
+  // shared buffers point directly to the shape data, avoiding a copy;
+  // embree reads vertices with 16 byte loads, so positions need one more
+  // element of capacity, usually reserved in set_positions
+  auto shared = params.embree_shared ||
+                params.bvh == bvh_type::embree_compact;
+  if (shared && shape->positions.capacity() == shape->positions.size())
+    shape->positions.reserve(shape->positions.size() + 1);
   if (!shape->points.empty()) {
-    throw std::runtime_error("embree does not support points");
+    // points are ray-facing discs, as in intersect_point; embree has no
+    // index buffer for them, so the primitive id is the point index
+    auto epositions = std::vector<vec4f>{};
+    epositions.reserve(shape->points.size());
+    for (auto& p : shape->points)
+      epositions.push_back({shape->positions[p], shape->radius[p]});
+    auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_DISC_POINT);
+    rtcSetGeometryVertexAttributeCount(egeometry, 1);
+    auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, 4 * 4, epositions.size());
+    memcpy(embree_positions, epositions.data(), epositions.size() * 16);
+    rtcCommitGeometry(egeometry);
+    rtcAttachGeometryByID(escene, egeometry, 0);
   } else if (!shape->lines.empty()) {
     auto elines     = std::vector<int>{};
     auto epositions = std::vector<vec4f>{};
@@ -697,10 +1751,32 @@ static void init_embree_bvh(trc::shape* shape, const trace_params& params) {
     memcpy(embree_lines, elines.data(), elines.size() * 4);
     rtcCommitGeometry(egeometry);
     rtcAttachGeometryByID(escene, egeometry, 0);
+  } else if (!shape->beziers.empty()) {
+    // embree indexes the first of four consecutive control points
+    auto ebeziers   = std::vector<int>{};
+    auto epositions = std::vector<vec4f>{};
+    ebeziers.reserve(shape->beziers.size());
+    epositions.reserve(shape->beziers.size() * 4);
+    for (auto& b : shape->beziers) {
+      ebeziers.push_back((int)epositions.size());
+      for (auto vid : {b.x, b.y, b.z, b.w})
+        epositions.push_back({shape->positions[vid], shape->radius[vid]});
+    }
+    auto egeometry = rtcNewGeometry(
+        edevice, RTC_GEOMETRY_TYPE_ROUND_BEZIER_CURVE);
+    rtcSetGeometryVertexAttributeCount(egeometry, 1);
+    auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, 4 * 4, epositions.size());
+    auto embree_beziers   = rtcSetNewGeometryBuffer(egeometry,
+        RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, 4, ebeziers.size());
+    memcpy(embree_positions, epositions.data(), epositions.size() * 16);
+    memcpy(embree_beziers, ebeziers.data(), ebeziers.size() * 4);
+    rtcCommitGeometry(egeometry);
+    rtcAttachGeometryByID(escene, egeometry, 0);
   } else if (!shape->triangles.empty()) {
     auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_TRIANGLE);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
-    if (params.bvh == bvh_type::embree_compact) {
+    if (shared) {
       rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_VERTEX, 0,
           RTC_FORMAT_FLOAT3, shape->positions.data(), 0, 3 * 4,
           shape->positions.size());
@@ -724,7 +1800,7 @@ static void init_embree_bvh(trc::shape* shape, const trace_params& params) {
   } else if (!shape->quads.empty()) {
     auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_QUAD);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
-    if (params.bvh == bvh_type::embree_compact) {
+    if (shared) {
       rtcSetSharedGeometryBuffer(egeometry, RTC_BUFFER_TYPE_VERTEX, 0,
           RTC_FORMAT_FLOAT3, shape->positions.data(), 0, 3 * 4,
           shape->positions.size());
@@ -759,20 +1835,27 @@ static void init_embree_bvh(trc::scene* scene, const trace_params& params) {
     rtcSetSceneFlags(escene, RTC_SCENE_FLAG_COMPACT);
   if (params.bvh == bvh_type::embree_highquality)
     rtcSetSceneBuildQuality(escene, RTC_BUILD_QUALITY_HIGH);
+  scene->embree_instances.clear();
   auto object_id = 0;
   for (auto object : scene->objects) {
-    auto instance_id = 0;
-    for (auto frame : object->instance->frames) {
-      frame          = frame * object->frame;
+    auto& motion = object->instance->motion;
+    for (auto instance_id = 0; instance_id < object->instance->frames.size();
+         instance_id++) {
+      if (is_pruned(scene->pruned_instances, object_id, instance_id)) continue;
       auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_INSTANCE);
       rtcSetGeometryInstancedScene(egeometry, object->shape->embree_bvh);
-      rtcSetGeometryTransform(
-          egeometry, 0, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, &frame);
+      // moving instances use one time step per keyframe
+      rtcSetGeometryTimeStepCount(egeometry, (unsigned int)motion.size() + 1);
+      for (auto key = 0; key <= motion.size(); key++) {
+        auto& frames = key == 0 ? object->instance->frames : motion[key - 1];
+        auto  frame  = frames[instance_id] * object->frame;
+        rtcSetGeometryTransform(
+            egeometry, key, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, &frame);
+      }
       rtcCommitGeometry(egeometry);
       rtcAttachGeometryByID(
           escene, egeometry, (int)scene->embree_instances.size());
       scene->embree_instances.push_back({object_id, instance_id});
-      instance_id += 1;
     }
     object_id += 1;
   }
@@ -784,15 +1867,24 @@ static void update_embree_bvh(trc::scene* scene,
     const std::vector<trc::shape*>&       updated_shapes,
     const std::vector<trc::instance*>&    updated_instances,
     const trace_params&                   params) {
-  // scene bvh
+  // scene bvh, whose geometries are attached by embree_instances position,
+  // since pruned instances are skipped
   auto escene = scene->embree_bvh;
-  for (auto& [object_id, instance_id] : scene->embree_instances) {
-    auto object    = scene->objects[object_id];
-    auto frame     = scene->objects[instance_id]->frame * object->frame;
-    auto egeometry = rtcGetGeometry(escene, instance_id);
+  for (auto idx = 0; idx < scene->embree_instances.size(); idx++) {
+    auto  object_id   = scene->embree_instances[idx].x;
+    auto  instance_id = scene->embree_instances[idx].y;
+    auto  object      = scene->objects[object_id];
+    auto& motion      = object->instance->motion;
+    auto  egeometry   = rtcGetGeometry(escene, idx);
     rtcSetGeometryInstancedScene(egeometry, object->shape->embree_bvh);
-    rtcSetGeometryTransform(
-        egeometry, 0, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, &frame);
+    // moving instances use one time step per keyframe
+    rtcSetGeometryTimeStepCount(egeometry, (unsigned int)motion.size() + 1);
+    for (auto key = 0; key <= motion.size(); key++) {
+      auto& frames = key == 0 ? object->instance->frames : motion[key - 1];
+      auto  frame  = frames[instance_id] * object->frame;
+      rtcSetGeometryTransform(
+          egeometry, key, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, &frame);
+    }
     rtcCommitGeometry(egeometry);
   }
   rtcCommitScene(escene);
@@ -824,7 +1916,7 @@ static bool intersect_shape_embree_bvh(trc::shape* shape, const ray3f& ray,
 
 static bool intersect_scene_embree_bvh(const trc::scene* scene,
     const ray3f& ray, int& shape, int& instance, int& element, vec2f& uv,
-    float& distance, bool find_any) {
+    float& distance, bool find_any, float time) {
   RTCRayHit embree_ray;
   embree_ray.ray.org_x     = ray.o.x;
   embree_ray.ray.org_y     = ray.o.y;
@@ -834,6 +1926,7 @@ static bool intersect_scene_embree_bvh(const trc::scene* scene,
   embree_ray.ray.dir_z     = ray.d.z;
   embree_ray.ray.tnear     = ray.tmin;
   embree_ray.ray.tfar      = ray.tmax;
+  embree_ray.ray.time      = time;
   embree_ray.ray.flags     = 0;
   embree_ray.hit.geomID    = RTC_INVALID_GEOMETRY_ID;
   embree_ray.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
@@ -848,332 +1941,604 @@ static bool intersect_scene_embree_bvh(const trc::scene* scene,
   distance = embree_ray.ray.tfar;
   return true;
 }
-#endif
-
-// primitive used to sort bvh entries
-struct bvh_primitive {
-  bbox3f bbox      = invalidb3f;
-  vec3f  center    = zero3f;
-  vec2i  primitive = {0, 0};
-};
-
-// Splits a BVH node using the SAH heuristic. Returns split position and axis.
-static std::pair<int, int> split_sah(
-    std::vector<bvh_primitive>& primitives, int start, int end) {
-  // initialize split axis and position
-  auto split_axis = 0;
-  auto mid        = (start + end) / 2;
-
-  // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++) cbbox = merge(cbbox, primitives[i].center);
-  auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, split_axis};
-
-  // consider N bins, compute their cost and keep the minimum
-  const int nbins    = 16;
-  auto      middle   = 0.0f;
-  auto      min_cost = flt_max;
-  auto      area     = [](auto& b) {
-    auto size = b.max - b.min;
-    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
-           2 * size.y * size.z;
-  };
-  for (auto saxis = 0; saxis < 3; saxis++) {
-    for (auto b = 1; b < nbins; b++) {
-      auto split     = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (primitives[i].center[saxis] < split) {
-          left_bbox = merge(left_bbox, primitives[i].bbox);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, primitives[i].bbox);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * area(left_bbox) / area(cbbox) +
-                  right_nprims * area(right_bbox) / area(cbbox);
-      if (cost < min_cost) {
-        min_cost   = cost;
-        middle     = split;
-        split_axis = saxis;
-      }
-    }
-  }
-  // split
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [split_axis, middle](auto& primitive) {
-                    return primitive.center[split_axis] < middle;
-                  }) -
-              primitives.data());
-
-  // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    throw std::runtime_error("bad bvh split");
-    split_axis = 0;
-    mid        = (start + end) / 2;
-  }
-
-  return {mid, split_axis};
-}
-
-// Splits a BVH node using the balance heuristic. Returns split position and
-// axis.
-static std::pair<int, int> split_balanced(
-    std::vector<bvh_primitive>& primitives, int start, int end) {
-  // initialize split axis and position
-  auto axis = 0;
-  auto mid  = (start + end) / 2;
-
-  // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++) cbbox = merge(cbbox, primitives[i].center);
-  auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, axis};
-
-  // split along largest
-  if (csize.x >= csize.y && csize.x >= csize.z) axis = 0;
-  if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
-  if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
-
-  // balanced tree split: find the largest axis of the
-  // bounding box and split along this one right in the middle
-  mid = (start + end) / 2;
-  std::nth_element(primitives.data() + start, primitives.data() + mid,
-      primitives.data() + end, [axis](auto& primitive_a, auto& primitive_b) {
-        return primitive_a.center[axis] < primitive_b.center[axis];
-      });
 
-  // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    // throw std::runtime_error("bad bvh split");
-    mid = (start + end) / 2;
+// Intersect a buffer of rays with Embree as a stream. Rays are flagged as
+// coherent, since streams are built from the camera rays of a tile row.
+static void intersect_scene_embree_bvh(const trc::scene* scene,
+    const std::vector<ray3f>& rays, std::vector<intersection3f>& intersections) {
+  auto embree_rays = std::vector<RTCRayHit>(rays.size());
+  for (auto idx = 0; idx < (int)rays.size(); idx++) {
+    auto& ray                = rays[idx];
+    auto& embree_ray         = embree_rays[idx];
+    embree_ray.ray.org_x     = ray.o.x;
+    embree_ray.ray.org_y     = ray.o.y;
+    embree_ray.ray.org_z     = ray.o.z;
+    embree_ray.ray.dir_x     = ray.d.x;
+    embree_ray.ray.dir_y     = ray.d.y;
+    embree_ray.ray.dir_z     = ray.d.z;
+    embree_ray.ray.tnear     = ray.tmin;
+    embree_ray.ray.tfar      = ray.tmax;
+    embree_ray.ray.time      = 0;
+    embree_ray.ray.mask      = (unsigned int)-1;
+    embree_ray.ray.flags     = 0;
+    embree_ray.hit.geomID    = RTC_INVALID_GEOMETRY_ID;
+    embree_ray.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
   }
-
-  return {mid, axis};
-}
-
-// Splits a BVH node using the middle heutirtic. Returns split position and
-// axis.
-static std::pair<int, int> split_middle(
-    std::vector<bvh_primitive>& primitives, int start, int end) {
-  // initialize split axis and position
-  auto axis = 0;
-  auto mid  = (start + end) / 2;
-
-  // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++) cbbox = merge(cbbox, primitives[i].center);
-  auto csize = cbbox.max - cbbox.min;
-  if (csize == zero3f) return {mid, axis};
-
-  // split along largest
-  if (csize.x >= csize.y && csize.x >= csize.z) axis = 0;
-  if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
-  if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
-
-  // split the space in the middle along the largest axis
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [axis, middle = center(cbbox)[axis]](auto& primitive) {
-                    return primitive.center[axis] < middle;
-                  }) -
-              primitives.data());
-
-  // if we were not able to split, just break the primitives in half
-  if (mid == start || mid == end) {
-    // throw std::runtime_error("bad bvh split");
-    mid = (start + end) / 2;
+  RTCIntersectContext embree_ctx;
+  rtcInitIntersectContext(&embree_ctx);
+  embree_ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+  rtcIntersect1M(scene->embree_bvh, &embree_ctx, embree_rays.data(),
+      (unsigned int)embree_rays.size(), sizeof(RTCRayHit));
+  for (auto idx = 0; idx < (int)rays.size(); idx++) {
+    auto& embree_ray   = embree_rays[idx];
+    auto& intersection = intersections[idx];
+    intersection.hit   = embree_ray.hit.geomID != RTC_INVALID_GEOMETRY_ID;
+    if (!intersection.hit) continue;
+    auto& ids             = scene->embree_instances[embree_ray.hit.instID[0]];
+    intersection.object   = ids.x;
+    intersection.instance = ids.y;
+    intersection.element  = (int)embree_ray.hit.primID;
+    intersection.uv       = {embree_ray.hit.u, embree_ray.hit.v};
+    intersection.distance = embree_ray.ray.tfar;
   }
+}
 
-  return {mid, axis};
+static bool occluded_scene_embree_bvh(
+    const trc::scene* scene, const ray3f& ray, float time) {
+  RTCRay embree_ray;
+  embree_ray.org_x = ray.o.x;
+  embree_ray.org_y = ray.o.y;
+  embree_ray.org_z = ray.o.z;
+  embree_ray.dir_x = ray.d.x;
+  embree_ray.dir_y = ray.d.y;
+  embree_ray.dir_z = ray.d.z;
+  embree_ray.tnear = ray.tmin;
+  embree_ray.tfar  = ray.tmax;
+  embree_ray.time  = time;
+  embree_ray.flags = 0;
+  RTCIntersectContext embree_ctx;
+  rtcInitIntersectContext(&embree_ctx);
+  rtcOccluded1(scene->embree_bvh, &embree_ctx, &embree_ray);
+  // tfar is set to -inf on hit
+  return embree_ray.tfar < 0;
 }
+#endif
 
-// Split bvh nodes according to a type
-static std::pair<int, int> split_nodes(
-    std::vector<bvh_primitive>& primitives, int start, int end, bvh_type type) {
+// Split heuristic used by the builder for a bvh type
+static yshp::bvh_split get_bvh_split(bvh_type type) {
   switch (type) {
-    case bvh_type::default_: return split_middle(primitives, start, end);
-    case bvh_type::highquality: return split_sah(primitives, start, end);
-    case bvh_type::middle: return split_middle(primitives, start, end);
-    case bvh_type::balanced: return split_balanced(primitives, start, end);
+    case bvh_type::default_: return yshp::bvh_split::middle;
+    case bvh_type::highquality: return yshp::bvh_split::sah;
+    case bvh_type::middle: return yshp::bvh_split::middle;
+    case bvh_type::balanced: return yshp::bvh_split::balanced;
+    case bvh_type::wide4: return yshp::bvh_split::middle;
+    case bvh_type::wide8: return yshp::bvh_split::middle;
+    case bvh_type::compressed: return yshp::bvh_split::middle;
     default: throw std::runtime_error("should not have gotten here");
   }
 }
 
-// Maximum number of primitives per BVH node.
-const int bvh_max_prims = 4;
-
-// Build BVH nodes
-static void build_bvh_serial(std::vector<bvh_node>& nodes,
-    std::vector<bvh_primitive>& primitives, bvh_type type) {
-  // prepare to build nodes
-  nodes.clear();
-  nodes.reserve(primitives.size() * 2);
-
-  // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
-  nodes.emplace_back();
+// Surface area heuristic costs of all bvh subtrees, each normalized by the
+// area of its root, so that the first one is the cost of the whole bvh.
+static std::vector<float> compute_bvh_costs(const std::vector<bvh_node>& nodes) {
+  auto area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return 1e-12f + size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+  auto costs = std::vector<float>(nodes.size());
+  for (auto nodeid = (int)nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = nodes[nodeid];
+    if (node.internal) {
+      auto& left    = nodes[node.start + 0];
+      auto& right   = nodes[node.start + 1];
+      costs[nodeid] = 1 + (area(left.bbox) * costs[node.start + 0] +
+                              area(right.bbox) * costs[node.start + 1]) /
+                              area(node.bbox);
+    } else {
+      costs[nodeid] = node.num;
+    }
+  }
+  return costs;
+}
 
-  // create nodes until the queue is empty
-  while (!queue.empty()) {
-    // grab node to work on
-    auto next = queue.front();
-    queue.pop_front();
-    auto nodeid = next.x, start = next.y, end = next.z;
+// Number of subtrees whose top tree is rebuilt in partial rebuilds.
+const int bvh_partial_subtrees = 1024;
+
+// Initialize the costs used to choose bvh updates, and pick the subtrees
+// reused by partial rebuilds, by opening nodes with too many primitives.
+static void init_bvh_costs(bvh_tree* bvh) {
+  auto& nodes = bvh->nodes;
+  bvh->cost   = 0;
+  bvh->subtrees.clear();
+  bvh->subtree_costs.clear();
+  if (nodes.empty()) return;
+
+  // count primitives in each subtree, since children follow their parents
+  auto counts = std::vector<int>(nodes.size());
+  for (auto nodeid = (int)nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node     = nodes[nodeid];
+    counts[nodeid] = node.internal
+                         ? counts[node.start + 0] + counts[node.start + 1]
+                         : node.num;
+  }
 
-    // grab node
+  // pick subtrees
+  auto costs     = compute_bvh_costs(nodes);
+  auto max_count = max(counts[0] / bvh_partial_subtrees, bvh_max_prims);
+  auto stack     = std::vector<int>{0};
+  while (!stack.empty()) {
+    auto nodeid = stack.back();
+    stack.pop_back();
     auto& node = nodes[nodeid];
-
-    // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, primitives[i].bbox);
-
-    // split into two children
-    if (end - start > bvh_max_prims) {
-      // get split
-      auto [mid, axis] = split_nodes(primitives, start, end, type);
-
-      // make an internal node
-      node.internal = true;
-      node.axis     = axis;
-      node.num      = 2;
-      node.start    = (int)nodes.size();
-      nodes.emplace_back();
-      nodes.emplace_back();
-      queue.push_back({node.start + 0, start, mid});
-      queue.push_back({node.start + 1, mid, end});
+    if (!node.internal || counts[nodeid] <= max_count) {
+      bvh->subtrees.push_back(nodeid);
+      bvh->subtree_costs.push_back(costs[nodeid]);
     } else {
-      // Make a leaf node
-      node.internal = false;
-      node.num      = end - start;
-      node.start    = start;
+      stack.push_back(node.start + 0);
+      stack.push_back(node.start + 1);
     }
   }
-
-  // cleanup
-  nodes.shrink_to_fit();
+  bvh->cost = costs[0];
 }
 
-#if 0
+// Rebuild the top of a bvh over its refit subtrees, that are kept as is.
+// This is effective when parts of a shape move rigidly with respect to each
+// other, as for skinned meshes.
+static void rebuild_bvh_top(bvh_tree* bvh, bvh_type type) {
+  auto& nodes    = bvh->nodes;
+  auto& subtrees = bvh->subtrees;
 
-// Build BVH nodes
-static void build_bvh_parallel(
-    const shared_ptr<bvh_tree>& bvh, std::vector<bbox3f>& bboxes, bvh_type type) {
-  // get values
-  auto& nodes      = bvh->nodes;
-  auto& primitives = bvh->primitives;
+  // build the top tree with one subtree per leaf
+  auto primitives = std::vector<bvh_primitive>{};
+  for (auto idx = 0; idx < subtrees.size(); idx++) {
+    auto& primitive     = primitives.emplace_back();
+    primitive.bbox      = nodes[subtrees[idx]].bbox;
+    primitive.center    = center(primitive.bbox);
+    primitive.primitive = {idx, 0};
+  }
+  auto top_nodes = std::vector<bvh_node>{};
+  yshp::build_bvh_nodes(top_nodes, primitives, get_bvh_split(type), 1);
+
+  // replace top leaves with subtrees, copying subtree nodes after their parent
+  auto queue = std::deque<vec2i>{};
+  for (auto nodeid = 0; nodeid < top_nodes.size(); nodeid++) {
+    auto& node = top_nodes[nodeid];
+    if (node.internal) continue;
+    auto subtree      = primitives[node.start].primitive.x;
+    queue.push_back({nodeid, subtrees[subtree]});
+    subtrees[subtree] = nodeid;
+  }
+  top_nodes.reserve(nodes.size());
+  while (!queue.empty()) {
+    auto [nodeid, old_nodeid] = queue.front();
+    queue.pop_front();
+    auto node = nodes[old_nodeid];
+    if (node.internal) {
+      auto old_start = node.start;
+      node.start     = (int)top_nodes.size();
+      top_nodes.emplace_back();
+      top_nodes.emplace_back();
+      queue.push_back({node.start + 0, old_start + 0});
+      queue.push_back({node.start + 1, old_start + 1});
+    }
+    top_nodes[nodeid] = node;
+  }
+  nodes = std::move(top_nodes);
+}
 
-  // prepare to build nodes
-  nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
+// Maximum ratio between the current and the build SAH costs of a bvh.
+const float bvh_max_cost_ratio = 1.3f;
+
+// Update a bvh with new primitive bounds. The bvh is refit if its SAH cost
+// did not degrade too much since it was built. Otherwise, if the subtrees
+// used for partial rebuilds kept their quality, only the top of the tree is
+// rebuilt. Returns false if the bvh needs a full rebuild.
+static bool update_bvh(
+    bvh_tree* bvh, const std::vector<bbox3f>& bboxes, bvh_type type) {
+  // refit
+  yshp::refit_bvh_nodes(bvh->nodes, bboxes);
+  auto costs = compute_bvh_costs(bvh->nodes);
+  if (costs.empty() || costs[0] <= bvh->cost * bvh_max_cost_ratio) {
+    bvh->stats.refits += 1;
+    return true;
+  }
 
-  // prepare primitives
-  bvh->primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh->primitives[idx] = idx;
+  // check subtrees quality, weighting their costs by their area
+  if (bvh->subtrees.size() <= 2) return false;
+  auto area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return 1e-12f + size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+  auto subtrees_cost = 0.0f, build_cost = 0.0f;
+  for (auto idx = 0; idx < bvh->subtrees.size(); idx++) {
+    auto subtree = bvh->subtrees[idx];
+    auto weight  = area(bvh->nodes[subtree].bbox);
+    subtrees_cost += weight * costs[subtree];
+    build_cost += weight * bvh->subtree_costs[idx];
+  }
+  if (subtrees_cost > build_cost * bvh_max_cost_ratio) return false;
 
-  // prepare centers
-  auto centers = std::vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+  // partial rebuild, that becomes the reference for later refits
+  rebuild_bvh_top(bvh, type);
+  bvh->cost = compute_bvh_costs(bvh->nodes)[0];
+  bvh->stats.partials += 1;
+  return true;
+}
 
-  // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
-  nodes.emplace_back();
+// Collapse a binary bvh into a wide bvh with up to N children per node.
+// At each node, the internal child with the largest surface area is
+// replaced by its children until the node is full.
+template <int N>
+static void collapse_bvh(
+    std::vector<bvh_wide_node<N>>& wnodes, const std::vector<bvh_node>& nodes) {
+  // prepare nodes
+  wnodes.clear();
+  if (nodes.empty()) return;
+  wnodes.reserve(nodes.size() / (N - 1) + 1);
+
+  // surface area for choosing which child to open
+  auto area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
 
-  // synchronization
-  std::atomic<int>          num_processed_prims(0);
-  std::mutex                queue_mutex;
-  std::vector<std::future<void>> futures;
-  auto                      nthreads = std::thread::hardware_concurrency();
+  // queue up the root, as a wide node index and a binary node index
+  auto queue = std::deque<vec2i>{{0, 0}};
+  wnodes.emplace_back();
 
   // create nodes until the queue is empty
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&nodes, &primitives, &bboxes, &centers, &type,
-                                &num_processed_prims, &queue_mutex, &queue] {
-          while (true) {
-            // exit if needed
-            if (num_processed_prims >= primitives.size()) return;
-
-            // grab node to work on
-            auto next = zero3i;
-            {
-              std::lock_guard<std::mutex> lock{queue_mutex};
-              if (!queue.empty()) {
-                next = queue.front();
-                queue.pop_front();
-              }
-            }
+  while (!queue.empty()) {
+    auto [wnodeid, nodeid] = queue.front();
+    queue.pop_front();
 
-            // wait a bit if needed
-            if (next == zero3i) {
-              std::this_thread::sleep_for(std::chrono::microseconds(10));
-              continue;
-            }
+    // gather children by opening the largest internal ones
+    int  children[N];
+    auto count = 0;
+    if (nodes[nodeid].internal) {
+      children[count++] = nodes[nodeid].start + 0;
+      children[count++] = nodes[nodeid].start + 1;
+    } else {
+      children[count++] = nodeid;
+    }
+    while (count < N) {
+      auto best = -1;
+      for (auto idx = 0; idx < count; idx++) {
+        auto& child = nodes[children[idx]];
+        if (!child.internal) continue;
+        if (best < 0 || area(child.bbox) > area(nodes[children[best]].bbox))
+          best = idx;
+      }
+      if (best < 0) break;
+      auto& child       = nodes[children[best]];
+      children[best]    = child.start + 0;
+      children[count++] = child.start + 1;
+    }
 
-            // grab node
-            auto  nodeid = next.x, start = next.y, end = next.z;
-            auto& node = nodes[nodeid];
-
-            // compute bounds
-            node.bbox = invalidb3f;
-            for (auto i = start; i < end; i++)
-              node.bbox = merge(node.bbox, bboxes[primitives[i]]);
-
-            // split into two children
-            if (end - start > bvh_max_prims) {
-              // get split
-              auto [mid, axis] = split_nodes(
-                  primitives, bboxes, centers, start, end, type);
-
-              // make an internal node
-              {
-                std::lock_guard<std::mutex> lock{queue_mutex};
-                node.internal = true;
-                node.axis     = axis;
-                node.num      = 2;
-                node.start    = (int)nodes.size();
-                nodes.emplace_back();
-                nodes.emplace_back();
-                queue.push_back({node.start + 0, start, mid});
-                queue.push_back({node.start + 1, mid, end});
-              }
-            } else {
-              // Make a leaf node
-              node.internal = false;
-              node.num      = end - start;
-              node.start    = start;
-              num_processed_prims += node.num;
-            }
-          }
-        }));
+    // make wide node
+    auto wnode = bvh_wide_node<N>{};
+    for (auto idx = 0; idx < N; idx++) {
+      auto bbox          = idx < count ? nodes[children[idx]].bbox : invalidb3f;
+      wnode.min_x[idx]   = bbox.min.x;
+      wnode.min_y[idx]   = bbox.min.y;
+      wnode.min_z[idx]   = bbox.min.z;
+      wnode.max_x[idx]   = bbox.max.x;
+      wnode.max_y[idx]   = bbox.max.y;
+      wnode.max_z[idx]   = bbox.max.z;
+      wnode.start[idx]    = 0;
+      wnode.num[idx]      = 0;
+      wnode.internal[idx] = false;
+      if (idx >= count) continue;
+      auto& child = nodes[children[idx]];
+      if (child.internal) {
+        wnode.internal[idx] = true;
+        wnode.start[idx]    = (int)wnodes.size();
+        queue.push_back({(int)wnodes.size(), children[idx]});
+        wnodes.emplace_back();
+      } else {
+        wnode.start[idx] = child.start;
+        wnode.num[idx]   = child.num;
+      }
+    }
+    wnodes[wnodeid] = wnode;
   }
-  for (auto& f : futures) f.get();
 
   // cleanup
-  nodes.shrink_to_fit();
+  wnodes.shrink_to_fit();
 }
 
-#endif
+// Collapse the bvh according to its type
+static void collapse_bvh(bvh_tree* bvh, bvh_type type) {
+  bvh->nodes4.clear();
+  bvh->nodes8.clear();
+  if (type == bvh_type::wide4) collapse_bvh(bvh->nodes4, bvh->nodes);
+  if (type == bvh_type::wide8) collapse_bvh(bvh->nodes8, bvh->nodes);
+}
+
+// Quantize a child bounds relative to its parent bounds, rounding
+// conservatively. Returns the dequantized child bounds.
+static bbox3f quantize_bbox(byte* qbounds, const bbox3f& bbox,
+    const bbox3f& parent) {
+  auto qbbox = bbox3f{};
+  for (auto axis = 0; axis < 3; axis++) {
+    auto extent = parent.max[axis] - parent.min[axis];
+    auto scale  = extent > 0 ? 255 / extent : 0.0f;
+    auto qmin   = clamp((int)((bbox.min[axis] - parent.min[axis]) * scale),
+        0, 255);
+    auto qmax   = clamp(
+        (int)std::ceil((bbox.max[axis] - parent.min[axis]) * scale), 0, 255);
+    while (qmin > 0 &&
+           parent.min[axis] + qmin * (extent / 255) > bbox.min[axis])
+      qmin--;
+    while (qmax < 255 &&
+           parent.min[axis] + qmax * (extent / 255) < bbox.max[axis])
+      qmax++;
+    qbounds[axis + 0] = (byte)qmin;
+    qbounds[axis + 3] = (byte)qmax;
+    qbbox.min[axis]   = parent.min[axis] + qmin * (extent / 255);
+    qbbox.max[axis]   = qmax == 255 ? parent.max[axis]
+                                    : parent.min[axis] + qmax * (extent / 255);
+  }
+  return qbbox;
+}
+
+// Dequantize a child bounds relative to its parent bounds.
+static bbox3f dequantize_bbox(const byte* qbounds, const bbox3f& parent) {
+  auto extent = (parent.max - parent.min) / 255;
+  auto qbbox  = bbox3f{};
+  for (auto axis = 0; axis < 3; axis++) {
+    qbbox.min[axis] = parent.min[axis] + qbounds[axis + 0] * extent[axis];
+    qbbox.max[axis] = qbounds[axis + 3] == 255
+                          ? parent.max[axis]
+                          : parent.min[axis] + qbounds[axis + 3] * extent[axis];
+  }
+  return qbbox;
+}
 
-// Update bvh
-static void update_bvh(bvh_tree* bvh, const std::vector<bbox3f>& bboxes) {
-  for (auto nodeid = (int)bvh->nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh->nodes[nodeid];
-    node.bbox  = invalidb3f;
+// Compress a binary bvh and release its binary nodes. Children bounds are
+// quantized relative to the dequantized parent bounds, so that errors do not
+// accumulate down the tree.
+static void compress_bvh(bvh_tree* bvh, bvh_type type) {
+  bvh->cnodes.clear();
+  if (type != bvh_type::compressed || bvh->nodes.empty()) return;
+  auto& nodes = bvh->nodes;
+  bvh->cnodes.resize(nodes.size());
+  bvh->cbbox = nodes[0].bbox;
+
+  // visit nodes top down with their dequantized bounds
+  auto stack = std::vector<std::pair<int, bbox3f>>{{0, bvh->cbbox}};
+  while (!stack.empty()) {
+    auto [nodeid, bbox] = stack.back();
+    stack.pop_back();
+    auto& node  = nodes[nodeid];
+    auto& cnode = bvh->cnodes[nodeid];
+    cnode.data  = ((uint32_t)node.start << 3) | ((uint32_t)node.axis << 1) |
+                 (node.internal ? 1 : 0);
     if (node.internal) {
       for (auto idx = 0; idx < 2; idx++) {
-        node.bbox = merge(node.bbox, bvh->nodes[node.start + idx].bbox);
+        auto qbbox = quantize_bbox(
+            cnode.bounds + idx * 6, nodes[node.start + idx].bbox, bbox);
+        stack.push_back({node.start + idx, qbbox});
       }
     } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        node.bbox = merge(node.bbox, bboxes[node.start + idx]);
+      cnode.bounds[0] = (byte)node.num;
+    }
+  }
+
+  // release binary nodes
+  bvh->nodes.clear();
+  bvh->nodes.shrink_to_fit();
+}
+
+// Bounds of a bvh
+static bbox3f get_bvh_bounds(const bvh_tree* bvh) {
+  if (!bvh->cnodes.empty()) return bvh->cbbox;
+  if (!bvh->nodes.empty()) return bvh->nodes[0].bbox;
+  return invalidb3f;
+}
+
+// Check if a bvh is empty
+static bool is_bvh_empty(const bvh_tree* bvh) {
+  return bvh->nodes.empty() && bvh->cnodes.empty();
+}
+
+// Version of the bvh cache format, that is part of the cache key.
+const uint64_t bvh_cache_version = 1;
+
+// Hash bytes with FNV-1a.
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const byte*)data;
+  for (auto i = (size_t)0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_bytes(uint64_t hash, const std::vector<T>& values) {
+  auto size = (uint64_t)values.size();
+  hash      = hash_bytes(hash, &size, sizeof(size));
+  return hash_bytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+// Hash of the shape content and bvh type, used as the bvh cache key.
+static uint64_t get_bvh_cache_key(const trc::shape* shape, bvh_type type) {
+  auto hash = 0xcbf29ce484222325ull;
+  hash      = hash_bytes(hash, &bvh_cache_version, sizeof(bvh_cache_version));
+  hash      = hash_bytes(hash, &type, sizeof(type));
+  hash      = hash_bytes(hash, shape->points);
+  hash      = hash_bytes(hash, shape->lines);
+  hash      = hash_bytes(hash, shape->beziers);
+  hash      = hash_bytes(hash, shape->triangles);
+  hash      = hash_bytes(hash, shape->quads);
+  hash      = hash_bytes(hash, shape->positions);
+  hash      = hash_bytes(hash, shape->radius);
+  hash      = hash_bytes(hash, &shape->cbounds, sizeof(shape->cbounds));
+  hash      = hash_bytes(hash, shape->cpositions);
+  hash      = hash_bytes(hash, shape->ctriangles);
+  return hash;
+}
+
+// Bvh cache filename for a key.
+static std::string get_bvh_cache_filename(
+    const std::string& dirname, uint64_t key) {
+  char name[64];
+  snprintf(name, sizeof(name), "bvh-%016llx.bin", (unsigned long long)key);
+  return dirname + "/" + name;
+}
+
+// Load a shape bvh from the cache. Returns false if not found or invalid.
+static bool load_bvh_cache(
+    const std::string& filename, uint64_t key, bvh_tree* bvh) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto read_value = [fs](auto& value) {
+    return fread(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto read_values = [fs, &read_value](auto& values) {
+    auto size = (uint64_t)0;
+    if (!read_value(size)) return false;
+    values.resize(size);
+    if (!size) return true;
+    return fread(values.data(), sizeof(values[0]), size, fs) == size;
+  };
+  auto magic = std::array<char, 4>{}, stored = std::array<char, 4>{};
+  auto stored_key = (uint64_t)0;
+  memcpy(magic.data(), "YBVH", 4);
+  if (!read_value(stored) || stored != magic) return false;
+  if (!read_value(stored_key) || stored_key != key) return false;
+  if (!read_values(bvh->nodes)) return false;
+  if (!read_values(bvh->primitives)) return false;
+  if (!read_values(bvh->nodes4)) return false;
+  if (!read_values(bvh->nodes8)) return false;
+  if (!read_values(bvh->cnodes)) return false;
+  if (!read_value(bvh->cbbox)) return false;
+  init_bvh_costs(bvh);
+  return true;
+}
+
+// Save a shape bvh to the cache. The file is written to a temporary and then
+// renamed, so that concurrent renders never read partial files.
+static bool save_bvh_cache(
+    const std::string& filename, uint64_t key, const bvh_tree* bvh) {
+  auto thread  = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto tmpname = filename + "." + std::to_string(common::get_time()) + "." +
+                 std::to_string(thread) + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) return false;
+  auto write_value = [fs](const auto& value) {
+    return fwrite(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto write_values = [fs, &write_value](const auto& values) {
+    auto size = (uint64_t)values.size();
+    if (!write_value(size)) return false;
+    if (!size) return true;
+    return fwrite(values.data(), sizeof(values[0]), size, fs) == size;
+  };
+  auto ok = fwrite("YBVH", 4, 1, fs) == 1 && write_value(key) &&
+            write_values(bvh->nodes) && write_values(bvh->primitives) &&
+            write_values(bvh->nodes4) && write_values(bvh->nodes8) &&
+            write_values(bvh->cnodes) && write_value(bvh->cbbox);
+  ok = fclose(fs) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Heightfield cells are grouped in square blocks at the finest mip level.
+// Blocks double in size at each level, up to a single one.
+static const auto heightfield_block = 2;
+
+// Build the min/max mipmap of a heightfield
+static void init_heightfield_mips(trc::shape* shape) {
+  auto& heightfield = shape->heightfield;
+  auto& mips        = shape->heightfield_mips;
+  auto  cells       = heightfield.size() - 1;
+  mips.clear();
+  if (cells.x < 1 || cells.y < 1) return;
+  auto blocks = (cells + heightfield_block - 1) / heightfield_block;
+  auto level  = img::image<vec2f>{blocks};
+  common::parallel_for(blocks.y, [&](int bj) {
+    for (auto bi = 0; bi < blocks.x; bi++) {
+      auto minmax = vec2f{flt_max, -flt_max};
+      auto start  = vec2i{bi, bj} * heightfield_block;
+      auto end    = min(start + heightfield_block, cells);
+      for (auto j = start.y; j <= end.y; j++) {
+        for (auto i = start.x; i <= end.x; i++) {
+          auto height = heightfield[{i, j}];
+          minmax      = {min(minmax.x, height), max(minmax.y, height)};
+        }
+      }
+      level[{bi, bj}] = minmax;
+    }
+  });
+  mips.push_back(std::move(level));
+  while (mips.back().size() != vec2i{1, 1}) {
+    auto& prev = mips.back();
+    auto  next = img::image<vec2f>{(prev.size() + 1) / 2};
+    for (auto j = 0; j < next.size().y; j++) {
+      for (auto i = 0; i < next.size().x; i++) {
+        auto minmax = vec2f{flt_max, -flt_max};
+        for (auto k = 0; k < 4; k++) {
+          auto ij = vec2i{i * 2 + k % 2, j * 2 + k / 2};
+          if (!prev.contains(ij)) continue;
+          minmax = {min(minmax.x, prev[ij].x), max(minmax.y, prev[ij].y)};
+        }
+        next[{i, j}] = minmax;
       }
     }
+    mips.push_back(std::move(next));
+  }
+}
+
+// Bounds of a block of heightfield cells at a mip level
+static bbox3f get_heightfield_bounds(
+    const trc::shape* shape, int level, const vec2i& ij) {
+  auto width  = shape->heightfield.size().x;
+  auto cells  = shape->heightfield.size() - 1;
+  auto start  = ij * (heightfield_block << level);
+  auto end    = min(start + (heightfield_block << level), cells);
+  auto p0     = get_heightfield_position(shape, start.y * width + start.x);
+  auto p1     = get_heightfield_position(shape, end.y * width + end.x);
+  auto minmax = shape->heightfield_mips[level][ij];
+  return {{p0.x, minmax.x, p1.z}, {p1.x, minmax.y, p0.z}};
+}
+
+// Store the triangles or quads of a shape in bvh leaf order, with their
+// edges precomputed, or their vertices for watertight intersection.
+static void init_bvh_triangles(trc::shape* shape, const trace_params& params) {
+  auto bvh = shape->bvh;
+  bvh->triangles.clear();
+  bvh->watertight = params.watertight;
+  if (!params.bvh_triangles && !params.watertight) return;
+  auto& positions = shape->positions;
+  auto  make_triangle = [&params](const vec3f& p0, const vec3f& p1,
+                           const vec3f& p2) {
+    if (params.watertight) return bvh_triangle{p0, p1, p2};
+    return bvh_triangle{p0, p1 - p0, p2 - p0};
+  };
+  if (has_triangles(shape)) {
+    bvh->triangles.reserve(bvh->primitives.size());
+    for (auto& primitive : bvh->primitives) {
+      auto t = get_triangle(shape, primitive.x);
+      bvh->triangles.push_back(make_triangle(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z)));
+    }
+  } else if (!shape->quads.empty()) {
+    bvh->triangles.reserve(bvh->primitives.size() * 2);
+    for (auto& primitive : bvh->primitives) {
+      auto& q = shape->quads[primitive.x];
+      bvh->triangles.push_back(
+          make_triangle(positions[q.x], positions[q.y], positions[q.w]));
+      bvh->triangles.push_back(
+          q.z == q.w ? bvh_triangle{positions[q.x], positions[q.x],
+                           positions[q.x]}
+                     : make_triangle(
+                           positions[q.z], positions[q.w], positions[q.y]));
+    }
   }
+  bvh->triangles.shrink_to_fit();
 }
 
 static void init_bvh(trc::shape* shape, const trace_params& params) {
@@ -1186,6 +2551,36 @@ static void init_bvh(trc::shape* shape, const trace_params& params) {
   }
 #endif
 
+  // heightfields keep only their bounds in the bvh, since they are
+  // traversed with their mipmap
+  if (!shape->heightfield.empty()) {
+    init_heightfield_mips(shape);
+    if (shape->bvh) delete shape->bvh;
+    shape->bvh = new bvh_tree{};
+    if (shape->heightfield_mips.empty()) return;
+    auto& node    = shape->bvh->nodes.emplace_back();
+    node.bbox     = get_heightfield_bounds(
+        shape, (int)shape->heightfield_mips.size() - 1, {0, 0});
+    node.start    = 0;
+    node.num      = 1;
+    node.internal = false;
+    node.axis     = 0;
+    shape->bvh->primitives.push_back({0, 3});
+    return;
+  }
+
+  // load bvh from cache
+  auto cache_key      = (uint64_t)0;
+  auto cache_filename = std::string{};
+  if (!params.bvh_cache.empty()) {
+    cache_key      = get_bvh_cache_key(shape, params.bvh);
+    cache_filename = get_bvh_cache_filename(params.bvh_cache, cache_key);
+    if (shape->bvh) delete shape->bvh;
+    shape->bvh = new bvh_tree{};
+    if (load_bvh_cache(cache_filename, cache_key, shape->bvh))
+      return init_bvh_triangles(shape, params);
+  }
+
   // build primitives
   auto primitives = std::vector<bvh_primitive>{};
   if (!shape->points.empty()) {
@@ -1205,12 +2600,23 @@ static void init_bvh(trc::shape* shape, const trace_params& params) {
       primitive.center    = center(primitive.bbox);
       primitive.primitive = {idx, 1};
     }
-  } else if (!shape->triangles.empty()) {
-    for (auto idx = 0; idx < shape->triangles.size(); idx++) {
+  } else if (!shape->beziers.empty()) {
+    for (auto idx = 0; idx < shape->beziers.size(); idx++) {
+      auto& b             = shape->beziers[idx];
+      auto& primitive     = primitives.emplace_back();
+      primitive.bbox      = bezier_bounds(shape->positions[b.x],
+          shape->positions[b.y], shape->positions[b.z], shape->positions[b.w],
+          shape->radius[b.x], shape->radius[b.y], shape->radius[b.z],
+          shape->radius[b.w]);
+      primitive.center    = center(primitive.bbox);
+      primitive.primitive = {idx, 4};
+    }
+  } else if (has_triangles(shape)) {
+    for (auto idx = 0; idx < get_num_triangles(shape); idx++) {
       auto& primitive = primitives.emplace_back();
-      auto& t         = shape->triangles[idx];
-      primitive.bbox  = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+      auto  t         = get_triangle(shape, idx);
+      primitive.bbox  = triangle_bounds(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z));
       primitive.center    = center(primitive.bbox);
       primitive.primitive = {idx, 2};
     }
@@ -1228,26 +2634,240 @@ static void init_bvh(trc::shape* shape, const trace_params& params) {
   // build nodes
   if (shape->bvh) delete shape->bvh;
   shape->bvh = new bvh_tree{};
-  build_bvh_serial(shape->bvh->nodes, primitives, params.bvh);
+  yshp::build_bvh_nodes(
+      shape->bvh->nodes, primitives, get_bvh_split(params.bvh));
+  init_bvh_costs(shape->bvh);
+  collapse_bvh(shape->bvh, params.bvh);
+  compress_bvh(shape->bvh, params.bvh);
 
   // set bvh primitives
   shape->bvh->primitives.reserve(primitives.size());
   for (auto& primitive : primitives) {
     shape->bvh->primitives.push_back(primitive.primitive);
   }
+  init_bvh_triangles(shape, params);
+
+  // save bvh to cache, counting failures since the cache is optional
+  if (!params.bvh_cache.empty()) {
+    if (!save_bvh_cache(cache_filename, cache_key, shape->bvh))
+      cache_failures += 1;
+  }
+}
+
+// Precompute the element normals and tangents of a triangle or quad shape.
+// Values are computed with the cache cleared, so they match the ones
+// evaluated without it.
+static void init_shading_cache(
+    trc::shape* shape, bool normals, bool tangents) {
+  shape->element_normals.clear();
+  shape->element_tangents.clear();
+  auto num = has_triangles(shape) ? get_num_triangles(shape)
+                                  : (int)shape->quads.size();
+  if (num == 0) return;
+  auto element_normals  = std::vector<vec3f>(normals ? num : 0);
+  auto halves           = shape->quads.empty() ? 1 : 2;
+  auto element_tangents = std::vector<std::pair<vec3f, vec3f>>(
+      tangents ? num * halves : 0);
+  common::parallel_for(0, num, 4096, [&](int idx) {
+    if (normals) element_normals[idx] = eval_normal(shape, idx);
+    if (tangents && halves == 1) {
+      element_tangents[idx] = eval_tangents(shape, idx, {0, 0});
+    } else if (tangents) {
+      element_tangents[idx * 2 + 0] = eval_tangents(shape, idx, {0, 0});
+      element_tangents[idx * 2 + 1] = eval_tangents(shape, idx, {1, 1});
+    }
+  });
+  shape->element_normals  = std::move(element_normals);
+  shape->element_tangents = std::move(element_tangents);
+}
+
+// Precompute the shading data of faceted and normal-mapped shapes
+static void init_shading_cache(trc::scene* scene, const trace_params& params) {
+  auto flags = std::unordered_map<trc::shape*, vec2i>{};
+  for (auto shape : scene->shapes) flags[shape] = {0, 0};
+  if (params.shading_cache) {
+    for (auto object : scene->objects) {
+      auto shape = object->shape;
+      if (!has_triangles(shape) && shape->quads.empty()) continue;
+      auto  normal_mapped = object->material->normal_tex != nullptr;
+      auto& flag          = flags[shape];
+      if (!has_normals(shape) || normal_mapped) flag.x = 1;
+      if (normal_mapped && shape->tangents.empty()) flag.y = 1;
+    }
+  }
+  common::parallel_for((int)scene->shapes.size(), [&](int idx) {
+    auto shape = scene->shapes[idx];
+    auto flag  = flags.at(shape);
+    init_shading_cache(shape, flag.x != 0, flag.y != 0);
+  });
+}
+
+// Forward declaration
+static void init_scene_bvh(trc::scene* scene, const trace_params& params);
+
+// Compile the flattened scene layout
+void init_layout(trc::scene* scene) {
+  // element indices
+  auto shape_ids    = std::unordered_map<const trc::shape*, int>{};
+  auto material_ids = std::unordered_map<const trc::material*, int>{};
+  for (auto idx = 0; idx < scene->shapes.size(); idx++)
+    shape_ids[scene->shapes[idx]] = idx;
+  for (auto idx = 0; idx < scene->materials.size(); idx++)
+    material_ids[scene->materials[idx]] = idx;
+
+  // instances
+  auto& layout = scene->layout;
+  layout       = {};
+  layout.offsets.reserve(scene->objects.size());
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto object = scene->objects[object_id];
+    layout.offsets.push_back((int)layout.instances.size());
+    for (auto instance_id = 0; instance_id < object->instance->frames.size();
+         instance_id++) {
+      auto frame = object->instance->frames[instance_id] * object->frame;
+      layout.instances.push_back({object_id, instance_id});
+      layout.frames.push_back(frame);
+      layout.inv_frames.push_back(inverse(frame, true));
+      layout.shapes.push_back(shape_ids.at(object->shape));
+      layout.materials.push_back(material_ids.at(object->material));
+      layout.moving.push_back(!object->instance->motion.empty());
+    }
+  }
+}
+
+// Interleave the pages of a buffer over the NUMA nodes.
+template <typename T>
+static void interleave_memory(const std::vector<T>& values) {
+  common::interleave_memory(values.data(), values.size() * sizeof(T));
+}
+template <typename T>
+static void interleave_memory(const img::image<T>& image) {
+  common::interleave_memory(image.data(), image.count() * sizeof(T));
+}
+static void interleave_memory(const bvh_tree* bvh) {
+  if (!bvh) return;
+  interleave_memory(bvh->nodes);
+  interleave_memory(bvh->primitives);
+  interleave_memory(bvh->nodes4);
+  interleave_memory(bvh->nodes8);
+  interleave_memory(bvh->cnodes);
+  interleave_memory(bvh->triangles);
+}
+
+// Interleave the read-only buffers of shapes and textures over the NUMA
+// nodes, since they were first touched by the loading thread and are read
+// by the render threads of all nodes.
+static void interleave_scene_memory(const trc::scene* scene) {
+  for (auto shape : scene->shapes) {
+    interleave_memory(shape->points);
+    interleave_memory(shape->lines);
+    interleave_memory(shape->beziers);
+    interleave_memory(shape->triangles);
+    interleave_memory(shape->quads);
+    interleave_memory(shape->positions);
+    interleave_memory(shape->normals);
+    interleave_memory(shape->texcoords);
+    interleave_memory(shape->colors);
+    interleave_memory(shape->radius);
+    interleave_memory(shape->tangents);
+    interleave_memory(shape->element_normals);
+    interleave_memory(shape->element_tangents);
+    interleave_memory(shape->heightfield);
+    interleave_memory(shape->cpositions);
+    interleave_memory(shape->cnormals);
+    interleave_memory(shape->ctexcoords);
+    interleave_memory(shape->ctriangles);
+    for (auto& mip : shape->heightfield_mips) interleave_memory(mip);
+    interleave_memory(shape->bvh);
+  }
+  for (auto texture : scene->textures) {
+    interleave_memory(texture->colorf);
+    interleave_memory(texture->colorh);
+    interleave_memory(texture->colorb);
+    interleave_memory(texture->scalarf);
+    interleave_memory(texture->scalarh);
+    interleave_memory(texture->scalarb);
+    for (auto& mip : texture->colorf_mips) interleave_memory(mip);
+    for (auto& mip : texture->colorh_mips) interleave_memory(mip);
+    for (auto& mip : texture->colorb_mips) interleave_memory(mip);
+    for (auto& mip : texture->scalarf_mips) interleave_memory(mip);
+    for (auto& mip : texture->scalarh_mips) interleave_memory(mip);
+    for (auto& mip : texture->scalarb_mips) interleave_memory(mip);
+  }
 }
 
 void init_bvh(trc::scene* scene, const trace_params& params,
     progress_callback progress_cb) {
+  auto timer = counter_timer{trace_counter::bvh_time};
+
+  // flattened layout
+  init_layout(scene);
+
+  // shading data
+  init_shading_cache(scene, params);
+
   // handle progress
   auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
 
-  // shapes
+  // create the bvh cache directory on first use, leaving failures to be
+  // counted when saving
+  if (!params.bvh_cache.empty()) {
+    auto ec = std::error_code{};
+    sfs::create_directories(params.bvh_cache, ec);
+  }
+
+  // create the embree device before building shapes concurrently
+#ifdef YOCTO_EMBREE
+  if (params.bvh == bvh_type::embree_default ||
+      params.bvh == bvh_type::embree_highquality ||
+      params.bvh == bvh_type::embree_compact) {
+    embree_device();
+  }
+#endif
+
+  // shapes are built concurrently, largest first so that big builds do not
+  // start last; big shapes also partition their nodes in parallel
+  auto order = std::vector<int>(scene->shapes.size());
+  auto sizes = std::vector<size_t>(scene->shapes.size());
   for (auto idx = 0; idx < scene->shapes.size(); idx++) {
-    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
-    init_bvh(scene->shapes[idx], params);
+    auto shape = scene->shapes[idx];
+    order[idx] = idx;
+    sizes[idx] = shape->points.size() + shape->lines.size() +
+                 shape->triangles.size() + shape->quads.size() +
+                 shape->beziers.size() + shape->ctriangles.size() / 3;
+  }
+  std::stable_sort(order.begin(), order.end(),
+      [&sizes](int a, int b) { return sizes[a] > sizes[b]; });
+
+  // with pruning, shapes whose instances are all pruned get empty bvhs
+  auto used = std::unordered_set<const trc::shape*>{};
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto object = scene->objects[object_id];
+    for (auto iidx = 0; iidx < object->instance->frames.size(); iidx++) {
+      if (is_pruned(scene->pruned_instances, object_id, iidx)) continue;
+      used.insert(object->shape);
+      break;
+    }
   }
 
+  auto progress_mutex = std::mutex{};
+  common::parallel_for((int)order.size(), [&](int idx) {
+    if (progress_cb) {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      progress_cb("build shape bvh", progress.x++, progress.y);
+    }
+    auto shape = scene->shapes[order[idx]];
+    if (!scene->pruned_instances.empty() && !used.count(shape)) {
+      if (shape->bvh) delete shape->bvh;
+      shape->bvh = new bvh_tree{};
+      return;
+    }
+    init_bvh(shape, params);
+  });
+
+  // numa placement
+  if (params.numa) interleave_scene_memory(scene);
+
   // embree
 #ifdef YOCTO_EMBREE
   if (params.bvh == bvh_type::embree_default ||
@@ -1260,21 +2880,30 @@ void init_bvh(trc::scene* scene, const trace_params& params,
   // handle progress
   if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
 
+  // scene bvh
+  init_scene_bvh(scene, params);
+  if (params.numa) interleave_memory(scene->bvh);
+
+  // handle progress
+  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+}
+
+static void init_scene_bvh(trc::scene* scene, const trace_params& params) {
   // instance bboxes
   auto primitives            = std::vector<bvh_primitive>{};
   auto object_id             = 0;
   auto empty_instance_frames = std::vector<frame3f>{identity3x4f};
   for (auto object : scene->objects) {
-    auto instance_id = 0;
-    for (auto& frame : object->instance->frames) {
+    for (auto instance_id = 0; instance_id < object->instance->frames.size();
+         instance_id++) {
+      if (is_pruned(scene->pruned_instances, object_id, instance_id)) continue;
       auto& primitive = primitives.emplace_back();
-      primitive.bbox  = object->shape->bvh->nodes.empty()
+      primitive.bbox  = is_bvh_empty(object->shape->bvh)
                            ? invalidb3f
-                           : transform_bbox(frame * object->frame,
-                                 object->shape->bvh->nodes[0].bbox);
+                           : eval_instance_bounds(object, instance_id,
+                                 get_bvh_bounds(object->shape->bvh));
       primitive.center    = center(primitive.bbox);
       primitive.primitive = {object_id, instance_id};
-      instance_id += 1;
     }
     object_id += 1;
   }
@@ -1282,16 +2911,31 @@ void init_bvh(trc::scene* scene, const trace_params& params,
   // build nodes
   if (scene->bvh) delete scene->bvh;
   scene->bvh = new bvh_tree{};
-  build_bvh_serial(scene->bvh->nodes, primitives, params.bvh);
+  yshp::build_bvh_nodes(
+      scene->bvh->nodes, primitives, get_bvh_split(params.bvh));
+  init_bvh_costs(scene->bvh);
+  collapse_bvh(scene->bvh, params.bvh);
+  compress_bvh(scene->bvh, params.bvh);
 
   // set bvh primitives
   scene->bvh->primitives.reserve(primitives.size());
   for (auto& primitive : primitives) {
     scene->bvh->primitives.push_back(primitive.primitive);
   }
+}
 
-  // handle progress
-  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+// Fully rebuild bvhs on update, keeping their update counts.
+static void rebuild_bvh(trc::shape* shape, const trace_params& params) {
+  auto stats = shape->bvh->stats;
+  init_bvh(shape, params);
+  shape->bvh->stats = stats;
+  shape->bvh->stats.rebuilds += 1;
+}
+static void rebuild_bvh(trc::scene* scene, const trace_params& params) {
+  auto stats = scene->bvh->stats;
+  init_scene_bvh(scene, params);
+  scene->bvh->stats = stats;
+  scene->bvh->stats.rebuilds += 1;
 }
 
 static void update_bvh(trc::shape* shape, const trace_params& params) {
@@ -1301,6 +2945,10 @@ static void update_bvh(trc::shape* shape, const trace_params& params) {
   }
 #endif
 
+  // compressed bvhs and heightfields can not be refit
+  if (!shape->bvh->cnodes.empty() || !shape->heightfield.empty())
+    return rebuild_bvh(shape, params);
+
   // build primitives
   auto bboxes = std::vector<bbox3f>(shape->bvh->primitives.size());
   if (!shape->points.empty()) {
@@ -1315,12 +2963,19 @@ static void update_bvh(trc::shape* shape, const trace_params& params) {
       bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
           shape->radius[l.x], shape->radius[l.y]);
     }
-  } else if (!shape->triangles.empty()) {
-    bboxes = std::vector<bbox3f>(shape->triangles.size());
+  } else if (!shape->beziers.empty()) {
+    bboxes = std::vector<bbox3f>(shape->beziers.size());
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& b     = shape->beziers[shape->bvh->primitives[idx].x];
+      bboxes[idx] = bezier_bounds(shape->positions[b.x], shape->positions[b.y],
+          shape->positions[b.z], shape->positions[b.w], shape->radius[b.x],
+          shape->radius[b.y], shape->radius[b.z], shape->radius[b.w]);
+    }
+  } else if (has_triangles(shape)) {
     for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape->triangles[shape->bvh->primitives[idx].x];
-      bboxes[idx] = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+      auto t      = get_triangle(shape, shape->bvh->primitives[idx].x);
+      bboxes[idx] = triangle_bounds(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z));
     }
   } else if (!shape->quads.empty()) {
     bboxes = std::vector<bbox3f>(shape->quads.size());
@@ -1331,8 +2986,11 @@ static void update_bvh(trc::shape* shape, const trace_params& params) {
     }
   }
 
-  // update nodes
-  update_bvh(shape->bvh, bboxes);
+  // update nodes, rebuilding if needed
+  if (!update_bvh(shape->bvh, bboxes, params.bvh))
+    return rebuild_bvh(shape, params);
+  collapse_bvh(shape->bvh, params.bvh);
+  init_bvh_triangles(shape, params);
 }
 
 void update_bvh(trc::scene*            scene,
@@ -1340,7 +2998,13 @@ void update_bvh(trc::scene*            scene,
     const std::vector<trc::shape*>&    updated_shapes,
     const std::vector<trc::instance*>& updated_instances,
     const trace_params&                params) {
+  auto timer = counter_timer{trace_counter::bvh_time};
   for (auto shape : updated_shapes) update_bvh(shape, params);
+  for (auto shape : updated_shapes) {
+    init_shading_cache(shape, !shape->element_normals.empty(),
+        !shape->element_tangents.empty());
+  }
+  init_layout(scene);
 
 #ifdef YOCTO_EMBREE
   if (scene->embree_bvh) {
@@ -1349,76 +3013,408 @@ void update_bvh(trc::scene*            scene,
   }
 #endif
 
+  // compressed bvhs can not be refit
+  if (!scene->bvh->cnodes.empty()) return rebuild_bvh(scene, params);
+
   // build primitives
   auto bboxes = std::vector<bbox3f>(scene->bvh->primitives.size());
   for (auto idx = 0; idx < bboxes.size(); idx++) {
     auto instance = scene->bvh->primitives[idx];
     auto object   = scene->objects[instance.x];
     auto sbvh     = object->shape->bvh;
-    bboxes[idx]   = transform_bbox(
-        object->instance->frames[instance.y] * object->frame,
-        sbvh->nodes[0].bbox);
+    bboxes[idx]   = eval_instance_bounds(
+        object, instance.y, get_bvh_bounds(sbvh));
   }
 
-  // update nodes
-  update_bvh(scene->bvh, bboxes);
+  // update nodes, rebuilding if needed
+  if (!update_bvh(scene->bvh, bboxes, params.bvh))
+    return rebuild_bvh(scene, params);
+  collapse_bvh(scene->bvh, params.bvh);
 }
 
-// Intersect ray with a bvh->
-static bool intersect_shape_bvh(trc::shape* shape, const ray3f& ray_,
-    int& element, vec2f& uv, float& distance, bool find_any) {
-#ifdef YOCTO_EMBREE
-  // call Embree if needed
-  if (shape->embree_bvh) {
-    return intersect_shape_embree_bvh(
-        shape, ray_, element, uv, distance, find_any);
-  }
-#endif
+// Get the bvh update counts.
+bvh_update_stats get_bvh_update_stats(const trc::scene* scene) {
+  auto stats = bvh_update_stats{};
+  auto add   = [&stats](const bvh_tree* bvh) {
+    if (!bvh) return;
+    stats.refits += bvh->stats.refits;
+    stats.partials += bvh->stats.partials;
+    stats.rebuilds += bvh->stats.rebuilds;
+  };
+  add(scene->bvh);
+  for (auto shape : scene->shapes) add(shape->bvh);
+  return stats;
+}
 
-  // get bvh and shape pointers for fast access
+// Intersect the elements of a leaf with a single ray. Updates the ray
+// tmax on hit.
+static bool intersect_shape_leaf(const trc::shape* shape, int start, int num,
+    ray3f& ray, int& element, vec2f& uv) {
+  add_counter(trace_counter::primitives, num);
+  auto hit      = false;
+  auto distance = 0.0f;
+
+  // triangles stored in leaf order, two per quad
   auto bvh = shape->bvh;
+  if (!bvh->triangles.empty()) {
+    auto count = shape->quads.empty() ? 1 : 2;
+    auto tuv   = vec2f{0, 0};
+    for (auto idx = start; idx < start + num; idx++) {
+      for (auto k = 0; k < count; k++) {
+        auto& t = bvh->triangles[idx * count + k];
+        if (bvh->watertight
+                ? !intersect_triangle_watertight(
+                      ray, t.v0, t.v1, t.v2, tuv, distance)
+                : !intersect_triangle_edges(
+                      ray, t.v0, t.v1, t.v2, tuv, distance))
+          continue;
+        hit      = true;
+        element  = bvh->primitives[idx].x;
+        uv       = k ? 1 - tuv : tuv;
+        ray.tmax = distance;
+      }
+    }
+    return hit;
+  }
 
-  // check empty
-  if (bvh->nodes.empty()) return false;
+  for (auto idx = start; idx < start + num; idx++) {
+    auto eid  = shape->bvh->primitives[idx].x;
+    auto ehit = false;
+    if (!shape->points.empty()) {
+      auto& p = shape->points[eid];
+      ehit    = intersect_point(
+          ray, shape->positions[p], shape->radius[p], uv, distance);
+    } else if (!shape->lines.empty()) {
+      auto& l = shape->lines[eid];
+      ehit    = intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+          shape->radius[l.x], shape->radius[l.y], uv, distance);
+    } else if (!shape->beziers.empty()) {
+      auto& b = shape->beziers[eid];
+      ehit    = intersect_bezier(ray, shape->positions[b.x],
+          shape->positions[b.y], shape->positions[b.z], shape->positions[b.w],
+          shape->radius[b.x], shape->radius[b.y], shape->radius[b.z],
+          shape->radius[b.w], uv, distance);
+    } else if (!shape->cpositions.empty()) {
+      auto t = get_triangle(shape, eid);
+      ehit   = intersect_triangle(ray, get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z), uv, distance);
+    } else if (!shape->triangles.empty()) {
+      auto& t = shape->triangles[eid];
+      ehit    = intersect_triangle(ray, shape->positions[t.x],
+          shape->positions[t.y], shape->positions[t.z], uv, distance);
+    } else if (!shape->quads.empty()) {
+      auto& q = shape->quads[eid];
+      ehit    = intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
+          shape->positions[q.z], shape->positions[q.w], uv, distance);
+    }
+    if (ehit) {
+      hit      = true;
+      element  = eid;
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
+// Hits and entry distances of the children of a wide node. Returned by value
+// so that the compiler can vectorize the test over the children.
+template <int N>
+struct bvh_wide_hits {
+  float tnear[N];
+  int   hit[N];
+};
+
+// Intersect a ray with all children bounds of a wide node.
+template <int N>
+static bvh_wide_hits<N> intersect_bbox(
+    const bvh_wide_node<N>& node, const ray3f& ray, const vec3f& ray_dinv) {
+  auto hits = bvh_wide_hits<N>{};
+  for (auto idx = 0; idx < N; idx++) {
+    auto tx0 = (node.min_x[idx] - ray.o.x) * ray_dinv.x;
+    auto tx1 = (node.max_x[idx] - ray.o.x) * ray_dinv.x;
+    auto ty0 = (node.min_y[idx] - ray.o.y) * ray_dinv.y;
+    auto ty1 = (node.max_y[idx] - ray.o.y) * ray_dinv.y;
+    auto tz0 = (node.min_z[idx] - ray.o.z) * ray_dinv.z;
+    auto tz1 = (node.max_z[idx] - ray.o.z) * ray_dinv.z;
+    auto t0  = max(max(min(tx0, tx1), max(min(ty0, ty1), min(tz0, tz1))),
+        ray.tmin);
+    auto t1  = min(min(max(tx0, tx1), min(max(ty0, ty1), max(tz0, tz1))),
+        ray.tmax);
+    hits.hit[idx]   = t0 <= t1 * 1.00000024f;
+    hits.tnear[idx] = t0;
+  }
+  return hits;
+}
 
+// Intersect ray with a wide bvh. Leaves are intersected with `intersect_leaf`,
+// that takes the primitive range and the ray, and shortens the ray on hit.
+// Children are visited front to back, and culled when popped if farther than
+// the closest hit. Leaf children are stored in the stack as negative indices
+// encoding their wide node and slot.
+template <int N, typename Func>
+static bool intersect_wide_bvh(const std::vector<bvh_wide_node<N>>& nodes,
+    ray3f& ray, bool find_any, Func&& intersect_leaf) {
   // node stack
-  int  node_stack[128];
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  int   node_stack[128];
+  float dist_stack[128];
+  auto  node_cur         = 0;
+  node_stack[node_cur]   = 0;
+  dist_stack[node_cur++] = ray.tmin;
 
   // shared variables
   auto hit = false;
 
-  // copy ray to modify it
-  auto ray = ray_;
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur) {
+    // grab entry and cull it if farther than the closest hit
+    node_cur--;
+    if (dist_stack[node_cur] > ray.tmax) continue;
+    auto entry = node_stack[node_cur];
+
+    // intersect leaf
+    if (entry < 0) {
+      auto& node = nodes[(-entry - 1) / N];
+      auto  slot = (-entry - 1) % N;
+      if (intersect_leaf(node.start[slot], (int)node.num[slot], ray)) {
+        hit = true;
+        if (find_any) return hit;
+      }
+      continue;
+    }
+
+    // grab node and intersect children bounds
+    auto& node = nodes[entry];
+    auto  hits = intersect_bbox(node, ray, ray_dinv);
+    add_counter(trace_counter::nodes);
+
+    // push children sorted by decreasing distance
+    auto start = node_cur;
+    for (auto idx = 0; idx < N; idx++) {
+      if (!hits.hit[idx]) continue;
+      auto child = node.internal[idx] ? node.start[idx] : -(entry * N + idx) - 1;
+      auto pos   = node_cur++;
+      while (pos > start && dist_stack[pos - 1] < hits.tnear[idx]) {
+        node_stack[pos] = node_stack[pos - 1];
+        dist_stack[pos] = dist_stack[pos - 1];
+        pos--;
+      }
+      node_stack[pos] = child;
+      dist_stack[pos] = hits.tnear[idx];
+    }
+  }
+
+  return hit;
+}
 
+// Intersect ray with a compressed bvh. Leaves are intersected with
+// `intersect_leaf`, that takes the primitive range and the ray, and shortens
+// the ray on hit. Node bounds are dequantized while descending the tree.
+template <typename Func>
+static bool intersect_compressed_bvh(const bvh_tree* bvh, ray3f& ray,
+    bool find_any, Func&& intersect_leaf) {
   // prepare ray for fast queries
   auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
       (ray_dinv.z < 0) ? 1 : 0};
 
+  // node stack with dequantized bounds
+  int    node_stack[128];
+  bbox3f bbox_stack[128];
+  auto   node_cur = 0;
+  if (!intersect_bbox(ray, ray_dinv, bvh->cbbox)) return false;
+  node_stack[node_cur]   = 0;
+  bbox_stack[node_cur++] = bvh->cbbox;
+
+  // shared variables
+  auto hit = false;
+
   // walking stack
   while (node_cur) {
     // grab node
-    auto& node = bvh->nodes[node_stack[--node_cur]];
+    node_cur--;
+    add_counter(trace_counter::nodes);
+    auto& node  = bvh->cnodes[node_stack[node_cur]];
+    auto  bbox  = bbox_stack[node_cur];
+    auto  start = (int)(node.data >> 3);
+
+    if (node.data & 1) {
+      // intersect children bounds, pushing the farthest first
+      auto axis   = (node.data >> 1) & 3;
+      auto first  = ray_dsign[axis] ? 0 : 1;
+      for (auto idx : {first, 1 - first}) {
+        auto cbbox = dequantize_bbox(node.bounds + idx * 6, bbox);
+        if (!intersect_bbox(ray, ray_dinv, cbbox)) continue;
+        node_stack[node_cur]   = start + idx;
+        bbox_stack[node_cur++] = cbbox;
+      }
+    } else if (intersect_leaf(start, (int)node.bounds[0], ray)) {
+      hit = true;
+      if (find_any) return hit;
+    }
+  }
 
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+  return hit;
+}
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
-    } else if (!shape->points.empty()) {
+// Intersect a ray with a heightfield, traversing its min/max mipmap from
+// the coarsest level. Blocks are visited nearest first along the ray, so
+// that the ray tmax culls most of the farther ones after a hit.
+static bool intersect_heightfield(const trc::shape* shape, const ray3f& ray_,
+    int& element, vec2f& uv, float& distance, bool find_any) {
+  auto& mips  = shape->heightfield_mips;
+  auto  width = shape->heightfield.size().x;
+  auto  cells = shape->heightfield.size() - 1;
+  if (mips.empty()) return false;
+
+  // node stack of mip levels and blocks
+  vec3i node_stack[128];
+  auto  node_cur         = 0;
+  node_stack[node_cur++] = {(int)mips.size() - 1, 0, 0};
+
+  // copy ray to modify it
+  auto ray = ray_;
+  auto hit = false;
+
+  // prepare ray for fast queries; x grows with i, z decreases with j
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_near = vec2i{ray.d.x < 0 ? 1 : 0, ray.d.z > 0 ? 1 : 0};
+
+  // walking stack
+  while (node_cur) {
+    auto [level, bi, bj] = node_stack[--node_cur];
+    add_counter(trace_counter::nodes);
+    if (!intersect_bbox(
+            ray, ray_dinv, get_heightfield_bounds(shape, level, {bi, bj})))
+      continue;
+
+    // push children, farthest first
+    if (level > 0) {
+      auto size = mips[level - 1].size();
+      for (auto k = 3; k >= 0; k--) {
+        auto ci = bi * 2 + ((k % 2) ^ ray_near.x);
+        auto cj = bj * 2 + ((k / 2) ^ ray_near.y);
+        if (ci < size.x && cj < size.y)
+          node_stack[node_cur++] = {level - 1, ci, cj};
+      }
+      continue;
+    }
+
+    // intersect the cells of the block, computing its vertices once
+    const auto stride = heightfield_block + 1;
+    vec3f      positions[stride * stride];
+    auto       start = vec2i{bi, bj} * heightfield_block;
+    auto       end   = min(start + heightfield_block, cells);
+    for (auto j = start.y; j <= end.y; j++) {
+      for (auto i = start.x; i <= end.x; i++) {
+        positions[(j - start.y) * stride + i - start.x] =
+            get_heightfield_position(shape, j * width + i);
+      }
+    }
+    add_counter(trace_counter::primitives,
+        (end.x - start.x) * (end.y - start.y));
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        auto p = &positions[(j - start.y) * stride + i - start.x];
+        if (!intersect_quad(ray, p[0], p[1], p[stride + 1], p[stride], uv,
+                distance))
+          continue;
+        hit      = true;
+        element  = j * cells.x + i;
+        ray.tmax = distance;
+      }
+    }
+
+    // check for early exit
+    if (find_any && hit) return hit;
+  }
+
+  distance = ray.tmax;
+  return hit;
+}
+
+// Intersect ray with a bvh->
+static bool intersect_shape_bvh(trc::shape* shape, const ray3f& ray_,
+    int& element, vec2f& uv, float& distance, bool find_any) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (shape->embree_bvh) {
+    return intersect_shape_embree_bvh(
+        shape, ray_, element, uv, distance, find_any);
+  }
+#endif
+
+  // heightfields are traversed with their mipmap
+  if (!shape->heightfield.empty()) {
+    return intersect_heightfield(shape, ray_, element, uv, distance, find_any);
+  }
+
+  // get bvh and shape pointers for fast access
+  auto bvh = shape->bvh;
+
+  // check empty
+  if (is_bvh_empty(bvh)) return false;
+
+  // use wide or compressed nodes if present
+  if (!bvh->nodes4.empty() || !bvh->nodes8.empty() || !bvh->cnodes.empty()) {
+    auto ray            = ray_;
+    auto intersect_leaf = [shape, &element, &uv, &distance](
+                              int start, int num, ray3f& ray) {
+      if (!intersect_shape_leaf(shape, start, num, ray, element, uv))
+        return false;
+      distance = ray.tmax;
+      return true;
+    };
+    if (!bvh->cnodes.empty())
+      return intersect_compressed_bvh(bvh, ray, find_any, intersect_leaf);
+    if (!bvh->nodes8.empty())
+      return intersect_wide_bvh(bvh->nodes8, ray, find_any, intersect_leaf);
+    return intersect_wide_bvh(bvh->nodes4, ray, find_any, intersect_leaf);
+  }
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+    add_counter(trace_counter::nodes);
+
+    // intersect bbox
+    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (!node.internal && bvh->triangles.empty())
+      add_counter(trace_counter::primitives, node.num);
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis]) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else if (!shape->points.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
         auto& p = shape->points[shape->bvh->primitives[idx].x];
         if (intersect_point(
@@ -1438,6 +3434,35 @@ static bool intersect_shape_bvh(trc::shape* shape, const ray3f& ray_,
           ray.tmax = distance;
         }
       }
+    } else if (!shape->beziers.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& b = shape->beziers[shape->bvh->primitives[idx].x];
+        if (intersect_bezier(ray, shape->positions[b.x], shape->positions[b.y],
+                shape->positions[b.z], shape->positions[b.w],
+                shape->radius[b.x], shape->radius[b.y], shape->radius[b.z],
+                shape->radius[b.w], uv, distance)) {
+          hit      = true;
+          element  = shape->bvh->primitives[idx].x;
+          ray.tmax = distance;
+        }
+      }
+    } else if (!bvh->triangles.empty()) {
+      if (intersect_shape_leaf(
+              shape, node.start, node.num, ray, element, uv)) {
+        hit      = true;
+        distance = ray.tmax;
+      }
+    } else if (!shape->cpositions.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto t = get_triangle(shape, shape->bvh->primitives[idx].x);
+        if (intersect_triangle(ray, get_position(shape, t.x),
+                get_position(shape, t.y), get_position(shape, t.z), uv,
+                distance)) {
+          hit      = true;
+          element  = shape->bvh->primitives[idx].x;
+          ray.tmax = distance;
+        }
+      }
     } else if (!shape->triangles.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
         auto& t = shape->triangles[shape->bvh->primitives[idx].x];
@@ -1470,20 +3495,50 @@ static bool intersect_shape_bvh(trc::shape* shape, const ray3f& ray_,
 // Intersect ray with a bvh->
 static bool intersect_scene_bvh(const trc::scene* scene, const ray3f& ray_,
     int& objecct, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any, bool non_rigid_frames, float time) {
 #ifdef YOCTO_EMBREE
   // call Embree if needed
   if (scene->embree_bvh) {
-    return intersect_scene_embree_bvh(
-        scene, ray_, objecct, instance, element, uv, distance, find_any);
+    return intersect_scene_embree_bvh(scene, ray_, objecct, instance, element,
+        uv, distance, find_any, time);
   }
 #endif
 
   // get bvh and scene pointers for fast access
-  auto bvh = scene->bvh;
+  auto  bvh    = scene->bvh;
+  auto& layout = scene->layout;
 
   // check empty
-  if (bvh->nodes.empty()) return false;
+  if (is_bvh_empty(bvh)) return false;
+
+  // use wide or compressed nodes if present
+  if (!bvh->nodes4.empty() || !bvh->nodes8.empty() || !bvh->cnodes.empty()) {
+    auto ray            = ray_;
+    auto intersect_leaf = [&](int start, int num, ray3f& ray) {
+      auto hit = false;
+      for (auto idx = start; idx < start + num; idx++) {
+        auto [object_id, instance_id] = bvh->primitives[idx];
+        auto index = get_layout_index(scene, object_id, instance_id);
+        auto shape = scene->shapes[layout.shapes[index]];
+        auto inv_ray = transform_ray(
+            eval_layout_inverse(scene, index, time, non_rigid_frames), ray);
+        if (intersect_shape_bvh(
+                shape, inv_ray, element, uv, distance, find_any)) {
+          hit      = true;
+          objecct  = object_id;
+          instance = instance_id;
+          ray.tmax = distance;
+          if (find_any) return hit;
+        }
+      }
+      return hit;
+    };
+    if (!bvh->cnodes.empty())
+      return intersect_compressed_bvh(bvh, ray, find_any, intersect_leaf);
+    if (!bvh->nodes8.empty())
+      return intersect_wide_bvh(bvh->nodes8, ray, find_any, intersect_leaf);
+    return intersect_wide_bvh(bvh->nodes4, ray, find_any, intersect_leaf);
+  }
 
   // node stack
   int  node_stack[128];
@@ -1505,6 +3560,7 @@ static bool intersect_scene_bvh(const trc::scene* scene, const ray3f& ray_,
   while (node_cur) {
     // grab node
     auto& node = bvh->nodes[node_stack[--node_cur]];
+    add_counter(trace_counter::nodes);
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -1524,12 +3580,13 @@ static bool intersect_scene_bvh(const trc::scene* scene, const ray3f& ray_,
       }
     } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto [object_id, instance_id] = scene->bvh->primitives[idx];
-        auto object                   = scene->objects[object_id];
-        auto frame   = object->instance->frames[instance_id] * object->frame;
-        auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+        auto [object_id, instance_id] = bvh->primitives[idx];
+        auto index = get_layout_index(scene, object_id, instance_id);
+        auto shape = scene->shapes[layout.shapes[index]];
+        auto inv_ray = transform_ray(
+            eval_layout_inverse(scene, index, time, non_rigid_frames), ray);
         if (intersect_shape_bvh(
-                object->shape, inv_ray, element, uv, distance, find_any)) {
+                shape, inv_ray, element, uv, distance, find_any)) {
           hit      = true;
           objecct  = object_id;
           instance = instance_id;
@@ -1548,30 +3605,466 @@ static bool intersect_scene_bvh(const trc::scene* scene, const ray3f& ray_,
 // Intersect ray with a bvh->
 static bool intersect_instance_bvh(const trc::object* object, int instance,
     const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto frame   = object->instance->frames[instance] * object->frame;
+    bool non_rigid_frames, float time) {
+  auto frame   = eval_instance_frame(object, instance, time);
   auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
   return intersect_shape_bvh(
       object->shape, inv_ray, element, uv, distance, find_any);
 }
+static bool intersect_instance_bvh(const trc::scene* scene, int index,
+    const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
+    bool non_rigid_frames, float time) {
+  auto shape   = scene->shapes[scene->layout.shapes[index]];
+  auto inv_ray = transform_ray(
+      eval_layout_inverse(scene, index, time, non_rigid_frames), ray);
+  return intersect_shape_bvh(shape, inv_ray, element, uv, distance, find_any);
+}
 
 intersection3f intersect_scene_bvh(const trc::scene* scene, const ray3f& ray,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any, bool non_rigid_frames, float time) {
+  auto timer = counter_timer{trace_counter::intersect_time};
+  add_counter(trace_counter::rays);
   auto intersection = intersection3f{};
   intersection.hit  = intersect_scene_bvh(scene, ray, intersection.object,
       intersection.instance, intersection.element, intersection.uv,
-      intersection.distance, find_any, non_rigid_frames);
+      intersection.distance, find_any, non_rigid_frames, time);
   return intersection;
 }
 intersection3f intersect_instance_bvh(const trc::object* object, int instance,
-    const ray3f& ray, bool find_any, bool non_rigid_frames) {
+    const ray3f& ray, bool find_any, bool non_rigid_frames, float time) {
+  auto timer = counter_timer{trace_counter::intersect_time};
+  add_counter(trace_counter::rays);
   auto intersection = intersection3f{};
   intersection.hit  = intersect_instance_bvh(object, instance, ray,
       intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      non_rigid_frames, time);
+  return intersection;
+}
+intersection3f intersect_instance_bvh(const trc::scene* scene, int object,
+    int instance, const ray3f& ray, bool find_any, bool non_rigid_frames,
+    float time) {
+  auto timer = counter_timer{trace_counter::intersect_time};
+  add_counter(trace_counter::rays);
+  auto intersection     = intersection3f{};
+  intersection.object   = object;
+  intersection.instance = instance;
+  intersection.hit      = intersect_instance_bvh(scene,
+      get_layout_index(scene, object, instance), ray, intersection.element,
+      intersection.uv, intersection.distance, find_any, non_rigid_frames,
+      time);
   return intersection;
 }
 
+bool is_scene_occluded(const trc::scene* scene, const ray3f& ray,
+    bool non_rigid_frames, float time) {
+  auto timer = counter_timer{trace_counter::intersect_time};
+  add_counter(trace_counter::rays);
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (scene->embree_bvh) return occluded_scene_embree_bvh(scene, ray, time);
+#endif
+  auto intersection = intersection3f{};
+  return intersect_scene_bvh(scene, ray, intersection.object,
+      intersection.instance, intersection.element, intersection.uv,
+      intersection.distance, true, non_rigid_frames, time);
+}
+
+// Packet of rays stored in SoA lanes, with the per-lane traversal results.
+template <int N>
+struct ray_packet {
+  ray3fl<N>   rays     = {};
+  vec3fl<N>   dinv     = {};
+  lanemask<N> active   = {};
+  lanemask<N> hit      = {};
+  int         object[N], instance[N], element[N];
+  vec2f       uv[N];
+};
+
+// Number of rays traced together by the stream interface.
+const int ray_packet_size = 8;
+
+// Initialize a packet from a buffer of rays. Lanes after count are inactive.
+template <int N>
+static void init_packet(ray_packet<N>& packet, const ray3f* rays, int count) {
+  for (auto lane = 0; lane < N; lane++) {
+    set_lane(packet.rays, lane, rays[min(lane, count - 1)]);
+    packet.object[lane]   = -1;
+    packet.instance[lane] = -1;
+    packet.element[lane]  = -1;
+    packet.uv[lane]       = zero2f;
+  }
+  packet.dinv   = 1 / packet.rays.d;
+  packet.active = make_lanemask<N>(count);
+  packet.hit    = {};
+}
+
+// Intersect a packet of rays with a shape bvh. Lanes that hit get their
+// tmax, element and uv updated; with `find_any` they are also deactivated.
+template <int N>
+static void intersect_shape_bvh(
+    const trc::shape* shape, ray_packet<N>& packet, bool find_any) {
+  // get bvh and check empty
+  auto bvh = shape->bvh;
+  if (is_bvh_empty(bvh)) return;
+
+  // compressed bvhs and heightfields are traversed one ray at a time
+  if (bvh->nodes.empty() || !shape->heightfield.empty()) {
+    for (auto lane = 0; lane < N; lane++) {
+      if (!packet.active[lane]) continue;
+      auto distance = 0.0f;
+      if (intersect_shape_bvh((trc::shape*)shape, get_lane(packet.rays, lane),
+              packet.element[lane], packet.uv[lane], distance, find_any)) {
+        packet.hit[lane]  = true;
+        packet.rays.tmax[lane] = distance;
+        if (find_any) packet.active[lane] = false;
+      }
+    }
+    return;
+  }
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // traversal order from the first active ray
+  auto first = 0;
+  while (first < N - 1 && !packet.active[first]) first++;
+  auto dsign = vec3i{packet.dinv.x[first] < 0 ? 1 : 0,
+      packet.dinv.y[first] < 0 ? 1 : 0, packet.dinv.z[first] < 0 ? 1 : 0};
+
+  // walking stack
+  while (node_cur) {
+    // grab node and intersect bbox with all lanes
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+    add_counter(trace_counter::nodes);
+    auto hits = intersect_bbox(
+        packet.rays, packet.dinv, node.bbox, packet.active);
+    if (!any(hits)) continue;
+
+    if (node.internal) {
+      if (dsign[node.axis]) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else if (!bvh->watertight &&
+               (has_triangles(shape) || !bvh->triangles.empty())) {
+      // triangles are intersected with all lanes at once
+      add_counter(trace_counter::primitives, node.num);
+      auto leaf_hits = lanemask<N>{};
+      auto uv        = vec2fl<N>{};
+      auto count     = shape->quads.empty() ? 1 : 2;
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto eid = bvh->primitives[idx].x;
+        for (auto k = 0; k < count; k++) {
+          auto thits = lanemask<N>{};
+          if (!bvh->triangles.empty()) {
+            auto& t = bvh->triangles[idx * count + k];
+            thits   = intersect_triangle_edges(
+                packet.rays, t.v0, t.v1, t.v2, hits, uv, packet.rays.tmax);
+          } else {
+            auto t = get_triangle(shape, eid);
+            thits  = intersect_triangle(packet.rays, get_position(shape, t.x),
+                get_position(shape, t.y), get_position(shape, t.z), hits, uv,
+                packet.rays.tmax);
+          }
+          for (auto lane = 0; lane < N; lane++) {
+            if (!thits[lane]) continue;
+            leaf_hits[lane]      = true;
+            packet.element[lane] = eid;
+            packet.uv[lane]      = k ? vec2f{1 - uv.x[lane], 1 - uv.y[lane]}
+                                     : vec2f{uv.x[lane], uv.y[lane]};
+          }
+        }
+      }
+      for (auto lane = 0; lane < N; lane++) {
+        if (!leaf_hits[lane]) continue;
+        packet.hit[lane] = true;
+        if (find_any) packet.active[lane] = false;
+      }
+      if (!any(packet.active)) return;
+    } else {
+      for (auto lane = 0; lane < N; lane++) {
+        if (!hits[lane]) continue;
+        auto ray = get_lane(packet.rays, lane);
+        if (intersect_shape_leaf(shape, node.start, node.num, ray,
+                packet.element[lane], packet.uv[lane])) {
+          packet.hit[lane]       = true;
+          packet.rays.tmax[lane] = ray.tmax;
+          if (find_any) packet.active[lane] = false;
+        }
+      }
+      if (!any(packet.active)) return;
+    }
+  }
+}
+
+// Intersect a packet of rays with the scene bvh.
+template <int N>
+static void intersect_scene_bvh(const trc::scene* scene,
+    ray_packet<N>& packet, bool find_any, bool non_rigid_frames) {
+  // get bvh and check empty
+  auto bvh = scene->bvh;
+  if (is_bvh_empty(bvh)) return;
+
+  // compressed bvhs are traversed one ray at a time
+  if (bvh->nodes.empty()) {
+    for (auto lane = 0; lane < N; lane++) {
+      if (!packet.active[lane]) continue;
+      auto intersection = intersect_scene_bvh(
+          scene, get_lane(packet.rays, lane), find_any, non_rigid_frames);
+      if (!intersection.hit) continue;
+      packet.hit[lane]      = true;
+      packet.rays.tmax[lane]     = intersection.distance;
+      packet.object[lane]   = intersection.object;
+      packet.instance[lane] = intersection.instance;
+      packet.element[lane]  = intersection.element;
+      packet.uv[lane]       = intersection.uv;
+      if (find_any) packet.active[lane] = false;
+    }
+    return;
+  }
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // traversal order from the first active ray
+  auto first = 0;
+  while (first < N - 1 && !packet.active[first]) first++;
+  auto dsign = vec3i{packet.dinv.x[first] < 0 ? 1 : 0,
+      packet.dinv.y[first] < 0 ? 1 : 0, packet.dinv.z[first] < 0 ? 1 : 0};
+
+  // walking stack
+  auto inv_packet = ray_packet<N>{};
+  while (node_cur) {
+    // grab node and intersect bbox with all lanes
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+    add_counter(trace_counter::nodes);
+    auto hits = intersect_bbox(
+        packet.rays, packet.dinv, node.bbox, packet.active);
+    if (!any(hits)) continue;
+
+    if (node.internal) {
+      if (dsign[node.axis]) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto [object_id, instance_id] = bvh->primitives[idx];
+        auto index = get_layout_index(scene, object_id, instance_id);
+        auto shape = scene->shapes[scene->layout.shapes[index]];
+        auto inv_frame = scene->layout.inv_frames[index];
+        // all lanes share the instance transform
+        inv_packet.rays   = transform_ray(inv_frame, packet.rays);
+        inv_packet.dinv   = 1 / inv_packet.rays.d;
+        inv_packet.active = hits;
+        inv_packet.hit    = {};
+        for (auto lane = 0; lane < N; lane++) {
+          inv_packet.element[lane] = packet.element[lane];
+          inv_packet.uv[lane]      = packet.uv[lane];
+        }
+        intersect_shape_bvh(shape, inv_packet, find_any);
+        for (auto lane = 0; lane < N; lane++) {
+          if (!inv_packet.hit[lane]) continue;
+          packet.hit[lane]      = true;
+          packet.rays.tmax[lane]     = inv_packet.rays.tmax[lane];
+          packet.object[lane]   = object_id;
+          packet.instance[lane] = instance_id;
+          packet.element[lane]  = inv_packet.element[lane];
+          packet.uv[lane]       = inv_packet.uv[lane];
+          if (find_any) packet.active[lane] = false;
+        }
+      }
+      if (!any(packet.active)) return;
+    }
+  }
+}
+
+// Memory used by a bvh
+static size_t get_bvh_memory(const bvh_tree* bvh) {
+  if (!bvh) return 0;
+  return sizeof(bvh_tree) + bvh->nodes.capacity() * sizeof(bvh_node) +
+         bvh->primitives.capacity() * sizeof(vec2i) +
+         bvh->nodes4.capacity() * sizeof(bvh_wide_node<4>) +
+         bvh->nodes8.capacity() * sizeof(bvh_wide_node<8>) +
+         bvh->cnodes.capacity() * sizeof(bvh_compressed_node) +
+         bvh->subtrees.capacity() * sizeof(int) +
+         bvh->subtree_costs.capacity() * sizeof(float) +
+         bvh->triangles.capacity() * sizeof(bvh_triangle);
+}
+
+// Memory used by the scene and shape bvhs, in bytes.
+size_t get_embree_memory() {
+#ifdef YOCTO_EMBREE
+  auto memory = (ssize_t)embree_memory;
+  return memory > 0 ? (size_t)memory : 0;
+#else
+  return 0;
+#endif
+}
+
+size_t get_bvh_memory(const trc::scene* scene) {
+  auto memory = get_bvh_memory(scene->bvh);
+  for (auto shape : scene->shapes) memory += get_bvh_memory(shape->bvh);
+#ifdef YOCTO_EMBREE
+  memory += get_embree_memory();
+#endif
+  return memory;
+}
+
+// Memory of buffers and images, by capacity
+template <typename T>
+static size_t get_memory(const std::vector<T>& values) {
+  return values.capacity() * sizeof(T);
+}
+static size_t get_memory(const std::vector<bool>& values) {
+  return values.capacity() / 8;
+}
+template <typename T>
+static size_t get_memory(const img::image<T>& image) {
+  return image.count() * sizeof(T);
+}
+template <typename T>
+static size_t get_memory(const std::vector<img::image<T>>& images) {
+  auto memory = get_memory<img::image<T>>(images);
+  for (auto& image : images) memory += get_memory(image);
+  return memory;
+}
+static size_t get_memory(const img::block_image& image) {
+  return get_memory(image.blocks);
+}
+
+trc::scene_memory get_scene_memory(const trc::scene* scene) {
+  auto memory = trc::scene_memory{};
+  for (auto shape : scene->shapes) {
+    memory.shapes += sizeof(trc::shape) + get_memory(shape->points) +
+                     get_memory(shape->lines) + get_memory(shape->beziers) +
+                     get_memory(shape->triangles) + get_memory(shape->quads) +
+                     get_memory(shape->positions) + get_memory(shape->normals) +
+                     get_memory(shape->texcoords) + get_memory(shape->colors) +
+                     get_memory(shape->radius) + get_memory(shape->tangents) +
+                     get_memory(shape->element_normals) +
+                     get_memory(shape->element_tangents) +
+                     get_memory(shape->heightfield) +
+                     get_memory(shape->heightfield_mips) +
+                     get_memory(shape->cpositions) +
+                     get_memory(shape->cnormals) +
+                     get_memory(shape->ctexcoords) +
+                     get_memory(shape->ctriangles);
+    memory.bvhs += get_bvh_memory(shape->bvh);
+    memory.lights += get_memory(shape->elements_cdf) +
+                     get_memory(shape->elements_alias);
+  }
+  memory.bvhs += get_bvh_memory(scene->bvh);
+  memory.lights += get_memory(scene->lights) + get_memory(scene->light_nodes) +
+                   get_memory(scene->environment_lights) +
+                   scene->lights.size() * sizeof(trc::light);
+  for (auto environment : scene->environments) {
+    memory.lights += get_memory(environment->texels_cdf) +
+                     get_memory(environment->texels_alias);
+    memory.other += sizeof(trc::environment);
+  }
+  for (auto texture : scene->textures) {
+    memory.textures +=
+        sizeof(trc::texture) + get_memory(texture->colorf) +
+        get_memory(texture->colorh) + get_memory(texture->colorb) +
+        get_memory(texture->scalarf) + get_memory(texture->scalarh) +
+        get_memory(texture->scalarb) + get_memory(texture->colorf_mips) +
+        get_memory(texture->colorh_mips) + get_memory(texture->colorb_mips) +
+        get_memory(texture->scalarf_mips) + get_memory(texture->scalarh_mips) +
+        get_memory(texture->scalarb_mips) + get_memory(texture->blocks) +
+        get_memory(texture->blocks_mips) +
+        get_memory(texture->tiled_offsets);
+  }
+  if (scene->texture_cache) {
+    auto lock = std::lock_guard{scene->texture_cache->mutex};
+    memory.textures += scene->texture_cache->used;
+  }
+  for (auto volume : scene->volumes) {
+    memory.volumes += sizeof(trc::volume) + get_memory(volume->offsets) +
+                      get_memory(volume->majorants) +
+                      get_memory(volume->voxels) + get_memory(volume->buffer);
+  }
+  for (auto instance : scene->instances) {
+    memory.other += sizeof(trc::instance) + get_memory(instance->frames) +
+                    get_memory(instance->motion);
+    for (auto& frames : instance->motion) memory.other += get_memory(frames);
+  }
+  memory.other += sizeof(trc::scene) +
+                  scene->cameras.size() * sizeof(trc::camera) +
+                  scene->objects.size() * sizeof(trc::object) +
+                  scene->materials.size() * sizeof(trc::material) +
+                  get_memory(scene->cameras) + get_memory(scene->objects) +
+                  get_memory(scene->shapes) + get_memory(scene->materials) +
+                  get_memory(scene->instances) + get_memory(scene->textures) +
+                  get_memory(scene->volumes) +
+                  get_memory(scene->environments);
+  auto& layout = scene->layout;
+  memory.other += get_memory(layout.offsets) + get_memory(layout.instances) +
+                  get_memory(layout.frames) + get_memory(layout.inv_frames) +
+                  get_memory(layout.shapes) + get_memory(layout.materials) +
+                  get_memory(layout.moving);
+#ifdef YOCTO_EMBREE
+  memory.other += get_memory(scene->embree_instances);
+#endif
+  memory.embree = get_embree_memory();
+  memory.total  = memory.shapes + memory.bvhs + memory.lights +
+                 memory.textures + memory.volumes + memory.other +
+                 memory.embree;
+  return memory;
+}
+
+// Intersect a buffer of rays with the scene bvh, tracing them in packets.
+// Packets share the instance transforms, so timed rays are traced alone.
+std::vector<intersection3f> intersect_scene_bvh(const trc::scene* scene,
+    const std::vector<ray3f>& rays, bool find_any, bool non_rigid_frames,
+    const std::vector<float>& times) {
+  auto intersections = std::vector<intersection3f>(rays.size());
+  if (!times.empty()) {
+    for (auto idx = 0; idx < (int)rays.size(); idx++) {
+      intersections[idx] = intersect_scene_bvh(
+          scene, rays[idx], find_any, non_rigid_frames, times[idx]);
+    }
+    return intersections;
+  }
+  auto timer = counter_timer{trace_counter::intersect_time};
+  add_counter(trace_counter::rays, rays.size());
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (scene->embree_bvh) {
+    intersect_scene_embree_bvh(scene, rays, intersections);
+    return intersections;
+  }
+#endif
+
+  auto packet = ray_packet<ray_packet_size>{};
+  for (auto start = 0; start < (int)rays.size(); start += ray_packet_size) {
+    auto count = min(ray_packet_size, (int)rays.size() - start);
+    init_packet(packet, rays.data() + start, count);
+    intersect_scene_bvh(scene, packet, find_any, non_rigid_frames);
+    for (auto lane = 0; lane < count; lane++) {
+      auto& intersection    = intersections[start + lane];
+      intersection.hit      = packet.hit[lane];
+      if (!intersection.hit) continue;
+      intersection.object   = packet.object[lane];
+      intersection.instance = packet.instance[lane];
+      intersection.element  = packet.element[lane];
+      intersection.uv       = packet.uv[lane];
+      intersection.distance = packet.rays.tmax[lane];
+    }
+  }
+  return intersections;
+}
+
 }  // namespace yocto::trace
 
 // -----------------------------------------------------------------------------
@@ -1862,25 +4355,85 @@ static float sample_scattering_pdf(const volume_point& point) {
       point.volanisotropy, point.outgoing, point.incoming);
 }
 
-// Sample lights wrt solid angle
+// Importance of a light tree node for a shading position, as its power
+// over the squared distance to the node, clamped inside the node bounds.
+static float eval_light_importance(
+    const light_node& node, const vec3f& position) {
+  auto distance2 = distance_squared(position, center(node.bbox));
+  auto size      = node.bbox.max - node.bbox.min;
+  auto radius2   = dot(size, size) / 4;
+  return node.power / max(max(distance2, radius2), 1e-12f);
+}
+
+// Probability of choosing the first child of a light tree node.
+static float sample_light_node_prob(
+    const trc::scene* scene, const light_node& node, const vec3f& position) {
+  auto left  = eval_light_importance(scene->light_nodes[node.start], position);
+  auto right = eval_light_importance(
+      scene->light_nodes[node.start + 1], position);
+  return (left + right) > 0 ? left / (left + right) : 0.5f;
+}
+
+// Probability of choosing environment lights over object lights.
+static float sample_environment_lights_prob(const trc::scene* scene) {
+  if (scene->environment_lights.empty()) return 0;
+  if (scene->light_nodes.empty()) return 1;
+  return 0.5f;
+}
+
+// Picks a light, choosing environment lights uniformly and object lights
+// with the light tree. Returns the light and the probability of picking it.
+static std::pair<const trc::light*, float> sample_light(
+    const trc::scene* scene, const vec3f& position, float rl) {
+  auto env_prob = sample_environment_lights_prob(scene);
+  if (rl < env_prob) {
+    auto& environments = scene->environment_lights;
+    return {environments[sample_uniform(environments.size(), rl / env_prob)],
+        env_prob * sample_uniform_pdf(environments.size())};
+  }
+  rl = min((rl - env_prob) / (1 - env_prob), 1 - flt_eps);
+  // descend the tree, reusing the random number at each level
+  auto nodeid     = 0;
+  auto light_prob = 1 - env_prob;
+  while (scene->light_nodes[nodeid].internal) {
+    auto& node = scene->light_nodes[nodeid];
+    auto  prob = sample_light_node_prob(scene, node, position);
+    if (rl < prob) {
+      rl     = min(rl / prob, 1 - flt_eps);
+      nodeid = node.start;
+      light_prob *= prob;
+    } else {
+      rl     = min((rl - prob) / (1 - prob), 1 - flt_eps);
+      nodeid = node.start + 1;
+      light_prob *= 1 - prob;
+    }
+  }
+  return {scene->lights[scene->light_nodes[nodeid].start], light_prob};
+}
+
+// Sample lights wrt solid angle, with moving lights placed at `time`
 static vec3f sample_lights(const trc::scene* scene, const vec3f& position,
-    float rl, float rel, const vec2f& ruv) {
-  auto  light_id = sample_uniform(scene->lights.size(), rl);
-  auto& light    = scene->lights[light_id];
+    float rl, const vec2f& rel, const vec2f& ruv, float time = 0) {
+  add_counter(trace_counter::light_samples);
+  auto [light, light_prob] = sample_light(scene, position, rl);
   if (light->object) {
-    auto& object    = light->object;
-    auto  shape     = object->shape;
-    auto  frame     = object->instance->frames[light->instance] * object->frame;
-    auto  element   = sample_discrete_cdf(shape->elements_cdf, rel);
-    auto  uv        = (!shape->triangles.empty()) ? sample_triangle(ruv) : ruv;
-    auto  lposition = transform_point(
-        frame, eval_shape(shape, shape->positions, element, uv, zero3f));
+    auto  shape     = light->object->shape;
+    auto  frame     = eval_layout_frame(scene, light->layout, time);
+    auto  element   = !shape->elements_alias.empty()
+                          ? sample_discrete_alias(
+                                shape->elements_alias, rel.x, rel.y)
+                          : sample_discrete_cdf(shape->elements_cdf, rel.x);
+    auto  uv        = has_triangles(shape) ? sample_triangle(ruv) : ruv;
+    auto  lposition = transform_point(frame, eval_position(shape, element, uv));
     return normalize(lposition - position);
   } else if (light->environment) {
     auto& environment = light->environment;
     if (environment->emission_tex) {
       auto emission_tex = environment->emission_tex;
-      auto idx          = sample_discrete_cdf(environment->texels_cdf, rel);
+      auto idx = !environment->texels_alias.empty()
+                     ? sample_discrete_alias(
+                           environment->texels_alias, rel.x, rel.y)
+                     : sample_discrete_cdf(environment->texels_cdf, rel.x);
       auto size         = texture_size(emission_tex);
       auto uv           = vec2f{
           (idx % size.x + 0.5f) / size.x, (idx / size.x + 0.5f) / size.y};
@@ -1895,77 +4448,714 @@ static vec3f sample_lights(const trc::scene* scene, const vec3f& position,
   }
 }
 
-// Sample lights pdf
-static float sample_lights_pdf(
-    const trc::scene* scene, const vec3f& position, const vec3f& direction) {
-  auto pdf = 0.0f;
-  for (auto& light : scene->lights) {
-    if (light->object) {
-      // check all intersection
-      auto  lpdf          = 0.0f;
-      auto  next_position = position;
-      auto& object        = light->object;
-      auto  frame = object->instance->frames[light->instance] * object->frame;
-      for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_instance_bvh(
-            light->object, light->instance, {next_position, direction});
-        if (!intersection.hit) break;
-        // accumulate pdf
-        auto lposition = transform_point(
-            frame, eval_shape(object->shape, object->shape->positions,
-                       intersection.element, intersection.uv, zero3f));
-        auto lnormal = transform_normal(frame,
-            eval_normal(object->shape, intersection.element), non_rigid_frames);
-        // prob triangle * area triangle = area triangle mesh
-        auto area = object->shape->elements_cdf.back();
-        lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
-        // continue
-        next_position = lposition + direction * 1e-3f;
-      }
-      pdf += lpdf;
-    } else if (light->environment) {
-      auto& environment = light->environment;
-      if (environment->emission_tex) {
-        auto& cdf          = environment->texels_cdf;
-        auto  emission_tex = environment->emission_tex;
-        auto  size         = texture_size(emission_tex);
-        auto  wl = transform_direction(inverse(environment->frame), direction);
-        auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto i     = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
-        auto j     = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
-        auto prob  = sample_discrete_cdf_pdf(cdf, j * size.x + i) / cdf.back();
-        auto angle = (2 * pif / size.x) * (pif / size.y) *
-                     sin(pif * (j + 0.5f) / size.y);
-        pdf += prob / angle;
-      } else {
-        pdf += 1 / (4 * pif);
-      }
-    }
+// Sample object light pdf
+static float sample_object_light_pdf(const trc::scene* scene,
+    const trc::light* light, const vec3f& position, const vec3f& direction,
+    float time) {
+  // check all intersection
+  auto  lpdf          = 0.0f;
+  auto  next_position = position;
+  auto& object        = light->object;
+  auto  object_id     = scene->layout.instances[light->layout].x;
+  auto  frame         = eval_layout_frame(scene, light->layout, time);
+  for (auto bounce = 0; bounce < 100; bounce++) {
+    auto intersection = intersect_instance_bvh(scene, object_id,
+        light->instance, {next_position, direction}, false, true, time);
+    if (!intersection.hit) break;
+    // accumulate pdf
+    auto lposition = transform_point(frame,
+        eval_position(object->shape, intersection.element, intersection.uv));
+    auto lnormal = transform_normal(frame,
+        eval_normal(object->shape, intersection.element), non_rigid_frames);
+    // prob triangle * area triangle = area triangle mesh
+    auto area = object->shape->elements_cdf.back();
+    lpdf += distance_squared(lposition, position) /
+            (abs(dot(lnormal, direction)) * area);
+    // continue
+    next_position = lposition + direction * 1e-3f;
   }
-  pdf *= sample_uniform_pdf(scene->lights.size());
-  return pdf;
+  return lpdf;
 }
 
-// Recursive path tracing.
-static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
-    const ray3f& ray_, rng_state& rng, const trace_params& params) {
-  // initialize
-  auto radiance      = zero3f;
-  auto weight        = vec3f{1, 1, 1};
-  auto ray           = ray_;
-  auto volume_stack  = std::vector<volume_point>{};
-  auto max_roughness = 0.0f;
-  auto hit           = false;
+// Sample environment light pdf
+static float sample_environment_light_pdf(
+    const trc::light* light, const vec3f& direction) {
+  auto& environment = light->environment;
+  if (environment->emission_tex) {
+    auto& cdf          = environment->texels_cdf;
+    auto  emission_tex = environment->emission_tex;
+    auto  size         = texture_size(emission_tex);
+    auto  wl = transform_direction(inverse(environment->frame), direction);
+    auto  texcoord = vec2f{
+        atan2(wl.z, wl.x) / (2 * pif), acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+    if (texcoord.x < 0) texcoord.x += 1;
+    auto i     = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
+    auto j     = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
+    auto prob  = sample_discrete_cdf_pdf(cdf, j * size.x + i) / cdf.back();
+    auto angle = (2 * pif / size.x) * (pif / size.y) *
+                 sin(pif * (j + 0.5f) / size.y);
+    return prob / angle;
+  } else {
+    return 1 / (4 * pif);
+  }
+}
+
+// Sample lights pdf. Object lights are found by traversing the light tree
+// with the ray, accumulating the probability of choosing each node.
+static float sample_lights_pdf(const trc::scene* scene,
+    const vec3f& position, const vec3f& direction, float time = 0) {
+  auto pdf      = 0.0f;
+  auto env_prob = sample_environment_lights_prob(scene);
+
+  // environment lights
+  for (auto light : scene->environment_lights) {
+    pdf += env_prob * sample_uniform_pdf(scene->environment_lights.size()) *
+           sample_environment_light_pdf(light, direction);
+  }
+
+  // object lights
+  if (scene->light_nodes.empty()) return pdf;
+  auto ray      = ray3f{position, direction};
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto stack    = std::vector<std::pair<int, float>>{{0, 1 - env_prob}};
+  while (!stack.empty()) {
+    auto [nodeid, prob] = stack.back();
+    stack.pop_back();
+    auto& node = scene->light_nodes[nodeid];
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    if (node.internal) {
+      auto left_prob = sample_light_node_prob(scene, node, position);
+      if (left_prob > 0) stack.push_back({node.start, prob * left_prob});
+      if (left_prob < 1)
+        stack.push_back({node.start + 1, prob * (1 - left_prob)});
+    } else {
+      auto light = scene->lights[node.start];
+      pdf += prob * sample_object_light_pdf(
+                        scene, light, position, direction, time);
+    }
+  }
+  return pdf;
+}
+
+// Point sampled on a light, with its emission, distance and pdf wrt solid
+// angle. For environments, the distance is infinite.
+struct light_sample {
+  vec3f incoming = zero3f;
+  vec3f emission = zero3f;
+  float distance = 0;
+  float pdf      = 0;
+};
+
+// Sample a point on a light for next event estimation. Contrary to
+// sample_lights, the pdf is the one of the chosen light alone.
+static light_sample sample_lights_point(const trc::scene* scene,
+    const vec3f& position, float rl, const vec2f& rel, const vec2f& ruv,
+    float time = 0) {
+  auto [light, light_prob] = sample_light(scene, position, rl);
+  auto sample              = light_sample{};
+  if (light->object) {
+    auto& layout    = scene->layout;
+    auto  shape     = light->object->shape;
+    auto  material  = scene->materials[layout.materials[light->layout]];
+    auto  frame     = eval_layout_frame(scene, light->layout, time);
+    auto  element   = !shape->elements_alias.empty()
+                          ? sample_discrete_alias(
+                                shape->elements_alias, rel.x, rel.y)
+                          : sample_discrete_cdf(shape->elements_cdf, rel.x);
+    auto  uv        = has_triangles(shape) ? sample_triangle(ruv) : ruv;
+    auto  lposition = transform_point(frame, eval_position(shape, element, uv));
+    auto lnormal = transform_normal(
+        frame, eval_normal(shape, element), non_rigid_frames);
+    auto texcoord   = eval_texcoord(shape, element, uv);
+    sample.distance = distance(lposition, position);
+    sample.incoming = (lposition - position) / sample.distance;
+    sample.emission = material->emission *
+                      eval_texture(material->emission_tex, texcoord, false);
+    // prob triangle * area triangle = area triangle mesh
+    auto cosine = abs(dot(lnormal, sample.incoming));
+    auto area   = shape->elements_cdf.back();
+    if (cosine > 0)
+      sample.pdf = light_prob * sample.distance * sample.distance /
+                   (cosine * area);
+  } else if (light->environment) {
+    sample.incoming = sample_lights(scene, position, rl, rel, ruv, time);
+    sample.distance = flt_max;
+    sample.emission = eval_environment(light->environment, sample.incoming);
+    sample.pdf      = light_prob *
+                 sample_environment_light_pdf(light, sample.incoming);
+  }
+  return sample;
+}
+
+// Power heuristic for multiple importance sampling
+static float mis_power_weight(float pdf, float other_pdf) {
+  return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Directional quadtree of incoming radiance over the square of cylindrical
+// direction coordinates. Nodes store the radiance of their four quadrants,
+// and the index of the child node of each quadrant, or 0 for leaves.
+struct guiding_quadtree {
+  std::vector<std::array<float, 4>> sums     = {};
+  std::vector<std::array<int, 4>>   children = {};
+};
+
+// Node of the spatial binary tree, split at the midpoint along axis, with
+// consecutive children. Leaves have a negative axis and index a quadtree.
+struct guiding_node {
+  int axis     = -1;
+  int children = 0;
+  int leaf     = 0;
+};
+
+// Path guiding field, an sd-tree that partitions space with a binary tree
+// whose leaves hold directional quadtrees. Leaves sample from the quadtrees
+// learned in the last iteration, while the radiance of the current one is
+// recorded in copies of them. Training runs in iterations that double in
+// samples, until `trace_params::guiding_samples`.
+struct guiding_field {
+  bbox3f                        bounds      = invalidb3f;
+  std::vector<guiding_node>     nodes       = {};
+  std::vector<guiding_quadtree> sampling    = {};
+  std::vector<guiding_quadtree> recording   = {};
+  std::vector<int64_t>          records     = {};
+  std::unique_ptr<std::mutex[]> locks       = {};
+  bool                          training    = true;
+  int                           iteration   = 0;
+  int                           next_update = 1;
+};
+
+// Vertices of a path recorded for guiding, with the direction sampled at
+// the vertex, the radiance accumulated before it and the weight after it.
+struct guiding_vertex {
+  int   leaf      = 0;
+  vec2f direction = zero2f;
+  vec3f radiance  = zero3f;
+  vec3f weight    = zero3f;
+};
+struct guiding_path {
+  std::array<guiding_vertex, 16> vertices = {};
+  int                            count    = 0;
+};
+
+// Guiding parameters: spatial leaves split over a number of records that
+// grows with iterations, and quadrants with a fraction of the radiance over
+// the threshold are subdivided, up to a maximum depth. The learned field
+// draws a fraction of the directions, the rest come from brdf and lights.
+const auto guiding_split     = 12000.0f;
+const auto guiding_threshold = 0.01f;
+const auto guiding_depth     = 20;
+const auto guiding_fraction  = 0.3f;
+
+// Map directions to and from the unit square of cylindrical coordinates,
+// where areas are proportional to solid angles.
+static vec2f guiding_to_square(const vec3f& direction) {
+  auto phi = atan2(direction.y, direction.x);
+  if (phi < 0) phi += 2 * pif;
+  return {clamp((direction.z + 1) / 2, 0.0f, 1.0f),
+      clamp(phi / (2 * pif), 0.0f, 1.0f)};
+}
+static vec3f guiding_from_square(const vec2f& uv) {
+  auto cos_theta = 2 * uv.x - 1;
+  auto sin_theta = sqrt(max(1 - cos_theta * cos_theta, 0.0f));
+  auto phi       = 2 * pif * uv.y;
+  return {sin_theta * cos(phi), sin_theta * sin(phi), cos_theta};
+}
+
+// Find the spatial leaf that contains a position.
+static int find_guiding_leaf(
+    const guiding_field* field, const vec3f& position) {
+  auto bbox = field->bounds;
+  auto node = 0;
+  while (field->nodes[node].axis >= 0) {
+    auto& snode  = field->nodes[node];
+    auto  axis   = snode.axis;
+    auto  middle = (bbox.min[axis] + bbox.max[axis]) / 2;
+    if (position[axis] < middle) {
+      bbox.max[axis] = middle;
+      node           = snode.children;
+    } else {
+      bbox.min[axis] = middle;
+      node           = snode.children + 1;
+    }
+  }
+  return field->nodes[node].leaf;
+}
+
+// Total radiance of a quadtree.
+static float get_quadtree_total(const guiding_quadtree& tree) {
+  if (tree.sums.empty()) return 0;
+  auto& sums = tree.sums[0];
+  return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+// Sample a point in the square proportionally to the quadtree radiance.
+static vec2f sample_quadtree(
+    const guiding_quadtree& tree, float rn, const vec2f& ruv) {
+  auto origin = zero2f;
+  auto size   = 1.0f;
+  auto node   = 0;
+  while (true) {
+    auto& sums  = tree.sums[node];
+    auto  value = rn * (sums[0] + sums[1] + sums[2] + sums[3]);
+    auto  quad  = 0;
+    while (quad < 3 && value >= sums[quad]) value -= sums[quad++];
+    rn = sums[quad] > 0 ? clamp(value / sums[quad], 0.0f, 0.9999f) : 0.5f;
+    size /= 2;
+    origin += vec2f{(quad % 2) * size, (quad / 2) * size};
+    auto child = tree.children[node][quad];
+    if (!child) return origin + ruv * size;
+    node = child;
+  }
+}
+
+// Pdf of sampling a point in the square from the quadtree.
+static float sample_quadtree_pdf(const guiding_quadtree& tree, vec2f uv) {
+  auto pdf  = 1.0f;
+  auto node = 0;
+  while (true) {
+    auto& sums  = tree.sums[node];
+    auto  total = sums[0] + sums[1] + sums[2] + sums[3];
+    if (total <= 0) return 0;
+    auto quad = (uv.x >= 0.5f ? 1 : 0) + (uv.y >= 0.5f ? 2 : 0);
+    pdf *= 4 * sums[quad] / total;
+    uv    = {uv.x * 2 - (quad % 2), uv.y * 2 - (quad / 2)};
+    auto child = tree.children[node][quad];
+    if (!child) return pdf;
+    node = child;
+  }
+}
+
+// Add radiance to the quadrants that contain a point of the square.
+static void record_quadtree(
+    guiding_quadtree& tree, vec2f uv, float radiance) {
+  auto node = 0;
+  while (true) {
+    auto quad = (uv.x >= 0.5f ? 1 : 0) + (uv.y >= 0.5f ? 2 : 0);
+    tree.sums[node][quad] += radiance;
+    uv         = {uv.x * 2 - (quad % 2), uv.y * 2 - (quad / 2)};
+    auto child = tree.children[node][quad];
+    if (!child) return;
+    node = child;
+  }
+}
+
+// Rebuild a quadtree from the recorded radiance, subdividing the quadrants
+// that hold more than a fraction of the total and pruning the others.
+// Quadrants subdivided for the first time split their radiance evenly.
+static guiding_quadtree refine_quadtree(const guiding_quadtree& recorded) {
+  auto total = get_quadtree_total(recorded);
+  auto tree  = guiding_quadtree{};
+  tree.sums.push_back(recorded.sums[0]);
+  tree.children.push_back({0, 0, 0, 0});
+  auto stack = std::vector<vec3i>{{0, 0, 1}};  // node, recorded node, depth
+  while (!stack.empty()) {
+    auto [node, old, depth] = stack.back();
+    stack.pop_back();
+    for (auto quad = 0; quad < 4; quad++) {
+      auto value = tree.sums[node][quad];
+      if (value <= total * guiding_threshold || depth >= guiding_depth)
+        continue;
+      auto old_child = old >= 0 ? recorded.children[old][quad] : 0;
+      auto child     = (int)tree.sums.size();
+      tree.children[node][quad] = child;
+      tree.children.push_back({0, 0, 0, 0});
+      if (old_child) {
+        tree.sums.push_back(recorded.sums[old_child]);
+      } else {
+        tree.sums.push_back({value / 4, value / 4, value / 4, value / 4});
+      }
+      stack.push_back({child, old_child ? old_child : -1, depth + 1});
+    }
+  }
+  return tree;
+}
+
+// Bounds of the scene, from its bvh if built, or its shapes otherwise.
+static bbox3f get_scene_bounds(const trc::scene* scene) {
+  if (scene->bvh && !is_bvh_empty(scene->bvh))
+    return get_bvh_bounds(scene->bvh);
+  auto bounds = invalidb3f;
+  for (auto object : scene->objects) {
+    auto sbounds = object->shape->cpositions.empty() ? invalidb3f
+                                                     : object->shape->cbounds;
+    for (auto& position : object->shape->positions)
+      sbounds = merge(sbounds, position);
+    for (auto idx = 0; idx < object->instance->frames.size(); idx++)
+      bounds = merge(bounds, eval_instance_bounds(object, idx, sbounds));
+  }
+  return bounds;
+}
+
+// Make a guiding field with a single leaf over the scene bounds, whose
+// quadtree samples directions uniformly.
+static std::shared_ptr<guiding_field> make_guiding_field(
+    const trc::scene* scene) {
+  auto field    = std::make_shared<guiding_field>();
+  auto bounds   = get_scene_bounds(scene);
+  auto padding  = max(bounds.max - bounds.min) * 0.01f + 1e-3f;
+  field->bounds = {bounds.min - padding, bounds.max + padding};
+  field->nodes.push_back({-1, 0, 0});
+  auto tree = guiding_quadtree{{{0, 0, 0, 0}}, {{0, 0, 0, 0}}};
+  field->sampling.push_back(tree);
+  field->recording.push_back(tree);
+  field->records.push_back(0);
+  field->locks = std::make_unique<std::mutex[]>(1);
+  return field;
+}
+
+// Record the incoming radiance at the vertices of a path, computed from the
+// radiance gathered after each vertex and the path weight.
+static void record_guiding(guiding_field* field, const guiding_path& path,
+    const vec3f& radiance) {
+  for (auto idx = 0; idx < path.count; idx++) {
+    auto& vertex   = path.vertices[idx];
+    auto  incoming = zero3f;
+    for (auto c = 0; c < 3; c++) {
+      if (vertex.weight[c] > 0)
+        incoming[c] = (radiance[c] - vertex.radiance[c]) / vertex.weight[c];
+    }
+    if (!isfinite(incoming)) continue;
+    auto value = max(mean(incoming), 0.0f);
+    std::lock_guard<std::mutex> lock(field->locks[vertex.leaf]);
+    field->records[vertex.leaf] += 1;
+    if (value > 0)
+      record_quadtree(field->recording[vertex.leaf], vertex.direction, value);
+  }
+}
+
+// Update the guiding field after a pass, if an iteration is done. Leaves
+// learn the recorded quadtrees and split while they have enough records.
+static void update_guiding(
+    guiding_field* field, const trace_params& params, int samples) {
+  if (!field->training || samples < field->next_update) return;
+  auto threshold = guiding_split * sqrt(pow(2.0f, (float)field->iteration));
+  auto stack     = std::vector<std::pair<int, bbox3f>>{{0, field->bounds}};
+  auto counts    = std::vector<int64_t>(field->nodes.size(), 0);
+  for (auto idx = 0; idx < field->nodes.size(); idx++) {
+    auto& node = field->nodes[idx];
+    if (node.axis < 0) counts[idx] = field->records[node.leaf];
+  }
+  // learn the quadtrees of the leaves that received radiance
+  common::parallel_for((int)field->sampling.size(), [field](int leaf) {
+    auto& recorded = field->recording[leaf];
+    if (get_quadtree_total(recorded) > 0)
+      field->sampling[leaf] = refine_quadtree(recorded);
+  });
+  // split leaves, assuming records divide evenly among children
+  while (!stack.empty()) {
+    auto [node, bbox] = stack.back();
+    stack.pop_back();
+    auto snode = field->nodes[node];
+    if (snode.axis >= 0) {
+      auto axis = snode.axis;
+      auto bbox0 = bbox, bbox1 = bbox;
+      bbox0.max[axis] = bbox1.min[axis] = (bbox.min[axis] + bbox.max[axis]) / 2;
+      stack.push_back({snode.children, bbox0});
+      stack.push_back({snode.children + 1, bbox1});
+      continue;
+    }
+    if (counts[node] <= threshold) continue;
+    auto size  = bbox.max - bbox.min;
+    auto axis  = size.x >= size.y && size.x >= size.z ? 0
+                 : size.y >= size.z                   ? 1
+                                                      : 2;
+    auto first = (int)field->nodes.size();
+    auto leaf  = (int)field->sampling.size();
+    field->nodes[node] = {axis, first, 0};
+    field->nodes.push_back({-1, 0, snode.leaf});
+    field->nodes.push_back({-1, 0, leaf});
+    field->sampling.push_back(field->sampling[snode.leaf]);
+    counts.push_back(counts[node] / 2);
+    counts.push_back(counts[node] / 2);
+    stack.push_back({node, bbox});
+  }
+  // reset recording on the new quadtrees
+  field->recording = field->sampling;
+  for (auto& tree : field->recording) {
+    for (auto& sums : tree.sums) sums = {0, 0, 0, 0};
+  }
+  field->records.assign(field->sampling.size(), 0);
+  field->locks = std::make_unique<std::mutex[]>(field->sampling.size());
+  // schedule the next iteration, with twice the samples
+  field->iteration += 1;
+  field->next_update = samples + (1 << min(field->iteration, 16));
+  field->training    = samples < params.guiding_samples;
+}
+
+// State of a path, advanced one bounce at a time by the path tracers.
+struct path_state {
+  vec3f                     radiance      = zero3f;
+  vec3f                     weight        = {1, 1, 1};
+  ray3f                     ray           = {};
+  ray_cone                  cone          = {};
+  float                     time          = 0;
+  std::vector<volume_point> volume_stack  = {};
+  float                     max_roughness = 0.0f;
+  bool                      hit           = false;
+  int                       bounce        = 0;
+};
+
+// Advance a path by one bounce, given the intersection of its ray with the
+// scene. Returns false when the path terminates.
+// With a guiding field, rough surfaces also sample directions from it, and
+// with a guiding path, the sampled directions are recorded for training.
+template <bool nocaustics>
+static bool trace_path_bounce(const trc::scene* scene, path_state& path,
+    intersection3f intersection, sampler_state& rng, const trace_params& params,
+    const guiding_field* guiding = nullptr, guiding_path* record = nullptr) {
+  auto& radiance      = path.radiance;
+  auto& weight        = path.weight;
+  auto& ray           = path.ray;
+  auto& cone          = path.cone;
+  auto  time          = path.time;
+  auto& volume_stack  = path.volume_stack;
+  auto& max_roughness = path.max_roughness;
+  auto& hit           = path.hit;
+  auto  recorded      = false;
+
+  // handle environment
+  if (!intersection.hit) {
+    radiance += weight * eval_environment(scene, ray);
+    return false;
+  }
+
+  // handle transmission if inside a volume
+  auto in_volume = false;
+  if (!volume_stack.empty()) {
+    auto& point    = volume_stack.back();
+    auto  distance = intersection.distance;
+    if (point.density) {
+      auto [collision, tweight] = sample_density_distance(
+          point, ray, intersection.distance, rng);
+      distance = collision;
+      weight *= tweight;
+    } else {
+      distance = sample_transmittance(
+          point.voldensity, intersection.distance, rand1f(rng), rand1f(rng));
+      weight *= eval_transmittance(point.voldensity, distance) /
+                sample_transmittance_pdf(
+                    point.voldensity, distance, intersection.distance);
+    }
+    in_volume             = distance < intersection.distance;
+    intersection.distance = distance;
+  }
+
+  // switch between surface and volume
+  if (!in_volume) {
+    // prepare shading point
+    auto width = cone.width + cone.spread * intersection.distance;
+    auto point = eval_point(
+        scene, intersection, ray, params.mipmap ? width : 0, time);
+
+    // correct roughness
+    if constexpr (nocaustics) {
+      max_roughness   = max(point.roughness, max_roughness);
+      point.roughness = max_roughness;
+    }
+
+    // handle opacity
+    if (point.opacity < 1 && rand1f(rng) >= point.opacity) {
+      ray  = {point.position + ray.d * 1e-2f, ray.d};
+      cone = scatter_cone(cone, intersection.distance, 0);
+      return true;
+    }
+    hit = true;
+
+    // accumulate emission
+    radiance += weight * eval_emission(point);
+
+    // next direction
+    auto leaf = guiding && point.roughness
+                    ? find_guiding_leaf(guiding, point.position)
+                    : -1;
+    if (leaf >= 0 && get_quadtree_total(guiding->sampling[leaf]) > 0) {
+      // one-sample mis of brdf, lights and guiding field
+      auto& tree = guiding->sampling[leaf];
+      auto  rn   = rand1f(rng);
+      if (rn < guiding_fraction) {
+        point.incoming = guiding_from_square(
+            sample_quadtree(tree, rand1f(rng), rand2f(rng)));
+      } else if (rn < (1 + guiding_fraction) / 2) {
+        point.incoming = sample_brdf(point, rand1f(rng), rand2f(rng));
+      } else {
+        point.incoming = sample_lights(scene, point.position, rand1f(rng),
+            rand2f(rng), rand2f(rng), time);
+      }
+      auto guiding_pdf = sample_quadtree_pdf(
+                             tree, guiding_to_square(point.incoming)) /
+                         (4 * pif);
+      auto other_pdf = 0.5f * sample_brdf_pdf(point) +
+                       0.5f * sample_lights_pdf(
+                                  scene, point.position, point.incoming, time);
+      weight *= eval_brdfcos(point) /
+                (guiding_fraction * guiding_pdf +
+                    (1 - guiding_fraction) * other_pdf);
+    } else if (point.roughness) {
+      if (rand1f(rng) < 0.5f) {
+        point.incoming = sample_brdf(point, rand1f(rng), rand2f(rng));
+      } else {
+        point.incoming = sample_lights(scene, point.position, rand1f(rng),
+            rand2f(rng), rand2f(rng), time);
+      }
+      weight *= eval_brdfcos(point) /
+                (0.5f * sample_brdf_pdf(point) +
+                    0.5f * sample_lights_pdf(
+                               scene, point.position, point.incoming, time));
+    } else {
+      point.incoming = sample_delta(point, rand1f(rng));
+      weight *= eval_delta(point) / sample_delta_pdf(point);
+    }
+
+    // record the sampled direction, with the weight set after roulette
+    if (record && leaf >= 0 && record->count < record->vertices.size()) {
+      auto& vertex     = record->vertices[record->count++];
+      vertex.leaf      = leaf;
+      vertex.direction = guiding_to_square(point.incoming);
+      vertex.radiance  = radiance;
+      vertex.weight    = zero3f;
+      recorded         = true;
+    }
+
+    // update volume stack
+    if (has_volume(scene, intersection) &&
+        dot(point.normal, point.outgoing) *
+                dot(point.normal, point.incoming) <
+            0) {
+      if (volume_stack.empty()) {
+        auto volpoint = eval_volume(scene, intersection, ray, time);
+        volume_stack.push_back(volpoint);
+      } else {
+        volume_stack.pop_back();
+      }
+    }
+
+    // setup next iteration
+    ray  = {point.position, point.incoming};
+    cone = scatter_cone(cone, intersection.distance, point.roughness);
+  } else {
+    // prepare shading point
+    auto point       = volume_stack.back();
+    point.outgoing   = -ray.d;
+    point.position   = ray.o + ray.d * intersection.distance;
+    point.voldensity = eval_voldensity(point, point.position);
+
+    // handle opacity
+    hit = true;
+
+    // accumulate emission
+    radiance += weight * eval_volemission(point);
+
+    // next direction
+    if (rand1f(rng) < 0.5f) {
+      point.incoming = sample_scattering(point, rand1f(rng), rand2f(rng));
+    } else {
+      point.incoming = sample_lights(scene, point.position, rand1f(rng),
+          rand2f(rng), rand2f(rng), time);
+    }
+    weight *= eval_scattering(point) /
+              (0.5f * sample_scattering_pdf(point) +
+                  0.5f * sample_lights_pdf(
+                             scene, point.position, point.incoming, time));
+
+    // setup next iteration
+    ray  = {point.position, point.incoming};
+    cone = scatter_cone(cone, intersection.distance, 1);
+  }
+
+  // check weight
+  if (weight == zero3f || !isfinite(weight)) return false;
+
+  // russian roulette
+  if (path.bounce > 3) {
+    auto rr_prob = min((float)0.99, max(weight));
+    if (rand1f(rng) >= rr_prob) return false;
+    weight *= 1 / rr_prob;
+  }
+  if (recorded) record->vertices[record->count - 1].weight = weight;
+
+  // next bounce
+  path.bounce += 1;
+  return path.bounce < params.bounces;
+}
+
+// Recursive path tracing.
+template <bool nocaustics>
+static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
+    const ray3f& ray_, const ray_cone& cone, float time, sampler_state& rng,
+    const trace_params& params) {
+  // initialize
+  auto path = path_state{};
+  path.ray  = ray_;
+  path.cone = cone;
+  path.time = time;
+
+  // trace  path
+  if (params.bounces <= 0) return {path.radiance, path.hit};
+  while (trace_path_bounce<nocaustics>(scene, path,
+      intersect_scene_bvh(scene, path.ray, false, true, time), rng, params)) {
+  }
+
+  return {path.radiance, path.hit};
+}
+
+// Path tracing guided by a field learned from the radiance of the previous
+// paths, that is recorded while the field is training.
+template <bool nocaustics>
+static std::pair<vec3f, bool> trace_guided(const trc::scene* scene,
+    guiding_field* guiding, const ray3f& ray_, const ray_cone& cone,
+    float time, sampler_state& rng, const trace_params& params) {
+  // initialize
+  auto path   = path_state{};
+  path.ray    = ray_;
+  path.cone   = cone;
+  path.time   = time;
+  auto record = guiding_path{};
+  auto train  = guiding && guiding->training;
+
+  // trace  path
+  if (params.bounces <= 0) return {path.radiance, path.hit};
+  while (trace_path_bounce<nocaustics>(scene, path,
+      intersect_scene_bvh(scene, path.ray, false, true, time), rng, params,
+      guiding, train ? &record : nullptr)) {
+  }
+
+  // record radiance for training
+  if (train) record_guiding(guiding, record, path.radiance);
+
+  return {path.radiance, path.hit};
+}
+
+// Path tracing with next event estimation. At each rough surface, a light
+// is sampled and connected with a shadow ray, while the next bounce samples
+// the brdf. Both strategies are combined with the power heuristic. Inside
+// and across volume boundaries, where shadow rays would miss transmittance,
+// and for delta lobes, light sampling is skipped and hit emission is taken
+// as is. Shadow rays treat all surfaces as opaque.
+template <bool nocaustics>
+static std::pair<vec3f, bool> trace_pathnee(const trc::scene* scene,
+    const ray3f& ray_, const ray_cone& cone_, float time, sampler_state& rng,
+    const trace_params& params) {
+  // initialize
+  auto radiance      = zero3f;
+  auto weight        = vec3f{1, 1, 1};
+  auto ray           = ray_;
+  auto cone          = cone_;
+  auto volume_stack  = std::vector<volume_point>{};
+  auto max_roughness = 0.0f;
+  auto hit           = false;
+  auto nee_pdf       = 0.0f;  // brdf pdf of the last bounce if nee was used
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
     // intersect next point
-    auto intersection = intersect_scene_bvh(scene, ray);
+    auto intersection = intersect_scene_bvh(scene, ray, false, true, time);
     if (!intersection.hit) {
-      radiance += weight * eval_environment(scene, ray);
+      auto emission = eval_environment(scene, ray);
+      if (nee_pdf && emission != zero3f)
+        emission *= mis_power_weight(
+            nee_pdf, sample_lights_pdf(scene, ray.o, ray.d, time));
+      radiance += weight * emission;
       break;
     }
 
@@ -1973,11 +5163,19 @@ static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
     auto in_volume = false;
     if (!volume_stack.empty()) {
       auto& point    = volume_stack.back();
-      auto  distance = sample_transmittance(
-          point.voldensity, intersection.distance, rand1f(rng), rand1f(rng));
-      weight *= eval_transmittance(point.voldensity, distance) /
-                sample_transmittance_pdf(
-                    point.voldensity, distance, intersection.distance);
+      auto  distance = intersection.distance;
+      if (point.density) {
+        auto [collision, tweight] = sample_density_distance(
+            point, ray, intersection.distance, rng);
+        distance = collision;
+        weight *= tweight;
+      } else {
+        distance = sample_transmittance(point.voldensity,
+            intersection.distance, rand1f(rng), rand1f(rng));
+        weight *= eval_transmittance(point.voldensity, distance) /
+                  sample_transmittance_pdf(
+                      point.voldensity, distance, intersection.distance);
+      }
       in_volume             = distance < intersection.distance;
       intersection.distance = distance;
     }
@@ -1985,62 +5183,89 @@ static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
     // switch between surface and volume
     if (!in_volume) {
       // prepare shading point
-      auto point = eval_point(scene, intersection, ray);
+      auto width = cone.width + cone.spread * intersection.distance;
+      auto point = eval_point(
+          scene, intersection, ray, params.mipmap ? width : 0, time);
 
       // correct roughness
-      if (params.nocaustics) {
+      if constexpr (nocaustics) {
         max_roughness   = max(point.roughness, max_roughness);
         point.roughness = max_roughness;
       }
 
       // handle opacity
       if (point.opacity < 1 && rand1f(rng) >= point.opacity) {
-        ray = {point.position + ray.d * 1e-2f, ray.d};
+        ray  = {point.position + ray.d * 1e-2f, ray.d};
+        cone = scatter_cone(cone, intersection.distance, 0);
         bounce -= 1;
         continue;
       }
       hit = true;
 
-      // accumulate emission
-      radiance += weight * eval_emission(point);
+      // accumulate emission, weighted against light sampling
+      auto emission = eval_emission(point);
+      if (nee_pdf && emission != zero3f)
+        emission *= mis_power_weight(
+            nee_pdf, sample_lights_pdf(scene, ray.o, ray.d, time));
+      radiance += weight * emission;
 
       // next direction
+      auto enters_volume = [&](const vec3f& incoming) {
+        return has_volume(scene, intersection) &&
+               dot(point.normal, point.outgoing) *
+                       dot(point.normal, incoming) <
+                   0;
+      };
       if (point.roughness) {
-        if (rand1f(rng) < 0.5f) {
-          point.incoming = sample_brdf(point, rand1f(rng), rand2f(rng));
-        } else {
-          point.incoming = sample_lights(
-              scene, point.position, rand1f(rng), rand1f(rng), rand2f(rng));
+        // next event estimation, skipping lights behind volume boundaries
+        nee_pdf = 0;
+        if (volume_stack.empty()) {
+          auto light = sample_lights_point(scene, point.position,
+              rand1f(rng), rand2f(rng), rand2f(rng), time);
+          if (light.pdf > 0 && light.emission != zero3f &&
+              !enters_volume(light.incoming)) {
+            point.incoming = light.incoming;
+            auto brdfcos   = eval_brdfcos(point);
+            auto shadow    = ray3f{point.position, light.incoming, ray_eps,
+                light.distance * (1 - 1e-3f)};
+            if (brdfcos != zero3f &&
+                !is_scene_occluded(scene, shadow, true, time)) {
+              radiance += weight * brdfcos * light.emission / light.pdf *
+                          mis_power_weight(
+                              light.pdf, sample_brdf_pdf(point));
+            }
+          }
         }
-        weight *= eval_brdfcos(point) /
-                  (0.5f * sample_brdf_pdf(point) +
-                      0.5f * sample_lights_pdf(
-                                 scene, point.position, point.incoming));
+        point.incoming = sample_brdf(point, rand1f(rng), rand2f(rng));
+        auto brdf_pdf  = sample_brdf_pdf(point);
+        weight *= eval_brdfcos(point) / brdf_pdf;
+        if (volume_stack.empty()) nee_pdf = brdf_pdf;
       } else {
         point.incoming = sample_delta(point, rand1f(rng));
         weight *= eval_delta(point) / sample_delta_pdf(point);
+        nee_pdf = 0;
       }
 
       // update volume stack
-      if (has_volume(scene, intersection) &&
-          dot(point.normal, point.outgoing) *
-                  dot(point.normal, point.incoming) <
-              0) {
+      if (enters_volume(point.incoming)) {
         if (volume_stack.empty()) {
-          auto volpoint = eval_volume(scene, intersection, ray);
+          auto volpoint = eval_volume(scene, intersection, ray, time);
           volume_stack.push_back(volpoint);
         } else {
           volume_stack.pop_back();
         }
+        nee_pdf = 0;
       }
 
       // setup next iteration
-      ray = {point.position, point.incoming};
+      ray  = {point.position, point.incoming};
+      cone = scatter_cone(cone, intersection.distance, point.roughness);
     } else {
       // prepare shading point
-      auto point     = volume_stack.back();
-      point.outgoing = -ray.d;
-      point.position = ray.o + ray.d * intersection.distance;
+      auto point       = volume_stack.back();
+      point.outgoing   = -ray.d;
+      point.position   = ray.o + ray.d * intersection.distance;
+      point.voldensity = eval_voldensity(point, point.position);
 
       // handle opacity
       hit = true;
@@ -2049,19 +5274,13 @@ static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
       radiance += weight * eval_volemission(point);
 
       // next direction
-      if (rand1f(rng) < 0.5f) {
-        point.incoming = sample_scattering(point, rand1f(rng), rand2f(rng));
-      } else {
-        point.incoming = sample_lights(
-            scene, point.position, rand1f(rng), rand1f(rng), rand2f(rng));
-      }
-      weight *=
-          eval_scattering(point) /
-          (0.5f * sample_scattering_pdf(point) +
-              0.5f * sample_lights_pdf(scene, point.position, point.incoming));
+      point.incoming = sample_scattering(point, rand1f(rng), rand2f(rng));
+      weight *= eval_scattering(point) / sample_scattering_pdf(point);
+      nee_pdf = 0;
 
       // setup next iteration
-      ray = {point.position, point.incoming};
+      ray  = {point.position, point.incoming};
+      cone = scatter_cone(cone, intersection.distance, 1);
     }
 
     // check weight
@@ -2080,28 +5299,33 @@ static std::pair<vec3f, bool> trace_path(const trc::scene* scene,
 
 // Recursive path tracing.
 static std::pair<vec3f, bool> trace_naive(const trc::scene* scene,
-    const ray3f& ray_, rng_state& rng, const trace_params& params) {
+    const ray3f& ray_, const ray_cone& cone_, float time, sampler_state& rng,
+    const trace_params& params) {
   // initialize
   auto radiance = zero3f;
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
+  auto cone     = cone_;
   auto hit      = false;
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
     // intersect next point
-    auto intersection = intersect_scene_bvh(scene, ray);
+    auto intersection = intersect_scene_bvh(scene, ray, false, true, time);
     if (!intersection.hit) {
       radiance += weight * eval_environment(scene, ray);
       break;
     }
 
     // prepare shading point
-    auto point = eval_point(scene, intersection, ray);
+    auto width = cone.width + cone.spread * intersection.distance;
+    auto point = eval_point(
+        scene, intersection, ray, params.mipmap ? width : 0, time);
 
     // handle opacity
     if (point.opacity < 1 && rand1f(rng) >= point.opacity) {
-      ray = {point.position + ray.d * 1e-2f, ray.d};
+      ray  = {point.position + ray.d * 1e-2f, ray.d};
+      cone = scatter_cone(cone, intersection.distance, 0);
       bounce -= 1;
       continue;
     }
@@ -2130,36 +5354,47 @@ static std::pair<vec3f, bool> trace_naive(const trc::scene* scene,
     }
 
     // setup next iteration
-    ray = {point.position, point.incoming};
+    ray  = {point.position, point.incoming};
+    cone = scatter_cone(cone, intersection.distance, point.roughness);
   }
 
   return {radiance, hit};
 }
 
-// Eyelight for quick previewing.
-static std::pair<vec3f, bool> trace_eyelight(const trc::scene* scene,
-    const ray3f& ray_, rng_state& rng, const trace_params& params) {
+// Eyelight for quick previewing, given the intersection of the first ray.
+static std::pair<vec3f, bool> shade_eyelight(const trc::scene* scene,
+    const ray3f& ray_, const intersection3f& intersection_,
+    const ray_cone& cone_, float time, sampler_state& rng,
+    const trace_params& params) {
   // initialize
   auto radiance = zero3f;
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
+  auto cone     = cone_;
   auto hit      = false;
+  auto first    = true;
 
   // trace  path
   for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
     // intersect next point
-    auto intersection = intersect_scene_bvh(scene, ray);
+    auto intersection = first ? intersection_
+                              : intersect_scene_bvh(
+                                    scene, ray, false, true, time);
+    first             = false;
     if (!intersection.hit) {
       radiance += weight * eval_environment(scene, ray);
       break;
     }
 
     // prepare shading point
-    auto point = eval_point(scene, intersection, ray);
+    auto width = cone.width + cone.spread * intersection.distance;
+    auto point = eval_point(
+        scene, intersection, ray, params.mipmap ? width : 0, time);
 
     // handle opacity
     if (point.opacity < 1 && rand1f(rng) >= point.opacity) {
-      ray = {point.position + ray.d * 1e-2f, ray.d};
+      ray  = {point.position + ray.d * 1e-2f, ray.d};
+      cone = scatter_cone(cone, intersection.distance, 0);
       bounce -= 1;
       continue;
     }
@@ -2179,24 +5414,31 @@ static std::pair<vec3f, bool> trace_eyelight(const trc::scene* scene,
     if (weight == zero3f || !isfinite(weight)) break;
 
     // setup next iteration
-    ray = {point.position, point.incoming};
+    ray  = {point.position, point.incoming};
+    cone = scatter_cone(cone, intersection.distance, 0);
   }
 
   return {radiance, hit};
 }
 
-// False color rendering
-static std::pair<vec3f, bool> trace_falsecolor(const trc::scene* scene,
-    const ray3f& ray, rng_state& rng, const trace_params& params) {
-  // intersect next point
-  auto intersection = intersect_scene_bvh(scene, ray);
-  if (!intersection.hit) {
-    return {zero3f, false};
-  }
+// Eyelight for quick previewing.
+static std::pair<vec3f, bool> trace_eyelight(const trc::scene* scene,
+    const ray3f& ray, const ray_cone& cone, float time, sampler_state& rng,
+    const trace_params& params) {
+  auto intersection = intersect_scene_bvh(scene, ray, false, true, time);
+  return shade_eyelight(scene, ray, intersection, cone, time, rng, params);
+}
 
-  // prepare shading point
-  auto point = eval_point(scene, intersection, ray);
+// Albedo of a point, summing the weights of all lobes.
+static vec3f eval_albedo(const trace_point& point) {
+  return min(point.diffuse + point.specular + point.metal + point.coat +
+                 point.transmission + point.translucency,
+      vec3f{1, 1, 1});
+}
 
+// False color of a hit point
+static vec3f eval_falsecolor(const trace_point& point, const ray3f& ray,
+    const intersection3f& intersection, falsecolor_type type) {
   // hash color
   auto hashed_color = [](int id) {
     auto hashed = std::hash<int>()(id);
@@ -2204,55 +5446,84 @@ static std::pair<vec3f, bool> trace_falsecolor(const trc::scene* scene,
     return pow(0.5f + 0.5f * rand3f(rng), 2.2f);
   };
 
-  switch (params.falsecolor) {
-    case falsecolor_type::normal: return {point.normal * 0.5f + 0.5f, 1};
+  switch (type) {
+    case falsecolor_type::normal: return point.normal * 0.5f + 0.5f;
     case falsecolor_type::frontfacing:
-      return {
-          dot(point.normal, -ray.d) > 0 ? vec3f{0, 1, 0} : vec3f{1, 0, 0}, 1};
-    case falsecolor_type::gnormal: return {point.gnormal * 0.5f + 0.5f, 1};
+      return dot(point.normal, -ray.d) > 0 ? vec3f{0, 1, 0} : vec3f{1, 0, 0};
+    case falsecolor_type::gnormal: return point.gnormal * 0.5f + 0.5f;
     case falsecolor_type::gfrontfacing:
-      return {
-          dot(point.gnormal, -ray.d) > 0 ? vec3f{0, 1, 0} : vec3f{1, 0, 0}, 1};
+      return dot(point.gnormal, -ray.d) > 0 ? vec3f{0, 1, 0} : vec3f{1, 0, 0};
     case falsecolor_type::texcoord:
-      return {
-          {fmod(point.texcoord.x, 1.0f), fmod(point.texcoord.y, 1.0f), 0}, 1};
-    case falsecolor_type::color: return {point.color, 1};
-    case falsecolor_type::emission: return {point.emission, 1};
-    case falsecolor_type::diffuse: return {point.diffuse, 1};
-    case falsecolor_type::specular: return {point.specular, 1};
-    case falsecolor_type::coat: return {point.coat, 1};
-    case falsecolor_type::metal: return {point.metal, 1};
-    case falsecolor_type::transmission: return {point.transmission, 1};
-    case falsecolor_type::translucency: return {point.translucency, 1};
-    case falsecolor_type::refraction: return {point.refraction, 1};
-    case falsecolor_type::roughness: return {vec3f{point.roughness}, 1};
-    case falsecolor_type::opacity: return {vec3f{point.opacity}, 1};
-    case falsecolor_type::ior: return {vec3f{point.ior}, 1};
-    case falsecolor_type::element:
-      return {hashed_color(intersection.element), 1};
-    case falsecolor_type::object: return {hashed_color(intersection.object), 1};
+      return {fmod(point.texcoord.x, 1.0f), fmod(point.texcoord.y, 1.0f), 0};
+    case falsecolor_type::color: return point.color;
+    case falsecolor_type::emission: return point.emission;
+    case falsecolor_type::diffuse: return point.diffuse;
+    case falsecolor_type::specular: return point.specular;
+    case falsecolor_type::coat: return point.coat;
+    case falsecolor_type::metal: return point.metal;
+    case falsecolor_type::transmission: return point.transmission;
+    case falsecolor_type::translucency: return point.translucency;
+    case falsecolor_type::refraction: return point.refraction;
+    case falsecolor_type::roughness: return vec3f{point.roughness};
+    case falsecolor_type::opacity: return vec3f{point.opacity};
+    case falsecolor_type::ior: return vec3f{point.ior};
+    case falsecolor_type::element: return hashed_color(intersection.element);
+    case falsecolor_type::object: return hashed_color(intersection.object);
     case falsecolor_type::highlight: {
       auto emission = point.emission;
       if (emission == zero3f) emission = {0.2f, 0.2f, 0.2f};
-      return {emission * abs(dot(-ray.d, point.normal)), 1};
+      return emission * abs(dot(-ray.d, point.normal));
     } break;
-    default: return {zero3f, false};
+    case falsecolor_type::depth:
+      return vec3f{intersection.distance * length(ray.d)};
+    case falsecolor_type::albedo: return eval_albedo(point);
+    default: return zero3f;
   }
 }
 
-// Trace a single ray from the camera using the given algorithm.
-using sampler_func = std::pair<vec3f, bool> (*)(const trc::scene* scene,
-    const ray3f& ray, rng_state& rng, const trace_params& params);
-static sampler_func get_trace_sampler_func(const trace_params& params) {
-  switch (params.sampler) {
-    case sampler_type::path: return trace_path;
-    case sampler_type::naive: return trace_naive;
-    case sampler_type::eyelight: return trace_eyelight;
-    case sampler_type::falsecolor: return trace_falsecolor;
-    default: {
-      throw std::runtime_error("sampler unknown");
-      return nullptr;
-    }
+// False color rendering
+static std::pair<vec3f, bool> shade_falsecolor(const trc::scene* scene,
+    const ray3f& ray, const intersection3f& intersection, float time,
+    const trace_params& params) {
+  // check hit
+  if (!intersection.hit) {
+    return {zero3f, false};
+  }
+
+  // prepare shading point
+  auto point = eval_point(scene, intersection, ray, 0, time);
+  return {eval_falsecolor(point, ray, intersection, params.falsecolor), true};
+}
+
+// False color rendering
+static std::pair<vec3f, bool> trace_falsecolor(const trc::scene* scene,
+    const ray3f& ray, const ray_cone& cone, float time, sampler_state& rng,
+    const trace_params& params) {
+  auto intersection = intersect_scene_bvh(scene, ray, false, true, time);
+  return shade_falsecolor(scene, ray, intersection, time, params);
+}
+
+// Trace a single ray from the camera using the given algorithm, with moving
+// instances placed at the ray time. The sampler is a template parameter, so
+// that it is inlined in the render kernels.
+template <sampler_type sampler, bool nocaustics>
+static std::pair<vec3f, bool> trace_sampler(const trc::scene* scene,
+    const ray3f& ray, const ray_cone& cone, float time, sampler_state& rng,
+    const trace_params& params, guiding_field* guiding) {
+  if constexpr (sampler == sampler_type::path ||
+                sampler == sampler_type::wavefront) {
+    return trace_path<nocaustics>(scene, ray, cone, time, rng, params);
+  } else if constexpr (sampler == sampler_type::guided) {
+    return trace_guided<nocaustics>(
+        scene, guiding, ray, cone, time, rng, params);
+  } else if constexpr (sampler == sampler_type::pathnee) {
+    return trace_pathnee<nocaustics>(scene, ray, cone, time, rng, params);
+  } else if constexpr (sampler == sampler_type::naive) {
+    return trace_naive(scene, ray, cone, time, rng, params);
+  } else if constexpr (sampler == sampler_type::eyelight) {
+    return trace_eyelight(scene, ray, cone, time, rng, params);
+  } else {
+    return trace_falsecolor(scene, ray, cone, time, rng, params);
   }
 }
 
@@ -2260,9 +5531,12 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
 bool is_sampler_lit(const trace_params& params) {
   switch (params.sampler) {
     case sampler_type::path: return true;
+    case sampler_type::pathnee: return true;
+    case sampler_type::wavefront: return true;
     case sampler_type::naive: return true;
     case sampler_type::eyelight: return false;
     case sampler_type::falsecolor: return false;
+    case sampler_type::guided: return true;
     default: {
       throw std::runtime_error("sampler unknown");
       return false;
@@ -2270,16 +5544,112 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
-vec4f trace_sample(trc::state* state, const trc::scene* scene,
-    const trc::camera* camera, const vec2i& ij, const trace_params& params) {
-  auto  sampler = get_trace_sampler_func(params);
-  auto& pixel   = state->pixels[ij];
-  auto  ray = sample_camera(camera, ij, state->pixels.size(), rand2f(pixel.rng),
-      rand2f(pixel.rng), params.tentfilter);
-  auto [radiance, hit] = sampler(scene, ray, pixel.rng, params);
+// Get and set pixels, converting from and to half-floats if needed.
+static trc::pixel get_pixel(const trc::state* state, const vec2i& ij) {
+  if (state->hpixels.empty()) return state->pixels[ij];
+  auto& hpixel     = state->hpixels[ij];
+  auto  pixel      = trc::pixel{};
+  pixel.hits       = hpixel.hits;
+  pixel.samples    = hpixel.samples;
+  pixel.radiance   = half_to_float(hpixel.radiance) * (float)pixel.samples;
+  pixel.luminance2 = half_to_float(hpixel.luminance2) * pixel.samples;
+  return pixel;
+}
+static void set_pixel(
+    trc::state* state, const vec2i& ij, const trc::pixel& pixel) {
+  if (state->hpixels.empty()) {
+    state->pixels[ij] = pixel;
+    return;
+  }
+  auto& hpixel   = state->hpixels[ij];
+  hpixel.hits    = pixel.hits;
+  hpixel.samples = pixel.samples;
+  if (!pixel.samples) return;
+  auto radiance     = pixel.radiance / (float)pixel.samples;
+  hpixel.radiance   = float_to_half(radiance);
+  hpixel.luminance2 = float_to_half(pixel.luminance2 / pixel.samples);
+}
+
+// Check whether a frame is split by samples across nodes.
+static bool is_sample_partition(const trace_params& params) {
+  return params.nodes > 1 && params.partition == partition_type::samples;
+}
+
+// Range of samples traced by the node, when splitting samples.
+static vec2i get_partition_samples(const trace_params& params) {
+  if (!is_sample_partition(params)) return {0, params.samples};
+  auto nodes = (int64_t)params.nodes, samples = (int64_t)params.samples;
+  return {(int)(params.node * samples / nodes),
+      (int)((params.node + 1) * samples / nodes)};
+}
+
+// Pixel of the frame for a pixel of the state buffers.
+static vec2i get_frame_pixel(const trc::state* state, const vec2i& ij) {
+  return {ij.x + state->crop.x, ij.y + state->crop.y};
+}
+
+// Get and set the rng of a pixel for its next sample. Compact rngs are
+// counter-based, keyed by the pixel index and sample number, and are not
+// stored.
+// Low-discrepancy sequences are indexed by the sample number, and scrambled
+// with a seed derived from the pixel index.
+static sampler_state get_pixel_rng(const trc::state* state, const vec2i& ij,
+    int sample, const trace_params& params) {
+  sample += get_partition_samples(params).x;
+  auto fij   = get_frame_pixel(state, ij);
+  auto pixel = (uint64_t)fij.y * (uint64_t)state->frame.x + (uint64_t)fij.x;
+  auto rng      = sampler_state{};
+  rng.sequence  = params.sequence;
+  rng.index     = (uint32_t)sample;
+  rng.seed      = (uint32_t)mix_bits(pixel ^ params.seed);
+  rng.compact   = state->rngs.empty();
+  if (rng.compact) {
+    rng.key = hash_rng(make_rng_key(params.seed, pixel), (uint64_t)sample);
+  } else {
+    rng.rng = state->rngs[ij];
+  }
+  return rng;
+}
+static void set_pixel_rng(
+    trc::state* state, const vec2i& ij, const sampler_state& rng) {
+  if (!state->rngs.empty()) state->rngs[ij] = rng.rng;
+}
+
+// Sample the time of a camera ray while the shutter is open. The random
+// number is drawn only for open shutters, to keep still renders unchanged.
+static float sample_camera_time(
+    const trc::camera* camera, sampler_state& rng) {
+  return camera->shutter > 0 ? rand1f(rng) * camera->shutter : 0;
+}
+
+// Accumulate the first hit of a camera ray in the denoising features and
+// aovs, if present. Opacity is ignored and no random numbers are drawn, so
+// that features do not change the render.
+static void accumulate_features(trc::state* state, const trc::scene* scene,
+    const vec2i& ij, const ray3f& ray, float time,
+    const trace_params& params) {
+  if (state->albedo.empty() && state->aovs.empty()) return;
+  auto intersection = intersect_scene_bvh(scene, ray, false, true, time);
+  auto point        = intersection.hit
+                          ? eval_point(scene, intersection, ray, 0, time)
+                          : trace_point{};
+  if (!state->albedo.empty()) {
+    state->albedo[ij] += {eval_albedo(point), 1};
+    state->normal[ij] += {point.normal, 1};
+  }
+  if (!intersection.hit) return;
+  for (auto idx = 0; idx < (int)state->aovs.size(); idx++) {
+    state->aovs[idx][ij] += {
+        eval_falsecolor(point, ray, intersection, params.aovs[idx]), 1};
+  }
+}
+
+// Accumulate a sample in a pixel and returns the pixel color
+template <bool envhidden>
+static vec4f accumulate_sample(trc::pixel& pixel, const trc::scene* scene,
+    vec3f radiance, bool hit, const trace_params& params) {
   if (!hit) {
-    if (params.envhidden || scene->environments.empty()) {
+    if (envhidden || scene->environments.empty()) {
       radiance = zero3f;
       hit      = false;
     } else {
@@ -2289,195 +5659,1680 @@ vec4f trace_sample(trc::state* state, const trc::scene* scene,
   if (!isfinite(radiance)) radiance = zero3f;
   if (max(radiance) > params.clamp)
     radiance = radiance * (params.clamp / max(radiance));
+  auto luminance = (radiance.x + radiance.y + radiance.z) / 3;
   pixel.radiance += radiance;
+  pixel.luminance2 += luminance * luminance;
   pixel.hits += hit ? 1 : 0;
   pixel.samples += 1;
   return {pixel.hits ? pixel.radiance / pixel.hits : zero3f,
       (float)pixel.hits / (float)pixel.samples};
 }
+static vec4f accumulate_sample(trc::pixel& pixel, const trc::scene* scene,
+    vec3f radiance, bool hit, const trace_params& params) {
+  return params.envhidden
+             ? accumulate_sample<true>(pixel, scene, radiance, hit, params)
+             : accumulate_sample<false>(pixel, scene, radiance, hit, params);
+}
 
-// Init a sequence of random number generators.
-void init_state(trc::state* state, const trc::scene* scene,
-    const trc::camera* camera, const trace_params& params) {
-  auto image_size =
-      (camera->film.x > camera->film.y)
-          ? vec2i{params.resolution,
-                (int)round(params.resolution * camera->film.y / camera->film.x)}
-          : vec2i{
-                (int)round(params.resolution * camera->film.x / camera->film.y),
-                params.resolution};
-  state->pixels.assign(image_size, pixel{});
-  state->render.assign(image_size, zero4f);
-  auto rng = make_rng(1301081);
-  for (auto& pixel : state->pixels) {
-    pixel.rng = make_rng(params.seed, rand1i(rng, 1 << 31) / 2 + 1);
+// Trace a sample of a pixel. Kernels are specialized on the sampler and
+// the boolean options, so that option checks are resolved at compile time.
+template <sampler_type sampler, bool nocaustics, bool tentfilter,
+    bool envhidden>
+static vec4f trace_sample(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const vec2i& ij, const trace_params& params) {
+  auto timer = counter_timer{trace_counter::sample_time};
+  add_counter(trace_counter::samples);
+  auto pixel = get_pixel(state, ij);
+  auto rng   = get_pixel_rng(state, ij, pixel.samples, params);
+  auto ray   = sample_camera(camera, get_frame_pixel(state, ij), state->frame,
+      rand2f(rng), rand2f(rng), tentfilter);
+  auto cone            = get_camera_cone(camera, state->frame);
+  auto time            = sample_camera_time(camera, rng);
+  auto [radiance, hit] = trace_sampler<sampler, nocaustics>(
+      scene, ray, cone, time, rng, params, state->guiding.get());
+  accumulate_features(state, scene, ij, ray, time, params);
+  auto color = accumulate_sample<envhidden>(
+      pixel, scene, radiance, hit, params);
+  set_pixel(state, ij, pixel);
+  set_pixel_rng(state, ij, rng);
+  return color;
+}
+
+// Render kernel for the sampler and options, selected once per render.
+using sample_kernel = vec4f (*)(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const vec2i& ij, const trace_params& params);
+template <sampler_type sampler, bool nocaustics>
+static sample_kernel get_sample_kernel(const trace_params& params) {
+  if (params.tentfilter) {
+    return params.envhidden ? trace_sample<sampler, nocaustics, true, true>
+                            : trace_sample<sampler, nocaustics, true, false>;
+  } else {
+    return params.envhidden ? trace_sample<sampler, nocaustics, false, true>
+                            : trace_sample<sampler, nocaustics, false, false>;
+  }
+}
+static sample_kernel get_sample_kernel(const trace_params& params) {
+  switch (params.sampler) {
+    case sampler_type::path:
+    case sampler_type::wavefront:
+      return params.nocaustics
+                 ? get_sample_kernel<sampler_type::path, true>(params)
+                 : get_sample_kernel<sampler_type::path, false>(params);
+    case sampler_type::pathnee:
+      return params.nocaustics
+                 ? get_sample_kernel<sampler_type::pathnee, true>(params)
+                 : get_sample_kernel<sampler_type::pathnee, false>(params);
+    case sampler_type::naive:
+      return get_sample_kernel<sampler_type::naive, false>(params);
+    case sampler_type::eyelight:
+      return get_sample_kernel<sampler_type::eyelight, false>(params);
+    case sampler_type::falsecolor:
+      return get_sample_kernel<sampler_type::falsecolor, false>(params);
+    case sampler_type::guided:
+      return params.nocaustics
+                 ? get_sample_kernel<sampler_type::guided, true>(params)
+                 : get_sample_kernel<sampler_type::guided, false>(params);
+    default: {
+      throw std::runtime_error("sampler unknown");
+      return nullptr;
+    }
   }
 }
 
-// Forward declaration
-trc::light* add_light(trc::scene* scene);
+// Size of the image rendered from a camera, following its aspect.
+vec2i get_render_size(const trc::camera* camera, const trace_params& params) {
+  return (camera->film.x > camera->film.y)
+             ? vec2i{params.resolution,
+                   (int)round(
+                       params.resolution * camera->film.y / camera->film.x)}
+             : vec2i{(int)round(
+                         params.resolution * camera->film.x / camera->film.y),
+                   params.resolution};
+}
 
-// Init trace lights
-void init_lights(trc::scene* scene, progress_callback progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1};
-  if (progress_cb) progress_cb("build light", progress.x++, progress.y);
+// Part of the frame rendered
+vec4i get_render_crop(const trc::camera* camera, const trace_params& params) {
+  auto size = get_render_size(camera, params);
+  auto crop = params.crop;
+  if (crop.z <= crop.x || crop.w <= crop.y) return {0, 0, size.x, size.y};
+  crop = {clamp(crop.x, 0, size.x), clamp(crop.y, 0, size.y),
+      clamp(crop.z, 0, size.x), clamp(crop.w, 0, size.y)};
+  if (crop.z <= crop.x || crop.w <= crop.y)
+    throw std::runtime_error("render crop outside the frame");
+  return crop;
+}
 
-  for (auto light : scene->lights) delete light;
-  scene->lights.clear();
+// Seed the per-pixel rngs. Rngs are drawn for the whole frame, so that
+// pixels in a crop get the same rngs as in the full render.
+static void seed_rngs(trc::state* state, const trace_params& params) {
+  auto rng  = make_rng(1301081);
+  auto crop = state->crop;
+  for (auto j = 0; j < crop.w; j++) {
+    for (auto i = 0; i < state->frame.x; i++) {
+      auto seed = rand1i(rng, 1 << 31) / 2 + 1;
+      if (j < crop.y || i < crop.x || i >= crop.z) continue;
+      state->rngs[{i - crop.x, j - crop.y}] = make_rng(params.seed, seed);
+    }
+  }
+}
+
+// NUMA node that owns the pixels of an image row. Rows are split in bands,
+// one per node, so that the pixels of each node are contiguous.
+static int get_row_node(int row, int height) {
+  auto nodes = (int)common::get_numa_nodes().size();
+  return clamp((int)((int64_t)row * nodes / max(height, 1)), 0, nodes - 1);
+}
+
+// Move the pixel buffers of each band of rows to the NUMA node that owns it.
+static void bind_state_memory(trc::state* state) {
+  auto bind_image = [](const auto& image) {
+    if (image.empty()) return;
+    auto [width, height] = image.size();
+    auto row_size        = (size_t)width * sizeof(*image.data());
+    auto start           = 0;
+    for (auto row = 1; row <= height; row++) {
+      if (row < height &&
+          get_row_node(row, height) == get_row_node(start, height))
+        continue;
+      common::bind_memory((const char*)image.data() + start * row_size,
+          (row - start) * row_size, get_row_node(start, height));
+      start = row;
+    }
+  };
+  bind_image(state->render);
+  bind_image(state->pixels);
+  bind_image(state->hpixels);
+  bind_image(state->rngs);
+  bind_image(state->albedo);
+  bind_image(state->normal);
+  for (auto& aov : state->aovs) bind_image(aov);
+}
+
+// Init a sequence of random number generators.
+void init_state(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params) {
+  state->frame    = get_render_size(camera, params);
+  state->crop     = get_render_crop(camera, params);
+  auto image_size = vec2i{
+      state->crop.z - state->crop.x, state->crop.w - state->crop.y};
+  state->render.assign(image_size, zero4f);
+  if (params.halfbuffer) {
+    state->pixels  = {};
+    state->hpixels.assign(image_size, pixel_half{});
+  } else {
+    state->pixels.assign(image_size, pixel{});
+    state->hpixels = {};
+  }
+  if (params.compactrng || is_sample_partition(params)) {
+    state->rngs = {};
+  } else {
+    state->rngs.assign(image_size, rng_state{});
+    seed_rngs(state, params);
+  }
+  if (params.denoise) {
+    state->albedo.assign(image_size, zero4f);
+    state->normal.assign(image_size, zero4f);
+  } else {
+    state->albedo = {};
+    state->normal = {};
+  }
+  state->aovs.assign(
+      params.aovs.size(), img::image<vec4f>{image_size, zero4f});
+  state->guiding = params.sampler == sampler_type::guided
+                       ? make_guiding_field(scene)
+                       : nullptr;
+  state->camera  = *camera;
+  if (params.numa) bind_state_memory(state);
+}
+
+size_t get_state_memory(const trc::state* state) {
+  auto memory = sizeof(trc::state) + get_memory(state->render) +
+                get_memory(state->pixels) + get_memory(state->hpixels) +
+                get_memory(state->rngs) + get_memory(state->albedo) +
+                get_memory(state->normal) + get_memory(state->aovs);
+  if (auto guiding = state->guiding.get(); guiding) {
+    memory += sizeof(guiding_field) + get_memory(guiding->nodes) +
+              get_memory(guiding->sampling) + get_memory(guiding->recording) +
+              get_memory(guiding->records) +
+              guiding->sampling.size() * sizeof(std::mutex);
+  }
+  return memory;
+}
+
+size_t get_state_memory(
+    const trc::camera* camera, const trace_params& params) {
+  auto crop   = get_render_crop(camera, params);
+  auto pixels = (size_t)(crop.z - crop.x) * (size_t)(crop.w - crop.y);
+  auto memory = sizeof(trc::state) + pixels * sizeof(vec4f);
+  memory += pixels * (params.halfbuffer ? sizeof(pixel_half) : sizeof(pixel));
+  if (!params.compactrng && !is_sample_partition(params))
+    memory += pixels * sizeof(rng_state);
+  if (params.denoise) memory += 2 * pixels * sizeof(vec4f);
+  memory += params.aovs.size() * pixels * sizeof(vec4f);
+  return memory;
+}
+
+// Clear the accumulated samples of a state, keeping its buffers and render
+// if they match the render size and options, or init it otherwise.
+static void clear_state(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params) {
+  auto has_rngs = !params.compactrng && !is_sample_partition(params);
+  if (state->frame != get_render_size(camera, params) ||
+      state->crop != get_render_crop(camera, params) ||
+      state->hpixels.empty() == params.halfbuffer ||
+      state->rngs.empty() == has_rngs ||
+      state->albedo.empty() == params.denoise ||
+      state->aovs.size() != params.aovs.size()) {
+    return init_state(state, scene, camera, params);
+  }
+  std::fill(state->pixels.begin(), state->pixels.end(), pixel{});
+  std::fill(state->hpixels.begin(), state->hpixels.end(), pixel_half{});
+  if (has_rngs) seed_rngs(state, params);
+  std::fill(state->albedo.begin(), state->albedo.end(), zero4f);
+  std::fill(state->normal.begin(), state->normal.end(), zero4f);
+  for (auto& aov : state->aovs) std::fill(aov.begin(), aov.end(), zero4f);
+  state->guiding = params.sampler == sampler_type::guided
+                       ? make_guiding_field(scene)
+                       : nullptr;
+  state->camera  = *camera;
+}
+
+// Forward declaration
+trc::light* add_light(trc::scene* scene);
+
+// Build the light tree over object lights. Lights are split at the median
+// of their centers along the largest axis, so that the tree is balanced.
+static void init_light_tree(trc::scene* scene) {
+  auto& nodes = scene->light_nodes;
+  nodes.clear();
+
+  // light bounds and power in world space
+  struct light_primitive {
+    bbox3f bbox   = invalidb3f;
+    vec3f  center = zero3f;
+    float  power  = 0;
+    int    light  = 0;
+  };
+  auto primitives = std::vector<light_primitive>{};
+  auto shape_bbox = invalidb3f;
+  auto last_shape = (trc::shape*)nullptr;
+  for (auto idx = 0; idx < scene->lights.size(); idx++) {
+    auto light = scene->lights[idx];
+    if (!light->object) continue;
+    auto object = light->object;
+    auto shape  = object->shape;
+    if (shape != last_shape) {
+      shape_bbox = shape->cpositions.empty() ? invalidb3f : shape->cbounds;
+      for (auto& position : shape->positions)
+        shape_bbox = merge(shape_bbox, position);
+      last_shape = shape;
+    }
+    auto frame  = scene->layout.frames[light->layout];
+    auto scale  = abs(determinant(mat3f{frame.x, frame.y, frame.z}));
+    auto& primitive = primitives.emplace_back();
+    primitive.bbox  = eval_instance_bounds(object, light->instance, shape_bbox);
+    // enlarge bounds to avoid missing lights in pdf computations
+    auto size       = primitive.bbox.max - primitive.bbox.min;
+    primitive.bbox  = {primitive.bbox.min - size * 1e-4f - 1e-6f,
+        primitive.bbox.max + size * 1e-4f + 1e-6f};
+    primitive.center = center(primitive.bbox);
+    primitive.power  = max(object->material->emission) *
+                      shape->elements_cdf.back() * pow(scale, 2.0f / 3.0f);
+    primitive.light  = idx;
+  }
+  if (primitives.empty()) return;
+
+  // build nodes
+  nodes.reserve(primitives.size() * 2);
+  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
+  nodes.emplace_back();
+  while (!queue.empty()) {
+    auto [nodeid, start, end] = queue.front();
+    queue.pop_front();
+    auto& node = nodes[nodeid];
+    auto  cbbox = invalidb3f;
+    for (auto idx = start; idx < end; idx++) {
+      node.bbox = merge(node.bbox, primitives[idx].bbox);
+      node.power += primitives[idx].power;
+      cbbox = merge(cbbox, primitives[idx].center);
+    }
+    if (end - start == 1) {
+      node.internal = false;
+      node.start    = primitives[start].light;
+      continue;
+    }
+    auto csize = cbbox.max - cbbox.min;
+    auto axis  = (csize.x >= csize.y && csize.x >= csize.z)
+                    ? 0
+                    : (csize.y >= csize.z ? 1 : 2);
+    auto mid = (start + end) / 2;
+    std::nth_element(primitives.data() + start, primitives.data() + mid,
+        primitives.data() + end, [axis](auto& a, auto& b) {
+          return a.center[axis] < b.center[axis];
+        });
+    node.internal = true;
+    node.start    = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    queue.push_back({node.start + 0, start, mid});
+    queue.push_back({node.start + 1, mid, end});
+  }
+}
+
+// Init trace lights
+// Inclusive prefix sum, computed in parallel over chunks of fixed size so
+// that results do not depend on the number of threads.
+static void parallel_prefix_sum(std::vector<float>& values) {
+  auto chunk  = 1 << 16;
+  auto size   = (int)values.size();
+  auto chunks = (size + chunk - 1) / chunk;
+  auto sums   = std::vector<float>(chunks);
+  common::parallel_for(chunks, [&](int idx) {
+    auto start = idx * chunk, end = min(start + chunk, size);
+    for (auto i = start + 1; i < end; i++) values[i] += values[i - 1];
+    sums[idx] = values[end - 1];
+  });
+  for (auto idx = 1; idx < chunks; idx++) sums[idx] += sums[idx - 1];
+  common::parallel_for(1, chunks, [&](int idx) {
+    auto start = idx * chunk, end = min(start + chunk, size);
+    for (auto i = start; i < end; i++) values[i] += sums[idx - 1];
+  });
+}
 
+// Build the element cdf and alias table of an emissive shape
+static void init_elements_cdf(trc::shape* shape) {
+  auto& cdf       = shape->elements_cdf;
+  auto& positions = shape->positions;
+  if (!shape->quads.empty()) {
+    cdf = std::vector<float>(shape->quads.size());
+    common::parallel_for(0, (int)cdf.size(), 4096, [&](int idx) {
+      auto& q  = shape->quads[idx];
+      cdf[idx] = quad_area(
+          positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+    });
+  } else if (!shape->cpositions.empty()) {
+    cdf = std::vector<float>(get_num_triangles(shape));
+    common::parallel_for(0, (int)cdf.size(), 4096, [&](int idx) {
+      auto t   = get_triangle(shape, idx);
+      cdf[idx] = triangle_area(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z));
+    });
+  } else {
+    cdf = std::vector<float>(shape->triangles.size());
+    common::parallel_for(0, (int)cdf.size(), 4096, [&](int idx) {
+      auto& t  = shape->triangles[idx];
+      cdf[idx] = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
+    });
+  }
+  parallel_prefix_sum(cdf);
+  shape->elements_alias = make_discrete_alias(cdf);
+}
+
+// Build the texel cdf and alias table of an environment, keeping the
+// version of the texture they were built from
+static void init_texels_cdf(trc::environment* environment) {
+  auto  texture = environment->emission_tex;
+  auto  size    = texture_size(texture);
+  auto& cdf     = environment->texels_cdf;
+  cdf           = std::vector<float>(size.x * size.y);
+  common::parallel_for(size.y, [&](int j) {
+    auto th = (j + 0.5f) * pif / size.y;
+    for (auto i = 0; i < size.x; i++) {
+      cdf[j * size.x + i] = max(lookup_texture(texture, {i, j})) * sin(th);
+    }
+  });
+  parallel_prefix_sum(cdf);
+  environment->texels_alias   = make_discrete_alias(cdf);
+  environment->texels_version = texture->version;
+}
+
+// Camera-aware pruning of instances and emitters
+void prune_scene(trc::scene* scene, const trc::camera* camera,
+    const trace_params& params) {
+  scene->pruned_instances.clear();
+  scene->pruned_lights.clear();
+  if (params.prune == prune_type::none || camera->orthographic) return;
+  auto aggressive = params.prune == prune_type::aggressive;
+
+  // shape bounds, and areas of emissive shapes, computed concurrently
+  auto shape_ids = std::unordered_map<const trc::shape*, int>{};
+  for (auto idx = 0; idx < scene->shapes.size(); idx++)
+    shape_ids[scene->shapes[idx]] = idx;
+  auto emissive = std::vector<int>(scene->shapes.size(), 0);
   for (auto object : scene->objects) {
     if (object->material->emission == zero3f) continue;
-    auto shape = object->shape;
-    if (shape->triangles.empty() && shape->quads.empty()) continue;
-    if (progress_cb) progress_cb("build light", progress.x++, ++progress.y);
-    if (!shape->triangles.empty()) {
-      shape->elements_cdf = std::vector<float>(shape->triangles.size());
-      for (auto idx = 0; idx < shape->elements_cdf.size(); idx++) {
-        auto& t                  = shape->triangles[idx];
-        shape->elements_cdf[idx] = triangle_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z]);
-        if (idx) shape->elements_cdf[idx] += shape->elements_cdf[idx - 1];
+    emissive[shape_ids.at(object->shape)] = 1;
+  }
+  auto shape_bounds = std::vector<bbox3f>(scene->shapes.size(), invalidb3f);
+  auto shape_areas  = std::vector<float>(scene->shapes.size(), 0);
+  common::parallel_for((int)scene->shapes.size(), [&](int idx) {
+    auto shape  = scene->shapes[idx];
+    auto bounds = shape->cpositions.empty() ? invalidb3f : shape->cbounds;
+    for (auto& position : shape->positions) bounds = merge(bounds, position);
+    shape_bounds[idx] = bounds;
+    if (!emissive[idx]) return;
+    if (!shape->quads.empty()) {
+      for (auto& q : shape->quads)
+        shape_areas[idx] += quad_area(shape->positions[q.x],
+            shape->positions[q.y], shape->positions[q.z],
+            shape->positions[q.w]);
+    } else if (has_triangles(shape)) {
+      for (auto element = 0; element < get_num_triangles(shape); element++) {
+        auto t = get_triangle(shape, element);
+        shape_areas[idx] += triangle_area(get_position(shape, t.x),
+            get_position(shape, t.y), get_position(shape, t.z));
       }
     }
-    if (!shape->quads.empty()) {
-      shape->elements_cdf = std::vector<float>(shape->quads.size());
-      for (auto idx = 0; idx < shape->elements_cdf.size(); idx++) {
-        auto& t                  = shape->quads[idx];
-        shape->elements_cdf[idx] = quad_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z],
-            shape->positions[t.w]);
-        if (idx) shape->elements_cdf[idx] += shape->elements_cdf[idx - 1];
+  });
+
+  // projected size in pixels of bounds seen from the camera, and whether
+  // they are outside the view, testing their bounds in camera space
+  auto origin      = camera->frame.o;
+  auto pixel_angle = max(camera->film) / (camera->lens * params.resolution);
+  auto half_tan    = max(camera->film) / (2 * camera->lens);
+  auto to_camera   = inverse(camera->frame, true);
+  auto projected_size = [&](const bbox3f& bbox) {
+    auto radius   = length(bbox.max - bbox.min) / 2;
+    auto distance = length(center(bbox) - origin) - radius;
+    return distance <= 0 ? flt_max : 2 * radius / (distance * pixel_angle);
+  };
+  auto is_offscreen = [&](const bbox3f& bbox) {
+    auto local = transform_bbox(to_camera, bbox);
+    return local.min.z >= 0 || local.min.x + half_tan * local.min.z > 0 ||
+           -local.max.x + half_tan * local.min.z > 0 ||
+           local.min.y + half_tan * local.min.z > 0 ||
+           -local.max.y + half_tan * local.min.z > 0;
+  };
+
+  // prune instances, keeping emissive ones and the ones with no bounds
+  auto min_size = params.prune_size;
+  auto emitters = std::vector<std::tuple<int, int, float, float>>{};
+  scene->pruned_instances.resize(scene->objects.size());
+  scene->pruned_lights.resize(scene->objects.size());
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto  object  = scene->objects[object_id];
+    auto  shape   = shape_ids.at(object->shape);
+    auto& frames  = object->instance->frames;
+    auto& pruned  = scene->pruned_instances[object_id];
+    auto  sbounds = shape_bounds[shape];
+    pruned.assign(frames.size(), false);
+    scene->pruned_lights[object_id].assign(frames.size(), false);
+    if (sbounds.min.x > sbounds.max.x) continue;
+    for (auto iidx = 0; iidx < frames.size(); iidx++) {
+      auto bounds = eval_instance_bounds(object, iidx, sbounds);
+      auto size   = projected_size(bounds);
+      if (emissive[shape] && object->material->emission != zero3f) {
+        auto frame    = eval_instance_frame(object, iidx, 0);
+        auto scale    = abs(determinant(mat3f{frame.x, frame.y, frame.z}));
+        auto distance = max(length(center(bounds) - origin) -
+                                length(bounds.max - bounds.min) / 2,
+            0.0f);
+        auto power = max(object->material->emission) * shape_areas[shape] *
+                     pow(scale, 2.0f / 3.0f);
+        emitters.push_back({object_id, iidx, size,
+            distance > 0 ? power / (distance * distance) : flt_max});
+      } else if (size < min_size ||
+                 (aggressive && size < 16 * min_size && is_offscreen(bounds))) {
+        pruned[iidx] = true;
       }
     }
+  }
+
+  // prune emitters relative to the total irradiance bound, where
+  // environments are bounded assuming textures of unit average
+  auto total = 0.0f;
+  for (auto& [object_id, iidx, size, irradiance] : emitters) {
+    if (irradiance < flt_max) total += irradiance;
+  }
+  for (auto environment : scene->environments) {
+    total += max(environment->emission) * pif;
+  }
+  for (auto& [object_id, iidx, size, irradiance] : emitters) {
+    if (aggressive ? irradiance < 1e-3f * total
+                   : irradiance < 1e-4f * total && size < min_size)
+      scene->pruned_lights[object_id][iidx] = true;
+  }
+}
+
+void init_lights(trc::scene* scene, progress_callback progress_cb) {
+  auto timer = counter_timer{trace_counter::lights_time};
+
+  // handle progress
+  auto progress = vec2i{0, 1};
+  if (progress_cb) progress_cb("build light", progress.x++, progress.y);
+
+  scene->light_arena.clear();
+  scene->lights.clear();
+  scene->environment_lights.clear();
+
+  // flattened layout, used to place lights
+  init_layout(scene);
+
+  // classify materials to pick the specialized shading code
+  for (auto material : scene->materials) {
+    material->lobes = get_material_lobes(material);
+  }
+
+  // emissive shapes, each built once even if shared by many objects
+  auto shapes = std::vector<trc::shape*>{};
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto object = scene->objects[object_id];
+    if (object->material->emission == zero3f) continue;
+    auto shape = object->shape;
+    if (!has_triangles(shape) && shape->quads.empty()) continue;
+    auto pruned = 0;
+    for (auto iidx = 0; iidx < object->instance->frames.size(); iidx++)
+      pruned += is_pruned(scene->pruned_lights, object_id, iidx);
+    if (pruned == object->instance->frames.size()) continue;
+    shapes.push_back(shape);
+  }
+  std::sort(shapes.begin(), shapes.end());
+  shapes.erase(std::unique(shapes.begin(), shapes.end()), shapes.end());
+
+  // emissive environment textures, skipping the ones already built
+  auto environments = std::vector<trc::environment*>{};
+  for (auto environment : scene->environments) {
+    if (environment->emission == zero3f || !environment->emission_tex)
+      continue;
+    auto version = environment->emission_tex->version;
+    if (version != 0 && version == environment->texels_version) continue;
+    environments.push_back(environment);
+  }
+
+  // build cdfs in parallel across lights, and within large lights
+  auto jobs           = (int)(shapes.size() + environments.size());
+  auto progress_mutex = std::mutex{};
+  progress.y += jobs;
+  common::parallel_for(jobs, [&](int job) {
+    if (job < shapes.size()) {
+      init_elements_cdf(shapes[job]);
+    } else {
+      init_texels_cdf(environments[job - shapes.size()]);
+    }
+    if (progress_cb) {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      progress_cb("build light", progress.x++, progress.y);
+    }
+  });
+
+  // add lights
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto object = scene->objects[object_id];
+    if (object->material->emission == zero3f) continue;
+    auto shape = object->shape;
+    if (!has_triangles(shape) && shape->quads.empty()) continue;
     for (auto iidx = 0; iidx < object->instance->frames.size(); iidx++) {
+      if (is_pruned(scene->pruned_lights, object_id, iidx)) continue;
       auto light         = add_light(scene);
       light->object      = object;
       light->instance    = iidx;
+      light->layout      = get_layout_index(scene, object_id, iidx);
       light->environment = nullptr;
     }
   }
   for (auto environment : scene->environments) {
     if (environment->emission == zero3f) continue;
-    if (progress_cb) progress_cb("build light", progress.x++, ++progress.y);
-    if (environment->emission_tex) {
-      auto texture            = environment->emission_tex;
-      auto size               = texture_size(texture);
-      environment->texels_cdf = std::vector<float>(size.x * size.y);
-      if (size != zero2i) {
-        for (auto i = 0; i < environment->texels_cdf.size(); i++) {
-          auto ij                    = vec2i{i % size.x, i / size.x};
-          auto th                    = (ij.y + 0.5f) * pif / size.y;
-          auto value                 = lookup_texture(texture, ij);
-          environment->texels_cdf[i] = max(value) * sin(th);
-          if (i) environment->texels_cdf[i] += environment->texels_cdf[i - 1];
+    auto light         = add_light(scene);
+    light->object      = nullptr;
+    light->instance    = -1;
+    light->environment = environment;
+    scene->environment_lights.push_back(light);
+  }
+
+  // light tree
+  init_light_tree(scene);
+
+  // handle progress
+  if (progress_cb) progress_cb("build light", progress.x++, progress.y);
+}
+
+using std::atomic;
+using std::deque;
+using std::future;
+
+// Interleave the lower 16 bits of x and y to get a Morton index.
+static uint32_t morton_index(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+// Key used to sort rays for coherence: the direction octant in the top bits,
+// followed by the Morton index of the origin on a 1024^3 grid over bounds.
+static uint32_t ray_coherence_key(const ray3f& ray, const bbox3f& bounds) {
+  auto spread = [](uint32_t v) {
+    v &= 0x000003ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  };
+  auto cell = clamp((ray.o - bounds.min) / max(bounds.max - bounds.min,
+                                               vec3f{1e-6f, 1e-6f, 1e-6f}),
+                  0.0f, 1.0f) *
+              1023.0f;
+  auto octant = (ray.d.x < 0 ? 1u : 0u) | (ray.d.y < 0 ? 2u : 0u) |
+                (ray.d.z < 0 ? 4u : 0u);
+  return (octant << 30) | spread((uint32_t)cell.x) |
+         (spread((uint32_t)cell.y) << 1) | (spread((uint32_t)cell.z) << 2);
+}
+
+// Split an image into tiles sorted in Morton order. Each tile is stored
+// as {min.x, min.y, max.x, max.y}, with max excluded.
+static std::vector<vec4i> make_tiles(const vec2i& size, int tilesize) {
+  tilesize   = max(tilesize, 1);
+  auto ntiles = vec2i{
+      (size.x + tilesize - 1) / tilesize, (size.y + tilesize - 1) / tilesize};
+  auto tiles = std::vector<std::pair<uint32_t, vec4i>>{};
+  tiles.reserve((size_t)ntiles.x * (size_t)ntiles.y);
+  for (auto tj = 0; tj < ntiles.y; tj++) {
+    for (auto ti = 0; ti < ntiles.x; ti++) {
+      tiles.push_back({morton_index(ti, tj),
+          {ti * tilesize, tj * tilesize, min((ti + 1) * tilesize, size.x),
+              min((tj + 1) * tilesize, size.y)}});
+    }
+  }
+  std::sort(tiles.begin(), tiles.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  auto sorted = std::vector<vec4i>{};
+  sorted.reserve(tiles.size());
+  for (auto& [index, tile] : tiles) sorted.push_back(tile);
+  return sorted;
+}
+
+// Parallel for over image tiles run on the global thread pool. Tiles are split
+// in contiguous Morton ranges among per-thread queues. Threads consume their
+// own queue from the front and steal from the back of the others when they
+// run out of work. With `numa`, there is a queue for each NUMA node with the
+// tiles whose first row is in the node band, consumed first by the threads
+// that run on the node. `Func` takes the tile. The first version runs
+// `nthreads` threads, the caller and those of the given pool, and each
+// thread stops taking tiles when `Active`, called with its index, is false.
+template <typename Func, typename Active>
+inline void parallel_for_tiles(common::thread_pool& pool, int nthreads,
+    const std::vector<vec4i>& tiles, bool numa, Func&& func,
+    Active&& active) {
+  struct tile_queue {
+    std::mutex      mutex;
+    std::deque<int> tiles;
+  };
+  auto nqueues = numa ? (int)common::get_numa_nodes().size() : nthreads;
+  auto queues   = std::vector<tile_queue>(nqueues);
+  auto height   = 0;
+  for (auto& tile : tiles) height = max(height, tile.w);
+  for (auto idx = 0; idx < (int)tiles.size(); idx++) {
+    auto queue = numa ? get_row_node(tiles[idx].y, height)
+                      : (int)((size_t)idx * nthreads / tiles.size());
+    queues[queue].tiles.push_back(idx);
+  }
+  auto pop_tile = [&queues, nqueues](int queue_id, int& tile) {
+    {
+      auto& queue = queues[queue_id];
+      auto  lock  = std::lock_guard{queue.mutex};
+      if (!queue.tiles.empty()) {
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+      }
+    }
+    for (auto offset = 1; offset < nqueues; offset++) {
+      auto& queue = queues[(queue_id + offset) % nqueues];
+      auto  lock  = std::lock_guard{queue.mutex};
+      if (!queue.tiles.empty()) {
+        tile = queue.tiles.back();
+        queue.tiles.pop_back();
+        return true;
+      }
+    }
+    return false;
+  };
+  common::parallel_for(pool, 0, nthreads, 1,
+      [&func, &active, &tiles, &pop_tile, numa](int thread_id) {
+        auto queue_id = numa ? common::get_numa_node() : thread_id;
+        auto tile     = 0;
+        while (active(thread_id) && pop_tile(queue_id, tile))
+          func(tiles[tile]);
+      });
+}
+template <typename Func>
+inline void parallel_for_tiles(
+    const std::vector<vec4i>& tiles, bool numa, Func&& func) {
+  parallel_for_tiles(common::get_thread_pool(), common::get_num_threads(),
+      tiles, numa, std::forward<Func>(func),
+      [](int thread_id) { return true; });
+}
+
+// Minimum number of samples before checking pixel convergence, and maximum
+// ratio between the samples of a pixel and the per-pixel budget, used in
+// adaptive mode.
+const int adaptive_min_samples = 16;
+const int adaptive_max_ratio   = 4;
+
+// Check if a pixel is done in adaptive mode, by comparing the standard error
+// of its mean luminance with the noise threshold relative to the mean. A small
+// floor on the mean lets dark pixels converge.
+static bool is_pixel_converged(
+    const trc::pixel& pixel, const trace_params& params) {
+  if (!params.adaptive) return false;
+  if (pixel.samples >= params.samples * adaptive_max_ratio) return true;
+  if (pixel.samples < adaptive_min_samples) return false;
+  auto mean = (pixel.radiance.x + pixel.radiance.y + pixel.radiance.z) /
+              (3 * pixel.samples);
+  auto variance = max(pixel.luminance2 / pixel.samples - mean * mean, 0.0f);
+  auto error    = sqrt(variance / pixel.samples);
+  return error <= params.noise * max(mean, 0.01f);
+}
+
+// Wavefront path tracing of a batch of samples for the pixels of a tile.
+// The paths of the tile are advanced together in stages: their rays are
+// intersected as a stream, paths are shaded sorted by material, and
+// terminated paths are removed. With `raysort`, secondary rays are sorted
+// by their coherence key before intersection. Since each pixel has a single
+// path in flight, results match trace_path. Returns the number of samples
+// traced.
+static int trace_tile_wavefront(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const vec4i& tile, int batch,
+    const trace_params& params) {
+  auto traced        = 0;
+  auto paths         = std::vector<path_state>{};
+  auto pixels        = std::vector<vec2i>{};
+  auto rngs          = std::vector<sampler_state>{};
+  auto active        = std::vector<int>{};
+  auto next          = std::vector<int>{};
+  auto order         = std::vector<int>{};
+  auto materials     = std::vector<const trc::material*>{};
+  auto rays          = std::vector<ray3f>{};
+  auto times         = std::vector<float>{};
+  auto keys          = std::vector<uint64_t>{};
+  for (auto sample = 0; sample < batch; sample++) {
+    // generate camera paths
+    paths.clear();
+    pixels.clear();
+    rngs.clear();
+    for (auto j = tile.y; j < tile.w; j++) {
+      for (auto i = tile.x; i < tile.z; i++) {
+        auto pixel = get_pixel(state, {i, j});
+        if (is_pixel_converged(pixel, params)) continue;
+        auto& rng  = rngs.emplace_back(
+            get_pixel_rng(state, {i, j}, pixel.samples, params));
+        auto& path = paths.emplace_back();
+        path.ray   = sample_camera(camera, get_frame_pixel(state, {i, j}),
+            state->frame, rand2f(rng), rand2f(rng), params.tentfilter);
+        path.cone  = get_camera_cone(camera, state->frame);
+        path.time  = sample_camera_time(camera, rng);
+        accumulate_features(
+            state, scene, {i, j}, path.ray, path.time, params);
+        pixels.push_back({i, j});
+      }
+    }
+    active.resize(params.bounces > 0 ? paths.size() : 0);
+    for (auto idx = 0; idx < active.size(); idx++) active[idx] = idx;
+
+    // advance paths until all terminate
+    for (auto bounce = 0; !active.empty(); bounce++) {
+      // sort secondary rays, since camera rays are already coherent
+      if (params.raysort && bounce > 0 && active.size() > 1) {
+        auto bounds = invalidb3f;
+        for (auto pathid : active) bounds = merge(bounds, paths[pathid].ray.o);
+        keys.resize(active.size());
+        for (auto idx = 0; idx < active.size(); idx++) {
+          auto key  = ray_coherence_key(paths[active[idx]].ray, bounds);
+          keys[idx] = ((uint64_t)key << 32) | (uint32_t)active[idx];
+        }
+        std::sort(keys.begin(), keys.end());
+        for (auto idx = 0; idx < active.size(); idx++)
+          active[idx] = (int)(keys[idx] & 0xffffffff);
+      }
+
+      // intersect
+      rays.resize(active.size());
+      times.resize(camera->shutter > 0 ? active.size() : 0);
+      for (auto idx = 0; idx < active.size(); idx++)
+        rays[idx] = paths[active[idx]].ray;
+      for (auto idx = 0; idx < times.size(); idx++)
+        times[idx] = paths[active[idx]].time;
+      auto intersections = intersect_scene_bvh(
+          scene, rays, false, true, times);
+
+      // sort by material
+      materials.resize(active.size());
+      order.resize(active.size());
+      for (auto idx = 0; idx < active.size(); idx++) {
+        auto& intersection = intersections[idx];
+        materials[idx]     = intersection.hit
+                             ? scene->objects[intersection.object]->material
+                             : nullptr;
+        order[idx]         = idx;
+      }
+      std::sort(order.begin(), order.end(), [&materials](int a, int b) {
+        return materials[a] < materials[b];
+      });
+
+      // shade
+      next.clear();
+      for (auto idx : order) {
+        auto pathid = active[idx];
+        auto next_bounce = params.nocaustics
+                               ? trace_path_bounce<true>(scene, paths[pathid],
+                                     intersections[idx], rngs[pathid], params)
+                               : trace_path_bounce<false>(scene,
+                                     paths[pathid], intersections[idx],
+                                     rngs[pathid], params);
+        if (next_bounce) next.push_back(pathid);
+      }
+      std::swap(active, next);
+    }
+
+    // accumulate
+    for (auto pathid = 0; pathid < paths.size(); pathid++) {
+      auto& path  = paths[pathid];
+      auto  pixel = get_pixel(state, pixels[pathid]);
+      state->render[pixels[pathid]] = accumulate_sample(
+          pixel, scene, path.radiance, path.hit, params);
+      set_pixel(state, pixels[pathid], pixel);
+      set_pixel_rng(state, pixels[pathid], rngs[pathid]);
+    }
+    traced += (int)paths.size();
+  }
+  return traced;
+}
+
+// Trace a batch of samples for the pixels of a tile, skipping converged
+// pixels. Returns the number of samples traced.
+static int trace_tile(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const vec4i& tile, int batch,
+    const trace_params& params) {
+  // wavefront tracing handles whole tiles
+  if (params.sampler == sampler_type::wavefront) {
+    return trace_tile_wavefront(state, scene, camera, tile, batch, params);
+  }
+
+  auto traced = 0;
+
+  // false color and eyelight are mostly primary visibility, so camera rays
+  // of each tile row are intersected as a stream
+  if (params.sampler == sampler_type::falsecolor ||
+      params.sampler == sampler_type::eyelight) {
+    auto rays   = std::vector<ray3f>{};
+    auto times  = std::vector<float>{};
+    auto pixels = std::vector<vec2i>{};
+    auto rngs   = std::vector<sampler_state>{};
+    auto cone   = get_camera_cone(camera, state->frame);
+    for (auto sample = 0; sample < batch; sample++) {
+      for (auto j = tile.y; j < tile.w; j++) {
+        rays.clear();
+        times.clear();
+        pixels.clear();
+        rngs.clear();
+        for (auto i = tile.x; i < tile.z; i++) {
+          auto pixel = get_pixel(state, {i, j});
+          if (is_pixel_converged(pixel, params)) continue;
+          auto& rng = rngs.emplace_back(
+              get_pixel_rng(state, {i, j}, pixel.samples, params));
+          rays.push_back(sample_camera(camera,
+              get_frame_pixel(state, {i, j}), state->frame, rand2f(rng),
+              rand2f(rng), params.tentfilter));
+          if (camera->shutter > 0)
+            times.push_back(sample_camera_time(camera, rng));
+          pixels.push_back({i, j});
+        }
+        if (rays.empty()) continue;
+        auto intersections = intersect_scene_bvh(
+            scene, rays, false, true, times);
+        for (auto idx = 0; idx < rays.size(); idx++) {
+          auto time            = times.empty() ? 0 : times[idx];
+          accumulate_features(
+              state, scene, pixels[idx], rays[idx], time, params);
+          auto [radiance, hit] =
+              params.sampler == sampler_type::falsecolor
+                  ? shade_falsecolor(
+                        scene, rays[idx], intersections[idx], time, params)
+                  : shade_eyelight(scene, rays[idx], intersections[idx], cone,
+                        time, rngs[idx], params);
+          auto pixel = get_pixel(state, pixels[idx]);
+          state->render[pixels[idx]] = accumulate_sample(
+              pixel, scene, radiance, hit, params);
+          set_pixel(state, pixels[idx], pixel);
+          set_pixel_rng(state, pixels[idx], rngs[idx]);
         }
+        traced += (int)rays.size();
+      }
+    }
+    return traced;
+  }
+
+  auto kernel = get_sample_kernel(params);
+  for (auto sample = 0; sample < batch; sample++) {
+    for (auto j = tile.y; j < tile.w; j++) {
+      for (auto i = tile.x; i < tile.z; i++) {
+        if (is_pixel_converged(get_pixel(state, {i, j}), params)) continue;
+        state->render[{i, j}] = kernel(state, scene, camera, {i, j}, params);
+        traced += 1;
+      }
+    }
+  }
+  return traced;
+}
+
+// Tiles traced by the node. When splitting regions, nodes trace
+// consecutive ranges of tile rows.
+static std::vector<vec4i> get_partition_tiles(
+    const vec2i& size, const trace_params& params) {
+  auto tiles = make_tiles(size, params.tilesize);
+  if (params.nodes <= 1 || params.partition != partition_type::regions)
+    return tiles;
+  auto tilesize = max(params.tilesize, 1);
+  auto rows     = (int64_t)(size.y + tilesize - 1) / tilesize;
+  auto start    = (int)(params.node * rows / params.nodes);
+  auto end      = (int)((params.node + 1) * rows / params.nodes);
+  auto ntiles   = std::vector<vec4i>{};
+  for (auto& tile : tiles) {
+    auto row = tile.y / tilesize;
+    if (row >= start && row < end) ntiles.push_back(tile);
+  }
+  return ntiles;
+}
+
+// Checkpoints store a magic number, a version, the frame size, the crop
+// and whether rngs are saved, followed by the pixels and rngs of the crop.
+static const int checkpoint_version = 2;
+
+// Pixels and rngs of a checkpoint, for a crop of the frame.
+struct checkpoint_data {
+  vec2i                  frame  = {0, 0};
+  vec4i                  crop   = {0, 0, 0, 0};
+  img::image<trc::pixel> pixels = {};
+  img::image<rng_state>  rngs   = {};
+};
+
+// Load a checkpoint. Returns false if the file does not exist, and throws
+// if it is invalid.
+static bool load_checkpoint(
+    const std::string& filename, checkpoint_data& checkpoint) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  auto fs_guard   = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto read_value = [fs](auto& value) {
+    return fread(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto magic = std::array<char, 4>{}, stored = std::array<char, 4>{};
+  auto version  = 0;
+  auto has_rngs = false;
+  memcpy(magic.data(), "YCKP", 4);
+  if (!read_value(stored) || stored != magic || !read_value(version) ||
+      version != checkpoint_version || !read_value(checkpoint.frame) ||
+      !read_value(checkpoint.crop) || !read_value(has_rngs))
+    throw std::runtime_error(filename + ": unknown checkpoint format");
+  auto& crop = checkpoint.crop;
+  if (crop.x < 0 || crop.y < 0 || crop.z > checkpoint.frame.x ||
+      crop.w > checkpoint.frame.y || crop.z <= crop.x || crop.w <= crop.y)
+    throw std::runtime_error(filename + ": corrupted checkpoint");
+  auto size = vec2i{crop.z - crop.x, crop.w - crop.y};
+  checkpoint.pixels.assign(size, trc::pixel{});
+  checkpoint.rngs = {};
+  if (has_rngs) checkpoint.rngs.assign(size, rng_state{});
+  if (fread(checkpoint.pixels.data(), sizeof(trc::pixel),
+          checkpoint.pixels.count(), fs) != checkpoint.pixels.count() ||
+      fread(checkpoint.rngs.data(), sizeof(rng_state),
+          checkpoint.rngs.count(), fs) != checkpoint.rngs.count())
+    throw std::runtime_error(filename + ": corrupted checkpoint");
+  return true;
+}
+
+// Save a checkpoint. The file is written to a temporary and then renamed,
+// so that a crash never leaves a partial checkpoint.
+static void save_checkpoint(
+    const std::string& filename, const checkpoint_data& checkpoint) {
+  auto tmpname = filename + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) throw std::runtime_error(filename + ": cannot save checkpoint");
+  auto write_value = [fs](const auto& value) {
+    return fwrite(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto ok = fwrite("YCKP", 4, 1, fs) == 1 && write_value(checkpoint_version) &&
+            write_value(checkpoint.frame) && write_value(checkpoint.crop) &&
+            write_value(!checkpoint.rngs.empty()) &&
+            fwrite(checkpoint.pixels.data(), sizeof(trc::pixel),
+                checkpoint.pixels.count(), fs) == checkpoint.pixels.count() &&
+            fwrite(checkpoint.rngs.data(), sizeof(rng_state),
+                checkpoint.rngs.count(), fs) == checkpoint.rngs.count();
+  ok = fclose(fs) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    throw std::runtime_error(filename + ": cannot save checkpoint");
+  }
+}
+
+// Check that a checkpoint holds the crop of the state, with the same rngs.
+static bool is_checkpoint_compatible(
+    const checkpoint_data& checkpoint, const trc::state* state) {
+  auto &crop = checkpoint.crop, &scrop = state->crop;
+  return checkpoint.frame == state->frame && crop.x <= scrop.x &&
+         crop.y <= scrop.y && crop.z >= scrop.z && crop.w >= scrop.w &&
+         checkpoint.rngs.empty() == state->rngs.empty();
+}
+
+// Resume the state from a checkpoint of the same crop.
+static void set_checkpoint(
+    trc::state* state, const checkpoint_data& checkpoint) {
+  auto size = state->render.size();
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      auto& pixel = checkpoint.pixels[{i, j}];
+      set_pixel(state, {i, j}, pixel);
+      state->render[{i, j}] = {
+          pixel.hits ? pixel.radiance / pixel.hits : zero3f,
+          pixel.samples ? (float)pixel.hits / (float)pixel.samples : 0};
+    }
+  }
+  if (!state->rngs.empty()) state->rngs = checkpoint.rngs;
+}
+
+// Copy the pixels and rngs of the state into its crop of the checkpoint,
+// that is initialized from the state if empty.
+static void get_checkpoint(
+    const trc::state* state, checkpoint_data& checkpoint) {
+  if (checkpoint.pixels.empty()) {
+    checkpoint.frame = state->frame;
+    checkpoint.crop  = state->crop;
+    checkpoint.pixels.assign(state->render.size(), trc::pixel{});
+    checkpoint.rngs = {};
+    if (!state->rngs.empty())
+      checkpoint.rngs.assign(state->render.size(), rng_state{});
+  }
+  auto size   = state->render.size();
+  auto offset = vec2i{state->crop.x - checkpoint.crop.x,
+      state->crop.y - checkpoint.crop.y};
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      checkpoint.pixels[{i + offset.x, j + offset.y}] = get_pixel(
+          state, {i, j});
+    }
+  }
+  if (!state->rngs.empty())
+    img::set_region(checkpoint.rngs, state->rngs, offset);
+}
+
+// Check whether another pass fits in the time budget, estimating its time
+// from the last pass.
+static bool is_time_left(
+    const trace_params& params, int64_t start, int64_t pass_start) {
+  if (params.timebudget <= 0) return true;
+  auto now = common::get_time();
+  return (2 * now - start - pass_start) / 1e9 <= params.timebudget;
+}
+
+// Trace the part of the frame of the node in passes, until its sample
+// budget or time budget is used, counting samples per pixel. Returns the
+// samples per pixel traced.
+static int trace_frame(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    progress_callback progress_cb, image_callback image_cb) {
+  if (params.nodes > 1 && (params.node < 0 || params.node >= params.nodes))
+    throw std::runtime_error("render node out of range");
+  auto tiles   = get_partition_tiles(state->render.size(), params);
+  auto range   = get_partition_samples(params);
+  auto samples = range.y - range.x;
+  auto npixels = (int64_t)0;
+  for (auto& tile : tiles)
+    npixels += (int64_t)(tile.z - tile.x) * (int64_t)(tile.w - tile.y);
+  auto budget = (int64_t)samples * npixels;
+  auto traced = (int64_t)0;
+  auto start  = common::get_time();
+
+  // resume from a checkpoint of the same crop, or re-render the crop of a
+  // larger checkpoint, that is then updated in place
+  auto checkpoint_time = start;
+  auto checkpoint      = checkpoint_data{};
+  if (!params.checkpoint.empty() &&
+      load_checkpoint(params.checkpoint, checkpoint)) {
+    if (!is_checkpoint_compatible(checkpoint, state))
+      throw std::runtime_error(
+          params.checkpoint + ": checkpoint does not match render");
+    if (checkpoint.crop == state->crop) {
+      set_checkpoint(state, checkpoint);
+      for (auto& tile : tiles) {
+        for (auto j = tile.y; j < tile.w; j++) {
+          for (auto i = tile.x; i < tile.z; i++) {
+            traced += get_pixel(state, {i, j}).samples;
+          }
+        }
+      }
+    }
+  }
+  auto update_checkpoint = [state, &params, &checkpoint]() {
+    get_checkpoint(state, checkpoint);
+    save_checkpoint(params.checkpoint, checkpoint);
+  };
+
+  while (traced < budget) {
+    auto pass_start = common::get_time();
+    auto sample     = (int)(traced / npixels);
+    if (progress_cb) progress_cb("trace image", sample, samples);
+    auto batch      = clamp(params.batch, 1, samples - sample);
+    auto num_traced = std::atomic<int64_t>{0};
+    if (params.noparallel) {
+      for (auto& tile : tiles) {
+        num_traced += trace_tile(state, scene, camera, tile, batch, params);
+      }
+    } else {
+      parallel_for_tiles(tiles, params.numa,
+          [state, scene, camera, batch, &params, &num_traced](
+              const vec4i& tile) {
+        num_traced += trace_tile(state, scene, camera, tile, batch, params);
+      });
+    }
+    if (num_traced == 0) break;
+    traced += num_traced;
+    if (state->guiding)
+      update_guiding(state->guiding.get(), params, (int)(traced / npixels));
+    if (image_cb)
+      image_cb(
+          state->render, min((int)(traced / npixels), samples), samples);
+    if (!params.checkpoint.empty() &&
+        (common::get_time() - checkpoint_time) / 1e9 >=
+            params.checkpoint_interval) {
+      update_checkpoint();
+      checkpoint_time = common::get_time();
+    }
+    if (!is_time_left(params, start, pass_start)) break;
+  }
+  if (!params.checkpoint.empty()) update_checkpoint();
+  if (progress_cb) progress_cb("trace image", samples, samples);
+  return npixels ? (int)(traced / npixels) : 0;
+}
+
+// Average of feature sums, whose last channel is the sample count.
+static img::image<vec4f> get_feature_average(img::image<vec4f> features) {
+  for (auto& feature : features)
+    feature = feature.w ? vec4f{xyz(feature) / feature.w, 1} : zero4f;
+  return features;
+}
+
+// Final image of a state, denoised if requested.
+static img::image<vec4f> get_final_render(const trc::state* state,
+    const trace_params& params, progress_callback progress_cb) {
+  if (!params.denoise) return state->render;
+  if (progress_cb) progress_cb("denoise image", 0, 1);
+  auto denoised = denoise_image(state->render,
+      get_feature_average(state->albedo), get_feature_average(state->normal));
+  if (progress_cb) progress_cb("denoise image", 1, 1);
+  return denoised;
+}
+
+// Progressively compute an image by calling trace_samples multiple times.
+img::image<vec4f> trace_image(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    progress_callback progress_cb, image_callback image_cb) {
+  auto samples = 0;
+  return trace_image(
+      scene, camera, params, samples, progress_cb, image_cb);
+}
+img::image<vec4f> trace_image(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, int& samples,
+    progress_callback progress_cb, image_callback image_cb) {
+  auto state_guard = std::make_unique<state>();
+  auto state       = state_guard.get();
+  init_state(state, scene, camera, params);
+  samples = trace_frame(state, scene, camera, params, progress_cb, image_cb);
+  return get_final_render(state, params, progress_cb);
+}
+img::image<vec4f> trace_image(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    std::vector<img::image<vec4f>>& aovs, progress_callback progress_cb,
+    image_callback image_cb) {
+  auto state_guard = std::make_unique<state>();
+  auto state       = state_guard.get();
+  init_state(state, scene, camera, params);
+  trace_frame(state, scene, camera, params, progress_cb, image_cb);
+  // aovs are averaged over hits, with the coverage as alpha
+  aovs = state->aovs;
+  for (auto& aov : aovs) {
+    for (auto j = 0; j < aov.size().y; j++) {
+      for (auto i = 0; i < aov.size().x; i++) {
+        auto  samples = get_pixel(state, {i, j}).samples;
+        auto& value   = aov[{i, j}];
+        value = value.w ? vec4f{xyz(value) / value.w, value.w / samples}
+                        : zero4f;
       }
     }
-    auto light         = add_light(scene);
-    light->object      = nullptr;
-    light->instance    = -1;
-    light->environment = environment;
   }
+  return get_final_render(state, params, progress_cb);
+}
+
+// Trace the part of the frame of a node, returning its pixels.
+img::image<trc::pixel> trace_partial(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    progress_callback progress_cb, image_callback image_cb) {
+  auto state_guard = std::make_unique<state>();
+  auto state       = state_guard.get();
+  init_state(state, scene, camera, params);
+  trace_frame(state, scene, camera, params, progress_cb, image_cb);
+  if (state->hpixels.empty()) return std::move(state->pixels);
+  auto pixels = img::image<trc::pixel>{state->render.size()};
+  for (auto j = 0; j < pixels.size().y; j++) {
+    for (auto i = 0; i < pixels.size().x; i++) {
+      pixels[{i, j}] = get_pixel(state, {i, j});
+    }
+  }
+  return pixels;
+}
+
+// Sum the pixels of a partial render into the merged ones.
+void merge_partial(
+    img::image<trc::pixel>& merged, const img::image<trc::pixel>& partial) {
+  if (merged.empty()) {
+    merged = partial;
+    return;
+  }
+  if (merged.size() != partial.size())
+    throw std::runtime_error("partial renders have different sizes");
+  for (auto j = 0; j < merged.size().y; j++) {
+    for (auto i = 0; i < merged.size().x; i++) {
+      auto& pixel = merged[{i, j}];
+      auto& other = partial[{i, j}];
+      pixel.radiance += other.radiance;
+      pixel.luminance2 += other.luminance2;
+      pixel.hits += other.hits;
+      pixel.samples += other.samples;
+    }
+  }
+}
+
+// Convert pixels to the image returned by trace_image.
+img::image<vec4f> get_partial_render(const img::image<trc::pixel>& pixels) {
+  auto render = img::image<vec4f>{pixels.size()};
+  for (auto j = 0; j < pixels.size().y; j++) {
+    for (auto i = 0; i < pixels.size().x; i++) {
+      auto& pixel      = pixels[{i, j}];
+      render[{i, j}] = {pixel.hits ? pixel.radiance / pixel.hits : zero3f,
+          pixel.samples ? (float)pixel.hits / (float)pixel.samples : 0};
+    }
+  }
+  return render;
+}
+
+// Partial buffers are stored with a magic number, a version and the image
+// size, followed by the raw pixels.
+static const int partial_version = 1;
+
+// Load partial buffers.
+bool load_partial(const std::string& filename, img::image<trc::pixel>& pixels,
+    std::string& error) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto fs_guard   = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto read_value = [fs](auto& value) {
+    return fread(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto magic = std::array<char, 4>{}, stored = std::array<char, 4>{};
+  auto version = 0;
+  auto size    = zero2i;
+  memcpy(magic.data(), "YPRT", 4);
+  if (!read_value(stored) || stored != magic || !read_value(version) ||
+      version != partial_version || !read_value(size) || size.x < 0 ||
+      size.y < 0) {
+    error = filename + ": unknown format";
+    return false;
+  }
+  pixels = img::image<trc::pixel>{size};
+  if (fread(pixels.data(), sizeof(trc::pixel), pixels.count(), fs) !=
+      pixels.count()) {
+    pixels = {};
+    error  = filename + ": read error";
+    return false;
+  }
+  return true;
+}
+
+// Save partial buffers.
+bool save_partial(const std::string& filename,
+    const img::image<trc::pixel>& pixels, std::string& error) {
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto write_value = [fs](const auto& value) {
+    return fwrite(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto ok = fwrite("YPRT", 4, 1, fs) == 1 && write_value(partial_version) &&
+            write_value(pixels.size()) &&
+            fwrite(pixels.data(), sizeof(trc::pixel), pixels.count(), fs) ==
+                pixels.count();
+  ok = fclose(fs) == 0 && ok;
+  if (!ok) {
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+// Render a preview at a lower resolution and upsample it, adapting the
+// preview ratio for the next start, since the preview time scales with the
+// number of pixels.
+static void trace_preview(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, int64_t start) {
+  auto pratio = (params.previewtime > 0 && state->pratio > 0) ? state->pratio
+                                                              : params.pratio;
+  pratio      = max(pratio, 1);
+  auto pprms  = params;
+  auto crop   = state->crop;
+  pprms.resolution /= pratio;
+  pprms.samples    = 1;
+  pprms.checkpoint = "";
+  pprms.timebudget = 0;
+  pprms.crop       = {crop.x / pratio, crop.y / pratio,
+      (crop.z + pratio - 1) / pratio, (crop.w + pratio - 1) / pratio};
+  auto pcrop   = get_render_crop(camera, pprms);
+  auto preview = trace_image(scene, camera, pprms);
+  for (auto j = 0; j < state->render.size().y; j++) {
+    for (auto i = 0; i < state->render.size().x; i++) {
+      auto pi = clamp((crop.x + i) / pratio - pcrop.x, 0, preview.size().x - 1),
+           pj = clamp((crop.y + j) / pratio - pcrop.y, 0, preview.size().y - 1);
+      state->render[{i, j}] = preview[{pi, pj}];
+    }
+  }
+  if (params.previewtime > 0) {
+    auto time     = (common::get_time() - start) / 1e9;
+    state->pratio = clamp((int)round(pratio * sqrt(time / params.previewtime)),
+        1, max(params.pratio, 1) * 8);
+  }
+}
+
+// Intersect a camera ray with the element of its hit, tracing the ray only
+// if it misses the element, as may happen at element edges.
+static intersection3f intersect_hit(
+    const trc::scene* scene, const ray3f& ray, const vec4i& hit) {
+  if (hit.x < 0 || hit.x >= (int)scene->objects.size()) return {};
+  auto object = scene->objects[hit.x];
+  if (hit.y < 0 || hit.y >= (int)object->instance->frames.size())
+    return intersect_scene_bvh(scene, ray);
+  auto index    = get_layout_index(scene, hit.x, hit.y);
+  auto shape    = scene->shapes[scene->layout.shapes[index]];
+  auto inv_ray  = transform_ray(scene->layout.inv_frames[index], ray);
+  auto uv       = zero2f;
+  auto distance = 0.0f;
+  auto found    = false;
+  auto& p       = shape->positions;
+  if (!shape->cpositions.empty()) {
+    if (hit.z >= 0 && hit.z < get_num_triangles(shape)) {
+      auto t = get_triangle(shape, hit.z);
+      found  = intersect_triangle(inv_ray, get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z), uv, distance);
+    }
+  } else if (hit.z >= 0 && hit.z < (int)shape->triangles.size()) {
+    auto& t = shape->triangles[hit.z];
+    found   = intersect_triangle(inv_ray, p[t.x], p[t.y], p[t.z], uv, distance);
+  } else if (hit.z >= 0 && hit.z < (int)shape->quads.size()) {
+    auto& q = shape->quads[hit.z];
+    found   = intersect_quad(
+        inv_ray, p[q.x], p[q.y], p[q.z], p[q.w], uv, distance);
+  }
+  if (!found) return intersect_scene_bvh(scene, ray);
+  return {hit.x, hit.y, hit.z, uv, distance, true};
+}
 
-  // handle progress
-  if (progress_cb) progress_cb("build light", progress.x++, progress.y);
+// Shade a preview from the first hits of the camera rays through pixel
+// centers, with false colors or eyelight for other samplers. Hits are given
+// for the whole frame.
+static void shade_preview(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    const img::image<vec4i>& hits) {
+  auto cone  = get_camera_cone(camera, state->frame);
+  auto tiles = make_tiles(state->render.size(), params.tilesize);
+  parallel_for_tiles(tiles, params.numa, [&](const vec4i& tile) {
+    for (auto j = tile.y; j < tile.w; j++) {
+      for (auto i = tile.x; i < tile.z; i++) {
+        auto rng = get_pixel_rng(state, {i, j}, 0, params);
+        auto fij = get_frame_pixel(state, {i, j});
+        auto ray = sample_camera(
+            camera, fij, state->frame, {0.5f, 0.5f}, {0.5f, 0.5f}, false);
+        auto intersection    = intersect_hit(scene, ray, hits[fij]);
+        auto [radiance, hit] = params.sampler == sampler_type::falsecolor
+                                   ? shade_falsecolor(
+                                         scene, ray, intersection, 0, params)
+                                   : shade_eyelight(scene, ray, intersection,
+                                         cone, 0, rng, params);
+        auto pixel            = trc::pixel{};
+        state->render[{i, j}] = accumulate_sample(
+            pixel, scene, radiance, hit, params);
+      }
+    }
+  });
 }
 
-using std::atomic;
-using std::deque;
-using std::future;
+// Number of render threads of the async interface, leaving the reserved
+// ones to the caller.
+static int get_render_threads(const trace_params& params) {
+  return max(common::get_num_threads() - max(params.reserved, 0), 1);
+}
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
-template <typename Func>
-inline void parallel_for(const vec2i& size, Func&& func) {
-  auto             futures  = std::vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, size]() {
-          while (true) {
-            auto j = next_idx.fetch_add(1);
-            if (j >= size.y) break;
-            for (auto i = 0; i < size.x; i++) func({i, j});
-          }
-        }));
+// Create the render pool of the async interface, kept across restarts. A
+// pool is needed only to reserve threads or lower their priority, and the
+// global pool is used otherwise. The worker thread takes part in the loops,
+// so the pool has one thread less than the render threads.
+static void init_render_pool(trc::state* state, const trace_params& params) {
+  if (params.reserved <= 0 && !params.lowpriority) {
+    state->pool = nullptr;
+    return;
   }
-  for (auto& f : futures) f.get();
+  auto nthreads = get_render_threads(params);
+  if (state->pool && state->pool->size() == nthreads - 1 &&
+      state->lowpriority == params.lowpriority)
+    return;
+  state->pool        = nullptr;
+  state->pool        = std::make_shared<common::thread_pool>(nthreads - 1,
+      common::get_thread_affinity(), params.lowpriority);
+  state->lowpriority = params.lowpriority;
 }
 
-// Progressively compute an image by calling trace_samples multiple times.
-img::image<vec4f> trace_image(const trc::scene* scene,
-    const trc::camera* camera, const trace_params& params,
-    progress_callback progress_cb, image_callback image_cb) {
-  auto state_guard = std::make_unique<state>();
-  auto state       = state_guard.get();
-  init_state(state, scene, camera, params);
+// Progressively trace samples in a worker thread. Between tiles, threads
+// yield to the caller, and with a target frame rate, threads beyond the
+// active count leave the pass.
+static void start_worker(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, int64_t start,
+    progress_callback progress_cb, image_callback image_cb,
+    async_callback async_cb, tile_callback tile_cb) {
+  auto tiles    = make_tiles(state->render.size(), params.tilesize);
+  auto kernel   = get_sample_kernel(params);
+  auto nthreads = get_render_threads(params);
+  init_render_pool(state, params);
+  if (state->active <= 0 || state->active > nthreads)
+    state->active = nthreads;
+  state->worker = std::async(std::launch::async, [=]() {
+    if (params.lowpriority) common::lower_thread_priority();
+    auto& pool   = state->pool ? *state->pool : common::get_thread_pool();
+    auto  active = [state, &params](int thread_id) {
+      if (params.framerate <= 0) return true;
+      std::this_thread::yield();
+      return thread_id < state->active;
+    };
+    auto pass_start = start;
+    for (auto sample = 0; sample < params.samples; sample++) {
+      if (state->stop) return;
+      if (sample && !is_time_left(params, start, pass_start)) break;
+      pass_start = common::get_time();
+      if (progress_cb) progress_cb("trace img::image", sample, params.samples);
+      parallel_for_tiles(
+          pool, nthreads, tiles, params.numa,
+          [&](const vec4i& tile) {
+            for (auto j = tile.y; j < tile.w; j++) {
+              for (auto i = tile.x; i < tile.z; i++) {
+                if (state->stop) return;
+                state->render[{i, j}] = kernel(
+                    state, scene, camera, {i, j}, params);
+                if (async_cb)
+                  async_cb(state->render, sample, params.samples, {i, j});
+              }
+            }
+            if (tile_cb) tile_cb(state->render, sample, params.samples, tile);
+          },
+          active);
+      if (state->guiding)
+        update_guiding(state->guiding.get(), params, sample + 1);
+      if (image_cb) image_cb(state->render, sample + 1, params.samples);
+    }
+    if (progress_cb)
+      progress_cb("trace img::image", params.samples, params.samples);
+    if (image_cb) image_cb(state->render, params.samples, params.samples);
+  });
+}
 
-  for (auto sample = 0; sample < params.samples; sample++) {
-    if (progress_cb) progress_cb("trace image", sample, params.samples);
-    if (params.noparallel) {
-      for (auto j = 0; j < state->render.size().y; j++) {
-        for (auto i = 0; i < state->render.size().x; i++) {
-          state->render[{i, j}] = trace_sample(
-              state, scene, camera, {i, j}, params);
+// Image coordinates of a point, or of a direction for points at infinity,
+// seen by a pinhole camera. Returns false if outside the image.
+static bool project_camera(
+    const trc::camera* camera, const vec3f& p, bool point, vec2f& uv) {
+  auto frame = inverse(camera->frame);
+  auto q = point ? transform_point(frame, p) : transform_direction(frame, p);
+  if (q.z >= 0) return false;
+  if (camera->orthographic) {
+    if (!point) return false;
+    uv = {0.5f + q.x * camera->lens / camera->film.x,
+        0.5f - q.y * camera->lens / camera->film.y};
+  } else {
+    uv = {0.5f - q.x * camera->lens / (q.z * camera->film.x),
+        0.5f + q.y * camera->lens / (q.z * camera->film.y)};
+  }
+  return uv.x >= 0 && uv.x < 1 && uv.y >= 0 && uv.y < 1;
+}
+
+// Reproject the pixels accumulated with the previous camera. The first hit
+// of each pixel center is projected in the previous camera, and the pixel
+// found there is kept if its own first hit is on the same object at the
+// same depth, or if both rays miss. Kept pixels are scaled to `weight`
+// times their samples.
+static void reproject_pixels(trc::state* state, const trc::scene* scene,
+    const trc::camera* previous, const trc::camera* camera,
+    const trace_params& params, float weight,
+    const img::image<trc::pixel>& pixels) {
+  auto tiles = make_tiles(state->render.size(), params.tilesize);
+  parallel_for_tiles(tiles, params.numa, [&](const vec4i& tile) {
+    for (auto j = tile.y; j < tile.w; j++) {
+      for (auto i = tile.x; i < tile.z; i++) {
+        auto ray = sample_camera(camera, get_frame_pixel(state, {i, j}),
+            state->frame, {0.5f, 0.5f}, {0.5f, 0.5f}, false);
+        auto intersection = intersect_scene_bvh(scene, ray);
+        auto position     = ray.o + ray.d * intersection.distance;
+        auto uv           = zero2f;
+        if (!project_camera(previous, intersection.hit ? position : ray.d,
+                intersection.hit, uv))
+          continue;
+        auto fij = vec2i{(int)(uv.x * state->frame.x),
+            (int)(uv.y * state->frame.y)};
+        auto pij = vec2i{fij.x - state->crop.x, fij.y - state->crop.y};
+        if (pij.x < 0 || pij.x >= pixels.size().x || pij.y < 0 ||
+            pij.y >= pixels.size().y)
+          continue;
+
+        // the previous first hit must match
+        auto pray = sample_camera(
+            previous, fij, state->frame, {0.5f, 0.5f}, {0.5f, 0.5f}, false);
+        auto pintersection = intersect_scene_bvh(scene, pray);
+        if (pintersection.hit != intersection.hit) continue;
+        if (intersection.hit) {
+          if (pintersection.object != intersection.object ||
+              pintersection.instance != intersection.instance)
+            continue;
+          auto depth = distance(position, pray.o);
+          if (abs(pintersection.distance - depth) > 0.02f * depth) continue;
         }
+
+        // scale the samples, keeping the pixel color
+        auto pixel = pixels[pij];
+        if (!pixel.samples) continue;
+        auto samples = max((int)round(pixel.samples * weight), 1);
+        auto scale   = (float)samples / (float)pixel.samples;
+        auto hits    = (int)round(pixel.hits * scale);
+        pixel.radiance *= pixel.hits ? (float)hits / (float)pixel.hits : 0;
+        pixel.luminance2 *= scale;
+        pixel.hits    = hits;
+        pixel.samples = samples;
+        set_pixel(state, {i, j}, pixel);
+        state->render[{i, j}] = {hits ? pixel.radiance / hits : zero3f,
+            (float)hits / (float)samples};
       }
-    } else {
-      parallel_for(state->render.size(),
-          [state, scene, camera, &params](const vec2i& ij) {
-            state->render[ij] = trace_sample(state, scene, camera, ij, params);
-          });
     }
-    if (image_cb) image_cb(state->render, sample + 1, params.samples);
-  }
-
-  if (progress_cb) progress_cb("trace image", params.samples, params.samples);
-  return state->render;
+  });
 }
 
 // [experimental] Asynchronous interface
 void trace_start(trc::state* state, const trc::scene* scene,
     const trc::camera* camera, const trace_params& params,
     progress_callback progress_cb, image_callback image_cb,
-    async_callback async_cb) {
+    async_callback async_cb, tile_callback tile_cb) {
   init_state(state, scene, camera, params);
   state->worker = {};
   state->stop   = false;
+  auto start    = common::get_time();
 
   // render preview
   if (progress_cb) progress_cb("trace preview", 0, params.samples);
-  auto pprms = params;
-  pprms.resolution /= params.pratio;
-  pprms.samples = 1;
-  auto preview  = trace_image(scene, camera, pprms);
-  for (auto j = 0; j < state->render.size().y; j++) {
-    for (auto i = 0; i < state->render.size().x; i++) {
-      auto pi               = clamp(i / params.pratio, 0, preview.size().x - 1),
-           pj               = clamp(j / params.pratio, 0, preview.size().y - 1);
-      state->render[{i, j}] = preview[{pi, pj}];
-    }
+  trace_preview(state, scene, camera, params, start);
+  if (image_cb) image_cb(state->render, 0, params.samples);
+
+  // start renderer
+  start_worker(state, scene, camera, params, start, progress_cb, image_cb,
+      async_cb, tile_cb);
+}
+void trace_start(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    const img::image<vec4i>& hits, progress_callback progress_cb,
+    image_callback image_cb, async_callback async_cb, tile_callback tile_cb) {
+  init_state(state, scene, camera, params);
+  state->worker = {};
+  state->stop   = false;
+  auto start    = common::get_time();
+
+  // render preview from the hits when they match the frame
+  if (progress_cb) progress_cb("trace preview", 0, params.samples);
+  if (hits.size() == state->frame) {
+    shade_preview(state, scene, camera, params, hits);
+  } else {
+    trace_preview(state, scene, camera, params, start);
   }
   if (image_cb) image_cb(state->render, 0, params.samples);
 
   // start renderer
-  state->worker = std::async(std::launch::async, [=]() {
-    for (auto sample = 0; sample < params.samples; sample++) {
-      if (state->stop) return;
-      if (progress_cb) progress_cb("trace img::image", sample, params.samples);
-      parallel_for(state->render.size(), [&](const vec2i& ij) {
-        if (state->stop) return;
-        state->render[ij] = trace_sample(state, scene, camera, ij, params);
-        if (async_cb) async_cb(state->render, sample, params.samples, ij);
-      });
-      if (image_cb) image_cb(state->render, sample + 1, params.samples);
-    }
-    if (progress_cb)
-      progress_cb("trace img::image", params.samples, params.samples);
-    if (image_cb) image_cb(state->render, params.samples, params.samples);
-  });
+  start_worker(state, scene, camera, params, start, progress_cb, image_cb,
+      async_cb, tile_cb);
+}
+void trace_restart(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, bool keep_render,
+    progress_callback progress_cb, image_callback image_cb,
+    async_callback async_cb, tile_callback tile_cb) {
+  keep_render = keep_render &&
+                state->frame == get_render_size(camera, params) &&
+                state->crop == get_render_crop(camera, params);
+  clear_state(state, scene, camera, params);
+  state->worker = {};
+  state->stop   = false;
+  auto start    = common::get_time();
+
+  // the kept render is shown until new samples replace it
+  if (!keep_render) {
+    if (progress_cb) progress_cb("trace preview", 0, params.samples);
+    trace_preview(state, scene, camera, params, start);
+  }
+  if (image_cb) image_cb(state->render, 0, params.samples);
+
+  // start renderer
+  start_worker(state, scene, camera, params, start, progress_cb, image_cb,
+      async_cb, tile_cb);
+}
+void trace_reproject(trc::state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, float weight,
+    progress_callback progress_cb, image_callback image_cb,
+    async_callback async_cb, tile_callback tile_cb) {
+  auto previous = state->camera;
+  if (weight <= 0 || previous.aperture > 0 || camera->aperture > 0 ||
+      state->frame != get_render_size(camera, params) ||
+      state->crop != get_render_crop(camera, params) ||
+      state->hpixels.empty() == params.halfbuffer) {
+    return trace_restart(state, scene, camera, params, false, progress_cb,
+        image_cb, async_cb, tile_cb);
+  }
+  auto pixels = img::image<trc::pixel>{state->render.size()};
+  for (auto j = 0; j < pixels.size().y; j++)
+    for (auto i = 0; i < pixels.size().x; i++)
+      pixels[{i, j}] = get_pixel(state, {i, j});
+  clear_state(state, scene, camera, params);
+  state->worker = {};
+  state->stop   = false;
+  auto start    = common::get_time();
+
+  // the preview is shown only where pixels are not reprojected
+  if (progress_cb) progress_cb("trace preview", 0, params.samples);
+  trace_preview(state, scene, camera, params, start);
+  reproject_pixels(state, scene, &previous, camera, params, weight, pixels);
+  if (image_cb) image_cb(state->render, 0, params.samples);
+
+  // start renderer
+  start_worker(state, scene, camera, params, start, progress_cb, image_cb,
+      async_cb, tile_cb);
+}
+void trace_report_frame(trc::state* state, const trace_params& params) {
+  auto now  = common::get_time();
+  auto last = state->frame_time.exchange(now);
+  if (params.framerate <= 0 || !last) return;
+  auto elapsed  = (now - last) / 1e9;
+  auto target   = 1 / params.framerate;
+  auto nthreads = get_render_threads(params);
+  if (elapsed > target * 1.25f) {
+    state->active = max(state->active - 1, 1);
+  } else if (elapsed < target) {
+    state->active = min(state->active + 1, nthreads);
+  }
 }
 void trace_stop(trc::state* state) {
   if (!state) return;
@@ -2500,19 +7355,20 @@ shape::~shape() {
 #endif
 }
 
+// cleanup
+volume::~volume() {
+#ifndef _WIN32
+  if (mapped) munmap((void*)mapped, mapped_size);
+#endif
+}
+
 // cleanup
 scene::~scene() {
   if (bvh) delete bvh;
+  if (texture_cache) delete texture_cache;
 #ifdef YOCTO_EMBREE
   if (embree_bvh) rtcReleaseScene(embree_bvh);
 #endif
-  for (auto camera : cameras) delete camera;
-  for (auto object : objects) delete object;
-  for (auto shape : shapes) delete shape;
-  for (auto material : materials) delete material;
-  for (auto instance : instances) delete instance;
-  for (auto texture : textures) delete texture;
-  for (auto environment : environments) delete environment;
 }
 
 // Default instance
@@ -2520,30 +7376,34 @@ static auto default_instance = instance{{identity3x4f}};
 
 // Add element
 trc::camera* add_camera(trc::scene* scene) {
-  return scene->cameras.emplace_back(new camera{});
+  return scene->cameras.emplace_back(scene->camera_arena.create());
 }
 trc::texture* add_texture(trc::scene* scene) {
-  return scene->textures.emplace_back(new texture{});
+  return scene->textures.emplace_back(scene->texture_arena.create());
+}
+trc::volume* add_volume(trc::scene* scene) {
+  return scene->volumes.emplace_back(scene->volume_arena.create());
 }
 trc::shape* add_shape(trc::scene* scene) {
-  return scene->shapes.emplace_back(new shape{});
+  return scene->shapes.emplace_back(scene->shape_arena.create());
 }
 trc::material* add_material(trc::scene* scene) {
-  return scene->materials.emplace_back(new material{});
+  return scene->materials.emplace_back(scene->material_arena.create());
 }
 trc::instance* add_instance(trc::scene* scene) {
-  return scene->instances.emplace_back(new instance{});
+  return scene->instances.emplace_back(scene->instance_arena.create());
 }
 trc::object* add_object(trc::scene* scene) {
-  auto object_      = scene->objects.emplace_back(new object{});
+  auto object_      = scene->objects.emplace_back(scene->object_arena.create());
   object_->instance = &default_instance;
   return object_;
 }
 trc::environment* add_environment(trc::scene* scene) {
-  return scene->environments.emplace_back(new environment{});
+  return scene->environments.emplace_back(
+      scene->environment_arena.create());
 }
 trc::light* add_light(trc::scene* scene) {
-  return scene->lights.emplace_back(new light{});
+  return scene->lights.emplace_back(scene->light_arena.create());
 }
 
 // Set cameras
@@ -2561,31 +7421,560 @@ void set_focus(trc::camera* camera, float aperture, float focus) {
   camera->aperture = aperture;
   camera->focus    = focus;
 }
+void set_shutter(trc::camera* camera, float shutter) {
+  camera->shutter = shutter;
+}
+
+// Build mip levels by halving the image down to a single texel, averaging
+// blocks of 2x2 texels. Odd sizes clamp the block to the image.
+template <typename T, typename Average>
+static std::vector<img::image<T>> make_texture_mips(
+    const img::image<T>& img, Average&& average) {
+  auto mips = std::vector<img::image<T>>{};
+  if (img.empty()) return mips;
+  while (true) {
+    auto& previous = mips.empty() ? img : mips.back();
+    auto  psize    = previous.size();
+    if (psize == vec2i{1, 1}) break;
+    auto mip = img::image<T>{max(psize / 2, vec2i{1, 1})};
+    for (auto j = 0; j < mip.size().y; j++) {
+      for (auto i = 0; i < mip.size().x; i++) {
+        auto ii = min(2 * i + 1, psize.x - 1), jj = min(2 * j + 1, psize.y - 1);
+        mip[{i, j}] = average(previous[{2 * i, 2 * j}],
+            previous[{ii, 2 * j}], previous[{2 * i, jj}], previous[{ii, jj}]);
+      }
+    }
+    mips.push_back(std::move(mip));
+  }
+  return mips;
+}
+
+// Build mip levels for each texture type. Ldr colors are averaged in
+// linear space since they are encoded as srgb, other types are box filtered.
+static std::vector<img::image<vec3b>> make_texture_mips(
+    const img::image<vec3b>& img) {
+  return make_texture_mips(
+      img, [](const vec3b& a, const vec3b& b, const vec3b& c, const vec3b& d) {
+        return float_to_byte(rgb_to_srgb(
+            (srgb_to_rgb(byte_to_float(a)) + srgb_to_rgb(byte_to_float(b)) +
+                srgb_to_rgb(byte_to_float(c)) +
+                srgb_to_rgb(byte_to_float(d))) /
+            4));
+      });
+}
+static std::vector<img::image<vec3f>> make_texture_mips(
+    const img::image<vec3f>& img) {
+  return img::build_mips(img);
+}
+static std::vector<img::image<byte>> make_texture_mips(
+    const img::image<byte>& img) {
+  return img::build_mips(img);
+}
+static std::vector<img::image<float>> make_texture_mips(
+    const img::image<float>& img) {
+  return img::build_mips(img);
+}
+static std::vector<img::image<vec3h>> make_texture_mips(
+    const img::image<vec3h>& img) {
+  return img::build_mips(img);
+}
+static std::vector<img::image<half>> make_texture_mips(
+    const img::image<half>& img) {
+  return img::build_mips(img);
+}
+
+// Build mip levels of block compressed images, by decompressing them,
+// building mips of their pixels and compressing those.
+static std::vector<img::block_image> make_texture_mips(
+    const img::block_image& img) {
+  auto mips    = std::vector<img::block_image>{};
+  auto decoded = img::decompress_image(img);
+  if (img.format == img::block_format::bc1) {
+    for (auto& mip : make_texture_mips(decoded))
+      mips.push_back(img::compress_image(mip));
+  } else {
+    auto scalar = img::image<byte>{decoded.size()};
+    for (auto i = (size_t)0; i < scalar.count(); i++) scalar[i] = decoded[i].x;
+    for (auto& mip : make_texture_mips(scalar))
+      mips.push_back(img::compress_image(mip));
+  }
+  return mips;
+}
 
 // Add texture
 void set_texture(trc::texture* texture, const img::image<vec3b>& img) {
-  texture->colorb  = img;
-  texture->colorf  = {};
-  texture->scalarb = {};
-  texture->scalarf = {};
+  set_texture(texture, img::image<vec3b>{img});
 }
 void set_texture(trc::texture* texture, const img::image<vec3f>& img) {
-  texture->colorb  = {};
-  texture->colorf  = img;
-  texture->scalarb = {};
-  texture->scalarf = {};
+  set_texture(texture, img::image<vec3f>{img});
 }
 void set_texture(trc::texture* texture, const img::image<byte>& img) {
-  texture->colorb  = {};
-  texture->colorf  = {};
-  texture->scalarb = img;
-  texture->scalarf = {};
+  set_texture(texture, img::image<byte>{img});
 }
 void set_texture(trc::texture* texture, const img::image<float>& img) {
-  texture->colorb  = {};
-  texture->colorf  = {};
-  texture->scalarb = {};
-  texture->scalarf = img;
+  set_texture(texture, img::image<float>{img});
+}
+void set_texture(trc::texture* texture, const img::image<vec3h>& img) {
+  set_texture(texture, img::image<vec3h>{img});
+}
+void set_texture(trc::texture* texture, const img::image<half>& img) {
+  set_texture(texture, img::image<half>{img});
+}
+void set_texture(trc::texture* texture, const img::block_image& img) {
+  set_texture(texture, img::block_image{img});
+}
+
+// Clear texture images, before setting one of them
+static void clear_texture_images(trc::texture* texture) {
+  static auto next_version = std::atomic<uint64_t>{1};
+  texture->version         = next_version++;
+  texture->procedural      = {};
+  texture->procedural_size = {0, 0};
+  texture->colorf       = {};
+  texture->colorh       = {};
+  texture->colorb       = {};
+  texture->scalarf      = {};
+  texture->scalarh      = {};
+  texture->scalarb      = {};
+  texture->colorf_mips  = {};
+  texture->colorh_mips  = {};
+  texture->colorb_mips  = {};
+  texture->scalarf_mips = {};
+  texture->scalarh_mips = {};
+  texture->scalarb_mips = {};
+  texture->blocks       = {};
+  texture->blocks_mips  = {};
+}
+
+// Add texture
+void set_texture(trc::texture* texture, img::image<vec3b>&& img) {
+  clear_texture_images(texture);
+  texture->colorb_mips = make_texture_mips(img);
+  texture->colorb      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::image<vec3f>&& img) {
+  clear_texture_images(texture);
+  texture->colorf_mips = make_texture_mips(img);
+  texture->colorf      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::image<byte>&& img) {
+  clear_texture_images(texture);
+  texture->scalarb_mips = make_texture_mips(img);
+  texture->scalarb      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::image<float>&& img) {
+  clear_texture_images(texture);
+  texture->scalarf_mips = make_texture_mips(img);
+  texture->scalarf      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::image<vec3h>&& img) {
+  clear_texture_images(texture);
+  texture->colorh_mips = make_texture_mips(img);
+  texture->colorh      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::image<half>&& img) {
+  clear_texture_images(texture);
+  texture->scalarh_mips = make_texture_mips(img);
+  texture->scalarh      = std::move(img);
+}
+void set_texture(trc::texture* texture, img::block_image&& img) {
+  clear_texture_images(texture);
+  texture->blocks_mips = make_texture_mips(img);
+  texture->blocks      = std::move(img);
+}
+
+// Set a procedural texture
+void set_procedural(trc::texture* texture, const texture_shader& shader,
+    const vec2i& size) {
+  clear_texture_images(texture);
+  texture->procedural      = shader;
+  texture->procedural_size = size;
+}
+
+// Save a tiled texture, with a header holding the number of channels, the
+// texel type and the size of each level, followed by the tiles of all
+// levels in order. Tiles are padded by clamping to the image edges. The file
+// is written to a temporary and then renamed, like bvh caches.
+template <typename T>
+static bool save_tiled_texture(const std::string& filename,
+    const img::image<T>& img, bool ldr, std::string& error) {
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+  auto mips     = make_texture_mips(img);
+  auto channels = (int)sizeof(T) / (ldr ? 1 : 4);
+  auto levels   = 1 + (int)mips.size();
+  auto thread  = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto tmpname = filename + "." + std::to_string(common::get_time()) + "." +
+                 std::to_string(thread) + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) return write_error();
+  auto write_value = [fs](const auto& value) {
+    return fwrite(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto ok = fwrite("YTEX", 4, 1, fs) == 1 && write_value(channels) &&
+            write_value((int)ldr) && write_value(levels);
+  for (auto level = 0; level < levels && ok; level++) {
+    ok = write_value(level ? mips[level - 1].size() : img.size());
+  }
+  auto tile = std::vector<T>(texture_tile * texture_tile);
+  for (auto level = 0; level < levels && ok; level++) {
+    auto& mip   = level ? mips[level - 1] : img;
+    auto  size  = mip.size();
+    auto  tiles = (size + (texture_tile - 1)) / texture_tile;
+    for (auto tj = 0; tj < tiles.y && ok; tj++) {
+      for (auto ti = 0; ti < tiles.x && ok; ti++) {
+        for (auto j = 0; j < texture_tile; j++) {
+          for (auto i = 0; i < texture_tile; i++) {
+            tile[j * texture_tile + i] = mip[{
+                min(ti * texture_tile + i, size.x - 1),
+                min(tj * texture_tile + j, size.y - 1)}];
+          }
+        }
+        ok = fwrite(tile.data(), sizeof(T), tile.size(), fs) == tile.size();
+      }
+    }
+  }
+  ok = fclose(fs) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    return write_error();
+  }
+  return true;
+}
+bool save_tiled_texture(const std::string& filename,
+    const img::image<vec3b>& img, std::string& error) {
+  return save_tiled_texture(filename, img, true, error);
+}
+bool save_tiled_texture(const std::string& filename,
+    const img::image<vec3f>& img, std::string& error) {
+  return save_tiled_texture(filename, img, false, error);
+}
+bool save_tiled_texture(const std::string& filename,
+    const img::image<byte>& img, std::string& error) {
+  return save_tiled_texture(filename, img, true, error);
+}
+bool save_tiled_texture(const std::string& filename,
+    const img::image<float>& img, std::string& error) {
+  return save_tiled_texture(filename, img, false, error);
+}
+
+// Set a texture to a tiled texture file, reading only its header. Textures
+// get unique ids, so that tiles of different scenes never collide.
+bool set_tiled_texture(trc::scene* scene, trc::texture* texture,
+    const std::string& filename, std::string& error) {
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+  static auto next_id = std::atomic<uint64_t>{1};
+  auto        fs      = fopen(filename.c_str(), "rb");
+  if (!fs) return read_error();
+  auto fs_guard   = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  auto read_value = [fs](auto& value) {
+    return fread(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto magic = std::array<char, 4>{}, stored = std::array<char, 4>{};
+  auto channels = 0, ldr = 0, levels = 0;
+  memcpy(magic.data(), "YTEX", 4);
+  if (!read_value(stored) || stored != magic) return read_error();
+  if (!read_value(channels) || (channels != 1 && channels != 3))
+    return read_error();
+  if (!read_value(ldr) || !read_value(levels) || levels <= 0 || levels > 32)
+    return read_error();
+  auto sizes = std::vector<vec2i>(levels);
+  for (auto& size : sizes) {
+    if (!read_value(size) || size.x <= 0 || size.y <= 0) return read_error();
+  }
+  set_texture(texture, img::image<vec3f>{});
+  texture->tiled          = filename;
+  texture->tiled_id       = next_id++;
+  texture->tiled_channels = channels;
+  texture->tiled_ldr      = ldr != 0;
+  texture->tiled_sizes    = sizes;
+  texture->tiled_offsets.resize(levels);
+  auto offset = (uint64_t)(4 + sizeof(int) * 3 + sizeof(vec2i) * levels);
+  for (auto level = 0; level < levels; level++) {
+    auto tiles = (sizes[level] + (texture_tile - 1)) / texture_tile;
+    texture->tiled_offsets[level] = offset;
+    offset += (uint64_t)tiles.x * (uint64_t)tiles.y * get_tile_bytes(texture);
+  }
+  if (!scene->texture_cache) scene->texture_cache = new texture_cache{};
+  texture->tiled_cache = scene->texture_cache;
+  return true;
+}
+
+// Set the texture cache budget, evicting tiles as they are next loaded.
+void set_texture_cache(trc::scene* scene, size_t budget) {
+  if (!scene->texture_cache) scene->texture_cache = new texture_cache{};
+  auto lock                    = std::lock_guard{scene->texture_cache->mutex};
+  scene->texture_cache->budget = budget;
+}
+
+// Release the voxels of a sparse volume file
+static void clear_volume_file(trc::volume* volume) {
+#ifndef _WIN32
+  if (volume->mapped) munmap((void*)volume->mapped, volume->mapped_size);
+#endif
+  volume->encoding    = volume_encoding::floats;
+  volume->encoded     = nullptr;
+  volume->mapped      = nullptr;
+  volume->mapped_size = 0;
+  volume->buffer.clear();
+  volume->buffer.shrink_to_fit();
+}
+
+// Add volume, splitting the grid into bricks and dropping empty ones.
+// Majorants include the voxels around each brick, since interpolation
+// reaches half a voxel outside it.
+void set_volume(trc::volume* volume, const img::volume<float>& vol,
+    const bbox3f& bounds) {
+  clear_volume_file(volume);
+  volume->size    = vol.size();
+  volume->bounds  = bounds;
+  volume->bricks  = (vol.size() + (volume_brick - 1)) / volume_brick;
+  auto num_bricks = volume->bricks.x * volume->bricks.y * volume->bricks.z;
+  volume->offsets.assign(num_bricks, -1);
+  volume->majorants.assign(num_bricks, 0);
+  volume->voxels.clear();
+  auto size = vol.size();
+  for (auto bid = 0; bid < num_bricks; bid++) {
+    auto brick = vec3i{bid % volume->bricks.x,
+        (bid / volume->bricks.x) % volume->bricks.y,
+        bid / (volume->bricks.x * volume->bricks.y)};
+    auto start = brick * volume_brick;
+    auto end   = min(start + volume_brick, size);
+    // majorant over the brick and its neighboring voxels
+    auto majorant = 0.0f;
+    auto dstart = max(start + (-1), 0), dend = min(end + 1, size);
+    for (auto k = dstart.z; k < dend.z; k++) {
+      for (auto j = dstart.y; j < dend.y; j++) {
+        for (auto i = dstart.x; i < dend.x; i++) {
+          majorant = max(majorant, vol[{i, j, k}]);
+        }
+      }
+    }
+    volume->majorants[bid] = majorant;
+    // store non-empty bricks
+    auto empty = true;
+    for (auto k = start.z; k < end.z && empty; k++) {
+      for (auto j = start.y; j < end.y && empty; j++) {
+        for (auto i = start.x; i < end.x && empty; i++) {
+          if (vol[{i, j, k}] != 0) empty = false;
+        }
+      }
+    }
+    if (empty) continue;
+    volume->offsets[bid] = (int)volume->voxels.size();
+    volume->voxels.resize(volume->voxels.size() +
+                          volume_brick * volume_brick * volume_brick);
+    auto voxels = volume->voxels.data() + volume->offsets[bid];
+    for (auto k = start.z; k < end.z; k++) {
+      for (auto j = start.y; j < end.y; j++) {
+        for (auto i = start.x; i < end.x; i++) {
+          voxels[((k - start.z) * volume_brick + (j - start.y)) *
+                     volume_brick +
+                 (i - start.x)] = vol[{i, j, k}];
+        }
+      }
+    }
+  }
+}
+
+// Alignment of the voxels in sparse volume files, so that mapped bricks
+// start at page boundaries
+const auto volume_file_alignment = (size_t)4096;
+
+// Size in bytes of an encoded voxel
+static size_t get_voxel_bytes(volume_encoding encoding) {
+  switch (encoding) {
+    case volume_encoding::floats: return sizeof(float);
+    case volume_encoding::halfs: return sizeof(half);
+    case volume_encoding::bytes: return sizeof(byte);
+    default: return 0;
+  }
+}
+
+// Save a sparse volume, with a header holding the encoding, the grid size,
+// the number of bricks stored and the offsets and majorants of all bricks,
+// followed by the voxels of the stored bricks. Voxels start at an aligned
+// offset. The file is written to a temporary and then renamed, like tiled
+// textures.
+bool save_sparse_volume(const std::string& filename,
+    const img::volume<float>& vol, volume_encoding encoding,
+    std::string& error) {
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+  auto sparse = trc::volume{};
+  set_volume(&sparse, vol);
+  auto brick_voxels = (size_t)(volume_brick * volume_brick * volume_brick);
+  auto stored  = (int)(sparse.voxels.size() / brick_voxels);
+  auto thread  = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto tmpname = filename + "." + std::to_string(common::get_time()) + "." +
+                 std::to_string(thread) + ".tmp";
+  auto fs      = fopen(tmpname.c_str(), "wb");
+  if (!fs) return write_error();
+  auto write_value = [fs](const auto& value) {
+    return fwrite(&value, sizeof(value), 1, fs) == 1;
+  };
+  auto write_values = [fs](const auto& values) {
+    return fwrite(values.data(), sizeof(values[0]), values.size(), fs) ==
+           values.size();
+  };
+  auto ok = fwrite("YSVL", 4, 1, fs) == 1 && write_value((int)encoding) &&
+            write_value(sparse.size) && write_value(stored) &&
+            write_values(sparse.offsets) && write_values(sparse.majorants);
+  auto header  = 4 + sizeof(int) * 2 + sizeof(vec3i) +
+                (sizeof(int) + sizeof(float)) * sparse.offsets.size();
+  auto padding = std::vector<byte>(
+      (volume_file_alignment - header % volume_file_alignment) %
+          volume_file_alignment,
+      (byte)0);
+  ok = ok && write_values(padding);
+  switch (encoding) {
+    case volume_encoding::floats: ok = ok && write_values(sparse.voxels); break;
+    case volume_encoding::halfs: {
+      auto voxels = std::vector<half>(brick_voxels);
+      for (auto brick = 0; brick < stored && ok; brick++) {
+        for (auto idx = (size_t)0; idx < brick_voxels; idx++)
+          voxels[idx] = float_to_half(
+              sparse.voxels[brick * brick_voxels + idx]);
+        ok = write_values(voxels);
+      }
+    } break;
+    case volume_encoding::bytes: {
+      auto voxels = std::vector<byte>(brick_voxels);
+      for (auto bid = 0; bid < (int)sparse.offsets.size() && ok; bid++) {
+        if (sparse.offsets[bid] < 0) continue;
+        auto scale = sparse.majorants[bid] > 0 ? 255 / sparse.majorants[bid]
+                                               : 0.0f;
+        for (auto idx = (size_t)0; idx < brick_voxels; idx++)
+          voxels[idx] = (byte)round(clamp(
+              sparse.voxels[sparse.offsets[bid] + idx] * scale, 0.0f, 255.0f));
+        ok = write_values(voxels);
+      }
+    } break;
+    default: ok = false;
+  }
+  ok = fclose(fs) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpname.c_str());
+    return write_error();
+  }
+  return true;
+}
+
+// Set a volume to a sparse volume file, mapping the file in memory, or
+// reading it where mapping is not supported. Only the brick offsets and
+// majorants are copied.
+bool set_sparse_volume(trc::volume* volume, const std::string& filename,
+    const bbox3f& bounds, std::string& error) {
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+  auto data   = (const byte*)nullptr;
+  auto size   = (size_t)0;
+  auto buffer = std::vector<byte>{};
+#ifndef _WIN32
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return read_error();
+  auto stats = (struct stat){};
+  if (fstat(fd, &stats) != 0 || stats.st_size == 0) {
+    close(fd);
+    return read_error();
+  }
+  size         = (size_t)stats.st_size;
+  auto mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return read_error();
+  data = (const byte*)mapping;
+#else
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return read_error();
+  auto fs_guard = std::unique_ptr<FILE, decltype(&fclose)>{fs, fclose};
+  _fseeki64(fs, 0, SEEK_END);
+  buffer.resize((size_t)_ftelli64(fs));
+  _fseeki64(fs, 0, SEEK_SET);
+  if (fread(buffer.data(), 1, buffer.size(), fs) != buffer.size())
+    return read_error();
+  data = buffer.data();
+  size = buffer.size();
+#endif
+  auto unmap_error = [&]() {
+#ifndef _WIN32
+    munmap((void*)data, size);
+#endif
+    return read_error();
+  };
+
+  // header
+  auto offset     = (size_t)0;
+  auto read_value = [data, size, &offset](auto& value) {
+    if (offset + sizeof(value) > size) return false;
+    memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+  };
+  auto read_values = [data, size, &offset](auto& values) {
+    auto bytes = sizeof(values[0]) * values.size();
+    if (offset + bytes > size) return false;
+    memcpy(values.data(), data + offset, bytes);
+    offset += bytes;
+    return true;
+  };
+  auto magic = std::array<char, 4>{}, stored_magic = std::array<char, 4>{};
+  auto encoding = 0, stored = 0;
+  auto grid     = zero3i;
+  memcpy(magic.data(), "YSVL", 4);
+  if (!read_value(stored_magic) || stored_magic != magic)
+    return unmap_error();
+  if (!read_value(encoding) || encoding < 0 ||
+      encoding > (int)volume_encoding::bytes)
+    return unmap_error();
+  if (!read_value(grid) || grid.x <= 0 || grid.y <= 0 || grid.z <= 0)
+    return unmap_error();
+  if (!read_value(stored) || stored < 0) return unmap_error();
+  auto bricks     = (grid + (volume_brick - 1)) / volume_brick;
+  auto num_bricks = (size_t)bricks.x * (size_t)bricks.y * (size_t)bricks.z;
+  auto offsets    = std::vector<int>(num_bricks);
+  auto majorants  = std::vector<float>(num_bricks);
+  if (!read_values(offsets) || !read_values(majorants)) return unmap_error();
+  offset = (offset + volume_file_alignment - 1) / volume_file_alignment *
+           volume_file_alignment;
+  auto brick_voxels = (size_t)(volume_brick * volume_brick * volume_brick);
+  auto voxel_bytes  = get_voxel_bytes((volume_encoding)encoding);
+  if (offset + (size_t)stored * brick_voxels * voxel_bytes > size)
+    return unmap_error();
+  for (auto brick_offset : offsets) {
+    if (brick_offset >= 0 &&
+        ((size_t)brick_offset % brick_voxels != 0 ||
+            (size_t)brick_offset / brick_voxels >= (size_t)stored))
+      return unmap_error();
+  }
+
+  // set the volume
+  clear_volume_file(volume);
+  volume->size      = grid;
+  volume->bounds    = bounds;
+  volume->bricks    = bricks;
+  volume->offsets   = std::move(offsets);
+  volume->majorants = std::move(majorants);
+  volume->encoding  = (volume_encoding)encoding;
+  volume->buffer    = std::move(buffer);
+  volume->voxels.clear();
+  volume->voxels.shrink_to_fit();
+#ifndef _WIN32
+  volume->mapped      = data;
+  volume->mapped_size = size;
+  volume->encoded     = data + offset;
+#else
+  volume->encoded = volume->buffer.data() + offset;
+#endif
+  return true;
 }
 
 // Add shape
@@ -2595,6 +7984,9 @@ void set_points(trc::shape* shape, const std::vector<int>& points) {
 void set_lines(trc::shape* shape, const std::vector<vec2i>& lines) {
   shape->lines = lines;
 }
+void set_beziers(trc::shape* shape, const std::vector<vec4i>& beziers) {
+  shape->beziers = beziers;
+}
 void set_triangles(trc::shape* shape, const std::vector<vec3i>& triangles) {
   shape->triangles = triangles;
 }
@@ -2602,7 +7994,16 @@ void set_quads(trc::shape* shape, const std::vector<vec4i>& quads) {
   shape->quads = quads;
 }
 void set_positions(trc::shape* shape, const std::vector<vec3f>& positions) {
-  shape->positions = positions;
+  // padded so that embree can share the buffer
+  shape->positions.clear();
+  shape->positions.reserve(positions.size() + 1);
+  shape->positions.assign(positions.begin(), positions.end());
+}
+void set_positions(trc::shape* shape, std::vector<vec3f>&& positions) {
+  // padded so that embree can share the buffer, reallocating only if needed
+  if (positions.capacity() <= positions.size())
+    positions.reserve(positions.size() + 1);
+  shape->positions = std::move(positions);
 }
 void set_normals(trc::shape* shape, const std::vector<vec3f>& normals) {
   shape->normals = normals;
@@ -2619,6 +8020,127 @@ void set_radius(trc::shape* shape, const std::vector<float>& radius) {
 void set_tangents(trc::shape* shape, const std::vector<vec4f>& tangents) {
   shape->tangents = tangents;
 }
+void set_points(trc::shape* shape, std::vector<int>&& points) {
+  shape->points = std::move(points);
+}
+void set_lines(trc::shape* shape, std::vector<vec2i>&& lines) {
+  shape->lines = std::move(lines);
+}
+void set_beziers(trc::shape* shape, std::vector<vec4i>&& beziers) {
+  shape->beziers = std::move(beziers);
+}
+void set_triangles(trc::shape* shape, std::vector<vec3i>&& triangles) {
+  shape->triangles = std::move(triangles);
+}
+void set_quads(trc::shape* shape, std::vector<vec4i>&& quads) {
+  shape->quads = std::move(quads);
+}
+void set_normals(trc::shape* shape, std::vector<vec3f>&& normals) {
+  shape->normals = std::move(normals);
+}
+void set_texcoords(trc::shape* shape, std::vector<vec2f>&& texcoords) {
+  shape->texcoords = std::move(texcoords);
+}
+void set_colors(trc::shape* shape, std::vector<vec3f>&& colors) {
+  shape->colors = std::move(colors);
+}
+void set_radius(trc::shape* shape, std::vector<float>&& radius) {
+  shape->radius = std::move(radius);
+}
+void set_tangents(trc::shape* shape, std::vector<vec4f>&& tangents) {
+  shape->tangents = std::move(tangents);
+}
+void set_heightfield(trc::shape* shape, const img::image<float>& heightfield) {
+  shape->heightfield = heightfield;
+}
+void set_heightfield(trc::shape* shape, img::image<float>&& heightfield) {
+  shape->heightfield = std::move(heightfield);
+}
+void compress_shape(trc::shape* shape) {
+  if (shape->triangles.empty() || shape->positions.empty()) return;
+  if (!shape->cpositions.empty()) return;
+  auto num_vertices = shape->positions.size();
+
+  // positions quantized in their bounds
+  auto bounds = invalidb3f;
+  for (auto& position : shape->positions) bounds = merge(bounds, position);
+  auto extent       = bounds.max - bounds.min;
+  shape->cbounds    = bounds;
+  shape->cpositions = std::vector<ushort>(num_vertices * 3);
+  for (auto vid = (size_t)0; vid < num_vertices; vid++) {
+    for (auto k = 0; k < 3; k++) {
+      auto value = extent[k] > 0
+                       ? (shape->positions[vid][k] - bounds.min[k]) / extent[k]
+                       : 0.0f;
+      shape->cpositions[vid * 3 + k] = (ushort)round(
+          clamp(value, 0.0f, 1.0f) * 65535);
+    }
+  }
+
+  // normals projected on the octahedron and unfolded on the plane
+  if (!shape->normals.empty()) {
+    shape->cnormals = std::vector<ushort>(num_vertices * 2);
+    for (auto vid = (size_t)0; vid < num_vertices; vid++) {
+      auto& n      = shape->normals[vid];
+      auto  length = abs(n.x) + abs(n.y) + abs(n.z);
+      auto  o      = length ? vec2f{n.x, n.y} / length : zero2f;
+      if (n.z < 0)
+        o = {(1 - abs(o.y)) * (o.x >= 0 ? 1 : -1),
+            (1 - abs(o.x)) * (o.y >= 0 ? 1 : -1)};
+      auto e = clamp(o * 0.5f + 0.5f, 0.0f, 1.0f) * 65535;
+      shape->cnormals[vid * 2 + 0] = (ushort)round(e.x);
+      shape->cnormals[vid * 2 + 1] = (ushort)round(e.y);
+    }
+  }
+
+  // texcoords as halfs
+  if (!shape->texcoords.empty()) {
+    shape->ctexcoords = std::vector<half>(num_vertices * 2);
+    for (auto vid = (size_t)0; vid < num_vertices; vid++) {
+      shape->ctexcoords[vid * 2 + 0] = float_to_half(shape->texcoords[vid].x);
+      shape->ctexcoords[vid * 2 + 1] = float_to_half(shape->texcoords[vid].y);
+    }
+  }
+
+  // triangles with 16 bit indices if possible
+  if (num_vertices <= 65536) {
+    shape->ctriangles = std::vector<ushort>(shape->triangles.size() * 3);
+    for (auto idx = (size_t)0; idx < shape->triangles.size(); idx++) {
+      for (auto k = 0; k < 3; k++)
+        shape->ctriangles[idx * 3 + k] = (ushort)shape->triangles[idx][k];
+    }
+    shape->triangles.clear();
+    shape->triangles.shrink_to_fit();
+  }
+
+  // release the uncompressed data
+  shape->positions.clear();
+  shape->normals.clear();
+  shape->texcoords.clear();
+  shape->positions.shrink_to_fit();
+  shape->normals.shrink_to_fit();
+  shape->texcoords.shrink_to_fit();
+}
+void set_skinning(trc::shape* shape, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms,
+    bool dual_quaternion) {
+  if (!shape->cpositions.empty())
+    throw std::runtime_error("cannot skin compressed shapes");
+  // padded so that embree can share the buffer
+  if (shape->positions.size() != positions.size()) {
+    shape->positions.reserve(positions.size() + 1);
+    shape->positions.resize(positions.size());
+  }
+  shape->normals.resize(normals.size());
+  if (dual_quaternion) {
+    yshp::update_dual_quaternion_skinning(shape->positions, shape->normals,
+        positions, normals, weights, joints, xforms);
+  } else {
+    yshp::update_skinning(shape->positions, shape->normals, positions, normals,
+        weights, joints, xforms);
+  }
+}
 
 // Add object
 void set_frame(trc::object* object, const frame3f& frame) {
@@ -2639,6 +8161,71 @@ void set_instance(trc::object* object, trc::instance* instance) {
 void set_frames(trc::instance* instance, const std::vector<frame3f>& frames) {
   instance->frames = frames;
 }
+void set_frames(trc::instance* instance, std::vector<frame3f>&& frames) {
+  instance->frames = std::move(frames);
+}
+void set_motion(trc::instance* instance,
+    const std::vector<std::vector<frame3f>>& motion) {
+  instance->motion = motion;
+}
+void set_scatter(trc::instance* instance, const trc::object* surface,
+    const trc::texture* density_tex, int num_instances, float radius,
+    const vec2f& scale, int seed) {
+  // sample surface points
+  auto shape = surface->shape;
+  if (!shape->cpositions.empty())
+    throw std::runtime_error("cannot scatter on compressed shapes");
+  auto positions = std::vector<vec3f>{};
+  auto normals   = std::vector<vec3f>{};
+  auto texcoords = std::vector<vec2f>{};
+  if (!shape->triangles.empty()) {
+    if (radius > 0) {
+      yshp::sample_triangles_poisson(positions, normals, texcoords,
+          shape->triangles, shape->positions, shape->normals,
+          shape->texcoords, radius, seed);
+    } else {
+      yshp::sample_triangles(positions, normals, texcoords, shape->triangles,
+          shape->positions, shape->normals, shape->texcoords, num_instances,
+          seed);
+    }
+  } else if (!shape->quads.empty()) {
+    if (radius > 0) {
+      yshp::sample_quads_poisson(positions, normals, texcoords, shape->quads,
+          shape->positions, shape->normals, shape->texcoords, radius, seed);
+    } else {
+      yshp::sample_quads(positions, normals, texcoords, shape->quads,
+          shape->positions, shape->normals, shape->texcoords, num_instances,
+          seed);
+    }
+  }
+
+  // keep points by density, with a random stream per point
+  auto num_points = (int)positions.size();
+  auto kept       = std::vector<int>(num_points, 1);
+  if (density_tex) {
+    common::parallel_for(0, num_points, 4096, [&](int idx) {
+      auto rng  = make_rng(seed, idx);
+      kept[idx] = rand1f(rng) <
+                  eval_texture(density_tex, texcoords[idx], true).x;
+    });
+  }
+  auto offsets = std::vector<int>(num_points + 1, 0);
+  for (auto idx = 0; idx < num_points; idx++) {
+    offsets[idx + 1] = offsets[idx] + kept[idx];
+  }
+
+  // write frames
+  instance->frames.resize(offsets.back());
+  common::parallel_for(0, num_points, 4096, [&](int idx) {
+    if (!kept[idx]) return;
+    auto rng   = make_rng(seed + 1, idx);
+    auto angle = 2 * pif * rand1f(rng);
+    auto size  = lerp(scale.x, scale.y, rand1f(rng));
+    instance->frames[offsets[idx]] =
+        surface->frame * frame_fromz(positions[idx], normals[idx]) *
+        rotation_frame({0, 0, 1}, angle) * scaling_frame(vec3f{size});
+  });
+}
 
 // Add material
 void set_emission(trc::material* material, const vec3f& emission,
@@ -2696,6 +8283,9 @@ void set_scattering(trc::material* material, const vec3f& scattering,
 void set_normalmap(trc::material* material, trc::texture* normal_tex) {
   material->normal_tex = normal_tex;
 }
+void set_density(trc::material* material, trc::volume* density_vol) {
+  material->density_vol = density_vol;
+}
 
 // Add environment
 void set_frame(trc::environment* environment, const frame3f& frame) {
@@ -66,11 +66,14 @@
 // -----------------------------------------------------------------------------
 
 #include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
 
+#include "yocto_common.h"
 #include "yocto_image.h"
 #include "yocto_math.h"
+#include "yocto_shape.h"
 
 #ifdef YOCTO_EMBREE
 #include <embree3/rtcore.h>
@@ -89,13 +92,16 @@ namespace img = yocto::image;
 using math::bbox3f;
 using math::byte;
 using math::frame3f;
+using math::half;
 using math::identity3x4f;
 using math::ray3f;
 using math::rng_state;
+using math::ushort;
 using math::vec2f;
 using math::vec2i;
 using math::vec3b;
 using math::vec3f;
+using math::vec3h;
 using math::vec3i;
 using math::vec4f;
 using math::vec4i;
@@ -113,6 +119,7 @@ struct camera;
 struct environment;
 struct shape;
 struct texture;
+struct volume;
 struct material;
 struct instance;
 struct object;
@@ -121,6 +128,7 @@ struct object;
 trc::camera*      add_camera(trc::scene* scene);
 trc::object*      add_object(trc::scene* scene);
 trc::texture*     add_texture(trc::scene* scene);
+trc::volume*      add_volume(trc::scene* scene);
 trc::material*    add_material(trc::scene* scene);
 trc::shape*       add_shape(trc::scene* scene);
 trc::instance*    add_instance(trc::scene* scene);
@@ -131,6 +139,7 @@ void set_frame(trc::camera* camera, const frame3f& frame);
 void set_lens(trc::camera* camera, float lens, float aspect, float film,
     bool ortho = false);
 void set_focus(trc::camera* camera, float aperture, float focus);
+void set_shutter(trc::camera* camera, float shutter);
 
 // object properties
 void set_frame(trc::object* object, const frame3f& frame);
@@ -138,11 +147,60 @@ void set_material(trc::object* object, trc::material* material);
 void set_shape(trc::object* object, trc::shape* shape);
 void set_instance(trc::object* object, trc::instance* instance);
 
-// texture properties
+// texture properties, moving images avoids copying their pixels
 void set_texture(trc::texture* texture, const img::image<vec3b>& img);
 void set_texture(trc::texture* texture, const img::image<vec3f>& img);
 void set_texture(trc::texture* texture, const img::image<byte>& img);
 void set_texture(trc::texture* texture, const img::image<float>& img);
+void set_texture(trc::texture* texture, const img::image<vec3h>& img);
+void set_texture(trc::texture* texture, const img::image<half>& img);
+void set_texture(trc::texture* texture, img::image<vec3b>&& img);
+void set_texture(trc::texture* texture, img::image<vec3f>&& img);
+void set_texture(trc::texture* texture, img::image<byte>&& img);
+void set_texture(trc::texture* texture, img::image<float>&& img);
+void set_texture(trc::texture* texture, img::image<vec3h>&& img);
+void set_texture(trc::texture* texture, img::image<half>&& img);
+void set_texture(trc::texture* texture, const img::block_image& img);
+void set_texture(trc::texture* texture, img::block_image&& img);
+
+// Tiled textures are stored on disk as mip levels split into tiles. Their
+// tiles are loaded on demand in a texture cache shared by the scene, that
+// keeps at most budget bytes of tiles, evicting the least recently used.
+bool save_tiled_texture(const std::string& filename,
+    const img::image<vec3b>& img, std::string& error);
+bool save_tiled_texture(const std::string& filename,
+    const img::image<vec3f>& img, std::string& error);
+bool save_tiled_texture(const std::string& filename,
+    const img::image<byte>& img, std::string& error);
+bool save_tiled_texture(const std::string& filename,
+    const img::image<float>& img, std::string& error);
+bool set_tiled_texture(trc::scene* scene, trc::texture* texture,
+    const std::string& filename, std::string& error);
+void set_texture_cache(trc::scene* scene, size_t budget);
+
+// Procedural textures are evaluated at each lookup from their uv, in linear
+// color, and take no memory. Size is only used to sample them as texels,
+// for example when importance sampling environments.
+using texture_shader = std::function<vec3f(const vec2f& uv)>;
+void set_procedural(trc::texture* texture, const texture_shader& shader,
+    const vec2i& size = {1024, 1024});
+
+// volume properties, with the grid spanning bounds in object coordinates
+void set_volume(trc::volume* volume, const img::volume<float>& vol,
+    const bbox3f& bounds = {{-1, -1, -1}, {1, 1, 1}});
+
+// Sparse volumes are stored on disk as the non-empty bricks of the grid,
+// with voxels as floats, halfs, or bytes quantized to the brick majorant.
+// Files are memory mapped, so that bricks are paged in on demand when first
+// traversed, and can be shared by processes rendering the same volume.
+enum struct volume_encoding { floats, halfs, bytes };
+const auto volume_encoding_names = std::vector<std::string>{
+    "float", "half", "byte"};
+bool save_sparse_volume(const std::string& filename,
+    const img::volume<float>& vol, volume_encoding encoding,
+    std::string& error);
+bool set_sparse_volume(trc::volume* volume, const std::string& filename,
+    const bbox3f& bounds, std::string& error);
 
 // material properties
 void set_emission(trc::material* material, const vec3f& emission,
@@ -166,10 +224,12 @@ void set_thin(trc::material* material, bool thin);
 void set_scattering(trc::material* material, const vec3f& scattering,
     float scanisotropy, trc::texture* scattering_tex = nullptr);
 void set_normalmap(trc::material* material, trc::texture* normal_tex);
+void set_density(trc::material* material, trc::volume* density_vol);
 
-// shape properties
+// shape properties, moving arrays avoids copying their data
 void set_points(trc::shape* shape, const std::vector<int>& points);
 void set_lines(trc::shape* shape, const std::vector<vec2i>& lines);
+void set_beziers(trc::shape* shape, const std::vector<vec4i>& beziers);
 void set_triangles(trc::shape* shape, const std::vector<vec3i>& triangles);
 void set_quads(trc::shape* shape, const std::vector<vec4i>& quads);
 void set_positions(trc::shape* shape, const std::vector<vec3f>& positions);
@@ -178,28 +238,79 @@ void set_texcoords(trc::shape* shape, const std::vector<vec2f>& texcoords);
 void set_colors(trc::shape* shape, const std::vector<vec3f>& colors);
 void set_radius(trc::shape* shape, const std::vector<float>& radius);
 void set_tangents(trc::shape* shape, const std::vector<vec4f>& tangents);
+void set_points(trc::shape* shape, std::vector<int>&& points);
+void set_lines(trc::shape* shape, std::vector<vec2i>&& lines);
+void set_beziers(trc::shape* shape, std::vector<vec4i>&& beziers);
+void set_triangles(trc::shape* shape, std::vector<vec3i>&& triangles);
+void set_quads(trc::shape* shape, std::vector<vec4i>&& quads);
+void set_positions(trc::shape* shape, std::vector<vec3f>&& positions);
+void set_normals(trc::shape* shape, std::vector<vec3f>&& normals);
+void set_texcoords(trc::shape* shape, std::vector<vec2f>&& texcoords);
+void set_colors(trc::shape* shape, std::vector<vec3f>&& colors);
+void set_radius(trc::shape* shape, std::vector<float>&& radius);
+void set_tangents(trc::shape* shape, std::vector<vec4f>&& tangents);
+// Heightfields are intersected directly with a min/max mipmap, instead of
+// building the make_heightfield mesh and its bvh. They are not sampled as
+// lights and are not supported by Embree.
+void set_heightfield(trc::shape* shape, const img::image<float>& heightfield);
+void set_heightfield(trc::shape* shape, img::image<float>&& heightfield);
+// Compress the positions, normals, texcoords and triangles of a triangle
+// shape in place, decoding them on the fly while rendering. Positions are
+// quantized to 16 bits in the shape bounds, normals are octahedral encoded,
+// texcoords are stored as halfs, and triangles use 16 bit indices for shapes
+// with fewer than 65536 vertices. Call it after setting the shape data and
+// before building the bvh. Compressed shapes are not supported by Embree and
+// can not be skinned.
+void compress_shape(trc::shape* shape);
+// Skin positions and normals from their rest pose straight into the shape,
+// reusing its buffers, e.g. for each frame of an animation before calling
+// update_bvh(). Uses dual quaternion skinning if requested.
+void set_skinning(trc::shape* shape, const std::vector<vec3f>& positions,
+    const std::vector<vec3f>& normals, const std::vector<vec4f>& weights,
+    const std::vector<vec4i>& joints, const std::vector<frame3f>& xforms,
+    bool dual_quaternion = false);
 
 // instance properties
 void set_frames(trc::instance* instance, const std::vector<frame3f>& frames);
+void set_frames(trc::instance* instance, std::vector<frame3f>&& frames);
+void set_motion(trc::instance* instance,
+    const std::vector<std::vector<frame3f>>& motion);
+
+// Scatter instance frames over the surface of an object, writing them
+// directly into the instance. `num_instances` points are sampled uniformly
+// on the object shape, or, if `radius` is positive, as many as fit with no
+// two closer than `radius`. Points are kept with probability given by the
+// first channel of `density_tex` at their texcoords, if present. Frames are
+// in world space, aligned to the surface normal, rotated randomly around it
+// and scaled randomly in the `scale` range, so objects using the instance
+// should have identity frames. Frames are computed in parallel and are the
+// same for a given seed.
+void set_scatter(trc::instance* instance, const trc::object* surface,
+    const trc::texture* density_tex, int num_instances, float radius = 0,
+    const vec2f& scale = {1, 1}, int seed = 7);
 
 // environment properties
 void set_frame(trc::environment* environment, const frame3f& frame);
 void set_emission(trc::environment* environment, const vec3f& emission,
     trc::texture* emission_tex = nullptr);
 
-// Type of tracing algorithm
+// Type of tracing algorithm. With `raysort`, the wavefront sampler reorders
+// secondary rays by origin and direction before intersecting them.
 enum struct sampler_type {
   path,        // path tracing
+  pathnee,     // path tracing with next event estimation
+  wavefront,   // wavefront path tracing
   naive,       // naive path tracing
   eyelight,    // eyelight rendering
   falsecolor,  // false color rendering
+  guided,      // path tracing with path guiding
 };
 // Type of false color visualization
 enum struct falsecolor_type {
   // clang-format off
   normal, frontfacing, gnormal, gfrontfacing, texcoord, color, emission,    
   diffuse, specular, coat, metal, transmission, translucency, refraction, 
-  roughness, opacity, ior, object, element, highlight
+  roughness, opacity, ior, object, element, highlight, depth, albedo
   // clang-format on
 };
 // Strategy used to build the bvh
@@ -208,43 +319,101 @@ enum struct bvh_type {
   highquality,
   middle,
   balanced,
+  wide4,
+  wide8,
+  compressed,
 #ifdef YOCTO_EMBREE
   embree_default,
   embree_highquality,
   embree_compact  // only for copy interface
 #endif
 };
+// Sequence of random numbers used by samplers
+enum struct sequence_type {
+  random,  // pseudo-random numbers
+  sobol,   // owen-scrambled sobol sequence
+  pmj02,   // progressive multi-jittered (0,2) sequence
+};
+// Camera-aware pruning of the scene contributors before building bvhs
+enum struct prune_type {
+  none,          // keep all instances and emitters
+  conservative,  // drop sub-pixel instances and emitters
+  aggressive,    // also drop small off-screen instances and dim emitters
+};
+// Strategy used to split a frame across render nodes
+enum struct partition_type {
+  samples,  // each node traces a range of samples of all pixels
+  regions,  // each node traces all samples of a range of tile rows
+};
 
 // Default trace seed
 const auto default_seed = 961748941ull;
 
 // Options for trace functions
 struct trace_params {
-  int             resolution = 1280;
-  sampler_type    sampler    = sampler_type::path;
-  falsecolor_type falsecolor = falsecolor_type::diffuse;
-  int             samples    = 512;
-  int             bounces    = 8;
-  float           clamp      = 100;
-  bool            nocaustics = false;
-  bool            envhidden  = false;
-  bool            tentfilter = false;
-  uint64_t        seed       = default_seed;
-  bvh_type        bvh        = bvh_type::default_;
-  bool            noparallel = false;
-  int             pratio     = 8;
-  float           exposure   = 0;
+  int                          resolution          = 1280;
+  sampler_type                 sampler             = sampler_type::path;
+  falsecolor_type              falsecolor          = falsecolor_type::diffuse;
+  int                          samples             = 512;
+  int                          bounces             = 8;
+  float                        clamp               = 100;
+  bool                         nocaustics          = false;
+  bool                         envhidden           = false;
+  bool                         tentfilter          = false;
+  bool                         mipmap              = false;
+  uint64_t                     seed                = default_seed;
+  sequence_type                sequence            = sequence_type::random;
+  bvh_type                     bvh                 = bvh_type::default_;
+  bool                         embree_shared       = false;
+  bool                         noparallel          = false;
+  int                          pratio              = 8;
+  float                        exposure            = 0;
+  int                          tilesize            = 32;
+  int                          batch               = 1;
+  std::string                  bvh_cache           = "";
+  bool                         bvh_triangles       = false;
+  bool                         watertight          = false;
+  bool                         shading_cache       = true;
+  bool                         adaptive            = false;
+  float                        noise               = 0.01f;
+  bool                         halfbuffer          = false;
+  bool                         compactrng          = false;
+  partition_type               partition           = partition_type::samples;
+  int                          nodes               = 1;
+  int                          node                = 0;
+  std::string                  checkpoint          = "";
+  float                        checkpoint_interval = 60;
+  float                        timebudget          = 0;
+  float                        previewtime         = 0;
+  bool                         denoise             = false;
+  std::vector<falsecolor_type> aovs                = {};
+  int                          guiding_samples     = 64;
+  bool                         raysort             = true;
+  bool                         numa                = false;
+  vec4i                        crop                = {0, 0, 0, 0};
+  int                          reserved            = 0;
+  bool                         lowpriority         = false;
+  float                        framerate           = 0;
+  prune_type                   prune               = prune_type::none;
+  float                        prune_size          = 1;
 };
 
-const auto sampler_names = std::vector<std::string>{
-    "path", "naive", "eyelight", "falsecolor"};
+const auto sampler_names = std::vector<std::string>{"path", "pathnee",
+    "wavefront", "naive", "eyelight", "falsecolor", "guided"};
 
 const auto falsecolor_names = std::vector<std::string>{"normal", "frontfacing",
     "gnormal", "gfrontfacing", "texcoord", "color", "emission", "diffuse",
     "specular", "coat", "metal", "transmission", "translucency", "refraction",
-    "roughness", "opacity", "ior", "object", "element", "highlight"};
+    "roughness", "opacity", "ior", "object", "element", "highlight", "depth",
+    "albedo"};
+const auto sequence_names  = std::vector<std::string>{
+    "random", "sobol", "pmj02"};
+const auto partition_names = std::vector<std::string>{"samples", "regions"};
+const auto prune_names     = std::vector<std::string>{
+    "none", "conservative", "aggressive"};
 const auto bvh_names        = std::vector<std::string>{
-    "default", "highquality", "middle", "balanced",
+    "default", "highquality", "middle", "balanced", "wide4", "wide8",
+    "compressed",
 #ifdef YOCTO_EMBREE
     "embree-default", "embree-highquality", "embree-compact"
 #endif
@@ -257,40 +426,202 @@ using progress_callback =
 using image_callback = std::function<void(
     const img::image<vec4f>& render, int current, int total)>;
 
+// Compile the flattened scene layout used during rendering. This is done
+// by init_bvh, update_bvh and init_lights, and needs to be repeated only
+// when objects are edited without updating those.
+void init_layout(trc::scene* scene);
+
 // Initialize lights.
 void init_lights(trc::scene* scene, progress_callback progress_cb = {});
 
-// Build the bvh acceleration structure.
+// Build the bvh acceleration structure. With `bvh_triangles`, shape bvhs
+// also store their triangles in leaf order, with precomputed edges, and with
+// `watertight` they are intersected with a watertight test. Both apply only
+// to the built-in bvh. With `shading_cache`, faceted and normal-mapped shapes
+// also store their element normals, and normal-mapped ones their tangents.
+// With `numa`, shape and texture buffers are interleaved over NUMA nodes.
 void init_bvh(trc::scene* scene, const trace_params& params,
     progress_callback progress_cb = {});
 
-// Refit bvh data
+// Mark the object instances and emitters that contribute negligibly to the
+// image of a camera, to be skipped by the next init_bvh and init_lights.
+// Instances are measured by their projected size at `params.resolution`,
+// seen from the camera position in any direction, so that geometry seen in
+// reflections is judged like the visible one, and are dropped if smaller
+// than `params.prune_size` pixels. Aggressive pruning also drops the ones
+// outside the view smaller than 16 times that. Emitters are measured by a
+// bound of their irradiance at the camera, relative to the total one, and
+// are dropped below 1e-3 with aggressive pruning, or below 1e-4 and if also
+// sub-pixel with conservative pruning. Dropped emitters are not sampled as
+// lights, but are still hit by rays, since emissive instances stay in the
+// bvh. Orthographic cameras and prune type none prune nothing.
+void prune_scene(trc::scene* scene, const trc::camera* camera,
+    const trace_params& params);
+
+// Memory used by the scene and shape bvhs, in bytes.
+size_t get_bvh_memory(const trc::scene* scene);
+
+// Memory allocated by Embree for all scenes, in bytes. Zero without Embree.
+size_t get_embree_memory();
+
+// Memory used by a scene, in bytes, by kind of data, counting the capacity
+// of its buffers. Embree memory is shared by all scenes.
+struct scene_memory {
+  size_t shapes   = 0;  // geometry and shading caches
+  size_t bvhs     = 0;  // built-in bvhs
+  size_t lights   = 0;  // lights, light tree and sampling cdfs
+  size_t textures = 0;  // images, mips, blocks and cached tiles
+  size_t volumes  = 0;  // voxels and majorants
+  size_t other    = 0;  // elements, instances and the scene layout
+  size_t embree   = 0;  // Embree scenes, zero without Embree
+  size_t total    = 0;
+};
+scene_memory get_scene_memory(const trc::scene* scene);
+
+// Counts of the bvh updates chosen by update_bvh, for shapes and the scene.
+// Bvhs are refit, partially rebuilt by rebuilding the top of the tree over
+// refit subtrees, or fully rebuilt, depending on how their SAH cost degrades.
+struct bvh_update_stats {
+  int refits   = 0;
+  int partials = 0;
+  int rebuilds = 0;
+};
+
+// Get the bvh update counts.
+bvh_update_stats get_bvh_update_stats(const trc::scene* scene);
+
+// Update bvh data, refitting or rebuilding bvhs as needed
 void update_bvh(trc::scene*            scene,
     const std::vector<trc::object*>&   updated_objects,
     const std::vector<trc::shape*>&    updated_shapes,
     const std::vector<trc::instance*>& updated_instances,
     const trace_params&                params);
 
-// Progressively computes an image.
+// Progressively computes an image. In adaptive mode, pixels stop sampling
+// when their relative noise is below `params.noise`, and the remaining
+// budget of `params.samples` per pixel goes to the other pixels.
+// If `params.checkpoint` is set, pixels and rngs are saved to that file
+// every `params.checkpoint_interval` seconds and at the end, and rendering
+// resumes from the file if it exists.
+// If `params.timebudget` is positive, rendering stops before exceeding that
+// many seconds, with `params.samples` as the maximum number of samples.
+// If `params.denoise` is set, albedo and normal features of the first hits
+// are accumulated with the samples and used to denoise the final image.
+// If `params.numa` is set, image rows are split in bands owned by the NUMA
+// nodes, whose pixel buffers are placed on the node and whose tiles are
+// traced first by its threads; pin those with common::set_thread_affinity().
+// If `params.crop` is not empty, only the pixels of the frame in the crop,
+// given as {min.x, min.y, max.x, max.y}, are allocated and traced, and the
+// images returned have the crop size. Pixels match those of the full frame,
+// so crops can be pasted into it with img::set_region(). A checkpoint of a
+// larger part of the frame is updated in place, re-rendering the crop.
 img::image<vec4f> trace_image(const trc::scene* scene,
     const trc::camera* camera, const trace_params& params,
     progress_callback progress_cb = {}, image_callback image_cb = {});
+// Same as above, also returning the samples per pixel traced.
+img::image<vec4f> trace_image(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, int& samples,
+    progress_callback progress_cb = {}, image_callback image_cb = {});
+// Same as above, also returning one image for each false color type in
+// `params.aovs`, computed from the first hits of the same camera rays.
+img::image<vec4f> trace_image(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    std::vector<img::image<vec4f>>& aovs, progress_callback progress_cb = {},
+    image_callback image_cb = {});
 
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params);
 
+// Distributed rendering. Each node traces the part of the frame selected by
+// `params.node` out of `params.nodes`, returning its accumulation buffers
+// with per-pixel radiance sums, hits and sample counts. Partial buffers of
+// all nodes are summed and then converted to the final image. When
+// splitting samples, pixel rngs are derived from the sample number, so that
+// merged images do not depend on the number of nodes.
+struct pixel;
+img::image<trc::pixel> trace_partial(const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    progress_callback progress_cb = {}, image_callback image_cb = {});
+void merge_partial(
+    img::image<trc::pixel>& merged, const img::image<trc::pixel>& partial);
+img::image<vec4f> get_partial_render(const img::image<trc::pixel>& pixels);
+
+// Load and save partial buffers.
+bool load_partial(const std::string& filename, img::image<trc::pixel>& pixels,
+    std::string& error);
+bool save_partial(const std::string& filename,
+    const img::image<trc::pixel>& pixels, std::string& error);
+
 // [experimental] Callback used to report partially computed image
 using async_callback = std::function<void(
     const img::image<vec4f>& render, int current, int total, const vec2i& ij)>;
+// [experimental] Callback used to report a tile of the image, given as
+// (xmin, ymin, xmax, ymax), after each sample is traced for all its pixels.
+// Called from worker threads, so viewers should copy the tile into their own
+// buffer and upload only the updated regions.
+using tile_callback = std::function<void(const img::image<vec4f>& render,
+    int current, int total, const vec4i& tile)>;
 
 // [experimental] Asynchronous interface
+// Rendering stops after `params.timebudget` seconds, if positive. If
+// `params.previewtime` is positive, the preview ratio is adapted at each
+// start from the previous preview time of the state to hit that time.
+// Render threads leave `params.reserved` threads to the caller, and run at a
+// lower priority with `params.lowpriority`. With a positive
+// `params.framerate`, callers report their frames with trace_report_frame()
+// and the number of render threads is adapted to keep that frame rate.
 struct state;
 void trace_start(state* state, const trc::scene* scene,
     const trc::camera* camera, const trace_params& params,
     progress_callback progress_cb = {}, image_callback image_cb = {},
-    async_callback async_cb = {});
+    async_callback async_cb = {}, tile_callback tile_cb = {});
+// [experimental] Same as above, with the preview shaded at full resolution
+// from the first hits of the camera rays through pixel centers. Hits are
+// given as object, instance and element ids, computed outside the tracer,
+// e.g. by rasterization, with negative objects where nothing is hit. Only
+// the given elements are intersected, so no camera rays are traversed for
+// the preview. Hits are ignored if their size is not the render size.
+void trace_start(state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params,
+    const img::image<vec4i>& hits, progress_callback progress_cb = {},
+    image_callback image_cb = {}, async_callback async_cb = {},
+    tile_callback tile_cb = {});
+// [experimental] Restart rendering after an edit, clearing the accumulated
+// samples while keeping the state buffers when the render size and options
+// are unchanged. If `keep_render` is set, as for edits with a still camera,
+// the current render stays on display until new samples replace it, instead
+// of rendering a preview.
+void trace_restart(state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, bool keep_render,
+    progress_callback progress_cb = {}, image_callback image_cb = {},
+    async_callback async_cb = {}, tile_callback tile_cb = {});
+// [experimental] Restart rendering after a camera move, reprojecting the
+// accumulated samples instead of discarding them. The first hits of the new
+// pixel centers are projected in the previous camera, and pixels whose
+// previous first hit is a different object or lies at a different depth are
+// cleared, as are all pixels if the render size or crop change or for
+// cameras with depth of field. Kept pixels have their sample counts scaled
+// by `weight`, so that they act as a prior that new samples soon replace.
+void trace_reproject(state* state, const trc::scene* scene,
+    const trc::camera* camera, const trace_params& params, float weight,
+    progress_callback progress_cb = {}, image_callback image_cb = {},
+    async_callback async_cb = {}, tile_callback tile_cb = {});
+// [experimental] Report that the caller drew a frame, to adapt the render
+// threads to `params.framerate`.
+void trace_report_frame(state* state, const trace_params& params);
 void trace_stop(state* state);
 
+// Memory used by the buffers of a render state, in bytes. The second version
+// estimates the memory of a state for a camera before it is allocated.
+size_t get_state_memory(const state* state);
+size_t get_state_memory(const trc::camera* camera, const trace_params& params);
+
+// [experimental] Size of the image rendered from a camera.
+vec2i get_render_size(const trc::camera* camera, const trace_params& params);
+// [experimental] Part of the frame rendered, as {min.x, min.y, max.x, max.y}.
+// This is the crop clipped to the frame, or the whole frame without a crop.
+vec4i get_render_crop(const trc::camera* camera, const trace_params& params);
+
 }  // namespace yocto::trace
 
 // -----------------------------------------------------------------------------
@@ -298,25 +629,66 @@ void trace_stop(state* state);
 // -----------------------------------------------------------------------------
 namespace yocto::trace {
 
-// BVH tree node containing its bounds, indices to the BVH arrays of either
-// primitives or internal nodes, the node element type,
-// and the split axis. Leaf and internal nodes are identical, except that
-// indices refer to primitives for leaf nodes or other nodes for internal nodes.
-struct bvh_node {
-  bbox3f bbox;
-  int    start;
-  short  num;
-  bool   internal;
-  byte   axis;
+// BVH tree node, shared with Yocto/Shape that builds and refits the nodes.
+using yocto::shape::bvh_node;
+
+// Wide BVH node with up to N children, whose bounds are stored in SoA layout
+// to test all of them at once. Internal children refer to other wide nodes,
+// while leaf children refer to a primitive range. Unused children have
+// invalid bounds and are never hit.
+template <int N>
+struct bvh_wide_node {
+  float min_x[N], min_y[N], min_z[N];
+  float max_x[N], max_y[N], max_z[N];
+  int   start[N];
+  short num[N];
+  bool  internal[N];
+};
+
+// Compressed BVH node of 16 bytes. Internal nodes store the bounds of their
+// two children, quantized to 8 bits relative to the node bounds, while
+// children are stored consecutively. Leaf nodes store the number of
+// primitives in the first byte of the bounds. The data field packs the
+// children or primitive start, the split axis and the internal flag.
+struct bvh_compressed_node {
+  byte     bounds[12] = {};
+  uint32_t data       = 0;
+};
+
+// Triangle of a bvh leaf, stored in primitive order to avoid indexed vertex
+// loads. Holds the first vertex and the two edges from it, or the three
+// vertices for watertight intersection. Quads are stored as two triangles,
+// with degenerate second triangles never hit.
+struct bvh_triangle {
+  vec3f v0 = {0, 0, 0};
+  vec3f v1 = {0, 0, 0};
+  vec3f v2 = {0, 0, 0};
 };
 
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
 // Application data is not stored explicitly.
+// For wide bvh types, the binary tree is also collapsed into wide nodes,
+// that are used for traversal, while the binary nodes are used for refitting.
+// For compressed bvhs, the binary nodes are replaced by compressed ones and
+// the root bounds are stored separately. Compressed bvhs are rebuilt on update.
+// The SAH costs at build time of the tree and of the subtrees reused by
+// partial rebuilds are used to decide how to update the bvh.
+// Shape bvhs may also store their triangles or quads in leaf order.
 struct bvh_tree {
-  std::vector<bvh_node> nodes      = {};
-  std::vector<vec2i>    primitives = {};
+  std::vector<bvh_node>            nodes         = {};
+  std::vector<vec2i>               primitives    = {};
+  std::vector<bvh_wide_node<4>>    nodes4        = {};
+  std::vector<bvh_wide_node<8>>    nodes8        = {};
+  std::vector<bvh_compressed_node> cnodes        = {};
+  bbox3f                           cbbox         = {};
+  float                            cost          = 0;
+  std::vector<int>                 subtrees      = {};
+  std::vector<float>               subtree_costs = {};
+  bvh_update_stats                 stats         = {};
+  std::vector<bvh_triangle>        triangles     = {};
+  bool                             watertight    = false;
 };
 
 // Camera based on a simple lens model. The camera is placed using a frame.
@@ -331,6 +703,8 @@ struct bvh_tree {
 // 2.4:1  on 35 mm:  0.036 x 0.015   or 0.05760 x 0.024 (approx. 2.39 : 1)
 // To compute good apertures, one can use the F-stop number from phostography
 // and set the aperture to focal_leangth/f_stop.
+// The shutter is the fraction of the scene time interval [0, 1] the camera
+// is open for. Zero shutters disable motion blur.
 struct camera {
   frame3f frame        = identity3x4f;
   bool    orthographic = false;
@@ -338,15 +712,76 @@ struct camera {
   vec2f   film         = {0.036, 0.024};
   float   focus        = 10000;
   float   aperture     = 0;
+  float   shutter      = 0;
 };
 
+// Cache of texture tiles, defined in the implementation.
+struct texture_cache;
+
 // Texture containing either an LDR or HDR image. HdR images are encoded
-// in linear color space, while LDRs are encoded as sRGB.
+// in linear color space, while LDRs are encoded as sRGB. HDR images may be
+// stored as halfs and LDR ones block compressed to save memory. Tiled
+// textures are stored on disk instead, and read through a texture cache.
 struct texture {
   img::image<vec3f> colorf  = {};
+  img::image<vec3h> colorh  = {};
   img::image<vec3b> colorb  = {};
   img::image<float> scalarf = {};
+  img::image<half>  scalarh = {};
   img::image<byte>  scalarb = {};
+
+  // mip levels below the base image, built in set_texture
+  std::vector<img::image<vec3f>> colorf_mips  = {};
+  std::vector<img::image<vec3h>> colorh_mips  = {};
+  std::vector<img::image<vec3b>> colorb_mips  = {};
+  std::vector<img::image<float>> scalarf_mips = {};
+  std::vector<img::image<half>>  scalarh_mips = {};
+  std::vector<img::image<byte>>  scalarb_mips = {};
+
+  // block compressed ldr colors or scalars, with their mip levels
+  img::block_image              blocks      = {};
+  std::vector<img::block_image> blocks_mips = {};
+
+  // procedural textures, with their nominal size
+  texture_shader procedural      = {};
+  vec2i          procedural_size = {0, 0};
+
+  // tiled textures, with the size and file offset of each level
+  std::string           tiled          = "";
+  texture_cache*        tiled_cache    = nullptr;
+  uint64_t              tiled_id       = 0;
+  int                   tiled_channels = 0;
+  bool                  tiled_ldr      = false;
+  std::vector<vec2i>    tiled_sizes    = {};
+  std::vector<uint64_t> tiled_offsets  = {};
+
+  // unique version set when the texture changes, 0 if never set
+  uint64_t version = 0;
+};
+
+// Sparse density grid for heterogeneous volumes. Voxels are stored in
+// bricks of volume_brick^3 voxels and empty bricks are not allocated.
+// Each brick keeps the largest density that can be interpolated inside it,
+// used as majorant when tracking through the grid.
+const auto volume_brick = 8;
+struct volume {
+  vec3i              size      = {0, 0, 0};
+  vec3i              bricks    = {0, 0, 0};
+  bbox3f             bounds    = {{-1, -1, -1}, {1, 1, 1}};
+  std::vector<int>   offsets   = {};  // brick voxels offset, or -1 if empty
+  std::vector<float> majorants = {};
+  std::vector<float> voxels    = {};
+
+  // sparse volume files, with the encoded voxels in the file mapping, or
+  // in the buffer when mapping is not supported
+  volume_encoding   encoding    = volume_encoding::floats;
+  const byte*       encoded     = nullptr;
+  const byte*       mapped      = nullptr;
+  size_t            mapped_size = 0;
+  std::vector<byte> buffer      = {};
+
+  // cleanup
+  ~volume();
 };
 
 // Material for surfaces, lines and triangles.
@@ -384,16 +819,25 @@ struct material {
   trc::texture* coat_tex         = nullptr;
   trc::texture* opacity_tex      = nullptr;
   trc::texture* normal_tex       = nullptr;
+
+  // density grid scaling the volume density, if any
+  trc::volume* density_vol = nullptr;
+
+  // lobes with non-zero weight, computed in init_lights (-1 for all)
+  int lobes = -1;
 };
 
 // Shape data represented as an indexed meshes of elements.
-// May contain either points, lines, triangles and quads.
+// May contain either points, lines, cubic beziers, triangles and quads.
+// Beziers index their four control points, and are intersected natively
+// as round curves whose radius is interpolated like the positions.
 // Additionally, we support faceavarying primitives where
 // each verftex data has its own topology.
 struct shape {
   // primitives
   std::vector<int>   points    = {};
   std::vector<vec2i> lines     = {};
+  std::vector<vec4i> beziers   = {};
   std::vector<vec3i> triangles = {};
   std::vector<vec4i> quads     = {};
 
@@ -405,22 +849,49 @@ struct shape {
   std::vector<float> radius    = {};
   std::vector<vec4f> tangents  = {};
 
+  // heightfield, used in place of the elements when not empty; it is laid
+  // out as make_heightfield, with its cells as quad elements and vertex
+  // data, if any, given per pixel
+  img::image<float> heightfield = {};
+
+  // compressed triangle meshes, used in place of the positions, normals,
+  // texcoords and triangles when `cpositions` is not empty; triangles are
+  // kept in `triangles` for shapes that need 32 bit indices
+  bbox3f              cbounds    = {};
+  std::vector<ushort> cpositions = {};  // 3 per vertex
+  std::vector<ushort> cnormals   = {};  // 2 per vertex
+  std::vector<half>   ctexcoords = {};  // 2 per vertex
+  std::vector<ushort> ctriangles = {};  // 3 per triangle
+
   // computed properties
   bvh_tree* bvh = nullptr;
 #ifdef YOCTO_EMBREE
   RTCScene embree_bvh = nullptr;
 #endif
 
-  // element cdf for sampling
-  std::vector<float> elements_cdf = {};
+  // element cdf and alias table for sampling
+  std::vector<float>                 elements_cdf   = {};
+  std::vector<std::pair<float, int>> elements_alias = {};
+
+  // element normals and uv tangents of triangles and quads, precomputed in
+  // init_bvh with `shading_cache`; quads store the tangents of both halves
+  std::vector<vec3f>                   element_normals  = {};
+  std::vector<std::pair<vec3f, vec3f>> element_tangents = {};
+
+  // min and max heights of blocks of heightfield cells, built in init_bvh,
+  // from the finest blocks to a single one
+  std::vector<img::image<vec2f>> heightfield_mips = {};
 
   // cleanup
   ~shape();
 };
 
-// Instances.
+// Instances. Moving instances store additional keyframes in `motion`, each
+// with as many frames as `frames`. Keys are spaced uniformly over the time
+// interval [0, 1], with `frames` at time 0 and the last key at time 1.
 struct instance {
-  std::vector<frame3f> frames = {};
+  std::vector<frame3f>              frames = {};
+  std::vector<std::vector<frame3f>> motion = {};
 };
 
 // Object.
@@ -433,19 +904,49 @@ struct object {
 
 // Environment map.
 struct environment {
-  frame3f            frame        = identity3x4f;
-  vec3f              emission     = {0, 0, 0};
-  trc::texture*      emission_tex = nullptr;
-  std::vector<float> texels_cdf   = {};
+  frame3f                            frame          = identity3x4f;
+  vec3f                              emission       = {0, 0, 0};
+  trc::texture*                      emission_tex   = nullptr;
+  std::vector<float>                 texels_cdf     = {};
+  std::vector<std::pair<float, int>> texels_alias   = {};
+  uint64_t                           texels_version = 0;  // texture version
 };
 
 // Trace lights used during rendering. These are created automatically.
 struct light {
   trc::object*      object      = nullptr;
   int               instance    = -1;
+  int               layout      = -1;  // index in the scene layout
   trc::environment* environment = nullptr;
 };
 
+// Light tree node, used to sample object lights proportionally to their
+// estimated contribution. Nodes store the bounds and power of their lights.
+// Internal nodes refer to their two children, stored consecutively, while
+// leaf nodes refer to a single light.
+struct light_node {
+  bbox3f bbox     = {};
+  float  power    = 0;
+  int    start    = 0;
+  bool   internal = false;
+};
+
+// Flattened scene layout, compiled from the objects before rendering.
+// Object instances are stored contiguously, ordered by object and instance,
+// with the instances of an object starting at its offset. For each, we keep
+// the transform at time zero, its inverse, and the shape and material
+// indices, so that traversal and shading avoid chasing object pointers.
+// Moving instances are flagged and evaluated from their objects.
+struct scene_layout {
+  std::vector<int>     offsets    = {};
+  std::vector<vec2i>   instances  = {};
+  std::vector<frame3f> frames     = {};
+  std::vector<frame3f> inv_frames = {};
+  std::vector<int>     shapes     = {};
+  std::vector<int>     materials  = {};
+  std::vector<bool>    moving     = {};
+};
+
 // Scene comprised an array of objects whose memory is owened by the scene.
 // All members are optional,Scene objects (camera, instances, environments)
 // have transforms defined internally. A scene can optionally contain a
@@ -460,34 +961,91 @@ struct scene {
   std::vector<trc::material*>    materials    = {};
   std::vector<trc::instance*>    instances    = {};
   std::vector<trc::texture*>     textures     = {};
+  std::vector<trc::volume*>      volumes      = {};
   std::vector<trc::environment*> environments = {};
 
   // computed properties
-  std::vector<trc::light*> lights = {};
-  bvh_tree*                bvh    = nullptr;
+  std::vector<trc::light*> lights             = {};
+  std::vector<light_node>  light_nodes        = {};
+  std::vector<trc::light*> environment_lights = {};
+  trc::scene_layout        layout             = {};
+  bvh_tree*                bvh                = nullptr;
+  trc::texture_cache*      texture_cache      = nullptr;
 #ifdef YOCTO_EMBREE
   RTCScene           embree_bvh       = nullptr;
   std::vector<vec2i> embree_instances = {};
 #endif
 
+  // instances skipped by init_bvh, and emitters skipped by init_lights,
+  // by object and instance, as marked by prune_scene()
+  std::vector<std::vector<bool>> pruned_instances = {};
+  std::vector<std::vector<bool>> pruned_lights    = {};
+
+  // storage of the elements, freed at once with the scene
+  common::arena<trc::camera>      camera_arena      = {};
+  common::arena<trc::object>      object_arena      = {};
+  common::arena<trc::shape>       shape_arena       = {};
+  common::arena<trc::material>    material_arena    = {};
+  common::arena<trc::instance>    instance_arena    = {};
+  common::arena<trc::texture>     texture_arena     = {};
+  common::arena<trc::volume>      volume_arena      = {};
+  common::arena<trc::environment> environment_arena = {};
+  common::arena<trc::light>       light_arena       = {};
+
   // cleanup
   ~scene();
 };
 
 // State of a pixel during tracing
+// The sum of squared sample luminances is used to estimate pixel variance.
 struct pixel {
-  vec3f     radiance = {0, 0, 0};
-  int       hits     = 0;
-  int       samples  = 0;
-  rng_state rng      = {};
+  vec3f radiance   = {0, 0, 0};
+  float luminance2 = 0;
+  int   hits       = 0;
+  int   samples    = 0;
+};
+
+// State of a pixel stored in half-floats, used to reduce memory at large
+// resolutions. Radiance and squared luminance are stored as per-sample means.
+struct pixel_half {
+  vec3h radiance   = {};
+  half  luminance2 = {};
+  int   hits       = 0;
+  int   samples    = 0;
 };
 
 // [experimental] Asynchronous state
+// Pixels are stored in either `pixels` or `hpixels`, depending on
+// `halfbuffer`. Per-pixel rngs are not stored when using `compactrng`, since
+// random numbers are then hashed from the pixel index, sample number and
+// dimension. When denoising, `albedo` and `normal` hold per-pixel feature
+// sums, with the sample count in the last channel. Similarly, `aovs` holds
+// the sums of the false colors in `params.aovs`, with the hit count in the
+// last channel. The guided sampler learns its guiding field in `guiding`.
+// Buffers hold the pixels in `crop` of a render of size `frame`.
+struct guiding_field;
 struct state {
-  img::image<vec4f> render = {};
-  img::image<pixel> pixels = {};
-  std::future<void> worker = {};  // async
-  std::atomic<bool> stop   = {};  // async
+  img::image<vec4f>              render  = {};
+  img::image<pixel>              pixels  = {};
+  img::image<pixel_half>         hpixels = {};
+  img::image<rng_state>          rngs    = {};
+  img::image<vec4f>              albedo  = {};
+  img::image<vec4f>              normal  = {};
+  std::vector<img::image<vec4f>> aovs    = {};
+  std::future<void>              worker  = {};  // async
+  std::atomic<bool>              stop    = {};  // async
+  int                            pratio  = 0;   // async, adapted preview ratio
+  std::shared_ptr<guiding_field> guiding = {};  // guided sampler
+  vec2i                          frame   = {0, 0};
+  vec4i                          crop    = {0, 0, 0, 0};
+  trc::camera                    camera  = {};  // camera of the samples
+
+  // async render threads, with the number of active ones and the time of
+  // the last frame reported by the caller
+  std::shared_ptr<common::thread_pool> pool        = {};
+  bool                                 lowpriority = false;
+  std::atomic<int>                     active      = 0;
+  std::atomic<int64_t>                 frame_time  = 0;
 };
 
 }  // namespace yocto::trace
@@ -512,10 +1070,60 @@ struct intersection3f {
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
+// Moving instances are placed at `time`.
 intersection3f intersect_scene_bvh(const trc::scene* scene, const ray3f& ray,
-    bool find_any = false, bool non_rigid_frames = true);
+    bool find_any = false, bool non_rigid_frames = true, float time = 0);
 intersection3f intersect_instance_bvh(const trc::object* object, int instance,
-    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
+    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true,
+    float time = 0);
+// Instance intersection using the inverse transforms cached in the scene
+// layout, instead of inverting the instance frame on each call.
+intersection3f intersect_instance_bvh(const trc::scene* scene, int object,
+    int instance, const ray3f& ray, bool find_any = false,
+    bool non_rigid_frames = true, float time = 0);
+
+// Check whether a ray hits any surface in the scene, stopping at the first
+// intersection found. Use this for shadow rays, limiting the ray to the
+// segment between the two points being connected.
+bool is_scene_occluded(const trc::scene* scene, const ray3f& ray,
+    bool non_rigid_frames = true, float time = 0);
+
+// Intersect a buffer of rays with the scene bvh. With the built-in bvh,
+// rays are traced in packets of consecutive rays, while Embree traces them
+// as a coherent stream. So coherent rays, like camera rays of a tile,
+// should be stored next to each other. If `times` is not empty, it holds
+// the time of each ray, and rays are traced one at a time.
+std::vector<intersection3f> intersect_scene_bvh(const trc::scene* scene,
+    const std::vector<ray3f>& rays, bool find_any = false,
+    bool non_rigid_frames = true, const std::vector<float>& times = {});
+
+}  // namespace yocto::trace
+
+// -----------------------------------------------------------------------------
+// STATISTICS
+// -----------------------------------------------------------------------------
+namespace yocto::trace {
+
+// Counts and timings of the work done by the renderer, summed over threads.
+// They are collected only when the library is built with YOCTO_STATS, since
+// counting in the traversal loops has a cost, and are zero otherwise.
+// Thread times add the time spent by all threads.
+struct trace_stats {
+  uint64_t rays           = 0;  // rays intersected with the scene
+  uint64_t nodes          = 0;  // bvh nodes visited
+  uint64_t primitives     = 0;  // shape primitives tested
+  uint64_t light_samples  = 0;  // lights sampled
+  uint64_t samples        = 0;  // pixel samples traced
+  double   bvh_time       = 0;  // seconds building bvhs
+  double   lights_time    = 0;  // seconds initializing lights
+  double   sample_time    = 0;  // thread seconds tracing pixel samples
+  double   intersect_time = 0;  // thread seconds intersecting rays
+  uint64_t cache_failures = 0;  // bvh cache writes failed, in all builds
+};
+
+// Get the statistics collected so far, or reset them when not rendering.
+trace_stats get_trace_stats();
+void        reset_trace_stats();
 
 }  // namespace yocto::trace
 
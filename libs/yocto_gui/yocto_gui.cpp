@@ -30,7 +30,9 @@
 #include "yocto_gui.h"
 
 #include <algorithm>
+#include <array>
 #include <cstdarg>
+#include <cstring>
 #include <deque>
 #include <mutex>
 #include <string>
@@ -203,7 +205,7 @@ void set_texture(gui::texture* texture, const vec2i& size, int nchannels,
       {1, GL_RGB16F},
       {2, GL_RGB16F},
       {3, GL_RGB16F},
-      {4, GL_RGBA32F},
+      {4, GL_RGBA16F},
   };
   static auto iformat = std::unordered_map<int, uint>{
       {1, GL_RGB},
@@ -411,6 +413,47 @@ void set_elementbuffer(gui::elementbuffer* buffer,
       (int*)triangles.data(), dynamic);
 }
 
+// set buffer
+void set_uniformbuffer(
+    gui::uniformbuffer* buffer, size_t size, const void* data) {
+  assert_error();
+  if (size == 0 || data == nullptr) {
+    clear_uniformbuffer(buffer);
+    return;
+  }
+  if (!buffer->buffer_id) glGenBuffers(1, &buffer->buffer_id);
+  glBindBuffer(GL_UNIFORM_BUFFER, buffer->buffer_id);
+  if (buffer->size != size) {
+    glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+  } else {
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  buffer->size = size;
+  assert_error();
+}
+
+// check if buffer is initialized
+bool is_initialized(gui::uniformbuffer* buffer) {
+  return buffer->buffer_id != 0;
+}
+
+// clear buffer
+void clear_uniformbuffer(gui::uniformbuffer* buffer) {
+  assert_error();
+  if (buffer->buffer_id) glDeleteBuffers(1, &buffer->buffer_id);
+  assert_error();
+  buffer->buffer_id = 0;
+  buffer->size      = 0;
+}
+
+// bind buffer to a uniform block binding point
+void bind_uniformbuffer(gui::uniformbuffer* buffer, int binding) {
+  assert_error();
+  glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer->buffer_id);
+  assert_error();
+}
+
 // initialize program
 bool init_program(gui::program* program, const std::string& vertex,
     const std::string& fragment, std::string& error, std::string& errorlog) {
@@ -602,8 +645,71 @@ auto glimage_fragment =
 in vec2 frag_texcoord;
 out vec4 frag_color;
 uniform sampler2D txt;
+uniform bool tonemap;
+uniform float exposure;
+uniform bool filmic;
+uniform bool srgb;
+uniform bool colorgrade;
+uniform vec3 tint;
+uniform float lincontrast, logcontrast, linsaturation;
+uniform float contrast, saturation;
+uniform bool lift_gamma_gain;
+uniform vec3 lift, gamma, gain;
+vec3 tonemap_filmic(vec3 rgb) {
+    // same fit as yocto image tonemap_filmic()
+    vec3 aces = rgb * 0.6;
+    return max((aces * aces * 2.51 + aces * 0.03) /
+               (aces * aces * 2.43 + aces * 0.59 + 0.14), 0.0);
+}
+vec3 rgb_to_srgb(vec3 rgb) {
+    return mix(1.055 * pow(max(rgb, 0.0), vec3(1 / 2.4)) - 0.055, 12.92 * rgb,
+               lessThanEqual(rgb, vec3(0.0031308)));
+}
+vec3 bias(vec3 a, float b) {
+    return a / ((1 / b - 2) * (1 - a) + 1);
+}
+vec3 scontrast(vec3 rgb, float contrast) {
+    float g = 1 - contrast;
+    return mix(bias(rgb * 2, g) / 2, bias(rgb * 2 - 1, 1 - g) / 2 + 0.5,
+               greaterThanEqual(rgb, vec3(0.5)));
+}
+vec3 saturate(vec3 rgb, float saturation) {
+    float grey = (rgb.x + rgb.y + rgb.z) / 3;
+    return max(vec3(0), grey + (rgb - grey) * (saturation * 2));
+}
+vec3 apply_colorgrade(vec3 rgb) {
+    // same steps as yocto image colorgrade() for linear images
+    rgb *= exp2(exposure) * tint;
+    if (lincontrast != 0.5)
+        rgb = max(vec3(0), 0.18 + (rgb - 0.18) * (lincontrast * 2));
+    if (logcontrast != 0.5) {
+        vec3 log_ldr = log2(rgb + 0.0001);
+        float log_grey = log2(0.18);
+        rgb = max(vec3(0), exp2(log_grey + (log_ldr - log_grey) *
+                                           (logcontrast * 2)) - 0.0001);
+    }
+    if (linsaturation != 0.5) rgb = saturate(rgb, linsaturation);
+    if (filmic) rgb = tonemap_filmic(rgb);
+    if (srgb) rgb = rgb_to_srgb(rgb);
+    if (contrast != 0.5) rgb = scontrast(rgb, contrast);
+    if (saturation != 0.5) rgb = saturate(rgb, saturation);
+    if (lift_gamma_gain) {
+        vec3 lerp_value = clamp(pow(rgb, 1 / gamma), 0, 1);
+        rgb = gain * lerp_value + lift * (1 - lerp_value);
+    }
+    return rgb;
+}
 void main() {
-    frag_color = texture(txt, frag_texcoord);
+    vec4 color = texture(txt, frag_texcoord);
+    if (colorgrade) {
+        color.xyz = apply_colorgrade(color.xyz);
+    } else if (tonemap) {
+        vec3 rgb = color.xyz * exp2(exposure);
+        if (filmic) rgb = tonemap_filmic(rgb);
+        if (srgb) rgb = rgb_to_srgb(rgb);
+        color.xyz = rgb;
+    }
+    frag_color = color;
 }
 )";
 #if 0
@@ -659,17 +765,113 @@ void clear_image(gui::image* image) {
   clear_texture(image->texture);
   clear_arraybuffer(image->texcoords);
   clear_elementbuffer(image->triangles);
+  if (image->pixelbuffer_id) glDeleteBuffers(1, &image->pixelbuffer_id);
+  image->pixelbuffer_id = 0;
 }
 
 // update image data
-void set_image(
-    gui::image* image, const img::image<vec4f>& img, bool linear, bool mipmap) {
-  set_texture(image->texture, img, false, linear, mipmap);
+void set_image(gui::image* image, const img::image<vec4f>& img, bool linear,
+    bool mipmap, bool as_float) {
+  set_texture(image->texture, img, as_float, linear, mipmap);
 }
 void set_image(
     gui::image* image, const img::image<vec4b>& img, bool linear, bool mipmap) {
   set_texture(image->texture, img, false, linear, mipmap);
 }
+void set_image_region(gui::image* image, const img::image<vec4f>& img,
+    const vec4i& region, bool linear, bool mipmap, bool as_float) {
+  set_image_regions(image, img, {region}, linear, mipmap, as_float);
+}
+void set_image_regions(gui::image* image, const img::image<vec4f>& img,
+    const std::vector<vec4i>& regions, bool linear, bool mipmap,
+    bool as_float) {
+  auto texture = image->texture;
+  if (!texture->texture_id || texture->size != img.size() ||
+      texture->nchannels != 4 || texture->is_float != as_float ||
+      texture->is_srgb || texture->linear != linear ||
+      texture->mipmap != mipmap) {
+    return set_image(image, img, linear, mipmap, as_float);
+  }
+  auto count = (size_t)0;
+  for (auto& region : regions) {
+    if (region.z <= region.x || region.w <= region.y) continue;
+    count += (size_t)(region.z - region.x) * (size_t)(region.w - region.y);
+  }
+  if (count == 0) return;
+  assert_error();
+
+  // pack the regions in a freshly orphaned pixel buffer, so that mapping does
+  // not wait for the previous transfers, then copy them to the texture
+  if (!image->pixelbuffer_id) glGenBuffers(1, &image->pixelbuffer_id);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, image->pixelbuffer_id);
+  glBufferData(
+      GL_PIXEL_UNPACK_BUFFER, count * sizeof(vec4f), nullptr, GL_STREAM_DRAW);
+  auto mapped = (vec4f*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+      count * sizeof(vec4f), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  auto offset = (size_t)0;
+  for (auto& region : regions) {
+    if (region.z <= region.x || region.w <= region.y) continue;
+    auto width = (size_t)(region.z - region.x);
+    for (auto j = region.y; j < region.w; j++) {
+      memcpy(mapped + offset, &img[{region.x, j}], width * sizeof(vec4f));
+      offset += width;
+    }
+  }
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+  offset = 0;
+  for (auto& region : regions) {
+    if (region.z <= region.x || region.w <= region.y) continue;
+    auto size = vec2i{region.z - region.x, region.w - region.y};
+    glTexSubImage2D(GL_TEXTURE_2D, 0, region.x, region.y, size.x, size.y,
+        GL_RGBA, GL_FLOAT, (void*)(offset * sizeof(vec4f)));
+    offset += (size_t)size.x * (size_t)size.y;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (mipmap) glGenerateMipmap(GL_TEXTURE_2D);
+  assert_error();
+}
+
+// set the tonemap and colorgrade uniforms used when drawing images
+static void set_display_uniforms(
+    gui::program* program, const image_params& params) {
+  set_uniform(program, "tonemap", (int)params.tonemap);
+  set_uniform(program, "colorgrade", (int)params.colorgrade);
+  if (params.colorgrade) {
+    auto& grading = params.grading;
+    set_uniform(program, "exposure", grading.exposure);
+    set_uniform(program, "filmic", (int)grading.filmic);
+    set_uniform(program, "srgb", (int)grading.srgb);
+    set_uniform(program, "tint", grading.tint);
+    set_uniform(program, "lincontrast", grading.lincontrast);
+    set_uniform(program, "logcontrast", grading.logcontrast);
+    set_uniform(program, "linsaturation", grading.linsaturation);
+    set_uniform(program, "contrast", grading.contrast);
+    set_uniform(program, "saturation", grading.saturation);
+    // lift, gamma and gain are computed here as in colorgrade()
+    auto lift_gamma_gain = grading.shadows != 0.5f ||
+                           grading.midtones != 0.5f ||
+                           grading.highlights != 0.5f ||
+                           grading.shadows_color != vec3f{1, 1, 1} ||
+                           grading.midtones_color != vec3f{1, 1, 1} ||
+                           grading.highlights_color != vec3f{1, 1, 1};
+    auto lift  = grading.shadows_color - mean(grading.shadows_color) +
+                grading.shadows - 0.5f;
+    auto gain  = grading.highlights_color - mean(grading.highlights_color) +
+                grading.highlights + 0.5f;
+    auto grey  = grading.midtones_color - mean(grading.midtones_color) +
+                grading.midtones;
+    auto gamma = log((0.5f - lift) / (gain - lift)) / log(grey);
+    set_uniform(program, "lift_gamma_gain", (int)lift_gamma_gain);
+    set_uniform(program, "lift", lift);
+    set_uniform(program, "gamma", gamma);
+    set_uniform(program, "gain", gain);
+  } else {
+    set_uniform(program, "exposure", params.exposure);
+    set_uniform(program, "filmic", (int)params.filmic);
+    set_uniform(program, "srgb", (int)params.srgb);
+  }
+}
 
 // draw image
 void draw_image(gui::image* image, const image_params& params) {
@@ -686,12 +888,139 @@ void draw_image(gui::image* image, const image_params& params) {
   set_uniform(image->program, "image_size", (vec2f)image->texture->size);
   set_uniform(image->program, "image_center", params.center);
   set_uniform(image->program, "image_scale", params.scale);
+  set_display_uniforms(image->program, params);
   set_attribute(image->program, "texcoord", image->texcoords);
   draw_elements(image->triangles);
   unbind_program(image->program);
   assert_error();
 }
 
+tiled_image::~tiled_image() {
+  for (auto& [key, tile] : tiles) delete tile.first;
+  if (image) delete image;
+}
+
+// pyramid layout, with levels rounded up to cover the whole image
+int get_tiled_levels(const vec2i& size, int tile_size) {
+  auto levels = 1;
+  while (max(get_tiled_size(size, levels - 1)) > tile_size) levels++;
+  return levels;
+}
+vec2i get_tiled_size(const vec2i& size, int level) {
+  auto round = (1 << level) - 1;
+  return {max(1, (size.x + round) >> level), max(1, (size.y + round) >> level)};
+}
+
+// init tiled image
+bool init_tiled_image(gui::tiled_image* image, const vec2i& size,
+    int tile_size,
+    const std::function<void(
+        int level, const vec2i& tile, img::image<vec4f>& pixels)>& loader) {
+  clear_tiled_image(image);
+  if (!init_image(image->image)) return false;
+  image->size      = size;
+  image->tile_size = tile_size;
+  image->levels    = get_tiled_levels(size, tile_size);
+  image->loader    = loader;
+  return true;
+}
+bool is_initialized(const gui::tiled_image* image) {
+  return is_initialized(image->image);
+}
+
+// clear tiled image
+void clear_tiled_image(gui::tiled_image* image) {
+  for (auto& [key, tile] : image->tiles) {
+    clear_texture(tile.first);
+    delete tile.first;
+  }
+  image->tiles.clear();
+  clear_image(image->image);
+}
+
+// draw tiled image
+void draw_tiled_image(gui::tiled_image* image, const image_params& params) {
+  assert_error();
+  image->frame += 1;
+  glViewport(params.framebuffer.x, params.framebuffer.y, params.framebuffer.z,
+      params.framebuffer.w);
+  glClearColor(params.background.x, params.background.y, params.background.z,
+      params.background.w);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  // finer levels are drawn over coarser ones
+  glDisable(GL_DEPTH_TEST);
+  auto program = image->image->program;
+  bind_program(program);
+  set_uniform(program, "window_size", (vec2f)params.window);
+  set_uniform(program, "image_scale", params.scale);
+  set_display_uniforms(program, params);
+  set_attribute(program, "texcoord", image->image->texcoords);
+
+  // visible region in image pixels and finest level needed at this zoom
+  auto size   = (vec2f)image->size;
+  auto pmin   = -params.center / params.scale + size / 2;
+  auto pmax   = ((vec2f)params.window - params.center) / params.scale +
+              size / 2;
+  auto target = clamp(
+      (int)floor(log2(1 / params.scale)), 0, image->levels - 1);
+
+  // draw from coarse to fine, loading only the tiles of the target level
+  // and the coarsest one, that is always shown while the others load
+  auto loads = 0;
+  for (auto level = image->levels - 1; level >= target; level--) {
+    auto tsize  = (float)(image->tile_size << level);
+    auto ntiles = (get_tiled_size(image->size, level) + image->tile_size - 1) /
+                  image->tile_size;
+    auto tmin   = max(vec2i{(int)floor(pmin.x / tsize),
+                        (int)floor(pmin.y / tsize)},
+        vec2i{0, 0});
+    auto tmax   = min(vec2i{(int)floor(pmax.x / tsize),
+                        (int)floor(pmax.y / tsize)},
+        ntiles - 1);
+    for (auto j = tmin.y; j <= tmax.y; j++) {
+      for (auto i = tmin.x; i <= tmax.x; i++) {
+        auto key = ((uint64_t)level << 48) | ((uint64_t)j << 24) | (uint64_t)i;
+        auto it  = image->tiles.find(key);
+        if (it == image->tiles.end()) {
+          auto coarsest = level == image->levels - 1;
+          if (level != target && !coarsest) continue;
+          if (loads >= image->max_loads && !coarsest) continue;
+          auto pixels = img::image<vec4f>{};
+          image->loader(level, {i, j}, pixels);
+          loads += 1;
+          if (pixels.empty()) continue;
+          auto texture = new gui::texture{};
+          set_texture(texture, pixels, true, false, false);
+          it = image->tiles.insert({key, {texture, 0}}).first;
+        }
+        it->second.second = image->frame;
+        auto texture      = it->second.first;
+        auto extent       = (vec2f)texture->size * (float)(1 << level);
+        auto origin       = vec2f{i * tsize, j * tsize};
+        set_uniform(program, "txt", texture, 0);
+        set_uniform(program, "image_size", extent);
+        set_uniform(program, "image_center",
+            params.center + (origin + extent / 2 - size / 2) * params.scale);
+        draw_elements(image->image->triangles);
+      }
+    }
+  }
+  unbind_program(program);
+
+  // evict the least recently used tiles, keeping the ones drawn now
+  while ((int)image->tiles.size() > image->max_tiles) {
+    auto lru = image->tiles.begin();
+    for (auto it = image->tiles.begin(); it != image->tiles.end(); ++it) {
+      if (it->second.second < lru->second.second) lru = it;
+    }
+    if (lru->second.second == image->frame) break;
+    clear_texture(lru->second.first);
+    delete lru->second.first;
+    image->tiles.erase(lru);
+  }
+  assert_error();
+}
+
 // set uniforms
 void set_uniform(gui::program* program, int location, int value) {
   assert_error();
@@ -776,6 +1105,15 @@ int get_uniform_location(gui::program* program, const char* name) {
   return glGetUniformLocation(program->program_id, name);
 }
 
+// assign a uniform block to a binding point
+void set_uniform_block(gui::program* program, const char* name, int binding) {
+  assert_error();
+  auto index = glGetUniformBlockIndex(program->program_id, name);
+  if (index != GL_INVALID_INDEX)
+    glUniformBlockBinding(program->program_id, index, binding);
+  assert_error();
+}
+
 // set uniform texture
 void set_uniform(gui::program* program, int location,
     const gui::texture* texture, int unit) {
@@ -842,6 +1180,30 @@ void set_attribute(gui::program* program, int location, const vec4f& value) {
   glVertexAttrib4f(location, value.x, value.y, value.z, value.w);
 }
 
+// set instance frame attributes
+void set_instance_attribute(
+    gui::program* program, int location, gui::arraybuffer* buffer) {
+  assert_error();
+  glBindBuffer(GL_ARRAY_BUFFER, buffer->buffer_id);
+  for (auto axis = 0; axis < 4; axis++) {
+    glEnableVertexAttribArray(location + axis);
+    glVertexAttribPointer(location + axis, 3, GL_FLOAT, false,
+        sizeof(frame3f), (void*)(axis * sizeof(vec3f)));
+    glVertexAttribDivisor(location + axis, 1);
+  }
+  assert_error();
+}
+void set_instance_attribute(
+    gui::program* program, int location, const frame3f& value) {
+  assert_error();
+  for (auto axis = 0; axis < 4; axis++) {
+    glDisableVertexAttribArray(location + axis);
+    glVertexAttrib3f(location + axis, value[axis].x, value[axis].y,
+        value[axis].z);
+  }
+  assert_error();
+}
+
 // draw elements
 void draw_elements(gui::elementbuffer* buffer) {
   static auto elements = std::unordered_map<element_type, uint>{
@@ -853,6 +1215,16 @@ void draw_elements(gui::elementbuffer* buffer) {
   glDrawElements(
       elements.at(buffer->element), buffer->size, GL_UNSIGNED_INT, nullptr);
 }
+void draw_elements(gui::elementbuffer* buffer, int instances) {
+  static auto elements = std::unordered_map<element_type, uint>{
+      {element_type::points, GL_POINTS},
+      {element_type::lines, GL_LINES},
+      {element_type::triangles, GL_TRIANGLES},
+  };
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->buffer_id);
+  glDrawElementsInstanced(elements.at(buffer->element), buffer->size,
+      GL_UNSIGNED_INT, nullptr, instances);
+}
 
 }  // namespace yocto::gui
 
@@ -875,9 +1247,13 @@ layout(location = 1) in vec3 normals;             // vertex normal (in mesh coor
 layout(location = 2) in vec2 texcoords;           // vertex texcoords
 layout(location = 3) in vec4 colors;              // vertex color
 layout(location = 4) in vec4 tangents;            // vertex tangent space
+layout(location = 5) in vec3 instance_x;          // instance frame x axis
+layout(location = 6) in vec3 instance_y;          // instance frame y axis
+layout(location = 7) in vec3 instance_z;          // instance frame z axis
+layout(location = 8) in vec3 instance_o;          // instance frame origin
 
 uniform mat4 frame;             // shape transform
-uniform mat4 frameit;           // shape transform
+uniform bool non_rigid_frames;  // whether frames may scale non-uniformly
 uniform float offset;           // shape normal offset
 
 uniform mat4 view;              // inverse of the camera frame (as a matrix)
@@ -888,9 +1264,16 @@ out vec3 normal;                // [to fragment shader] vertex normal (in world
 out vec2 texcoord;              // [to fragment shader] vertex texture coordinates
 out vec4 color;                 // [to fragment shader] vertex color
 out vec4 tangsp;                // [to fragment shader] vertex tangent space
+flat out mat4 shape_frame;      // [to fragment shader] shape and instance transform
 
 // main function
 void main() {
+  // shape and instance transforms
+  shape_frame = frame * mat4(vec4(instance_x,0), vec4(instance_y,0),
+                             vec4(instance_z,0), vec4(instance_o,1));
+  mat3 shape_frameit = mat3(shape_frame);
+  if(non_rigid_frames) shape_frameit = transpose(inverse(shape_frameit));
+
   // copy values
   position = positions;
   normal = normals;
@@ -904,9 +1287,9 @@ void main() {
   }
 
   // world projection
-  position = (frame * vec4(position,1)).xyz;
-  normal = (frameit * vec4(normal,0)).xyz;
-  tangsp.xyz = (frame * vec4(tangsp.xyz,0)).xyz;
+  position = (shape_frame * vec4(position,1)).xyz;
+  normal = shape_frameit * normal;
+  tangsp.xyz = (shape_frame * vec4(tangsp.xyz,0)).xyz;
 
   // clip
   gl_Position = projection * view * vec4(position,1);
@@ -982,11 +1365,13 @@ uniform bool faceted;
 uniform vec4 highlight;           // highlighted color
 
 uniform int mtype;                // material type
-uniform vec3 emission;            // material ke
-uniform vec3 diffuse;             // material kd
-uniform vec3 specular;            // material ks
-uniform float roughness;          // material rs
-uniform float opacity;            // material op
+layout(std140) uniform material_block {
+  vec3 emission;                  // material ke
+  vec3 diffuse;                   // material kd
+  vec3 specular;                  // material ks
+  float roughness;                // material rs
+  float opacity;                  // material op
+};
 
 uniform bool emission_tex_on;     // material ke texture on
 uniform sampler2D emission_tex;   // material ke texture
@@ -1004,8 +1389,7 @@ uniform sampler2D mat_norm_tex;   // material normal texture
 
 uniform bool double_sided;        // double sided rendering
 
-uniform mat4 frame;              // shape transform
-uniform mat4 frameit;            // shape transform
+flat in mat4 shape_frame;        // [from vertex shader] shape transform
 
 bool evaluate_material(vec2 texcoord, vec4 color, out vec3 ke, 
                     out vec3 kd, out vec3 ks, out float rs, out float op) {
@@ -1044,7 +1428,7 @@ bool evaluate_material(vec2 texcoord, vec4 color, out vec3 ke,
 
 vec3 apply_normal_map(vec2 texcoord, vec3 normal, vec4 tangsp) {
     if(!mat_norm_tex_on) return normal;
-  vec3 tangu = normalize((frame * vec4(normalize(tangsp.xyz),0)).xyz);
+  vec3 tangu = normalize((shape_frame * vec4(normalize(tangsp.xyz),0)).xyz);
   vec3 tangv = normalize(cross(normal, tangu));
   if(tangsp.w < 0) tangv = -tangv;
   vec3 texture = 2 * pow(texture(mat_norm_tex,texcoord).xyz, vec3(1/2.2)) - 1;
@@ -1070,7 +1454,7 @@ out vec4 frag_color;
 vec3 triangle_normal(vec3 position) {
   vec3 fdx = dFdx(position); 
   vec3 fdy = dFdy(position); 
-  return normalize((frame * vec4(normalize(cross(fdx, fdy)), 0)).xyz);
+  return normalize((shape_frame * vec4(normalize(cross(fdx, fdy)), 0)).xyz);
 }
 
 // main
@@ -1147,28 +1531,63 @@ void main() {
 // forward declaration
 void clear_shape(gui::shape* shape);
 
-shape::~shape() {
-  clear_shape(this);
-  if (positions) delete positions;
-  if (normals) delete normals;
-  if (texcoords) delete texcoords;
-  if (colors) delete colors;
-  if (tangents) delete tangents;
-  if (points) delete points;
-  if (lines) delete lines;
-  if (triangles) delete triangles;
-  if (quads) delete quads;
-  if (edges) delete edges;
+shape::~shape() { clear_shape(this); }
+
+instance::~instance() {
+  clear_arraybuffer(buffer);
+  if (buffer) delete buffer;
+}
+
+material::~material() {
+  clear_uniformbuffer(buffer);
+  if (buffer) delete buffer;
+}
+
+object::~object() {
+  clear_arraybuffer(visible);
+  if (visible) delete visible;
 }
 
 scene::~scene() {
   clear_scene(this);
-  for (auto camera : cameras) delete camera;
-  for (auto shape : shapes) delete shape;
-  for (auto material : materials) delete material;
-  for (auto instance : instances) delete instance;
-  for (auto texture : textures) delete texture;
-  for (auto light : lights) delete light;
+  if (program) delete program;
+  if (edges_material) delete edges_material;
+  if (hits_program) delete hits_program;
+  if (packed_positions) delete packed_positions;
+  if (packed_normals) delete packed_normals;
+  if (packed_texcoords) delete packed_texcoords;
+  if (packed_colors) delete packed_colors;
+  if (packed_tangents) delete packed_tangents;
+  if (packed_elements) delete packed_elements;
+}
+
+// Uniforms of the scene program, whose locations are cached at init
+enum struct scene_uniform {
+  // clang-format off
+  frame, non_rigid_frames, offset, eye, view, projection, eyelight, exposure,
+  gamma, lamb, lnum, highlight, mtype, etype, faceted, double_sided,
+  emission_tex, emission_tex_on, diffuse_tex, diffuse_tex_on, specular_tex,
+  specular_tex_on, roughness_tex, roughness_tex_on, opacity_tex,
+  opacity_tex_on, mat_norm_tex, mat_norm_tex_on, lights
+  // clang-format on
+};
+static const auto scene_uniform_names = std::vector<std::string>{"frame",
+    "non_rigid_frames", "offset", "eye", "view", "projection", "eyelight",
+    "exposure", "gamma", "lamb", "lnum", "highlight", "mtype", "etype",
+    "faceted", "double_sided", "emission_tex", "emission_tex_on",
+    "diffuse_tex", "diffuse_tex_on", "specular_tex", "specular_tex_on",
+    "roughness_tex", "roughness_tex_on", "opacity_tex", "opacity_tex_on",
+    "mat_norm_tex", "mat_norm_tex_on"};
+static const auto scene_max_lights   = 16;
+static const auto material_binding   = 0;
+static const auto material_blocksize = 16;
+
+// Cached uniform locations
+static int get_location(gui::scene* scene, scene_uniform uniform) {
+  return scene->uniforms[(int)uniform];
+}
+static int get_light_location(gui::scene* scene, int light, int param) {
+  return scene->uniforms[(int)scene_uniform::lights + light * 3 + param];
 }
 
 // Initialize an OpenGL scene
@@ -1177,6 +1596,23 @@ void init_scene(gui::scene* scene) {
   auto error = ""s, errorlog = ""s;
   init_program(
       scene->program, glscene_vertex, glscene_fragment, error, errorlog);
+  scene->uniforms.clear();
+  for (auto& name : scene_uniform_names)
+    scene->uniforms.push_back(
+        get_uniform_location(scene->program, name.c_str()));
+  for (auto light = 0; light < scene_max_lights; light++) {
+    for (auto name : {"lpos", "lke", "ltype"}) {
+      auto lname = name + ("["s + std::to_string(light) + "]");
+      scene->uniforms.push_back(
+          get_uniform_location(scene->program, lname.c_str()));
+    }
+  }
+  set_uniform_block(scene->program, "material_block", material_binding);
+  auto edges_block = std::array<float, material_blocksize>{};
+  edges_block[11]  = 1;  // roughness
+  edges_block[12]  = 1;  // opacity
+  set_uniformbuffer(
+      scene->edges_material, sizeof(edges_block), edges_block.data());
 }
 bool is_initialized(gui::scene* scene) {
   return is_initialized(scene->program);
@@ -1199,13 +1635,84 @@ void clear_shape(gui::shape* shape) {
 // Clear an OpenGL scene
 void clear_scene(gui::scene* scene) {
   for (auto texture : scene->textures) clear_texture(texture);
-  for (auto shape : scene->shapes) clear_shape(shape);
+  for (auto shape : scene->shapes) {
+    clear_shape(shape);
+    shape->packed_vertex = -1;
+  }
+  clear_arraybuffer(scene->packed_positions);
+  clear_arraybuffer(scene->packed_normals);
+  clear_arraybuffer(scene->packed_texcoords);
+  clear_arraybuffer(scene->packed_colors);
+  clear_arraybuffer(scene->packed_tangents);
+  clear_elementbuffer(scene->packed_elements);
+  for (auto instance : scene->instances) clear_arraybuffer(instance->buffer);
+  for (auto object : scene->objects) clear_arraybuffer(object->visible);
+  for (auto material : scene->materials) clear_uniformbuffer(material->buffer);
+  clear_uniformbuffer(scene->edges_material);
   clear_program(scene->program);
+  clear_program(scene->hits_program);
+  if (scene->hits_framebuffer)
+    glDeleteFramebuffers(1, &scene->hits_framebuffer);
+  if (scene->hits_color) glDeleteRenderbuffers(1, &scene->hits_color);
+  if (scene->hits_depth) glDeleteRenderbuffers(1, &scene->hits_depth);
+  scene->hits_framebuffer = 0;
+  scene->hits_color       = 0;
+  scene->hits_depth       = 0;
+  scene->hits_size        = {0, 0};
+  scene->uploads.clear();
+  if (scene->staging_id) glDeleteBuffers(1, &scene->staging_id);
+  scene->staging_id   = 0;
+  scene->staging_size = 0;
+  scene->uploaded     = 0;
+  scene->upload_total = 0;
+  scene->uniforms.clear();
+}
+
+// Memory used by a scene
+size_t get_scene_memory(const gui::scene* scene) {
+  auto abuffer = [](const gui::arraybuffer* buffer) {
+    return buffer->size * sizeof(float);
+  };
+  auto ebuffer = [](const gui::elementbuffer* buffer) {
+    return buffer->size * sizeof(int);
+  };
+  auto memory = (size_t)0;
+  for (auto texture : scene->textures) {
+    if (!texture->texture_id) continue;
+    // one and two channels are stored as rgb, floats as halfs
+    auto channels = texture->nchannels == 4 ? 4 : 3;
+    auto texels   = (size_t)texture->size.x * (size_t)texture->size.y;
+    auto bytes    = texels * channels * (texture->is_float ? 2 : 1);
+    memory += texture->mipmap ? bytes * 4 / 3 : bytes;
+  }
+  for (auto shape : scene->shapes) {
+    for (auto& buffer : shape->vertex_buffers) memory += abuffer(&buffer);
+    for (auto& buffer : shape->element_buffers) memory += ebuffer(&buffer);
+  }
+  memory += abuffer(scene->packed_positions) +
+            abuffer(scene->packed_normals) +
+            abuffer(scene->packed_texcoords) + abuffer(scene->packed_colors) +
+            abuffer(scene->packed_tangents) + ebuffer(scene->packed_elements);
+  for (auto instance : scene->instances) {
+    memory += abuffer(instance->buffer) +
+              instance->frames.capacity() * sizeof(frame3f);
+  }
+  for (auto object : scene->objects) {
+    memory += abuffer(object->visible) +
+              object->cull_bvh.capacity() * sizeof(gui::cull_node) +
+              object->cull_instances.capacity() * sizeof(int);
+  }
+  for (auto material : scene->materials) memory += material->buffer->size;
+  // integer ids and depth of the first hits
+  memory += (size_t)scene->hits_size.x * (size_t)scene->hits_size.y *
+            (4 * sizeof(int) + 4);
+  memory += scene->staging_size;
+  return memory;
 }
 
 // add camera
 gui::camera* add_camera(gui::scene* scene) {
-  return scene->cameras.emplace_back(new camera{});
+  return scene->cameras.emplace_back(scene->camera_arena.create());
 }
 void set_frame(gui::camera* camera, const frame3f& frame) {
   camera->frame = frame;
@@ -1222,12 +1729,12 @@ void set_nearfar(gui::camera* camera, float near, float far) {
 
 // add texture
 gui::texture* add_texture(gui::scene* scene) {
-  return scene->textures.emplace_back(new texture{});
+  return scene->textures.emplace_back(scene->texture_arena.create());
 }
 
 // add shape
 gui::shape* add_shape(gui::scene* scene) {
-  return scene->shapes.emplace_back(new shape{});
+  return scene->shapes.emplace_back(scene->shape_arena.create());
 }
 
 void set_points(gui::shape* shape, const std::vector<int>& points) {
@@ -1243,8 +1750,9 @@ void set_quads(gui::shape* shape, const std::vector<vec4i>& quads) {
   auto triangles = std::vector<vec3i>{};
   triangles.reserve(quads.size() * 2);
   for (auto& q : quads) {
+    // degenerate quads keep an empty triangle, so that each quad has two
     triangles.push_back({q.x, q.y, q.w});
-    if (q.z != q.w) triangles.push_back({q.z, q.w, q.y});
+    triangles.push_back({q.z, q.w, q.y});
   }
   set_elementbuffer(shape->quads, triangles);
 }
@@ -1267,6 +1775,10 @@ void set_edges(gui::shape* shape, const std::vector<vec3i>& triangles,
 }
 void set_positions(gui::shape* shape, const std::vector<vec3f>& positions) {
   set_arraybuffer(shape->positions, positions);
+  shape->packed_vertex = -1;
+  shape->bounds = invalidb3f;
+  for (auto& position : positions)
+    shape->bounds = merge(shape->bounds, position);
 }
 void set_normals(gui::shape* shape, const std::vector<vec3f>& normals) {
   set_arraybuffer(shape->normals, normals);
@@ -1283,7 +1795,7 @@ void set_tangents(gui::shape* shape, const std::vector<vec4f>& tangents) {
 
 // add object
 gui::object* add_object(gui::scene* scene) {
-  return scene->objects.emplace_back(new object{});
+  return scene->objects.emplace_back(scene->object_arena.create());
 }
 void set_frame(gui::object* object, const frame3f& frame) {
   object->frame = frame;
@@ -1304,15 +1816,18 @@ void set_highlighted(gui::object* object, bool highlighted) {
 
 // add instance
 gui::instance* add_instance(gui::scene* scene) {
-  return scene->instances.emplace_back(new instance{});
+  return scene->instances.emplace_back(scene->instance_arena.create());
 }
 void set_frames(gui::instance* instance, const std::vector<frame3f>& frames) {
   instance->frames = frames;
+  instance->version += 1;
+  set_arraybuffer(instance->buffer, frames.size() * 12, 12,
+      (const float*)frames.data());
 }
 
 // add material
 gui::material* add_material(gui::scene* scene) {
-  return scene->materials.emplace_back(new material{});
+  return scene->materials.emplace_back(scene->material_arena.create());
 }
 void set_emission(gui::material* material, const vec3f& emission,
     gui::texture* emission_tex) {
@@ -1349,7 +1864,7 @@ void set_normalmap(gui::material* material, gui::texture* normal_tex) {
 
 // add light
 light* add_light(gui::scene* scene) {
-  return scene->lights.emplace_back(new light{});
+  return scene->lights.emplace_back(scene->light_arena.create());
 }
 void set_light(light* light, const vec3f& position, const vec3f& emission,
     light_type type, bool camera) {
@@ -1359,7 +1874,7 @@ void set_light(light* light, const vec3f& position, const vec3f& emission,
   light->camera   = camera;
 }
 void clear_lights(gui::scene* scene) {
-  for (auto light : scene->lights) delete light;
+  scene->light_arena.clear();
   scene->lights.clear();
 }
 bool has_max_lights(gui::scene* scene) { return scene->lights.size() >= 16; }
@@ -1375,101 +1890,665 @@ void add_default_lights(gui::scene* scene) {
       gui::light_type::directional, true);
 }
 
-// Draw a shape
-void draw_object(
-    gui::scene* scene, gui::object* object, const scene_params& params) {
-  static auto empty_instances = std::vector<frame3f>{identity3x4f};
+// Streaming upload job, returning true once complete
+using upload_job = std::function<bool(gui::scene*, size_t&)>;
+
+// Copy data to the staging buffer bound to target, orphaning its storage so
+// that mapping does not wait on transfers still in flight
+static void stage_upload(
+    gui::scene* scene, uint target, const void* data, size_t size) {
+  if (!scene->staging_id) glGenBuffers(1, &scene->staging_id);
+  glBindBuffer(target, scene->staging_id);
+  if (scene->staging_size < size) {
+    glBufferData(target, size, nullptr, GL_STREAM_DRAW);
+    scene->staging_size = size;
+  }
+  auto mapped = glMapBufferRange(
+      target, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  memcpy(mapped, data, size);
+  glUnmapBuffer(target);
+}
+
+// Upload a buffer in pieces, passing it to publish once complete
+static upload_job make_buffer_upload(gui::scene* scene, const void* data,
+    size_t size, const std::function<void(uint)>& publish) {
+  scene->upload_total += size;
+  return [data, size, publish, buffer_id = (uint)0, offset = (size_t)0](
+             gui::scene* scene, size_t& budget) mutable {
+    assert_error();
+    if (size == 0) {
+      publish(0);
+      return true;
+    }
+    if (!buffer_id) {
+      glGenBuffers(1, &buffer_id);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+      glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+    }
+    while (offset < size && budget > 0) {
+      auto chunk = std::min(size - offset, budget);
+      stage_upload(
+          scene, GL_COPY_READ_BUFFER, (const byte*)data + offset, chunk);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+      glCopyBufferSubData(
+          GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, offset, chunk);
+      offset += chunk;
+      budget -= chunk;
+      scene->uploaded += chunk;
+    }
+    assert_error();
+    if (offset < size) return false;
+    publish(buffer_id);
+    return true;
+  };
+}
 
-  if (object->hidden) return;
+// Upload of data computed on first use, to keep queueing cheap
+static upload_job make_deferred_upload(
+    const std::function<upload_job(gui::scene*)>& make) {
+  return [make, job = upload_job{}](
+             gui::scene* scene, size_t& budget) mutable {
+    if (!job) job = make(scene);
+    return job(scene, budget);
+  };
+}
 
-  auto shape_xform     = mat4f(object->frame);
-  auto shape_inv_xform = transpose(
-      mat4f(inverse(object->frame, params.non_rigid_frames)));
-  set_uniform(scene->program, "frame", shape_xform);
-  set_uniform(scene->program, "frameit", shape_inv_xform);
-  set_uniform(scene->program, "offset", 0.0f);
-  if (object->highlighted) {
-    set_uniform(scene->program, "highlight", vec4f{1, 1, 0, 1});
-  } else {
-    set_uniform(scene->program, "highlight", vec4f{0, 0, 0, 0});
-  }
-
-  auto material = object->material;
-  auto mtype    = 2;
-  set_uniform(scene->program, "mtype", mtype);
-  set_uniform(scene->program, "emission", material->emission);
-  set_uniform(scene->program, "diffuse", material->color);
-  set_uniform(scene->program, "specular", vec3f{material->metallic});
-  set_uniform(scene->program, "roughness", material->roughness);
-  set_uniform(scene->program, "opacity", material->opacity);
-  set_uniform(scene->program, "double_sided", (int)params.double_sided);
-  set_uniform(
-      scene->program, "emission_tex", "emission_tex_on", material->emission_tex, 0);
-  set_uniform(
-      scene->program, "diffuse_tex", "diffuse_tex_on", material->color_tex, 1);
-  set_uniform(
-      scene->program, "specular_tex", "specular_tex_on", material->metallic_tex, 2);
-  set_uniform(scene->program, "roughness_tex", "roughness_tex_on",
-      material->roughness_tex, 3);
-  set_uniform(
-      scene->program, "opacity_tex", "opacity_tex_on", material->opacity_tex, 4);
-  set_uniform(scene->program, "mat_norm_tex", "mat_norm_tex_on",
-      material->normal_tex, 5);
+// Vertex and element buffer uploads, with owner keeping derived data alive
+template <typename T>
+static upload_job make_arraybuffer_upload(gui::scene* scene,
+    gui::arraybuffer* buffer, const std::vector<T>& data,
+    const std::function<void()>& done = {}) {
+  auto esize = (int)(sizeof(T) / sizeof(float));
+  auto size  = data.size() * esize;
+  return make_buffer_upload(scene, data.data(), size * sizeof(float),
+      [buffer, size, esize, done](uint buffer_id) {
+        clear_arraybuffer(buffer);
+        buffer->buffer_id = buffer_id;
+        buffer->size      = buffer_id ? size : 0;
+        buffer->esize     = buffer_id ? esize : 0;
+        buffer->dynamic   = false;
+        if (done) done();
+      });
+}
+template <typename T>
+static upload_job make_elementbuffer_upload(gui::scene* scene,
+    gui::elementbuffer* buffer, element_type element,
+    const std::vector<T>& data, std::shared_ptr<void> owner = nullptr) {
+  auto size = data.size() * (sizeof(T) / sizeof(int));
+  return make_buffer_upload(scene, data.data(), size * sizeof(int),
+      [buffer, element, size, owner](uint buffer_id) {
+        clear_elementbuffer(buffer);
+        buffer->buffer_id = buffer_id;
+        buffer->size      = buffer_id ? size : 0;
+        buffer->element   = buffer_id ? element : element_type::points;
+        buffer->dynamic   = false;
+      });
+}
 
-  auto shape = object->shape;
-  set_uniform(scene->program, "faceted", !is_initialized(shape->normals));
-  set_attribute(scene->program, "positions", shape->positions, vec3f{0, 0, 0});
-  set_attribute(scene->program, "normals", shape->normals, vec3f{0, 0, 1});
-  set_attribute(scene->program, "texcoords", shape->texcoords, vec2f{0, 0});
-  set_attribute(scene->program, "colors", shape->colors, vec4f{1, 1, 1, 1});
-  set_attribute(scene->program, "tangents", shape->tangents, vec4f{0, 0, 1, 1});
-
-  auto& instances = object->instance ? object->instance->frames
-                                     : empty_instances;
-
-  for (auto& frame : instances) {
-    auto shape_xform     = mat4f(object->frame * frame);
-    auto shape_inv_xform = transpose(
-        mat4f(inverse(object->frame * frame, params.non_rigid_frames)));
-    set_uniform(scene->program, "frame", shape_xform);
-    set_uniform(scene->program, "frameit", shape_inv_xform);
-
-    if (is_initialized(shape->points)) {
-      glPointSize(shape->points_size);
-      set_uniform(scene->program, "etype", 1);
-      draw_elements(shape->points);
+// Upload a texture in bands of rows through a pixel unpack buffer, setting
+// it once complete
+static upload_job make_texture_upload(gui::scene* scene,
+    gui::texture* texture, const vec2i& size, int nchannels, const void* data,
+    bool is_float, bool is_srgb, uint internal, bool linear, bool mipmap) {
+  static auto cformat = std::unordered_map<int, uint>{
+      {1, GL_RED},
+      {2, GL_RG},
+      {3, GL_RGB},
+      {4, GL_RGBA},
+  };
+  auto row_size = (size_t)size.x * nchannels *
+                  (is_float ? sizeof(float) : sizeof(byte));
+  scene->upload_total += row_size * size.y;
+  return [=, texture_id = (uint)0, row = 0](
+             gui::scene* scene, size_t& budget) mutable {
+    assert_error();
+    if (size.x == 0 || size.y == 0 || data == nullptr) {
+      clear_texture(texture);
+      return true;
+    }
+    auto format = cformat.at(nchannels);
+    auto type   = is_float ? GL_FLOAT : GL_UNSIGNED_BYTE;
+    if (!texture_id) {
+      glGenTextures(1, &texture_id);
+      glBindTexture(GL_TEXTURE_2D, texture_id);
+      glTexImage2D(GL_TEXTURE_2D, 0, internal, size.x, size.y, 0, format,
+          type, nullptr);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    while (row < size.y && budget > 0) {
+      auto rows  = clamp((int)(budget / row_size), 1, size.y - row);
+      auto chunk = rows * row_size;
+      stage_upload(scene, GL_PIXEL_UNPACK_BUFFER,
+          (const byte*)data + row * row_size, chunk);
+      glBindTexture(GL_TEXTURE_2D, texture_id);
+      glTexSubImage2D(
+          GL_TEXTURE_2D, 0, 0, row, size.x, rows, format, type, nullptr);
+      row += rows;
+      budget -= std::min(budget, chunk);
+      scene->uploaded += chunk;
     }
-    if (is_initialized(shape->lines)) {
-      set_uniform(scene->program, "etype", 2);
-      draw_elements(shape->lines);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    assert_error();
+    if (row < size.y) return false;
+    glBindTexture(GL_TEXTURE_2D, texture_id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+        mipmap ? (linear ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST)
+               : (linear ? GL_LINEAR : GL_NEAREST));
+    glTexParameteri(
+        GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, linear ? GL_LINEAR : GL_NEAREST);
+    if (mipmap) glGenerateMipmap(GL_TEXTURE_2D);
+    clear_texture(texture);
+    texture->texture_id = texture_id;
+    texture->size       = size;
+    texture->nchannels  = nchannels;
+    texture->is_srgb    = is_srgb;
+    texture->is_float   = is_float;
+    texture->linear     = linear;
+    texture->mipmap     = mipmap;
+    assert_error();
+    return true;
+  };
+}
+
+// Queue texture uploads
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec4b>& img, bool as_srgb, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 4,
+      img.data(), false, as_srgb, as_srgb ? GL_SRGB_ALPHA : GL_RGBA, linear,
+      mipmap));
+}
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec4f>& img, bool as_float, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 4,
+      img.data(), as_float, false, as_float ? GL_RGBA16F : GL_RGBA, linear,
+      mipmap));
+}
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec3b>& img, bool as_srgb, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 3,
+      img.data(), false, as_srgb, as_srgb ? GL_SRGB : GL_RGB, linear,
+      mipmap));
+}
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec3f>& img, bool as_float, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 3,
+      img.data(), as_float, false, as_float ? GL_RGB16F : GL_RGB, linear,
+      mipmap));
+}
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<byte>& img, bool as_srgb, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 1,
+      img.data(), false, as_srgb, as_srgb ? GL_SRGB : GL_RGB, linear,
+      mipmap));
+}
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<float>& img, bool as_float, bool linear, bool mipmap) {
+  scene->uploads.push_back(make_texture_upload(scene, texture, img.size(), 1,
+      img.data(), as_float, false, as_float ? GL_RGB16F : GL_RGB, linear,
+      mipmap));
+}
+
+// Queue shape uploads. Vertices go first, so that a shape is drawn only
+// once its elements are complete.
+void queue_shape(gui::scene* scene, gui::shape* shape,
+    const std::vector<int>& points, const std::vector<vec2i>& lines,
+    const std::vector<vec3i>& triangles, const std::vector<vec4i>& quads,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<vec2f>& texcoords, const std::vector<vec3f>& colors,
+    bool edges) {
+  auto& uploads = scene->uploads;
+  shape->packed_vertex = -1;
+  uploads.push_back(make_arraybuffer_upload(
+      scene, shape->positions, positions, [shape, &positions]() {
+        shape->bounds = invalidb3f;
+        for (auto& position : positions)
+          shape->bounds = merge(shape->bounds, position);
+      }));
+  uploads.push_back(make_arraybuffer_upload(scene, shape->normals, normals));
+  uploads.push_back(
+      make_arraybuffer_upload(scene, shape->texcoords, texcoords));
+  uploads.push_back(make_arraybuffer_upload(scene, shape->colors, colors));
+  uploads.push_back(make_elementbuffer_upload(
+      scene, shape->points, element_type::points, points));
+  uploads.push_back(make_elementbuffer_upload(
+      scene, shape->lines, element_type::lines, lines));
+  uploads.push_back(make_elementbuffer_upload(
+      scene, shape->triangles, element_type::triangles, triangles));
+  uploads.push_back(make_deferred_upload([shape, &quads](gui::scene* scene) {
+    auto split = std::make_shared<std::vector<vec3i>>();
+    split->reserve(quads.size() * 2);
+    for (auto& q : quads) {
+      split->push_back({q.x, q.y, q.w});
+      split->push_back({q.z, q.w, q.y});
+    }
+    return make_elementbuffer_upload(
+        scene, shape->quads, element_type::triangles, *split, split);
+  }));
+  if (!edges) return;
+  uploads.push_back(make_deferred_upload(
+      [shape, &triangles, &quads](gui::scene* scene) {
+        auto edgemap = std::unordered_set<vec2i>{};
+        for (auto t : triangles) {
+          edgemap.insert({min(t.x, t.y), max(t.x, t.y)});
+          edgemap.insert({min(t.y, t.z), max(t.y, t.z)});
+          edgemap.insert({min(t.z, t.x), max(t.z, t.x)});
+        }
+        for (auto q : quads) {
+          edgemap.insert({min(q.x, q.y), max(q.x, q.y)});
+          edgemap.insert({min(q.y, q.z), max(q.y, q.z)});
+          edgemap.insert({min(q.z, q.w), max(q.z, q.w)});
+          edgemap.insert({min(q.w, q.x), max(q.w, q.x)});
+        }
+        auto split = std::make_shared<std::vector<vec2i>>(
+            edgemap.begin(), edgemap.end());
+        return make_elementbuffer_upload(
+            scene, shape->edges, element_type::lines, *split, split);
+      }));
+}
+
+// Upload queued data up to a byte budget, returning whether uploads remain
+bool process_uploads(gui::scene* scene, size_t budget) {
+  while (!scene->uploads.empty() && budget > 0) {
+    if (!scene->uploads.front()(scene, budget)) break;
+    scene->uploads.pop_front();
+  }
+  if (scene->uploads.empty() && scene->staging_id) {
+    glDeleteBuffers(1, &scene->staging_id);
+    scene->staging_id   = 0;
+    scene->staging_size = 0;
+  }
+  return !scene->uploads.empty();
+}
+
+// Copy bytes between two buffers on the GPU
+static void copy_buffer(
+    uint from, uint to, size_t from_offset, size_t to_offset, size_t bytes) {
+  glBindBuffer(GL_COPY_READ_BUFFER, from);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, to);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, from_offset,
+      to_offset, bytes);
+}
+
+// Grow a buffer keeping its contents, since GL buffers cannot be resized
+static void grow_buffer(uint& buffer_id, size_t old_bytes, size_t new_bytes) {
+  auto grown = (uint)0;
+  glGenBuffers(1, &grown);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+  glBufferData(GL_COPY_WRITE_BUFFER, new_bytes, nullptr, GL_STATIC_DRAW);
+  if (buffer_id && old_bytes) copy_buffer(buffer_id, grown, 0, 0, old_bytes);
+  if (buffer_id) glDeleteBuffers(1, &buffer_id);
+  buffer_id = grown;
+}
+
+// Pack shapes in the scene buffers
+void pack_shapes(gui::scene* scene) {
+  assert_error();
+  if (!scene->uploads.empty()) return;
+
+  // shapes still in their own buffers, with the space they need
+  auto shapes   = std::vector<gui::shape*>{};
+  auto vertices = (size_t)0, indices = (size_t)0;
+  for (auto shape : scene->shapes) {
+    if (!is_initialized(shape->positions)) continue;
+    shapes.push_back(shape);
+    vertices += shape->positions->size / 3;
+    for (auto elements : {shape->points, shape->lines, shape->triangles,
+             shape->quads, shape->edges})
+      indices += elements->size;
+  }
+  if (shapes.empty()) return;
+
+  // grow the packed buffers past the shapes packed before
+  auto packed   = std::array<gui::arraybuffer*, 5>{scene->packed_positions,
+      scene->packed_normals, scene->packed_texcoords, scene->packed_colors,
+      scene->packed_tangents};
+  auto esizes   = std::array<int, 5>{3, 3, 2, 3, 4};
+  auto defaults = std::array<vec4f, 5>{vec4f{0, 0, 0, 0}, vec4f{0, 0, 1, 0},
+      vec4f{0, 0, 0, 0}, vec4f{1, 1, 1, 1}, vec4f{0, 0, 1, 1}};
+  auto vertex   = scene->packed_positions->size / 3;
+  for (auto k = 0; k < 5; k++) {
+    auto size = packed[k]->size + vertices * esizes[k];
+    grow_buffer(packed[k]->buffer_id, packed[k]->size * sizeof(float),
+        size * sizeof(float));
+    packed[k]->size  = size;
+    packed[k]->esize = esizes[k];
+  }
+  auto elements = scene->packed_elements;
+  auto index    = elements->size;
+  grow_buffer(elements->buffer_id, elements->size * sizeof(int),
+      (elements->size + indices) * sizeof(int));
+  elements->size += indices;
+  elements->element = element_type::triangles;
+
+  // copy vertices and elements, filling missing attributes with defaults
+  for (auto shape : shapes) {
+    auto count   = shape->positions->size / 3;
+    auto buffers = std::array<gui::arraybuffer*, 5>{shape->positions,
+        shape->normals, shape->texcoords, shape->colors, shape->tangents};
+    for (auto k = 0; k < 5; k++) {
+      auto offset = vertex * esizes[k] * sizeof(float);
+      auto bytes  = count * esizes[k] * sizeof(float);
+      if (is_initialized(buffers[k]) && buffers[k]->esize == esizes[k] &&
+          buffers[k]->size == count * esizes[k]) {
+        copy_buffer(buffers[k]->buffer_id, packed[k]->buffer_id, 0, offset,
+            bytes);
+      } else {
+        auto filler = std::vector<float>(count * esizes[k]);
+        for (auto idx = (size_t)0; idx < filler.size(); idx++)
+          filler[idx] = defaults[k][(int)(idx % esizes[k])];
+        glBindBuffer(GL_COPY_WRITE_BUFFER, packed[k]->buffer_id);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, filler.data());
+      }
     }
-    if (is_initialized(shape->triangles)) {
-      set_uniform(scene->program, "etype", 3);
-      draw_elements(shape->triangles);
+    auto kinds = std::array<gui::elementbuffer*, 5>{shape->points,
+        shape->lines, shape->triangles, shape->quads, shape->edges};
+    for (auto k = 0; k < 5; k++) {
+      auto size               = kinds[k]->size;
+      shape->packed_ranges[k] = {(int)index, (int)size};
+      if (!size) continue;
+      copy_buffer(kinds[k]->buffer_id, elements->buffer_id, 0,
+          index * sizeof(int), size * sizeof(int));
+      index += size;
+    }
+    shape->packed_normals = is_initialized(shape->normals);
+    shape->packed_vertex  = (int)vertex;
+    vertex += count;
+    clear_shape(shape);
+  }
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  assert_error();
+}
+
+// View frustum planes, with normals pointing inside, from the rows of the
+// projection-view matrix.
+static std::array<vec4f, 6> make_frustum(const mat4f& projection_view) {
+  auto& m   = projection_view;
+  auto  row = [&m](int i) { return vec4f{m.x[i], m.y[i], m.z[i], m.w[i]}; };
+  return {row(3) + row(0), row(3) - row(0), row(3) + row(1), row(3) - row(1),
+      row(3) + row(2), row(3) - row(2)};
+}
+
+// Classify a box as outside (-1), intersecting (0) or inside (1) a frustum,
+// testing the box corners farthest along and against each plane normal.
+static int cull_bbox(const std::array<vec4f, 6>& frustum, const bbox3f& bbox) {
+  auto inside = true;
+  for (auto& plane : frustum) {
+    auto farthest = vec3f{plane.x >= 0 ? bbox.max.x : bbox.min.x,
+        plane.y >= 0 ? bbox.max.y : bbox.min.y,
+        plane.z >= 0 ? bbox.max.z : bbox.min.z};
+    auto nearest  = vec3f{plane.x >= 0 ? bbox.min.x : bbox.max.x,
+        plane.y >= 0 ? bbox.min.y : bbox.max.y,
+        plane.z >= 0 ? bbox.min.z : bbox.max.z};
+    auto normal = vec3f{plane.x, plane.y, plane.z};
+    if (dot(normal, farthest) + plane.w < 0) return -1;
+    if (dot(normal, nearest) + plane.w < 0) inside = false;
+  }
+  return inside ? 1 : 0;
+}
+
+// Build the culling hierarchy of an object over the world bounds of its
+// instances, splitting at the median centroid along the largest axis.
+static void update_culling(gui::object* object) {
+  auto shape    = object->shape;
+  auto instance = object->instance;
+  auto version  = instance ? instance->version : 0;
+  if (!object->cull_bvh.empty() && object->cull_frame == object->frame &&
+      object->cull_bounds == shape->bounds && object->cull_version == version)
+    return;
+  object->cull_frame   = object->frame;
+  object->cull_bounds  = shape->bounds;
+  object->cull_version = version;
+
+  auto num_instances = instance ? (int)instance->frames.size() : 1;
+  auto bboxes        = std::vector<bbox3f>(num_instances);
+  for (auto idx = 0; idx < num_instances; idx++) {
+    auto frame  = instance ? object->frame * instance->frames[idx]
+                           : object->frame;
+    bboxes[idx] = transform_bbox(frame, shape->bounds);
+  }
+  auto& nodes     = object->cull_bvh;
+  auto& instances = object->cull_instances;
+  nodes.assign(1, {});
+  instances.resize(num_instances);
+  for (auto idx = 0; idx < num_instances; idx++) instances[idx] = idx;
+  auto stack = std::vector<vec3i>{{0, 0, num_instances}};
+  while (!stack.empty()) {
+    auto [nodeid, start, end] = stack.back();
+    stack.pop_back();
+    auto bbox = invalidb3f, cbox = invalidb3f;
+    for (auto idx = start; idx < end; idx++) {
+      bbox = merge(bbox, bboxes[instances[idx]]);
+      cbox = merge(cbox, center(bboxes[instances[idx]]));
     }
-    if (is_initialized(shape->quads)) {
-      set_uniform(scene->program, "etype", 3);
-      draw_elements(shape->quads);
+    nodes[nodeid].bbox = bbox;
+    if (end - start <= 16) {
+      nodes[nodeid].start = start;
+      nodes[nodeid].num   = end - start;
+      continue;
+    }
+    auto csize = size(cbox);
+    auto axis  = csize.x >= csize.y && csize.x >= csize.z ? 0
+                 : csize.y >= csize.z                     ? 1
+                                                          : 2;
+    auto middle = (start + end) / 2;
+    std::nth_element(instances.begin() + start, instances.begin() + middle,
+        instances.begin() + end, [&bboxes, axis](int a, int b) {
+          return center(bboxes[a])[axis] < center(bboxes[b])[axis];
+        });
+    nodes[nodeid].start = (int)nodes.size();
+    nodes[nodeid].num   = 0;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    stack.push_back({nodes[nodeid].start, start, middle});
+    stack.push_back({nodes[nodeid].start + 1, middle, end});
+  }
+}
+
+// Collect the instances of an object in the view frustum, returning whether
+// all of them are visible.
+static bool cull_instances(gui::object* object,
+    const std::array<vec4f, 6>& frustum, std::vector<int>& visible) {
+  visible.clear();
+  auto& nodes = object->cull_bvh;
+  auto  stack = std::vector<vec2i>{{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeid, inside] = stack.back();
+    stack.pop_back();
+    auto& node = nodes[nodeid];
+    if (!inside) {
+      auto cull = cull_bbox(frustum, node.bbox);
+      if (cull < 0) continue;
+      inside = cull > 0;
+    }
+    if (node.num) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++)
+        visible.push_back(object->cull_instances[idx]);
+    } else {
+      stack.push_back({node.start, inside});
+      stack.push_back({node.start + 1, inside});
     }
   }
+  return visible.size() == object->cull_instances.size();
+}
+
+// Upload a material block when its values change, and bind it with its
+// textures
+static void bind_material(gui::scene* scene, gui::material* material) {
+  auto block = std::array<float, material_blocksize>{material->emission.x,
+      material->emission.y, material->emission.z, 0, material->color.x,
+      material->color.y, material->color.z, 0, material->metallic,
+      material->metallic, material->metallic, material->roughness,
+      material->opacity, 0, 0, 0};
+  if (block != material->block || !is_initialized(material->buffer)) {
+    set_uniformbuffer(material->buffer, sizeof(block), block.data());
+    material->block = block;
+  }
+  bind_uniformbuffer(material->buffer, material_binding);
+
+  auto program = scene->program;
+  set_uniform(program, get_location(scene, scene_uniform::emission_tex),
+      get_location(scene, scene_uniform::emission_tex_on),
+      material->emission_tex, 0);
+  set_uniform(program, get_location(scene, scene_uniform::diffuse_tex),
+      get_location(scene, scene_uniform::diffuse_tex_on), material->color_tex,
+      1);
+  set_uniform(program, get_location(scene, scene_uniform::specular_tex),
+      get_location(scene, scene_uniform::specular_tex_on),
+      material->metallic_tex, 2);
+  set_uniform(program, get_location(scene, scene_uniform::roughness_tex),
+      get_location(scene, scene_uniform::roughness_tex_on),
+      material->roughness_tex, 3);
+  set_uniform(program, get_location(scene, scene_uniform::opacity_tex),
+      get_location(scene, scene_uniform::opacity_tex_on),
+      material->opacity_tex, 4);
+  set_uniform(program, get_location(scene, scene_uniform::mat_norm_tex),
+      get_location(scene, scene_uniform::mat_norm_tex_on),
+      material->normal_tex, 5);
+}
+
+// Material and shape currently bound, to skip redundant state changes
+struct draw_state {
+  gui::material* material = nullptr;
+  gui::shape*    shape    = nullptr;
+  bool           packed   = false;
+};
+
+// Bind the vertex attributes of a shape. Packed shapes share the scene
+// buffers, so these are bound only when switching to them.
+static void bind_shape(
+    gui::scene* scene, gui::shape* shape, draw_state& state) {
+  auto program = scene->program;
+  auto packed  = shape->packed_vertex >= 0;
+  set_uniform(program, get_location(scene, scene_uniform::faceted),
+      packed ? !shape->packed_normals : !is_initialized(shape->normals));
+  if (packed && !state.packed) {
+    set_attribute(program, 0, scene->packed_positions);
+    set_attribute(program, 1, scene->packed_normals);
+    set_attribute(program, 2, scene->packed_texcoords);
+    set_attribute(program, 3, scene->packed_colors);
+    set_attribute(program, 4, scene->packed_tangents);
+  } else if (!packed) {
+    set_attribute(program, 0, shape->positions, vec3f{0, 0, 0});
+    set_attribute(program, 1, shape->normals, vec3f{0, 0, 1});
+    set_attribute(program, 2, shape->texcoords, vec2f{0, 0});
+    set_attribute(program, 3, shape->colors, vec4f{1, 1, 1, 1});
+    set_attribute(program, 4, shape->tangents, vec4f{0, 0, 1, 1});
+  }
+  state.packed = packed;
+}
+
+// Get the elements of a shape, in the order of packed ranges
+static gui::elementbuffer* get_elements(gui::shape* shape, int kind) {
+  switch (kind) {
+    case 0: return shape->points;
+    case 1: return shape->lines;
+    case 2: return shape->triangles;
+    case 3: return shape->quads;
+    default: return shape->edges;
+  }
+}
+
+// Check if a shape has elements of a kind
+static bool has_elements(gui::shape* shape, int kind) {
+  return shape->packed_vertex >= 0 ? shape->packed_ranges[kind].y > 0
+                                   : is_initialized(get_elements(shape, kind));
+}
+
+// Draw the elements of a kind, from the shape or the scene packed buffers
+static void draw_elements(
+    gui::scene* scene, gui::shape* shape, int kind, int instances) {
+  if (shape->packed_vertex < 0)
+    return draw_elements(get_elements(shape, kind), instances);
+  static const uint modes[5] = {
+      GL_POINTS, GL_LINES, GL_TRIANGLES, GL_TRIANGLES, GL_LINES};
+  auto& range = shape->packed_ranges[kind];
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene->packed_elements->buffer_id);
+  glDrawElementsInstancedBaseVertex(modes[kind], range.y, GL_UNSIGNED_INT,
+      (const void*)(range.x * sizeof(int)), instances, shape->packed_vertex);
+}
 
-  for (auto& frame : instances) {
-    auto shape_xform     = mat4f(object->frame * frame);
-    auto shape_inv_xform = transpose(
-        mat4f(inverse(object->frame * frame, params.non_rigid_frames)));
-    set_uniform(scene->program, "frame", shape_xform);
-    set_uniform(scene->program, "frameit", shape_inv_xform);
-
-    if (is_initialized(shape->edges) && params.edges && !params.wireframe) {
-      set_uniform(scene->program, "mtype", mtype);
-      set_uniform(scene->program, "emission", vec3f{0, 0, 0});
-      set_uniform(scene->program, "diffuse", vec3f{0, 0, 0});
-      set_uniform(scene->program, "specular", vec3f{0, 0, 0});
-      set_uniform(scene->program, "roughness", 1);
-      set_uniform(scene->program, "etype", 2);
-      draw_elements(shape->edges);
+// Draw a shape
+static void draw_object(gui::scene* scene, gui::object* object,
+    const scene_params& params, const std::array<vec4f, 6>& frustum,
+    draw_state& state) {
+  if (object->hidden) return;
+  if (object->instance && object->instance->frames.empty()) return;
+
+  // cull the object, or the instances outside the view
+  auto all_visible = true, culled = false;
+  auto visible     = std::vector<int>{};
+  if (params.culling && object->shape->bounds != invalidb3f) {
+    update_culling(object);
+    all_visible = cull_instances(object, frustum, visible);
+    if (visible.empty()) return;
+    if (!all_visible && object->instance) {
+      auto frames = std::vector<frame3f>(visible.size());
+      for (auto idx = 0; idx < (int)visible.size(); idx++)
+        frames[idx] = object->instance->frames[visible[idx]];
+      set_arraybuffer(object->visible, frames.size() * 12, 12,
+          (const float*)frames.data(), true);
+      culled = true;
     }
   }
+
+  auto program = scene->program;
+  set_uniform(
+      program, get_location(scene, scene_uniform::frame), mat4f(object->frame));
+  set_uniform(program, get_location(scene, scene_uniform::highlight),
+      object->highlighted ? vec4f{1, 1, 0, 1} : vec4f{0, 0, 0, 0});
+
+  if (object->material != state.material) {
+    bind_material(scene, object->material);
+    state.material = object->material;
+  }
+  auto shape = object->shape;
+  if (shape != state.shape) {
+    bind_shape(scene, shape, state);
+    state.shape = shape;
+  }
+
+  // instance frames are drawn in a single call per element type
+  auto instances = 1;
+  if (culled) {
+    set_instance_attribute(program, 5, object->visible);
+    instances = (int)visible.size();
+  } else if (object->instance && is_initialized(object->instance->buffer)) {
+    set_instance_attribute(program, 5, object->instance->buffer);
+    instances = (int)object->instance->frames.size();
+  } else {
+    set_instance_attribute(program, 5, identity3x4f);
+  }
+
+  auto etype = get_location(scene, scene_uniform::etype);
+  if (has_elements(shape, 0)) {
+    glPointSize(shape->points_size);
+    set_uniform(program, etype, 1);
+    draw_elements(scene, shape, 0, instances);
+  }
+  if (has_elements(shape, 1)) {
+    set_uniform(program, etype, 2);
+    draw_elements(scene, shape, 1, instances);
+  }
+  if (has_elements(shape, 2)) {
+    set_uniform(program, etype, 3);
+    draw_elements(scene, shape, 2, instances);
+  }
+  if (has_elements(shape, 3)) {
+    set_uniform(program, etype, 3);
+    draw_elements(scene, shape, 3, instances);
+  }
+
+  if (has_elements(shape, 4) && params.edges && !params.wireframe) {
+    bind_uniformbuffer(scene->edges_material, material_binding);
+    state.material = nullptr;
+    set_uniform(program, etype, 2);
+    draw_elements(scene, shape, 4, instances);
+  }
+
+  // leave instance arrays disabled for other programs
+  set_instance_attribute(program, 5, identity3x4f);
 }
 
 // Display a scene
@@ -1497,50 +2576,198 @@ void draw_scene(gui::scene* scene, gui::camera* camera, const vec4i& viewport,
   clear_framebuffer(params.background);
   set_viewport(viewport);
 
-  bind_program(scene->program);
-  set_uniform(scene->program, "eye", camera->frame.o);
-  set_uniform(scene->program, "view", camera_view);
-  set_uniform(scene->program, "projection", camera_proj);
-  set_uniform(scene->program, "eyelight",
+  // per-frame uniforms
+  auto program = scene->program;
+  bind_program(program);
+  set_uniform(program, get_location(scene, scene_uniform::eye),
+      camera->frame.o);
+  set_uniform(program, get_location(scene, scene_uniform::view), camera_view);
+  set_uniform(
+      program, get_location(scene, scene_uniform::projection), camera_proj);
+  set_uniform(program, get_location(scene, scene_uniform::eyelight),
       params.shading == shading_type::eyelight ? 1 : 0);
-  set_uniform(scene->program, "exposure", params.exposure);
-  set_uniform(scene->program, "gamma", params.gamma);
+  set_uniform(
+      program, get_location(scene, scene_uniform::exposure), params.exposure);
+  set_uniform(program, get_location(scene, scene_uniform::gamma), params.gamma);
+  set_uniform(program, get_location(scene, scene_uniform::non_rigid_frames),
+      (int)params.non_rigid_frames);
+  set_uniform(program, get_location(scene, scene_uniform::offset), 0.0f);
+  set_uniform(program, get_location(scene, scene_uniform::double_sided),
+      (int)params.double_sided);
+  set_uniform(program, get_location(scene, scene_uniform::mtype), 2);
 
   if (params.shading == shading_type::lights ||
       params.shading == shading_type::camlights) {
     auto& lights = params.shading == shading_type::lights ? scene->lights
                                                           : camera_lights;
-    set_uniform(scene->program, "lamb", vec3f{0, 0, 0});
-    set_uniform(scene->program, "lnum", (int)lights.size());
-    auto lid = 0;
-    for (auto light : lights) {
-      auto is = std::to_string(lid);
+    auto  nlights = min((int)lights.size(), scene_max_lights);
+    set_uniform(program, get_location(scene, scene_uniform::lamb), zero3f);
+    set_uniform(program, get_location(scene, scene_uniform::lnum), nlights);
+    for (auto lid = 0; lid < nlights; lid++) {
+      auto light = lights[lid];
       if (light->camera) {
         auto position = light->type == light_type::directional
                             ? transform_direction(
                                   camera->frame, light->position)
                             : transform_point(camera->frame, light->position);
-        set_uniform(scene->program, ("lpos[" + is + "]").c_str(), position);
+        set_uniform(program, get_light_location(scene, lid, 0), position);
       } else {
         set_uniform(
-            scene->program, ("lpos[" + is + "]").c_str(), light->position);
+            program, get_light_location(scene, lid, 0), light->position);
       }
-      set_uniform(scene->program, ("lke[" + is + "]").c_str(), light->emission);
+      set_uniform(program, get_light_location(scene, lid, 1), light->emission);
       set_uniform(
-          scene->program, ("ltype[" + is + "]").c_str(), (int)light->type);
-      lid++;
+          program, get_light_location(scene, lid, 2), (int)light->type);
     }
   }
 
+  // sort draws by material and shape to minimize state changes, keeping the
+  // scene order otherwise
+  auto objects = scene->objects;
+  std::stable_sort(objects.begin(), objects.end(),
+      [](const gui::object* a, const gui::object* b) {
+        return std::less<>{}(a->material, b->material) ||
+               (a->material == b->material &&
+                   std::less<>{}(a->shape, b->shape));
+      });
+
   if (params.wireframe) set_wireframe(true);
-  for (auto object : scene->objects) {
-    draw_object(scene, object, params);
+  auto frustum = make_frustum(camera_proj * camera_view);
+  auto state   = draw_state{};
+  for (auto object : objects) {
+    draw_object(scene, object, params, frustum, state);
   }
 
   unbind_program();
   if (params.wireframe) set_wireframe(false);
 }
 
+static const char* glhits_vertex =
+    R"(
+#version 330
+layout(location = 0) in vec3 positions;
+layout(location = 5) in vec3 instance_x;
+layout(location = 6) in vec3 instance_y;
+layout(location = 7) in vec3 instance_z;
+layout(location = 8) in vec3 instance_o;
+uniform mat4 frame;
+uniform mat4 view;
+uniform mat4 projection;
+flat out int instance;
+void main() {
+  mat4 shape_frame = frame * mat4(vec4(instance_x,0), vec4(instance_y,0),
+                                  vec4(instance_z,0), vec4(instance_o,1));
+  instance = gl_InstanceID;
+  gl_Position = projection * view * shape_frame * vec4(positions,1);
+}
+)";
+
+static const char* glhits_fragment =
+    R"(
+#version 330
+flat in int instance;
+uniform int object;
+uniform bool quads;
+layout(location = 0) out ivec4 hit;
+void main() {
+  // quads are split in two triangles each
+  hit = ivec4(object, instance, quads ? gl_PrimitiveID / 2 : gl_PrimitiveID, 1);
+}
+)";
+
+// Draw first hits
+void draw_scene_hits(gui::scene* scene, gui::camera* camera,
+    const vec2i& size, const scene_params& params, img::image<vec4i>& hits) {
+  assert_error();
+  if (!is_initialized(scene->hits_program)) {
+    auto error = ""s, errorlog = ""s;
+    if (!init_program(scene->hits_program, glhits_vertex, glhits_fragment,
+            error, errorlog))
+      return;
+  }
+
+  // integer ids and depth are drawn to renderbuffers of the requested size
+  if (!scene->hits_framebuffer) glGenFramebuffers(1, &scene->hits_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, scene->hits_framebuffer);
+  if (scene->hits_size != size) {
+    if (!scene->hits_color) glGenRenderbuffers(1, &scene->hits_color);
+    if (!scene->hits_depth) glGenRenderbuffers(1, &scene->hits_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, scene->hits_color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32I, size.x, size.y);
+    glBindRenderbuffer(GL_RENDERBUFFER, scene->hits_depth);
+    glRenderbufferStorage(
+        GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size.x, size.y);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_RENDERBUFFER, scene->hits_color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+        GL_RENDERBUFFER, scene->hits_depth);
+    scene->hits_size = size;
+  }
+
+  auto camera_aspect = (float)size.x / (float)size.y;
+  auto camera_yfov   = 2 *
+                     atan(camera->film / (camera_aspect * 2 * camera->lens));
+  auto camera_view   = mat4f(inverse(camera->frame));
+  auto camera_proj   = perspective_mat(
+      camera_yfov, camera_aspect, params.near, params.far);
+
+  static const int miss[4] = {-1, -1, -1, 0};
+  glViewport(0, 0, size.x, size.y);
+  glClearBufferiv(GL_COLOR, 0, miss);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+
+  // all instances are drawn, since culling would renumber them
+  auto program = scene->hits_program;
+  bind_program(program);
+  set_uniform(program, "view", camera_view);
+  set_uniform(program, "projection", camera_proj);
+  for (auto idx = 0; idx < (int)scene->objects.size(); idx++) {
+    auto object = scene->objects[idx];
+    auto shape  = object->shape;
+    if (object->hidden || !shape) continue;
+    if (object->instance && object->instance->frames.empty()) continue;
+    auto instances = 1;
+    if (object->instance && is_initialized(object->instance->buffer)) {
+      set_instance_attribute(program, 5, object->instance->buffer);
+      instances = (int)object->instance->frames.size();
+    } else {
+      set_instance_attribute(program, 5, identity3x4f);
+    }
+    set_uniform(program, "frame", mat4f(object->frame));
+    set_uniform(program, "object", idx);
+    if (shape->packed_vertex >= 0) {
+      set_attribute(program, 0, scene->packed_positions);
+    } else {
+      set_attribute(program, 0, shape->positions, vec3f{0, 0, 0});
+    }
+    if (has_elements(shape, 2)) {
+      set_uniform(program, "quads", 0);
+      draw_elements(scene, shape, 2, instances);
+    }
+    if (has_elements(shape, 3)) {
+      set_uniform(program, "quads", 1);
+      draw_elements(scene, shape, 3, instances);
+    }
+  }
+  set_instance_attribute(program, 5, identity3x4f);
+  unbind_program();
+
+  // read back, flipping rows to start from the top
+  auto flipped = img::image<vec4i>{size};
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(
+      0, 0, size.x, size.y, GL_RGBA_INTEGER, GL_INT, (void*)flipped.data());
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  hits.resize(size);
+  for (auto j = 0; j < size.y; j++) {
+    auto row = &flipped[{0, size.y - 1 - j}];
+    std::copy(row, row + size.x, &hits[{0, j}]);
+  }
+  assert_error();
+}
+
 }  // namespace yocto::gui
 
 // -----------------------------------------------------------------------------
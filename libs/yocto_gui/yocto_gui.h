@@ -34,11 +34,15 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <yocto/yocto_common.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 
+#include <array>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 // forward declaration
@@ -59,6 +63,7 @@ using math::byte;
 using math::frame2f;
 using math::frame3f;
 using math::identity3x4f;
+using math::invalidb3f;
 using math::mat2f;
 using math::mat3f;
 using math::mat4f;
@@ -201,6 +206,27 @@ void set_elementbuffer(gui::elementbuffer* buffer,
 void set_elementbuffer(gui::elementbuffer* buffer,
     const std::vector<vec3i>& triangles, bool dynamic = false);
 
+// Opengl uniform buffer
+struct uniformbuffer {
+  // buffer data
+  size_t size = 0;
+  // OpenGL state
+  uint buffer_id = 0;
+};
+
+// set buffer
+void set_uniformbuffer(
+    gui::uniformbuffer* buffer, size_t size, const void* data);
+
+// check if buffer is initialized
+bool is_initialized(gui::uniformbuffer* buffer);
+
+// clear buffer
+void clear_uniformbuffer(gui::uniformbuffer* buffer);
+
+// bind buffer to a uniform block binding point
+void bind_uniformbuffer(gui::uniformbuffer* buffer, int binding);
+
 // Opengl program
 struct program {
   // program code
@@ -231,6 +257,9 @@ void unbind_program();
 // get uniform location
 int get_uniform_location(gui::program* program, const char* name);
 
+// assign a uniform block to a binding point
+void set_uniform_block(gui::program* program, const char* name, int binding);
+
 // set uniforms
 void set_uniform(gui::program* program, int location, int value);
 void set_uniform(gui::program* program, int location, const vec2i& value);
@@ -297,8 +326,16 @@ inline void set_attribute(gui::program* program, const char* name,
   set_attribute(program, get_attribute_location(program, name), buffer, def);
 }
 
+// set instance frame attributes, in four consecutive locations for the
+// frame axes and origin, advancing once per instance
+void set_instance_attribute(
+    gui::program* program, int location, gui::arraybuffer* buffer);
+void set_instance_attribute(
+    gui::program* program, int location, const frame3f& value);
+
 // draw elements
 void draw_elements(gui::elementbuffer* buffer);
+void draw_elements(gui::elementbuffer* buffer, int instances);
 
 }  // namespace yocto::gui
 
@@ -318,6 +355,9 @@ struct image {
   gui::texture*       texture   = new gui::texture{};
   gui::arraybuffer*   texcoords = new gui::arraybuffer{};
   gui::elementbuffer* triangles = new gui::elementbuffer{};
+
+  // pixel buffer used to stream image regions
+  uint pixelbuffer_id = 0;
 };
 
 // create image drawing program
@@ -327,27 +367,87 @@ bool is_initialized(const gui::image* image);
 // clear image
 void clear_image(gui::image* image);
 
-// update image data
+// update image data; float images are kept as float to tonemap them on the
+// GPU when drawing
 void set_image(gui::image* image, const img::image<vec4f>& img,
-    bool linear = false, bool mipmap = false);
+    bool linear = false, bool mipmap = false, bool as_float = false);
 void set_image(gui::image* image, const img::image<vec4b>& img,
     bool linear = false, bool mipmap = false);
+// update a region of the image data, given as (xmin, ymin, xmax, ymax); the
+// whole image is updated if its size changed
+void set_image_region(gui::image* image, const img::image<vec4f>& img,
+    const vec4i& region, bool linear = false, bool mipmap = false,
+    bool as_float = false);
+// update several regions at once, streaming them through a pixel buffer
+void set_image_regions(gui::image* image, const img::image<vec4f>& img,
+    const std::vector<vec4i>& regions, bool linear = false,
+    bool mipmap = false, bool as_float = false);
 
 // OpenGL image drawing params
 struct image_params {
-  vec2i window      = {512, 512};
-  vec4i framebuffer = {0, 0, 512, 512};
-  vec2f center      = {0, 0};
-  float scale       = 1;
-  bool  fit         = true;
-  bool  checker     = true;
-  float border_size = 2;
-  vec4f background  = {0.15f, 0.15f, 0.15f, 1.0f};
+  vec2i                  window      = {512, 512};
+  vec4i                  framebuffer = {0, 0, 512, 512};
+  vec2f                  center      = {0, 0};
+  float                  scale       = 1;
+  bool                   fit         = true;
+  bool                   checker     = true;
+  float                  border_size = 2;
+  vec4f                  background  = {0.15f, 0.15f, 0.15f, 1.0f};
+  bool                   tonemap     = false;  // tonemap when drawing
+  float                  exposure    = 0;
+  bool                   filmic      = false;
+  bool                   srgb        = true;
+  bool                   colorgrade  = false;  // colorgrade when drawing
+  img::colorgrade_params grading     = {};
 };
 
 // draw image
 void draw_image(gui::image* image, const image_params& params);
 
+// Tiled image, drawn from a pyramid of square tiles where each level halves
+// the previous one. Only visible tiles at the current zoom are requested
+// from the loader, and kept as textures in a least recently used cache.
+struct tiled_image {
+  tiled_image() {}
+  tiled_image(const tiled_image&) = delete;
+  tiled_image& operator=(const tiled_image&) = delete;
+  ~tiled_image();
+
+  // pyramid layout and tile loader
+  vec2i size      = {0, 0};
+  int   tile_size = 256;
+  int   levels    = 0;
+  std::function<void(int level, const vec2i& tile, img::image<vec4f>& pixels)>
+      loader = {};
+
+  // tile cache, limited in size and in tiles loaded per frame
+  int max_tiles = 512;
+  int max_loads = 8;
+  std::unordered_map<uint64_t, std::pair<gui::texture*, uint64_t>> tiles = {};
+  uint64_t                                                         frame = 0;
+
+  // drawing program
+  gui::image* image = new gui::image{};
+};
+
+// initialize a tiled image with its size and tile loader
+bool init_tiled_image(gui::tiled_image* image, const vec2i& size,
+    int tile_size,
+    const std::function<void(int level, const vec2i& tile,
+        img::image<vec4f>& pixels)>& loader);
+bool is_initialized(const gui::tiled_image* image);
+
+// clear tiled image and its cached tiles
+void clear_tiled_image(gui::tiled_image* image);
+
+// number of levels and size of a level in a tile pyramid
+int   get_tiled_levels(const vec2i& size, int tile_size);
+vec2i get_tiled_size(const vec2i& size, int level);
+
+// draw the visible tiles, loading the missing ones and falling back to coarser
+// levels while they are not available
+void draw_tiled_image(gui::tiled_image* image, const image_params& params);
+
 }  // namespace yocto::gui
 
 // -----------------------------------------------------------------------------
@@ -381,23 +481,44 @@ struct material {
   gui::texture* specular_tex  = nullptr;
   gui::texture* opacity_tex   = nullptr;
   gui::texture* normal_tex    = nullptr;
+
+  // OpenGL state: material block, re-uploaded only when its values change
+  gui::uniformbuffer*   buffer = new gui::uniformbuffer{};
+  std::array<float, 16> block  = {};
+
+  material() {}
+  material(const material&) = delete;
+  material& operator=(const material&) = delete;
+  ~material();
 };
 
 // Opengl shape
 struct shape {
+  // storage of the buffers, allocated with the shape
+  std::array<gui::arraybuffer, 5>   vertex_buffers  = {};
+  std::array<gui::elementbuffer, 5> element_buffers = {};
+
   // vertex buffers
-  gui::arraybuffer*   positions      = new gui::arraybuffer{};
-  gui::arraybuffer*   normals        = new gui::arraybuffer{};
-  gui::arraybuffer*   texcoords      = new gui::arraybuffer{};
-  gui::arraybuffer*   colors         = new gui::arraybuffer{};
-  gui::arraybuffer*   tangents       = new gui::arraybuffer{};
-  gui::elementbuffer* points         = new gui::elementbuffer{};
-  gui::elementbuffer* lines          = new gui::elementbuffer{};
-  gui::elementbuffer* triangles      = new gui::elementbuffer{};
-  gui::elementbuffer* quads          = new gui::elementbuffer{};
-  gui::elementbuffer* edges          = new gui::elementbuffer{};
+  gui::arraybuffer*   positions      = &vertex_buffers[0];
+  gui::arraybuffer*   normals        = &vertex_buffers[1];
+  gui::arraybuffer*   texcoords      = &vertex_buffers[2];
+  gui::arraybuffer*   colors         = &vertex_buffers[3];
+  gui::arraybuffer*   tangents       = &vertex_buffers[4];
+  gui::elementbuffer* points         = &element_buffers[0];
+  gui::elementbuffer* lines          = &element_buffers[1];
+  gui::elementbuffer* triangles      = &element_buffers[2];
+  gui::elementbuffer* quads          = &element_buffers[3];
+  gui::elementbuffer* edges          = &element_buffers[4];
   float               points_size    = 10;
   float               line_thickness = 4;
+  bbox3f              bounds         = invalidb3f;
+
+  // location in the scene packed buffers, with packed_vertex at -1 when the
+  // shape uses its own buffers; ranges are first index and count of points,
+  // lines, triangles, quads and edges
+  int                  packed_vertex  = -1;
+  std::array<vec2i, 5> packed_ranges  = {};
+  bool                 packed_normals = false;
 
   shape() {}
   shape(const shape&) = delete;
@@ -407,7 +528,21 @@ struct shape {
 
 // Opengl instance
 struct instance {
-  std::vector<frame3f> frames = {};
+  std::vector<frame3f> frames  = {};
+  gui::arraybuffer*    buffer  = new gui::arraybuffer{};
+  int                  version = 0;
+
+  instance() {}
+  instance(const instance&) = delete;
+  instance& operator=(const instance&) = delete;
+  ~instance();
+};
+
+// Culling hierarchy node, with two children or a range of instances
+struct cull_node {
+  bbox3f bbox  = invalidb3f;
+  int    start = 0;  // first child or instance
+  int    num   = 0;  // number of instances, zero for internal nodes
 };
 
 // Opengl object
@@ -419,6 +554,19 @@ struct object {
   gui::instance* instance    = nullptr;
   bool           hidden      = false;
   bool           highlighted = false;
+
+  // culling hierarchy over instance bounds, rebuilt when they change
+  std::vector<gui::cull_node> cull_bvh       = {};
+  std::vector<int>            cull_instances = {};
+  frame3f                     cull_frame     = identity3x4f;
+  bbox3f                      cull_bounds    = invalidb3f;
+  int                         cull_version   = -1;
+  gui::arraybuffer*           visible        = new gui::arraybuffer{};
+
+  object() {}
+  object(const object&) = delete;
+  object& operator=(const object&) = delete;
+  ~object();
 };
 
 // Light type
@@ -448,8 +596,41 @@ struct scene {
   std::vector<gui::texture*>  textures  = {};
   std::vector<gui::light*>    lights    = {};
 
+  // storage of the scene objects, freed at once with the scene
+  common::arena<gui::camera>   camera_arena   = {};
+  common::arena<gui::object>   object_arena   = {};
+  common::arena<gui::shape>    shape_arena    = {};
+  common::arena<gui::material> material_arena = {};
+  common::arena<gui::instance> instance_arena = {};
+  common::arena<gui::texture>  texture_arena  = {};
+  common::arena<gui::light>    light_arena    = {};
+
   // OpenGL state
-  gui::program* program = new gui::program{};
+  gui::program*       program        = new gui::program{};
+  gui::uniformbuffer* edges_material = new gui::uniformbuffer{};
+  std::vector<int>    uniforms       = {};
+
+  // vertices and elements of packed shapes, shared to avoid rebinding
+  gui::arraybuffer*   packed_positions = new gui::arraybuffer{};
+  gui::arraybuffer*   packed_normals   = new gui::arraybuffer{};
+  gui::arraybuffer*   packed_texcoords = new gui::arraybuffer{};
+  gui::arraybuffer*   packed_colors    = new gui::arraybuffer{};
+  gui::arraybuffer*   packed_tangents  = new gui::arraybuffer{};
+  gui::elementbuffer* packed_elements  = new gui::elementbuffer{};
+
+  // first hits drawn to an offscreen framebuffer
+  gui::program* hits_program     = new gui::program{};
+  uint          hits_framebuffer = 0;
+  uint          hits_color       = 0;
+  uint          hits_depth       = 0;
+  vec2i         hits_size        = {0, 0};
+
+  // streaming uploads, with progress in bytes
+  std::deque<std::function<bool(gui::scene*, size_t&)>> uploads = {};
+  size_t uploaded     = 0;
+  size_t upload_total = 0;
+  uint   staging_id   = 0;
+  size_t staging_size = 0;
 };
 
 // Shading type
@@ -471,6 +652,7 @@ struct scene_params {
   vec3f        ambient          = {0, 0, 0};
   bool         double_sided     = true;
   bool         non_rigid_frames = true;
+  bool         culling          = true;
   float        near             = 0.01f;
   float        far              = 10000.0f;
   vec4f        background       = vec4f{0.15f, 0.15f, 0.15f, 1.0f};
@@ -483,6 +665,11 @@ bool is_initialized(const gui::scene* scene);
 // Clear an OpenGL scene
 void clear_scene(gui::scene* scene);
 
+// Memory used by a scene, in bytes. This counts the OpenGL buffers, textures
+// and render targets of the scene, estimated from their sizes and formats,
+// and the instance frames and culling data kept on the host.
+size_t get_scene_memory(const gui::scene* scene);
+
 // add scene elements
 gui::camera*   add_camera(gui::scene* scene);
 gui::texture*  add_texture(gui::scene* scene);
@@ -545,10 +732,57 @@ void set_light(gui::light* light, const vec3f& position, const vec3f& emission,
 void clear_lights(gui::scene* scene);
 bool has_max_lights(gui::scene* scene);
 
+// Streaming uploads. Queued textures and shapes are copied to the GPU by
+// process_uploads() through a mapped staging buffer, up to a byte budget per
+// call, so that large scenes display progressively. Each texture and buffer
+// becomes visible only once complete. Queued data is referenced, not copied,
+// and must outlive the uploads.
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec4b>& img, bool as_srgb = true, bool linear = true,
+    bool mipmap = true);
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec4f>& img, bool as_float = false, bool linear = true,
+    bool mipmap = true);
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec3b>& img, bool as_srgb = true, bool linear = true,
+    bool mipmap = true);
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<vec3f>& img, bool as_float = false, bool linear = true,
+    bool mipmap = true);
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<byte>& img, bool as_srgb = true, bool linear = true,
+    bool mipmap = true);
+void queue_texture(gui::scene* scene, gui::texture* texture,
+    const img::image<float>& img, bool as_float = false, bool linear = true,
+    bool mipmap = true);
+void queue_shape(gui::scene* scene, gui::shape* shape,
+    const std::vector<int>& points, const std::vector<vec2i>& lines,
+    const std::vector<vec3i>& triangles, const std::vector<vec4i>& quads,
+    const std::vector<vec3f>& positions, const std::vector<vec3f>& normals,
+    const std::vector<vec2f>& texcoords, const std::vector<vec3f>& colors,
+    bool edges = true);
+
+// Upload queued data up to a byte budget, returning whether uploads remain
+bool process_uploads(gui::scene* scene, size_t budget);
+
+// Move the buffers of all uploaded shapes into the scene packed buffers,
+// so that they are drawn without rebinding vertex buffers. The copy is done
+// on the GPU. Setting positions unpacks a shape, so all its data has to be
+// set again after that.
+void pack_shapes(gui::scene* scene);
+
 // Draw an OpenGL scene
 void draw_scene(gui::scene* scene, gui::camera* camera, const vec4i& viewport,
     const scene_params& params);
 
+// Draw the first hits of the camera rays through pixel centers offscreen,
+// reading back the object, instance and element ids, with -1 where nothing
+// is hit and 1 in the last channel otherwise. Rows are from the top. Quads
+// are counted as elements, while points and lines are not drawn. Used to
+// seed ray tracing without tracing camera rays.
+void draw_scene_hits(gui::scene* scene, gui::camera* camera,
+    const vec2i& size, const scene_params& params, img::image<vec4i>& hits);
+
 }  // namespace yocto::gui
 
 // -----------------------------------------------------------------------------
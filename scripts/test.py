@@ -52,6 +52,35 @@ def run():
     os.system('rm tests/_output/*.png; rm  tests/_difference/*.png')
     os.system('cd build/release && ctest -j 4 --output-on-failure')
 
+@cli.command()
+@click.option('--scene', '-s', default='')
+@click.option('--out', '-o', default='bench.json')
+def bench(scene='',out='bench.json'):
+    os.system(f'./bin/ybench --scenes "{scene}" -o {out}')
+
+@cli.command()
+@click.option('--scene', '-s', default='*')
+@click.option('--format', '-f', default='pbrt')
+@click.option('--out', '-o', default='tests/_roundtrip')
+def roundtrip(scene='*',format='pbrt',out='tests/_roundtrip'):
+    def convert(filename, outname):
+        info = os.popen(f'./bin/ysceneproc {filename} -i -o {outname}').read()
+        for line in info.splitlines():
+            if line.startswith('textures:'): return int(line.split()[1])
+        return -1
+    failed = []
+    for filename in sorted(glob.glob(f'tests/{scene}/{scene}.json')):
+        name = os.path.basename(filename).replace('.json','')
+        outname = f'{out}/{name}/{name}.{format}'
+        print(f'converting {filename}')
+        expected = convert(filename, outname)
+        loaded = convert(outname, f'{out}/{name}/{name}-reload.json')
+        # textures without a format equivalent, like normal maps, are dropped
+        if expected < 0 or loaded < 0 or (expected > 0 and loaded == 0):
+            failed += [filename]
+    for filename in failed: print(f'failed {filename}')
+    if failed: raise SystemExit(1)
+
 @cli.command()
 def clean():
     os.system('rm tests/_output/*.png; rm tests/_difference/*.png')